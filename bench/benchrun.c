@@ -0,0 +1,182 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * benchrun - run command and report its elapsed time, CPU time, peak RSS and
+ * optionally number of system calls
+ *
+ * System calls are counted by tracing the command with ptrace(), which slows
+ * it down, so timing and counting should be done in separate runs.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static void usage(void)
+{
+	fprintf(stderr, "benchrun from " PACKAGE_NAME " " PACKAGE_VERSION "\n"
+		"Usage:\n"
+		"\tbenchrun [-s] [-b bytes] [-o file] command [arguments]\n"
+		"Options:\n"
+		"\t-s         Count system calls of command and its threads\n"
+		"\t-b bytes   Report throughput for processing given amount of bytes\n"
+		"\t-o file    Append report to file instead of printing it to stderr\n"
+	);
+	exit(1);
+}
+
+static double timeval_sec(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * @brief wait for traced command, counting system call stops of all its threads
+ * @return wait status of the command
+ */
+static int trace_syscalls(pid_t pid, unsigned long long *syscalls)
+{
+	unsigned long long stops = 0;
+	int status, sig;
+	pid_t tid;
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+		return status;
+
+	ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, 0, 0);
+
+	while ((tid = waitpid(-1, &status, __WALL)) > 0)
+	{
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+		{
+			if (tid == pid)
+				break;
+			continue;
+		}
+
+		sig = 0;
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+			stops++;
+		else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP)
+			sig = WSTOPSIG(status);
+
+		ptrace(PTRACE_SYSCALL, tid, 0, sig);
+	}
+
+	// Every system call stops twice, on entry and on exit
+	*syscalls = stops / 2;
+	return status;
+}
+
+int main(int argc, char *argv[])
+{
+	struct timespec start, end;
+	struct rusage usage_info;
+	unsigned long long syscalls = 0;
+	unsigned long long bytes = 0;
+	int count_syscalls = 0;
+	FILE *report = stderr;
+	double elapsed;
+	int status;
+	int opt;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "+sb:o:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				count_syscalls = 1;
+				break;
+			case 'b':
+				bytes = strtoull(optarg, NULL, 0);
+				break;
+			case 'o':
+				report = fopen(optarg, "a");
+				if (!report)
+				{
+					fprintf(stderr, "benchrun: Error: Cannot open report file '%s': %s\n", optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (optind >= argc)
+		usage();
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid = fork();
+	if (pid < 0)
+	{
+		fprintf(stderr, "benchrun: Error: fork failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (pid == 0)
+	{
+		if (count_syscalls)
+		{
+			ptrace(PTRACE_TRACEME, 0, 0, 0);
+			raise(SIGSTOP);
+		}
+		execvp(argv[optind], argv + optind);
+		fprintf(stderr, "benchrun: Error: Cannot execute '%s': %s\n", argv[optind], strerror(errno));
+		_exit(127);
+	}
+
+	if (count_syscalls)
+		status = trace_syscalls(pid, &syscalls);
+	else if (waitpid(pid, &status, 0) < 0)
+	{
+		fprintf(stderr, "benchrun: Error: waitpid failed: %s\n", strerror(errno));
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_CHILDREN, &usage_info);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	fprintf(report, "elapsed=%.3f user=%.3f sys=%.3f maxrss=%ld", elapsed, timeval_sec(&usage_info.ru_utime), timeval_sec(&usage_info.ru_stime), usage_info.ru_maxrss);
+	if (bytes)
+		fprintf(report, " throughput=%.1f", elapsed > 0 ? bytes / elapsed / (1024*1024) : 0.0);
+	if (count_syscalls)
+		fprintf(report, " syscalls=%llu", syscalls);
+	fprintf(report, " status=%d\n", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+
+	if (report != stderr)
+		fclose(report);
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
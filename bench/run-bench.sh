@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Generate synthetic UDF images and time udftools on them
+#
+# Usage: run-bench.sh [top_builddir]
+#
+# Environment:
+#   BENCH_DIR      directory for images and logs (default: temporary directory)
+#   BENCH_BLOCKS   number of blocks of generated images (default: 2097152)
+#   BENCH_FILES    files in every directory (default: 10)
+#   BENCH_DIRS     subdirectories in every directory (default: 4)
+#   BENCH_DEPTH    depth of directory tree (default: 4), layouts with VAT
+#                  use at most depth 2 as whole VAT has to fit into one block
+#   BENCH_SYSCALLS set to 0 to skip counting system calls
+#
+# For every layout and tool one line is printed with elapsed time, throughput
+# over the whole image, peak RSS and number of system calls.
+
+set -e
+
+top=${1:-..}
+blocks=${BENCH_BLOCKS:-2097152}
+files=${BENCH_FILES:-10}
+dirs=${BENCH_DIRS:-4}
+depth=${BENCH_DEPTH:-4}
+syscalls=${BENCH_SYSCALLS:-1}
+
+if [ -n "$BENCH_DIR" ]; then
+	dir=$BENCH_DIR
+	mkdir -p "$dir"
+else
+	dir=$(mktemp -d "${TMPDIR:-/tmp}/udfbench.XXXXXX")
+	trap 'rm -rf "$dir"' EXIT
+fi
+
+udfgen=$top/bench/udfgen
+benchrun=$top/bench/benchrun
+mkudffs=$top/mkudffs/mkudffs
+udfinfo=$top/udfinfo/udfinfo
+udffsck=$top/udffsck/udffsck
+udflabel=$top/udflabel/udflabel
+
+# Run one tool, print its report line
+# usage: run name layout bytes command...
+run() {
+	name=$1 layout=$2 bytes=$3
+	shift 3
+	rm -f "$dir/report"
+	"$benchrun" -b "$bytes" -o "$dir/report" "$@" > "$dir/$name.log" 2>&1 || true
+	line=$(cat "$dir/report")
+	if [ "$syscalls" != 0 ]; then
+		rm -f "$dir/report"
+		"$benchrun" -s -o "$dir/report" "$@" > /dev/null 2>&1 || true
+		line="$line $(sed -n 's/.*\(syscalls=[0-9]*\).*/\1/p' "$dir/report")"
+	fi
+	printf '%-10s %-22s %s\n' "$name" "$layout" "$line"
+}
+
+while read -r layout maxdepth opts; do
+	img=$dir/image.img
+	rm -f "$img"
+	tree=$depth
+	if [ "$maxdepth" != - ] && [ "$tree" -gt "$maxdepth" ]; then
+		tree=$maxdepth
+	fi
+	if ! "$udfgen" --files="$files" --dirs="$dirs" --depth="$tree" -- $opts "$img" "$blocks" > "$dir/udfgen.log" 2>&1; then
+		printf '%-10s %-22s %s\n' udfgen "$layout" "failed, see $dir/udfgen.log"
+		continue
+	fi
+	bytes=$(wc -c < "$img")
+
+	run udfinfo "$layout" "$bytes" "$udfinfo" "$img"
+	if [ -x "$udffsck" ]; then
+		run udffsck "$layout" "$bytes" "$udffsck" "$img"
+	fi
+	run udflabel "$layout" "$bytes" "$udflabel" "$img" Benchmark
+
+	# Format last, it overwrites the generated tree
+	run mkudffs "$layout" "$bytes" "$mkudffs" $opts --bootarea=erase "$img"
+done <<LAYOUTS
+hd-2.01 - --media-type=hd --udfrev=2.01 --blocksize=2048
+hd-1.50-4096 - --media-type=hd --udfrev=1.50 --blocksize=4096
+dvdrw-sparable-2.01 - --media-type=dvdrw --udfrev=2.01
+cdr-vat-2.01 2 --media-type=cdr --udfrev=2.01
+bdr-vat-2.50 2 --media-type=bdr --udfrev=2.50
+LAYOUTS
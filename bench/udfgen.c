@@ -0,0 +1,353 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * udfgen - synthetic UDF image generator for benchmarks
+ *
+ * Formats image file in the same way as mkudffs and populates root directory
+ * with tree of directories and files. Layout of the image (UDF revision,
+ * media type, VAT, Sparing Table, ...) is specified by mkudffs options
+ * after the udfgen options and "--".
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "mkudffs.h"
+#include "defaults.h"
+#include "options.h"
+#include "file.h"
+#include "template.h"
+
+#define MAX_DEPTH	32
+
+static struct option gen_options[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "files", required_argument, NULL, 'f' },
+	{ "dirs", required_argument, NULL, 'd' },
+	{ "depth", required_argument, NULL, 'D' },
+	{ "file-size", required_argument, NULL, 's' },
+	{ 0, 0, NULL, 0 },
+};
+
+static void gen_usage(void)
+{
+	fprintf(stderr, "udfgen from " PACKAGE_NAME " " PACKAGE_VERSION "\n"
+		"Usage:\n"
+		"\tudfgen [options] -- [mkudffs options] image blocks-count\n"
+		"Options:\n"
+		"\t--help, -h         Display this help\n"
+		"\t--files=, -f       Number of files in every directory (default: 10)\n"
+		"\t--dirs=, -d        Number of subdirectories in every directory (default: 4)\n"
+		"\t--depth=, -D       Depth of directory tree (default: 2)\n"
+		"\t--file-size=, -s   Size of file data stored in ICB in bytes (default: 0)\n"
+	);
+	exit(1);
+}
+
+static int write_func(struct udf_disc *disc, struct udf_extent *ext)
+{
+	static char *buffer = NULL;
+	static size_t bufferlen = 0;
+	int fd = *(int *)disc->write_data;
+	struct udf_desc *desc;
+	struct udf_data *data;
+	size_t length, padded;
+
+	// Image file is created empty, so unwritten extents already read as zeros
+	if (ext->space_type & (USPACE|RESERVED))
+		return 0;
+
+	for (desc = ext->head; desc != NULL; desc = desc->next)
+	{
+		length = 0;
+		for (data = desc->data; data != NULL; data = data->next)
+			length += data->length;
+		padded = (length + disc->blocksize - 1) & ~(size_t)(disc->blocksize - 1);
+
+		if (padded > bufferlen)
+		{
+			buffer = realloc(buffer, padded);
+			if (!buffer)
+				return -1;
+			bufferlen = padded;
+		}
+
+		length = 0;
+		for (data = desc->data; data != NULL; data = data->next)
+		{
+			memcpy(buffer + length, data->buffer, data->length);
+			length += data->length;
+		}
+		memset(buffer + length, 0, padded - length);
+
+		if (pwrite(fd, buffer, padded, (off_t)(ext->start + desc->offset) * disc->blocksize) != (ssize_t)padded)
+			return -1;
+		udf_progress_add(UDF_PROGRESS_WRITTEN, padded);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief populate directory tree below root, depth first
+ */
+static void populate(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *root, uint32_t offset, uint32_t files, uint32_t dirs, uint32_t depth, uint32_t file_size, uint32_t *num_files, uint32_t *num_dirs)
+{
+	struct udf_desc *stack[MAX_DEPTH+1];
+	uint32_t next[MAX_DEPTH+1];
+	struct udf_desc *desc;
+	struct udf_data *data;
+	char name[64];
+	uint32_t i, vat_max;
+	int len;
+	int sp = 0;
+
+	// VAT is stored in ICB too, one entry for every allocated block and the VAT itself
+	vat_max = (disc->blocksize - ((disc->flags & FLAG_EFE) ? sizeof(struct extendedFileEntry) : sizeof(struct fileEntry)) - sizeof(struct virtualAllocationTable20)) / sizeof(uint32_t);
+
+	stack[0] = root;
+	next[0] = 0;
+
+	while (sp >= 0)
+	{
+		if (next[sp] >= files + ((uint32_t)sp < depth ? dirs : 0))
+		{
+			sp--;
+			continue;
+		}
+
+		if ((disc->flags & FLAG_VAT) && disc->vat_entries + 2 > vat_max)
+		{
+			fprintf(stderr, "%s: Error: Virtual Allocation Table does not fit into block size %"PRIu32", use fewer --files, --dirs or --depth\n", appname, disc->blocksize);
+			exit(1);
+		}
+
+		i = next[sp]++;
+		name[0] = 8;
+		if (i < files)
+		{
+			len = snprintf(name + 1, sizeof(name) - 1, "file%d_%"PRIu32, sp, i);
+			desc = udf_create(disc, pspace, (const dchars *)name, len + 1, offset, stack[sp], 0, ICBTAG_FILE_TYPE_REGULAR, 0);
+			if (file_size)
+			{
+				data = alloc_data(disc, NULL, file_size);
+				memset(data->buffer, 'a' + i % 26, file_size);
+				insert_data(disc, pspace, desc, data);
+			}
+			(*num_files)++;
+			udf_progress_add(UDF_PROGRESS_FILES, 1);
+		}
+		else
+		{
+			len = snprintf(name + 1, sizeof(name) - 1, "dir%d_%"PRIu32, sp, i - files);
+			desc = udf_mkdir(disc, pspace, (const dchars *)name, len + 1, offset, stack[sp]);
+			(*num_dirs)++;
+			udf_progress_add(UDF_PROGRESS_FILES, 1);
+		}
+
+		// mkudffs stores directories in ICB only, so all entries must fit into one block
+		if (stack[sp]->length > disc->blocksize)
+		{
+			fprintf(stderr, "%s: Error: Directory entries do not fit into block size %"PRIu32", use larger --blocksize or fewer --files and --dirs\n", appname, disc->blocksize);
+			exit(1);
+		}
+
+		if (i >= files)
+		{
+			sp++;
+			stack[sp] = desc;
+			next[sp] = 0;
+		}
+		offset = desc->offset + 1;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct udf_disc disc;
+	struct udf_extent *pspace;
+	struct udf_desc *root;
+	char *filename;
+	char *populate_dir = NULL;
+	char *progress = NULL;
+	struct template_args tmpl;
+	unsigned int jobs = 1;
+	uint32_t files = 10, dirs = 4, depth = 2, file_size = 0;
+	uint32_t num_files = 0, num_dirs = 0, max_size;
+	int create_new_file = 0;
+	int blocksize = -1;
+	off_t size;
+	int media;
+	int failed;
+	int retval;
+	int fd;
+
+	appname = "udfgen";
+
+	while ((retval = getopt_long(argc, argv, "+hf:d:D:s:", gen_options, NULL)) != EOF)
+	{
+		switch (retval)
+		{
+			case 'f':
+				files = strtou32(optarg, 0, &failed);
+				if (failed)
+					gen_usage();
+				break;
+			case 'd':
+				dirs = strtou32(optarg, 0, &failed);
+				if (failed)
+					gen_usage();
+				break;
+			case 'D':
+				depth = strtou32(optarg, 0, &failed);
+				if (failed || depth > MAX_DEPTH)
+					gen_usage();
+				break;
+			case 's':
+				file_size = strtou32(optarg, 0, &failed);
+				if (failed)
+					gen_usage();
+				break;
+			default:
+				gen_usage();
+		}
+	}
+
+	// Remaining arguments are parsed by mkudffs option parser
+	argv[optind-1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+	optind = 0;
+
+	udf_init_disc(&disc);
+	memset(&tmpl, 0, sizeof(tmpl));
+	parse_args(argc, argv, &disc, &filename, &create_new_file, &blocksize, &media, &populate_dir, &jobs, &progress, &tmpl);
+
+	if (tmpl.save || tmpl.stamp)
+	{
+		fprintf(stderr, "%s: Error: Templates are not supported by udfgen\n", appname);
+		exit(1);
+	}
+
+	if (progress && udf_progress_start(appname, progress) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot report progress to '%s': %s\n", appname, progress, strerror(errno));
+		exit(1);
+	}
+
+	if (!disc.blocks)
+	{
+		fprintf(stderr, "%s: Error: block-count was not specified\n", appname);
+		exit(1);
+	}
+
+	if (blocksize == -1 && media == MEDIA_TYPE_HD)
+	{
+		disc.blocksize = 512;
+		disc.udf_lvd[0]->logicalBlockSize = cpu_to_le32(disc.blocksize);
+	}
+
+	max_size = disc.blocksize - ((disc.flags & FLAG_EFE) ? sizeof(struct extendedFileEntry) : sizeof(struct fileEntry));
+	if (file_size > max_size)
+	{
+		fprintf(stderr, "%s: Error: File size is limited to %"PRIu32" bytes for block size %"PRIu32"\n", appname, max_size, disc.blocksize);
+		exit(1);
+	}
+
+	disc.head->blocks = disc.blocks;
+	disc.write = write_func;
+	disc.write_data = &fd;
+	fd = -1;
+
+	if (!(disc.flags & FLAG_BOOTAREA_MASK))
+		disc.flags |= FLAG_BOOTAREA_PRESERVE;
+
+	split_space(&disc);
+
+	setup_mbr(&disc);
+	setup_vrs(&disc);
+	setup_anchor(&disc);
+
+	// The same as setup_partition(), but with files created before VAT
+	pspace = next_extent(disc.head, PSPACE);
+	if (!pspace)
+	{
+		fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
+		exit(1);
+	}
+	setup_space(&disc, pspace, 0);
+	setup_fileset(&disc, pspace);
+	setup_root(&disc, pspace);
+
+	root = find_desc(pspace, le32_to_cpu(disc.udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum));
+	populate(&disc, pspace, root, root->offset + 1, files, dirs, depth, file_size, &num_files, &num_dirs);
+
+	if (disc.flags & FLAG_VAT)
+		setup_vat(&disc, pspace);
+
+	setup_vds(&disc);
+
+	if (!(disc.flags & FLAG_NO_WRITE))
+	{
+		fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | (create_new_file ? O_EXCL : 0), 0660);
+		if (fd < 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot create image file '%s': %s\n", appname, filename, strerror(errno));
+			exit(1);
+		}
+
+		// Sequentially written media ends with VAT, like images recorded by mkudffs
+		if (disc.vat_block)
+			size = (off_t)(disc.vat_block + 1) * disc.blocksize;
+		else
+			size = (off_t)disc.blocks * disc.blocksize;
+
+		if (ftruncate(fd, size) != 0 || write_disc(&disc) < 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot write to image file '%s': %s\n", appname, filename, strerror(errno));
+			exit(1);
+		}
+
+		if (close(fd) != 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot write to image file '%s': %s\n", appname, filename, strerror(errno));
+			exit(1);
+		}
+	}
+
+	printf("filename=%s\n", filename);
+	printf("blocksize=%"PRIu32"\n", disc.blocksize);
+	printf("blocks=%"PRIu32"\n", disc.blocks);
+	printf("udfrev=%"PRIx16".%02"PRIx16"\n", disc.udf_rev >> 8, disc.udf_rev & 0xFF);
+	printf("files=%"PRIu32"\n", num_files);
+	printf("dirs=%"PRIu32"\n", num_dirs);
+	if (disc.vat_block)
+		printf("vatblock=%"PRIu32"\n", disc.vat_block);
+
+	return 0;
+}
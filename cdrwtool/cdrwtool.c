@@ -22,6 +22,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,8 +31,10 @@
 #include <getopt.h>
 #include <signal.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <asm/param.h>
 
 #include <linux/cdrom.h>
@@ -323,16 +326,157 @@ int write_blocks(int fd, unsigned char *buffer, int lba, int blocks)
 	return wait_cmd(fd, &cgc, buffer, CGC_DATA_WRITE, WAIT_SYNC);
 }
 
-int write_file(int fd, struct cdrw_disc *disc)
+/*
+ * write_file() keeps a ring of packet buffers. A reader thread fills them
+ * from the source file ahead of the drive, so WRITE(10) commands are issued
+ * back to back and the drive buffer does not drain while the source is read.
+ * The ring holds twice the drive buffer. When it runs empty, the writer waits
+ * until it holds as many packets as the drive buffer has free room for, and
+ * then sends them in one burst.
+ */
+#define WRITE_RING_MIN	4
+#define WRITE_RING_MAX	64
+
+struct write_ring
+{
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned char	*buf;		/* count packets of size bytes */
+	int		*blocks;	/* blocks to write from each packet */
+	int		count;
+	int		size;
+	int		head;		/* next packet written to the drive */
+	int		filled;		/* packets read and not written yet */
+	int		eof;		/* no more packets will be read */
+	int		error;		/* read from file failed */
+	int		stop;		/* writer is done, reader must exit */
+	int		file;
+	struct cdrw_disc *disc;
+};
+
+static int read_packet(int file, unsigned char *buf, int size)
+{
+	int done = 0, ret;
+
+	while (done < size) {
+		ret = read(file, buf + done, size - done);
+		if (ret == -1)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static void *write_reader(void *arg)
 {
-	int file, lba, size, blocks;
-	unsigned char *buf = NULL;
-	int ret = 0, go_on = 1;
+	struct write_ring *ring = arg;
+	int tail = 0, ret, blocks;
+
+	for (;;) {
+		unsigned char *buf = ring->buf + (size_t)tail * ring->size;
 
-	if ((file = open(disc->filename, O_RDONLY)) < 0) {
+		pthread_mutex_lock(&ring->lock);
+		while (ring->filled == ring->count && !ring->stop)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		if (ring->stop) {
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ring->lock);
+
+		ret = read_packet(ring->file, buf, ring->size);
+		blocks = ring->size / CDROM_BLOCK;
+		if (ret > 0 && ret < ring->size) {
+			/* not enough data to complete the packet. fill
+			 * the rest of the data block with zeros. we must
+			 * write out complete packets every time with
+			 * fixed packets. for variable packets we just
+			 * write what we have left.
+			 */
+			if (ring->disc->fpacket)
+				memset(&buf[ret], 0, ring->size - ret);
+			else
+				blocks = (ret + CDROM_BLOCK - 1) / CDROM_BLOCK;
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		if (ret == -1) {
+			perror("read from file");
+			ring->error = 1;
+		}
+		if (ret > 0) {
+			ring->blocks[tail] = blocks;
+			ring->filled++;
+		}
+		/* regardless of type, a short packet is the last write */
+		if (ret < ring->size)
+			ring->eof = 1;
+		pthread_cond_broadcast(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+
+		if (ret < ring->size)
+			break;
+		tail = (tail + 1) % ring->count;
+	}
+	return NULL;
+}
+
+static int read_buffer_free(int fd, unsigned int *size, unsigned int *free_size)
+{
+	struct cdrom_generic_command cgc;
+	struct {
+		unsigned int pad;
+		unsigned int buffer_size;
+		unsigned int buffer_free;
+	} __attribute((packed)) buf;
+	int ret;
+
+	memset(&cgc, 0, sizeof(cgc));
+	memset(&buf, 0, sizeof(buf));
+	cgc.cmd[0] = 0x5c;
+	cgc.cmd[8] = cgc.buflen = 12;
+
+	if ((ret = wait_cmd(fd, &cgc, (unsigned char *)&buf, CGC_DATA_READ, WAIT_PC)))
+		return ret;
+
+	*size = be32_to_cpu(buf.buffer_size);
+	*free_size = be32_to_cpu(buf.buffer_free);
+	return 0;
+}
+
+/* number of packets to collect before writing resumes */
+static int write_burst(int fd, struct write_ring *ring)
+{
+	unsigned int size, free_size;
+	int burst;
+
+	if (read_buffer_free(fd, &size, &free_size))
+		return 1;
+	burst = free_size / ring->size;
+	if (burst < 1)
+		burst = 1;
+	if (burst > ring->count)
+		burst = ring->count;
+	return burst;
+}
+
+int write_file(int fd, struct cdrw_disc *disc)
+{
+	struct write_ring ring;
+	struct stat st;
+	pthread_t reader;
+	int lba, size, blocks, burst;
+	int ret = 0;
+
+	memset(&ring, 0, sizeof(ring));
+	if ((ring.file = open(disc->filename, O_RDONLY)) < 0) {
 		fprintf(stderr, "can't open %s\n", disc->filename);
 		return 1;
 	}
+	if (fstat(ring.file, &st) == 0 && S_ISREG(st.st_mode))
+		udf_progress_total(UDF_PROGRESS_WRITTEN, st.st_size);
 
 	/* for fixed packets, the write size is set. variable packets,
 	 * we write a little less than the buffer capacity. the drive
@@ -342,38 +486,52 @@ int write_file(int fd, struct cdrw_disc *disc)
 	size = disc->fpacket ? disc->packet_size * CDROM_BLOCK : 63 * CDROM_BLOCK;
 	lba = disc->offset;
 
-	buf = (unsigned char *) malloc(size+1);
-	if (buf == NULL) {
+	ring.size = size;
+	ring.disc = disc;
+	ring.count = 2 * (disc->buffer / size);
+	if (ring.count < WRITE_RING_MIN)
+		ring.count = WRITE_RING_MIN;
+	if (ring.count > WRITE_RING_MAX)
+		ring.count = WRITE_RING_MAX;
+
+	ring.buf = (unsigned char *) malloc((size_t)ring.count * size);
+	ring.blocks = (int *) malloc(ring.count * sizeof(int));
+	if (ring.buf == NULL || ring.blocks == NULL) {
 		perror("malloc");
-		close(file);
+		free(ring.buf);
+		free(ring.blocks);
+		close(ring.file);
 		return 1;
 	}
 
-	while (!ret && go_on) {
-		blocks = disc->fpacket ? disc->packet_size : size / CDROM_BLOCK;
-		ret = read(file, buf, size);
-		if (ret == -1) {
-			perror("read from file");
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+	if ((errno = pthread_create(&reader, NULL, write_reader, &ring))) {
+		perror("pthread_create");
+		pthread_cond_destroy(&ring.cond);
+		pthread_mutex_destroy(&ring.lock);
+		free(ring.buf);
+		free(ring.blocks);
+		close(ring.file);
+		return 1;
+	}
+
+	burst = write_burst(fd, &ring);
+	for (;;) {
+		pthread_mutex_lock(&ring.lock);
+		while (ring.filled < burst && !ring.eof)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		if (ring.filled == 0) {
+			pthread_mutex_unlock(&ring.lock);
 			break;
-		} else if (ret < size) {
-			/* not enough data to complete the packet. fill
-			 * the rest of the data block with zeros. we must
-			 * write out complete packets every time with
-			 * fixed packets. for variable packets we just
-			 * write what we have left.
-			 */
-			if (disc->fpacket) {
-				memset(&buf[ret], 0, size - ret - 1);
-			} else {
-				blocks = (ret + CDROM_BLOCK - 1) / CDROM_BLOCK;
-			}
-			/* regardless of type, this is the last write */
-			go_on = 0;
 		}
+		blocks = ring.blocks[ring.head];
+		pthread_mutex_unlock(&ring.lock);
 
 		fprintf(stdout, "writing at lba = %d, blocks = %d\n", lba, blocks);
-		if ((ret = write_blocks(fd, buf, lba, blocks)))
+		if ((ret = write_blocks(fd, ring.buf + (size_t)ring.head * size, lba, blocks)))
 			break;
+		udf_progress_add(UDF_PROGRESS_WRITTEN, (uint64_t)blocks * CDROM_BLOCK);
 
 		/* sync to indicate that one packet has been sent */
 //		sync_cache(fd);
@@ -384,11 +542,34 @@ int write_file(int fd, struct cdrw_disc *disc)
 		 */
 		lba += blocks;
 //		lba += disc->fpacket ? 0 : 7;
+
+		pthread_mutex_lock(&ring.lock);
+		ring.head = (ring.head + 1) % ring.count;
+		ring.filled--;
+		pthread_cond_broadcast(&ring.cond);
+		burst = (ring.filled == 0 && !ring.eof) ? -1 : 1;
+		pthread_mutex_unlock(&ring.lock);
+
+		/* source fell behind, refill as much as the drive can take */
+		if (burst < 0)
+			burst = write_burst(fd, &ring);
 	}
+
+	pthread_mutex_lock(&ring.lock);
+	ring.stop = 1;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+	pthread_join(reader, NULL);
+
+	if (!ret && ring.error)
+		ret = -1;
 	sync_cache(fd);
 
-	close(file);
-	free(buf);
+	pthread_cond_destroy(&ring.cond);
+	pthread_mutex_destroy(&ring.lock);
+	close(ring.file);
+	free(ring.buf);
+	free(ring.blocks);
 	return ret;
 }
 
@@ -572,24 +753,12 @@ int close_session(int fd, unsigned int track)
 
 int read_buffer_cap(int fd, struct cdrw_disc *disc)
 {
-	struct cdrom_generic_command cgc;
-	struct {
-		unsigned int pad;
-		unsigned int buffer_size;
-		unsigned int buffer_free;
-	} __attribute((packed)) buf;
+	unsigned int free_size;
 	int ret;
 
-	memset(&cgc, 0, sizeof(cgc));
-	memset(&buf, 0, sizeof(buf));
-	cgc.cmd[0] = 0x5c;
-	cgc.cmd[8] = cgc.buflen = 12;
-
-	if ((ret = wait_cmd(fd, &cgc, (unsigned char *)&buf, CGC_DATA_READ, WAIT_PC)))
+	if ((ret = read_buffer_free(fd, &disc->buffer, &free_size)))
 		return ret;
 
-	disc->buffer = be32_to_cpu(buf.buffer_size);
-
 	printf("%uKB internal buffer\n", disc->buffer >> 10);
 	return 0;
 }
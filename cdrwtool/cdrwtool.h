@@ -70,6 +70,7 @@ typedef struct
 struct cdrw_disc
 {
 	const char *	filename;		/* file to write */
+	const char *	progress;		/* progress target of file write */
 	unsigned long	offset;			/* write file / format */
 	unsigned char	get_settings;		/* just print settings */
 	unsigned char	set_settings;		/* save settings */
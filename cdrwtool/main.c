@@ -354,7 +354,14 @@ int main(int argc, char *argv[])
 
 	if (disc.filename)
 	{
+		if (disc.progress && udf_progress_start(appname, disc.progress))
+		{
+			fprintf(stderr, "%s: Error: Cannot report progress to '%s': %s\n", appname, disc.progress, strerror(errno));
+			cdrom_close(fd);
+			return 1;
+		}
 		ret = write_file(fd, &disc);
+		udf_progress_stop();
 		cdrom_close(fd);
 		return ret;
 	}
@@ -52,6 +52,7 @@ struct option long_options[] = {
 	{ "file to write", 1, NULL, 'f' },
 	{ "start at this lba for file write", 1, NULL,'o' },
 	{ "print detailed disc info", no_argument, NULL, 'i' },
+	{ "report file write progress", optional_argument, NULL, 'P' },
 	{ 0, 0, NULL, 0 },
 };
 
@@ -72,7 +73,7 @@ void parse_args(int argc, char *argv[], struct cdrw_disc *disc, const char **dev
 {
 	int retval;
 
-	while ((retval = getopt_long(argc, argv, "r:t:im:u:v:d:sgq::c:C:b:p:z:l:w:f:o:h", long_options, NULL)) != EOF)
+	while ((retval = getopt_long(argc, argv, "r:t:im:u:v:d:sgq::c:C:b:p:z:l:w:f:o:P::h", long_options, NULL)) != EOF)
 	{
 		switch (retval)
 		{
@@ -224,6 +225,11 @@ void parse_args(int argc, char *argv[], struct cdrw_disc *disc, const char **dev
 				printf("write offset %lu\n", disc->offset);
 				break;
 			}
+			case 'P':
+			{
+				disc->progress = optarg ? optarg : "-";
+				break;
+			}
 		}
 	}
 
@@ -48,6 +48,26 @@
 		  (((uint64_t)(x) & 0x00FF000000000000ULL) >> 40) | \
 		  (((uint64_t)(x) & 0xFF00000000000000ULL) >> 56)))
 
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+
+/* Compiled to single byte swapping instruction or byte reversed load/store */
+static inline uint16_t swab16(uint16_t x)
+{
+	return __builtin_bswap16(x);
+}
+
+static inline uint32_t swab32(uint32_t x)
+{
+	return __builtin_bswap32(x);
+}
+
+static inline uint64_t swab64(uint64_t x)
+{
+	return __builtin_bswap64(x);
+}
+
+#else
+
 static inline uint16_t swab16(uint16_t x)
 {
 	return ((uint16_t)((((uint16_t)(x) & 0x00FFU) << 8) | \
@@ -74,6 +94,8 @@ static inline uint64_t swab64(uint64_t x)
 			   (((uint64_t)(x) & 0xFF00000000000000ULL) >> 56)));
 }
 
+#endif
+
 #define constant_swab16p(x) \
 	((uint16_t)(((*(uint16_t *)(x) & 0x00FFU) << 8) | \
 		  ((*(uint16_t *)(x) & 0xFF00U) >> 8)))
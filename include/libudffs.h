@@ -30,6 +30,7 @@
 #define __LIBUDFFS_H
 
 #include <stddef.h>
+#include <sys/types.h>
 
 #include "ecma_167.h"
 #include "osta_udf.h"
@@ -59,14 +60,23 @@
 #define FLAG_EFE			0x00002000
 
 #define FLAG_NO_WRITE			0x00004000
+#define FLAG_DIRECT_IO			0x00008000
 
 #define FLAG_BOOTAREA_PRESERVE		0x00010000
 #define FLAG_BOOTAREA_ERASE		0x00020000
 #define FLAG_BOOTAREA_MBR		0x00040000
 #define FLAG_BOOTAREA_MASK		(FLAG_BOOTAREA_PRESERVE|FLAG_BOOTAREA_ERASE|FLAG_BOOTAREA_MBR)
 
+#define FLAG_DISCARD			0x00100000
+#define FLAG_SECURE_DISCARD		0x00200000
+
+#define FLAG_METADATA			0x00400000
+#define FLAG_METADATA_MIRROR		0x00800000
+
 struct udf_extent;
 struct udf_desc;
+struct udf_index_node;
+struct udf_space_summary;
 struct udf_data;
 
 enum udf_space_type
@@ -104,6 +114,142 @@ enum udf_alloc_type
 	UDF_ALLOC_TYPE_SIZE,
 };
 
+#define UDF_SPARING_FILTER_BITS		4096
+
+/*
+ * Remapped packets of sparable partition, see sparing.c
+ */
+struct udf_sparing_map
+{
+	uint32_t			packet_len;
+	uint32_t			count;
+	uint32_t			size;
+	uint32_t			*orig;
+	uint32_t			*mapped;
+	uint32_t			filter[UDF_SPARING_FILTER_BITS / 32];
+};
+
+#define UDF_PARTITION_UNMAPPED		0	/* blocks cannot be read */
+#define UDF_PARTITION_PHYSICAL		1	/* Type 1 Partition Map */
+#define UDF_PARTITION_VIRTUAL		2	/* through Virtual Allocation Table */
+#define UDF_PARTITION_SPARABLE		3	/* through sparing map */
+#define UDF_PARTITION_METADATA		4	/* through Metadata File extents */
+
+/*
+ * Recorded extent of Metadata File, blocks of Metadata Partition map
+ * to blocks of underlying partition
+ */
+struct udf_meta_extent
+{
+	uint32_t			block;		/* first block in Metadata Partition */
+	uint32_t			position;	/* first block in underlying partition */
+	uint32_t			length;		/* in blocks */
+};
+
+/*
+ * Translation of partition reference number to medium, see readdisc.c
+ */
+struct udf_partition
+{
+	uint8_t				type;
+	uint32_t			start;
+	struct partitionDesc		*pd;
+	uint16_t			underlying;	/* partition reference of Metadata Partition */
+	uint32_t			num_extents;
+	struct udf_meta_extent		*extents;	/* sorted by block */
+	uint32_t			num_mirror_extents;
+	struct udf_meta_extent		*mirror_extents;	/* Metadata Mirror File, NULL unless both files were read */
+};
+
+#define UDF_READ_VDS			0x01	/* Main and Reserve Volume Descriptor Sequences */
+#define UDF_READ_LVIS			0x02	/* Logical Volume Integrity Sequence */
+#define UDF_READ_PARTITIONS		0x04	/* Sparing Tables, VAT and Partition Maps */
+#define UDF_READ_FSD			0x08	/* File Set Descriptor */
+#define UDF_READ_SPACE			0x10	/* used and free space blocks */
+#define UDF_READ_ALL			0x1F
+
+#define UDF_MEDIUM_IO_PREAD		0	/* blocking pread() */
+#define UDF_MEDIUM_IO_URING		1	/* io_uring, falls back to pread() when not available */
+
+#define UDF_MEDIUM_QUEUE_DEPTH		32
+#define UDF_MEDIUM_SEGMENT		131072
+
+struct udf_uring;
+struct udf_medium_window;
+struct iovec;
+
+#define UDF_ARENA_BLOCK			65536
+#define UDF_ARENA_ALIGN			16
+
+struct udf_arena_block;
+
+#define UDF_PROGRESS_READ		0	/* bytes read from medium */
+#define UDF_PROGRESS_WRITTEN		1	/* bytes written to medium */
+#define UDF_PROGRESS_DESCS		2	/* descriptors checked */
+#define UDF_PROGRESS_FILES		3	/* files and directories visited */
+#define UDF_PROGRESS_COUNTERS		4
+
+#define UDF_PROGRESS_INTERVAL		1	/* seconds between reports */
+
+#define UDF_TRACE_MEDIUM_READ		0	/* udf_medium_read() */
+#define UDF_TRACE_MEDIUM_MAP		1	/* udf_medium_map() window cache */
+#define UDF_TRACE_CACHE_GET		2	/* udffsck block cache window */
+#define UDF_TRACE_CACHE_SYNC		3	/* udffsck msync() of window */
+#define UDF_TRACE_WRITE			4	/* mkudffs pwrite() */
+#define UDF_TRACE_PACKET_READ		5	/* wrudf packet read, hits from flush queue */
+#define UDF_TRACE_PACKET_WRITE		6	/* wrudf packet write */
+#define UDF_TRACE_CD_READ		7	/* wrudf READ CD command */
+#define UDF_TRACE_CD_WRITE		8	/* wrudf WRITE 10 command */
+#define UDF_TRACE_CRC			9	/* udf_crc() */
+#define UDF_TRACE_POINTS		10
+
+#define UDF_TRACE_BUCKETS		32	/* log2 of latency in nanoseconds */
+
+/*
+ * USDT probe udftools:name with position and length (or result) arguments,
+ * compiled in only when <sys/sdt.h> is available
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define UDF_PROBE(name, pos, len)	DTRACE_PROBE2(udftools, name, pos, len)
+#else
+#define UDF_PROBE(name, pos, len)	do { (void)(pos); (void)(len); } while (0)
+#endif
+
+/*
+ * Trace point around I/O or CRC: probes name__start and name__done fire,
+ * and the call is counted when the counter table is enabled
+ */
+#define UDF_TRACE_START(name, pos, len, start) \
+	do { UDF_PROBE(name##__start, pos, len); start = udf_trace_begin(); } while (0)
+#define UDF_TRACE_DONE(point, name, pos, ret, start) \
+	do { UDF_PROBE(name##__done, pos, ret); udf_trace_end(point, start, ret); } while (0)
+
+/*
+ * Memory of udf_extent/udf_desc/udf_data graph of udf_disc, see arena.c
+ */
+struct udf_arena
+{
+	struct udf_arena_block		*blocks;
+	unsigned char			*next;
+	unsigned char			*end;
+	unsigned char			*last;
+};
+
+/*
+ * Read access to medium shared by udffsck and udfinfo, see medium.c
+ */
+struct udf_medium
+{
+	int				fd;
+	int				io;
+	unsigned int			depth;
+	struct udf_uring		*uring;
+	struct udf_medium_window	*windows;
+	unsigned long			stamp;
+	int				no_holes;
+};
+
 struct udf_disc
 {
 	uint16_t			udf_rev;
@@ -139,15 +285,41 @@ struct udf_disc
 	struct logicalVolIntegrityDesc	*udf_lvid;
 
 	struct sparingTable		*udf_stable[4];
+	struct udf_sparing_map		sparing_map;
 
 	uint32_t			vat_block;
 	uint32_t			*vat;
 	uint64_t			vat_entries;
 
+	struct udf_partition		*partitions;
+	uint16_t			num_partitions;
+
 	struct fileSetDesc		*udf_fsd;
 
 	struct udf_extent		*head;
 	struct udf_extent		*tail;
+	struct udf_index_node		*ext_index;
+	struct udf_space_summary	*space_summary;
+
+	uint32_t			meta_start;
+	uint32_t			meta_blocks;
+	uint32_t			meta_unit;
+	uint16_t			meta_align;
+	struct udf_desc			*meta_bitmap;
+
+	struct udf_arena		arena;
+};
+
+/*
+ * Node of ordered index kept alongside udf_extent and udf_desc lists.
+ * In-order traversal of the index follows the list order.
+ */
+struct udf_index_node
+{
+	struct udf_index_node		*left;
+	struct udf_index_node		*right;
+	struct udf_index_node		*parent;
+	uint32_t			priority;
 };
 
 struct udf_extent
@@ -158,9 +330,11 @@ struct udf_extent
 
 	struct udf_desc			*head;
 	struct udf_desc			*tail;
+	struct udf_index_node		*desc_index;
 
 	struct udf_extent		*next;
 	struct udf_extent		*prev;
+	struct udf_index_node		node;
 };
 
 struct udf_desc
@@ -169,9 +343,11 @@ struct udf_desc
 	uint32_t			offset;
 	uint64_t			length;
 	struct udf_data			*data;
+	struct udf_data			*data_tail;
 
 	struct udf_desc			*next;
 	struct udf_desc			*prev;
+	struct udf_index_node		node;
 };
 
 struct udf_data
@@ -206,6 +382,14 @@ struct mbr
 	uint16_t			boot_signature;
 } __attribute__ ((packed));
 
+/* arena.c */
+void *udf_arena_alloc(struct udf_disc *, size_t);
+void *udf_arena_realloc(struct udf_disc *, void *, size_t, size_t);
+void udf_arena_release(struct udf_disc *);
+
+/* batch.c */
+int udf_batch(char *const [], unsigned int, unsigned int, int *);
+
 /* crc.c */
 extern uint16_t udf_crc(uint8_t *, uint32_t, uint16_t);
 
@@ -217,11 +401,80 @@ struct udf_extent *prev_extent(struct udf_extent *, enum udf_space_type);
 uint32_t prev_extent_size(struct udf_extent *, enum udf_space_type, uint32_t, uint32_t);
 struct udf_extent *find_extent(struct udf_disc *, uint32_t);
 struct udf_extent *set_extent(struct udf_disc *, enum udf_space_type, uint32_t,uint32_t);
+void insert_extent(struct udf_disc *, struct udf_extent *, struct udf_extent *);
+void remove_extent(struct udf_disc *, struct udf_extent *);
 struct udf_desc *next_desc(struct udf_desc *, uint16_t);
 struct udf_desc *find_desc(struct udf_extent *, uint32_t);
-struct udf_desc *set_desc(struct udf_extent *, uint16_t, uint32_t, uint32_t, struct udf_data *);
+struct udf_desc *set_desc(struct udf_disc *, struct udf_extent *, uint16_t, uint32_t, uint32_t, struct udf_data *);
 void append_data(struct udf_desc *, struct udf_data *);
-struct udf_data *alloc_data(void *, int);
+struct udf_data *alloc_data(struct udf_disc *, void *, int);
+
+/* medium.c */
+int udf_medium_init(struct udf_medium *, int, int, unsigned int);
+void udf_medium_free(struct udf_medium *);
+int udf_medium_register(struct udf_medium *, const struct iovec *, unsigned int);
+ssize_t udf_medium_read(struct udf_medium *, void *, size_t, uint64_t, int);
+const void *udf_medium_map(struct udf_medium *, uint64_t, size_t, uint64_t);
+uint64_t udf_medium_next_data(struct udf_medium *, uint64_t, uint64_t);
+void udf_medium_invalidate(struct udf_medium *);
+int udf_medium_parse_io(const char *);
+const char *udf_medium_io_name(int);
+
+/* popcount.c */
+uint64_t udf_popcount(const uint8_t *, size_t);
+uint64_t udf_popcount_xor(const uint8_t *, const uint8_t *, size_t);
+
+/* progress.c */
+extern int udf_progress_enabled;
+extern uint64_t udf_progress_counters[UDF_PROGRESS_COUNTERS];
+int udf_progress_start(const char *, const char *);
+void udf_progress_total(unsigned int, uint64_t);
+void udf_progress_stop(void);
+
+/*
+ * Add to progress counter, cheap enough for work loops of several threads
+ */
+static inline void udf_progress_add(unsigned int counter, uint64_t value)
+{
+	if (udf_progress_enabled)
+		__atomic_fetch_add(&udf_progress_counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/* trace.c */
+extern int udf_trace_enabled;
+int udf_trace_start(const char *);
+uint64_t udf_trace_clock(void);
+void udf_trace_record(unsigned int, uint64_t, int64_t);
+void udf_trace_hit(unsigned int);
+
+/*
+ * Start time of traced call, 0 when counter table is disabled
+ */
+static inline uint64_t udf_trace_begin(void)
+{
+	return udf_trace_enabled ? udf_trace_clock() : 0;
+}
+
+static inline void udf_trace_end(unsigned int point, uint64_t start, int64_t bytes)
+{
+	if (start)
+		udf_trace_record(point, start, bytes);
+}
+
+/* readdisc.c */
+int udf_read_disc(struct udf_medium *, struct udf_disc *);
+int udf_read_disc_stages(struct udf_medium *, struct udf_disc *, unsigned int);
+uint32_t udf_block_position(struct udf_disc *, uint16_t, uint32_t);
+uint32_t udf_mirror_block_position(struct udf_disc *, uint16_t, uint32_t);
+int udf_read_blocks(struct udf_medium *, struct udf_disc *, uint16_t, uint32_t, uint32_t, void *);
+
+/* sparing.c */
+void udf_sparing_map_init(struct udf_sparing_map *, uint32_t);
+void udf_sparing_map_free(struct udf_sparing_map *);
+int udf_sparing_map_add(struct udf_sparing_map *, uint32_t, uint32_t);
+int udf_sparing_map_find(const struct udf_sparing_map *, uint32_t, uint32_t *);
+uint32_t udf_sparing_map_lookup(const struct udf_sparing_map *, uint32_t);
+int udf_sparing_map_load(struct udf_sparing_map *, const struct sparingTable *);
 
 /* unicode.c */
 extern size_t decode_utf8(const dchars *, char *, size_t, size_t);
@@ -156,6 +156,31 @@ struct sparablePartitionMap
 	uint32_t	locSparingTable[4];
 } __attribute__ ((packed));
 
+/* Metadata Partition Map (UDF 2.50 2.2.10) */
+struct metadataPartitionMap
+{
+	uint8_t		partitionMapType;
+	uint8_t		partitionMapLength;
+	uint8_t		reserved1[2];
+	regid		partIdent;
+	uint16_t	volSeqNum;
+	uint16_t	partitionNum;
+	uint32_t	metadataFileLoc;
+	uint32_t	metadataMirrorFileLoc;
+	uint32_t	metadataBitmapFileLoc;
+	uint32_t	allocUnitSize;
+	uint16_t	alignUnitSize;
+	uint8_t		flags;
+	uint8_t		reserved2[5];
+} __attribute__ ((packed));
+
+#define MPM_FLAGS_DUPLICATE		0x01
+
+/* Metadata File, Metadata Mirror File and Metadata Bitmap File (UDF 2.50 2.2.13) */
+#define ICBTAG_FILE_TYPE_MAIN		0xFAU
+#define ICBTAG_FILE_TYPE_MIRROR		0xFBU
+#define ICBTAG_FILE_TYPE_BITMAP		0xFCU
+
 /* Virtual Allocation Table (UDF 1.5 2.2.10) */
 struct virtualAllocationTable15
 {
@@ -0,0 +1,325 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Typed accessors of little endian fields of on-disc descriptors
+ *
+ * Descriptors are used in place in the buffers they were read to. Every
+ * accessor is one load or store of the field, as is on little endian hosts
+ * and byte swapped on big endian hosts.
+ */
+
+#ifndef __UDF_ACCESS_H
+#define __UDF_ACCESS_H
+
+#include <stdint.h>
+
+#include "ecma_167.h"
+#include "bswap.h"
+
+/* Descriptor Tag (ECMA 167r3 3/7.2) */
+static inline uint16_t udf_tag_ident(const tag *t)
+{
+	return le16_to_cpu(t->tagIdent);
+}
+
+static inline uint16_t udf_tag_version(const tag *t)
+{
+	return le16_to_cpu(t->descVersion);
+}
+
+static inline uint16_t udf_tag_serial(const tag *t)
+{
+	return le16_to_cpu(t->tagSerialNum);
+}
+
+static inline uint16_t udf_tag_crc(const tag *t)
+{
+	return le16_to_cpu(t->descCRC);
+}
+
+static inline uint16_t udf_tag_crc_length(const tag *t)
+{
+	return le16_to_cpu(t->descCRCLength);
+}
+
+static inline uint32_t udf_tag_location(const tag *t)
+{
+	return le32_to_cpu(t->tagLocation);
+}
+
+static inline void udf_tag_set_serial(tag *t, uint16_t serial)
+{
+	t->tagSerialNum = cpu_to_le16(serial);
+}
+
+static inline void udf_tag_set_crc(tag *t, uint16_t crc)
+{
+	t->descCRC = cpu_to_le16(crc);
+}
+
+static inline void udf_tag_set_location(tag *t, uint32_t location)
+{
+	t->tagLocation = cpu_to_le32(location);
+}
+
+/* Timestamp (ECMA 167r3 1/7.3) */
+static inline uint16_t udf_timestamp_type_tz(const timestamp *ts)
+{
+	return le16_to_cpu(ts->typeAndTimezone);
+}
+
+static inline uint16_t udf_timestamp_year(const timestamp *ts)
+{
+	return le16_to_cpu(ts->year);
+}
+
+/* Extent Descriptor (ECMA 167r3 3/7.1) */
+static inline uint32_t udf_extad_length(const extent_ad *ext)
+{
+	return le32_to_cpu(ext->extLength);
+}
+
+static inline uint32_t udf_extad_location(const extent_ad *ext)
+{
+	return le32_to_cpu(ext->extLocation);
+}
+
+/* Recorded Address (ECMA 167r3 4/7.1) */
+static inline uint32_t udf_lb_block(const lb_addr *addr)
+{
+	return le32_to_cpu(addr->logicalBlockNum);
+}
+
+static inline uint16_t udf_lb_partition(const lb_addr *addr)
+{
+	return le16_to_cpu(addr->partitionReferenceNum);
+}
+
+/* Short Allocation Descriptor (ECMA 167r3 4/14.14.1) */
+static inline uint32_t udf_sad_length(const short_ad *ad)
+{
+	return le32_to_cpu(ad->extLength) & 0x3FFFFFFF;
+}
+
+static inline uint32_t udf_sad_type(const short_ad *ad)
+{
+	return le32_to_cpu(ad->extLength) >> 30;
+}
+
+static inline uint32_t udf_sad_position(const short_ad *ad)
+{
+	return le32_to_cpu(ad->extPosition);
+}
+
+/* Long Allocation Descriptor (ECMA 167r3 4/14.14.2) */
+static inline uint32_t udf_lad_length(const long_ad *ad)
+{
+	return le32_to_cpu(ad->extLength) & 0x3FFFFFFF;
+}
+
+static inline uint32_t udf_lad_type(const long_ad *ad)
+{
+	return le32_to_cpu(ad->extLength) >> 30;
+}
+
+static inline uint32_t udf_lad_block(const long_ad *ad)
+{
+	return udf_lb_block(&ad->extLocation);
+}
+
+static inline uint16_t udf_lad_partition(const long_ad *ad)
+{
+	return udf_lb_partition(&ad->extLocation);
+}
+
+/* Extended Allocation Descriptor (ECMA 167r3 4/14.14.3) */
+static inline uint32_t udf_ead_length(const ext_ad *ad)
+{
+	return le32_to_cpu(ad->extLength) & 0x3FFFFFFF;
+}
+
+static inline uint32_t udf_ead_type(const ext_ad *ad)
+{
+	return le32_to_cpu(ad->extLength) >> 30;
+}
+
+static inline uint32_t udf_ead_block(const ext_ad *ad)
+{
+	return udf_lb_block(&ad->extLocation);
+}
+
+static inline uint16_t udf_ead_partition(const ext_ad *ad)
+{
+	return udf_lb_partition(&ad->extLocation);
+}
+
+/* File Identifier Descriptor (ECMA 167r3 4/14.4) */
+static inline uint16_t udf_fid_version(const struct fileIdentDesc *fid)
+{
+	return le16_to_cpu(fid->fileVersionNum);
+}
+
+static inline uint16_t udf_fid_imp_use_length(const struct fileIdentDesc *fid)
+{
+	return le16_to_cpu(fid->lengthOfImpUse);
+}
+
+/* File Identifier, follows Implementation Use */
+static inline const uint8_t *udf_fid_ident(const struct fileIdentDesc *fid)
+{
+	return fid->impUseAndFileIdent + udf_fid_imp_use_length(fid);
+}
+
+/* Length of FID including its padding to 4 bytes */
+static inline uint32_t udf_fid_length(const struct fileIdentDesc *fid)
+{
+	return 4 * ((sizeof(struct fileIdentDesc) + udf_fid_imp_use_length(fid) + fid->lengthFileIdent + 3) / 4);
+}
+
+/* ICB Tag (ECMA 167r3 4/14.6) */
+static inline uint16_t udf_icbtag_flags(const icbtag *icb)
+{
+	return le16_to_cpu(icb->flags);
+}
+
+/* File Entry (ECMA 167r3 4/14.9) */
+static inline uint32_t udf_fe_uid(const struct fileEntry *fe)
+{
+	return le32_to_cpu(fe->uid);
+}
+
+static inline uint32_t udf_fe_gid(const struct fileEntry *fe)
+{
+	return le32_to_cpu(fe->gid);
+}
+
+static inline uint32_t udf_fe_permissions(const struct fileEntry *fe)
+{
+	return le32_to_cpu(fe->permissions);
+}
+
+static inline uint16_t udf_fe_link_count(const struct fileEntry *fe)
+{
+	return le16_to_cpu(fe->fileLinkCount);
+}
+
+static inline uint64_t udf_fe_info_length(const struct fileEntry *fe)
+{
+	return le64_to_cpu(fe->informationLength);
+}
+
+static inline uint64_t udf_fe_blocks_recorded(const struct fileEntry *fe)
+{
+	return le64_to_cpu(fe->logicalBlocksRecorded);
+}
+
+static inline uint64_t udf_fe_unique_id(const struct fileEntry *fe)
+{
+	return le64_to_cpu(fe->uniqueID);
+}
+
+static inline uint32_t udf_fe_ea_length(const struct fileEntry *fe)
+{
+	return le32_to_cpu(fe->lengthExtendedAttr);
+}
+
+static inline uint32_t udf_fe_ad_length(const struct fileEntry *fe)
+{
+	return le32_to_cpu(fe->lengthAllocDescs);
+}
+
+/* Allocation Descriptors, follow Extended Attributes */
+static inline uint8_t *udf_fe_ads(struct fileEntry *fe)
+{
+	return fe->extendedAttrAndAllocDescs + udf_fe_ea_length(fe);
+}
+
+/* Length of FE including Extended Attributes and Allocation Descriptors */
+static inline uint32_t udf_fe_length(const struct fileEntry *fe)
+{
+	return sizeof(struct fileEntry) + udf_fe_ea_length(fe) + udf_fe_ad_length(fe);
+}
+
+static inline void udf_fe_set_unique_id(struct fileEntry *fe, uint64_t uid)
+{
+	fe->uniqueID = cpu_to_le64(uid);
+}
+
+/* Extended File Entry (ECMA 167r3 4/14.17) */
+static inline uint32_t udf_efe_uid(const struct extendedFileEntry *efe)
+{
+	return le32_to_cpu(efe->uid);
+}
+
+static inline uint32_t udf_efe_gid(const struct extendedFileEntry *efe)
+{
+	return le32_to_cpu(efe->gid);
+}
+
+static inline uint32_t udf_efe_permissions(const struct extendedFileEntry *efe)
+{
+	return le32_to_cpu(efe->permissions);
+}
+
+static inline uint16_t udf_efe_link_count(const struct extendedFileEntry *efe)
+{
+	return le16_to_cpu(efe->fileLinkCount);
+}
+
+static inline uint64_t udf_efe_info_length(const struct extendedFileEntry *efe)
+{
+	return le64_to_cpu(efe->informationLength);
+}
+
+static inline uint64_t udf_efe_blocks_recorded(const struct extendedFileEntry *efe)
+{
+	return le64_to_cpu(efe->logicalBlocksRecorded);
+}
+
+static inline uint64_t udf_efe_unique_id(const struct extendedFileEntry *efe)
+{
+	return le64_to_cpu(efe->uniqueID);
+}
+
+static inline uint32_t udf_efe_ea_length(const struct extendedFileEntry *efe)
+{
+	return le32_to_cpu(efe->lengthExtendedAttr);
+}
+
+static inline uint32_t udf_efe_ad_length(const struct extendedFileEntry *efe)
+{
+	return le32_to_cpu(efe->lengthAllocDescs);
+}
+
+/* Allocation Descriptors, follow Extended Attributes */
+static inline uint8_t *udf_efe_ads(struct extendedFileEntry *efe)
+{
+	return efe->extendedAttrAndAllocDescs + udf_efe_ea_length(efe);
+}
+
+/* Length of EFE including Extended Attributes and Allocation Descriptors */
+static inline uint32_t udf_efe_length(const struct extendedFileEntry *efe)
+{
+	return sizeof(struct extendedFileEntry) + udf_efe_ea_length(efe) + udf_efe_ad_length(efe);
+}
+
+static inline void udf_efe_set_unique_id(struct extendedFileEntry *efe, uint64_t uid)
+{
+	efe->uniqueID = cpu_to_le64(uid);
+}
+
+#endif /* __UDF_ACCESS_H */
@@ -0,0 +1,140 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * libudffs arena allocator of udf_disc
+ *
+ * udf_extent, udf_desc and udf_data items and their payloads are carved out
+ * of big zeroed blocks owned by the udf_disc. Nothing is freed individually,
+ * all blocks are released at once by udf_arena_release(). The most recent
+ * allocation can grow in place, which covers descriptors extended right after
+ * they were created. Requests bigger than a quarter of a block get their own
+ * block so they do not waste the rest of the current one.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libudffs.h"
+
+#define ARENA_ALIGN(size)	(((size) + UDF_ARENA_ALIGN - 1) & ~(size_t)(UDF_ARENA_ALIGN - 1))
+#define ARENA_HEADER		ARENA_ALIGN(sizeof(struct udf_arena_block))
+
+struct udf_arena_block
+{
+	struct udf_arena_block		*next;
+};
+
+static unsigned char *arena_new_block(struct udf_arena *arena, size_t size)
+{
+	struct udf_arena_block *block = calloc(1, ARENA_HEADER + size);
+
+	if (!block)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	block->next = arena->blocks;
+	arena->blocks = block;
+	return (unsigned char *)block + ARENA_HEADER;
+}
+
+/**
+ * @brief allocate zeroed memory owned by a udf_disc
+ * @param disc the udf_disc owning the memory
+ * @param size the size of the memory in bytes
+ * @return the in-memory address of the allocated memory
+ */
+void *udf_arena_alloc(struct udf_disc *disc, size_t size)
+{
+	struct udf_arena *arena = &disc->arena;
+	unsigned char *ptr;
+
+	size = ARENA_ALIGN(size ? size : 1);
+
+	if (size > (size_t)(arena->end - arena->next))
+	{
+		if (size > UDF_ARENA_BLOCK / 4)
+		{
+			arena->last = NULL;
+			return arena_new_block(arena, size);
+		}
+		arena->next = arena_new_block(arena, UDF_ARENA_BLOCK);
+		arena->end = arena->next + UDF_ARENA_BLOCK;
+	}
+
+	ptr = arena->next;
+	arena->next += size;
+	arena->last = ptr;
+	return ptr;
+}
+
+/**
+ * @brief resize memory allocated by udf_arena_alloc(), the memory is grown
+ *        in place when it is the most recent allocation, otherwise moved
+ * @param disc the udf_disc owning the memory
+ * @param ptr the memory to resize, if NULL allocate new memory
+ * @param old_size the current size of the memory in bytes
+ * @param size the new size of the memory in bytes
+ * @return the in-memory address of the resized memory
+ */
+void *udf_arena_realloc(struct udf_disc *disc, void *ptr, size_t old_size, size_t size)
+{
+	struct udf_arena *arena = &disc->arena;
+	void *new_ptr;
+
+	if (!ptr)
+		return udf_arena_alloc(disc, size);
+	if (size <= old_size)
+		return ptr;
+
+	if (ptr == arena->last && ARENA_ALIGN(size) <= (size_t)(arena->end - (unsigned char *)ptr))
+	{
+		arena->next = (unsigned char *)ptr + ARENA_ALIGN(size);
+		return ptr;
+	}
+
+	new_ptr = udf_arena_alloc(disc, size);
+	memcpy(new_ptr, ptr, old_size);
+	return new_ptr;
+}
+
+/**
+ * @brief release all memory allocated by udf_arena_alloc() for a udf_disc
+ * @param disc the udf_disc owning the memory
+ * @return void
+ */
+void udf_arena_release(struct udf_disc *disc)
+{
+	struct udf_arena *arena = &disc->arena;
+	struct udf_arena_block *block, *next;
+
+	for (block = arena->blocks; block; block = next)
+	{
+		next = block->next;
+		free(block);
+	}
+
+	memset(arena, 0, sizeof(*arena));
+}
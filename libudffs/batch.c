@@ -0,0 +1,263 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * libudffs batch processing of several devices
+ *
+ * Every device is processed by a forked child which continues in the normal
+ * code path of the tool, so options, caches and all other global state of
+ * the tool stay private to one device, while exec, locale and option setup
+ * are paid only once. At most jobs children run at once. Output of every
+ * child goes to its own temporary files and is copied out as one record per
+ * device, in the order of the devices:
+ *
+ *	device=<device>
+ *	<standard output of the tool>
+ *	error=<last message of the tool, empty when there was none>
+ *	status=<exit status>
+ *
+ * Records are separated by an empty line. Standard error of the child is
+ * copied to standard error at the same time, every line prefixed by the
+ * device, so messages of different devices are never interleaved and
+ * standard output holds nothing but records.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libudffs.h"
+
+struct batch_child
+{
+	pid_t		pid;
+	FILE		*out;
+	FILE		*err;
+	int		status;
+	int		done;
+};
+
+static void batch_copy(FILE *from, FILE *to)
+{
+	char buffer[4096];
+	size_t len;
+
+	rewind(from);
+	while ((len = fread(buffer, 1, sizeof(buffer), from)) > 0)
+		fwrite(buffer, 1, len, to);
+}
+
+/**
+ * @brief Copy messages of child prefixed by device
+ * @return last non-empty line without newline, NULL when there was none
+ */
+static char *batch_copy_messages(const char *device, FILE *from, FILE *to)
+{
+	char *line = NULL, *last = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	rewind(from);
+	while ((len = getline(&line, &size, from)) > 0)
+	{
+		// Message cut by exit still gets its own line
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+		fprintf(to, "%s: %s\n", device, line);
+		if (len > 0)
+		{
+			free(last);
+			last = strdup(line);
+		}
+	}
+	free(line);
+	return last;
+}
+
+static void batch_emit(const char *device, struct batch_child *child)
+{
+	char *error = NULL;
+
+	if (child->err)
+	{
+		error = batch_copy_messages(device, child->err, stderr);
+		fclose(child->err);
+		child->err = NULL;
+	}
+	fflush(stderr);
+
+	printf("device=%s\n", device);
+	if (child->out)
+	{
+		batch_copy(child->out, stdout);
+		fclose(child->out);
+		child->out = NULL;
+	}
+	if (error)
+		printf("error=%s\n", error);
+	else if (child->status > 128)
+		printf("error=%s\n", strsignal(child->status - 128));
+	else
+		printf("error=\n");
+	printf("status=%d\n\n", child->status);
+	fflush(stdout);
+	free(error);
+}
+
+static void batch_child_setup(struct batch_child *children, unsigned int count, unsigned int index)
+{
+	unsigned int i;
+	int fd;
+
+	if (dup2(fileno(children[index].out), STDOUT_FILENO) < 0 || dup2(fileno(children[index].err), STDERR_FILENO) < 0)
+		_exit(1);
+
+	// Nobody can answer questions of a child
+	fd = open("/dev/null", O_RDONLY);
+	if (fd >= 0)
+	{
+		dup2(fd, STDIN_FILENO);
+		close(fd);
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		if (children[i].out)
+			fclose(children[i].out);
+		if (children[i].err)
+			fclose(children[i].err);
+	}
+	free(children);
+}
+
+/**
+ * @brief Process several devices by forked children
+ *
+ * Returns twice like fork(): in a child with index of device which it has
+ * to process and whose exit status is its result, in the caller only after
+ * all devices were processed and their records were written out.
+ *
+ * @param devices list of devices
+ * @param count number of devices
+ * @param jobs maximal number of devices processed at once
+ * @param status set in the caller to bitwise or of exit statuses of children
+ * @return index of device in a child, -1 in the caller
+ */
+int udf_batch(char *const devices[], unsigned int count, unsigned int jobs, int *status)
+{
+	struct batch_child *children;
+	unsigned int next, emitted, running, i;
+	int wstatus;
+	pid_t pid;
+
+	*status = 0;
+	if (!count)
+		return -1;
+	if (!jobs)
+		jobs = 1;
+
+	children = calloc(count, sizeof(*children));
+	if (!children)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	next = emitted = running = 0;
+	while (emitted < count)
+	{
+		while (running < jobs && next < count)
+		{
+			children[next].out = tmpfile();
+			children[next].err = tmpfile();
+			if (!children[next].out || !children[next].err)
+			{
+				fprintf(stderr, "%s: Error: Cannot create temporary file: %s\n", appname, strerror(errno));
+				children[next].status = 1;
+				children[next].done = 1;
+				next++;
+				continue;
+			}
+
+			pid = fork();
+			if (pid == 0)
+			{
+				batch_child_setup(children, count, next);
+				return next;
+			}
+
+			if (pid < 0)
+			{
+				fprintf(children[next].err, "%s: Error: fork failed: %s\n", appname, strerror(errno));
+				children[next].status = 1;
+				children[next].done = 1;
+			}
+			else
+			{
+				children[next].pid = pid;
+				running++;
+			}
+			next++;
+		}
+
+		while (emitted < count && children[emitted].done)
+		{
+			batch_emit(devices[emitted], &children[emitted]);
+			*status |= children[emitted].status;
+			emitted++;
+		}
+
+		if (!running)
+			continue;
+
+		pid = waitpid(-1, &wstatus, 0);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: Error: waitpid failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+
+		for (i = emitted; i < next; ++i)
+		{
+			if (children[i].pid != pid || children[i].done)
+				continue;
+			if (WIFEXITED(wstatus))
+				children[i].status = WEXITSTATUS(wstatus);
+			else
+				children[i].status = 128 + WTERMSIG(wstatus);
+			children[i].done = 1;
+			running--;
+			break;
+		}
+	}
+
+	free(children);
+	return -1;
+}
@@ -26,7 +26,12 @@
  * libudffs CRC functions
  */
 
+#include "config.h"
+
+#include <stdint.h>
+
 #include "ecma_167.h"
+#include "libudffs.h"
 
 static uint16_t crc_table[256] = {
 	0x0000U, 0x1021U, 0x2042U, 0x3063U, 0x4084U, 0x50a5U, 0x60c6U, 0x70e7U,
@@ -63,6 +68,178 @@ static uint16_t crc_table[256] = {
 	0x6e17U, 0x7e36U, 0x4e55U, 0x5e74U, 0x2e93U, 0x3eb2U, 0x0ed1U, 0x1ef0U
 };
 
+/*
+ * crc_slice
+ *
+ * PURPOSE
+ *	Lookup tables for processing eight bytes per iteration.
+ *
+ * DESCRIPTION
+ *	crc_slice[k][n] is the CRC of byte n followed by k zero bytes, so
+ *	crc_slice[0] equals crc_table. Tables are derived from crc_table on
+ *	first use by crc_init().
+ */
+static uint16_t crc_slice[8][256];
+
+/*
+ * Carry-less multiply folding constants: x^192 mod P and x^128 mod P.
+ */
+static uint64_t crc_fold_k1, crc_fold_k2;
+
+static uint16_t crc_bytes(const uint8_t *data, uint32_t size, uint16_t crc);
+static uint16_t crc_slice8(const uint8_t *data, uint32_t size, uint16_t crc);
+static uint16_t (*crc_func)(const uint8_t *, uint32_t, uint16_t);
+
+/*
+ * crc_bytes
+ *
+ * PURPOSE
+ *	Reference byte-at-a-time implementation, used for short tails.
+ */
+static uint16_t
+crc_bytes(const uint8_t *data, uint32_t size, uint16_t crc)
+{
+	while (size--)
+		crc = crc_table[(crc >> 8 ^ *(data++)) & 0xffU] ^ (crc << 8);
+
+	return crc;
+}
+
+/*
+ * crc_slice8
+ *
+ * PURPOSE
+ *	Slicing-by-8 implementation, portable to any architecture.
+ *
+ * DESCRIPTION
+ *	The current CRC is merged into the first two bytes of each 8-byte
+ *	block, and every byte of the block is then looked up in the table
+ *	matching the number of bytes which follow it.
+ */
+static uint16_t
+crc_slice8(const uint8_t *data, uint32_t size, uint16_t crc)
+{
+	while (size >= 8)
+	{
+		crc ^= (uint16_t)(data[0] << 8 | data[1]);
+		crc = crc_slice[7][crc >> 8] ^ crc_slice[6][crc & 0xffU] ^
+		      crc_slice[5][data[2]] ^ crc_slice[4][data[3]] ^
+		      crc_slice[3][data[4]] ^ crc_slice[2][data[5]] ^
+		      crc_slice[1][data[6]] ^ crc_slice[0][data[7]];
+		data += 8;
+		size -= 8;
+	}
+
+	return crc_bytes(data, size, crc);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#include <immintrin.h>
+
+/*
+ * crc_clmul
+ *
+ * PURPOSE
+ *	PCLMULQDQ implementation for x86-64.
+ *
+ * DESCRIPTION
+ *	Polynomials are kept in natural bit order (bit n is the coefficient
+ *	of x^n), so every 16-byte block is byte swapped on load. The 128-bit
+ *	accumulator X is folded over each following block B as
+ *	X' = X_hi * (x^192 mod P) + X_lo * (x^128 mod P) + B, which keeps
+ *	X congruent to the processed message modulo P. The final 16 bytes
+ *	of X (plus any tail smaller than one block) are then reduced with
+ *	the slicing tables; multiplying X by x^16 mod P is exactly what the
+ *	table driven CRC computes.
+ */
+__attribute__((target("pclmul,ssse3")))
+static uint16_t
+crc_clmul(const uint8_t *data, uint32_t size, uint16_t crc)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k = _mm_set_epi64x((long long)crc_fold_k1, (long long)crc_fold_k2);
+	uint8_t buf[16];
+	__m128i x, hi, lo;
+
+	if (size < 32)
+		return crc_slice8(data, size, crc);
+
+	x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+	x = _mm_xor_si128(x, _mm_set_epi64x((long long)((uint64_t)crc << 48), 0));
+	data += 16;
+	size -= 16;
+
+	while (size >= 16)
+	{
+		hi = _mm_clmulepi64_si128(x, k, 0x11);
+		lo = _mm_clmulepi64_si128(x, k, 0x00);
+		x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+		x = _mm_xor_si128(x, _mm_xor_si128(hi, lo));
+		data += 16;
+		size -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)buf, _mm_shuffle_epi8(x, bswap));
+	crc = crc_slice8(buf, sizeof(buf), 0);
+
+	return crc_slice8(data, size, crc);
+}
+
+#endif /* defined(__GNUC__) && defined(__x86_64__) */
+
+/*
+ * crc_xpow_mod
+ *
+ * PURPOSE
+ *	Calculate x^n mod P for the folding constants.
+ */
+static uint64_t
+crc_xpow_mod(unsigned int n)
+{
+	uint32_t r = 1;
+
+	while (n--)
+	{
+		r <<= 1;
+		if (r & 0x10000U)
+			r ^= 0x11021U;
+	}
+
+	return r;
+}
+
+/*
+ * crc_init
+ *
+ * PURPOSE
+ *	Build the slicing tables and select the fastest implementation
+ *	supported by the running CPU.
+ */
+static void
+crc_init(void)
+{
+	uint16_t (*func)(const uint8_t *, uint32_t, uint16_t) = crc_slice8;
+	int k, n;
+
+	for (n = 0; n < 256; n++)
+		crc_slice[0][n] = crc_table[n];
+	for (k = 1; k < 8; k++)
+		for (n = 0; n < 256; n++)
+			crc_slice[k][n] = (crc_slice[k-1][n] << 8) ^ crc_table[crc_slice[k-1][n] >> 8];
+
+	crc_fold_k1 = crc_xpow_mod(192);
+	crc_fold_k2 = crc_xpow_mod(128);
+
+#if defined(__GNUC__) && defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+		func = crc_clmul;
+#endif
+
+	__atomic_store_n(&crc_func, func, __ATOMIC_RELEASE);
+}
+
 /*
  * udf_crc
  *
@@ -73,6 +250,9 @@ static uint16_t crc_table[256] = {
  *	The OSTA-UDF(tm) 1.50 standard states that using CRCs is mandatory.
  *	The polynomial used is:	x^16 + x^12 + x^15 + 1
  *
+ *	The work is dispatched to a carry-less multiply or slicing-by-8
+ *	implementation chosen on the first call.
+ *
  * PRE-CONDITIONS
  *	data		Pointer to the data block.
  *	size		Size of the data block.
@@ -87,9 +267,19 @@ static uint16_t crc_table[256] = {
 extern uint16_t
 udf_crc(uint8_t *data, uint32_t size, uint16_t crc)
 {
-	while (size--)
-		crc = crc_table[(crc >> 8 ^ *(data++)) & 0xffU] ^ (crc << 8);
+	uint16_t (*func)(const uint8_t *, uint32_t, uint16_t);
+	uint64_t start;
+
+	func = __atomic_load_n(&crc_func, __ATOMIC_ACQUIRE);
+	if (!func)
+	{
+		crc_init();
+		func = crc_func;
+	}
 
+	UDF_TRACE_START(crc, (uintptr_t)data, size, start);
+	crc = func(data, size, crc);
+	UDF_TRACE_DONE(UDF_TRACE_CRC, crc, (uintptr_t)data, size, start);
 	return crc;
 }
 
@@ -105,14 +295,16 @@ udf_crc(uint8_t *data, uint32_t size, uint16_t crc)
  *	Adapted from OSTA-UDF(tm) 1.50 standard.
  */
 
+#include <stdio.h>
+
 unsigned char bytes[] = { 0x70U, 0x6AU, 0x77U };
 
 int main(void)
 {
 	unsigned short x;
 
-	x = udf_crc16(bytes, sizeof bytes);
-	printf("udf_crc16: calculated = %4.4x, correct = %4.4x\n", x, 0x3299U);
+	x = udf_crc(bytes, sizeof bytes, 0);
+	printf("udf_crc: calculated = %4.4x, correct = %4.4x\n", x, 0x3299U);
 
 	return 0;
 }
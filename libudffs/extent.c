@@ -37,6 +37,7 @@
 #include <time.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <stddef.h>
 
 #include "libudffs.h"
 
@@ -101,7 +102,164 @@
  * disc is just a matter of iterating through the extents and their descriptors
  * and data in order and writing them sequentially onto the media while also
  * converting to the on-disc little-endian format as needed.
+ *
+ * Both the udf_extent list of a udf_disc and the udf_descriptor list of a
+ * udf_extent have an ordered index (a treap) kept alongside them, so that
+ * find_extent() and find_desc() do not have to scan the lists. The index is
+ * positional: its in-order traversal is the list order and lookups rely on
+ * the lists being sorted, so extents and descriptors can be resized in place
+ * without touching the index. An index is built on first lookup, which also
+ * covers lists assembled by hand. Linking an udf_extent into a list which is
+ * already indexed must go through insert_extent() and remove_extent().
+ */
+
+#define extent_of(n)	((struct udf_extent *)((char *)(n) - offsetof(struct udf_extent, node)))
+#define desc_of(n)	((struct udf_desc *)((char *)(n) - offsetof(struct udf_desc, node)))
+
+/**
+ * @brief generate pseudo-random priority for a new index node
+ * @return priority
+ */
+static uint32_t index_priority(void)
+{
+	static uint32_t state = 2463534242U;
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/**
+ * @brief rotate an index node above its parent, keeping in-order sequence
+ * @param root the index root
+ * @param node the node to move up
+ * @return void
+ */
+static void index_rotate(struct udf_index_node **root, struct udf_index_node *node)
+{
+	struct udf_index_node *parent = node->parent;
+	struct udf_index_node *grand = parent->parent;
+
+	if (parent->left == node)
+	{
+		parent->left = node->right;
+		if (node->right)
+			node->right->parent = parent;
+		node->right = parent;
+	}
+	else
+	{
+		parent->right = node->left;
+		if (node->left)
+			node->left->parent = parent;
+		node->left = parent;
+	}
+	parent->parent = node;
+	node->parent = grand;
+
+	if (!grand)
+		*root = node;
+	else if (grand->left == parent)
+		grand->left = node;
+	else
+		grand->right = node;
+}
+
+/**
+ * @brief insert a node into an index right after another one
+ * @param root the index root
+ * @param pos the node preceding the new one, if NULL insert as first
+ * @param node the node to insert
+ * @return void
+ */
+static void index_insert(struct udf_index_node **root, struct udf_index_node *pos, struct udf_index_node *node)
+{
+	node->left = node->right = node->parent = NULL;
+	node->priority = index_priority();
+
+	if (!*root)
+	{
+		*root = node;
+		return;
+	}
+
+	if (!pos)
+	{
+		for (pos = *root; pos->left; pos = pos->left)
+			;
+		pos->left = node;
+	}
+	else if (!pos->right)
+		pos->right = node;
+	else
+	{
+		for (pos = pos->right; pos->left; pos = pos->left)
+			;
+		pos->left = node;
+	}
+	node->parent = pos;
+
+	while (node->parent && node->parent->priority < node->priority)
+		index_rotate(root, node);
+}
+
+/**
+ * @brief remove a node from an index
+ * @param root the index root
+ * @param node the node to remove
+ * @return void
+ */
+static void index_remove(struct udf_index_node **root, struct udf_index_node *node)
+{
+	struct udf_index_node *child;
+
+	while (node->left || node->right)
+	{
+		if (!node->left)
+			child = node->right;
+		else if (!node->right)
+			child = node->left;
+		else
+			child = (node->left->priority > node->right->priority) ? node->left : node->right;
+		index_rotate(root, child);
+	}
+
+	if (!node->parent)
+		*root = NULL;
+	else if (node->parent->left == node)
+		node->parent->left = NULL;
+	else
+		node->parent->right = NULL;
+}
+
+/**
+ * @brief build the udf_extent index of a udf_disc from its udf_extent list
+ * @param disc the udf_disc
+ * @return void
  */
+static void build_extent_index(struct udf_disc *disc)
+{
+	struct udf_extent *ext, *prev = NULL;
+
+	disc->ext_index = NULL;
+	for (ext = disc->head; ext != NULL; prev = ext, ext = ext->next)
+		index_insert(&disc->ext_index, prev ? &prev->node : NULL, &ext->node);
+}
+
+/**
+ * @brief build the udf_descriptor index of a udf_extent from its udf_descriptor list
+ * @param ext the udf_extent
+ * @return void
+ */
+static void build_desc_index(struct udf_extent *ext)
+{
+	struct udf_desc *desc, *prev = NULL;
+
+	ext->desc_index = NULL;
+	for (desc = ext->head; desc != NULL; prev = desc, desc = desc->next)
+		index_insert(&ext->desc_index, prev ? &prev->node : NULL, &desc->node);
+}
 
 /**
  * @brief find the next udf_extent of a given space_type on a udf_extent list
@@ -226,15 +384,32 @@ cont:
  */
 struct udf_extent *find_extent(struct udf_disc *disc, uint32_t start)
 {
-	struct udf_extent *start_ext = disc->head;
+	struct udf_index_node *node;
+	struct udf_extent *ext, *found = NULL;
+
+	if (!disc->ext_index)
+		build_extent_index(disc);
 
-	while (start_ext->next != NULL)
+	/* first udf_extent which ends after start, or the last one */
+	node = disc->ext_index;
+	while (node)
 	{
-		if (start_ext->start + start_ext->blocks > start)
+		ext = extent_of(node);
+		if (ext->start + ext->blocks > start)
+		{
+			found = ext;
+			node = node->left;
+		}
+		else if (node->right)
+			node = node->right;
+		else
+		{
+			if (!found)
+				found = ext;
 			break;
-		start_ext = start_ext->next;
+		}
 	}
-	return start_ext;
+	return found;
 }
 
 /**
@@ -267,11 +442,12 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 		}
 		else if (blocks < start_ext->blocks)
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
+			new_ext = udf_arena_alloc(disc, sizeof(struct udf_extent));
 			new_ext->space_type = type;
 			new_ext->start = start;
 			new_ext->blocks = blocks;
 			new_ext->head = new_ext->tail = NULL;
+			new_ext->desc_index = NULL;
 			new_ext->prev = start_ext->prev;
 			if (new_ext->prev)
 				new_ext->prev->next = new_ext;
@@ -282,6 +458,7 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 			start_ext->start += blocks;
 			start_ext->blocks -= blocks;
 			start_ext->prev = new_ext;
+			index_insert(&disc->ext_index, new_ext->prev ? &new_ext->prev->node : NULL, &new_ext->node);
 
 			return new_ext;
 		}
@@ -295,11 +472,12 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 	{
 		if (start + blocks == start_ext->start + start_ext->blocks)
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
+			new_ext = udf_arena_alloc(disc, sizeof(struct udf_extent));
 			new_ext->space_type = type;
 			new_ext->start = start;
 			new_ext->blocks = blocks;
 			new_ext->head = new_ext->tail = NULL;
+			new_ext->desc_index = NULL;
 			new_ext->prev = start_ext;
 			new_ext->next = start_ext->next;
 			if (new_ext->next)
@@ -309,24 +487,27 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 
 			start_ext->blocks -= blocks;
 			start_ext->next = new_ext;
+			index_insert(&disc->ext_index, &start_ext->node, &new_ext->node);
 
 			return new_ext;
 		}
 		else if (start + blocks < start_ext->start + start_ext->blocks)
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
+			new_ext = udf_arena_alloc(disc, sizeof(struct udf_extent));
 			new_ext->space_type = type;
 			new_ext->start = start;
 			new_ext->blocks = blocks;
 			new_ext->head = new_ext->tail = NULL;
+			new_ext->desc_index = NULL;
 			new_ext->prev = start_ext;
 
-			new_ext->next = malloc(sizeof(struct udf_extent));
+			new_ext->next = udf_arena_alloc(disc, sizeof(struct udf_extent));
 			new_ext->next->prev = new_ext;
 			new_ext->next->space_type = start_ext->space_type;
 			new_ext->next->start = start + blocks;
 			new_ext->next->blocks = start_ext->blocks - blocks - start + start_ext->start;
 			new_ext->next->head = new_ext->next->tail = NULL;
+			new_ext->next->desc_index = NULL;
 			new_ext->next->next = start_ext->next;
 			if (new_ext->next->next)
 				new_ext->next->next->prev = new_ext->next;
@@ -335,6 +516,8 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 
 			start_ext->blocks = start - start_ext->start;
 			start_ext->next = new_ext;
+			index_insert(&disc->ext_index, &start_ext->node, &new_ext->node);
+			index_insert(&disc->ext_index, &new_ext->node, &new_ext->next->node);
 
 			return new_ext;
 		}
@@ -345,11 +528,12 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 				fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
 				exit(1);
 			}
-			new_ext = malloc(sizeof(struct udf_extent));
+			new_ext = udf_arena_alloc(disc, sizeof(struct udf_extent));
 			new_ext->space_type = type;
 			new_ext->start = start;
 			new_ext->blocks = blocks;
 			new_ext->head = new_ext->tail = NULL;
+			new_ext->desc_index = NULL;
 			new_ext->prev = start_ext;
 			new_ext->next = start_ext->next;
 			if (new_ext->next)
@@ -359,12 +543,66 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 
 			start_ext->blocks -= blocks;
 			start_ext->next = new_ext;
+			index_insert(&disc->ext_index, &start_ext->node, &new_ext->node);
 
 			return new_ext;
 		}
 	}
 }
 
+/**
+ * @brief link a udf_extent into a udf_disc's udf_extent list and its index
+ * @param disc the udf_disc containing the udf_extent list
+ * @param prev the udf_extent to insert after, if NULL insert as list head
+ * @param ext the udf_extent to insert, with space_type, start, blocks and
+ *        udf_descriptor list already set
+ * @return void
+ */
+void insert_extent(struct udf_disc *disc, struct udf_extent *prev, struct udf_extent *ext)
+{
+	if (!disc->ext_index)
+		build_extent_index(disc);
+
+	ext->desc_index = NULL;
+	ext->prev = prev;
+	ext->next = prev ? prev->next : disc->head;
+	if (ext->prev)
+		ext->prev->next = ext;
+	else
+		disc->head = ext;
+	if (ext->next)
+		ext->next->prev = ext;
+	else
+		disc->tail = ext;
+
+	index_insert(&disc->ext_index, prev ? &prev->node : NULL, &ext->node);
+}
+
+/**
+ * @brief unlink a udf_extent from a udf_disc's udf_extent list and its index,
+ *        the udf_extent itself is not freed
+ * @param disc the udf_disc containing the udf_extent list
+ * @param ext the udf_extent to remove
+ * @return void
+ */
+void remove_extent(struct udf_disc *disc, struct udf_extent *ext)
+{
+	if (!disc->ext_index)
+		build_extent_index(disc);
+
+	index_remove(&disc->ext_index, &ext->node);
+
+	if (ext->prev)
+		ext->prev->next = ext->next;
+	else
+		disc->head = ext->next;
+	if (ext->next)
+		ext->next->prev = ext->prev;
+	else
+		disc->tail = ext->prev;
+	ext->next = ext->prev = NULL;
+}
+
 /**
  * @brief find the next udf_descriptor of a given tag ident on a udf_descriptor list
  * @param start_desc the starting udf_descriptor for the search
@@ -388,23 +626,38 @@ struct udf_desc *next_desc(struct udf_desc *start_desc, uint16_t ident)
  */
 struct udf_desc *find_desc(struct udf_extent *ext, uint32_t offset)
 {
-	struct udf_desc *start_desc = ext->head;
+	struct udf_index_node *node;
+	struct udf_desc *desc, *found = NULL;
+
+	if (!ext->desc_index)
+		build_desc_index(ext);
 
-	while (start_desc->next != NULL)
+	/* first udf_descriptor at or after offset */
+	node = ext->desc_index;
+	while (node)
 	{
-		if (start_desc->offset == offset)
-			return start_desc;
-		else if (start_desc->offset > offset)
-			return start_desc->prev;
+		desc = desc_of(node);
+		if (desc->offset >= offset)
+		{
+			found = desc;
+			node = node->left;
+		}
 		else
-			start_desc = start_desc->next;
+			node = node->right;
 	}
-	return start_desc;
+
+	if (found == NULL)
+		return ext->tail;
+	else if (found->offset == offset)
+		return found;
+	else
+		return found->prev;
 }
 
 /**
  * @brief allocate a new udf_descriptor having a udf_data item and insert it
  *        into the udf_descriptor list of a udf_extent ordered by block number
+ * @param disc the udf_disc owning the new udf_descriptor
  * @oaram ext the udf_extent containing the udf_descriptor list head
  * @param ident the tag ident of the new udf_descriptor
  * @param offset the first block the new descriptor describes
@@ -412,15 +665,15 @@ struct udf_desc *find_desc(struct udf_extent *ext, uint32_t offset)
  * @param data the udf_data item, if NULL allocate memory for the udf_data item
  * @return the in-memory address of the new udf_descriptor
  */
-struct udf_desc *set_desc(struct udf_extent *ext, uint16_t ident, uint32_t offset, uint32_t length, struct udf_data *data)
+struct udf_desc *set_desc(struct udf_disc *disc, struct udf_extent *ext, uint16_t ident, uint32_t offset, uint32_t length, struct udf_data *data)
 {
-	struct udf_desc *start_desc, *new_desc = calloc(1, sizeof(struct udf_desc));
+	struct udf_desc *start_desc, *new_desc = udf_arena_alloc(disc, sizeof(struct udf_desc));
 
 	new_desc->ident = ident;
 	new_desc->offset = offset;
 	new_desc->length = length;
 	if (data == NULL)
-		new_desc->data = alloc_data(NULL, length);
+		new_desc->data = alloc_data(disc, NULL, length);
 	else
 		new_desc->data = data;
 
@@ -428,6 +681,7 @@ struct udf_desc *set_desc(struct udf_extent *ext, uint16_t ident, uint32_t offse
 	{
 		ext->head = ext->tail = new_desc;
 		new_desc->next = new_desc->prev = NULL;
+		ext->desc_index = NULL;
 	}
 	else
 	{
@@ -450,20 +704,23 @@ struct udf_desc *set_desc(struct udf_extent *ext, uint16_t ident, uint32_t offse
 			start_desc->next = new_desc;
 		}
 	}
+	index_insert(&ext->desc_index, new_desc->prev ? &new_desc->prev->node : NULL, &new_desc->node);
 
 	return new_desc;
 }
 
 /**
  * @brief append a udf_data list to the end of the udf_data list of a
- *        udf_descriptor and update the udf_descriptor summed data length
+ *        udf_descriptor and update the udf_descriptor summed data length,
+ *        the end of the list is remembered so directories are filled in
+ *        constant time per entry
  * @param desc the udf_descriptor containing the target udf_data list head
  * @param data the source udf_data list head
  * @return void
  */
 void append_data(struct udf_desc *desc, struct udf_data *data)
 {
-	struct udf_data *ndata = desc->data;
+	struct udf_data *ndata = desc->data_tail ? desc->data_tail : desc->data;
 
 	desc->length += data->length;
 
@@ -472,23 +729,28 @@ void append_data(struct udf_desc *desc, struct udf_data *data)
 
 	ndata->next = data;
 	data->prev = ndata;
+
+	while (data->next != NULL)
+		data = data->next;
+	desc->data_tail = data;
 }
 
 /**
  * @brief allocate a new udf_data item and initialize it with either
  *        allocated zeros or the supplied payload
+ * @param disc the udf_disc owning the new udf_data item
  * @param buffer the supplied payload, if NULL allocate memory for the payload
  * @param length the length of the udf_data item payload in bytes
  * @return the in-memory address of the new udf_data item
  */
-struct udf_data *alloc_data(void *buffer, int length)
+struct udf_data *alloc_data(struct udf_disc *disc, void *buffer, int length)
 {
-	struct udf_data *data = calloc(1, sizeof(struct udf_data));
+	struct udf_data *data = udf_arena_alloc(disc, sizeof(struct udf_data));
 
 	if (buffer)
 		data->buffer = buffer;
 	else if (length)
-		data->buffer = calloc(1, length);
+		data->buffer = udf_arena_alloc(disc, length);
 	data->length = length;
 
 	return data;
@@ -0,0 +1,582 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * libudffs read access to medium
+ *
+ * With the pread backend every read is one blocking pread() loop. With the
+ * io_uring backend a read is split into segments of UDF_MEDIUM_SEGMENT bytes
+ * and up to depth segments are in flight at once, so the device sees a queue
+ * instead of one request at a time. Reads into buffers registered by
+ * udf_medium_register() use fixed buffer requests, which saves mapping of
+ * user pages by kernel for every request.
+ *
+ * The io_uring rings are set up by raw system calls, no library is needed.
+ * When io_uring is not available (old kernel, disabled by sysctl, seccomp,
+ * built without linux/io_uring.h), the pread backend is used instead.
+ *
+ * udf_medium_next_data() skips holes of sparse image files, callers which
+ * stream large ranges do not read zeros which are not stored on disk.
+ *
+ * udf_medium_map() serves small reads from a few cached windows. Each window
+ * is a whole aligned run of MEDIUM_WINDOW_SIZE bytes (or more for bigger
+ * requests), read by one read of medium, so neighbouring descriptors cost no
+ * additional I/O.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "libudffs.h"
+
+#define MEDIUM_WINDOW_SIZE	65536
+#define MEDIUM_WINDOW_COUNT	8
+
+struct udf_medium_window
+{
+	uint8_t			*buffer;
+	size_t			size;
+	uint64_t		start;
+	size_t			length;
+	unsigned long		stamp;
+};
+
+static ssize_t medium_pread(int fd, void *buf, size_t count, uint64_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < count)
+	{
+		ret = pread(fd, (uint8_t *)buf + done, count - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+struct udf_uring
+{
+	int			fd;
+	unsigned int		entries;
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+	int			registered;
+};
+
+struct uring_segment
+{
+	uint32_t		length;
+	uint32_t		done;
+};
+
+static void uring_free(struct udf_uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	free(ring);
+}
+
+static struct udf_uring *uring_init(unsigned int depth)
+{
+	struct io_uring_params params;
+	struct udf_uring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+	// IORING_OP_READ came together with IORING_FEAT_RW_CUR_POS
+	if (ring->fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS))
+		goto failed;
+
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto failed;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+	{
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto failed;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto failed;
+
+	ring->sq_head = (unsigned int *)((uint8_t *)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)((uint8_t *)ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)((uint8_t *)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)((uint8_t *)ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (unsigned int *)((uint8_t *)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((uint8_t *)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)((uint8_t *)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cq_ring + params.cq_off.cqes);
+	return ring;
+
+failed:
+	uring_free(ring);
+	return NULL;
+}
+
+static int uring_register(struct udf_uring *ring, const struct iovec *iov, unsigned int count)
+{
+	if (ring->registered)
+	{
+		syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+		ring->registered = 0;
+	}
+	if (count == 0)
+		return 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count) < 0)
+		return -1;
+	ring->registered = 1;
+	return 0;
+}
+
+static ssize_t uring_read(struct udf_medium *medium, void *buf, size_t count, uint64_t offset, int index)
+{
+	struct udf_uring *ring = medium->uring;
+	struct uring_segment *segs;
+	uint32_t *retry;
+	size_t num, next = 0, nretry = 0, i;
+	unsigned int inflight = 0, limit;
+	ssize_t ret = 0;
+	int error = 0;
+
+	num = (count + UDF_MEDIUM_SEGMENT - 1) / UDF_MEDIUM_SEGMENT;
+	if (num == 0)
+		return 0;
+
+	segs = calloc(num, sizeof(*segs));
+	retry = malloc(num * sizeof(*retry));
+	if (!segs || !retry)
+	{
+		free(segs);
+		free(retry);
+		return medium_pread(medium->fd, buf, count, offset);
+	}
+	for (i = 0; i < num; ++i)
+		segs[i].length = (i == num - 1) ? count - i * UDF_MEDIUM_SEGMENT : UDF_MEDIUM_SEGMENT;
+
+	limit = medium->depth < ring->entries ? medium->depth : ring->entries;
+
+	while (inflight > 0 || (!error && (next < num || nretry > 0)))
+	{
+		unsigned int tail = *ring->sq_tail;
+		unsigned int head;
+		int to_submit;
+
+		while (!error && inflight < limit && (nretry > 0 || next < num))
+		{
+			struct io_uring_sqe *sqe;
+			uint32_t seg = nretry > 0 ? retry[--nretry] : next++;
+
+			sqe = &ring->sqes[tail & *ring->sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+			sqe->fd = medium->fd;
+			sqe->off = offset + (uint64_t)seg * UDF_MEDIUM_SEGMENT + segs[seg].done;
+			sqe->addr = (uint64_t)(uintptr_t)((uint8_t *)buf + (size_t)seg * UDF_MEDIUM_SEGMENT + segs[seg].done);
+			sqe->len = segs[seg].length - segs[seg].done;
+			if (index >= 0)
+				sqe->buf_index = index;
+			sqe->user_data = seg;
+			ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+			tail++;
+			inflight++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		// Kernel moves SQ head as it consumes entries, so interrupted submission is simply repeated
+		to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			if (error)
+				break;
+			error = errno;
+			// Withdraw entries which kernel did not consume and wait only for those in flight
+			head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+			inflight -= tail - head;
+			__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+		}
+
+		head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			uint32_t seg = (uint32_t)cqe->user_data;
+			int res = cqe->res;
+
+			head++;
+			inflight--;
+			if (res == -EINTR || res == -EAGAIN)
+				retry[nretry++] = seg;
+			else if (res < 0)
+				error = -res;
+			else if (res > 0)
+			{
+				segs[seg].done += res;
+				if (segs[seg].done < segs[seg].length)
+					retry[nretry++] = seg;
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (error)
+	{
+		errno = error;
+		ret = -1;
+	}
+	else
+	{
+		// Like pread(), return the readable part from start, which is shorter at end of medium
+		for (i = 0; i < num; ++i)
+		{
+			ret += segs[i].done;
+			if (segs[i].done < segs[i].length)
+				break;
+		}
+	}
+
+	free(segs);
+	free(retry);
+	return ret;
+}
+
+#else
+
+struct udf_uring
+{
+	int			unused;
+};
+
+static struct udf_uring *uring_init(unsigned int depth)
+{
+	(void)depth;
+	return NULL;
+}
+
+static void uring_free(struct udf_uring *ring)
+{
+	free(ring);
+}
+
+static int uring_register(struct udf_uring *ring, const struct iovec *iov, unsigned int count)
+{
+	(void)ring;
+	(void)iov;
+	(void)count;
+	return -1;
+}
+
+static ssize_t uring_read(struct udf_medium *medium, void *buf, size_t count, uint64_t offset, int index)
+{
+	(void)index;
+	return medium_pread(medium->fd, buf, count, offset);
+}
+
+#endif
+
+/**
+ * @brief Set up access to medium
+ * @param medium medium access to set up
+ * @param fd opened medium
+ * @param io requested backend, UDF_MEDIUM_IO_PREAD or UDF_MEDIUM_IO_URING
+ * @param depth number of requests in flight for io_uring, 0 for default
+ * @return 0 when requested backend is used, 1 when pread fallback is used instead
+ */
+int udf_medium_init(struct udf_medium *medium, int fd, int io, unsigned int depth)
+{
+	memset(medium, 0, sizeof(*medium));
+	medium->fd = fd;
+	medium->io = UDF_MEDIUM_IO_PREAD;
+	medium->depth = depth ? depth : UDF_MEDIUM_QUEUE_DEPTH;
+
+	if (io != UDF_MEDIUM_IO_URING)
+		return 0;
+
+	medium->uring = uring_init(medium->depth);
+	if (!medium->uring)
+		return 1;
+
+	medium->io = UDF_MEDIUM_IO_URING;
+	return 0;
+}
+
+/**
+ * @brief Release medium access, medium itself is not closed
+ */
+void udf_medium_free(struct udf_medium *medium)
+{
+	udf_medium_invalidate(medium);
+	free(medium->windows);
+	medium->windows = NULL;
+
+	if (medium->uring)
+		uring_free(medium->uring);
+	medium->uring = NULL;
+	medium->io = UDF_MEDIUM_IO_PREAD;
+}
+
+/**
+ * @brief Register buffers for fixed buffer reads, replacing previously registered ones
+ * @param medium medium access
+ * @param iov buffers, index in this array is passed to udf_medium_read()
+ * @param count number of buffers, 0 unregisters all buffers
+ * @return 0 on success, -1 when buffers cannot be registered (e.g. locked memory limit)
+ */
+int udf_medium_register(struct udf_medium *medium, const struct iovec *iov, unsigned int count)
+{
+	if (medium->io != UDF_MEDIUM_IO_URING)
+		return -1;
+	return uring_register(medium->uring, iov, count);
+}
+
+/**
+ * @brief Read from medium
+ * @param medium medium access
+ * @param buf destination buffer
+ * @param count number of bytes to read
+ * @param offset position on medium in bytes
+ * @param index index of registered buffer containing whole destination, -1 when not registered
+ * @return number of bytes read, shorter only at end of medium, -1 on error with errno set
+ */
+ssize_t udf_medium_read(struct udf_medium *medium, void *buf, size_t count, uint64_t offset, int index)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	UDF_TRACE_START(medium_read, offset, count, start);
+	if (medium->io == UDF_MEDIUM_IO_URING)
+		ret = uring_read(medium, buf, count, offset, index);
+	else
+		ret = medium_pread(medium->fd, buf, count, offset);
+	UDF_TRACE_DONE(UDF_TRACE_MEDIUM_READ, medium_read, offset, ret, start);
+	return ret;
+}
+
+/**
+ * @brief Read from medium through the window cache
+ * @param medium medium access
+ * @param offset position on medium in bytes
+ * @param count number of bytes to read
+ * @param size size of medium in bytes, windows do not extend beyond it
+ * @return in-memory address of the data, valid until the next call,
+ *         NULL on error with errno set
+ */
+const void *udf_medium_map(struct udf_medium *medium, uint64_t offset, size_t count, uint64_t size)
+{
+	struct udf_medium_window *win;
+	uint64_t start, trace;
+	size_t length;
+	ssize_t ret;
+	uint8_t *buffer;
+	int i;
+
+	if (!medium->windows)
+	{
+		medium->windows = calloc(MEDIUM_WINDOW_COUNT, sizeof(*medium->windows));
+		if (!medium->windows)
+			return NULL;
+	}
+
+	win = &medium->windows[0];
+	for (i = 0; i < MEDIUM_WINDOW_COUNT; ++i)
+	{
+		if (medium->windows[i].length && offset >= medium->windows[i].start && offset + count <= medium->windows[i].start + medium->windows[i].length)
+		{
+			medium->windows[i].stamp = ++medium->stamp;
+			UDF_PROBE(medium_map__hit, offset, count);
+			if (udf_trace_enabled)
+				udf_trace_hit(UDF_TRACE_MEDIUM_MAP);
+			return medium->windows[i].buffer + (offset - medium->windows[i].start);
+		}
+		if (medium->windows[i].stamp < win->stamp)
+			win = &medium->windows[i];
+	}
+
+	start = offset & ~(uint64_t)(MEDIUM_WINDOW_SIZE - 1);
+	length = (offset - start + count + MEDIUM_WINDOW_SIZE - 1) & ~(size_t)(MEDIUM_WINDOW_SIZE - 1);
+	if (start + length > size)
+		length = size - start;
+
+	if (length > win->size)
+	{
+		buffer = realloc(win->buffer, length);
+		if (!buffer)
+			return NULL;
+		win->buffer = buffer;
+		win->size = length;
+	}
+
+	win->length = 0;
+	win->stamp = ++medium->stamp;
+
+	UDF_TRACE_START(medium_map, offset, count, trace);
+	ret = udf_medium_read(medium, win->buffer, length, start, -1);
+	if (ret < 0 || (uint64_t)ret < offset - start + count)
+	{
+		// Whole window is not readable, e.g. bad sector near requested range, so read only the requested range
+		start = offset;
+		ret = udf_medium_read(medium, win->buffer, count, offset, -1);
+		if (ret >= 0 && (size_t)ret != count)
+		{
+			errno = EIO;
+			ret = -1;
+		}
+	}
+	UDF_TRACE_DONE(UDF_TRACE_MEDIUM_MAP, medium_map, offset, ret, trace);
+	if (ret < 0)
+		return NULL;
+
+	win->start = start;
+	win->length = ret;
+	return win->buffer + (offset - start);
+}
+
+/**
+ * @brief Find the first byte of range which may contain data
+ *
+ * Holes of sparse image files read back as zeros and need not be read. Media
+ * without hole information (block devices, file systems without SEEK_DATA)
+ * report the whole range as data.
+ * @param medium medium access
+ * @param offset start of range in bytes
+ * @param end end of range in bytes
+ * @return offset of data, end when the rest of range is a hole
+ */
+uint64_t udf_medium_next_data(struct udf_medium *medium, uint64_t offset, uint64_t end)
+{
+#ifdef SEEK_DATA
+	off_t data;
+
+	if (offset >= end || medium->no_holes)
+		return offset;
+
+	data = lseek(medium->fd, offset, SEEK_DATA);
+	if (data < 0)
+	{
+		// ENXIO means that there is no data up to end of file
+		if (errno == ENXIO)
+			return end;
+		medium->no_holes = 1;
+		return offset;
+	}
+	return (uint64_t)data < end ? (uint64_t)data : end;
+#else
+	(void)medium;
+	(void)end;
+	return offset;
+#endif
+}
+
+/**
+ * @brief Drop all data cached by udf_medium_map(), needed after medium was written
+ */
+void udf_medium_invalidate(struct udf_medium *medium)
+{
+	int i;
+
+	if (!medium->windows)
+		return;
+
+	for (i = 0; i < MEDIUM_WINDOW_COUNT; ++i)
+		free(medium->windows[i].buffer);
+	memset(medium->windows, 0, MEDIUM_WINDOW_COUNT * sizeof(*medium->windows));
+	medium->stamp = 0;
+}
+
+/**
+ * @brief Parse name of backend
+ * @return UDF_MEDIUM_IO_* value, -1 for unknown name
+ */
+int udf_medium_parse_io(const char *name)
+{
+	if (strcmp(name, "pread") == 0)
+		return UDF_MEDIUM_IO_PREAD;
+	if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+		return UDF_MEDIUM_IO_URING;
+	return -1;
+}
+
+/**
+ * @brief Name of backend
+ */
+const char *udf_medium_io_name(int io)
+{
+	return io == UDF_MEDIUM_IO_URING ? "io_uring" : "pread";
+}
@@ -0,0 +1,207 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * libudffs bit counting functions for space bitmaps
+ *
+ * Kernels take an optional second buffer: when it is given, bits of the
+ * exclusive or of both buffers are counted, which is used for comparing
+ * bitmaps. The fastest kernel supported by the running CPU is selected on
+ * the first call.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "libudffs.h"
+
+static uint64_t (*popcount_func)(const uint8_t *, const uint8_t *, size_t);
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * @brief portable kernel, also used for tails of vector kernels
+ */
+static uint64_t popcount_generic(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	uint64_t count = 0;
+	uint64_t val;
+	size_t i;
+
+	for (i = 0; i + 8 <= length; i += 8)
+	{
+		val = load64(a + i);
+		if (b)
+			val ^= load64(b + i);
+		count += __builtin_popcountll(val);
+	}
+
+	for (; i < length; ++i)
+		count += __builtin_popcount(b ? a[i] ^ b[i] : a[i]);
+
+	return count;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+
+#include <immintrin.h>
+
+/**
+ * @brief the same as popcount_generic() but compiled with POPCNT instruction
+ */
+__attribute__((target("popcnt")))
+static uint64_t popcount_popcnt(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	uint64_t count = 0;
+	uint64_t val;
+	size_t i;
+
+	for (i = 0; i + 8 <= length; i += 8)
+	{
+		val = load64(a + i);
+		if (b)
+			val ^= load64(b + i);
+		count += __builtin_popcountll(val);
+	}
+
+	for (; i < length; ++i)
+		count += __builtin_popcount(b ? a[i] ^ b[i] : a[i]);
+
+	return count;
+}
+
+/**
+ * @brief AVX2 kernel, nibbles are counted by table lookup with VPSHUFB
+ *
+ * Per byte counts are summed in 8 bit lanes for at most 31 vectors (at most
+ * 248 per lane) and then folded into 64 bit lanes by VPSADBW.
+ */
+__attribute__((target("avx2,popcnt")))
+static uint64_t popcount_avx2(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc = zero;
+	__m256i local, v;
+	size_t i = 0;
+	int n;
+
+	while (i + 32 <= length)
+	{
+		local = zero;
+		for (n = 0; n < 31 && i + 32 <= length; ++n, i += 32)
+		{
+			v = _mm256_loadu_si256((const __m256i *)(a + i));
+			if (b)
+				v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)(b + i)));
+			local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)));
+			local = _mm256_add_epi8(local, _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+		}
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(local, zero));
+	}
+
+	return (uint64_t)_mm256_extract_epi64(acc, 0) + (uint64_t)_mm256_extract_epi64(acc, 1) +
+	       (uint64_t)_mm256_extract_epi64(acc, 2) + (uint64_t)_mm256_extract_epi64(acc, 3) +
+	       popcount_popcnt(a + i, b ? b + i : NULL, length - i);
+}
+
+/**
+ * @brief AVX-512 kernel using VPOPCNTQ
+ */
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static uint64_t popcount_avx512(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	__m512i acc = _mm512_setzero_si512();
+	__m512i v;
+	size_t i;
+
+	for (i = 0; i + 64 <= length; i += 64)
+	{
+		v = _mm512_loadu_si512((const void *)(a + i));
+		if (b)
+			v = _mm512_xor_si512(v, _mm512_loadu_si512((const void *)(b + i)));
+		acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
+	}
+
+	return (uint64_t)_mm512_reduce_add_epi64(acc) + popcount_popcnt(a + i, b ? b + i : NULL, length - i);
+}
+
+#endif /* defined(__GNUC__) && defined(__x86_64__) */
+
+static void popcount_init(void)
+{
+	uint64_t (*func)(const uint8_t *, const uint8_t *, size_t) = popcount_generic;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vpopcntdq"))
+		func = popcount_avx512;
+	else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		func = popcount_avx2;
+	else if (__builtin_cpu_supports("popcnt"))
+		func = popcount_popcnt;
+#endif
+
+	__atomic_store_n(&popcount_func, func, __ATOMIC_RELEASE);
+}
+
+static uint64_t popcount_dispatch(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	uint64_t (*func)(const uint8_t *, const uint8_t *, size_t);
+
+	func = __atomic_load_n(&popcount_func, __ATOMIC_ACQUIRE);
+	if (!func)
+	{
+		popcount_init();
+		func = popcount_func;
+	}
+
+	return func(a, b, length);
+}
+
+/**
+ * @brief count set bits in buffer
+ * @param data pointer to buffer
+ * @param length length of buffer in bytes
+ * @return number of set bits
+ */
+uint64_t udf_popcount(const uint8_t *data, size_t length)
+{
+	return popcount_dispatch(data, NULL, length);
+}
+
+/**
+ * @brief count bits which differ between two buffers
+ * @param a pointer to first buffer
+ * @param b pointer to second buffer
+ * @param length length of both buffers in bytes
+ * @return number of differing bits
+ */
+uint64_t udf_popcount_xor(const uint8_t *a, const uint8_t *b, size_t length)
+{
+	return popcount_dispatch(a, b, length);
+}
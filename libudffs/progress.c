@@ -0,0 +1,374 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * libudffs progress reporting of long running tools
+ *
+ * Work loops only add to counters by udf_progress_add(), which is one
+ * relaxed atomic addition, or nothing when progress is not reported. All
+ * formatting and output is done by a reporter thread which wakes up every
+ * UDF_PROGRESS_INTERVAL seconds or when SIGUSR1 arrives. SIGUSR1 is blocked
+ * by udf_progress_start() and taken by sigtimedwait() of the reporter, so
+ * threads started later inherit the blocked signal and no handler runs in
+ * the work loops.
+ *
+ * Progress goes to one target:
+ *	-	standard error, one line rewritten in place on a terminal
+ *	fd:N	one line per report appended to file descriptor N
+ *	FILE	status file with key=value lines, replaced by every report
+ *
+ * SIGUSR1 writes a report to the target and one line to standard error.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libudffs.h"
+
+int udf_progress_enabled = 0;
+uint64_t udf_progress_counters[UDF_PROGRESS_COUNTERS];
+
+static const char *progress_names[UDF_PROGRESS_COUNTERS] = {
+	"bytes_read",
+	"bytes_written",
+	"descriptors",
+	"files",
+};
+
+static struct
+{
+	const char	*tool;
+	int		fd;		/* target descriptor, -1 for status file */
+	char		*path;		/* status file */
+	int		terminal;	/* line is rewritten in place */
+	size_t		width;		/* length of line shown on terminal */
+	uint64_t	totals[UDF_PROGRESS_COUNTERS];
+	uint64_t	last[UDF_PROGRESS_COUNTERS];
+	double		start;
+	double		prev;		/* time of last report */
+	pthread_t	thread;
+	int		running;
+	int		stop;
+} progress;
+
+static double progress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int progress_time(char *buf, size_t size, double seconds)
+{
+	unsigned long s = seconds > 0 ? (unsigned long)seconds : 0;
+
+	return snprintf(buf, size, "%lu:%02lu:%02lu", s / 3600, (s / 60) % 60, s % 60);
+}
+
+/**
+ * @brief seconds left until counter with known total reaches it
+ * @return -1 when no counter has total or there is no progress yet
+ */
+static double progress_eta(const uint64_t *values, double elapsed, int *counter)
+{
+	int i;
+
+	for (i = 0; i < UDF_PROGRESS_COUNTERS; i++)
+	{
+		if (!progress.totals[i])
+			continue;
+		*counter = i;
+		if (!values[i] || elapsed <= 0)
+			return -1;
+		if (values[i] >= progress.totals[i])
+			return 0;
+		return (progress.totals[i] - values[i]) * elapsed / values[i];
+	}
+	*counter = -1;
+	return -1;
+}
+
+/**
+ * @brief format one line report, rates are calculated over interval since previous report
+ */
+static size_t progress_line(char *buf, size_t size, const uint64_t *values, double now)
+{
+	double elapsed = now - progress.start;
+	double interval = now - progress.prev;
+	double eta;
+	size_t len;
+	int counter;
+	int i;
+
+	len = snprintf(buf, size, "%s: ", progress.tool);
+	len += progress_time(buf + len, size - len, elapsed);
+
+	for (i = 0; i < UDF_PROGRESS_COUNTERS && len < size; i++)
+	{
+		double rate = interval > 0 ? (values[i] - progress.last[i]) / interval : 0;
+
+		if (!values[i])
+			continue;
+		if (i == UDF_PROGRESS_READ || i == UDF_PROGRESS_WRITTEN)
+			len += snprintf(buf + len, size - len, ", %s %.1f MiB (%.1f MiB/s)",
+					i == UDF_PROGRESS_READ ? "read" : "written",
+					values[i] / 1048576.0, rate / 1048576.0);
+		else
+			len += snprintf(buf + len, size - len, ", %"PRIu64" %s (%.0f/s)",
+					values[i], progress_names[i], rate);
+	}
+
+	eta = progress_eta(values, elapsed, &counter);
+	if (counter >= 0 && len < size)
+	{
+		uint64_t percent = values[counter] >= progress.totals[counter] ? 100 : values[counter] * 100 / progress.totals[counter];
+
+		len += snprintf(buf + len, size - len, ", %"PRIu64"%%", percent);
+		if (eta >= 0 && len < size)
+		{
+			len += snprintf(buf + len, size - len, ", ETA ");
+			len += progress_time(buf + len, size - len, eta);
+		}
+	}
+	return len < size ? len : size - 1;
+}
+
+static void progress_write(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/**
+ * @brief replace status file by current counters
+ */
+static void progress_status(const uint64_t *values, double now)
+{
+	size_t pathlen = strlen(progress.path);
+	char tmp[pathlen + 5];
+	char buf[512];
+	double elapsed = now - progress.start;
+	double eta;
+	size_t len;
+	int counter;
+	int fd;
+	int i;
+
+	len = snprintf(buf, sizeof(buf), "tool=%s\nelapsed=%.0f\n", progress.tool, elapsed);
+	for (i = 0; i < UDF_PROGRESS_COUNTERS; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%s=%"PRIu64"\n", progress_names[i], values[i]);
+	eta = progress_eta(values, elapsed, &counter);
+	if (counter >= 0)
+	{
+		len += snprintf(buf + len, sizeof(buf) - len, "total_%s=%"PRIu64"\n", progress_names[counter], progress.totals[counter]);
+		if (eta >= 0)
+			len += snprintf(buf + len, sizeof(buf) - len, "eta=%.0f\n", eta);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.new", progress.path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	progress_write(fd, buf, len);
+	close(fd);
+	rename(tmp, progress.path);
+}
+
+static void progress_report(int signal)
+{
+	uint64_t values[UDF_PROGRESS_COUNTERS];
+	double now = progress_now();
+	char line[512];
+	size_t len;
+	int i;
+
+	for (i = 0; i < UDF_PROGRESS_COUNTERS; i++)
+		values[i] = __atomic_load_n(&udf_progress_counters[i], __ATOMIC_RELAXED);
+
+	len = progress_line(line + 1, sizeof(line) - 2, values, now);
+	if (progress.path)
+		progress_status(values, now);
+	else if (progress.terminal)
+	{
+		// Pad over the end of previous line
+		line[0] = '\r';
+		while (len < progress.width && len < sizeof(line) - 2)
+			line[1 + len++] = ' ';
+		progress.width = len;
+		progress_write(progress.fd, line, len + 1);
+	}
+	else
+	{
+		line[1 + len] = '\n';
+		progress_write(progress.fd, line + 1, len + 1);
+	}
+
+	if (signal && (progress.path || progress.fd != STDERR_FILENO))
+	{
+		len = progress_line(line, sizeof(line) - 1, values, now);
+		line[len] = '\n';
+		progress_write(STDERR_FILENO, line, len + 1);
+	}
+
+	memcpy(progress.last, values, sizeof(values));
+	progress.prev = now;
+}
+
+static void *progress_thread(void *arg)
+{
+	struct timespec timeout = { UDF_PROGRESS_INTERVAL, 0 };
+	sigset_t set;
+	int sig;
+
+	(void)arg;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	for (;;)
+	{
+		sig = sigtimedwait(&set, NULL, &timeout);
+		if (__atomic_load_n(&progress.stop, __ATOMIC_ACQUIRE))
+			break;
+		if (sig < 0 && errno == EINTR)
+			continue;
+		progress_report(sig == SIGUSR1);
+	}
+	return NULL;
+}
+
+/**
+ * @brief start reporting progress
+ *
+ * Must be called before the tool starts other threads, they have to inherit
+ * blocked SIGUSR1.
+ *
+ * @param tool name printed in reports
+ * @param target - for standard error, fd:N for file descriptor or path of status file
+ * @return 0 on success, -1 on failure with errno set
+ */
+int udf_progress_start(const char *tool, const char *target)
+{
+	static int registered = 0;
+	sigset_t set;
+	char *end;
+	long fd;
+
+	if (progress.running)
+		return 0;
+
+	memset(&progress, 0, sizeof(progress));
+	progress.tool = tool;
+	if (!strcmp(target, "-"))
+	{
+		progress.fd = STDERR_FILENO;
+		progress.terminal = isatty(STDERR_FILENO);
+	}
+	else if (!strncmp(target, "fd:", 3))
+	{
+		errno = 0;
+		fd = strtol(target + 3, &end, 10);
+		if (errno || end == target + 3 || *end || fd < 0 || fd > INT32_MAX || fcntl(fd, F_GETFD) < 0)
+		{
+			errno = EBADF;
+			return -1;
+		}
+		progress.fd = fd;
+	}
+	else
+	{
+		progress.fd = -1;
+		progress.path = strdup(target);
+		if (!progress.path)
+			return -1;
+	}
+
+	progress.start = progress.prev = progress_now();
+	memset(udf_progress_counters, 0, sizeof(udf_progress_counters));
+	__atomic_store_n(&udf_progress_enabled, 1, __ATOMIC_RELAXED);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	errno = pthread_create(&progress.thread, NULL, progress_thread, NULL);
+	if (errno)
+	{
+		udf_progress_enabled = 0;
+		free(progress.path);
+		progress.path = NULL;
+		return -1;
+	}
+	progress.running = 1;
+
+	// Terminal line is finished also when the tool exits on error
+	if (!registered)
+		registered = atexit(udf_progress_stop) == 0;
+	return 0;
+}
+
+/**
+ * @brief set total of counter, estimated time is calculated from the first counter with total
+ * @param counter UDF_PROGRESS_* counter
+ * @param total expected final value, 0 when not known
+ */
+void udf_progress_total(unsigned int counter, uint64_t total)
+{
+	if (counter < UDF_PROGRESS_COUNTERS)
+		progress.totals[counter] = total;
+}
+
+/**
+ * @brief stop reporting progress, final report is written
+ *
+ * SIGUSR1 stays blocked, so a late signal does not terminate the tool.
+ */
+void udf_progress_stop(void)
+{
+	if (!progress.running)
+		return;
+
+	__atomic_store_n(&progress.stop, 1, __ATOMIC_RELEASE);
+	pthread_kill(progress.thread, SIGUSR1);
+	pthread_join(progress.thread, NULL);
+	progress.running = 0;
+	udf_progress_enabled = 0;
+
+	progress_report(0);
+	if (progress.terminal)
+		progress_write(progress.fd, "\n", 1);
+	free(progress.path);
+	progress.path = NULL;
+}
@@ -16,9 +16,21 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/**
+ * @file
+ * libudffs reader of UDF volume structures, used by udfinfo and udflabel
+ *
+ * udf_read_disc() detects VRS and anchors, scans the volume descriptor
+ * sequences and integrity sequence and reads Sparing Table, VAT, Metadata File
+ * extents and File Set Descriptor into a udf_disc. All reads go through the window cache of the
+ * udf_medium, see udf_medium_map(). The Sparing Table map is built on first
+ * use. udf_read_blocks() reads logical blocks of any partition afterwards.
+ */
+
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -33,48 +45,52 @@
 #include <sys/ioctl.h>
 
 #include "libudffs.h"
-#include "readdisc.h"
 
-static int read_offset(int fd, struct udf_disc *disc, void *buf, off_t offset, size_t count, int warn_beyond)
+/* Space bitmaps are counted in pieces of this size */
+#define BITMAP_CHUNK_SIZE	(1024*1024)
+
+static const void *read_range(struct udf_medium *medium, struct udf_disc *disc, off_t offset, size_t count, int warn_beyond)
 {
-	off_t off;
-	ssize_t ret;
+	off_t disk_size = (off_t)disc->blocks * disc->blocksize;
+	const void *ptr;
 
-	if (offset + (off_t)count > (off_t)disc->blocks * disc->blocksize)
+	if (offset + (off_t)count > disk_size)
 	{
 		if (warn_beyond)
 			fprintf(stderr, "%s: Warning: Trying to read beyond end of disk\n", appname);
-		return -1;
-	}
-
-	off = lseek(fd, offset, SEEK_SET);
-	if (off != (off_t)-1 && off != offset)
-	{
-		errno = EIO;
-		off = (off_t)-1;
-	}
-	if (off == (off_t)-1)
-	{
-		fprintf(stderr, "%s: Warning: lseek failed: %s\n", appname, strerror(errno));
-		return -1;
+		return NULL;
 	}
 
-	ret = read(fd, buf, count);
-	if (ret >= 0 && (size_t)ret != count)
-	{
-		errno = EIO;
-		ret = -1;
-	}
-	if (ret < 0)
-	{
+	ptr = udf_medium_map(medium, offset, count, disk_size);
+	if (!ptr)
 		fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno));
+	return ptr;
+}
+
+static int read_offset(struct udf_medium *medium, struct udf_disc *disc, void *buf, off_t offset, size_t count, int warn_beyond)
+{
+	const void *ptr = read_range(medium, disc, offset, count, warn_beyond);
+
+	if (!ptr)
 		return -1;
-	}
 
+	memcpy(buf, ptr, count);
 	return 0;
 }
 
-static int read_vrs(int fd, struct udf_disc *disc, int *bea, int *nsr, int *tea)
+static void read_hint(struct udf_medium *medium, struct udf_disc *disc, off_t offset, off_t length)
+{
+	off_t disk_size = (off_t)disc->blocks * disc->blocksize;
+
+	if (offset >= disk_size)
+		return;
+	if (offset + length > disk_size)
+		length = disk_size - offset;
+
+	posix_fadvise(medium->fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
+static int read_vrs(struct udf_medium *medium, struct udf_disc *disc, int *bea, int *nsr, int *tea)
 {
 	struct volStructDesc vsd;
 	uint32_t vsd_len;
@@ -89,7 +105,7 @@ static int read_vrs(int fd, struct udf_disc *disc, int *bea, int *nsr, int *tea)
 	{
 		if (32768 + i*vsd_len >= 256*disc->blocksize)
 			break;
-		if (read_offset(fd, disc, &vsd, 32768 + i*vsd_len, sizeof(vsd), 0) < 0)
+		if (read_offset(medium, disc, &vsd, 32768 + i*vsd_len, sizeof(vsd), 0) < 0)
 			break;
 		if (!vsd.stdIdent[0])
 			break;
@@ -181,28 +197,28 @@ static void setup_vrs(struct udf_disc *disc, int bea, int nsr, int tea)
 
 	if (disc->blocksize >= 2048)
 	{
-		set_desc(ext, 0x00, nsr, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[1], sizeof(struct volStructDesc)));
+		set_desc(disc, ext, 0x00, nsr, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[1], sizeof(struct volStructDesc)));
 		if (bea != -1)
-			set_desc(ext, 0x00, bea, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[0], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, bea, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[0], sizeof(struct volStructDesc)));
 		if (tea != -1)
-			set_desc(ext, 0x00, tea, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[2], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, tea, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[2], sizeof(struct volStructDesc)));
 	}
 	else
 	{
-		set_desc(ext, 0x00, nsr * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[1], sizeof(struct volStructDesc)));
+		set_desc(disc, ext, 0x00, nsr * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[1], sizeof(struct volStructDesc)));
 		if (bea != -1)
-			set_desc(ext, 0x00, bea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[0], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, bea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[0], sizeof(struct volStructDesc)));
 		if (tea != -1)
-			set_desc(ext, 0x00, tea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[2], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, tea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[2], sizeof(struct volStructDesc)));
 	}
 }
 
-static int read_anchor_i(int fd, struct udf_disc *disc, int i, uint32_t location)
+static int read_anchor_i(struct udf_medium *medium, struct udf_disc *disc, int i, uint32_t location)
 {
 	struct anchorVolDescPtr avdp;
 	struct udf_extent *ext;
 
-	if (read_offset(fd, disc, &avdp, (off_t)location * disc->blocksize, sizeof(avdp), 1) < 0)
+	if (read_offset(medium, disc, &avdp, (off_t)location * disc->blocksize, sizeof(avdp), 1) < 0)
 		return -2;
 
 	if (le32_to_cpu(avdp.descTag.tagLocation) != location)
@@ -220,29 +236,29 @@ static int read_anchor_i(int fd, struct udf_disc *disc, int i, uint32_t location
 	memcpy(disc->udf_anchor[i], &avdp, sizeof(avdp));
 
 	ext = set_extent(disc, ANCHOR, location, 1);
-	set_desc(ext, TAG_IDENT_AVDP, 0, sizeof(avdp), alloc_data(disc->udf_anchor[i], sizeof(avdp)));
+	set_desc(disc, ext, TAG_IDENT_AVDP, 0, sizeof(avdp), alloc_data(disc, disc->udf_anchor[i], sizeof(avdp)));
 
 	return 0;
 }
 
-static int read_anchor_first(int fd, struct udf_disc *disc)
+static int read_anchor_first(struct udf_medium *medium, struct udf_disc *disc)
 {
-	return read_anchor_i(fd, disc, 0, 256);
+	return read_anchor_i(medium, disc, 0, 256);
 }
 
-static int read_anchor_second(int fd, struct udf_disc *disc)
+static int read_anchor_second(struct udf_medium *medium, struct udf_disc *disc)
 {
 	int ret1, ret2;
 
 	if (disc->blocks > 257 && (off_t)(disc->blocks - 257) * disc->blocksize > (off_t)32768 + disc->blocksize && disc->blocks - 257 != 256)
-		ret1 = read_anchor_i(fd, disc, 1, disc->blocks - 257);
+		ret1 = read_anchor_i(medium, disc, 1, disc->blocks - 257);
 	else
 		ret1 = -2;
 	if (ret1 == -1)
 		return -1;
 
 	if ((off_t)(disc->blocks - 1) * disc->blocksize > (off_t)32768 + disc->blocksize && disc->blocks - 1 != 256)
-		ret2 = read_anchor_i(fd, disc, 2, disc->blocks - 1);
+		ret2 = read_anchor_i(medium, disc, 2, disc->blocks - 1);
 	else
 		ret2 = -2;
 	if (ret2 == -1)
@@ -264,18 +280,18 @@ static int read_anchor_second(int fd, struct udf_disc *disc)
 	return 0;
 }
 
-static int read_anchor_512(int fd, struct udf_disc *disc)
+static int read_anchor_512(struct udf_medium *medium, struct udf_disc *disc)
 {
 	int ret;
 
-	ret = read_anchor_i(fd, disc, 0, 512);
+	ret = read_anchor_i(medium, disc, 0, 512);
 	if (ret == 0)
 		fprintf(stderr, "%s: Warning: First, second and third Anchor Volume Descriptor Pointer not found, but found on sector 512, using it\n", appname);
 
 	return ret;
 }
 
-static int detect_vrs_and_anchor(int fd, struct udf_disc *disc, int id, int *found_vrs, int *vsd_2048_valid, int *bea, int *nsr, int *tea)
+static int detect_vrs_and_anchor(struct udf_medium *medium, struct udf_disc *disc, int id, int *found_vrs, int *vsd_2048_valid, int *bea, int *nsr, int *tea)
 {
 	int ret;
 
@@ -293,7 +309,7 @@ static int detect_vrs_and_anchor(int fd, struct udf_disc *disc, int id, int *fou
 		disc->udf_vrs[1] = NULL;
 		disc->udf_vrs[2] = NULL;
 
-		ret = read_vrs(fd, disc, bea, nsr, tea);
+		ret = read_vrs(medium, disc, bea, nsr, tea);
 		if (ret == -2)
 		{
 			if (disc->blocksize <= 2048)
@@ -310,18 +326,18 @@ static int detect_vrs_and_anchor(int fd, struct udf_disc *disc, int id, int *fou
 	}
 
 	if (id == 0)
-		return read_anchor_first(fd, disc);
+		return read_anchor_first(medium, disc);
 	else if (id == 1)
-		return read_anchor_second(fd, disc);
+		return read_anchor_second(medium, disc);
 	else if (id == 2)
-		return read_anchor_512(fd, disc);
+		return read_anchor_512(medium, disc);
 	{
 		fprintf(stderr, "%s: Error: Wrong Anchor type\n", appname);
 		exit(1);
 	}
 }
 
-static int detect_udf(int fd, struct udf_disc *disc)
+static int detect_udf(struct udf_medium *medium, struct udf_disc *disc)
 {
 	int ret, ret2;
 	int bea, nsr, tea;
@@ -336,7 +352,7 @@ static int detect_udf(int fd, struct udf_disc *disc)
 
 		setup_blocks(disc);
 
-		ret = read_vrs(fd, disc, &bea, &nsr, &tea);
+		ret = read_vrs(medium, disc, &bea, &nsr, &tea);
 		if (ret < 0)
 		{
 			if (ret == -2)
@@ -344,13 +360,13 @@ static int detect_udf(int fd, struct udf_disc *disc)
 			return -1;
 		}
 
-		ret = read_anchor_first(fd, disc);
-		ret2 = read_anchor_second(fd, disc);
+		ret = read_anchor_first(medium, disc);
+		ret2 = read_anchor_second(medium, disc);
 		if (ret < 0 && ret2 < 0)
 		{
 			if (ret == -2 || ret2 == -2)
 			{
-				ret = read_anchor_512(fd, disc);
+				ret = read_anchor_512(medium, disc);
 				if (ret < 0)
 				{
 					fprintf(stderr, "%s: Error: UDF Volume Recognition Sequence found but not Anchor Volume Descriptor Pointer, maybe wrong --blocksize?\n", appname);
@@ -368,13 +384,13 @@ static int detect_udf(int fd, struct udf_disc *disc)
 	{
 		disc->blocksize = disc->blkssz;
 		setup_blocks(disc);
-		ret = read_vrs(fd, disc, &bea, &nsr, &tea);
+		ret = read_vrs(medium, disc, &bea, &nsr, &tea);
 		if (ret != -2)
 		{
 			if (ret != 0)
 				return -1;
-			ret = read_anchor_first(fd, disc);
-			ret2 = read_anchor_second(fd, disc);
+			ret = read_anchor_first(medium, disc);
+			ret2 = read_anchor_second(medium, disc);
 			if (ret == 0 || ret2 == 0)
 			{
 				setup_vrs(disc, bea, nsr, tea);
@@ -382,7 +398,7 @@ static int detect_udf(int fd, struct udf_disc *disc)
 			}
 			else if (ret == -2 || ret2 == -2)
 			{
-				ret = read_anchor_512(fd, disc);
+				ret = read_anchor_512(medium, disc);
 				if (ret < 0 && ret != -2)
 					return -1;
 				else if (ret == 0)
@@ -402,7 +418,7 @@ static int detect_udf(int fd, struct udf_disc *disc)
 			tea = tea_2048;
 		}
 
-		ret = detect_vrs_and_anchor(fd, disc, 0, &found_vrs, &vsd_2048_valid, &bea, &nsr, &tea);
+		ret = detect_vrs_and_anchor(medium, disc, 0, &found_vrs, &vsd_2048_valid, &bea, &nsr, &tea);
 
 		if (disc->blocksize <= 2048 && vsd_2048_valid)
 		{
@@ -416,7 +432,7 @@ static int detect_udf(int fd, struct udf_disc *disc)
 		else if (ret < 0)
 			return ret;
 
-		ret = read_anchor_second(fd, disc);
+		ret = read_anchor_second(medium, disc);
 		if (ret == -1)
 			return -1;
 
@@ -427,7 +443,7 @@ static int detect_udf(int fd, struct udf_disc *disc)
 	{
 		for (disc->blocksize = 512; disc->blocksize <= 32768; disc->blocksize *= 2)
 		{
-			ret = detect_vrs_and_anchor(fd, disc, 1, &found_vrs, &vsd_2048_valid, &bea, &nsr, &tea);
+			ret = detect_vrs_and_anchor(medium, disc, 1, &found_vrs, &vsd_2048_valid, &bea, &nsr, &tea);
 			if (ret == -3 || ret == -2)
 				continue;
 			else if (ret < 0)
@@ -440,7 +456,7 @@ static int detect_udf(int fd, struct udf_disc *disc)
 		{
 			for (disc->blocksize = 512; disc->blocksize <= 32768; disc->blocksize *= 2)
 			{
-				ret = detect_vrs_and_anchor(fd, disc, 2, &found_vrs, &vsd_2048_valid, &bea, &nsr, &tea);
+				ret = detect_vrs_and_anchor(medium, disc, 2, &found_vrs, &vsd_2048_valid, &bea, &nsr, &tea);
 				if (ret == -3 || ret == -2)
 					continue;
 				else if (ret < 0)
@@ -478,11 +494,11 @@ static int detect_udf(int fd, struct udf_disc *disc)
 	return 0;
 }
 
-static void read_mbr(int fd, struct udf_disc *disc)
+static void read_mbr(struct udf_medium *medium, struct udf_disc *disc)
 {
 	struct mbr mbr;
 
-	if (read_offset(fd, disc, &mbr, 0, sizeof(mbr), 1) < 0)
+	if (read_offset(medium, disc, &mbr, 0, sizeof(mbr), 1) < 0)
 		return;
 
 	if (le16_to_cpu(mbr.boot_signature) != MBR_BOOT_SIGNATURE)
@@ -503,7 +519,7 @@ static int choose_anchor(struct udf_disc *disc)
 		return -1;
 }
 
-static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
+static int scan_vds(struct udf_medium *medium, struct udf_disc *disc, enum udf_space_type vds_type)
 {
 	uint32_t location, length, count, i;
 	uint32_t next_location, next_length, next_count;
@@ -581,6 +597,8 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 		if (count > 256)
 			length = 256 * disc->blocksize;
 
+		read_hint(medium, disc, (off_t)location * disc->blocksize, length);
+
 		done = 0;
 
 		for (i = 0; i < count; ++i)
@@ -591,7 +609,7 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 				break;
 			}
 
-			if (read_offset(fd, disc, &buffer, ((off_t)location+i) * disc->blocksize, sizeof(buffer), 1) < 0)
+			if (read_offset(medium, disc, &buffer, ((off_t)location+i) * disc->blocksize, sizeof(buffer), 1) < 0)
 				return -3;
 
 			gd_ptr = (struct genericDesc *)&buffer;
@@ -620,7 +638,7 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 						return -1;
 					}
 					memcpy(gd_ptr, &buffer, sizeof(buffer));
-					set_desc(ext, type, i, sizeof(buffer), alloc_data(gd_ptr, sizeof(buffer)));
+					set_desc(disc, ext, type, i, sizeof(buffer), alloc_data(disc, gd_ptr, sizeof(buffer)));
 
 					switch (type)
 					{
@@ -710,16 +728,14 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 					else
 					{
 						memcpy(lvd, &buffer, sizeof(buffer));
-						errno = 0;
-						if (read(fd, (uint8_t *)lvd + sizeof(buffer), gd_length - sizeof(buffer)) != (ssize_t)(gd_length - sizeof(buffer)))
+						if (read_offset(medium, disc, (uint8_t *)lvd + sizeof(buffer), ((off_t)location+i) * disc->blocksize + sizeof(buffer), gd_length - sizeof(buffer), 1) < 0)
 						{
-							fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
 							free(lvd);
 							return -3;
 						}
 					}
 
-					set_desc(ext, TAG_IDENT_LVD, i, gd_length, alloc_data(lvd, gd_length));
+					set_desc(disc, ext, TAG_IDENT_LVD, i, gd_length, alloc_data(disc, lvd, gd_length));
 
 					if (gd_length > disc->blocksize)
 						i += (gd_length + (disc->blocksize-1)) / disc->blocksize - 1;
@@ -770,16 +786,14 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 					else
 					{
 						memcpy(usd, &buffer, sizeof(buffer));
-						errno = 0;
-						if (read(fd, (uint8_t *)usd + sizeof(buffer), gd_length - sizeof(buffer)) != (ssize_t)(gd_length - sizeof(buffer)))
+						if (read_offset(medium, disc, (uint8_t *)usd + sizeof(buffer), ((off_t)location+i) * disc->blocksize + sizeof(buffer), gd_length - sizeof(buffer), 1) < 0)
 						{
-							fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
 							free(usd);
 							return -3;
 						}
 					}
 
-					set_desc(ext, TAG_IDENT_USD, i, gd_length, alloc_data(usd, gd_length));
+					set_desc(disc, ext, TAG_IDENT_USD, i, gd_length, alloc_data(disc, usd, gd_length));
 
 					if (gd_length > disc->blocksize)
 						i += (gd_length + (disc->blocksize-1)) / disc->blocksize - 1;
@@ -798,29 +812,29 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 	return 0;
 }
 
-static void scan_mvds(int fd, struct udf_disc *disc)
+static void scan_mvds(struct udf_medium *medium, struct udf_disc *disc)
 {
 	int ret;
 
-	ret = scan_vds(fd, disc, MVDS);
+	ret = scan_vds(medium, disc, MVDS);
 	if (ret == -2)
 		fprintf(stderr, "%s: Warning: Main Volume Descriptor Sequence not found\n", appname);
 	else if (ret == -3)
 		fprintf(stderr, "%s: Warning: Main Volume Descriptor Sequence is damaged\n", appname);
 }
 
-static void scan_rvds(int fd, struct udf_disc *disc)
+static void scan_rvds(struct udf_medium *medium, struct udf_disc *disc)
 {
 	int ret;
 
-	ret = scan_vds(fd, disc, RVDS);
+	ret = scan_vds(medium, disc, RVDS);
 	if (ret == -2)
 		fprintf(stderr, "%s: Warning: Reserve Volume Descriptor Sequence not found\n", appname);
 	else if (ret == -3)
 		fprintf(stderr, "%s: Warning: Reserve Volume Descriptor Sequence is damaged\n", appname);
 }
 
-static void scan_lvis(int fd, struct udf_disc *disc)
+static void scan_lvis(struct udf_medium *medium, struct udf_disc *disc)
 {
 	uint32_t location, length;
 	uint32_t next_location, next_length;
@@ -853,7 +867,9 @@ static void scan_lvis(int fd, struct udf_disc *disc)
 			break;
 		}
 
-		if (read_offset(fd, disc, &buffer, (off_t)location * disc->blocksize, sizeof(buffer), 1) < 0)
+		read_hint(medium, disc, (off_t)location * disc->blocksize, length);
+
+		if (read_offset(medium, disc, &buffer, (off_t)location * disc->blocksize, sizeof(buffer), 1) < 0)
 			return;
 
 		descTag = (tag *)&buffer;
@@ -907,17 +923,15 @@ static void scan_lvis(int fd, struct udf_disc *disc)
 		else
 		{
 			memcpy(lvid, &buffer, sizeof(buffer));
-			errno = 0;
-			if (read(fd, (uint8_t *)lvid + sizeof(buffer), lvid_length - sizeof(buffer)) != (ssize_t)(lvid_length - sizeof(buffer)))
+			if (read_offset(medium, disc, (uint8_t *)lvid + sizeof(buffer), (off_t)location * disc->blocksize + sizeof(buffer), lvid_length - sizeof(buffer), 1) < 0)
 			{
-				fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
 				free(lvid);
 				break;
 			}
 		}
 
 		ext = set_extent(disc, LVID, location, (lvid_length + disc->blocksize-1) / disc->blocksize);
-		set_desc(ext, TAG_IDENT_LVID, 0, lvid_length, alloc_data(lvid, lvid_length));
+		set_desc(disc, ext, TAG_IDENT_LVID, 0, lvid_length, alloc_data(disc, lvid, lvid_length));
 
 		disc->udf_lvid = lvid;
 
@@ -1009,30 +1023,6 @@ static struct genericPartitionMap *find_partition(struct udf_disc *disc, uint8_t
 	return NULL;
 }
 
-static struct genericPartitionMap *get_partition(struct udf_disc *disc, int id, uint16_t partition)
-{
-	uint16_t i;
-	uint32_t offset;
-	struct genericPartitionMap *pmap;
-
-	if (partition >= le32_to_cpu(disc->udf_lvd[id]->numPartitionMaps))
-		return NULL;
-
-	offset = 0;
-	for (i = 0; i <= partition; ++i)
-	{
-		if (offset >= le32_to_cpu(disc->udf_lvd[id]->mapTableLength))
-			return NULL;
-		pmap = (struct genericPartitionMap *)&disc->udf_lvd[id]->partitionMaps[offset];
-		offset += pmap->partitionMapLength;
-	}
-
-	if (offset > le32_to_cpu(disc->udf_lvd[id]->mapTableLength))
-		return NULL;
-
-	return pmap;
-}
-
 static struct partitionDesc *find_partition_descriptor(struct udf_disc *disc, uint16_t partition)
 {
 	int id;
@@ -1060,87 +1050,276 @@ static struct partitionDesc *find_partition_descriptor(struct udf_disc *disc, ui
 	return NULL;
 }
 
-static uint32_t find_block_position(struct udf_disc *disc, struct genericPartitionMap *pmap, uint32_t block, uint16_t *partition)
+/*
+ * Resolve every Partition Map once, so translating a block is a table lookup
+ * instead of walking the maps, comparing their identifiers and searching the
+ * Partition Descriptors. Must run after Sparing Tables and VAT are read.
+ */
+static void setup_partitions(struct udf_disc *disc)
 {
+	struct genericPartitionMap *pmap;
 	struct genericPartitionMap1 *pm1;
 	struct udfPartitionMap2 *upm2;
-	struct virtualPartitionMap *vpm;
 	struct sparablePartitionMap *spm;
-	uint8_t count, i;
-	uint16_t packet_len, num, j;
-	uint32_t location, packet, offset;
+	struct udf_partition *part;
+	uint32_t count, offset;
+	uint16_t i, number;
+	uint8_t j, tables;
+	int id;
 
-	if (pmap->partitionMapType == GP_PARTITION_MAP_TYPE_1)
-	{
-		pm1 = (struct genericPartitionMap1 *)pmap;
-		*partition = le16_to_cpu(pm1->partitionNum);
-		return block;
-	}
-	else if (pmap->partitionMapType == GP_PARTITION_MAP_TYPE_2)
+	if (disc->udf_lvd[0])
+		id = 0;
+	else if (disc->udf_lvd[1])
+		id = 1;
+	else
+		return;
+
+	count = le32_to_cpu(disc->udf_lvd[id]->numPartitionMaps);
+	if (count > UINT16_MAX)
+		count = UINT16_MAX;
+
+	disc->partitions = udf_arena_alloc(disc, count * sizeof(*disc->partitions));
+	disc->num_partitions = count;
+
+	offset = 0;
+	for (i = 0; i < count; ++i)
 	{
-		upm2 = (struct udfPartitionMap2 *)pmap;
-		if (strncmp((char *)upm2->partIdent.ident, UDF_ID_VIRTUAL, sizeof(upm2->partIdent.ident)) == 0)
-		{
-			vpm = (struct virtualPartitionMap *)upm2;
-			*partition = le16_to_cpu(vpm->partitionNum);
+		part = &disc->partitions[i];
+		part->type = UDF_PARTITION_UNMAPPED;
+		part->num_extents = 0;
+		part->extents = NULL;
+		part->num_mirror_extents = 0;
+		part->mirror_extents = NULL;
 
-			if (!disc->vat)
-				return UINT32_MAX;
-			else if (block < disc->vat_entries)
-				return le32_to_cpu(disc->vat[block]);
-			else
-				return block;
+		if (offset >= le32_to_cpu(disc->udf_lvd[id]->mapTableLength))
+			break;
+		pmap = (struct genericPartitionMap *)&disc->udf_lvd[id]->partitionMaps[offset];
+		offset += pmap->partitionMapLength;
+		if (offset > le32_to_cpu(disc->udf_lvd[id]->mapTableLength))
+			break;
+
+		if (pmap->partitionMapType == GP_PARTITION_MAP_TYPE_1)
+		{
+			pm1 = (struct genericPartitionMap1 *)pmap;
+			number = le16_to_cpu(pm1->partitionNum);
+			part->type = UDF_PARTITION_PHYSICAL;
 		}
-		else if (strncmp((char *)upm2->partIdent.ident, UDF_ID_SPARABLE, sizeof(upm2->partIdent.ident)) == 0)
+		else if (pmap->partitionMapType == GP_PARTITION_MAP_TYPE_2)
 		{
-			spm = (struct sparablePartitionMap *)upm2;
-			count = spm->numSparingTables;
-			packet_len = le16_to_cpu(spm->packetLength);
-			*partition = le16_to_cpu(spm->partitionNum);
-
-			offset = block % packet_len;
-			packet = block - offset;
-
-			for (i = 0; i < count; ++i)
+			upm2 = (struct udfPartitionMap2 *)pmap;
+			number = le16_to_cpu(upm2->partitionNum);
+			if (strncmp((char *)upm2->partIdent.ident, UDF_ID_VIRTUAL, sizeof(upm2->partIdent.ident)) == 0)
 			{
-				if (!disc->udf_stable[i])
-					continue;
+				if (disc->vat)
+					part->type = UDF_PARTITION_VIRTUAL;
+			}
+			else if (strncmp((char *)upm2->partIdent.ident, UDF_ID_SPARABLE, sizeof(upm2->partIdent.ident)) == 0)
+			{
+				spm = (struct sparablePartitionMap *)upm2;
+				tables = spm->numSparingTables;
 
-				num = le16_to_cpu(disc->udf_stable[i]->reallocationTableLen);
-				for (j = 0; j < num; ++j)
+				// First Sparing Table takes precedence
+				if (!disc->sparing_map.packet_len)
 				{
-					location = le32_to_cpu(disc->udf_stable[i]->mapEntry[j].origLocation);
-					if (location >= 0xFFFFFFF0)
-						break;
-					else if (location == packet)
-						return le32_to_cpu(disc->udf_stable[i]->mapEntry[j].mappedLocation) + offset;
-					else if (location > packet)
-						break;
+					udf_sparing_map_init(&disc->sparing_map, le16_to_cpu(spm->packetLength));
+					for (j = tables > 4 ? 4 : tables; j > 0; --j)
+					{
+						if (disc->udf_stable[j-1] && udf_sparing_map_load(&disc->sparing_map, disc->udf_stable[j-1]) < 0)
+							fprintf(stderr, "%s: Warning: Not enough memory for Sparing Table\n", appname);
+					}
 				}
+				part->type = UDF_PARTITION_SPARABLE;
+			}
+			else if (strncmp((char *)upm2->partIdent.ident, UDF_ID_METADATA, sizeof(upm2->partIdent.ident)) == 0)
+			{
+				// Metadata File extents are read by read_metadata()
+				part->type = UDF_PARTITION_METADATA;
+			}
+			else
+			{
+				fprintf(stderr, "%s: Warning: Unknown Type 2 Partition Map\n", appname);
+				continue;
 			}
-
-			return block;
 		}
-		else if (strncmp((char *)upm2->partIdent.ident, UDF_ID_METADATA, sizeof(upm2->partIdent.ident)) == 0)
+		else
 		{
-			/* TODO: Add support for Metadata */
-			fprintf(stderr, "%s: Warning: Metadata Partition Map is not supported\n", appname);
-			return UINT32_MAX;
+			fprintf(stderr, "%s: Warning: Unknown Partition Map\n", appname);
+			continue;
+		}
+
+		part->pd = find_partition_descriptor(disc, number);
+		if (part->pd)
+			part->start = le32_to_cpu(part->pd->partitionStartingLocation);
+		else
+			part->type = UDF_PARTITION_UNMAPPED;
+	}
+}
+
+/*
+ * Read allocation descriptors of Metadata File (or Metadata Mirror File) ICB
+ * at block of underlying partition into extents of Metadata Partition.
+ * Only descriptors recorded in the ICB are supported.
+ */
+static int read_metadata_file(struct udf_medium *medium, struct udf_disc *disc, struct udf_partition *part, uint32_t block, uint8_t file_type, struct udf_meta_extent **extents, uint32_t *num_extents)
+{
+	struct fileEntry *fe;
+	struct extendedFileEntry *efe;
+	short_ad *sad;
+	long_ad *lad;
+	unsigned char *buffer;
+	uint32_t position, offset, length, count, i;
+	uint32_t ext_length, ext_position, logical;
+	uint16_t ad_type, ext_partition;
+
+	position = udf_block_position(disc, part->underlying, block);
+	if (position == UINT32_MAX)
+		return -1;
+
+	buffer = malloc(disc->blocksize);
+	if (!buffer)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		return -1;
+	}
+
+	if (read_offset(medium, disc, buffer, (off_t)position * disc->blocksize, disc->blocksize, 1) < 0)
+	{
+		free(buffer);
+		return -1;
+	}
+
+	fe = (struct fileEntry *)buffer;
+	efe = (struct extendedFileEntry *)buffer;
+	if (le16_to_cpu(fe->descTag.tagIdent) == TAG_IDENT_FE)
+	{
+		offset = sizeof(*fe) + le32_to_cpu(fe->lengthExtendedAttr);
+		length = le32_to_cpu(fe->lengthAllocDescs);
+	}
+	else if (le16_to_cpu(fe->descTag.tagIdent) == TAG_IDENT_EFE)
+	{
+		offset = sizeof(*efe) + le32_to_cpu(efe->lengthExtendedAttr);
+		length = le32_to_cpu(efe->lengthAllocDescs);
+	}
+	else
+	{
+		free(buffer);
+		return -1;
+	}
+
+	if (fe->icbTag.fileType != file_type || le32_to_cpu(fe->descTag.tagLocation) != block || offset > disc->blocksize || length > disc->blocksize - offset)
+	{
+		free(buffer);
+		return -1;
+	}
+
+	ad_type = le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK;
+	if (ad_type == ICBTAG_FLAG_AD_SHORT)
+		count = length / sizeof(short_ad);
+	else if (ad_type == ICBTAG_FLAG_AD_LONG)
+		count = length / sizeof(long_ad);
+	else
+	{
+		free(buffer);
+		return -1;
+	}
+
+	*extents = udf_arena_alloc(disc, count * sizeof(**extents));
+	*num_extents = 0;
+	logical = 0;
+	for (i = 0; i < count; ++i)
+	{
+		if (ad_type == ICBTAG_FLAG_AD_SHORT)
+		{
+			sad = (short_ad *)(buffer + offset) + i;
+			ext_length = le32_to_cpu(sad->extLength);
+			ext_position = le32_to_cpu(sad->extPosition);
+			ext_partition = part->underlying;
 		}
 		else
 		{
-			fprintf(stderr, "%s: Warning: Unknown Type 2 Partition Map\n", appname);
-			return UINT32_MAX;
+			lad = (long_ad *)(buffer + offset) + i;
+			ext_length = le32_to_cpu(lad->extLength);
+			ext_position = le32_to_cpu(lad->extLocation.logicalBlockNum);
+			ext_partition = le16_to_cpu(lad->extLocation.partitionReferenceNum);
 		}
+
+		if ((ext_length & EXT_LENGTH_MASK) == 0 || (ext_length & ~EXT_LENGTH_MASK) == EXT_NEXT_EXTENT_ALLOCDECS)
+			break;
+
+		// Unrecorded extents and extents outside of underlying partition stay unmapped
+		if ((ext_length & ~EXT_LENGTH_MASK) == EXT_RECORDED_ALLOCATED && ext_partition == part->underlying)
+		{
+			(*extents)[*num_extents].block = logical;
+			(*extents)[*num_extents].position = ext_position;
+			(*extents)[*num_extents].length = (ext_length & EXT_LENGTH_MASK) / disc->blocksize;
+			(*num_extents)++;
+		}
+		logical += ((ext_length & EXT_LENGTH_MASK) + disc->blocksize - 1) / disc->blocksize;
 	}
-	else
+
+	if (i < count && (ext_length & ~EXT_LENGTH_MASK) == EXT_NEXT_EXTENT_ALLOCDECS)
+		fprintf(stderr, "%s: Warning: Metadata File has Allocation Extent Descriptor which is not supported\n", appname);
+
+	free(buffer);
+	return 0;
+}
+
+/*
+ * Resolve Metadata Partition Maps to extents of Metadata File, Metadata
+ * Mirror File is used when Metadata File cannot be read. Extents of Metadata
+ * Mirror File are kept too, so writers can update both copies.
+ */
+static void read_metadata(struct udf_medium *medium, struct udf_disc *disc)
+{
+	struct metadataPartitionMap *mpm;
+	struct udf_partition *part;
+	uint16_t i, j, number;
+
+	mpm = (struct metadataPartitionMap *)find_partition(disc, GP_PARTITION_MAP_TYPE_2, UDF_ID_METADATA);
+	if (!mpm)
+		return;
+
+	number = le16_to_cpu(mpm->partitionNum);
+	for (i = 0; i < disc->num_partitions; ++i)
 	{
-		fprintf(stderr, "%s: Warning: Unknown Partition Map\n", appname);
-		return UINT32_MAX;
+		part = &disc->partitions[i];
+		if (part->type != UDF_PARTITION_METADATA)
+			continue;
+
+		// Metadata Partition is on top of Type 1 Partition with the same number
+		for (j = 0; j < disc->num_partitions; ++j)
+		{
+			if (disc->partitions[j].type == UDF_PARTITION_PHYSICAL && disc->partitions[j].pd && le16_to_cpu(disc->partitions[j].pd->partitionNumber) == number)
+				break;
+		}
+		if (j == disc->num_partitions)
+		{
+			fprintf(stderr, "%s: Warning: Metadata Partition Map found, but corresponding Type 1 Partition Map not found\n", appname);
+			part->type = UDF_PARTITION_UNMAPPED;
+			continue;
+		}
+		part->underlying = j;
+
+		if (read_metadata_file(medium, disc, part, le32_to_cpu(mpm->metadataFileLoc), ICBTAG_FILE_TYPE_MAIN, &part->extents, &part->num_extents) == 0)
+		{
+			if (read_metadata_file(medium, disc, part, le32_to_cpu(mpm->metadataMirrorFileLoc), ICBTAG_FILE_TYPE_MIRROR, &part->mirror_extents, &part->num_mirror_extents) != 0)
+			{
+				part->mirror_extents = NULL;
+				part->num_mirror_extents = 0;
+			}
+			continue;
+		}
+
+		fprintf(stderr, "%s: Warning: Metadata File cannot be read, trying Metadata Mirror File\n", appname);
+		if (read_metadata_file(medium, disc, part, le32_to_cpu(mpm->metadataMirrorFileLoc), ICBTAG_FILE_TYPE_MIRROR, &part->extents, &part->num_extents) == 0)
+			continue;
+
+		fprintf(stderr, "%s: Warning: Metadata Mirror File cannot be read\n", appname);
+		part->type = UDF_PARTITION_UNMAPPED;
 	}
 }
 
-static void read_stable(int fd, struct udf_disc *disc)
+static void read_stable(struct udf_medium *medium, struct udf_disc *disc)
 {
 	size_t st_len;
 	uint8_t count, i;
@@ -1169,7 +1348,7 @@ static void read_stable(int fd, struct udf_disc *disc)
 	{
 		location = le32_to_cpu(spm->locSparingTable[i]);
 
-		if (read_offset(fd, disc, &buffer, (off_t)location * disc->blocksize, sizeof(buffer), 1) < 0)
+		if (read_offset(medium, disc, &buffer, (off_t)location * disc->blocksize, sizeof(buffer), 1) < 0)
 			return;
 
 		st = (struct sparingTable *)&buffer;
@@ -1203,10 +1382,8 @@ static void read_stable(int fd, struct udf_disc *disc)
 		else
 		{
 			memcpy(disc->udf_stable[i], &buffer, sizeof(buffer));
-			errno = 0;
-			if (read(fd, (uint8_t *)disc->udf_stable[i] + sizeof(buffer), st_len - sizeof(buffer)) != (ssize_t)(st_len - sizeof(buffer)))
+			if (read_offset(medium, disc, (uint8_t *)disc->udf_stable[i] + sizeof(buffer), (off_t)location * disc->blocksize + sizeof(buffer), st_len - sizeof(buffer), 1) < 0)
 			{
-				fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
 				free(disc->udf_stable[i]);
 				disc->udf_stable[i] = NULL;
 				return;
@@ -1222,16 +1399,13 @@ static void read_stable(int fd, struct udf_disc *disc)
 			if (ext->prev && ext->prev->space_type == SSPACE)
 			{
 				ext->prev->blocks = packet_len + location - ext->prev->start;
-				ext->prev->next = ext->next;
-				if (ext->next)
-					ext->next->prev = ext->prev;
-				free(ext);
+				remove_extent(disc, ext);
 			}
 		}
 	}
 }
 
-static void read_vat(int fd, struct udf_disc *disc)
+static void read_vat(struct udf_medium *medium, struct udf_disc *disc)
 {
 	long last;
 	struct partitionDesc *pd;
@@ -1278,14 +1452,14 @@ static void read_vat(int fd, struct udf_disc *disc)
 
 	if (disc->vat_block)
 		vat_block = disc->vat_block;
-	else if (fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, CDROM_LAST_WRITTEN, &last) == 0)
+	else if (fstat(medium->fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(medium->fd, CDROM_LAST_WRITTEN, &last) == 0)
 		vat_block = last;
 	else
 		vat_block = disc->blocks - 1;
 
 	for (i = vat_block + 3; i > 0 && i > vat_block - 32; --i)
 	{
-		if (read_offset(fd, disc, &buffer, (off_t)i * disc->blocksize, sizeof(buffer), 0) < 0)
+		if (read_offset(medium, disc, &buffer, (off_t)i * disc->blocksize, sizeof(buffer), 0) < 0)
 			continue;
 
 		fe = (struct fileEntry *)&buffer;
@@ -1341,7 +1515,7 @@ static void read_vat(int fd, struct udf_disc *disc)
 			break;
 		}
 
-		if (read_offset(fd, disc, descs, (off_t)i * disc->blocksize + offset, length, 1) < 0)
+		if (read_offset(medium, disc, descs, (off_t)i * disc->blocksize + offset, length, 1) < 0)
 		{
 			free(descs);
 			break;
@@ -1471,7 +1645,7 @@ static void read_vat(int fd, struct udf_disc *disc)
 					}
 				}
 
-				if (read_offset(fd, disc, vat + vat_offset, (off_t)(ext_location + ext_position) * disc->blocksize, ext_length, 1) != 0)
+				if (read_offset(medium, disc, vat + vat_offset, (off_t)(ext_location + ext_position) * disc->blocksize, ext_length, 1) != 0)
 				{
 					fprintf(stderr, "%s: Error: Virtual Allocation Table is damaged\n", appname);
 					count = 0;
@@ -1511,7 +1685,7 @@ static void read_vat(int fd, struct udf_disc *disc)
 			{
 				if (sizeof(ea_hdr) > ea_length)
 					fprintf(stderr, "%s: Warning: Extended Attributes for Virtual Allocation Table are damaged\n", appname);
-				else if (read_offset(fd, disc, &ea_hdr, (off_t)i * disc->blocksize + ea_offset, sizeof(ea_hdr), 1) != 0)
+				else if (read_offset(medium, disc, &ea_hdr, (off_t)i * disc->blocksize + ea_offset, sizeof(ea_hdr), 1) != 0)
 					fprintf(stderr, "%s: Warning: Extended Attributes for Virtual Allocation Table are damaged\n", appname);
 				else
 				{
@@ -1519,7 +1693,7 @@ static void read_vat(int fd, struct udf_disc *disc)
 					ea_attr_offset = le32_to_cpu(ea_hdr.impAttrLocation);
 					while (ea_attr_offset < ea_length)
 					{
-						if (read_offset(fd, disc, &ea_attr, (off_t)i * disc->blocksize + ea_offset + ea_attr_offset, sizeof(ea_attr), 1) != 0)
+						if (read_offset(medium, disc, &ea_attr, (off_t)i * disc->blocksize + ea_offset + ea_attr_offset, sizeof(ea_attr), 1) != 0)
 						{
 							fprintf(stderr, "%s: Warning: Extended Attributes for Virtual Allocation Table are damaged\n", appname);
 							break;
@@ -1539,7 +1713,7 @@ static void read_vat(int fd, struct udf_disc *disc)
 								fprintf(stderr, "%s: Warning: Logical Volume Extended Information for Virtual Allocation Table is damaged\n", appname);
 								break;
 							}
-							if (read_offset(fd, disc, &ea_lv, (off_t)i * disc->blocksize + ea_offset + ea_attr_offset + sizeof(ea_attr), sizeof(ea_lv), 1) != 0)
+							if (read_offset(medium, disc, &ea_lv, (off_t)i * disc->blocksize + ea_offset + ea_attr_offset + sizeof(ea_attr), sizeof(ea_lv), 1) != 0)
 							{
 								fprintf(stderr, "%s: Warning: Logical Volume Extended Information for Virtual Allocation Table is damaged\n", appname);
 								break;
@@ -1666,21 +1840,12 @@ static void setup_pspace(struct udf_disc *disc, int second)
 		}
 		else
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
-			if (!new_ext)
-			{
-				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-				return;
-			}
+			new_ext = udf_arena_alloc(disc, sizeof(struct udf_extent));
 			new_ext->space_type = PSPACE;
 			new_ext->start = location;
 			new_ext->blocks = blocks;
 			new_ext->head = new_ext->tail = NULL;
-			new_ext->prev = ext;
-			new_ext->next = ext->next;
-			new_ext->prev->next = new_ext;
-			if (new_ext->next)
-				new_ext->next->prev = new_ext;
+			insert_extent(disc, ext, new_ext);
 		}
 	}
 	else
@@ -1697,14 +1862,12 @@ static void setup_pspace(struct udf_disc *disc, int second)
 	}
 }
 
-static void read_fsd(int fd, struct udf_disc *disc)
+static void read_fsd(struct udf_medium *medium, struct udf_disc *disc)
 {
 	long_ad *ad;
 	uint16_t partition;
-	uint32_t block, location, position, length;
-	struct genericPartitionMap *pmap;
+	uint32_t block, location, length;
 	struct udf_extent *ext;
-	struct partitionDesc *pd;
 	int id;
 
 	if (disc->udf_lvd[0])
@@ -1719,29 +1882,19 @@ static void read_fsd(int fd, struct udf_disc *disc)
 	partition = le16_to_cpu(ad->extLocation.partitionReferenceNum);
 	length = le32_to_cpu(ad->extLength) & EXT_LENGTH_MASK;
 
-	pmap = get_partition(disc, id, partition);
-	if (!pmap)
+	if (partition >= disc->num_partitions)
 	{
 		fprintf(stderr, "%s: Warning: Incorrect Logical Volume Descriptor\n", appname);
 		return;
 	}
 
-	position = find_block_position(disc, pmap, block, &partition);
-	if (position == UINT32_MAX)
-	{
-		fprintf(stderr, "%s: Warning: File Set Descriptor cannot be read\n", appname);
-		return;
-	}
-
-	pd = find_partition_descriptor(disc, partition);
-	if (!pd)
+	location = udf_block_position(disc, partition, block);
+	if (location == UINT32_MAX)
 	{
 		fprintf(stderr, "%s: Warning: File Set Descriptor cannot be read\n", appname);
 		return;
 	}
 
-	location = le32_to_cpu(pd->partitionStartingLocation) + position;
-
 	if (sizeof(*disc->udf_fsd) > length)
 	{
 		fprintf(stderr, "%s: Warning: Incorrect File Set Descriptor\n", appname);
@@ -1755,7 +1908,7 @@ static void read_fsd(int fd, struct udf_disc *disc)
 		return;
 	}
 
-	if (read_offset(fd, disc, disc->udf_fsd, (off_t)location * disc->blocksize, length, 1) < 0)
+	if (read_offset(medium, disc, disc->udf_fsd, (off_t)location * disc->blocksize, length, 1) < 0)
 	{
 		free(disc->udf_fsd);
 		disc->udf_fsd = NULL;
@@ -1780,7 +1933,7 @@ static void read_fsd(int fd, struct udf_disc *disc)
 
 	ext = next_extent(disc->head, PSPACE);
 	if (ext)
-		set_desc(ext, TAG_IDENT_FSD, location - ext->start, length, alloc_data(disc->udf_fsd, length));
+		set_desc(disc, ext, TAG_IDENT_FSD, location - ext->start, length, alloc_data(disc, disc->udf_fsd, length));
 }
 
 static void setup_total_space_blocks(struct udf_disc *disc)
@@ -1821,19 +1974,16 @@ static void setup_total_space_blocks(struct udf_disc *disc)
 	disc->total_space_blocks += le32_to_cpu(disc->udf_pd2[id]->partitionLength);
 }
 
-static uint32_t count_bitmap_blocks(int fd, struct udf_disc *disc, struct genericPartitionMap *pmap, uint32_t block, uint32_t length)
+static uint32_t count_bitmap_blocks(struct udf_medium *medium, struct udf_disc *disc, uint16_t partition, uint32_t block, uint32_t length)
 {
-	unsigned long int buffer[512/sizeof(unsigned long int)];
-	unsigned long int val;
+	const uint8_t *ptr;
+	off_t offset;
+	size_t chunk;
 	uint32_t location;
-	uint32_t position;
-	uint16_t partition;
-	struct partitionDesc *pd;
 	struct spaceBitmapDesc sbd;
 	uint32_t bits;
 	uint32_t bytes;
 	uint32_t blocks;
-	size_t i;
 
 	if (sizeof(sbd) > length)
 	{
@@ -1841,17 +1991,11 @@ static uint32_t count_bitmap_blocks(int fd, struct udf_disc *disc, struct generi
 		return 0;
 	}
 
-	position = find_block_position(disc, pmap, block, &partition);
-	if (position == UINT32_MAX)
-		return 0;
-
-	pd = find_partition_descriptor(disc, partition);
-	if (!pd)
+	location = udf_block_position(disc, partition, block);
+	if (location == UINT32_MAX)
 		return 0;
 
-	location = le32_to_cpu(pd->partitionStartingLocation) + position;
-
-	if (read_offset(fd, disc, &sbd, (off_t)location * disc->blocksize, sizeof(sbd), 1) < 0)
+	if (read_offset(medium, disc, &sbd, (off_t)location * disc->blocksize, sizeof(sbd), 1) < 0)
 		return 0;
 
 	bits = le32_to_cpu(sbd.numOfBits);
@@ -1865,59 +2009,46 @@ static uint32_t count_bitmap_blocks(int fd, struct udf_disc *disc, struct generi
 
 	bytes = (bits+7) / 8;
 	blocks = 0;
+	offset = (off_t)location * disc->blocksize + sizeof(sbd);
 
-	for (bytes = (bits+7) / 8; bytes > sizeof(buffer); bytes -= sizeof(buffer))
-	{
-		if (read(fd, &buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer))
-		{
-			fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
-			return 0;
-		}
-
-		for (i = 0; i < sizeof(buffer)/sizeof(*buffer); ++i)
-		{
-			val = buffer[i];
-			while (val)
-			{
-				val &= val - 1;
-				++blocks;
-			}
-		}
-	}
+	read_hint(medium, disc, offset, bytes);
 
-	if (bytes)
+	while (bytes > 0)
 	{
-		memset(&buffer, 0, sizeof(buffer));
-		if (read(fd, &buffer, bytes) != (ssize_t)bytes)
+		// Hole of sparse image reads as zeros, which are allocated blocks
+		chunk = udf_medium_next_data(medium, offset, offset + bytes) - offset;
+		if (chunk)
 		{
-			fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
-			return 0;
+			offset += chunk;
+			bytes -= chunk;
+			continue;
 		}
 
-		if (bits % 8)
-			((unsigned char *)buffer)[bytes-1] &= (1 << bits) - 1;
+		chunk = (bytes > BITMAP_CHUNK_SIZE) ? BITMAP_CHUNK_SIZE : bytes;
+		ptr = read_range(medium, disc, offset, chunk, 1);
+		if (!ptr)
+			return 0;
 
-		for (i = 0; i < (bytes+sizeof(*buffer)) / sizeof(*buffer); ++i)
+		// Last byte is handled separately as it can contain padding bits
+		if (bytes == chunk && bits % 8)
 		{
-			val = buffer[i];
-			while (val)
-			{
-				val &= val - 1;
-				++blocks;
-			}
+			blocks += udf_popcount(ptr, chunk - 1);
+			blocks += __builtin_popcount(ptr[chunk - 1] & ((1 << (bits % 8)) - 1));
 		}
+		else
+			blocks += udf_popcount(ptr, chunk);
+
+		offset += chunk;
+		bytes -= chunk;
 	}
 
 	return blocks;
 }
 
-static uint32_t count_table_blocks(int fd, struct udf_disc *disc, struct genericPartitionMap *pmap, uint32_t block, uint32_t length)
+static uint32_t count_table_blocks(struct udf_medium *medium, struct udf_disc *disc, uint16_t partition, uint32_t block, uint32_t length)
 {
 	unsigned char buffer[512];
 	uint32_t location;
-	uint32_t position;
-	uint16_t partition;
-	struct partitionDesc *pd;
 	struct unallocSpaceEntry *use;
 	size_t use_len;
 	uint64_t space, blocks;
@@ -1931,17 +2062,11 @@ static uint32_t count_table_blocks(int fd, struct udf_disc *disc, struct generic
 		return 0;
 	}
 
-	position = find_block_position(disc, pmap, block, &partition);
-	if (position == UINT32_MAX)
+	location = udf_block_position(disc, partition, block);
+	if (location == UINT32_MAX)
 		return 0;
 
-	pd = find_partition_descriptor(disc, partition);
-	if (!pd)
-		return 0;
-
-	location = le32_to_cpu(pd->partitionStartingLocation) + position;
-
-	if (read_offset(fd, disc, &buffer, (off_t)location * disc->blocksize, sizeof(buffer), 1) < 0)
+	if (read_offset(medium, disc, &buffer, (off_t)location * disc->blocksize, sizeof(buffer), 1) < 0)
 		return 0;
 
 	use = (struct unallocSpaceEntry *)&buffer;
@@ -1964,10 +2089,8 @@ static uint32_t count_table_blocks(int fd, struct udf_disc *disc, struct generic
 	else
 	{
 		memcpy(use, &buffer, sizeof(buffer));
-		errno = 0;
-		if (read(fd, (uint8_t *)use + sizeof(buffer), use_len - sizeof(buffer)) != (ssize_t)(use_len - sizeof(buffer)))
+		if (read_offset(medium, disc, (uint8_t *)use + sizeof(buffer), (off_t)location * disc->blocksize + sizeof(buffer), use_len - sizeof(buffer), 1) < 0)
 		{
-			fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
 			free(use);
 			return 0;
 		}
@@ -2020,12 +2143,11 @@ static uint32_t count_table_blocks(int fd, struct udf_disc *disc, struct generic
 	return blocks;
 }
 
-static void scan_free_space_blocks(int fd, struct udf_disc *disc)
+static void scan_free_space_blocks(struct udf_medium *medium, struct udf_disc *disc)
 {
 	long_ad *ad;
 	uint16_t partition;
 	uint32_t blocks, location, length, value;
-	struct genericPartitionMap *pmap;
 	struct partitionHeaderDesc *phd;
 	struct partitionDesc *pd;
 	char *ident;
@@ -2044,6 +2166,10 @@ static void scan_free_space_blocks(int fd, struct udf_disc *disc)
 	ad = (long_ad *)disc->udf_lvd[id]->logicalVolContentsUse;
 	partition = le16_to_cpu(ad->extLocation.partitionReferenceNum);
 
+	// Free space of Metadata Partition is counted in its underlying partition
+	if (partition < disc->num_partitions && disc->partitions[partition].type == UDF_PARTITION_METADATA)
+		partition = disc->partitions[partition].underlying;
+
 	if (partition < le32_to_cpu(disc->udf_lvid->numOfPartitions))
 	{
 		memcpy(&value, &disc->udf_lvid->data[sizeof(uint32_t)*partition], sizeof(value));
@@ -2055,18 +2181,11 @@ static void scan_free_space_blocks(int fd, struct udf_disc *disc)
 		}
 	}
 
-	pmap = get_partition(disc, id, partition);
-	if (!pmap)
+	if (partition >= disc->num_partitions)
 		return;
 
-	if (find_block_position(disc, pmap, 0, &partition) == UINT32_MAX)
-	{
-		fprintf(stderr, "%s: Warning: Determining free space blocks is not possible\n", appname);
-		return;
-	}
-
-	pd = find_partition_descriptor(disc, partition);
-	if (!pd)
+	pd = disc->partitions[partition].pd;
+	if (disc->partitions[partition].type == UDF_PARTITION_UNMAPPED || udf_block_position(disc, partition, 0) == UINT32_MAX)
 	{
 		fprintf(stderr, "%s: Warning: Determining free space blocks is not possible\n", appname);
 		return;
@@ -2092,7 +2211,7 @@ static void scan_free_space_blocks(int fd, struct udf_disc *disc)
 	length = le32_to_cpu(phd->unallocSpaceBitmap.extLength) & EXT_LENGTH_MASK;
 	if (length)
 	{
-		blocks = count_bitmap_blocks(fd, disc, pmap, le32_to_cpu(phd->unallocSpaceBitmap.extPosition), length);
+		blocks = count_bitmap_blocks(medium, disc, partition, le32_to_cpu(phd->unallocSpaceBitmap.extPosition), length);
 		if (blocks)
 		{
 			disc->free_space_blocks = blocks;
@@ -2103,7 +2222,7 @@ static void scan_free_space_blocks(int fd, struct udf_disc *disc)
 	length = le32_to_cpu(phd->freedSpaceBitmap.extLength) & EXT_LENGTH_MASK;
 	if (length)
 	{
-		blocks = count_bitmap_blocks(fd, disc, pmap, le32_to_cpu(phd->freedSpaceBitmap.extPosition), length);
+		blocks = count_bitmap_blocks(medium, disc, partition, le32_to_cpu(phd->freedSpaceBitmap.extPosition), length);
 		if (blocks)
 		{
 			disc->free_space_blocks = blocks;
@@ -2114,7 +2233,7 @@ static void scan_free_space_blocks(int fd, struct udf_disc *disc)
 	length = le32_to_cpu(phd->unallocSpaceTable.extLength) & EXT_LENGTH_MASK;
 	if (length)
 	{
-		blocks = count_table_blocks(fd, disc, pmap, le32_to_cpu(phd->unallocSpaceTable.extPosition), length);
+		blocks = count_table_blocks(medium, disc, partition, le32_to_cpu(phd->unallocSpaceTable.extPosition), length);
 		if (blocks)
 		{
 			disc->free_space_blocks = blocks;
@@ -2125,7 +2244,7 @@ static void scan_free_space_blocks(int fd, struct udf_disc *disc)
 	length = le32_to_cpu(phd->freedSpaceTable.extLength) & EXT_LENGTH_MASK;
 	if (length)
 	{
-		blocks = count_table_blocks(fd, disc, pmap, le32_to_cpu(phd->freedSpaceTable.extPosition), length);
+		blocks = count_table_blocks(medium, disc, partition, le32_to_cpu(phd->freedSpaceTable.extPosition), length);
 		if (blocks)
 		{
 			disc->free_space_blocks = blocks;
@@ -2136,15 +2255,45 @@ static void scan_free_space_blocks(int fd, struct udf_disc *disc)
 	disc->free_space_blocks = 0;
 }
 
-int read_disc(int fd, struct udf_disc *disc)
+/**
+ * @brief Read volume structures of UDF disc from medium, only those needed
+ *        by the requested stages
+ *
+ * Detection of VRS and anchors is always done. Stages pull in the stages
+ * they depend on: UDF_READ_FSD and UDF_READ_SPACE need UDF_READ_PARTITIONS,
+ * UDF_READ_SPACE also UDF_READ_LVIS, and all of them UDF_READ_VDS.
+ *
+ * Descriptors are read through the window cache of medium, which stays valid
+ * afterwards for udf_read_blocks(). Callers writing to medium by other means
+ * must call udf_medium_invalidate() before reading it again.
+ *
+ * @param medium medium access
+ * @param disc disc to fill, blksize and blkssz must be already set
+ * @param stages mask of UDF_READ_* stages
+ * @return 0 on success, -1 when medium does not contain UDF
+ */
+int udf_read_disc_stages(struct udf_medium *medium, struct udf_disc *disc, unsigned int stages)
 {
-	if (detect_udf(fd, disc) < 0)
+	if (stages & UDF_READ_SPACE)
+		stages |= UDF_READ_LVIS | UDF_READ_PARTITIONS;
+	if (stages & UDF_READ_FSD)
+		stages |= UDF_READ_PARTITIONS;
+	if (stages & (UDF_READ_LVIS | UDF_READ_PARTITIONS))
+		stages |= UDF_READ_VDS;
+
+	if (detect_udf(medium, disc) < 0)
+	{
+		udf_medium_invalidate(medium);
 		return -1;
+	}
 
-	read_mbr(fd, disc);
+	if (!(stages & UDF_READ_VDS))
+		return 0;
+
+	read_mbr(medium, disc);
 
-	scan_mvds(fd, disc);
-	scan_rvds(fd, disc);
+	scan_mvds(medium, disc);
+	scan_rvds(medium, disc);
 
 	if (!disc->udf_anchor[1] && !disc->udf_anchor[2] && !find_partition(disc, GP_PARTITION_MAP_TYPE_2, UDF_ID_VIRTUAL))
 		fprintf(stderr, "%s: Warning: Second and third Anchor Volume Descriptor Pointer not found\n", appname);
@@ -2163,26 +2312,176 @@ int read_disc(int fd, struct udf_disc *disc)
 	if (!disc->udf_td[0] && !disc->udf_td[1])
 		fprintf(stderr, "%s: Warning: Terminating Descriptor not found\n", appname);
 
-	scan_lvis(fd, disc);
+	if (stages & UDF_READ_LVIS)
+	{
+		scan_lvis(medium, disc);
 
-	if (!disc->udf_lvid)
-		fprintf(stderr, "%s: Warning: Logical Volume Integrity Descriptor not found\n", appname);
+		if (!disc->udf_lvid)
+			fprintf(stderr, "%s: Warning: Logical Volume Integrity Descriptor not found\n", appname);
 
-	parse_lvidiu(disc);
-	read_stable(fd, disc);
-	read_vat(fd, disc);
+		parse_lvidiu(disc);
+	}
+
+	if (!(stages & UDF_READ_PARTITIONS))
+		return 0;
+
+	read_stable(medium, disc);
+	read_vat(medium, disc);
+	setup_partitions(disc);
+	read_metadata(medium, disc);
 	setup_pspace(disc, 0);
 	setup_pspace(disc, 1);
 
 	/* TODO: setup USPACE extents */
 
-	read_fsd(fd, disc);
+	if (stages & UDF_READ_FSD)
+	{
+		read_fsd(medium, disc);
+
+		if (!disc->udf_fsd)
+			fprintf(stderr, "%s: Warning: File Set Descriptor not found\n", appname);
+	}
 
-	if (!disc->udf_fsd)
-		fprintf(stderr, "%s: Warning: File Set Descriptor not found\n", appname);
+	if (stages & UDF_READ_SPACE)
+	{
+		setup_total_space_blocks(disc);
+		scan_free_space_blocks(medium, disc);
+	}
 
-	setup_total_space_blocks(disc);
-	scan_free_space_blocks(fd, disc);
+	return 0;
+}
+
+/**
+ * @brief Read all volume structures of UDF disc from medium, see
+ *        udf_read_disc_stages()
+ * @param medium medium access
+ * @param disc disc to fill, blksize and blkssz must be already set
+ * @return 0 on success, -1 when medium does not contain UDF
+ */
+int udf_read_disc(struct udf_medium *medium, struct udf_disc *disc)
+{
+	return udf_read_disc_stages(medium, disc, UDF_READ_ALL);
+}
+
+/*
+ * Map block of Metadata Partition through extents of Metadata File or
+ * Metadata Mirror File
+ */
+static uint32_t metadata_block_position(struct udf_disc *disc, const struct udf_partition *part, const struct udf_meta_extent *extents, uint32_t num_extents, uint32_t block)
+{
+	uint32_t lo, hi, mid;
+
+	lo = 0;
+	hi = num_extents;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (block < extents[mid].block)
+			hi = mid;
+		else if (block - extents[mid].block >= extents[mid].length)
+			lo = mid + 1;
+		else
+			return udf_block_position(disc, part->underlying, extents[mid].position + block - extents[mid].block);
+	}
+	return UINT32_MAX;
+}
+
+/**
+ * @brief Find position on medium of a logical block of a partition, Virtual,
+ *        Sparable and Metadata Partition Maps are resolved by the table built
+ *        by udf_read_disc()
+ * @param disc disc read by udf_read_disc()
+ * @param partition partition reference number, as in long_ad
+ * @param block logical block in the partition
+ * @return block number on medium, UINT32_MAX when the block cannot be mapped
+ */
+uint32_t udf_block_position(struct udf_disc *disc, uint16_t partition, uint32_t block)
+{
+	const struct udf_partition *part;
+	uint32_t offset, mapped;
+
+	if (partition >= disc->num_partitions)
+		return UINT32_MAX;
+
+	part = &disc->partitions[partition];
+	switch (part->type)
+	{
+		case UDF_PARTITION_PHYSICAL:
+			return part->start + block;
+
+		case UDF_PARTITION_VIRTUAL:
+			if (block < disc->vat_entries)
+			{
+				block = le32_to_cpu(disc->vat[block]);
+				if (block == UINT32_MAX)
+					return UINT32_MAX;
+			}
+			return part->start + block;
+
+		case UDF_PARTITION_SPARABLE:
+			// Mapped Location of Sparing Table is already a position on medium
+			offset = block % disc->sparing_map.packet_len;
+			if (disc->sparing_map.count && udf_sparing_map_find(&disc->sparing_map, block - offset, &mapped))
+				return mapped + offset;
+			return part->start + block;
+
+		case UDF_PARTITION_METADATA:
+			return metadata_block_position(disc, part, part->extents, part->num_extents, block);
+
+		default:
+			return UINT32_MAX;
+	}
+}
+
+/**
+ * @brief Find position on medium of a logical block of a Metadata Partition
+ *        in its Metadata Mirror File
+ * @param disc disc read by udf_read_disc()
+ * @param partition partition reference number of Metadata Partition
+ * @param block logical block in the partition
+ * @return block number on medium, UINT32_MAX when partition is not a Metadata
+ *         Partition, Metadata Mirror File was not read or the block cannot
+ *         be mapped; the same position as udf_block_position() when the
+ *         Mirror File shares extents of Metadata File
+ */
+uint32_t udf_mirror_block_position(struct udf_disc *disc, uint16_t partition, uint32_t block)
+{
+	const struct udf_partition *part;
+
+	if (partition >= disc->num_partitions)
+		return UINT32_MAX;
+
+	part = &disc->partitions[partition];
+	if (part->type != UDF_PARTITION_METADATA || !part->mirror_extents)
+		return UINT32_MAX;
+
+	return metadata_block_position(disc, part, part->mirror_extents, part->num_mirror_extents, block);
+}
+
+/**
+ * @brief Read logical blocks of a partition, Virtual, Sparable and Metadata
+ *        Partition Maps are resolved block by block
+ * @param medium medium access
+ * @param disc disc read by udf_read_disc()
+ * @param partition partition reference number, as in long_ad
+ * @param block first logical block in the partition
+ * @param count number of blocks to read
+ * @param buf destination buffer of count blocks
+ * @return 0 on success, -1 when a block cannot be mapped or read
+ */
+int udf_read_blocks(struct udf_medium *medium, struct udf_disc *disc, uint16_t partition, uint32_t block, uint32_t count, void *buf)
+{
+	uint32_t position, i;
+
+	for (i = 0; i < count; ++i)
+	{
+		position = udf_block_position(disc, partition, block + i);
+		if (position == UINT32_MAX)
+			return -1;
+
+		if (read_offset(medium, disc, (uint8_t *)buf + (size_t)i * disc->blocksize, (off_t)position * disc->blocksize, disc->blocksize, 1) < 0)
+			return -1;
+	}
 
 	return 0;
 }
@@ -0,0 +1,194 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * libudffs remap map of sparable partitions
+ *
+ * Sparing Table entries are kept in an open addressing hash keyed by the
+ * original packet location. A bitmap filter indexed by the same hash tells
+ * for most packets without probing that they are not remapped, which is the
+ * common case on every read and write.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libudffs.h"
+
+#define SPARING_EMPTY	UINT32_MAX
+
+static inline uint32_t sparing_hash(uint32_t packet)
+{
+	return packet * 2654435761U;
+}
+
+static int sparing_map_grow(struct udf_sparing_map *map)
+{
+	uint32_t size = map->size ? map->size * 2 : 64;
+	uint32_t *orig, *mapped;
+	uint32_t i, slot;
+
+	orig = malloc(size * sizeof(uint32_t));
+	mapped = malloc(size * sizeof(uint32_t));
+	if (!orig || !mapped)
+	{
+		free(orig);
+		free(mapped);
+		return -1;
+	}
+	memset(orig, 0xFF, size * sizeof(uint32_t));
+
+	for (i = 0; i < map->size; ++i)
+	{
+		if (map->orig[i] == SPARING_EMPTY)
+			continue;
+		for (slot = sparing_hash(map->orig[i]) & (size - 1); orig[slot] != SPARING_EMPTY; slot = (slot + 1) & (size - 1))
+			;
+		orig[slot] = map->orig[i];
+		mapped[slot] = map->mapped[i];
+	}
+
+	free(map->orig);
+	free(map->mapped);
+	map->orig = orig;
+	map->mapped = mapped;
+	map->size = size;
+	return 0;
+}
+
+/**
+ * @brief initialize empty sparing map
+ * @param map sparing map
+ * @param packet_len packet length of sparable partition in blocks
+ */
+void udf_sparing_map_init(struct udf_sparing_map *map, uint32_t packet_len)
+{
+	memset(map, 0, sizeof(*map));
+	map->packet_len = packet_len ? packet_len : 1;
+}
+
+/**
+ * @brief free memory of sparing map
+ * @param map sparing map
+ */
+void udf_sparing_map_free(struct udf_sparing_map *map)
+{
+	free(map->orig);
+	free(map->mapped);
+	udf_sparing_map_init(map, map->packet_len);
+}
+
+/**
+ * @brief remap packet, replacing previous mapping of the same packet
+ * @param map sparing map
+ * @param orig original location of packet
+ * @param mapped location of its spare packet
+ * @return 0 on success, -1 when out of memory
+ */
+int udf_sparing_map_add(struct udf_sparing_map *map, uint32_t orig, uint32_t mapped)
+{
+	uint32_t hash, slot;
+
+	if (orig >= 0xFFFFFFF0)
+		return 0;
+
+	if (2 * (map->count + 1) > map->size && sparing_map_grow(map) < 0)
+		return -1;
+
+	hash = sparing_hash(orig);
+	for (slot = hash & (map->size - 1); map->orig[slot] != SPARING_EMPTY; slot = (slot + 1) & (map->size - 1))
+	{
+		if (map->orig[slot] == orig)
+		{
+			map->mapped[slot] = mapped;
+			return 0;
+		}
+	}
+
+	map->orig[slot] = orig;
+	map->mapped[slot] = mapped;
+	map->count++;
+	map->filter[(hash >> 16) % UDF_SPARING_FILTER_BITS / 32] |= UINT32_C(1) << ((hash >> 16) % 32);
+	return 0;
+}
+
+/**
+ * @brief find mapping of packet
+ * @param map sparing map
+ * @param orig original location of packet
+ * @param mapped set to location of spare packet when found
+ * @return 1 when packet is remapped, 0 when not
+ */
+int udf_sparing_map_find(const struct udf_sparing_map *map, uint32_t orig, uint32_t *mapped)
+{
+	uint32_t hash, slot;
+
+	hash = sparing_hash(orig);
+	if (!(map->filter[(hash >> 16) % UDF_SPARING_FILTER_BITS / 32] & (UINT32_C(1) << ((hash >> 16) % 32))))
+		return 0;
+
+	for (slot = hash & (map->size - 1); map->orig[slot] != SPARING_EMPTY; slot = (slot + 1) & (map->size - 1))
+	{
+		if (map->orig[slot] == orig)
+		{
+			*mapped = map->mapped[slot];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief translate block through sparing map
+ * @param map sparing map
+ * @param block block location
+ * @return location in spare packet if packet of block is remapped, otherwise block
+ */
+uint32_t udf_sparing_map_lookup(const struct udf_sparing_map *map, uint32_t block)
+{
+	uint32_t offset, mapped;
+
+	if (!map->count)
+		return block;
+
+	offset = block % map->packet_len;
+	if (udf_sparing_map_find(map, block - offset, &mapped))
+		return mapped + offset;
+	return block;
+}
+
+/**
+ * @brief add all entries of sparing table to sparing map
+ * @param map sparing map
+ * @param st sparing table in little endian
+ * @return 0 on success, -1 when out of memory
+ */
+int udf_sparing_map_load(struct udf_sparing_map *map, const struct sparingTable *st)
+{
+	uint16_t num = le16_to_cpu(st->reallocationTableLen);
+	uint16_t i;
+
+	for (i = 0; i < num; ++i)
+	{
+		if (udf_sparing_map_add(map, le32_to_cpu(st->mapEntry[i].origLocation), le32_to_cpu(st->mapEntry[i].mappedLocation)) < 0)
+			return -1;
+	}
+	return 0;
+}
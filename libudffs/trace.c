@@ -0,0 +1,207 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * libudffs trace points of I/O and CRC calculation
+ *
+ * Every trace point fires USDT probes udftools:NAME__start and
+ * udftools:NAME__done when built with <sys/sdt.h>, so runs can be profiled
+ * by bpftrace or perf without rebuilding. Probes are single nop instructions
+ * while nobody is attached.
+ *
+ * When environment variable UDF_TRACE is set to - (standard error) or to
+ * a file name, trace points are also counted in a table which is written
+ * at exit: calls, bytes, errors, cache hits and log2 histogram of latency.
+ * Disabled table costs one load and branch per trace point.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libudffs.h"
+
+int udf_trace_enabled = 0;
+
+struct trace_counters
+{
+	uint64_t	calls;
+	uint64_t	bytes;
+	uint64_t	errors;
+	uint64_t	hits;
+	uint64_t	nsecs;
+	uint64_t	max;
+	uint64_t	histogram[UDF_TRACE_BUCKETS];
+};
+
+static struct trace_counters trace_table[UDF_TRACE_POINTS];
+
+static const char *trace_names[UDF_TRACE_POINTS] = {
+	"medium_read",
+	"medium_map",
+	"cache_get",
+	"cache_sync",
+	"write",
+	"packet_read",
+	"packet_write",
+	"cd_read",
+	"cd_write",
+	"crc",
+};
+
+static const char *trace_tool;
+static char *trace_target;
+
+/**
+ * @brief monotonic time in nanoseconds, never 0
+ */
+uint64_t udf_trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + 1;
+}
+
+/**
+ * @brief count finished call of trace point
+ * @param point UDF_TRACE_* trace point
+ * @param start udf_trace_clock() when call started
+ * @param bytes number of bytes transferred, negative on error
+ */
+void udf_trace_record(unsigned int point, uint64_t start, int64_t bytes)
+{
+	struct trace_counters *c = &trace_table[point];
+	uint64_t nsecs = udf_trace_clock() - start;
+	uint64_t max;
+	unsigned int bucket = 0;
+
+	while (bucket < UDF_TRACE_BUCKETS - 1 && (nsecs >> (bucket + 1)))
+		bucket++;
+
+	__atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+	if (bytes < 0)
+		__atomic_fetch_add(&c->errors, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->nsecs, nsecs, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&c->histogram[bucket], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+	while (nsecs > max && !__atomic_compare_exchange_n(&c->max, &max, nsecs, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * @brief count call of trace point served from cache without I/O
+ */
+void udf_trace_hit(unsigned int point)
+{
+	__atomic_fetch_add(&trace_table[point].hits, 1, __ATOMIC_RELAXED);
+}
+
+static void trace_dump(void)
+{
+	uint64_t calls, bytes, errors, hits, nsecs, max, count;
+	FILE *out;
+	int i, j;
+
+	if (!udf_trace_enabled)
+		return;
+	udf_trace_enabled = 0;
+
+	if (!strcmp(trace_target, "-"))
+		out = stderr;
+	else
+	{
+		out = fopen(trace_target, "w");
+		if (!out)
+		{
+			fprintf(stderr, "%s: Error: Cannot write trace to '%s': %s\n", trace_tool, trace_target, strerror(errno));
+			free(trace_target);
+			return;
+		}
+	}
+
+	fprintf(out, "# %s trace, times in microseconds\n", trace_tool);
+	fprintf(out, "%-12s %10s %14s %8s %10s %12s %10s %10s\n", "point", "calls", "bytes", "errors", "hits", "total", "avg", "max");
+	for (i = 0; i < UDF_TRACE_POINTS; i++)
+	{
+		calls = __atomic_load_n(&trace_table[i].calls, __ATOMIC_RELAXED);
+		hits = __atomic_load_n(&trace_table[i].hits, __ATOMIC_RELAXED);
+		if (!calls && !hits)
+			continue;
+		bytes = __atomic_load_n(&trace_table[i].bytes, __ATOMIC_RELAXED);
+		errors = __atomic_load_n(&trace_table[i].errors, __ATOMIC_RELAXED);
+		nsecs = __atomic_load_n(&trace_table[i].nsecs, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&trace_table[i].max, __ATOMIC_RELAXED);
+		fprintf(out, "%-12s %10"PRIu64" %14"PRIu64" %8"PRIu64" %10"PRIu64" %12.1f %10.3f %10.1f\n",
+			trace_names[i], calls, bytes, errors, hits, nsecs / 1e3, calls ? nsecs / 1e3 / calls : 0.0, max / 1e3);
+	}
+
+	// Histogram line lists upper bound of bucket in microseconds and count of calls
+	for (i = 0; i < UDF_TRACE_POINTS; i++)
+	{
+		if (!__atomic_load_n(&trace_table[i].calls, __ATOMIC_RELAXED))
+			continue;
+		fprintf(out, "latency %s:", trace_names[i]);
+		for (j = 0; j < UDF_TRACE_BUCKETS; j++)
+		{
+			count = __atomic_load_n(&trace_table[i].histogram[j], __ATOMIC_RELAXED);
+			if (count)
+				fprintf(out, " <%g:%"PRIu64, (double)((uint64_t)2 << j) / 1e3, count);
+		}
+		fprintf(out, "\n");
+	}
+
+	if (out != stderr)
+		fclose(out);
+	free(trace_target);
+}
+
+/**
+ * @brief enable counter table when UDF_TRACE is set, it is written at exit
+ * @param tool name printed in the table
+ * @return 0 on success, -1 on failure with errno set
+ */
+int udf_trace_start(const char *tool)
+{
+	const char *target = getenv("UDF_TRACE");
+
+	if (!target || !*target || udf_trace_enabled)
+		return 0;
+
+	trace_tool = tool;
+	trace_target = strdup(target);
+	if (!trace_target)
+		return -1;
+	if (atexit(trace_dump) != 0)
+	{
+		free(trace_target);
+		trace_target = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(trace_table, 0, sizeof(trace_table));
+	udf_trace_enabled = 1;
+	return 0;
+}
@@ -39,9 +39,142 @@
 #include <errno.h>
 #include <limits.h>
 
-size_t decode_utf8(const dchars *in, char *out, size_t inlen, size_t outlen)
+#ifdef HAVE_LANGINFO_H
+#include <langinfo.h>
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define ASCII_ONES	0x0101010101010101ULL
+#define ASCII_HIGHS	0x8080808080808080ULL
+
+/**
+ * @brief count leading 7-bit characters (0x01 to 0x7F) of 8-bit code units
+ * @param in the code units
+ * @param len the number of code units
+ * @return the number of leading 7-bit characters
+ */
+static size_t ascii8_run(const uint8_t *in, size_t len)
 {
-	size_t len = 0, i;
+	size_t i = 0;
+
+#if defined(__GNUC__) && defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		/* High bit of a byte is set for NUL and for bytes above 0x7F */
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#else
+	for (; i + 8 <= len; i += 8)
+	{
+		uint64_t w;
+		memcpy(&w, in + i, sizeof(w));
+		/* w - ASCII_ONES sets high bit of NUL bytes */
+		if ((w | (w - ASCII_ONES)) & ASCII_HIGHS)
+			break;
+	}
+#endif
+
+	while (i < len && in[i] != 0 && in[i] < 0x80U)
+		i++;
+	return i;
+}
+
+/**
+ * @brief count leading 7-bit characters (0x0001 to 0x007F) of big endian
+ *        16-bit code units
+ * @param in the code units
+ * @param len the number of code units
+ * @return the number of leading 7-bit characters
+ */
+static size_t ascii16_run(const uint8_t *in, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__GNUC__) && defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bits = _mm_set1_epi16((short)0x80FF);
+
+	/* Lanes are byte swapped code units, 7-bit ones are 0x0100 to 0x7F00 */
+	for (; i + 8 <= len; i += 8)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2*i));
+		__m128i ok = _mm_andnot_si128(_mm_cmpeq_epi16(v, zero),
+		                              _mm_cmpeq_epi16(_mm_and_si128(v, bits), zero));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(ok) ^ 0xFFFFU;
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+#endif
+
+	while (i < len && in[2*i] == 0 && in[2*i+1] != 0 && in[2*i+1] < 0x80U)
+		i++;
+	return i;
+}
+
+/**
+ * @brief copy leading 7-bit characters of OSTA CS0 dchars
+ * @param in the dchars, the first byte is the compression ID
+ * @param i the index of the first code unit to copy
+ * @param inlen the length of the dchars in bytes
+ * @param out the output buffer
+ * @param len the position in the output buffer
+ * @param outlen the size of the output buffer, one byte is kept for NUL
+ * @return the number of copied characters
+ */
+static size_t copy_ascii(const dchars *in, size_t i, size_t inlen, char *out, size_t len, size_t outlen)
+{
+	size_t n, k;
+
+	if (len+1 >= outlen)
+		return 0;
+
+	if (in[0] == 8)
+	{
+		n = ascii8_run(in + i, inlen - i);
+		if (n > outlen - len - 1)
+			n = outlen - len - 1;
+		memcpy(out + len, in + i, n);
+	}
+	else
+	{
+		n = ascii16_run(in + i, (inlen - i) / 2);
+		if (n > outlen - len - 1)
+			n = outlen - len - 1;
+		k = 0;
+#if defined(__GNUC__) && defined(__SSE2__)
+		for (; k + 8 <= n; k += 8)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(in + i + 2*k));
+			_mm_storel_epi64((__m128i *)(out + len + k), _mm_packus_epi16(_mm_srli_epi16(v, 8), v));
+		}
+#endif
+		for (; k < n; k++)
+			out[len+k] = (char)in[i+2*k+1];
+	}
+
+	return n;
+}
+
+/**
+ * @brief convert OSTA CS0 dchars to UTF-8
+ * @param in the dchars, the first byte is the compression ID
+ * @param out the output buffer
+ * @param inlen the length of the dchars in bytes
+ * @param outlen the size of the output buffer
+ * @param lone_surrogate replace unpaired UTF-16 surrogates by '?' as wcrtomb() does, instead of encoding them
+ * @return the length of the output string, (size_t)-1 on error
+ */
+static size_t decode_to_utf8(const dchars *in, char *out, size_t inlen, size_t outlen, int lone_surrogate)
+{
+	size_t len = 0, i, n;
 	unsigned int c;
 
 	if (outlen == 0)
@@ -55,6 +188,15 @@ size_t decode_utf8(const dchars *in, char *out, size_t inlen, size_t outlen)
 
 	for (i=1; i<inlen;)
 	{
+		/* Names are mostly ASCII, copy whole runs of 7-bit characters */
+		n = copy_ascii(in, i, inlen, out, len, outlen);
+		if (n)
+		{
+			len += n;
+			i += (in[0] == 16) ? 2*n : n;
+			continue;
+		}
+
 		c = in[i++];
 		if (in[0] == 16)
 			c = (c << 8) | in[i++];
@@ -85,6 +227,12 @@ size_t decode_utf8(const dchars *in, char *out, size_t inlen, size_t outlen)
 			out[len++] = (uint8_t)(0x80 | ((c >> 6) & 0x3f));
 			out[len++] = (uint8_t)(0x80 | (c & 0x3f));
 		}
+		else if (lone_surrogate && c >= 0xD800 && c <= 0xDFFF)
+		{
+			if (len+1 >= outlen)
+				return (size_t)-1;
+			out[len++] = '?';
+		}
 		else
 		{
 			if (len+3 >= outlen)
@@ -99,6 +247,26 @@ size_t decode_utf8(const dchars *in, char *out, size_t inlen, size_t outlen)
 	return len;
 }
 
+/**
+ * @brief check whether current locale encoding is UTF-8
+ * @return 1 if it is UTF-8, 0 otherwise
+ */
+static int locale_is_utf8(void)
+{
+#ifdef HAVE_LANGINFO_H
+	const char *codeset = nl_langinfo(CODESET);
+
+	return codeset && (strcmp(codeset, "UTF-8") == 0 || strcmp(codeset, "utf8") == 0);
+#else
+	return 0;
+#endif
+}
+
+size_t decode_utf8(const dchars *in, char *out, size_t inlen, size_t outlen)
+{
+	return decode_to_utf8(in, out, inlen, outlen, 0);
+}
+
 size_t encode_utf8(dchars *out, const char *in, size_t outlen)
 {
 	size_t inlen = strlen(in);
@@ -117,6 +285,21 @@ try_again:
 
 	for (i=0; i<inlen; i++)
 	{
+		/* Runs of 7-bit characters are copied as they are with 8-bit code units */
+		if (!utf_cnt && max_val != 0x10FFFF && len < outlen)
+		{
+			size_t n = ascii8_run((const uint8_t *)in + i, inlen - i);
+			if (n > outlen - len)
+				n = outlen - len;
+			if (n > 1)
+			{
+				memcpy(out + len, in + i, n);
+				len += n;
+				i += n - 1;
+				continue;
+			}
+		}
+
 		c = in[i];
 
 		/* Complete a multi-byte UTF-8 character */
@@ -218,6 +401,10 @@ size_t decode_locale(const dchars *in, char *out, size_t inlen, size_t outlen)
 	if (outlen == 0)
 		return (size_t)-1;
 
+	/* wcrtomb() in UTF-8 locale produces the same as decode_utf8() */
+	if (locale_is_utf8())
+		return decode_to_utf8(in, out, inlen, outlen, 1);
+
 	if (in[0] == 16 && (inlen-1) % 2 != 0)
 		return (size_t)-1;
 
@@ -301,6 +488,15 @@ size_t encode_locale(dchars *out, const char *in, size_t outlen)
 	wchar_t max_val;
 	wchar_t *wcs;
 
+	/* In UTF-8 locale ASCII string is stored as it is with 8-bit code units */
+	mbslen = strlen(in);
+	if (mbslen+1 <= outlen && locale_is_utf8() && ascii8_run((const uint8_t *)in, mbslen) == mbslen)
+	{
+		out[0] = 8;
+		memcpy(out+1, in, mbslen);
+		return mbslen+1;
+	}
+
 	mbslen = mbstowcs(NULL, in, 0);
 	if (mbslen == (size_t)-1)
 	{
@@ -347,7 +543,7 @@ try_again:
 			if (wcs[i] > 0xFFFF)
 			{
 				if (len+4 > outlen)
-					return (size_t)-1;
+					goto error_out;
 				out[len++] = ((((wcs[i] - 0x10000) >> 10) + 0xD800) >> 8) & 0xFF;
 				out[len++] = (((wcs[i] - 0x10000) >> 10) + 0xD800) & 0xFF;
 				wcs[i] = ((wcs[i] - 0x10000) & 0x3FF) + 0xDC00;
@@ -409,6 +409,26 @@ struct virtualPartitionMap default_virtmap =
 	.volSeqNum = constant_cpu_to_le16(1)
 };
 
+struct metadataPartitionMap default_metamap =
+{
+	.partitionMapType = 2,
+	.partitionMapLength = sizeof(struct metadataPartitionMap),
+	.partIdent =
+	{
+		.flags = 0,
+		.ident = UDF_ID_METADATA,
+		.identSuffix =
+		{
+			0x50,
+			0x02,
+			UDF_OS_CLASS_UNIX,
+			UDF_OS_ID_LINUX
+		},
+	},
+	.volSeqNum = constant_cpu_to_le16(1),
+	.metadataBitmapFileLoc = constant_cpu_to_le32(0xFFFFFFFF)
+};
+
 struct fileSetDesc default_fsd =
 {
 	.descTag =
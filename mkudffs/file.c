@@ -110,7 +110,7 @@ tag query_tag(struct udf_disc *disc, struct udf_extent *ext, struct udf_desc *de
 	}
 	ret.descCRC = cpu_to_le16(crc);
 	if (ext->space_type & PSPACE)
-		ret.tagLocation = cpu_to_le32(desc->offset);
+		ret.tagLocation = cpu_to_le32(udf_lb_num(disc, desc->offset));
 	else
 		ret.tagLocation = cpu_to_le32(ext->start + desc->offset);
 	for (i=0; i<16; i++)
@@ -197,18 +197,18 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 
 			if (le32_to_cpu(efe->lengthAllocDescs) == 0)
 			{
-				block = udf_alloc_blocks(disc, pspace, desc->offset, 1);
-				fiddesc = set_desc(pspace, TAG_IDENT_FID, block, data->length, data);
+				block = udf_alloc_meta_blocks(disc, pspace, desc->offset, 1);
+				fiddesc = set_desc(disc, pspace, TAG_IDENT_FID, block, data->length, data);
 				if ((le16_to_cpu(efe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
 				{
 					short_ad *sad;
 
 					parent->length += sizeof(short_ad);
 					parent->data->length += sizeof(short_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
+					parent->data->buffer = udf_arena_realloc(disc, parent->data->buffer, parent->length - sizeof(short_ad), parent->length);
 					efe = (struct extendedFileEntry *)parent->data->buffer;
 					sad = (short_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs)];
-					sad->extPosition = cpu_to_le32(block);
+					sad->extPosition = cpu_to_le32(udf_lb_num(disc, block));
 					sad->extLength = cpu_to_le32(data->length);
 					efe->lengthAllocDescs = cpu_to_le32(sizeof(short_ad));
 				}
@@ -218,11 +218,11 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 
 					parent->length += sizeof(long_ad);
 					parent->data->length += sizeof(long_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
+					parent->data->buffer = udf_arena_realloc(disc, parent->data->buffer, parent->length - sizeof(long_ad), parent->length);
 					efe = (struct extendedFileEntry *)parent->data->buffer;
 					lad = (long_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs)];
-					lad->extLocation.logicalBlockNum = cpu_to_le32(block);
-					lad->extLocation.partitionReferenceNum = cpu_to_le16(0);
+					lad->extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, block));
+					lad->extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, block));
 					lad->extLength = cpu_to_le32(data->length);
 					efe->lengthAllocDescs = cpu_to_le32(sizeof(long_ad));
 				}
@@ -235,8 +235,8 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 					short_ad *sad;
 
 					sad = (short_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs) - sizeof(short_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(sad->extPosition));
-					block = fiddesc->offset;
+					fiddesc = find_desc(pspace, udf_lb_offset(disc, udf_lb_partition(disc, parent->offset), le32_to_cpu(sad->extPosition)));
+					block = fiddesc->offset + fiddesc->length / disc->blocksize;
 					append_data(fiddesc, data);
 					sad->extLength = cpu_to_le32(le32_to_cpu(sad->extLength) + data->length);
 				}
@@ -245,8 +245,8 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 					long_ad *lad;
 
 					lad = (long_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs) - sizeof(long_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(lad->extLocation.logicalBlockNum));
-					block = fiddesc->offset;
+					fiddesc = find_desc(pspace, udf_lb_offset(disc, le16_to_cpu(lad->extLocation.partitionReferenceNum), le32_to_cpu(lad->extLocation.logicalBlockNum)));
+					block = fiddesc->offset + fiddesc->length / disc->blocksize;
 					append_data(fiddesc, data);
 					lad->extLength = cpu_to_le32(le32_to_cpu(lad->extLength) + data->length);
 				}
@@ -269,18 +269,18 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 
 			if (le32_to_cpu(fe->lengthAllocDescs) == 0)
 			{
-				block = udf_alloc_blocks(disc, pspace, desc->offset, 1);
-				fiddesc = set_desc(pspace, TAG_IDENT_FID, block, data->length, data);
+				block = udf_alloc_meta_blocks(disc, pspace, desc->offset, 1);
+				fiddesc = set_desc(disc, pspace, TAG_IDENT_FID, block, data->length, data);
 				if ((le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
 				{
 					short_ad *sad;
 
 					parent->length += sizeof(short_ad);
 					parent->data->length += sizeof(short_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
+					parent->data->buffer = udf_arena_realloc(disc, parent->data->buffer, parent->length - sizeof(short_ad), parent->length);
 					fe = (struct fileEntry *)parent->data->buffer;
 					sad = (short_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs)];
-					sad->extPosition = cpu_to_le32(block);
+					sad->extPosition = cpu_to_le32(udf_lb_num(disc, block));
 					sad->extLength = cpu_to_le32(data->length);
 					fe->lengthAllocDescs = cpu_to_le32(sizeof(short_ad));
 				}
@@ -290,11 +290,11 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 
 					parent->length += sizeof(long_ad);
 					parent->data->length += sizeof(long_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
+					parent->data->buffer = udf_arena_realloc(disc, parent->data->buffer, parent->length - sizeof(long_ad), parent->length);
 					fe = (struct fileEntry *)parent->data->buffer;
 					lad = (long_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs)];
-					lad->extLocation.logicalBlockNum = cpu_to_le32(block);
-					lad->extLocation.partitionReferenceNum = cpu_to_le16(0);
+					lad->extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, block));
+					lad->extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, block));
 					lad->extLength = cpu_to_le32(data->length);
 					fe->lengthAllocDescs = cpu_to_le32(sizeof(long_ad));
 				}
@@ -307,8 +307,8 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 					short_ad *sad;
 
 					sad = (short_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs) - sizeof(short_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(sad->extPosition));
-					block = fiddesc->offset;
+					fiddesc = find_desc(pspace, udf_lb_offset(disc, udf_lb_partition(disc, parent->offset), le32_to_cpu(sad->extPosition)));
+					block = fiddesc->offset + fiddesc->length / disc->blocksize;
 					append_data(fiddesc, data);
 					sad->extLength = cpu_to_le32(le32_to_cpu(sad->extLength) + data->length);
 				}
@@ -317,8 +317,8 @@ int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 					long_ad *lad;
 
 					lad = (long_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs) - sizeof(long_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(lad->extLocation.logicalBlockNum));
-					block = fiddesc->offset;
+					fiddesc = find_desc(pspace, udf_lb_offset(disc, le16_to_cpu(lad->extLocation.partitionReferenceNum), le32_to_cpu(lad->extLocation.logicalBlockNum)));
+					block = fiddesc->offset + fiddesc->length / disc->blocksize;
 					append_data(fiddesc, data);
 					lad->extLength = cpu_to_le32(le32_to_cpu(lad->extLength) + data->length);
 				}
@@ -375,6 +375,156 @@ void insert_data(struct udf_disc *disc, struct udf_extent *pspace, struct udf_de
 	*(tag *)desc->data->buffer = query_tag(disc, pspace, desc, 1);
 }
 
+/**
+ * @brief make room for directory entries of known total length, so that
+ *        they need not fit into one block; entries which do not fit into the
+ *        ICB are moved into contiguous blocks allocated for the whole directory
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param length the length of FIDs which will be added in bytes
+ * @return void
+ */
+void udf_reserve_dir(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir, uint64_t length)
+{
+	struct extendedFileEntry *efe = NULL;
+	struct fileEntry *fe = NULL;
+	struct udf_desc *fiddesc;
+	struct udf_data *fids, *data;
+	uint16_t flags;
+	uint32_t lengthExtendedAttr, lengthAllocDescs, recorded, block, blocks;
+	uint64_t used;
+	short_ad *sad;
+	long_ad *lad;
+
+#define UPDATE_PTR                                                            \
+	do                                                                    \
+	{                                                                     \
+		if (disc->flags & FLAG_EFE)                                   \
+		{                                                             \
+			efe = (struct extendedFileEntry *)dir->data->buffer;  \
+			flags = le16_to_cpu(efe->icbTag.flags);               \
+			lengthExtendedAttr = le32_to_cpu(efe->lengthExtendedAttr); \
+			lengthAllocDescs = le32_to_cpu(efe->lengthAllocDescs); \
+			recorded = le64_to_cpu(efe->logicalBlocksRecorded);   \
+			used = le64_to_cpu(efe->informationLength);           \
+		}                                                             \
+		else                                                          \
+		{                                                             \
+			fe = (struct fileEntry *)dir->data->buffer;           \
+			flags = le16_to_cpu(fe->icbTag.flags);                \
+			lengthExtendedAttr = le32_to_cpu(fe->lengthExtendedAttr); \
+			lengthAllocDescs = le32_to_cpu(fe->lengthAllocDescs); \
+			recorded = le64_to_cpu(fe->logicalBlocksRecorded);    \
+			used = le64_to_cpu(fe->informationLength);            \
+		}                                                             \
+	} while ( 0 )
+
+	UPDATE_PTR;
+
+	length += used;
+	blocks = (length + disc->blocksize - 1) / disc->blocksize;
+
+	if ((flags & ICBTAG_FLAG_AD_MASK) != ICBTAG_FLAG_AD_IN_ICB && lengthAllocDescs)
+	{
+		uint32_t align = disc->sizing[PSPACE_SIZE].align;
+
+		/* Only the first block was allocated by insert_desc(), rest must follow it */
+		if (blocks <= recorded)
+			return;
+		if ((flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
+		{
+			sad = (short_ad *)&((disc->flags & FLAG_EFE) ? efe->extendedAttrAndAllocDescs : fe->extendedAttrAndAllocDescs)[lengthExtendedAttr];
+			block = udf_lb_offset(disc, udf_lb_partition(disc, dir->offset), le32_to_cpu(sad->extPosition));
+		}
+		else
+		{
+			lad = (long_ad *)&((disc->flags & FLAG_EFE) ? efe->extendedAttrAndAllocDescs : fe->extendedAttrAndAllocDescs)[lengthExtendedAttr];
+			block = udf_lb_offset(disc, le16_to_cpu(lad->extLocation.partitionReferenceNum), le32_to_cpu(lad->extLocation.logicalBlockNum));
+		}
+		disc->sizing[PSPACE_SIZE].align = 1;
+		if (udf_alloc_meta_blocks(disc, pspace, block + recorded, blocks - recorded) != (int)(block + recorded))
+		{
+			fprintf(stderr, "%s: Error: Not enough contiguous blocks for directory\n", appname);
+			exit(1);
+		}
+		disc->sizing[PSPACE_SIZE].align = align;
+	}
+	else if ((flags & ICBTAG_FLAG_AD_MASK) != ICBTAG_FLAG_AD_IN_ICB || dir->data->length + length > disc->blocksize)
+	{
+		size_t adlen = ((flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG) ? sizeof(long_ad) : sizeof(short_ad);
+
+		block = udf_alloc_meta_blocks(disc, pspace, dir->offset, blocks);
+
+		/* FIDs stored in ICB follow the FE as separate udf_data items */
+		fids = dir->data->next;
+		dir->data->next = NULL;
+		dir->data_tail = NULL;
+		dir->length = dir->data->length;
+		if (fids)
+			fids->prev = NULL;
+		else
+			fids = alloc_data(disc, NULL, 0);
+
+		dir->data->buffer = udf_arena_realloc(disc, dir->data->buffer, dir->data->length, dir->data->length + adlen);
+		dir->length += adlen;
+		dir->data->length += adlen;
+
+		UPDATE_PTR;
+
+		if ((flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB)
+			flags = (flags & ~ICBTAG_FLAG_AD_MASK) | ICBTAG_FLAG_AD_SHORT;
+		if ((flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
+		{
+			sad = (short_ad *)&((disc->flags & FLAG_EFE) ? efe->extendedAttrAndAllocDescs : fe->extendedAttrAndAllocDescs)[lengthExtendedAttr];
+			sad->extPosition = cpu_to_le32(udf_lb_num(disc, block));
+			sad->extLength = cpu_to_le32(used);
+		}
+		else
+		{
+			lad = (long_ad *)&((disc->flags & FLAG_EFE) ? efe->extendedAttrAndAllocDescs : fe->extendedAttrAndAllocDescs)[lengthExtendedAttr];
+			lad->extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, block));
+			lad->extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, block));
+			lad->extLength = cpu_to_le32(used);
+		}
+		if (disc->flags & FLAG_EFE)
+		{
+			efe->icbTag.flags = cpu_to_le16(flags);
+			efe->lengthAllocDescs = cpu_to_le32(adlen);
+		}
+		else
+		{
+			fe->icbTag.flags = cpu_to_le16(flags);
+			fe->lengthAllocDescs = cpu_to_le32(adlen);
+		}
+
+		fiddesc = set_desc(disc, pspace, TAG_IDENT_FID, block, used, fids);
+
+		/* Moved FIDs are recorded at new location */
+		used = 0;
+		for (data = fids; data != NULL; data = data->next)
+		{
+			struct fileIdentDesc *fid = data->buffer;
+
+			if (!data->length)
+				continue;
+			fid->descTag = udf_query_tag(disc, TAG_IDENT_FID, 1, udf_lb_num(disc, fiddesc->offset + used / disc->blocksize), data, 0, data->length);
+			used += data->length;
+		}
+	}
+	else
+		return;
+
+	if (disc->flags & FLAG_EFE)
+		efe->logicalBlocksRecorded = cpu_to_le64(blocks);
+	else
+		fe->logicalBlocksRecorded = cpu_to_le64(blocks);
+
+	*(tag *)dir->data->buffer = query_tag(disc, pspace, dir, 1);
+
+#undef UPDATE_PTR
+}
+
 /**
  * @brief helper function to compute tag:FID udf_descriptor size and padding
  *        to a multiple of 4 bytes
@@ -408,11 +558,11 @@ void insert_fid(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 	uint64_t uniqueID;
 	uint32_t uniqueID_le32;
 
-	data = alloc_data(NULL, ilength);
+	data = alloc_data(disc, NULL, ilength);
 	fid = data->buffer;
 
 	offset = insert_desc(disc, pspace, desc, parent, data);
-	fid->descTag.tagLocation = cpu_to_le32(offset);
+	fid->descTag.tagLocation = cpu_to_le32(udf_lb_num(disc, offset));
 
 	if (disc->flags & FLAG_EFE)
 	{
@@ -427,11 +577,11 @@ void insert_fid(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 			fid->icb.extLength = cpu_to_le32(disc->blocksize * 2);
 		else
 			fid->icb.extLength = cpu_to_le32(disc->blocksize);
-		fid->icb.extLocation.logicalBlockNum = cpu_to_le32(desc->offset);
+		fid->icb.extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, desc->offset));
 		if (disc->flags & FLAG_VAT)
 			fid->icb.extLocation.partitionReferenceNum = cpu_to_le16(1);
 		else
-			fid->icb.extLocation.partitionReferenceNum = cpu_to_le16(0);
+			fid->icb.extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, desc->offset));
 
 		uniqueID_le32 = cpu_to_le32(uniqueID & 0x00000000FFFFFFFFUL);
 		adiu = (struct allocDescImpUse *)fid->icb.impUse;
@@ -460,11 +610,11 @@ void insert_fid(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 			fid->icb.extLength = cpu_to_le32(disc->blocksize * 2);
 		else
 			fid->icb.extLength = cpu_to_le32(disc->blocksize);
-		fid->icb.extLocation.logicalBlockNum = cpu_to_le32(desc->offset);
+		fid->icb.extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, desc->offset));
 		if (disc->flags & FLAG_VAT)
 			fid->icb.extLocation.partitionReferenceNum = cpu_to_le16(1);
 		else
-			fid->icb.extLocation.partitionReferenceNum = cpu_to_le16(0);
+			fid->icb.extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, desc->offset));
 
 		uniqueID_le32 = cpu_to_le32(uniqueID & 0x00000000FFFFFFFFUL);
 		adiu = (struct allocDescImpUse *)fid->icb.impUse;
@@ -519,7 +669,7 @@ void insert_ea(struct udf_disc *disc, struct udf_desc *desc, struct genericForma
 	{
 		desc->length += sizeof(*ea_hdr);
 		desc->data->length += sizeof(*ea_hdr);
-		desc->data->buffer = realloc(desc->data->buffer, desc->data->length);
+		desc->data->buffer = udf_arena_realloc(disc, desc->data->buffer, desc->data->length - sizeof(*ea_hdr), desc->data->length);
 
 		UPDATE_PTR;
 
@@ -544,7 +694,7 @@ void insert_ea(struct udf_disc *disc, struct udf_desc *desc, struct genericForma
 	{
 		desc->length += length;
 		desc->data->length += length;
-		desc->data->buffer = realloc(desc->data->buffer, desc->data->length);
+		desc->data->buffer = udf_arena_realloc(disc, desc->data->buffer, desc->data->length - length, desc->data->length);
 
 		UPDATE_PTR;
 
@@ -580,7 +730,7 @@ void insert_ea(struct udf_disc *disc, struct udf_desc *desc, struct genericForma
 	{
 		desc->length += length;
 		desc->data->length += length;
-		desc->data->buffer = realloc(desc->data->buffer, desc->data->length);
+		desc->data->buffer = udf_arena_realloc(disc, desc->data->buffer, desc->data->length - length, desc->data->length);
 
 		UPDATE_PTR;
 
@@ -614,7 +764,7 @@ void insert_ea(struct udf_disc *disc, struct udf_desc *desc, struct genericForma
 	{
 		desc->length += length;
 		desc->data->length += length;
-		desc->data->buffer = realloc(desc->data->buffer, desc->data->length);
+		desc->data->buffer = udf_arena_realloc(disc, desc->data->buffer, desc->data->length - length, desc->data->length);
 
 		UPDATE_PTR;
 
@@ -664,16 +814,16 @@ struct udf_desc *udf_create(struct udf_disc *disc, struct udf_extent *pspace, co
 	struct udf_desc *desc;
 
 	if (disc->flags & FLAG_STRATEGY4096)
-		offset = udf_alloc_blocks(disc, pspace, offset, 2);
+		offset = udf_alloc_meta_blocks(disc, pspace, offset, 2);
 	else
-		offset = udf_alloc_blocks(disc, pspace, offset, 1);
+		offset = udf_alloc_meta_blocks(disc, pspace, offset, 1);
 
 	if (disc->flags & FLAG_EFE)
 	{
 		struct extendedFileEntry *efe;
 		uint64_t uniqueID_le64;
 
-		desc = set_desc(pspace, TAG_IDENT_EFE, offset, sizeof(struct extendedFileEntry), NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_EFE, offset, sizeof(struct extendedFileEntry), NULL);
 		efe = (struct extendedFileEntry *)desc->data->buffer;
 		memcpy(efe, &default_efe, sizeof(struct extendedFileEntry));
 		memcpy(&efe->accessTime, &disc->udf_pvd[0]->recordingDateAndTime, sizeof(timestamp));
@@ -681,6 +831,7 @@ struct udf_desc *udf_create(struct udf_disc *disc, struct udf_extent *pspace, co
 		memcpy(&efe->attrTime, &efe->accessTime, sizeof(timestamp));
 		memcpy(&efe->createTime, &efe->accessTime, sizeof(timestamp));
 		if (filetype == ICBTAG_FILE_TYPE_STREAMDIR ||
+		    filetype >= ICBTAG_FILE_TYPE_MAIN ||
 		    flags & ICBTAG_FLAG_STREAM)
 			efe->uniqueID = cpu_to_le64(0);
 		else
@@ -728,7 +879,7 @@ struct udf_desc *udf_create(struct udf_disc *disc, struct udf_extent *pspace, co
 		}
 		if (filetype == ICBTAG_FILE_TYPE_DIRECTORY)
 			query_lvidiu(disc)->numDirs = cpu_to_le32(le32_to_cpu(query_lvidiu(disc)->numDirs)+1);
-		else if (filetype != ICBTAG_FILE_TYPE_STREAMDIR && filetype != ICBTAG_FILE_TYPE_VAT20 && filetype != ICBTAG_FILE_TYPE_UNDEF && !(flags & ICBTAG_FLAG_STREAM))
+		else if (filetype != ICBTAG_FILE_TYPE_STREAMDIR && filetype != ICBTAG_FILE_TYPE_VAT20 && filetype != ICBTAG_FILE_TYPE_UNDEF && filetype < ICBTAG_FILE_TYPE_MAIN && !(flags & ICBTAG_FLAG_STREAM))
 			query_lvidiu(disc)->numFiles = cpu_to_le32(le32_to_cpu(query_lvidiu(disc)->numFiles)+1);
 	}
 	else
@@ -736,13 +887,14 @@ struct udf_desc *udf_create(struct udf_disc *disc, struct udf_extent *pspace, co
 		struct fileEntry *fe;
 		uint64_t uniqueID_le64;
 
-		desc = set_desc(pspace, TAG_IDENT_FE, offset, sizeof(struct fileEntry), NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_FE, offset, sizeof(struct fileEntry), NULL);
 		fe = (struct fileEntry *)desc->data->buffer;
 		memcpy(fe, &default_fe, sizeof(struct fileEntry));
 		memcpy(&fe->accessTime, &disc->udf_pvd[0]->recordingDateAndTime, sizeof(timestamp));
 		memcpy(&fe->modificationTime, &fe->accessTime, sizeof(timestamp));
 		memcpy(&fe->attrTime, &fe->accessTime, sizeof(timestamp));
 		if (filetype == ICBTAG_FILE_TYPE_STREAMDIR ||
+		    filetype >= ICBTAG_FILE_TYPE_MAIN ||
 		    flags & ICBTAG_FLAG_STREAM)
 			fe->uniqueID = cpu_to_le64(0);
 		else
@@ -790,7 +942,7 @@ struct udf_desc *udf_create(struct udf_disc *disc, struct udf_extent *pspace, co
 		}
 		if (filetype == ICBTAG_FILE_TYPE_DIRECTORY)
 			query_lvidiu(disc)->numDirs = cpu_to_le32(le32_to_cpu(query_lvidiu(disc)->numDirs)+1);
-		else if (filetype != ICBTAG_FILE_TYPE_STREAMDIR && filetype != ICBTAG_FILE_TYPE_VAT20 && filetype != ICBTAG_FILE_TYPE_UNDEF && !(flags & ICBTAG_FLAG_STREAM))
+		else if (filetype != ICBTAG_FILE_TYPE_STREAMDIR && filetype != ICBTAG_FILE_TYPE_VAT20 && filetype != ICBTAG_FILE_TYPE_UNDEF && filetype < ICBTAG_FILE_TYPE_MAIN && !(flags & ICBTAG_FLAG_STREAM))
 			query_lvidiu(disc)->numFiles = cpu_to_le32(le32_to_cpu(query_lvidiu(disc)->numFiles)+1);
 	}
 
@@ -819,127 +971,157 @@ struct udf_desc *udf_mkdir(struct udf_disc *disc, struct udf_extent *pspace, con
 	return desc;
 }
 
-#define BITS_PER_LONG 32
-
-#define leBPL_to_cpup(x) leNUM_to_cpup(BITS_PER_LONG, x)
-#define leNUM_to_cpup(x,y) xleNUM_to_cpup(x,y)
-#define xleNUM_to_cpup(x,y) (le ## x ## _to_cpup(y))
-#define uintBPL uint(BITS_PER_LONG)
-#define uint(x) xuint(x)
-#define xuint(x) uint ## x ## _t
+#define SUMMARY_LEVELS	6
 
 /**
- * @brief utility function to find the first zero bit in an unsigned long
- * @param word the unsigned long to search
- * @return the 0 based bit position from the lsb or BITS_PER_LONG
+ * @brief hierarchical summary of a space bitmap
+ *
+ * Bit i of level 0 tells whether 64-bit word i of the space bitmap has any
+ * bit of the searched kind, bit i of level l+1 tells the same about word i of
+ * level l. The top level fits into one word. Searches test a single word at
+ * every level, so runs of full words (and of full summary words) are skipped
+ * in one jump. There is one summary for free (set) and one for used (clear)
+ * bits. Summary is built on first allocation from the space bitmap and kept
+ * in sync by udf_alloc_bitmap_blocks(), so later changes must go through it.
  */
-static inline unsigned long ffz(unsigned long word)
+struct udf_space_summary
+{
+	const uint8_t		*bitmap;
+	uint32_t		bits;
+	uint32_t		bytes;
+	int			levels;
+	uint32_t		size[SUMMARY_LEVELS];
+	uint64_t		*level[2][SUMMARY_LEVELS];
+	struct udf_space_summary *next;
+};
+
+static inline uint64_t summary_bitmap_word(const struct udf_space_summary *summary, uint32_t word, int used)
 {
-	unsigned long result;
+	uint64_t value = 0;
+	uint32_t pos = word * 8;
 
-	result = 0;
-	while (word & 1)
-	{
-		result ++;
-		word >>= 1;
-	}
+	if (pos + 8 <= summary->bytes)
+		memcpy(&value, summary->bitmap + pos, 8);
+	else
+		memcpy(&value, summary->bitmap + pos, summary->bytes - pos);
+	value = le64_to_cpu(value);
 
-	return result;
+	// Bits behind end of bitmap are reported as used
+	return used ? ~value : value;
 }
 
-/**
- * @brief find the first one bit in a space bitmap
- * @param addr the in-memory address of the space bitmap
- * @param size the size of the space bitmap in bits
- * @param offset the starting bit position for the search
- * @return the 0 based bit position or size
- */
-static inline unsigned long udf_find_next_one_bit (void * addr, unsigned long size, unsigned long offset)
+static inline uint64_t summary_word(const struct udf_space_summary *summary, int l, uint32_t word, int used)
 {
-	uintBPL * p = ((uintBPL *) addr) + (offset / BITS_PER_LONG);
-	uintBPL result = offset & ~(BITS_PER_LONG-1);
-	uintBPL tmp;
-
-	if (offset >= size)
-		return size;
-	size -= result;
-	offset &= (BITS_PER_LONG-1);
-	if (offset)
+	if (l == 0)
+		return summary_bitmap_word(summary, word, used);
+	return summary->level[used][l-1][word];
+}
+
+static void summary_update(struct udf_space_summary *summary, uint32_t word)
+{
+	int used, l;
+
+	for (used = 0; used < 2; used++)
 	{
-		tmp = leBPL_to_cpup(p++);
-		tmp &= ~0UL << offset;
-		if (size < BITS_PER_LONG)
-			goto found_first;
-		if (tmp)
-			goto found_middle;
-		size -= BITS_PER_LONG;
-		result += BITS_PER_LONG;
+		uint32_t index = word;
+
+		for (l = 0; l < summary->levels; l++)
+		{
+			uint64_t *entry = &summary->level[used][l][index / 64];
+			uint64_t bit = 1ULL << (index % 64);
+			uint64_t old = *entry;
+
+			if (summary_word(summary, l, index, used))
+				*entry |= bit;
+			else
+				*entry &= ~bit;
+			// Upper levels change only when word becomes empty or non-empty
+			if ((old != 0) == (*entry != 0))
+				break;
+			index /= 64;
+		}
 	}
-	while (size & ~(BITS_PER_LONG-1))
+}
+
+static struct udf_space_summary *space_summary(struct udf_disc *disc, struct spaceBitmapDesc *sbd)
+{
+	struct udf_space_summary *summary;
+	uint32_t size, i;
+	int used, l;
+
+	// Partition and Metadata Partition have their own space bitmap
+	for (summary = disc->space_summary; summary; summary = summary->next)
+		if (summary->bitmap == sbd->bitmap && summary->bits == le32_to_cpu(sbd->numOfBits))
+			return summary;
+
+	summary = udf_arena_alloc(disc, sizeof(struct udf_space_summary));
+	summary->bitmap = sbd->bitmap;
+	summary->bits = le32_to_cpu(sbd->numOfBits);
+	summary->bytes = le32_to_cpu(sbd->numOfBytes);
+
+	size = (summary->bits + 63) / 64;
+	do
 	{
-		if ((tmp = leBPL_to_cpup(p++)))
-			goto found_middle;
-		result += BITS_PER_LONG;
-		size -= BITS_PER_LONG;
-	}
-	if (!size)
-		return result;
-	tmp = 0;
-	memcpy(&tmp, p, (size+7)/8);
-	tmp = leBPL_to_cpup(&tmp);
-found_first:
-	tmp &= ~0UL >> (BITS_PER_LONG-size);
-	tmp |= (1UL << size);
-found_middle:
-	return result + ffz(~tmp);
+		summary->size[summary->levels] = size;
+		for (used = 0; used < 2; used++)
+			summary->level[used][summary->levels] = udf_arena_alloc(disc, ((size + 63) / 64) * sizeof(uint64_t));
+		summary->levels++;
+		size = (size + 63) / 64;
+	} while (size > 1);
+
+	for (l = 0; l < summary->levels; l++)
+		for (used = 0; used < 2; used++)
+			for (i = 0; i < summary->size[l]; i++)
+				if (summary_word(summary, l, i, used))
+					summary->level[used][l][i / 64] |= 1ULL << (i % 64);
+
+	summary->next = disc->space_summary;
+	disc->space_summary = summary;
+	return summary;
 }
 
 /**
- * @brief find the first zero bit in a space bitmap
- * @param addr the in-memory address of the space bitmap
- * @param size the size of the space bitmap in bits
- * @param offset the starting bit position for the search
- * @return the 0 based bit position or size
+ * @brief find the first free or used block in a space bitmap
+ * @param summary the summary of the space bitmap
+ * @param start the starting bit position for the search
+ * @param used search for used (clear) bit instead of free (set) bit
+ * @return the 0 based bit position or size of the space bitmap
  */
-static inline unsigned long udf_find_next_zero_bit(void * addr, unsigned long size, unsigned long offset)
+static uint32_t summary_find_next(const struct udf_space_summary *summary, uint64_t start, int used)
 {
-	uintBPL * p = ((uintBPL *) addr) + (offset / BITS_PER_LONG);
-	uintBPL result = offset & ~(BITS_PER_LONG-1);
-	uintBPL tmp;
-
-	if (offset >= size)
-		return size;
-	size -= result;
-	offset &= (BITS_PER_LONG-1);
-	if (offset)
-	{
-		tmp = leBPL_to_cpup(p++);
-		tmp |= (~0UL >> (BITS_PER_LONG-offset));
-		if (size < BITS_PER_LONG)
-			goto found_first;
-		if (~tmp)
-			goto found_middle;
-		size -= BITS_PER_LONG;
-		result += BITS_PER_LONG;
-	}
-	while (size & ~(BITS_PER_LONG-1))
+	uint64_t value;
+	uint32_t index;
+	int l;
+
+	if (start >= summary->bits)
+		return summary->bits;
+
+	index = start / 64;
+	value = summary_bitmap_word(summary, index, used) & (~0ULL << (start % 64));
+
+	// Go up until some entry behind current one is not empty
+	for (l = 0; !value; l++)
 	{
-		if (~(tmp = leBPL_to_cpup(p++)))
-			goto found_middle;
-		result += BITS_PER_LONG;
-		size -= BITS_PER_LONG;
+		index++;
+		if (l == summary->levels || index >= summary->size[l])
+			return summary->bits;
+		value = summary->level[used][l][index / 64] & (~0ULL << (index % 64));
+		if (!value)
+		{
+			index /= 64;
+			continue;
+		}
+
+		// And down to the first bitmap word in that entry
+		index = (index & ~63U) + __builtin_ctzll(value);
+		while (l > 0)
+			index = index * 64 + __builtin_ctzll(summary->level[used][--l][index]);
+		value = summary_bitmap_word(summary, index, used);
+		break;
 	}
-	if (!size)
-		return result;
-	tmp = 0;
-	memcpy(&tmp, p, (size+7)/8);
-	tmp = leBPL_to_cpup(&tmp);
-found_first:
-	tmp |= (~0UL << size);
-	if (tmp == (uintBPL)~0UL)	/* Are any bits zero? */
-		return result + size; /* Nope. */
-found_middle:
-	return result + ffz(tmp);
+
+	start = (uint64_t)index * 64 + __builtin_ctzll(value);
+	return (start < summary->bits) ? start : summary->bits;
 }
 
 /**
@@ -954,26 +1136,36 @@ int udf_alloc_bitmap_blocks(struct udf_disc *disc, struct udf_desc *bitmap, uint
 {
 	uint32_t alignment = disc->sizing[PSPACE_SIZE].align;
 	struct spaceBitmapDesc *sbd = (struct spaceBitmapDesc *)bitmap->data->buffer;
-	uint32_t end;
+	struct udf_space_summary *summary = space_summary(disc, sbd);
+	uint64_t pos = start, end;
+	uint32_t word;
 
-	do
+	while (1)
 	{
-		start = ((start + alignment - 1) / alignment) * alignment;
-		if (start + blocks > le32_to_cpu(sbd->numOfBits))
+		pos = ((pos + alignment - 1) / alignment) * alignment;
+		if (pos + blocks > le32_to_cpu(sbd->numOfBits))
 		{
 			fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
 			exit(1);
 		}
-		if (sbd->bitmap[start/8] & (1 << (start%8)))
+		end = summary_find_next(summary, pos, 0);
+		if (end != pos)
 		{
-			end = udf_find_next_zero_bit(sbd->bitmap, le32_to_cpu(sbd->numOfBits), start);
+			// Used blocks, continue at next free one
+			pos = end;
+			continue;
 		}
-		else
-			start = end = udf_find_next_one_bit(sbd->bitmap, le32_to_cpu(sbd->numOfBits), start);
-	} while ((end - start) < blocks);
+		end = summary_find_next(summary, pos, 1);
+		if (end - pos >= blocks)
+			break;
+		// Free run is too short, continue behind it
+		pos = end;
+	}
 
-	clear_bits(sbd->bitmap, start, blocks);
-	return start;
+	clear_bits(sbd->bitmap, pos, blocks);
+	for (word = pos / 64; word <= (pos + blocks - 1) / 64; word++)
+		summary_update(summary, word);
+	return pos;
 }
 
 /**
@@ -1100,3 +1292,99 @@ int udf_alloc_blocks(struct udf_disc *disc, struct udf_extent *pspace, uint32_t
 	else
 		return 0;
 }
+
+/**
+ * @brief tell whether a block of the partition space belongs to the Metadata
+ *        File, descriptors of the Metadata Partition are kept at their place
+ *        in the partition space and translated only when they are addressed
+ * @param disc the udf_disc
+ * @param offset the block number in the partition space
+ * @return 1 when the block is recorded in the Metadata Partition, 0 otherwise
+ */
+static int udf_in_metadata(struct udf_disc *disc, uint32_t offset)
+{
+	return disc->meta_bitmap && offset >= disc->meta_start && offset - disc->meta_start < disc->meta_blocks;
+}
+
+/**
+ * @brief get the logical block number recorded on-disc for a block of the
+ *        partition space
+ * @param disc the udf_disc
+ * @param offset the block number in the partition space
+ * @return the logical block number in the partition of the block
+ */
+uint32_t udf_lb_num(struct udf_disc *disc, uint32_t offset)
+{
+	if (udf_in_metadata(disc, offset))
+		return offset - disc->meta_start;
+	return offset;
+}
+
+/**
+ * @brief get the partition reference number recorded on-disc for a block of
+ *        the partition space
+ * @param disc the udf_disc
+ * @param offset the block number in the partition space
+ * @return 1 for the Metadata Partition, 0 for the physical partition
+ */
+uint16_t udf_lb_partition(struct udf_disc *disc, uint32_t offset)
+{
+	return udf_in_metadata(disc, offset) ? 1 : 0;
+}
+
+/**
+ * @brief get the block number in the partition space of an on-disc address,
+ *        the reverse of udf_lb_num() and udf_lb_partition()
+ * @param disc the udf_disc
+ * @param partition the partition reference number
+ * @param block the logical block number in the partition
+ * @return the block number in the partition space
+ */
+uint32_t udf_lb_offset(struct udf_disc *disc, uint16_t partition, uint32_t block)
+{
+	if (disc->meta_bitmap && partition == 1)
+		return disc->meta_start + block;
+	return block;
+}
+
+/**
+ * @brief allocate blocks for metadata (ICBs and directories) on-disc
+ *
+ * Without the Metadata Partition this is udf_alloc_blocks(). Otherwise blocks
+ * are allocated from the space bitmap of the Metadata Partition, and the
+ * Metadata File grows behind its end in the partition space by whole
+ * allocation units when needed. All metadata is allocated before file data,
+ * so the Metadata File stays one contiguous extent.
+ *
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param start the starting block number in the partition space to search for on-disc allocations
+ * @param blocks the number of blocks to allocate
+ * @return the starting block number in the partition space of the on-disc allocation
+ */
+int udf_alloc_meta_blocks(struct udf_disc *disc, struct udf_extent *pspace, uint32_t start, uint32_t blocks)
+{
+	uint32_t align, block, grow;
+
+	if (!disc->meta_bitmap)
+		return udf_alloc_blocks(disc, pspace, start, blocks);
+
+	start = (start >= disc->meta_start) ? start - disc->meta_start : 0;
+	block = udf_alloc_bitmap_blocks(disc, disc->meta_bitmap, start, blocks);
+
+	if (block + blocks > disc->meta_blocks)
+	{
+		grow = (block + blocks - disc->meta_blocks + disc->meta_unit - 1) / disc->meta_unit * disc->meta_unit;
+		align = disc->sizing[PSPACE_SIZE].align;
+		disc->sizing[PSPACE_SIZE].align = 1;
+		if (udf_alloc_blocks(disc, pspace, disc->meta_start + disc->meta_blocks, grow) != (int)(disc->meta_start + disc->meta_blocks))
+		{
+			fprintf(stderr, "%s: Error: Not enough contiguous blocks for Metadata Partition\n", appname);
+			exit(1);
+		}
+		disc->sizing[PSPACE_SIZE].align = align;
+		disc->meta_blocks += grow;
+	}
+
+	return disc->meta_start + block;
+}
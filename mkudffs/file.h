@@ -32,8 +32,15 @@ extern struct udf_desc *udf_create(struct udf_disc *, struct udf_extent *, const
 extern struct udf_desc *udf_mkdir(struct udf_disc *, struct udf_extent *, const dchars *, uint8_t, uint32_t, struct udf_desc *);
 extern void insert_data(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc, struct udf_data *data);
 extern void insert_fid(struct udf_disc *, struct udf_extent *, struct udf_desc *, struct udf_desc *, const dchars *, uint8_t, uint8_t);
+extern uint32_t compute_ident_length(uint32_t);
+extern void udf_reserve_dir(struct udf_disc *, struct udf_extent *, struct udf_desc *, uint64_t);
 extern void insert_ea(struct udf_disc *disc, struct udf_desc *desc, struct genericFormat *ea, uint32_t length);
 extern int udf_alloc_blocks(struct udf_disc *, struct udf_extent *, uint32_t, uint32_t);
+extern int udf_alloc_bitmap_blocks(struct udf_disc *, struct udf_desc *, uint32_t, uint32_t);
+extern int udf_alloc_meta_blocks(struct udf_disc *, struct udf_extent *, uint32_t, uint32_t);
+extern uint32_t udf_lb_num(struct udf_disc *, uint32_t);
+extern uint16_t udf_lb_partition(struct udf_disc *, uint32_t);
+extern uint32_t udf_lb_offset(struct udf_disc *, uint16_t, uint32_t);
 
 static inline void clear_bits(uint8_t *bitmap, uint32_t offset, uint64_t length)
 {
@@ -26,6 +26,8 @@
  * mkudffs main program and I/O functions
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <stdio.h>
@@ -48,6 +50,10 @@
 #include "mkudffs.h"
 #include "defaults.h"
 #include "options.h"
+#include "populate.h"
+#include "template.h"
+
+#define WRITE_BATCH_SIZE	(1024*1024)
 
 static int valid_offset(int fd, off_t offset)
 {
@@ -251,105 +257,397 @@ static int is_removable_disk(int fd)
 	return -1;
 }
 
+static long read_queue_attr(int fd, const char *name)
+{
+	struct stat st;
+	char buf[512];
+	char *end;
+	ssize_t ret;
+	long value;
+	int attr_fd;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+	if (!S_ISBLK(st.st_mode))
+		return -1;
+
+	// Partitions do not have own queue directory, it is in parent disk
+	if (snprintf(buf, sizeof(buf), "/sys/dev/block/%d:%d/queue/%s", major(st.st_rdev), minor(st.st_rdev), name) >= (int)sizeof(buf))
+		return -1;
+
+	attr_fd = open(buf, O_RDONLY);
+	if (attr_fd < 0)
+	{
+		if (snprintf(buf, sizeof(buf), "/sys/dev/block/%d:%d/../queue/%s", major(st.st_rdev), minor(st.st_rdev), name) >= (int)sizeof(buf))
+			return -1;
+		attr_fd = open(buf, O_RDONLY);
+		if (attr_fd < 0)
+			return -1;
+	}
+
+	ret = read(attr_fd, buf, sizeof(buf)-1);
+	close(attr_fd);
+
+	if (ret <= 0)
+		return -1;
+
+	buf[ret] = 0;
+	errno = 0;
+	value = strtol(buf, &end, 10);
+	if (errno || end == buf)
+		return -1;
+
+	return value;
+}
+
+static int discard_zeroes_data;
+static int sparse_image;
+
+/**
+ * @brief check that device supports discard requested by --discard
+ *
+ * Clears FLAG_DISCARD when device cannot discard and sets discard_zeroes_data
+ * when discarded blocks are guaranteed to read back as zeros.
+ */
+static void setup_discard(struct udf_disc *disc, int fd, const char *filename)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (!S_ISBLK(st.st_mode) && !S_ISREG(st.st_mode)))
+	{
+		fprintf(stderr, "%s: Warning: Device '%s' does not support discard, ignoring option --discard\n", appname, filename);
+		disc->flags &= ~(FLAG_DISCARD|FLAG_SECURE_DISCARD);
+		return;
+	}
+
+	if (S_ISREG(st.st_mode))
+	{
+		// Image files are discarded by punching holes which read back as zeros
+		if (disc->flags & FLAG_SECURE_DISCARD)
+		{
+			fprintf(stderr, "%s: Warning: Secure discard is supported only for block devices, using normal discard for '%s'\n", appname, filename);
+			disc->flags &= ~FLAG_SECURE_DISCARD;
+		}
+		discard_zeroes_data = 1;
+		return;
+	}
+
+	if (read_queue_attr(fd, "discard_max_bytes") == 0)
+	{
+		fprintf(stderr, "%s: Warning: Device '%s' does not support discard, ignoring option --discard\n", appname, filename);
+		disc->flags &= ~(FLAG_DISCARD|FLAG_SECURE_DISCARD);
+		return;
+	}
+
+	discard_zeroes_data = !(disc->flags & FLAG_SECURE_DISCARD) && read_queue_attr(fd, "discard_zeroes_data") == 1;
+}
+
+/**
+ * @brief discard range of device
+ *
+ * After the first failure discard is disabled and the caller falls back to
+ * normal formatting.
+ * @return 0 on success, -1 when the range was not discarded
+ */
+static int discard_range(struct udf_disc *disc, int fd, off_t offset, off_t length)
+{
+	struct stat st;
+
+	if (!(disc->flags & FLAG_DISCARD))
+		return -1;
+
+	if (length <= 0)
+		return 0;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+	if (S_ISBLK(st.st_mode))
+	{
+		uint64_t range[2] = { offset, length };
+
+		if (ioctl(fd, (disc->flags & FLAG_SECURE_DISCARD) ? BLKSECDISCARD : BLKDISCARD, range) == 0)
+			return 0;
+	}
+#ifdef FALLOC_FL_PUNCH_HOLE
+	else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+		return 0;
+#else
+	else
+		errno = EOPNOTSUPP;
+#endif
+
+	fprintf(stderr, "%s: Warning: Cannot discard blocks: %s, falling back to normal format\n", appname, strerror(errno));
+	disc->flags &= ~(FLAG_DISCARD|FLAG_SECURE_DISCARD);
+	return -1;
+}
+
+static size_t desc_length(struct udf_disc *disc, struct udf_desc *desc)
+{
+	struct udf_data *data;
+	size_t length = 0;
+
+	for (data = desc->data; data != NULL; data = data->next)
+		length += data->length;
+
+	return (length + disc->blocksize - 1) & ~(size_t)(disc->blocksize - 1);
+}
+
+/**
+ * @brief discard free blocks of partition space, which are not covered by any descriptor
+ */
+static void discard_free_space(struct udf_disc *disc, int fd, struct udf_extent *ext)
+{
+	struct udf_desc *desc;
+	uint64_t cursor = 0, end;
+
+	for (desc = ext->head; desc != NULL; desc = desc->next)
+	{
+		if (desc->offset > cursor)
+		{
+			if (discard_range(disc, fd, (off_t)(ext->start + cursor) * disc->blocksize, (off_t)(desc->offset - cursor) * disc->blocksize) < 0)
+				return;
+		}
+		end = desc->offset + desc_length(disc, desc) / disc->blocksize;
+		if (end > cursor)
+			cursor = end;
+	}
+
+	if (ext->blocks > cursor)
+		discard_range(disc, fd, (off_t)(ext->start + cursor) * disc->blocksize, (off_t)(ext->blocks - cursor) * disc->blocksize);
+}
+
+/**
+ * @brief grow aligned I/O buffer
+ * @param buffer pointer to buffer, updated on reallocation
+ * @param bufferlen pointer to buffer size, updated on reallocation
+ * @param length requested buffer size
+ * @param keep number of leading bytes to preserve
+ * @return 0 on success, -1 on allocation failure
+ */
+static int reserve_buffer(char **buffer, size_t *bufferlen, size_t length, size_t keep)
+{
+	long align = sysconf(_SC_PAGESIZE);
+	void *newbuf;
+
+	if (length <= *bufferlen)
+		return 0;
+
+	if (align < 512)
+		align = 512;
+	length = (length + align - 1) & ~(size_t)(align - 1);
+
+	if (posix_memalign(&newbuf, align, length) != 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (keep)
+		memcpy(newbuf, *buffer, keep);
+	free(*buffer);
+	*buffer = newbuf;
+	*bufferlen = length;
+	return 0;
+}
+
+static int write_full(int fd, const char *buffer, size_t length, off_t offset)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	while (length > 0)
+	{
+		UDF_TRACE_START(write, offset, length, start);
+		ret = pwrite(fd, buffer, length, offset);
+		UDF_TRACE_DONE(UDF_TRACE_WRITE, write, offset, ret, start);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		udf_progress_add(UDF_PROGRESS_WRITTEN, ret);
+		buffer += ret;
+		length -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+/**
+ * @brief fill range of device with zeros
+ *
+ * Block devices are zeroed by BLKZEROOUT and regular files by fallocate()
+ * with FALLOC_FL_ZERO_RANGE. When these are not supported, zeros are written
+ * from a large buffer.
+ */
+static int zero_range(int fd, off_t offset, off_t length)
+{
+	static char *buffer = NULL;
+	static size_t bufferlen = 0;
+	static int no_zeroout = 0;
+	static int no_fallocate = 0;
+	struct stat st;
+	size_t chunk;
+
+	if (length <= 0)
+		return 0;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+#ifdef BLKZEROOUT
+	if (!no_zeroout && S_ISBLK(st.st_mode))
+	{
+		uint64_t range[2] = { offset, length };
+
+		if (ioctl(fd, BLKZEROOUT, range) == 0)
+		{
+			udf_progress_add(UDF_PROGRESS_WRITTEN, length);
+			return 0;
+		}
+		no_zeroout = 1;
+	}
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (!no_fallocate && S_ISREG(st.st_mode))
+	{
+		if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0)
+		{
+			udf_progress_add(UDF_PROGRESS_WRITTEN, length);
+			return 0;
+		}
+		no_fallocate = 1;
+	}
+#endif
+
+	if (buffer == NULL)
+	{
+		if (reserve_buffer(&buffer, &bufferlen, WRITE_BATCH_SIZE, 0) < 0)
+			return -1;
+		memset(buffer, 0, bufferlen);
+	}
+
+	while (length > 0)
+	{
+		chunk = (length < (off_t)bufferlen) ? (size_t)length : bufferlen;
+		if (write_full(fd, buffer, chunk, offset) < 0)
+			return -1;
+		offset += chunk;
+		length -= chunk;
+	}
+	return 0;
+}
+
+/**
+ * @brief extend image file created by mkudffs to end of range without writing
+ *
+ * Range beyond the end of file stays a hole which reads back as zeros.
+ */
+static int extend_range(int fd, off_t offset, off_t length)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+	if (st.st_size < offset + length && ftruncate(fd, offset + length) != 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief write udf_extent to device
+ *
+ * Descriptors which follow each other on disk are copied into one buffer and
+ * written by single pwrite() call. Unwritten extents are zeroed in one step
+ * by zero_range(). With --discard, free partition space is discarded and
+ * unwritten extents are discarded instead of zeroed when device guarantees
+ * zeros after discard. Image file created by mkudffs is empty, so unwritten
+ * extents are only holes of a sparse file.
+ */
 static int write_func(struct udf_disc *disc, struct udf_extent *ext)
 {
 	static char *buffer = NULL;
 	static size_t bufferlen = 0;
 	int fd = *(int *)disc->write_data;
-	ssize_t length, offset;
-	uint32_t blocks;
+	off_t offset, batch_start = 0;
+	size_t length, padded, batch_len = 0;
 	struct udf_desc *desc;
 	struct udf_data *data;
 
-	if (buffer == NULL)
-	{
-		bufferlen = disc->blocksize;
-		buffer = calloc(bufferlen, 1);
-	}
+	if (disc->flags & FLAG_NO_WRITE)
+		return 0;
 
 	if (!(ext->space_type & (USPACE|RESERVED)))
 	{
+		if ((ext->space_type & PSPACE) && (disc->flags & FLAG_DISCARD))
+			discard_free_space(disc, fd, ext);
+
 		desc = ext->head;
 		while (desc != NULL)
 		{
-			if (!(disc->flags & FLAG_NO_WRITE) || fd >= 0)
+			offset = (off_t)(ext->start + desc->offset) * disc->blocksize;
+			if (batch_len && (offset != batch_start + (off_t)batch_len || batch_len >= WRITE_BATCH_SIZE))
 			{
-				if (lseek(fd, (off_t)(ext->start + desc->offset) * disc->blocksize, SEEK_SET) < 0)
+				if (write_full(fd, buffer, batch_len, batch_start) < 0)
 					return -1;
+				batch_len = 0;
 			}
-			data = desc->data;
-			offset = 0;
-			while (data != NULL)
+			if (!batch_len)
+				batch_start = offset;
+
+			padded = desc_length(disc, desc);
+
+			if (reserve_buffer(&buffer, &bufferlen, batch_len + padded, batch_len) < 0)
+				return -1;
+			length = batch_len;
+			for (data = desc->data; data != NULL; data = data->next)
 			{
-				if (data->length + offset > bufferlen)
-				{
-					bufferlen = (data->length + offset + disc->blocksize - 1) & ~(disc->blocksize - 1);
-					buffer = realloc(buffer, bufferlen);
-				}
-				memcpy(buffer + offset, data->buffer, data->length);
-				offset += data->length;
-				data = data->next;
-			}
-			length = (offset + disc->blocksize - 1) & ~(disc->blocksize - 1);
-			if (offset != length)
-				memset(buffer + offset, 0x00, length - offset);
-			if (!(disc->flags & FLAG_NO_WRITE))
-			{
-				if (write(fd, buffer, length) != length)
-					return -1;
+				memcpy(buffer + length, data->buffer, data->length);
+				length += data->length;
 			}
+			batch_len += padded;
+			if (length != batch_len)
+				memset(buffer + length, 0x00, batch_len - length);
+
 			desc = desc->next;
 		}
+		if (batch_len && write_full(fd, buffer, batch_len, batch_start) < 0)
+			return -1;
 	}
 	else if (!(disc->flags & FLAG_BOOTAREA_PRESERVE))
 	{
-		length = disc->blocksize;
-		blocks = ext->blocks;
-		memset(buffer, 0, length);
-		if (!(disc->flags & FLAG_NO_WRITE) || fd >= 0)
-		{
-			if (lseek(fd, (off_t)(ext->start) * disc->blocksize, SEEK_SET) < 0)
-				return -1;
-		}
-		while (blocks-- > 0)
-		{
-			if (!(disc->flags & FLAG_NO_WRITE))
-			{
-				if (write(fd, buffer, length) != length)
-					return -1;
-			}
-		}
+		if (sparse_image)
+			return extend_range(fd, (off_t)(ext->start) * disc->blocksize, (off_t)(ext->blocks) * disc->blocksize);
+		if (discard_range(disc, fd, (off_t)(ext->start) * disc->blocksize, (off_t)(ext->blocks) * disc->blocksize) == 0 && discard_zeroes_data)
+			return 0;
+		if (zero_range(fd, (off_t)(ext->start) * disc->blocksize, (off_t)(ext->blocks) * disc->blocksize) < 0)
+			return -1;
 	}
 	return 0;
 }
-	
-int main(int argc, char *argv[])
+
+/**
+ * @brief open existing device for formatting
+ *
+ * Block devices are opened with O_EXCL, which fails when device is mounted.
+ * Errors are fatal.
+ * @return file descriptor, -1 when device does not exist
+ */
+static int open_device(struct udf_disc *disc, const char *filename, int create_new_file)
 {
-	struct udf_disc	disc;
 	struct stat stat;
-	char *filename;
-	char buf[128*3];
-	int fd;
-	int create_new_file = 0;
-	int blocksize = -1;
-	int media;
-	size_t len;
-
-	if (fcntl(0, F_GETFL) < 0 && open("/dev/null", O_RDONLY) < 0)
-		_exit(1);
-	if (fcntl(1, F_GETFL) < 0 && open("/dev/null", O_WRONLY) < 0)
-		_exit(1);
-	if (fcntl(2, F_GETFL) < 0 && open("/dev/null", O_WRONLY) < 0)
-		_exit(1);
-
-	setlocale(LC_CTYPE, "");
-	appname = "mkudffs";
-
-	udf_init_disc(&disc);
-	parse_args(argc, argv, &disc, &filename, &create_new_file, &blocksize, &media);
-
-	if (disc.flags & FLAG_NO_WRITE)
-		printf("Note: Not writing to device, just simulating\n");
+	int fd, fd2;
+	int flags2;
+	char filename2[64];
+	const char *error;
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0)
@@ -359,69 +657,225 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, strerror(errno));
 			exit(1);
 		}
+		return -1;
+	}
 
-		if (!disc.blocks)
-		{
-			fprintf(stderr, "%s: Error: Cannot create new image file '%s': block-count was not specified\n", appname, filename);
-			exit(1);
-		}
+	if (create_new_file)
+	{
+		fprintf(stderr, "%s: Error: Cannot create new image file '%s': %s\n", appname, filename, strerror(EEXIST));
+		exit(1);
 	}
+
+	if (fstat(fd, &stat) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot stat device '%s': %s\n", appname, filename, strerror(errno));
+		exit(1);
+	}
+
+	if (!(disc->flags & FLAG_NO_WRITE))
+		flags2 = O_RDWR;
 	else
+		flags2 = O_RDONLY;
+
+	if (snprintf(filename2, sizeof(filename2), "/proc/self/fd/%d", fd) >= (int)sizeof(filename2))
 	{
-		int fd2;
-		int flags2;
-		char filename2[64];
-		const char *error;
+		fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, strerror(ENAMETOOLONG));
+		exit(1);
+	}
 
-		if (create_new_file)
+	// Re-open block device with O_EXCL mode which fails when device is already mounted
+	if (S_ISBLK(stat.st_mode))
+		flags2 |= O_EXCL;
+
+	fd2 = open(filename2, flags2);
+	if (fd2 < 0)
+	{
+		if (errno != ENOENT)
 		{
-			fprintf(stderr, "%s: Error: Cannot create new image file '%s': %s\n", appname, filename, strerror(EEXIST));
+			error = (errno != EBUSY) ? strerror(errno) : "Device is mounted or mkudffs is already running";
+			fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, error);
 			exit(1);
 		}
 
-		if (fstat(fd, &stat) != 0)
+		// Fallback to orignal filename when /proc is not available, but this introduce race condition between stat and open
+		fd2 = open(filename, flags2);
+		if (fd2 < 0)
 		{
-			fprintf(stderr, "%s: Error: Cannot stat device '%s': %s\n", appname, filename, strerror(errno));
+			error = (errno != EBUSY) ? strerror(errno) : "Device is mounted or mkudffs is already running";
+			fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, error);
 			exit(1);
 		}
+	}
 
-		if (!(disc.flags & FLAG_NO_WRITE))
-			flags2 = O_RDWR;
-		else
-			flags2 = O_RDONLY;
+	close(fd);
+	return fd2;
+}
 
-		if (snprintf(filename2, sizeof(filename2), "/proc/self/fd/%d", fd) >= (int)sizeof(filename2))
-		{
-			fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, strerror(ENAMETOOLONG));
-			exit(1);
-		}
+/**
+ * @brief set O_DIRECT on device for --direct, errors are fatal
+ */
+static void setup_direct_io(struct udf_disc *disc, int fd, const char *filename)
+{
+	int flags;
 
-		// Re-open block device with O_EXCL mode which fails when device is already mounted
-		if (S_ISBLK(stat.st_mode))
-			flags2 |= O_EXCL;
+	if (disc->blocksize % disc->blkssz)
+	{
+		fprintf(stderr, "%s: Error: Cannot use direct I/O on device '%s': Block size is not multiple of disk logical sector size\n", appname, filename);
+		exit(1);
+	}
 
-		fd2 = open(filename2, flags2);
-		if (fd2 < 0)
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot use direct I/O on device '%s': %s\n", appname, filename, strerror(errno));
+		exit(1);
+	}
+}
+
+/**
+ * @brief format all devices of --stamp from template
+ *
+ * Devices are opened and checked one by one, stamping runs in parallel.
+ * Devices which do not exist are created as image files of template size.
+ * @return exit code
+ */
+static int stamp_devices(struct udf_disc *disc, struct template_args *args, int create_new_file, unsigned int jobs)
+{
+	struct template *tpl;
+	struct template_device *devices;
+	unsigned int count, i;
+	uint32_t blocks;
+	char buf[128*3];
+	int blocksize;
+	int ret = 0;
+
+	tpl = template_load(args->stamp);
+	if (!tpl)
+	{
+		if (errno == EINVAL)
+			fprintf(stderr, "%s: Error: File '%s' is not a valid mkudffs template\n", appname, args->stamp);
+		else
+			fprintf(stderr, "%s: Error: Cannot load template '%s': %s\n", appname, args->stamp, strerror(errno));
+		exit(1);
+	}
+
+	for (count = 0; args->devices[count]; count++);
+	devices = calloc(count, sizeof(*devices));
+	if (!devices)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	disc->blocksize = tpl->blocksize;
+	for (i = 0; i < count; i++)
+	{
+		devices[i].filename = args->devices[i];
+		devices[i].fd = open_device(disc, devices[i].filename, create_new_file);
+		if (devices[i].fd < 0)
 		{
-			if (errno != ENOENT)
+			if (disc->flags & FLAG_NO_WRITE)
+				continue;
+			devices[i].fd = open(devices[i].filename, O_RDWR | O_CREAT | O_EXCL, 0660);
+			if (devices[i].fd < 0 || ftruncate(devices[i].fd, (off_t)tpl->blocks * tpl->blocksize) != 0)
 			{
-				error = (errno != EBUSY) ? strerror(errno) : "Device is mounted or mkudffs is already running";
-				fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, error);
+				fprintf(stderr, "%s: Error: Cannot create new image file '%s': %s\n", appname, devices[i].filename, strerror(errno));
 				exit(1);
 			}
+			devices[i].sparse = 1;
+		}
 
-			// Fallback to orignal filename when /proc is not available, but this introduce race condition between stat and open
-			fd2 = open(filename, flags2);
-			if (fd2 < 0)
-			{
-				error = (errno != EBUSY) ? strerror(errno) : "Device is mounted or mkudffs is already running";
-				fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, error);
-				exit(1);
-			}
+		blocks = get_blocks(devices[i].fd, tpl->blocksize, 0);
+		if (blocks != tpl->blocks)
+		{
+			fprintf(stderr, "%s: Error: Device '%s' has %"PRIu32" blocks, but template is for %"PRIu32" blocks\n", appname, devices[i].filename, blocks, tpl->blocks);
+			exit(1);
 		}
 
-		close(fd);
-		fd = fd2;
+		if ((disc->flags & FLAG_DIRECT_IO) && !(disc->flags & FLAG_NO_WRITE))
+		{
+			// Only logical sector size is detected, block size is given by template
+			blocksize = disc->blocksize;
+			detect_blocksize(devices[i].fd, disc, &blocksize);
+			setup_direct_io(disc, devices[i].fd, devices[i].filename);
+		}
+	}
+
+	if (template_stamp(disc, tpl, devices, count, jobs, args->lvid ? disc->udf_lvd[0]->logicalVolIdent : NULL, args->vid ? disc->udf_pvd[0]->volIdent : NULL) < 0)
+		ret = 1;
+	udf_progress_stop();
+
+	for (i = 0; i < count; i++)
+	{
+		printf("filename=%s\n", devices[i].filename);
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, devices[i].uuid, 16);
+		printf("uuid=%s\n", buf);
+		if (devices[i].error)
+			fprintf(stderr, "%s: Error: Cannot write to device '%s': %s\n", appname, devices[i].filename, strerror(devices[i].error));
+		if (devices[i].fd >= 0)
+			close(devices[i].fd);
+	}
+
+	free(devices);
+	template_free(tpl);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	struct udf_disc	disc;
+	char *filename;
+	char *populate = NULL;
+	char *progress = NULL;
+	unsigned int jobs = 4;
+	struct populate tree;
+	struct template_args tmpl;
+	char buf[128*3];
+	int fd;
+	int create_new_file = 0;
+	int blocksize = -1;
+	int media;
+	size_t len;
+
+	if (fcntl(0, F_GETFL) < 0 && open("/dev/null", O_RDONLY) < 0)
+		_exit(1);
+	if (fcntl(1, F_GETFL) < 0 && open("/dev/null", O_WRONLY) < 0)
+		_exit(1);
+	if (fcntl(2, F_GETFL) < 0 && open("/dev/null", O_WRONLY) < 0)
+		_exit(1);
+
+	setlocale(LC_CTYPE, "");
+	appname = "mkudffs";
+
+	if (udf_trace_start(appname) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot enable trace: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	udf_init_disc(&disc);
+	memset(&tmpl, 0, sizeof(tmpl));
+	parse_args(argc, argv, &disc, &filename, &create_new_file, &blocksize, &media, &populate, &jobs, &progress, &tmpl);
+
+	// Started before reader threads of --populate, they inherit blocked SIGUSR1
+	if (progress && udf_progress_start(appname, progress) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot report progress to '%s': %s\n", appname, progress, strerror(errno));
+		exit(1);
+	}
+
+	if (disc.flags & FLAG_NO_WRITE)
+		printf("Note: Not writing to device, just simulating\n");
+
+	if (tmpl.stamp)
+		return stamp_devices(&disc, &tmpl, create_new_file, jobs);
+
+	fd = open_device(&disc, filename, create_new_file);
+	if (fd < 0 && !disc.blocks)
+	{
+		fprintf(stderr, "%s: Error: Cannot create new image file '%s': block-count was not specified\n", appname, filename);
+		exit(1);
 	}
 
 	if (fd >= 0)
@@ -468,6 +922,13 @@ int main(int argc, char *argv[])
 	setup_vrs(&disc);
 	setup_anchor(&disc);
 	setup_partition(&disc);
+	if (populate)
+	{
+		populate_tree(&disc, next_extent(disc.head, PSPACE), populate, &tree);
+		populate_read_embedded(&disc, next_extent(disc.head, PSPACE), &tree, jobs);
+	}
+	if (disc.flags & FLAG_METADATA)
+		finish_metadata(&disc, next_extent(disc.head, PSPACE));
 	setup_vds(&disc);
 
 	if (disc.vat_block)
@@ -495,6 +956,19 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "%s: Error: Cannot create new image file '%s': %s\n", appname, filename, strerror(errno));
 			exit(1);
 		}
+		sparse_image = 1;
+	}
+
+	if ((disc.flags & FLAG_DISCARD) && !(disc.flags & FLAG_NO_WRITE))
+		setup_discard(&disc, fd, filename);
+
+	if ((disc.flags & FLAG_DIRECT_IO) && !(disc.flags & FLAG_NO_WRITE))
+		setup_direct_io(&disc, fd, filename);
+
+	if (tmpl.save && template_save(&disc, tmpl.save) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot save template '%s': %s\n", appname, tmpl.save, strerror(errno));
+		return 1;
 	}
 
 	if (write_disc(&disc) < 0)
@@ -503,5 +977,20 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (populate)
+	{
+		if (!(disc.flags & FLAG_NO_WRITE) && populate_write(&disc, fd, next_extent(disc.head, PSPACE), &tree, jobs) < 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot write to device '%s': %s\n", appname, filename, strerror(errno));
+			return 1;
+		}
+		udf_progress_stop();
+		printf("files=%"PRIu32"\n", tree.num_files);
+		printf("dirs=%"PRIu32"\n", tree.num_dirs);
+		populate_free(&tree);
+	}
+
+	udf_progress_stop();
+	udf_arena_release(&disc);
 	return 0;
 }
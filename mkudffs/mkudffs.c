@@ -46,36 +46,32 @@
 #include "file.h"
 #include "defaults.h"
 
-void udf_init_disc(struct udf_disc *disc)
+/**
+ * @brief get current time as timestamp and new uuid based on it
+ * @param ts the timestamp to fill
+ * @param uuid buffer for 16 characters of uuid and terminating null byte
+ * @return void
+ */
+void udf_time_uuid(timestamp *ts, char *uuid)
 {
-	timestamp	ts;
 	struct timeval	tv;
 	struct tm 	*tm;
 	int		altzone;
 	uint32_t	uuid_time;
-	char		uuid[17];
-
-	memset(disc, 0x00, sizeof(*disc));
-
-	disc->blocksize = 2048;
-	disc->udf_rev = le16_to_cpu(default_lvidiu.minUDFReadRev);
-	disc->flags = FLAG_LOCALE | FLAG_CLOSED | FLAG_EFE;
-	disc->blkssz = 512;
-	disc->mode = 0755;
 
 	if (gettimeofday(&tv, NULL) != 0 || tv.tv_sec == (time_t)-1 || (tm = localtime(&tv.tv_sec)) == NULL || tm->tm_year < 1-1900 || tm->tm_year > 9999-1900)
 	{
 		/* fallback to 1.1.1980 00:00:00 */
-		ts.typeAndTimezone = cpu_to_le16(0x1000);
-		ts.year = cpu_to_le16(1980);
-		ts.month = 1;
-		ts.day = 1;
-		ts.hour = 0;
-		ts.minute = 0;
-		ts.second = 0;
-		ts.centiseconds = 0;
-		ts.hundredsOfMicroseconds = 0;
-		ts.microseconds = 0;
+		ts->typeAndTimezone = cpu_to_le16(0x1000);
+		ts->year = cpu_to_le16(1980);
+		ts->month = 1;
+		ts->day = 1;
+		ts->hour = 0;
+		ts->minute = 0;
+		ts->second = 0;
+		ts->centiseconds = 0;
+		ts->hundredsOfMicroseconds = 0;
+		ts->microseconds = 0;
 		/* and for uuid use random bytes */
 		uuid_time = randu32();
 	}
@@ -83,29 +79,46 @@ void udf_init_disc(struct udf_disc *disc)
 	{
 		altzone = timezone - 3600;
 		if (daylight)
-			ts.typeAndTimezone = cpu_to_le16(((-altzone/60) & 0x0FFF) | 0x1000);
+			ts->typeAndTimezone = cpu_to_le16(((-altzone/60) & 0x0FFF) | 0x1000);
 		else
-			ts.typeAndTimezone = cpu_to_le16(((-timezone/60) & 0x0FFF) | 0x1000);
-		ts.year = cpu_to_le16(1900 + tm->tm_year);
-		ts.month = 1 + tm->tm_mon;
-		ts.day = tm->tm_mday;
-		ts.hour = tm->tm_hour;
-		ts.minute = tm->tm_min;
-		ts.second = tm->tm_sec;
-		ts.centiseconds = tv.tv_usec / 10000;
-		ts.hundredsOfMicroseconds = (tv.tv_usec - ts.centiseconds * 10000) / 100;
-		ts.microseconds = tv.tv_usec - ts.centiseconds * 10000 - ts.hundredsOfMicroseconds * 100;
+			ts->typeAndTimezone = cpu_to_le16(((-timezone/60) & 0x0FFF) | 0x1000);
+		ts->year = cpu_to_le16(1900 + tm->tm_year);
+		ts->month = 1 + tm->tm_mon;
+		ts->day = tm->tm_mday;
+		ts->hour = tm->tm_hour;
+		ts->minute = tm->tm_min;
+		ts->second = tm->tm_sec;
+		ts->centiseconds = tv.tv_usec / 10000;
+		ts->hundredsOfMicroseconds = (tv.tv_usec - ts->centiseconds * 10000) / 100;
+		ts->microseconds = tv.tv_usec - ts->centiseconds * 10000 - ts->hundredsOfMicroseconds * 100;
 		if (tv.tv_sec < 0)
 			uuid_time = randu32();
 		else
 			uuid_time = tv.tv_sec & 0xFFFFFFFF;
 	}
 
+	snprintf(uuid, 17, "%08" PRIu32 "%08" PRIu32, uuid_time, randu32());
+}
+
+void udf_init_disc(struct udf_disc *disc)
+{
+	timestamp	ts;
+	char		uuid[17];
+
+	memset(disc, 0x00, sizeof(*disc));
+
+	disc->blocksize = 2048;
+	disc->udf_rev = le16_to_cpu(default_lvidiu.minUDFReadRev);
+	disc->flags = FLAG_LOCALE | FLAG_CLOSED | FLAG_EFE;
+	disc->blkssz = 512;
+	disc->mode = 0755;
+
+	udf_time_uuid(&ts, uuid);
+
 	/* Allocate/Initialize Descriptors */
 	disc->udf_pvd[0] = malloc(sizeof(struct primaryVolDesc));
 	memcpy(disc->udf_pvd[0], &default_pvd, sizeof(struct primaryVolDesc));
 	memcpy(&disc->udf_pvd[0]->recordingDateAndTime, &ts, sizeof(timestamp));
-	snprintf(uuid, sizeof(uuid), "%08" PRIu32 "%08" PRIu32, uuid_time, randu32());
 	memcpy(&disc->udf_pvd[0]->volSetIdent[1], uuid, 16);
 	disc->udf_pvd[0]->volIdent[31] = strlen((char *)disc->udf_pvd[0]->volIdent);
 	disc->udf_pvd[0]->volSetIdent[127] = strlen((char *)disc->udf_pvd[0]->volSetIdent);
@@ -150,7 +163,7 @@ void udf_init_disc(struct udf_disc *disc)
 	disc->udf_fsd->copyrightFileIdent[31] = strlen((char *)disc->udf_fsd->copyrightFileIdent);
 	disc->udf_fsd->abstractFileIdent[31] = strlen((char *)disc->udf_fsd->abstractFileIdent);
 
-	disc->head = malloc(sizeof(struct udf_extent));
+	disc->head = udf_arena_alloc(disc, sizeof(struct udf_extent));
 	disc->tail = disc->head;
 
 	disc->head->space_type = USPACE;
@@ -160,6 +173,7 @@ void udf_init_disc(struct udf_disc *disc)
 	disc->head->prev = NULL;
 	disc->head->head = NULL;
 	disc->head->tail = NULL;
+	disc->head->desc_index = NULL;
 }
 
 int udf_set_version(struct udf_disc *disc, uint16_t udf_rev)
@@ -570,7 +584,7 @@ void setup_mbr(struct udf_disc *disc)
 
 	if (!(ext = next_extent(disc->head, MBR)))
 		return;
-	desc = set_desc(ext, 0x00, 0, ext->blocks * disc->blocksize, NULL);
+	desc = set_desc(disc, ext, 0x00, 0, ext->blocks * disc->blocksize, NULL);
 	mbr = (struct mbr *)desc->data->buffer;
 	fill_mbr(disc, mbr, ext->start);
 }
@@ -582,16 +596,16 @@ void setup_vrs(struct udf_disc *disc)
 
 	if (!(ext = next_extent(disc->head, VRS)))
 		return;
-	desc = set_desc(ext, 0x00, 0, sizeof(struct volStructDesc), NULL);
+	desc = set_desc(disc, ext, 0x00, 0, sizeof(struct volStructDesc), NULL);
 	disc->udf_vrs[0] = (struct volStructDesc *)desc->data->buffer;
 	disc->udf_vrs[0]->structType = 0x00;
 	disc->udf_vrs[0]->structVersion = 0x01;
 	memcpy(disc->udf_vrs[0]->stdIdent, VSD_STD_ID_BEA01, VSD_STD_ID_LEN);
 
 	if (disc->blocksize >= 2048)
-		desc = set_desc(ext, 0x00, 1, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 1, sizeof(struct volStructDesc), NULL);
 	else
-		desc = set_desc(ext, 0x00, 2048 / disc->blocksize, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 2048 / disc->blocksize, sizeof(struct volStructDesc), NULL);
 	disc->udf_vrs[1] = (struct volStructDesc *)desc->data->buffer;
 	disc->udf_vrs[1]->structType = 0x00;
 	disc->udf_vrs[1]->structVersion = 0x01;
@@ -601,9 +615,9 @@ void setup_vrs(struct udf_disc *disc)
 		memcpy(disc->udf_vrs[1]->stdIdent, VSD_STD_ID_NSR02, VSD_STD_ID_LEN);
 
 	if (disc->blocksize >= 2048)
-		desc = set_desc(ext, 0x00, 2, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 2, sizeof(struct volStructDesc), NULL);
 	else
-		desc = set_desc(ext, 0x00, 4096 / disc->blocksize, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 4096 / disc->blocksize, sizeof(struct volStructDesc), NULL);
 	disc->udf_vrs[2] = (struct volStructDesc *)desc->data->buffer;
 	disc->udf_vrs[2]->structType = 0x00;
 	disc->udf_vrs[2]->structVersion = 0x01;
@@ -650,7 +664,7 @@ void setup_anchor(struct udf_disc *disc)
 	}
 	do
 	{
-		ext->head = ext->tail = malloc(sizeof(struct udf_desc) + sizeof(struct udf_data));
+		ext->head = ext->tail = udf_arena_alloc(disc, sizeof(struct udf_desc) + sizeof(struct udf_data));
 		ext->head->data = (struct udf_data *)&(ext->head)[1];
 		ext->head->data->next = ext->head->data->prev = NULL;
 		ext->head->ident = TAG_IDENT_AVDP;
@@ -679,6 +693,8 @@ void setup_partition(struct udf_disc *disc)
 		exit(1);
 	}
 	setup_space(disc, pspace, 0);
+	if (disc->flags & FLAG_METADATA)
+		setup_metadata(disc, pspace);
 	setup_fileset(disc, pspace);
 	setup_root(disc, pspace);
 	if (disc->flags & FLAG_VAT)
@@ -743,7 +759,7 @@ int setup_space(struct udf_disc *disc, struct udf_extent *pspace, uint32_t offse
 		int nBytes = (pspace->blocks+7)/8;
 
 		length = sizeof(struct spaceBitmapDesc) + nBytes;
-		desc = set_desc(pspace, TAG_IDENT_SBD, offset, length, NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_SBD, offset, length, NULL);
 		sbd = (struct spaceBitmapDesc *)desc->data->buffer;
 		sbd->numOfBits = cpu_to_le32(pspace->blocks);
 		sbd->numOfBytes = cpu_to_le32(nBytes);
@@ -766,7 +782,7 @@ int setup_space(struct udf_disc *disc, struct udf_extent *pspace, uint32_t offse
 			length = disc->blocksize * 2;
 		else
 			length = disc->blocksize;
-		desc = set_desc(pspace, TAG_IDENT_USE, offset, disc->blocksize, NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_USE, offset, disc->blocksize, NULL);
 		use = (struct unallocSpaceEntry *)desc->data->buffer;
 		use->lengthAllocDescs = cpu_to_le32(sizeof(short_ad));
 		sad = (short_ad *)&use->allocDescs[0];
@@ -816,11 +832,11 @@ int setup_space(struct udf_disc *disc, struct udf_extent *pspace, uint32_t offse
 
 			if (disc->flags & FLAG_BLANK_TERMINAL)
 			{
-//				tdesc = set_desc(pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
+//				tdesc = set_desc(disc, pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
 			}
 			else
 			{
-				tdesc = set_desc(pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
+				tdesc = set_desc(disc, pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
 				te = (struct terminalEntry *)tdesc->data->buffer;
 				te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
 				te->icbTag.strategyType = cpu_to_le16(4096);
@@ -844,18 +860,18 @@ int setup_fileset(struct udf_disc *disc, struct udf_extent *pspace)
 	int length = sizeof(struct fileSetDesc);
 	long_ad ad;
 
-	offset = udf_alloc_blocks(disc, pspace, offset, 1);
+	offset = udf_alloc_meta_blocks(disc, pspace, offset, 1);
 
 	memset(&ad, 0, sizeof(ad));
 	ad.extLength = cpu_to_le32(disc->blocksize);
-	ad.extLocation.logicalBlockNum = cpu_to_le32(offset);
+	ad.extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, offset));
 	if (disc->flags & FLAG_VAT)
 		ad.extLocation.partitionReferenceNum = cpu_to_le16(1);
 	else
-		ad.extLocation.partitionReferenceNum = cpu_to_le16(0);
+		ad.extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, offset));
 	memcpy(disc->udf_lvd[0]->logicalVolContentsUse, &ad, sizeof(ad));
 
-	desc = set_desc(pspace, TAG_IDENT_FSD, offset, 0, NULL);
+	desc = set_desc(disc, pspace, TAG_IDENT_FSD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_fsd;
 
@@ -868,8 +884,8 @@ int setup_fileset(struct udf_disc *disc, struct udf_extent *pspace)
 		offset = ss->offset;
 
 		disc->udf_fsd->streamDirectoryICB.extLength = cpu_to_le32(disc->blocksize);
-		disc->udf_fsd->streamDirectoryICB.extLocation.logicalBlockNum = cpu_to_le32(offset);
-		disc->udf_fsd->streamDirectoryICB.extLocation.partitionReferenceNum = cpu_to_le16(0);
+		disc->udf_fsd->streamDirectoryICB.extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, offset));
+		disc->udf_fsd->streamDirectoryICB.extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, offset));
 
 	}
 
@@ -891,11 +907,11 @@ int setup_root(struct udf_disc *disc, struct udf_extent *pspace)
 		disc->udf_fsd->rootDirectoryICB.extLength = cpu_to_le32(disc->blocksize * 2);
 	else
 		disc->udf_fsd->rootDirectoryICB.extLength = cpu_to_le32(disc->blocksize);
-	disc->udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum = cpu_to_le32(offset);
+	disc->udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, offset));
 	if (disc->flags & FLAG_VAT)
 		disc->udf_fsd->rootDirectoryICB.extLocation.partitionReferenceNum = cpu_to_le16(1);
 	else
-		disc->udf_fsd->rootDirectoryICB.extLocation.partitionReferenceNum = cpu_to_le16(0);
+		disc->udf_fsd->rootDirectoryICB.extLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, offset));
 	fsd_desc = next_desc(pspace->head, TAG_IDENT_FSD);
 	disc->udf_fsd->descTag = query_tag(disc, pspace, fsd_desc, 1);
 
@@ -903,19 +919,19 @@ int setup_root(struct udf_disc *disc, struct udf_extent *pspace)
 	{
 		if (disc->flags & FLAG_BLANK_TERMINAL)
 		{
-//			tdesc = set_desc(pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
+//			tdesc = set_desc(disc, pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
 			offset ++;
 		}
 		else
 		{
-			tdesc = set_desc(pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
+			tdesc = set_desc(disc, pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
 			te = (struct terminalEntry *)tdesc->data->buffer;
 			te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
 			te->icbTag.strategyType = cpu_to_le16(4096);
 			te->icbTag.strategyParameter = cpu_to_le16(1);
 			te->icbTag.numEntries = cpu_to_le16(2);
-			te->icbTag.parentICBLocation.logicalBlockNum = cpu_to_le32(desc->offset);
-			te->icbTag.parentICBLocation.partitionReferenceNum = cpu_to_le16(0);
+			te->icbTag.parentICBLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, desc->offset));
+			te->icbTag.parentICBLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, desc->offset));
 			te->icbTag.fileType = ICBTAG_FILE_TYPE_TE;
 			te->descTag = query_tag(disc, pspace, tdesc, 1);
 			offset = tdesc->offset;
@@ -967,19 +983,19 @@ int setup_root(struct udf_disc *disc, struct udf_extent *pspace)
 	{
 		if (disc->flags & FLAG_BLANK_TERMINAL)
 		{
-//			tdesc = set_desc(pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
+//			tdesc = set_desc(disc, pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
 			offset ++;
 		}
 		else
 		{
-			tdesc = set_desc(pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
+			tdesc = set_desc(disc, pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
 			te = (struct terminalEntry *)tdesc->data->buffer;
 			te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
 			te->icbTag.strategyType = cpu_to_le16(4096);
 			te->icbTag.strategyParameter = cpu_to_le16(1);
 			te->icbTag.numEntries = cpu_to_le16(2);
-			te->icbTag.parentICBLocation.logicalBlockNum = cpu_to_le32(desc->offset);
-			te->icbTag.parentICBLocation.partitionReferenceNum = cpu_to_le16(0);
+			te->icbTag.parentICBLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, desc->offset));
+			te->icbTag.parentICBLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, desc->offset));
 			te->icbTag.fileType = ICBTAG_FILE_TYPE_TE;
 			te->descTag = query_tag(disc, pspace, tdesc, 1);
 			offset = tdesc->offset;
@@ -992,6 +1008,186 @@ int setup_root(struct udf_disc *disc, struct udf_extent *pspace)
 		return 2;
 }
 
+/**
+ * @brief record allocation descriptors of one contiguous extent in the
+ *        partition space into a file tag:FE/EFE udf_descriptor
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent
+ * @param desc the file tag:FE/EFE udf_descriptor
+ * @param start the first block of the extent in the partition space
+ * @param length the length of the file in bytes
+ * @return void
+ */
+static void set_file_extent(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc, uint32_t start, uint64_t length)
+{
+	uint32_t maxlen = EXT_LENGTH_MASK & ~(disc->blocksize - 1);
+	uint32_t count = (length + maxlen - 1) / maxlen;
+	uint64_t blocks = (length + disc->blocksize - 1) / disc->blocksize;
+	uint32_t lengthExtendedAttr, i;
+	uint16_t flags;
+	size_t header;
+	short_ad *sad;
+
+	if (disc->flags & FLAG_EFE)
+	{
+		lengthExtendedAttr = le32_to_cpu(((struct extendedFileEntry *)desc->data->buffer)->lengthExtendedAttr);
+		header = sizeof(struct extendedFileEntry);
+	}
+	else
+	{
+		lengthExtendedAttr = le32_to_cpu(((struct fileEntry *)desc->data->buffer)->lengthExtendedAttr);
+		header = sizeof(struct fileEntry);
+	}
+
+	if (header + lengthExtendedAttr + count * sizeof(short_ad) > disc->blocksize)
+	{
+		fprintf(stderr, "%s: Error: Metadata Partition is too large\n", appname);
+		exit(1);
+	}
+
+	desc->data->buffer = udf_arena_realloc(disc, desc->data->buffer, desc->data->length, desc->data->length + count * sizeof(short_ad));
+	desc->data->length += count * sizeof(short_ad);
+	desc->length += count * sizeof(short_ad);
+
+	if (disc->flags & FLAG_EFE)
+	{
+		struct extendedFileEntry *efe = (struct extendedFileEntry *)desc->data->buffer;
+		flags = le16_to_cpu(efe->icbTag.flags);
+		efe->icbTag.flags = cpu_to_le16((flags & ~ICBTAG_FLAG_AD_MASK) | ICBTAG_FLAG_AD_SHORT);
+		efe->lengthAllocDescs = cpu_to_le32(count * sizeof(short_ad));
+		efe->informationLength = cpu_to_le64(length);
+		efe->objectSize = cpu_to_le64(length);
+		efe->logicalBlocksRecorded = cpu_to_le64(blocks);
+		sad = (short_ad *)&efe->extendedAttrAndAllocDescs[lengthExtendedAttr];
+	}
+	else
+	{
+		struct fileEntry *fe = (struct fileEntry *)desc->data->buffer;
+		flags = le16_to_cpu(fe->icbTag.flags);
+		fe->icbTag.flags = cpu_to_le16((flags & ~ICBTAG_FLAG_AD_MASK) | ICBTAG_FLAG_AD_SHORT);
+		fe->lengthAllocDescs = cpu_to_le32(count * sizeof(short_ad));
+		fe->informationLength = cpu_to_le64(length);
+		fe->logicalBlocksRecorded = cpu_to_le64(blocks);
+		sad = (short_ad *)&fe->extendedAttrAndAllocDescs[lengthExtendedAttr];
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		sad[i].extLength = cpu_to_le32(length > maxlen ? maxlen : length);
+		sad[i].extPosition = cpu_to_le32(start + i * (maxlen / disc->blocksize));
+		length -= le32_to_cpu(sad[i].extLength);
+	}
+
+	*(tag *)desc->data->buffer = query_tag(disc, pspace, desc, 1);
+}
+
+/**
+ * @brief create the Metadata Partition (UDF 2.50 2.2.10)
+ *
+ * File entries of the Metadata File, Metadata Mirror File and Metadata
+ * Bitmap File are recorded in the physical partition behind its space
+ * bitmap, the Metadata File starts at the next alignment unit. From now on
+ * udf_alloc_meta_blocks() places all ICBs and directories into the Metadata
+ * File. Its extents and space bitmap are recorded by finish_metadata().
+ *
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent
+ * @return void
+ */
+void setup_metadata(struct udf_disc *disc, struct udf_extent *pspace)
+{
+	struct metadataPartitionMap *mpm = find_type2_metadata_partition(disc, 0);
+	struct udf_desc *meta, *mirror, *bitmap;
+	struct spaceBitmapDesc *sbd;
+	uint32_t align, bits, bytes;
+
+	meta = udf_create(disc, pspace, NULL, 0, 0, NULL, 0, ICBTAG_FILE_TYPE_MAIN, ICBTAG_FLAG_SYSTEM);
+	mirror = udf_create(disc, pspace, NULL, 0, meta->offset + 1, NULL, 0, ICBTAG_FILE_TYPE_MIRROR, ICBTAG_FLAG_SYSTEM);
+	bitmap = udf_create(disc, pspace, NULL, 0, mirror->offset + 1, NULL, 0, ICBTAG_FILE_TYPE_BITMAP, ICBTAG_FLAG_SYSTEM);
+
+	mpm->metadataFileLoc = cpu_to_le32(meta->offset);
+	mpm->metadataMirrorFileLoc = cpu_to_le32(mirror->offset);
+	mpm->metadataBitmapFileLoc = cpu_to_le32(bitmap->offset);
+	mpm->allocUnitSize = cpu_to_le32(disc->meta_unit);
+	mpm->alignUnitSize = cpu_to_le16(disc->meta_align);
+	if (disc->flags & FLAG_METADATA_MIRROR)
+		mpm->flags |= MPM_FLAGS_DUPLICATE;
+
+	align = disc->sizing[PSPACE_SIZE].align;
+	disc->sizing[PSPACE_SIZE].align = disc->meta_align;
+	disc->meta_start = udf_alloc_blocks(disc, pspace, bitmap->offset + 1, disc->meta_unit);
+	disc->sizing[PSPACE_SIZE].align = align;
+	disc->meta_blocks = disc->meta_unit;
+
+	// Space bitmap covers rest of partition until finish_metadata() knows final size
+	bits = pspace->blocks - disc->meta_start;
+	bytes = (bits + 7) / 8;
+	disc->meta_bitmap = udf_arena_alloc(disc, sizeof(struct udf_desc));
+	disc->meta_bitmap->ident = TAG_IDENT_SBD;
+	disc->meta_bitmap->length = sizeof(struct spaceBitmapDesc) + bytes;
+	disc->meta_bitmap->data = alloc_data(disc, NULL, disc->meta_bitmap->length);
+	sbd = (struct spaceBitmapDesc *)disc->meta_bitmap->data->buffer;
+	sbd->numOfBits = cpu_to_le32(bits);
+	sbd->numOfBytes = cpu_to_le32(bytes);
+	memset(sbd->bitmap, 0xFF, bytes);
+}
+
+/**
+ * @brief record extents of the Metadata Partition files once all metadata
+ *        is allocated
+ *
+ * Space bitmap of the Metadata Partition is shrunk to the final size of the
+ * Metadata File and recorded as Metadata Bitmap File. With duplicated
+ * metadata, copies of all descriptors of the Metadata File are recorded into
+ * the Metadata Mirror File, which is allocated in the second half of the
+ * partition. Otherwise the Metadata Mirror File shares extents of the
+ * Metadata File.
+ *
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent
+ * @return void
+ */
+void finish_metadata(struct udf_disc *disc, struct udf_extent *pspace)
+{
+	struct metadataPartitionMap *mpm = find_type2_metadata_partition(disc, 0);
+	struct spaceBitmapDesc *sbd = (struct spaceBitmapDesc *)disc->meta_bitmap->data->buffer;
+	struct udf_desc *desc, *next;
+	uint32_t bytes = (disc->meta_blocks + 7) / 8;
+	uint32_t length = sizeof(struct spaceBitmapDesc) + bytes;
+	uint32_t align, block, mirror;
+
+	sbd->numOfBits = cpu_to_le32(disc->meta_blocks);
+	sbd->numOfBytes = cpu_to_le32(bytes);
+	if (disc->meta_blocks % 8)
+		sbd->bitmap[bytes-1] &= 0xFF >> (8 - disc->meta_blocks % 8);
+	disc->meta_bitmap->length = disc->meta_bitmap->data->length = length;
+
+	block = udf_alloc_blocks(disc, pspace, disc->meta_start + disc->meta_blocks, (length + disc->blocksize - 1) / disc->blocksize);
+	set_desc(disc, pspace, TAG_IDENT_SBD, block, length, disc->meta_bitmap->data);
+	sbd->descTag = udf_query_tag(disc, TAG_IDENT_SBD, 1, block, disc->meta_bitmap->data, 0, sizeof(struct spaceBitmapDesc));
+	set_file_extent(disc, pspace, find_desc(pspace, le32_to_cpu(mpm->metadataBitmapFileLoc)), block, length);
+
+	mirror = disc->meta_start;
+	if (disc->flags & FLAG_METADATA_MIRROR)
+	{
+		align = disc->sizing[PSPACE_SIZE].align;
+		disc->sizing[PSPACE_SIZE].align = disc->meta_align;
+		mirror = udf_alloc_blocks(disc, pspace, pspace->blocks / 2, disc->meta_blocks);
+		disc->sizing[PSPACE_SIZE].align = align;
+
+		// Copies share data with descriptors, tags already have locations in the Metadata Partition
+		for (desc = pspace->head; desc && desc->offset < disc->meta_start + disc->meta_blocks; desc = next)
+		{
+			next = desc->next;
+			if (desc->offset >= disc->meta_start)
+				set_desc(disc, pspace, desc->ident, mirror + desc->offset - disc->meta_start, desc->length, desc->data);
+		}
+	}
+
+	set_file_extent(disc, pspace, find_desc(pspace, le32_to_cpu(mpm->metadataFileLoc)), disc->meta_start, (uint64_t)disc->meta_blocks * disc->blocksize);
+	set_file_extent(disc, pspace, find_desc(pspace, le32_to_cpu(mpm->metadataMirrorFileLoc)), mirror, (uint64_t)disc->meta_blocks * disc->blocksize);
+}
+
 void setup_vds(struct udf_disc *disc)
 {
 	struct udf_extent *mvds, *rvds, *lvid, *stable[4], *sspace;
@@ -1032,14 +1228,14 @@ void setup_pvd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 	struct udf_desc *desc;
 	int length = sizeof(struct primaryVolDesc);
 
-	desc = set_desc(mvds, TAG_IDENT_PVD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_PVD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_pvd[0];
 	disc->udf_pvd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_PVD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_PVD, offset, length, NULL);
 	memcpy(disc->udf_pvd[1] = desc->data->buffer, disc->udf_pvd[0], length);
 	disc->udf_pvd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1053,14 +1249,14 @@ void setup_lvd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 	disc->udf_lvd[0]->integritySeqExt.extLocation = cpu_to_le32(lvid->start);
 //	((uint16_t *)disc->udf_lvd[0]->domainIdent.identSuffix)[0] = cpu_to_le16(disc->udf_rev);
 
-	desc = set_desc(mvds, TAG_IDENT_LVD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_LVD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_lvd[0];
 	disc->udf_lvd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_LVD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_LVD, offset, length, NULL);
 	memcpy(disc->udf_lvd[1] = desc->data->buffer, disc->udf_lvd[0], length);
 	disc->udf_lvd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1086,14 +1282,14 @@ void setup_pd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 		strcpy(disc->udf_pd[0]->partitionContents.ident, PARTITION_CONTENTS_NSR02);
 #endif
 
-	desc = set_desc(mvds, TAG_IDENT_PD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_PD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_pd[0];
 	disc->udf_pd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_PD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_PD, offset, length, NULL);
 	memcpy(disc->udf_pd[1] = desc->data->buffer, disc->udf_pd[0], length);
 	disc->udf_pd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1117,14 +1313,14 @@ void setup_usd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 		ext = next_extent(ext->next, USPACE);
 	}
 
-	desc = set_desc(mvds, TAG_IDENT_USD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_USD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_usd[0];
 	disc->udf_usd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_USD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_USD, offset, length, NULL);
 	memcpy(disc->udf_usd[1] = desc->data->buffer, disc->udf_usd[0], length);
 	disc->udf_usd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1136,14 +1332,14 @@ void setup_iuvd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_exten
 
 //	((uint16_t *)disc->udf_iuvd[0]->impIdent.identSuffix)[0] = cpu_to_le16(disc->udf_rev);
 
-	desc = set_desc(mvds, TAG_IDENT_IUVD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_IUVD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_iuvd[0];
 	disc->udf_iuvd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_IUVD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_IUVD, offset, length, NULL);
 	memcpy(disc->udf_iuvd[1] = desc->data->buffer, disc->udf_iuvd[0], length);
 	disc->udf_iuvd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1153,14 +1349,14 @@ void setup_td(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 	struct udf_desc *desc;
 	int length = sizeof(struct terminatingDesc);
 
-	desc = set_desc(mvds, TAG_IDENT_TD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_TD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_td[0];
 	disc->udf_td[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_TD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_TD, offset, length, NULL);
 	memcpy(disc->udf_td[1] = desc->data->buffer, disc->udf_td[0], length);
 	disc->udf_td[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1176,14 +1372,14 @@ void setup_lvid(struct udf_disc *disc, struct udf_extent *lvid)
 //	disc->udf_lvid->sizeTable[1] = cpu_to_le32(ext->blocks);
 	if (disc->flags & FLAG_VAT)
 		disc->udf_lvid->integrityType = cpu_to_le32(LVID_INTEGRITY_TYPE_OPEN);
-	desc = set_desc(lvid, TAG_IDENT_LVID, 0, 0, NULL);
+	desc = set_desc(disc, lvid, TAG_IDENT_LVID, 0, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_lvid;
 	disc->udf_lvid->descTag = query_tag(disc, lvid, desc, 1);
 
 	if (!(disc->flags & FLAG_BLANK_TERMINAL) && lvid->blocks > 1)
 	{
-		desc = set_desc(lvid, TAG_IDENT_TD, 1, sizeof(struct terminatingDesc), NULL);
+		desc = set_desc(disc, lvid, TAG_IDENT_TD, 1, sizeof(struct terminatingDesc), NULL);
 		((struct terminatingDesc *)desc->data->buffer)->descTag = query_tag(disc, lvid, desc, 1);
 	}
 }
@@ -1238,14 +1434,14 @@ void setup_stable(struct udf_disc *disc, struct udf_extent *stable[4], struct ud
 		disc->udf_stable[0]->mapEntry[i].origLocation = cpu_to_le32(0xFFFFFFFF);
 		disc->udf_stable[0]->mapEntry[i].mappedLocation = cpu_to_le32(sspace->start + (i * packetlen));
 	}
-	desc = set_desc(stable[0], 0, 0, 0, NULL);
+	desc = set_desc(disc, stable[0], 0, 0, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_stable[0];
 	disc->udf_stable[0]->descTag = query_tag(disc, stable[0], desc, 1);
 
 	for (i=1; i<4 && stable[i]; i++)
 	{
-		desc = set_desc(stable[i], 0, 0, length, NULL);
+		desc = set_desc(disc, stable[i], 0, 0, length, NULL);
 		memcpy(disc->udf_stable[i] = desc->data->buffer, disc->udf_stable[0], length);
 		disc->udf_stable[i]->descTag = query_tag(disc, stable[i], desc, 1);
 	}
@@ -1297,7 +1493,7 @@ void setup_vat(struct udf_disc *disc, struct udf_extent *pspace)
 		vtable = udf_create(disc, pspace, (const dchars *)"\x08" UDF_ID_ALLOC, strlen(UDF_ID_ALLOC)+1, offset, NULL, FID_FILE_CHAR_HIDDEN, ICBTAG_FILE_TYPE_VAT20, 0);
 		disc->vat_entries--; // Remove VAT file itself from VAT table
 		len = sizeof(struct virtualAllocationTable20);
-		data = alloc_data(&default_vat20, len);
+		data = alloc_data(disc, &default_vat20, len);
 		vat20 = data->buffer;
 		vat20->numFiles = query_lvidiu(disc)->numFiles;
 		vat20->numDirs = query_lvidiu(disc)->numDirs;
@@ -1306,7 +1502,7 @@ void setup_vat(struct udf_disc *disc, struct udf_extent *pspace)
 		vat20->maxUDFWriteRev = query_lvidiu(disc)->maxUDFWriteRev;
 		memcpy(vat20->logicalVolIdent, disc->udf_lvd[0]->logicalVolIdent, 128);
 		insert_data(disc, pspace, vtable, data);
-		data = alloc_data(disc->vat, disc->vat_entries * sizeof(uint32_t));
+		data = alloc_data(disc, disc->vat, disc->vat_entries * sizeof(uint32_t));
 		insert_data(disc, pspace, vtable, data);
 	}
 	else
@@ -1344,9 +1540,9 @@ void setup_vat(struct udf_disc *disc, struct udf_extent *pspace)
 		memcpy(ea_lv->logicalVolIdent, disc->udf_lvd[0]->logicalVolIdent, 128);
 		insert_ea(disc, vtable, (struct genericFormat *)buffer, sizeof(buffer));
 		len = sizeof(struct virtualAllocationTable15);
-		data = alloc_data(disc->vat, disc->vat_entries * sizeof(uint32_t));
+		data = alloc_data(disc, disc->vat, disc->vat_entries * sizeof(uint32_t));
 		insert_data(disc, pspace, vtable, data);
-		data = alloc_data(&default_vat15, len);
+		data = alloc_data(disc, &default_vat15, len);
 		vat15 = data->buffer;
 		memcpy(vat15->vatIdent.identSuffix, &udf_rev_le16, sizeof(udf_rev_le16));
 		insert_data(disc, pspace, vtable, data);
@@ -1486,4 +1682,64 @@ void add_type2_virtual_partition(struct udf_disc *disc, uint16_t partitionNum)
 }
 
 
+void add_type2_metadata_partition(struct udf_disc *disc, uint16_t partitionNum)
+{
+	struct metadataPartitionMap *pm;
+	int mtl = le32_to_cpu(disc->udf_lvd[0]->mapTableLength);
+	int npm = le32_to_cpu(disc->udf_lvd[0]->numPartitionMaps);
+	uint16_t udf_rev_le16 = cpu_to_le16(disc->udf_rev);
+
+	disc->udf_lvd[0] = realloc(disc->udf_lvd[0],
+		sizeof(struct logicalVolDesc) + mtl +
+		sizeof(struct metadataPartitionMap));
+
+	pm = (struct metadataPartitionMap *)&disc->udf_lvd[0]->partitionMaps[mtl];
+	mtl += sizeof(struct metadataPartitionMap);
+
+	disc->udf_lvd[0]->mapTableLength = cpu_to_le32(mtl);
+	disc->udf_lvd[0]->numPartitionMaps = cpu_to_le32(npm + 1);
+	memcpy(pm, &default_metamap, sizeof(struct metadataPartitionMap));
+	pm->partitionNum = cpu_to_le16(partitionNum);
+	memcpy(pm->partIdent.identSuffix, &udf_rev_le16, sizeof(udf_rev_le16));
+
+	disc->udf_lvid->numOfPartitions = cpu_to_le32(npm + 1);
+	disc->udf_lvid = realloc(disc->udf_lvid,
+		sizeof(struct logicalVolIntegrityDesc) +
+		sizeof(uint32_t) * 2 * (npm + 1) +
+		sizeof(struct logicalVolIntegrityDescImpUse));
+	memmove(&disc->udf_lvid->data[sizeof(uint32_t) * 2 * (npm + 1)],
+		&disc->udf_lvid->data[sizeof(uint32_t) * 2 * npm],
+		sizeof(struct logicalVolIntegrityDescImpUse));
+	memmove(&disc->udf_lvid->data[sizeof(uint32_t) * (npm + 1)],
+		&disc->udf_lvid->data[sizeof(uint32_t) * npm],
+		sizeof(uint32_t));
+}
+
+struct metadataPartitionMap *find_type2_metadata_partition(struct udf_disc *disc, uint16_t partitionNum)
+{
+	int i, npm, mtl = 0;
+	struct genericPartitionMap *pm;
+	struct udfPartitionMap2 *pm2;
+	struct metadataPartitionMap *mpm;
+
+	npm = le32_to_cpu(disc->udf_lvd[0]->numPartitionMaps);
+
+	for (i=0; i<npm; i++)
+	{
+		pm = (struct genericPartitionMap *)&disc->udf_lvd[0]->partitionMaps[mtl];
+		if (pm->partitionMapType == 2)
+		{
+			pm2 = (struct udfPartitionMap2 *)&disc->udf_lvd[0]->partitionMaps[mtl];
+			if (!strncmp((char *)pm2->partIdent.ident, UDF_ID_METADATA, strlen(UDF_ID_METADATA)))
+			{
+				mpm = (struct metadataPartitionMap *)&disc->udf_lvd[0]->partitionMaps[mtl];
+				if (le16_to_cpu(mpm->partitionNum) == partitionNum)
+					return mpm;
+			}
+		}
+		mtl += pm->partitionMapLength;
+	}
+	return NULL;
+}
+
 char *udf_space_type_str[UDF_SPACE_TYPE_SIZE] = { "RESERVED", "VRS", "ANCHOR", "MVDS", "RVDS", "LVID", "STABLE", "SSPACE", "PSPACE", "USPACE", "BAD", "MBR" };
@@ -60,6 +60,7 @@ enum media_type {
 
 extern char *udf_space_type_str[UDF_SPACE_TYPE_SIZE];
 
+void udf_time_uuid(timestamp *, char *);
 void udf_init_disc(struct udf_disc *);
 int udf_set_version(struct udf_disc *, uint16_t);
 void split_space(struct udf_disc *);
@@ -83,9 +84,13 @@ void setup_td(struct udf_disc *, struct udf_extent *, struct udf_extent *, uint3
 void setup_lvid(struct udf_disc *, struct udf_extent *);
 void setup_stable(struct udf_disc *, struct udf_extent *[4], struct udf_extent *);
 void setup_vat(struct udf_disc *, struct udf_extent *);
+void setup_metadata(struct udf_disc *, struct udf_extent *);
+void finish_metadata(struct udf_disc *, struct udf_extent *);
 void add_type1_partition(struct udf_disc *, uint16_t);
 void add_type2_sparable_partition(struct udf_disc *, uint16_t, uint8_t, uint16_t);
 void add_type2_virtual_partition(struct udf_disc *, uint16_t);
 struct sparablePartitionMap *find_type2_sparable_partition(struct udf_disc *, uint16_t);
+void add_type2_metadata_partition(struct udf_disc *, uint16_t);
+struct metadataPartitionMap *find_type2_metadata_partition(struct udf_disc *, uint16_t);
 
 #endif /* __MKUDFFS_H */
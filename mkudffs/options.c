@@ -40,6 +40,7 @@
 #include "mkudffs.h"
 #include "defaults.h"
 #include "options.h"
+#include "template.h"
 
 static struct option long_options[] = {
 	{ "help", no_argument, NULL, OPT_HELP },
@@ -73,6 +74,16 @@ static struct option long_options[] = {
 	{ "new-file", no_argument, NULL, OPT_NEW_FILE },
 	{ "no-write", no_argument, NULL, OPT_NO_WRITE },
 	{ "read-only", no_argument, NULL, OPT_READ_ONLY },
+	{ "direct", no_argument, NULL, OPT_DIRECT },
+	{ "discard", optional_argument, NULL, OPT_DISCARD },
+	{ "populate", required_argument, NULL, OPT_POPULATE },
+	{ "jobs", required_argument, NULL, OPT_JOBS },
+	{ "progress", optional_argument, NULL, OPT_PROGRESS },
+	{ "metadata-unit", required_argument, NULL, OPT_METADATA_UNIT },
+	{ "metadata-align", required_argument, NULL, OPT_METADATA_ALIGN },
+	{ "metadata-mirror", no_argument, NULL, OPT_METADATA_MIRROR },
+	{ "save-template", required_argument, NULL, OPT_SAVE_TEMPLATE },
+	{ "stamp", required_argument, NULL, OPT_STAMP },
 	{ 0, 0, NULL, 0 },
 };
 
@@ -81,6 +92,7 @@ void usage(void)
 	fprintf(stderr, "mkudffs from " PACKAGE_NAME " " PACKAGE_VERSION "\n"
 		"Usage:\n"
 		"\tmkudffs [options] device [blocks-count]\n"
+		"\tmkudffs --stamp=template [options] device...\n"
 		"Options:\n"
 		"\t--help, -h         Display this help\n"
 		"\t--label=, -l       UDF label, synonym for both --lvid and --vid (default: LinuxUDF)\n"
@@ -90,6 +102,13 @@ void usage(void)
 		"\t--udfrev=, -r      UDF revision (1.01, 1.02, 1.50, 2.00, 2.01, 2.50, 2.60; default: 2.01)\n"
 		"\t--no-write, -n     Not really, do not write to device, just simulate\n"
 		"\t--new-file         Create new image file, fail if already exists\n"
+		"\t--direct           Write to device with O_DIRECT, bypassing page cache\n"
+		"\t--discard[=secure] Discard free space instead of writing zeros; =secure uses secure discard (default: write zeros)\n"
+		"\t--populate=        Populate root directory by contents of directory tree\n"
+		"\t--jobs=            Number of threads reading files for --populate or stamping devices for --stamp (default: 4)\n"
+		"\t--save-template=   Save layout of formatted device as template for --stamp\n"
+		"\t--stamp=           Format devices from template, only --label, --lvid, --vid, --jobs, --progress, --no-write, --direct, --new-file and encoding options can be used\n"
+		"\t--progress         Report progress every second to stderr, or to --progress=fd:N or status --progress=FILE\n"
 		"\t--lvid=            Logical Volume Identifier (default: LinuxUDF)\n"
 		"\t--vid=             Volume Identifier (default: LinuxUDF)\n"
 		"\t--vsid=            17.-127. character of Volume Set Identifier (default: LinuxUDF)\n"
@@ -109,6 +128,9 @@ void usage(void)
 		"\t--space=           Space (freedbitmap, freedtable, unallocbitmap, unalloctable; default: unallocbitmap)\n"
 		"\t--ad=              Allocation descriptor (inicb, short, long; default: inicb)\n"
 		"\t--noefe            Don't Use Extended File Entries (default: use for UDF revision >= 2.00)\n"
+		"\t--metadata-unit=   Metadata Partition allocation unit in blocks (default: 32, UDF revision >= 2.50)\n"
+		"\t--metadata-align=  Metadata Partition alignment unit in blocks (default: packet length)\n"
+		"\t--metadata-mirror  Duplicate Metadata Partition into Metadata Mirror File (default: do not duplicate)\n"
 		"\t--locale           String options are encoded according to current locale (default)\n"
 		"\t--u8               String options are encoded in 8-bit OSTA Compressed Unicode format\n"
 		"\t--u16              String options are encoded in 16-bit OSTA Compressed Unicode format\n"
@@ -117,7 +139,35 @@ void usage(void)
 	exit(1);
 }
 
-void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, int *create_new_file, int *blocksize, int *media_ptr)
+/**
+ * @brief options which can be used together with --stamp, layout is taken from template
+ */
+static int stamp_option(int retval)
+{
+	switch (retval)
+	{
+		case OPT_STAMP:
+		case OPT_LABEL:
+		case 'l':
+		case OPT_LVID:
+		case OPT_VID:
+		case OPT_LOCALE:
+		case OPT_UNICODE8:
+		case OPT_UNICODE16:
+		case OPT_UTF8:
+		case OPT_NEW_FILE:
+		case OPT_NO_WRITE:
+		case 'n':
+		case OPT_DIRECT:
+		case OPT_JOBS:
+		case OPT_PROGRESS:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, int *create_new_file, int *blocksize, int *media_ptr, char **populate, unsigned int *jobs, char **progress, struct template_args *tmpl)
 {
 	int retval;
 	int i;
@@ -128,10 +178,16 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 	uint32_t spartable = 2;
 	uint32_t sparspace = 0;
 	uint16_t packetlen = 0;
+	uint32_t meta_unit = 0;
+	uint16_t meta_align = 0;
+	int layout_option = 0;
 	int failed;
 
 	while ((retval = getopt_long(argc, argv, "l:u:b:m:r:nh", long_options, NULL)) != EOF)
 	{
+		if (!stamp_option(retval))
+			layout_option = 1;
+
 		switch (retval)
 		{
 			case OPT_HELP:
@@ -208,6 +264,11 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 				read_only = 1;
 				break;
 			}
+			case OPT_DIRECT:
+			{
+				disc->flags |= FLAG_DIRECT_IO;
+				break;
+			}
 			case OPT_UNICODE8:
 			{
 				disc->flags &= ~FLAG_CHARSET;
@@ -273,6 +334,10 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 			case OPT_LABEL:
 			case 'l':
 			{
+				if (retval != OPT_VID)
+					tmpl->lvid = 1;
+				if (retval != OPT_LVID)
+					tmpl->vid = 1;
 				if (retval != OPT_VID)
 				{
 					struct impUseVolDescImpUse *iuvdiu;
@@ -474,6 +539,77 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 				}
 				break;
 			}
+			case OPT_DISCARD:
+			{
+				disc->flags |= FLAG_DISCARD;
+				disc->flags &= ~FLAG_SECURE_DISCARD;
+				if (optarg)
+				{
+					if (!strcmp(optarg, "secure"))
+						disc->flags |= FLAG_SECURE_DISCARD;
+					else
+					{
+						fprintf(stderr, "%s: Error: Invalid value for option --discard\n", appname);
+						exit(1);
+					}
+				}
+				break;
+			}
+			case OPT_POPULATE:
+			{
+				*populate = optarg;
+				break;
+			}
+			case OPT_JOBS:
+			{
+				*jobs = strtou32(optarg, 0, &failed);
+				if (failed || *jobs < 1 || *jobs > 256)
+				{
+					fprintf(stderr, "%s: Error: Invalid value for option --jobs\n", appname);
+					exit(1);
+				}
+				break;
+			}
+			case OPT_PROGRESS:
+			{
+				*progress = optarg ? optarg : "-";
+				break;
+			}
+			case OPT_SAVE_TEMPLATE:
+			{
+				tmpl->save = optarg;
+				break;
+			}
+			case OPT_STAMP:
+			{
+				tmpl->stamp = optarg;
+				break;
+			}
+			case OPT_METADATA_UNIT:
+			{
+				meta_unit = strtou32(optarg, 0, &failed);
+				if (failed || meta_unit == 0)
+				{
+					fprintf(stderr, "%s: Error: Invalid value for option --metadata-unit\n", appname);
+					exit(1);
+				}
+				break;
+			}
+			case OPT_METADATA_ALIGN:
+			{
+				meta_align = strtou16(optarg, 0, &failed);
+				if (failed || meta_align == 0)
+				{
+					fprintf(stderr, "%s: Error: Invalid value for option --metadata-align\n", appname);
+					exit(1);
+				}
+				break;
+			}
+			case OPT_METADATA_MIRROR:
+			{
+				disc->flags |= FLAG_METADATA_MIRROR;
+				break;
+			}
 			case OPT_STRATEGY:
 			{
 				if (strcmp(optarg, "4096") == 0)
@@ -680,6 +816,19 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 	}
 	if (optind == argc)
 		usage();
+
+	if (tmpl->stamp)
+	{
+		if (layout_option)
+		{
+			fprintf(stderr, "%s: Error: Layout options cannot be used with --stamp, layout is taken from template\n", appname);
+			exit(1);
+		}
+		tmpl->devices = &argv[optind];
+		*device = argv[optind];
+		return;
+	}
+
 	*device = argv[optind];
 	optind ++;
 	if (optind < argc)
@@ -734,10 +883,16 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 	else
 	{
 		add_type1_partition(disc, 0);
+		/* UDF 2.50+ require for non-VAT disks Metadata partition */
+		if (disc->udf_rev >= 0x0250)
+		{
+			add_type2_metadata_partition(disc, 0);
+			disc->flags |= FLAG_METADATA;
+		}
 	}
 
-	/* TODO: UDF 2.50+ require for non-VAT disks Metadata partition which mkudffs cannot create yet */
-	if (rev > 0x0201 && !(disc->flags & FLAG_VAT))
+	/* TODO: Metadata partition on top of Sparable partition is not supported yet */
+	if (rev > 0x0201 && use_sparable)
 	{
 		fprintf(stderr, "%s: Error: UDF revision above 2.01 is not currently supported for specified media type\n", appname);
 		exit(1);
@@ -752,6 +907,43 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 	if (!(disc->flags & FLAG_VAT) && !(disc->flags & FLAG_SPACE))
 		disc->flags |= FLAG_UNALLOC_BITMAP;
 
+	if (!(disc->flags & FLAG_METADATA) && (meta_unit || meta_align || (disc->flags & FLAG_METADATA_MIRROR)))
+	{
+		fprintf(stderr, "%s: Error: Options --metadata-unit, --metadata-align and --metadata-mirror need UDF revision 2.50 or higher without VAT\n", appname);
+		exit(1);
+	}
+
+	if (disc->flags & FLAG_METADATA)
+	{
+		disc->meta_align = meta_align ? meta_align : packetlen;
+		if (meta_unit)
+			disc->meta_unit = meta_unit;
+		else
+			disc->meta_unit = (32 + disc->meta_align - 1) / disc->meta_align * disc->meta_align;
+		if (disc->meta_unit % disc->meta_align)
+		{
+			fprintf(stderr, "%s: Error: Metadata allocation unit must be multiple of alignment unit\n", appname);
+			exit(1);
+		}
+		if (disc->meta_align % packetlen)
+		{
+			fprintf(stderr, "%s: Error: Metadata alignment unit must be multiple of packet length\n", appname);
+			exit(1);
+		}
+	}
+
+	if (*populate && tmpl->save)
+	{
+		fprintf(stderr, "%s: Error: Option --populate cannot be used with --save-template\n", appname);
+		exit(1);
+	}
+
+	if (*populate && (disc->flags & FLAG_VAT))
+	{
+		fprintf(stderr, "%s: Error: Option --populate cannot be used for VAT\n", appname);
+		exit(1);
+	}
+
 	if ((disc->flags & FLAG_STRATEGY4096) && (disc->flags & FLAG_VAT))
 	{
 		fprintf(stderr, "%s: Error: Cannot use strategy type 4096 for VAT\n", appname);
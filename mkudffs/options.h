@@ -24,8 +24,10 @@
 #ifndef _OPTIONS_H
 #define _OPTIONS_H 1
 
+struct template_args;
+
 void usage(void);
-void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *);
+void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *, char **, unsigned int *, char **, struct template_args *);
 
 /*
  * Command line option token values.
@@ -46,6 +48,8 @@ void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *);
 #define OPT_NEW_FILE	0x1009
 #define OPT_NO_WRITE	0x1010
 #define OPT_READ_ONLY	0x1011
+#define OPT_DIRECT	0x1012
+#define OPT_METADATA_MIRROR	0x1013
 
 #define OPT_BLK_SIZE	0x2000
 #define OPT_UDF_REV	0x2001
@@ -66,5 +70,13 @@ void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *);
 #define OPT_GID		0x2010
 #define OPT_MODE	0x2011
 #define OPT_BOOTAREA	0x2012
+#define OPT_DISCARD	0x2013
+#define OPT_POPULATE	0x2014
+#define OPT_JOBS	0x2015
+#define OPT_PROGRESS	0x2016
+#define OPT_METADATA_UNIT	0x2017
+#define OPT_METADATA_ALIGN	0x2018
+#define OPT_SAVE_TEMPLATE	0x2019
+#define OPT_STAMP	0x201A
 
 #endif /* _OPTIONS_H */
@@ -0,0 +1,976 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * mkudffs population of root directory from source directory tree
+ *
+ * Source tree is walked breadth first. Entries of every directory are sorted
+ * by name and their total FID length is reserved before the first one is
+ * added, so directories are not limited to one block. Directory and file
+ * ICBs are created by udf_create() like the rest of mkudffs metadata. Small
+ * files are embedded into their ICB. Data blocks of other files are allocated
+ * after the whole tree, so that data of all files forms one contiguous area
+ * behind the metadata.
+ *
+ * Metadata and allocations are built by one thread, as udf_disc is not
+ * locked. Source files are read by parallel reader threads: embedded data
+ * before the descriptors are written, together with tags of their ICBs, and
+ * data of other files afterwards in a pipeline feeding one ordered writer.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "mkudffs.h"
+#include "file.h"
+#include "populate.h"
+
+#define POPULATE_CHUNK_SIZE	(4*1024*1024)
+
+#ifdef IOV_MAX
+#define POPULATE_IOV_MAX	((IOV_MAX < 256) ? IOV_MAX : 256)
+#else
+#define POPULATE_IOV_MAX	16
+#endif
+
+struct populate_entry
+{
+	char			*name;
+	struct stat		st;
+	dchars			ident[256];
+	uint8_t			length;
+};
+
+struct populate_dir
+{
+	char			*path;
+	struct udf_desc		*desc;
+	struct udf_desc		*parent;
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr)
+	{
+		fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+	return ptr;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir), nlen = strlen(name);
+	char *path = xrealloc(NULL, dlen + nlen + 2);
+
+	memcpy(path, dir, dlen);
+	path[dlen] = '/';
+	memcpy(path + dlen + 1, name, nlen + 1);
+	return path;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	return strcmp(((const struct populate_entry *)a)->name, ((const struct populate_entry *)b)->name);
+}
+
+static int cmp_block(const void *a, const void *b)
+{
+	uint32_t ba = ((const struct populate_file *)a)->block, bb = ((const struct populate_file *)b)->block;
+	return ba < bb ? -1 : ba > bb;
+}
+
+static void set_timestamp(timestamp *ts, time_t sec, long nsec)
+{
+	struct tm tm;
+
+	if (!gmtime_r(&sec, &tm) || tm.tm_year < 1-1900 || tm.tm_year > 9999-1900)
+		return;
+
+	ts->typeAndTimezone = cpu_to_le16(0x1000);
+	ts->year = cpu_to_le16(1900 + tm.tm_year);
+	ts->month = 1 + tm.tm_mon;
+	ts->day = tm.tm_mday;
+	ts->hour = tm.tm_hour;
+	ts->minute = tm.tm_min;
+	ts->second = tm.tm_sec;
+	ts->centiseconds = nsec / 10000000;
+	ts->hundredsOfMicroseconds = (nsec / 100000) % 100;
+	ts->microseconds = (nsec / 1000) % 100;
+}
+
+/**
+ * @brief copy owner, permissions and times of source file into tag:FE/EFE
+ */
+static void set_attributes(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc, const struct stat *st)
+{
+	uint32_t permissions;
+	uint16_t flags = 0;
+
+	permissions =
+		((st->st_mode & S_IRWXU) << 4) |
+		((st->st_mode & S_IRWXG) << 2) |
+		((st->st_mode & S_IRWXO) << 0) |
+		((st->st_mode & S_IWUSR) ? FE_PERM_U_CHATTR | FE_PERM_U_DELETE : 0) |
+		((st->st_mode & S_IWGRP) ? FE_PERM_G_CHATTR | FE_PERM_G_DELETE : 0) |
+		((st->st_mode & S_IWOTH) ? FE_PERM_O_CHATTR | FE_PERM_O_DELETE : 0);
+
+	if (st->st_mode & S_ISUID)
+		flags |= ICBTAG_FLAG_SETUID;
+	if (st->st_mode & S_ISGID)
+		flags |= ICBTAG_FLAG_SETGID;
+	if (st->st_mode & S_ISVTX)
+		flags |= ICBTAG_FLAG_STICKY;
+
+	if (disc->flags & FLAG_EFE)
+	{
+		struct extendedFileEntry *efe = (struct extendedFileEntry *)desc->data->buffer;
+
+		efe->uid = cpu_to_le32(st->st_uid);
+		efe->gid = cpu_to_le32(st->st_gid);
+		efe->permissions = cpu_to_le32(permissions);
+		efe->icbTag.flags = cpu_to_le16(le16_to_cpu(efe->icbTag.flags) | flags);
+		set_timestamp(&efe->accessTime, st->st_atim.tv_sec, st->st_atim.tv_nsec);
+		set_timestamp(&efe->modificationTime, st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+		set_timestamp(&efe->createTime, st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+		set_timestamp(&efe->attrTime, st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+	}
+	else
+	{
+		struct fileEntry *fe = (struct fileEntry *)desc->data->buffer;
+
+		fe->uid = cpu_to_le32(st->st_uid);
+		fe->gid = cpu_to_le32(st->st_gid);
+		fe->permissions = cpu_to_le32(permissions);
+		fe->icbTag.flags = cpu_to_le16(le16_to_cpu(fe->icbTag.flags) | flags);
+		set_timestamp(&fe->accessTime, st->st_atim.tv_sec, st->st_atim.tv_nsec);
+		set_timestamp(&fe->modificationTime, st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+		set_timestamp(&fe->attrTime, st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+	}
+
+	*(tag *)desc->data->buffer = query_tag(disc, pspace, desc, 1);
+}
+
+/**
+ * @brief record tag:TE after ICB for strategy type 4096, like for root directory
+ */
+static void set_terminal(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc)
+{
+	struct udf_desc *tdesc;
+	struct terminalEntry *te;
+
+	if (!(disc->flags & FLAG_STRATEGY4096) || (disc->flags & FLAG_BLANK_TERMINAL))
+		return;
+
+	tdesc = set_desc(disc, pspace, TAG_IDENT_TE, desc->offset+1, sizeof(struct terminalEntry), NULL);
+	te = (struct terminalEntry *)tdesc->data->buffer;
+	te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
+	te->icbTag.strategyType = cpu_to_le16(4096);
+	te->icbTag.strategyParameter = cpu_to_le16(1);
+	te->icbTag.numEntries = cpu_to_le16(2);
+	te->icbTag.parentICBLocation.logicalBlockNum = cpu_to_le32(udf_lb_num(disc, desc->offset));
+	te->icbTag.parentICBLocation.partitionReferenceNum = cpu_to_le16(udf_lb_partition(disc, desc->offset));
+	te->icbTag.fileType = ICBTAG_FILE_TYPE_TE;
+	te->descTag = query_tag(disc, pspace, tdesc, 1);
+}
+
+/**
+ * @brief read part of source file, short read of shrunk file is filled by zeros
+ * @return 0 on success, -1 on failure
+ */
+static int read_file(int fd, const char *path, unsigned char *buffer, size_t length, uint64_t pos)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < length)
+	{
+		ret = pread(fd, buffer + done, length - done, pos + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+		{
+			fprintf(stderr, "%s: Warning: File '%s' was truncated while reading, filling by zeros\n", appname, path);
+			memset(buffer + done, 0, length - done);
+			break;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static int open_file(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot open file '%s': %s\n", appname, path, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/**
+ * @brief read entries of source directory sorted by name
+ * @return number of entries
+ */
+static size_t read_entries(struct udf_disc *disc, const char *path, struct populate_entry **entries_ptr)
+{
+	struct populate_entry *entries = NULL;
+	struct dirent *dirent;
+	size_t count = 0, size = 0;
+	size_t len;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+	{
+		fprintf(stderr, "%s: Error: Cannot open directory '%s': %s\n", appname, path, strerror(errno));
+		exit(1);
+	}
+
+	while ((errno = 0, dirent = readdir(dir)) != NULL)
+	{
+		struct populate_entry *entry;
+
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+			continue;
+
+		if (count == size)
+		{
+			size = size ? 2 * size : 64;
+			entries = xrealloc(entries, size * sizeof(struct populate_entry));
+		}
+		entry = &entries[count];
+
+		if (fstatat(dirfd(dir), dirent->d_name, &entry->st, AT_SYMLINK_NOFOLLOW) != 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot stat '%s/%s': %s\n", appname, path, dirent->d_name, strerror(errno));
+			exit(1);
+		}
+
+		if (!S_ISREG(entry->st.st_mode) && !S_ISDIR(entry->st.st_mode))
+		{
+			fprintf(stderr, "%s: Warning: Skipping '%s/%s': Only regular files and directories are supported\n", appname, path, dirent->d_name);
+			continue;
+		}
+
+		len = encode_string(disc, entry->ident, dirent->d_name, sizeof(entry->ident));
+		if (len == (size_t)-1)
+		{
+			fprintf(stderr, "%s: Warning: Skipping '%s/%s': Name cannot be encoded or is too long\n", appname, path, dirent->d_name);
+			continue;
+		}
+		entry->length = len;
+		entry->name = xrealloc(NULL, strlen(dirent->d_name) + 1);
+		strcpy(entry->name, dirent->d_name);
+		count++;
+	}
+
+	if (errno)
+	{
+		fprintf(stderr, "%s: Error: Cannot read directory '%s': %s\n", appname, path, strerror(errno));
+		exit(1);
+	}
+	closedir(dir);
+
+	qsort(entries, count, sizeof(struct populate_entry), cmp_entry);
+
+	*entries_ptr = entries;
+	return count;
+}
+
+/**
+ * @brief allocate data blocks of file and record them into its tag:FE/EFE
+ */
+static void alloc_file_data(struct udf_disc *disc, struct udf_extent *pspace, struct populate_file *file, uint32_t offset)
+{
+	struct udf_desc *desc = file->desc;
+	uint32_t maxlen = EXT_LENGTH_MASK & ~(disc->blocksize - 1);
+	uint32_t blocks = (file->length + disc->blocksize - 1) / disc->blocksize;
+	uint32_t count = (file->length + maxlen - 1) / maxlen;
+	uint32_t lengthExtendedAttr, i;
+	uint16_t flags;
+	size_t adlen, header;
+	uint64_t remaining;
+	uint8_t *ads;
+
+	if (file->length > (uint64_t)UINT32_MAX * disc->blocksize)
+	{
+		fprintf(stderr, "%s: Error: File '%s' is too large\n", appname, file->path);
+		exit(1);
+	}
+
+	if (disc->flags & FLAG_EFE)
+	{
+		struct extendedFileEntry *efe = (struct extendedFileEntry *)desc->data->buffer;
+		flags = le16_to_cpu(efe->icbTag.flags);
+		lengthExtendedAttr = le32_to_cpu(efe->lengthExtendedAttr);
+		header = sizeof(struct extendedFileEntry);
+	}
+	else
+	{
+		struct fileEntry *fe = (struct fileEntry *)desc->data->buffer;
+		flags = le16_to_cpu(fe->icbTag.flags);
+		lengthExtendedAttr = le32_to_cpu(fe->lengthExtendedAttr);
+		header = sizeof(struct fileEntry);
+	}
+
+	if ((flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB)
+		flags = (flags & ~ICBTAG_FLAG_AD_MASK) | ICBTAG_FLAG_AD_SHORT;
+	// ICB is in the Metadata Partition, data only in the physical one
+	if (disc->flags & FLAG_METADATA)
+		flags = (flags & ~ICBTAG_FLAG_AD_MASK) | ICBTAG_FLAG_AD_LONG;
+	adlen = ((flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG) ? sizeof(long_ad) : sizeof(short_ad);
+
+	if (header + lengthExtendedAttr + count * adlen > disc->blocksize)
+	{
+		fprintf(stderr, "%s: Error: File '%s' is too large\n", appname, file->path);
+		exit(1);
+	}
+
+	file->block = udf_alloc_blocks(disc, pspace, offset, blocks);
+
+	desc->data->buffer = udf_arena_realloc(disc, desc->data->buffer, desc->data->length, desc->data->length + count * adlen);
+	desc->data->length += count * adlen;
+	desc->length += count * adlen;
+
+	if (disc->flags & FLAG_EFE)
+	{
+		struct extendedFileEntry *efe = (struct extendedFileEntry *)desc->data->buffer;
+		efe->icbTag.flags = cpu_to_le16(flags);
+		efe->lengthAllocDescs = cpu_to_le32(count * adlen);
+		efe->informationLength = cpu_to_le64(file->length);
+		efe->objectSize = cpu_to_le64(file->length);
+		efe->logicalBlocksRecorded = cpu_to_le64(blocks);
+		ads = &efe->extendedAttrAndAllocDescs[lengthExtendedAttr];
+	}
+	else
+	{
+		struct fileEntry *fe = (struct fileEntry *)desc->data->buffer;
+		fe->icbTag.flags = cpu_to_le16(flags);
+		fe->lengthAllocDescs = cpu_to_le32(count * adlen);
+		fe->informationLength = cpu_to_le64(file->length);
+		fe->logicalBlocksRecorded = cpu_to_le64(blocks);
+		ads = &fe->extendedAttrAndAllocDescs[lengthExtendedAttr];
+	}
+
+	remaining = file->length;
+	for (i = 0; i < count; i++)
+	{
+		uint32_t length = (remaining > maxlen) ? maxlen : remaining;
+		uint32_t block = file->block + (uint64_t)i * (maxlen / disc->blocksize);
+
+		if (adlen == sizeof(short_ad))
+		{
+			short_ad *sad = (short_ad *)ads + i;
+			sad->extLength = cpu_to_le32(length);
+			sad->extPosition = cpu_to_le32(block);
+		}
+		else
+		{
+			long_ad *lad = (long_ad *)ads + i;
+			lad->extLength = cpu_to_le32(length);
+			lad->extLocation.logicalBlockNum = cpu_to_le32(block);
+			lad->extLocation.partitionReferenceNum = cpu_to_le16(0);
+		}
+		remaining -= length;
+	}
+
+	*(tag *)desc->data->buffer = query_tag(disc, pspace, desc, 1);
+}
+
+/**
+ * @brief populate root directory by contents of source directory tree
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param path the source directory
+ * @param tree files whose data has to be written by the caller
+ * @return void
+ */
+void populate_tree(struct udf_disc *disc, struct udf_extent *pspace, const char *path, struct populate *tree)
+{
+	struct populate_dir *dirs = NULL;
+	struct populate_entry *entries;
+	struct udf_desc *root, *desc;
+	struct stat st;
+	size_t count, i, head = 0, tail = 0, size = 0;
+	uint32_t offset;
+	uint64_t length;
+	size_t icb_max;
+
+	memset(tree, 0, sizeof(*tree));
+
+	if (stat(path, &st) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot stat '%s': %s\n", appname, path, strerror(errno));
+		exit(1);
+	}
+	if (!S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "%s: Error: Cannot populate from '%s': %s\n", appname, path, strerror(ENOTDIR));
+		exit(1);
+	}
+
+	root = find_desc(pspace, udf_lb_offset(disc, le16_to_cpu(disc->udf_fsd->rootDirectoryICB.extLocation.partitionReferenceNum), le32_to_cpu(disc->udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum)));
+	icb_max = disc->blocksize - ((disc->flags & FLAG_EFE) ? sizeof(struct extendedFileEntry) : sizeof(struct fileEntry));
+	offset = root->offset + 1;
+
+	dirs = xrealloc(dirs, sizeof(struct populate_dir));
+	size = 1;
+	dirs[tail].path = xrealloc(NULL, strlen(path) + 1);
+	strcpy(dirs[tail].path, path);
+	dirs[tail].desc = root;
+	dirs[tail].parent = NULL;
+	tail++;
+
+	while (head < tail)
+	{
+		struct populate_dir dir = dirs[head++];
+
+		count = read_entries(disc, dir.path, &entries);
+
+		// Parent link of root directory was already created by setup_root()
+		length = dir.parent ? compute_ident_length(sizeof(struct fileIdentDesc)) : 0;
+		for (i = 0; i < count; i++)
+			length += compute_ident_length(sizeof(struct fileIdentDesc) + entries[i].length);
+
+		udf_reserve_dir(disc, pspace, dir.desc, length);
+		if (dir.parent)
+			insert_fid(disc, pspace, dir.parent, dir.desc, NULL, 0, FID_FILE_CHAR_DIRECTORY | FID_FILE_CHAR_PARENT);
+
+		for (i = 0; i < count; i++)
+		{
+			struct populate_entry *entry = &entries[i];
+			char *epath = join_path(dir.path, entry->name);
+
+			if (S_ISDIR(entry->st.st_mode))
+			{
+				desc = udf_create(disc, pspace, entry->ident, entry->length, offset, dir.desc, FID_FILE_CHAR_DIRECTORY, ICBTAG_FILE_TYPE_DIRECTORY, 0);
+				set_attributes(disc, pspace, desc, &entry->st);
+
+				if (tail == size)
+				{
+					size *= 2;
+					dirs = xrealloc(dirs, size * sizeof(struct populate_dir));
+				}
+				dirs[tail].path = epath;
+				dirs[tail].desc = desc;
+				dirs[tail].parent = dir.desc;
+				tail++;
+				tree->num_dirs++;
+				udf_progress_add(UDF_PROGRESS_FILES, 1);
+			}
+			else
+			{
+				uint16_t flags;
+
+				desc = udf_create(disc, pspace, entry->ident, entry->length, offset, dir.desc, 0, ICBTAG_FILE_TYPE_REGULAR, 0);
+				set_attributes(disc, pspace, desc, &entry->st);
+
+				if (disc->flags & FLAG_EFE)
+					flags = le16_to_cpu(((struct extendedFileEntry *)desc->data->buffer)->icbTag.flags);
+				else
+					flags = le16_to_cpu(((struct fileEntry *)desc->data->buffer)->icbTag.flags);
+
+				if (entry->st.st_size == 0)
+				{
+					free(epath);
+				}
+				else if ((flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB && (uint64_t)entry->st.st_size <= icb_max)
+				{
+					// Data is read by populate_read_embedded()
+					struct udf_data *data = alloc_data(disc, NULL, entry->st.st_size);
+
+					insert_data(disc, pspace, desc, data);
+					if (tree->embed_count == tree->embed_size)
+					{
+						tree->embed_size = tree->embed_size ? 2 * tree->embed_size : 64;
+						tree->embeds = xrealloc(tree->embeds, tree->embed_size * sizeof(struct populate_embed));
+					}
+					tree->embeds[tree->embed_count].path = epath;
+					tree->embeds[tree->embed_count].desc = desc;
+					tree->embeds[tree->embed_count].data = data;
+					tree->embed_count++;
+				}
+				else
+				{
+					if (tree->count == tree->size)
+					{
+						tree->size = tree->size ? 2 * tree->size : 64;
+						tree->files = xrealloc(tree->files, tree->size * sizeof(struct populate_file));
+					}
+					tree->files[tree->count].path = epath;
+					tree->files[tree->count].desc = desc;
+					tree->files[tree->count].length = entry->st.st_size;
+					tree->files[tree->count].block = 0;
+					tree->count++;
+				}
+				tree->num_files++;
+				udf_progress_add(UDF_PROGRESS_FILES, 1);
+			}
+
+			set_terminal(disc, pspace, desc);
+			offset = desc->offset + 1;
+			free(entry->name);
+		}
+
+		free(entries);
+		free(dir.path);
+	}
+
+	free(dirs);
+
+	// Data of all files follows metadata, in order of directory walk
+	for (i = 0; i < tree->count; i++)
+	{
+		alloc_file_data(disc, pspace, &tree->files[i], offset);
+		offset = tree->files[i].block + (tree->files[i].length + disc->blocksize - 1) / disc->blocksize;
+	}
+
+	qsort(tree->files, tree->count, sizeof(struct populate_file), cmp_block);
+}
+
+struct populate_reader
+{
+	struct udf_disc		*disc;
+	struct udf_extent	*pspace;
+	struct populate		*tree;
+	size_t			next;
+	pthread_mutex_t		lock;
+};
+
+static void *embed_thread(void *arg)
+{
+	struct populate_reader *reader = arg;
+	struct populate_embed *embed;
+	size_t i;
+	int fd;
+
+	while (1)
+	{
+		pthread_mutex_lock(&reader->lock);
+		i = reader->next++;
+		pthread_mutex_unlock(&reader->lock);
+		if (i >= reader->tree->embed_count)
+			break;
+
+		embed = &reader->tree->embeds[i];
+		fd = open_file(embed->path);
+		if (read_file(fd, embed->path, embed->data->buffer, embed->data->length, 0) < 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot read file '%s': %s\n", appname, embed->path, strerror(errno));
+			exit(1);
+		}
+		close(fd);
+
+		// Tag of ICB covers embedded data
+		*(tag *)embed->desc->data->buffer = query_tag(reader->disc, reader->pspace, embed->desc, 1);
+	}
+
+	return NULL;
+}
+
+static pthread_t *start_threads(unsigned int jobs, void *(*func)(void *), void *arg)
+{
+	pthread_t *threads = xrealloc(NULL, jobs * sizeof(pthread_t));
+	unsigned int i;
+
+	for (i = 0; i < jobs; i++)
+	{
+		errno = pthread_create(&threads[i], NULL, func, arg);
+		if (errno)
+		{
+			fprintf(stderr, "%s: Error: Cannot create thread: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+	}
+	return threads;
+}
+
+static void join_threads(pthread_t *threads, unsigned int jobs)
+{
+	unsigned int i;
+
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+/**
+ * @brief read data of files embedded into ICBs and compute tags of their ICBs,
+ *        source files are read by parallel threads
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent of ICBs
+ * @param tree files of populated tree
+ * @param jobs the number of reader threads
+ * @return void
+ */
+void populate_read_embedded(struct udf_disc *disc, struct udf_extent *pspace, struct populate *tree, unsigned int jobs)
+{
+	struct populate_reader reader;
+	pthread_t *threads;
+
+	if (!tree->embed_count)
+		return;
+	if (jobs > tree->embed_count)
+		jobs = tree->embed_count;
+
+	memset(&reader, 0, sizeof(reader));
+	reader.disc = disc;
+	reader.pspace = pspace;
+	reader.tree = tree;
+	pthread_mutex_init(&reader.lock, NULL);
+
+	threads = start_threads(jobs, embed_thread, &reader);
+	join_threads(threads, jobs);
+
+	pthread_mutex_destroy(&reader.lock);
+}
+
+/**
+ * @brief part of source file copied into chunk buffer
+ */
+struct populate_piece
+{
+	size_t			file;
+	uint64_t		pos;
+	size_t			length;
+	size_t			buffer;
+	size_t			space;
+};
+
+/**
+ * @brief contiguous range of device filled by one chunk buffer
+ */
+struct populate_chunk
+{
+	off_t			offset;
+	size_t			length;
+	size_t			first;
+	size_t			count;
+};
+
+/**
+ * @brief state of data pipeline, chunk i is read into slot i % nslots
+ */
+struct populate_pipe
+{
+	struct populate		*tree;
+	struct populate_chunk	*chunks;
+	size_t			nchunks;
+	struct populate_piece	*pieces;
+	size_t			npieces;
+	unsigned char		**slots;
+	int			*filled;
+	size_t			nslots;
+	size_t			next;
+	size_t			written;
+	int			abort;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+};
+
+static void plan_chunks(struct udf_disc *disc, struct udf_extent *pspace, struct populate_pipe *pipe)
+{
+	struct populate *tree = pipe->tree;
+	struct populate_chunk *chunk = NULL;
+	size_t nchunks_size = 0, npieces_size = 0;
+	uint64_t pos, padded, n;
+	off_t offset;
+	size_t i;
+
+	for (i = 0; i < tree->count; i++)
+	{
+		offset = (off_t)(pspace->start + tree->files[i].block) * disc->blocksize;
+		padded = (tree->files[i].length + disc->blocksize - 1) & ~(uint64_t)(disc->blocksize - 1);
+
+		for (pos = 0; pos < padded; pos += n)
+		{
+			struct populate_piece *piece;
+
+			if (!chunk || chunk->offset + (off_t)chunk->length != offset + (off_t)pos || chunk->length == POPULATE_CHUNK_SIZE)
+			{
+				if (pipe->nchunks == nchunks_size)
+				{
+					nchunks_size = nchunks_size ? 2 * nchunks_size : 64;
+					pipe->chunks = xrealloc(pipe->chunks, nchunks_size * sizeof(struct populate_chunk));
+				}
+				chunk = &pipe->chunks[pipe->nchunks++];
+				chunk->offset = offset + pos;
+				chunk->length = 0;
+				chunk->first = pipe->npieces;
+				chunk->count = 0;
+			}
+
+			n = padded - pos;
+			if (n > POPULATE_CHUNK_SIZE - chunk->length)
+				n = POPULATE_CHUNK_SIZE - chunk->length;
+
+			if (pipe->npieces == npieces_size)
+			{
+				npieces_size = npieces_size ? 2 * npieces_size : 64;
+				pipe->pieces = xrealloc(pipe->pieces, npieces_size * sizeof(struct populate_piece));
+			}
+			piece = &pipe->pieces[pipe->npieces++];
+			piece->file = i;
+			piece->pos = pos;
+			piece->length = (pos < tree->files[i].length) ? ((tree->files[i].length - pos < n) ? tree->files[i].length - pos : n) : 0;
+			piece->buffer = chunk->length;
+			piece->space = n;
+
+			chunk->length += n;
+			chunk->count++;
+		}
+	}
+}
+
+static void *data_thread(void *arg)
+{
+	struct populate_pipe *pipe = arg;
+	struct populate_chunk *chunk;
+	struct populate_piece *piece;
+	struct populate_file *file;
+	unsigned char *buffer;
+	size_t i, k;
+	int fd;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (!pipe->abort && pipe->next < pipe->nchunks)
+	{
+		k = pipe->next++;
+		// Slot is free when chunk which used it before was written
+		while (!pipe->abort && k >= pipe->written + pipe->nslots)
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		if (pipe->abort)
+			break;
+		pthread_mutex_unlock(&pipe->lock);
+
+		chunk = &pipe->chunks[k];
+		buffer = pipe->slots[k % pipe->nslots];
+		for (i = chunk->first; i < chunk->first + chunk->count; i++)
+		{
+			piece = &pipe->pieces[i];
+			file = &pipe->tree->files[piece->file];
+			if (piece->length)
+			{
+				fd = open_file(file->path);
+				if (read_file(fd, file->path, buffer + piece->buffer, piece->length, piece->pos) < 0)
+				{
+					fprintf(stderr, "%s: Error: Cannot read file '%s': %s\n", appname, file->path, strerror(errno));
+					exit(1);
+				}
+				close(fd);
+			}
+			if (piece->length != piece->space)
+				memset(buffer + piece->buffer + piece->length, 0, piece->space - piece->length);
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->filled[k % pipe->nslots] = 1;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
+
+static int write_vector(int fd, struct iovec *iov, int count, off_t offset)
+{
+	ssize_t ret;
+
+	while (count > 0)
+	{
+		ret = pwritev(fd, iov, count, offset);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		udf_progress_add(UDF_PROGRESS_WRITTEN, ret);
+		offset += ret;
+		while (count > 0 && (size_t)ret >= iov->iov_len)
+		{
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief write data of files which are not embedded into ICBs
+ *
+ * Data area is split into chunks of contiguous blocks. Reader threads fill
+ * chunk buffers from source files ahead of the writer, which collects chunks
+ * following each other on device in order and writes them by one pwritev()
+ * call, so the device is written sequentially while sources are read in
+ * parallel.
+ *
+ * @param disc the udf_disc
+ * @param fd the device
+ * @param pspace the type:PSPACE udf_extent of data blocks
+ * @param tree files of populated tree
+ * @param jobs the number of reader threads
+ * @return 0 on success, -1 on write failure with errno set
+ */
+int populate_write(struct udf_disc *disc, int fd, struct udf_extent *pspace, struct populate *tree, unsigned int jobs)
+{
+	struct iovec iov[POPULATE_IOV_MAX];
+	struct populate_pipe pipe;
+	pthread_t *threads;
+	long align = sysconf(_SC_PAGESIZE);
+	uint64_t total;
+	size_t i, end;
+	int count, ret = 0, err = 0;
+
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.tree = tree;
+	plan_chunks(disc, pspace, &pipe);
+	if (!pipe.nchunks)
+		return 0;
+
+	// Writing of file data is the long part, estimated time is based on it
+	total = udf_progress_counters[UDF_PROGRESS_WRITTEN];
+	for (i = 0; i < pipe.nchunks; i++)
+		total += pipe.chunks[i].length;
+	udf_progress_total(UDF_PROGRESS_WRITTEN, total);
+
+	if (jobs > pipe.nchunks)
+		jobs = pipe.nchunks;
+	pipe.nslots = 2 * jobs;
+	pipe.slots = xrealloc(NULL, pipe.nslots * sizeof(unsigned char *));
+	pipe.filled = xrealloc(NULL, pipe.nslots * sizeof(int));
+	if (align < 512)
+		align = 512;
+	for (i = 0; i < pipe.nslots; i++)
+	{
+		if (posix_memalign((void **)&pipe.slots[i], align, POPULATE_CHUNK_SIZE) != 0)
+		{
+			fprintf(stderr, "%s: Error: posix_memalign failed: %s\n", appname, strerror(ENOMEM));
+			exit(1);
+		}
+		pipe.filled[i] = 0;
+	}
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.cond, NULL);
+
+	threads = start_threads(jobs, data_thread, &pipe);
+
+	pthread_mutex_lock(&pipe.lock);
+	while (pipe.written < pipe.nchunks)
+	{
+		while (!pipe.filled[pipe.written % pipe.nslots])
+			pthread_cond_wait(&pipe.cond, &pipe.lock);
+
+		count = 0;
+		end = pipe.written;
+		do
+		{
+			iov[count].iov_base = pipe.slots[end % pipe.nslots];
+			iov[count].iov_len = pipe.chunks[end].length;
+			count++;
+			end++;
+		} while (end < pipe.nchunks && end < pipe.written + pipe.nslots && count < POPULATE_IOV_MAX && pipe.filled[end % pipe.nslots] &&
+			 pipe.chunks[end].offset == pipe.chunks[end-1].offset + (off_t)pipe.chunks[end-1].length);
+		pthread_mutex_unlock(&pipe.lock);
+
+		ret = write_vector(fd, iov, count, pipe.chunks[pipe.written].offset);
+
+		pthread_mutex_lock(&pipe.lock);
+		if (ret < 0)
+		{
+			err = errno;
+			pipe.abort = 1;
+			pthread_cond_broadcast(&pipe.cond);
+			break;
+		}
+		for (i = pipe.written; i < end; i++)
+			pipe.filled[i % pipe.nslots] = 0;
+		pipe.written = end;
+		pthread_cond_broadcast(&pipe.cond);
+	}
+	pthread_mutex_unlock(&pipe.lock);
+
+	join_threads(threads, jobs);
+
+	pthread_cond_destroy(&pipe.cond);
+	pthread_mutex_destroy(&pipe.lock);
+	for (i = 0; i < pipe.nslots; i++)
+		free(pipe.slots[i]);
+	free(pipe.slots);
+	free(pipe.filled);
+	free(pipe.chunks);
+	free(pipe.pieces);
+
+	if (ret < 0)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief release list of files returned by populate_tree()
+ * @param tree files of populated tree
+ * @return void
+ */
+void populate_free(struct populate *tree)
+{
+	size_t i;
+
+	for (i = 0; i < tree->count; i++)
+		free(tree->files[i].path);
+	free(tree->files);
+	for (i = 0; i < tree->embed_count; i++)
+		free(tree->embeds[i].path);
+	free(tree->embeds);
+	memset(tree, 0, sizeof(*tree));
+}
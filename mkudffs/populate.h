@@ -0,0 +1,63 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __POPULATE_H
+#define __POPULATE_H
+
+#include "libudffs.h"
+
+/**
+ * @brief source file whose data is written outside of its ICB
+ */
+struct populate_file
+{
+	char			*path;
+	struct udf_desc		*desc;
+	uint64_t		length;
+	uint32_t		block;
+};
+
+/**
+ * @brief source file whose data is embedded into its ICB
+ */
+struct populate_embed
+{
+	char			*path;
+	struct udf_desc		*desc;
+	struct udf_data		*data;
+};
+
+/**
+ * @brief files of populated tree, in order of their data blocks
+ */
+struct populate
+{
+	struct populate_file	*files;
+	size_t			count;
+	size_t			size;
+	struct populate_embed	*embeds;
+	size_t			embed_count;
+	size_t			embed_size;
+	uint32_t		num_files;
+	uint32_t		num_dirs;
+};
+
+extern void populate_tree(struct udf_disc *, struct udf_extent *, const char *, struct populate *);
+extern void populate_read_embedded(struct udf_disc *, struct udf_extent *, struct populate *, unsigned int);
+extern int populate_write(struct udf_disc *, int, struct udf_extent *, struct populate *, unsigned int);
+extern void populate_free(struct populate *);
+
+#endif /* __POPULATE_H */
@@ -0,0 +1,898 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * mkudffs layout templates for formatting many identical devices
+ *
+ * template_save() records what write_disc() would write: descriptors which
+ * follow each other on disk as runs of data and unwritten extents as zero
+ * ranges. Descriptors with per-device fields (timestamps, uuid, labels and
+ * MBR disk signature) are recorded as patches together with offsets of those
+ * fields.
+ *
+ * template_stamp() formats devices from template without building udf_disc.
+ * Every device gets own copy of patches only, the rest of data is shared.
+ * Fields are stamped, tags of patched descriptors are recalculated and every
+ * run is written by one pwritev() which mixes shared data and patches.
+ * Devices are stamped by parallel threads.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#include "mkudffs.h"
+#include "template.h"
+
+#define TEMPLATE_ZERO_SIZE	(1024*1024)
+
+#ifdef IOV_MAX
+#define TEMPLATE_IOV_MAX	((IOV_MAX < 256) ? IOV_MAX : 256)
+#else
+#define TEMPLATE_IOV_MAX	16
+#endif
+
+/**
+ * @brief template being recorded by template_save()
+ */
+struct template_builder
+{
+	struct template		tpl;
+	uint32_t		runs_size;
+	uint32_t		zeros_size;
+	uint32_t		patches_size;
+	uint32_t		fields_size;
+	uint64_t		data_size;
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr)
+	{
+		fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+	return ptr;
+}
+
+static void add_field(struct template_builder *b, uint16_t type, uint32_t offset, uint16_t length)
+{
+	struct template_field *field;
+
+	if (b->tpl.num_fields == b->fields_size)
+	{
+		b->fields_size = b->fields_size ? b->fields_size * 2 : 64;
+		b->tpl.fields = xrealloc(b->tpl.fields, b->fields_size * sizeof(*b->tpl.fields));
+	}
+	field = &b->tpl.fields[b->tpl.num_fields++];
+	field->patch = b->tpl.num_patches;
+	field->offset = offset;
+	field->type = type;
+	field->length = length;
+	field->reserved = 0;
+}
+
+/**
+ * @brief record per-device fields of descriptor, descriptor with fields becomes a patch
+ */
+static void add_fields(struct template_builder *b, struct udf_extent *ext, struct udf_desc *desc, uint64_t offset, uint32_t length)
+{
+	uint32_t num_fields = b->tpl.num_fields;
+	struct template_patch *patch;
+
+	if (ext->space_type & MBR)
+		add_field(b, TEMPLATE_FIELD_MBR_SIGNATURE, offsetof(struct mbr, disk_signature), sizeof(uint32_t));
+	else
+	{
+		switch (desc->ident)
+		{
+			case TAG_IDENT_PVD:
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct primaryVolDesc, recordingDateAndTime), sizeof(timestamp));
+				add_field(b, TEMPLATE_FIELD_UUID, offsetof(struct primaryVolDesc, volSetIdent), 128);
+				add_field(b, TEMPLATE_FIELD_VID, offsetof(struct primaryVolDesc, volIdent), 32);
+				break;
+			case TAG_IDENT_LVD:
+				add_field(b, TEMPLATE_FIELD_LVID, offsetof(struct logicalVolDesc, logicalVolIdent), 128);
+				break;
+			case TAG_IDENT_IUVD:
+				add_field(b, TEMPLATE_FIELD_LVID, offsetof(struct impUseVolDesc, impUse) + offsetof(struct impUseVolDescImpUse, logicalVolIdent), 128);
+				break;
+			case TAG_IDENT_LVID:
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct logicalVolIntegrityDesc, recordingDateAndTime), sizeof(timestamp));
+				break;
+			case TAG_IDENT_FSD:
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct fileSetDesc, recordingDateAndTime), sizeof(timestamp));
+				add_field(b, TEMPLATE_FIELD_LVID, offsetof(struct fileSetDesc, logicalVolIdent), 128);
+				break;
+			case TAG_IDENT_FE:
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct fileEntry, accessTime), sizeof(timestamp));
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct fileEntry, modificationTime), sizeof(timestamp));
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct fileEntry, attrTime), sizeof(timestamp));
+				break;
+			case TAG_IDENT_EFE:
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct extendedFileEntry, accessTime), sizeof(timestamp));
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct extendedFileEntry, modificationTime), sizeof(timestamp));
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct extendedFileEntry, createTime), sizeof(timestamp));
+				add_field(b, TEMPLATE_FIELD_TIMESTAMP, offsetof(struct extendedFileEntry, attrTime), sizeof(timestamp));
+				break;
+		}
+	}
+
+	if (b->tpl.num_fields == num_fields)
+		return;
+
+	if (b->tpl.num_patches == b->patches_size)
+	{
+		b->patches_size = b->patches_size ? b->patches_size * 2 : 32;
+		b->tpl.patches = xrealloc(b->tpl.patches, b->patches_size * sizeof(*b->tpl.patches));
+	}
+	patch = &b->tpl.patches[b->tpl.num_patches++];
+	patch->offset = offset;
+	patch->length = length;
+	patch->tagged = !(ext->space_type & MBR);
+	b->tpl.patch_length += length;
+}
+
+static void add_desc(struct template_builder *b, struct udf_disc *disc, struct udf_extent *ext, struct udf_desc *desc)
+{
+	struct template_run *run = b->tpl.num_runs ? &b->tpl.runs[b->tpl.num_runs-1] : NULL;
+	uint32_t block = ext->start + desc->offset;
+	uint64_t length = 0;
+	uint64_t offset;
+	struct udf_data *data;
+
+	for (data = desc->data; data != NULL; data = data->next)
+		length += data->length;
+	length = (length + disc->blocksize - 1) & ~(uint64_t)(disc->blocksize - 1);
+
+	if (!run || block != run->block + run->count)
+	{
+		if (b->tpl.num_runs == b->runs_size)
+		{
+			b->runs_size = b->runs_size ? b->runs_size * 2 : 32;
+			b->tpl.runs = xrealloc(b->tpl.runs, b->runs_size * sizeof(*b->tpl.runs));
+		}
+		run = &b->tpl.runs[b->tpl.num_runs++];
+		run->block = block;
+		run->count = 0;
+		run->offset = b->tpl.data_length;
+	}
+	run->count += length / disc->blocksize;
+
+	offset = b->tpl.data_length;
+	if (offset + length > b->data_size)
+	{
+		while (offset + length > b->data_size)
+			b->data_size = b->data_size ? b->data_size * 2 : 1024*1024;
+		b->tpl.data = xrealloc(b->tpl.data, b->data_size);
+	}
+	for (data = desc->data; data != NULL; data = data->next)
+	{
+		memcpy(b->tpl.data + b->tpl.data_length, data->buffer, data->length);
+		b->tpl.data_length += data->length;
+	}
+	memset(b->tpl.data + b->tpl.data_length, 0, offset + length - b->tpl.data_length);
+	b->tpl.data_length = offset + length;
+
+	add_fields(b, ext, desc, offset, length);
+}
+
+static void add_zero(struct template_builder *b, uint32_t block, uint32_t count)
+{
+	if (b->tpl.num_zeros == b->zeros_size)
+	{
+		b->zeros_size = b->zeros_size ? b->zeros_size * 2 : 32;
+		b->tpl.zeros = xrealloc(b->tpl.zeros, b->zeros_size * sizeof(*b->tpl.zeros));
+	}
+	b->tpl.zeros[b->tpl.num_zeros].block = block;
+	b->tpl.zeros[b->tpl.num_zeros].count = count;
+	b->tpl.num_zeros++;
+}
+
+static uint16_t template_crc(const uint8_t *data, uint64_t length)
+{
+	uint16_t crc = 0;
+	uint32_t chunk;
+
+	while (length > 0)
+	{
+		chunk = length > UINT32_MAX ? UINT32_MAX : length;
+		crc = udf_crc((uint8_t *)data, chunk, crc);
+		data += chunk;
+		length -= chunk;
+	}
+	return crc;
+}
+
+static int write_template(const struct template *tpl, const char *path)
+{
+	struct template_header hdr;
+	struct template_run run;
+	struct template_zero zero;
+	struct template_patch patch;
+	struct template_field field;
+	uint32_t i;
+	int error;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TEMPLATE_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(TEMPLATE_VERSION);
+	hdr.blocksize = cpu_to_le32(tpl->blocksize);
+	hdr.blocks = cpu_to_le32(tpl->blocks);
+	hdr.numRuns = cpu_to_le32(tpl->num_runs);
+	hdr.numZeros = cpu_to_le32(tpl->num_zeros);
+	hdr.numPatches = cpu_to_le32(tpl->num_patches);
+	hdr.numFields = cpu_to_le32(tpl->num_fields);
+	hdr.dataCRC = cpu_to_le16(template_crc(tpl->data, tpl->data_length));
+	hdr.dataLength = cpu_to_le64(tpl->data_length);
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (i = 0; i < tpl->num_runs; i++)
+	{
+		run.block = cpu_to_le32(tpl->runs[i].block);
+		run.count = cpu_to_le32(tpl->runs[i].count);
+		run.offset = cpu_to_le64(tpl->runs[i].offset);
+		fwrite(&run, sizeof(run), 1, f);
+	}
+	for (i = 0; i < tpl->num_zeros; i++)
+	{
+		zero.block = cpu_to_le32(tpl->zeros[i].block);
+		zero.count = cpu_to_le32(tpl->zeros[i].count);
+		fwrite(&zero, sizeof(zero), 1, f);
+	}
+	for (i = 0; i < tpl->num_patches; i++)
+	{
+		patch.offset = cpu_to_le64(tpl->patches[i].offset);
+		patch.length = cpu_to_le32(tpl->patches[i].length);
+		patch.tagged = cpu_to_le32(tpl->patches[i].tagged);
+		fwrite(&patch, sizeof(patch), 1, f);
+	}
+	for (i = 0; i < tpl->num_fields; i++)
+	{
+		field.patch = cpu_to_le32(tpl->fields[i].patch);
+		field.offset = cpu_to_le32(tpl->fields[i].offset);
+		field.type = cpu_to_le16(tpl->fields[i].type);
+		field.length = cpu_to_le16(tpl->fields[i].length);
+		field.reserved = 0;
+		fwrite(&field, sizeof(field), 1, f);
+	}
+	if (tpl->data_length)
+		fwrite(tpl->data, tpl->data_length, 1, f);
+
+	error = ferror(f) ? EIO : 0;
+	if (fclose(f) != 0 && !error)
+		error = errno;
+	if (error)
+	{
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief save layout of udf_disc as template, after all descriptors are set up
+ * @param disc the udf_disc
+ * @param path file to create
+ * @return 0 on success, -1 on failure with errno set
+ */
+int template_save(struct udf_disc *disc, const char *path)
+{
+	struct template_builder b;
+	struct udf_extent *ext;
+	struct udf_desc *desc;
+	int ret;
+
+	memset(&b, 0, sizeof(b));
+	b.tpl.blocksize = disc->blocksize;
+	b.tpl.blocks = disc->blocks;
+
+	for (ext = disc->head; ext != NULL; ext = ext->next)
+	{
+		if (!(ext->space_type & (USPACE|RESERVED)))
+		{
+			for (desc = ext->head; desc != NULL; desc = desc->next)
+				add_desc(&b, disc, ext, desc);
+		}
+		else if (!(disc->flags & FLAG_BOOTAREA_PRESERVE) && ext->blocks)
+			add_zero(&b, ext->start, ext->blocks);
+	}
+
+	ret = write_template(&b.tpl, path);
+	free(b.tpl.runs);
+	free(b.tpl.zeros);
+	free(b.tpl.patches);
+	free(b.tpl.fields);
+	free(b.tpl.data);
+	return ret;
+}
+
+static int read_full(FILE *f, void *buf, size_t length)
+{
+	if (length && fread(buf, length, 1, f) != 1)
+	{
+		errno = ferror(f) ? EIO : EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static void *read_array(FILE *f, uint32_t count, size_t size)
+{
+	void *ptr;
+
+	ptr = calloc(count ? count : 1, size);
+	if (!ptr)
+		return NULL;
+	if (read_full(f, ptr, (size_t)count * size) < 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+	return ptr;
+}
+
+static int check_template(const struct template *tpl)
+{
+	uint64_t offset = 0;
+	uint32_t i, j;
+
+	if (tpl->blocksize < 512 || tpl->blocksize > 32768 || (tpl->blocksize & (tpl->blocksize - 1)))
+		return -1;
+
+	for (i = 0; i < tpl->num_runs; i++)
+	{
+		if (tpl->runs[i].offset != offset || (uint64_t)tpl->runs[i].block + tpl->runs[i].count > tpl->blocks)
+			return -1;
+		offset += (uint64_t)tpl->runs[i].count * tpl->blocksize;
+	}
+	if (offset != tpl->data_length)
+		return -1;
+
+	for (i = 0; i < tpl->num_zeros; i++)
+	{
+		if ((uint64_t)tpl->zeros[i].block + tpl->zeros[i].count > tpl->blocks)
+			return -1;
+	}
+
+	// Patches are ordered and every patch lies in one run
+	offset = 0;
+	for (i = 0, j = 0; i < tpl->num_patches; i++)
+	{
+		if (tpl->patches[i].offset < offset || tpl->patches[i].length == 0)
+			return -1;
+		while (j < tpl->num_runs && tpl->runs[j].offset + (uint64_t)tpl->runs[j].count * tpl->blocksize <= tpl->patches[i].offset)
+			j++;
+		if (j == tpl->num_runs || tpl->patches[i].offset + tpl->patches[i].length > tpl->runs[j].offset + (uint64_t)tpl->runs[j].count * tpl->blocksize)
+			return -1;
+		offset = tpl->patches[i].offset + tpl->patches[i].length;
+	}
+
+	for (i = 0; i < tpl->num_fields; i++)
+	{
+		if (tpl->fields[i].patch >= tpl->num_patches || (uint64_t)tpl->fields[i].offset + tpl->fields[i].length > tpl->patches[tpl->fields[i].patch].length)
+			return -1;
+		switch (tpl->fields[i].type)
+		{
+			case TEMPLATE_FIELD_TIMESTAMP:
+				if (tpl->fields[i].length != sizeof(timestamp))
+					return -1;
+				break;
+			case TEMPLATE_FIELD_UUID:
+			case TEMPLATE_FIELD_LVID:
+				if (tpl->fields[i].length != 128)
+					return -1;
+				break;
+			case TEMPLATE_FIELD_VID:
+				if (tpl->fields[i].length != 32)
+					return -1;
+				break;
+			case TEMPLATE_FIELD_MBR_SIGNATURE:
+				if (tpl->fields[i].length != sizeof(uint32_t))
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief load template saved by template_save()
+ * @param path template file
+ * @return template, NULL on failure with errno set, EINVAL for invalid template
+ */
+struct template *template_load(const char *path)
+{
+	struct template_header hdr;
+	struct template *tpl;
+	long align = sysconf(_SC_PAGESIZE);
+	uint32_t i;
+	void *data;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+
+	tpl = calloc(1, sizeof(*tpl));
+	if (!tpl)
+	{
+		fclose(f);
+		return NULL;
+	}
+
+	if (read_full(f, &hdr, sizeof(hdr)) < 0)
+		goto fail;
+	if (memcmp(hdr.magic, TEMPLATE_MAGIC, sizeof(hdr.magic)) != 0 || le32_to_cpu(hdr.version) != TEMPLATE_VERSION)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	tpl->blocksize = le32_to_cpu(hdr.blocksize);
+	tpl->blocks = le32_to_cpu(hdr.blocks);
+	tpl->num_runs = le32_to_cpu(hdr.numRuns);
+	tpl->num_zeros = le32_to_cpu(hdr.numZeros);
+	tpl->num_patches = le32_to_cpu(hdr.numPatches);
+	tpl->num_fields = le32_to_cpu(hdr.numFields);
+	tpl->data_length = le64_to_cpu(hdr.dataLength);
+
+	if (!(tpl->runs = read_array(f, tpl->num_runs, sizeof(*tpl->runs))))
+		goto fail;
+	if (!(tpl->zeros = read_array(f, tpl->num_zeros, sizeof(*tpl->zeros))))
+		goto fail;
+	if (!(tpl->patches = read_array(f, tpl->num_patches, sizeof(*tpl->patches))))
+		goto fail;
+	if (!(tpl->fields = read_array(f, tpl->num_fields, sizeof(*tpl->fields))))
+		goto fail;
+
+	for (i = 0; i < tpl->num_runs; i++)
+	{
+		tpl->runs[i].block = le32_to_cpu(tpl->runs[i].block);
+		tpl->runs[i].count = le32_to_cpu(tpl->runs[i].count);
+		tpl->runs[i].offset = le64_to_cpu(tpl->runs[i].offset);
+	}
+	for (i = 0; i < tpl->num_zeros; i++)
+	{
+		tpl->zeros[i].block = le32_to_cpu(tpl->zeros[i].block);
+		tpl->zeros[i].count = le32_to_cpu(tpl->zeros[i].count);
+	}
+	for (i = 0; i < tpl->num_patches; i++)
+	{
+		tpl->patches[i].offset = le64_to_cpu(tpl->patches[i].offset);
+		tpl->patches[i].length = le32_to_cpu(tpl->patches[i].length);
+		tpl->patches[i].tagged = le32_to_cpu(tpl->patches[i].tagged);
+		if (tpl->patch_length + (uint64_t)tpl->patches[i].length > UINT32_MAX)
+		{
+			errno = EINVAL;
+			goto fail;
+		}
+		tpl->patch_length += tpl->patches[i].length;
+	}
+	for (i = 0; i < tpl->num_fields; i++)
+	{
+		tpl->fields[i].patch = le32_to_cpu(tpl->fields[i].patch);
+		tpl->fields[i].offset = le32_to_cpu(tpl->fields[i].offset);
+		tpl->fields[i].type = le16_to_cpu(tpl->fields[i].type);
+		tpl->fields[i].length = le16_to_cpu(tpl->fields[i].length);
+	}
+
+	if (check_template(tpl) < 0)
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	// Data is written by direct I/O too
+	if (align < 512)
+		align = 512;
+	if (posix_memalign(&data, align, tpl->data_length ? tpl->data_length : 1) != 0)
+	{
+		errno = ENOMEM;
+		goto fail;
+	}
+	tpl->data = data;
+	if (read_full(f, tpl->data, tpl->data_length) < 0)
+		goto fail;
+	if (template_crc(tpl->data, tpl->data_length) != le16_to_cpu(hdr.dataCRC))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	fclose(f);
+	return tpl;
+
+fail:
+	i = errno;
+	fclose(f);
+	template_free(tpl);
+	errno = i;
+	return NULL;
+}
+
+void template_free(struct template *tpl)
+{
+	if (!tpl)
+		return;
+	free(tpl->runs);
+	free(tpl->zeros);
+	free(tpl->patches);
+	free(tpl->fields);
+	free(tpl->data);
+	free(tpl);
+}
+
+/**
+ * @brief state shared by stamping threads
+ */
+struct template_stamp
+{
+	struct template		*tpl;
+	struct template_device	*devices;
+	unsigned int		count;
+	unsigned int		next;
+	const dstring		*lvid;
+	const dstring		*vid;
+	uint8_t			*zeros;
+};
+
+static int stamp_writev(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0)
+	{
+		ret = pwritev(fd, iov, iovcnt, offset);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		udf_progress_add(UDF_PROGRESS_WRITTEN, ret);
+		offset += ret;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len)
+		{
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief fill range of device with zeros, like zero_range() of main.c
+ */
+static int stamp_zero(int fd, const uint8_t *zeros, off_t offset, off_t length)
+{
+	struct iovec iov;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+#ifdef BLKZEROOUT
+	if (S_ISBLK(st.st_mode))
+	{
+		uint64_t range[2] = { offset, length };
+
+		if (ioctl(fd, BLKZEROOUT, range) == 0)
+		{
+			udf_progress_add(UDF_PROGRESS_WRITTEN, length);
+			return 0;
+		}
+	}
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (S_ISREG(st.st_mode) && fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0)
+	{
+		udf_progress_add(UDF_PROGRESS_WRITTEN, length);
+		return 0;
+	}
+#endif
+
+	while (length > 0)
+	{
+		iov.iov_base = (void *)zeros;
+		iov.iov_len = length < TEMPLATE_ZERO_SIZE ? (size_t)length : TEMPLATE_ZERO_SIZE;
+		if (stamp_writev(fd, &iov, 1, offset) < 0)
+			return -1;
+		offset += TEMPLATE_ZERO_SIZE;
+		length -= TEMPLATE_ZERO_SIZE;
+	}
+	return 0;
+}
+
+static void stamp_fields(struct template_stamp *s, struct template_device *dev, uint8_t **patches)
+{
+	const struct template *tpl = s->tpl;
+	const struct template_field *field;
+	uint32_t signature = cpu_to_le32(dev->signature);
+	uint8_t *ptr;
+	uint16_t crc;
+	uint32_t i;
+	int j;
+	tag *t;
+
+	for (i = 0; i < tpl->num_fields; i++)
+	{
+		field = &tpl->fields[i];
+		ptr = patches[field->patch] + field->offset;
+		switch (field->type)
+		{
+			case TEMPLATE_FIELD_TIMESTAMP:
+				memcpy(ptr, &dev->ts, sizeof(timestamp));
+				break;
+			case TEMPLATE_FIELD_UUID:
+				if (ptr[0] == 8)
+					memcpy(&ptr[1], dev->uuid, 16);
+				else if (ptr[0] == 16)
+				{
+					for (j = 0; j < 16; j++)
+					{
+						ptr[2*j+1] = 0;
+						ptr[2*j+2] = dev->uuid[j];
+					}
+				}
+				break;
+			case TEMPLATE_FIELD_LVID:
+				if (s->lvid)
+					memcpy(ptr, s->lvid, 128);
+				break;
+			case TEMPLATE_FIELD_VID:
+				if (s->vid)
+					memcpy(ptr, s->vid, 32);
+				break;
+			case TEMPLATE_FIELD_MBR_SIGNATURE:
+				memcpy(ptr, &signature, sizeof(signature));
+				break;
+		}
+	}
+
+	// Only tags of patched descriptors change
+	for (i = 0; i < tpl->num_patches; i++)
+	{
+		if (!tpl->patches[i].tagged)
+			continue;
+		t = (tag *)patches[i];
+		if (sizeof(tag) + le16_to_cpu(t->descCRCLength) > tpl->patches[i].length)
+			continue;
+		crc = udf_crc(patches[i] + sizeof(tag), le16_to_cpu(t->descCRCLength), 0);
+		t->descCRC = cpu_to_le16(crc);
+		t->tagChecksum = 0;
+		for (j = 0; j < 16; j++)
+			if (j != 4)
+				t->tagChecksum += patches[i][j];
+	}
+}
+
+static int stamp_device(struct template_stamp *s, struct template_device *dev)
+{
+	const struct template *tpl = s->tpl;
+	const struct template_run *run;
+	struct iovec iov[TEMPLATE_IOV_MAX];
+	uint8_t **patches;
+	uint8_t *buffer = NULL;
+	uint64_t cursor, end, pos;
+	off_t offset;
+	uint32_t i, p;
+	long align = sysconf(_SC_PAGESIZE);
+	int iovcnt;
+	int ret = -1;
+
+	patches = calloc(tpl->num_patches ? tpl->num_patches : 1, sizeof(*patches));
+	if (!patches)
+		return -1;
+
+	if (align < 512)
+		align = 512;
+	if (posix_memalign((void **)&buffer, align, tpl->patch_length ? tpl->patch_length : 1) != 0)
+	{
+		errno = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0, pos = 0; i < tpl->num_patches; i++)
+	{
+		patches[i] = buffer + pos;
+		memcpy(patches[i], tpl->data + tpl->patches[i].offset, tpl->patches[i].length);
+		pos += tpl->patches[i].length;
+	}
+	stamp_fields(s, dev, patches);
+
+	p = 0;
+	for (i = 0; i < tpl->num_runs; i++)
+	{
+		run = &tpl->runs[i];
+		cursor = run->offset;
+		end = run->offset + (uint64_t)run->count * tpl->blocksize;
+		offset = (off_t)run->block * tpl->blocksize;
+		iovcnt = 0;
+		while (cursor < end)
+		{
+			if (iovcnt == TEMPLATE_IOV_MAX)
+			{
+				if (stamp_writev(dev->fd, iov, iovcnt, offset) < 0)
+					goto out;
+				offset = (off_t)run->block * tpl->blocksize + (cursor - run->offset);
+				iovcnt = 0;
+			}
+			if (p < tpl->num_patches && tpl->patches[p].offset == cursor)
+			{
+				iov[iovcnt].iov_base = patches[p];
+				iov[iovcnt].iov_len = tpl->patches[p].length;
+				cursor += tpl->patches[p].length;
+				p++;
+			}
+			else
+			{
+				iov[iovcnt].iov_base = tpl->data + cursor;
+				iov[iovcnt].iov_len = ((p < tpl->num_patches && tpl->patches[p].offset < end) ? tpl->patches[p].offset : end) - cursor;
+				cursor += iov[iovcnt].iov_len;
+			}
+			iovcnt++;
+		}
+		if (iovcnt && stamp_writev(dev->fd, iov, iovcnt, offset) < 0)
+			goto out;
+	}
+
+	for (i = 0; i < tpl->num_zeros && !dev->sparse; i++)
+	{
+		if (stamp_zero(dev->fd, s->zeros, (off_t)tpl->zeros[i].block * tpl->blocksize, (off_t)tpl->zeros[i].count * tpl->blocksize) < 0)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(buffer);
+	free(patches);
+	return ret;
+}
+
+static void *stamp_thread(void *arg)
+{
+	struct template_stamp *s = arg;
+	struct template_device *dev;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->count)
+	{
+		dev = &s->devices[i];
+		if (stamp_device(s, dev) < 0)
+			dev->error = errno ? errno : EIO;
+	}
+	return NULL;
+}
+
+/**
+ * @brief format devices from template, at most jobs devices at once
+ *
+ * Timestamps, uuids and MBR disk signatures of devices are generated before
+ * stamping starts and stay in devices for reporting. With FLAG_NO_WRITE
+ * nothing is written.
+ *
+ * @param disc the udf_disc with flags and string encoding of options
+ * @param tpl template loaded by template_load()
+ * @param devices opened devices
+ * @param count number of devices
+ * @param jobs maximal number of stamping threads
+ * @param lvid encoded Logical Volume Identifier which replaces the one from template, or NULL
+ * @param vid encoded Volume Identifier which replaces the one from template, or NULL
+ * @return 0 when all devices were stamped, -1 otherwise, error of every device is in its error
+ */
+int template_stamp(struct udf_disc *disc, struct template *tpl, struct template_device *devices, unsigned int count, unsigned int jobs, const dstring *lvid, const dstring *vid)
+{
+	struct template_stamp s;
+	pthread_t *threads;
+	unsigned int i, started;
+	uint64_t total = 0;
+	int ret = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		udf_time_uuid(&devices[i].ts, devices[i].uuid);
+		devices[i].signature = randu32();
+		devices[i].error = 0;
+	}
+
+	if (disc->flags & FLAG_NO_WRITE)
+		return 0;
+
+	memset(&s, 0, sizeof(s));
+	s.tpl = tpl;
+	s.devices = devices;
+	s.count = count;
+	s.lvid = lvid;
+	s.vid = vid;
+	if (posix_memalign((void **)&s.zeros, sysconf(_SC_PAGESIZE) < 512 ? 512 : sysconf(_SC_PAGESIZE), TEMPLATE_ZERO_SIZE) != 0)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(ENOMEM));
+		exit(1);
+	}
+	memset(s.zeros, 0, TEMPLATE_ZERO_SIZE);
+
+	for (i = 0; i < tpl->num_zeros; i++)
+		total += (uint64_t)tpl->zeros[i].count * tpl->blocksize;
+	udf_progress_total(UDF_PROGRESS_WRITTEN, (total + tpl->data_length) * count);
+
+	if (jobs > count)
+		jobs = count;
+	threads = calloc(jobs ? jobs : 1, sizeof(*threads));
+	if (!threads)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	for (started = 0; started < jobs; started++)
+	{
+		if (pthread_create(&threads[started], NULL, stamp_thread, &s) != 0)
+			break;
+	}
+	// Without any thread stamp in this one
+	if (!started)
+		stamp_thread(&s);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < count; i++)
+	{
+		if (devices[i].error)
+			ret = -1;
+	}
+
+	free(threads);
+	free(s.zeros);
+	return ret;
+}
@@ -0,0 +1,134 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __TEMPLATE_H
+#define __TEMPLATE_H
+
+#include "libudffs.h"
+
+#define TEMPLATE_MAGIC		"MKUDFTPL"
+#define TEMPLATE_VERSION	1
+
+/* Per-device fields of template */
+#define TEMPLATE_FIELD_TIMESTAMP	1	/* timestamp */
+#define TEMPLATE_FIELD_UUID		2	/* Volume Set Identifier, first 16 characters */
+#define TEMPLATE_FIELD_LVID		3	/* Logical Volume Identifier, dstring[128] */
+#define TEMPLATE_FIELD_VID		4	/* Volume Identifier, dstring[32] */
+#define TEMPLATE_FIELD_MBR_SIGNATURE	5	/* MBR disk signature */
+
+/*
+ * On-disk format of template, all numbers are little endian. Header is
+ * followed by runs, zero ranges, patches, fields and data of runs.
+ */
+struct template_header
+{
+	uint8_t			magic[8];
+	uint32_t		version;
+	uint32_t		blocksize;
+	uint32_t		blocks;
+	uint32_t		numRuns;
+	uint32_t		numZeros;
+	uint32_t		numPatches;
+	uint32_t		numFields;
+	uint16_t		dataCRC;
+	uint16_t		reserved;
+	uint64_t		dataLength;
+} __attribute__ ((packed));
+
+/* Blocks written from data of template */
+struct template_run
+{
+	uint32_t		block;
+	uint32_t		count;
+	uint64_t		offset;		/* in data */
+} __attribute__ ((packed));
+
+/* Blocks filled by zeros */
+struct template_zero
+{
+	uint32_t		block;
+	uint32_t		count;
+} __attribute__ ((packed));
+
+/* Descriptor with per-device fields, copied for every device */
+struct template_patch
+{
+	uint64_t		offset;		/* in data, ordered */
+	uint32_t		length;		/* padded to blocksize */
+	uint32_t		tagged;		/* tag is recalculated after fields are stamped */
+} __attribute__ ((packed));
+
+struct template_field
+{
+	uint32_t		patch;
+	uint32_t		offset;		/* in patch */
+	uint16_t		type;		/* TEMPLATE_FIELD_* */
+	uint16_t		length;
+	uint32_t		reserved;
+} __attribute__ ((packed));
+
+/**
+ * @brief layout template loaded into memory, numbers in cpu byte order
+ */
+struct template
+{
+	uint32_t		blocksize;
+	uint32_t		blocks;
+	struct template_run	*runs;
+	uint32_t		num_runs;
+	struct template_zero	*zeros;
+	uint32_t		num_zeros;
+	struct template_patch	*patches;
+	uint32_t		num_patches;
+	uint32_t		patch_length;	/* sum of patch lengths */
+	struct template_field	*fields;
+	uint32_t		num_fields;
+	uint8_t			*data;
+	uint64_t		data_length;
+};
+
+/**
+ * @brief template options of command line
+ */
+struct template_args
+{
+	char			*save;		/* --save-template */
+	char			*stamp;		/* --stamp */
+	char			**devices;	/* devices for --stamp, NULL terminated */
+	int			lvid;		/* --lvid or --label given for --stamp */
+	int			vid;		/* --vid or --label given for --stamp */
+};
+
+/**
+ * @brief device stamped from template
+ */
+struct template_device
+{
+	const char		*filename;
+	int			fd;
+	timestamp		ts;
+	char			uuid[17];
+	uint32_t		signature;
+	int			sparse;		/* new image file of template size, zero ranges are holes */
+	int			error;		/* errno of failed write, 0 on success */
+};
+
+extern int template_save(struct udf_disc *, const char *);
+extern struct template *template_load(const char *);
+extern void template_free(struct template *);
+extern int template_stamp(struct udf_disc *, struct template *, struct template_device *, unsigned int, unsigned int, const dstring *, const dstring *);
+
+#endif /* __TEMPLATE_H */
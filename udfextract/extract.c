@@ -0,0 +1,997 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * udfextract copying of UDF file tree into a directory
+ *
+ * The tree is walked by the main thread through the libudffs reader, so ICBs,
+ * Allocation Extent Descriptors and directories are small reads served by the
+ * window cache of the medium. Files embedded in their ICB are written right
+ * away. Recorded extents of other files are mapped to positions on medium
+ * and collected as pieces. After the walk the pieces are sorted by position,
+ * so the medium is read from front to back, and copied by a pool of threads:
+ * by copy_file_range() when the medium is a regular image file, otherwise by
+ * pread() and pwrite(). Extents which are not recorded are left as holes.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "libudffs.h"
+#include "extract.h"
+
+/* Nesting of directories, deeper ones are skipped */
+#define EXTRACT_MAX_DEPTH	1024
+/* Allocation Extent Descriptors followed for one ICB, against loops */
+#define EXTRACT_MAX_AEDS	65536
+/* Directories and symbolic links are read into memory up to this size */
+#define EXTRACT_MAX_DATA	(64*1024*1024)
+/* Buffer of one thread when copy_file_range() cannot be used */
+#define EXTRACT_BUFFER_SIZE	(1024*1024)
+
+struct extract_icb
+{
+	uint8_t			*buffer;
+	uint8_t			type;
+	uint16_t		flags;
+	uint16_t		partition;
+	uint32_t		block;
+	uint32_t		permissions;
+	uint64_t		length;
+	const timestamp		*atime;
+	const timestamp		*mtime;
+	uint8_t			*ads;
+	uint32_t		ads_length;
+};
+
+struct extract_extent
+{
+	uint64_t		offset;
+	uint32_t		length;
+	uint32_t		type;
+	uint16_t		partition;
+	uint32_t		block;
+};
+
+struct extract_file
+{
+	char			*path;
+	mode_t			mode;
+	struct timespec		times[2];
+	int			fd;
+	uint32_t		pieces;
+};
+
+struct extract_piece
+{
+	uint64_t		source;
+	uint64_t		offset;
+	uint64_t		length;
+	size_t			file;
+};
+
+struct extract
+{
+	struct udf_medium	*medium;
+	struct udf_disc		*disc;
+	int			copy_range;
+	unsigned long		errors;
+
+	struct extract_file	*files;
+	size_t			num_files;
+	size_t			size_files;
+	struct extract_piece	*pieces;
+	size_t			num_pieces;
+	size_t			size_pieces;
+	struct extract_file	*dirs;
+	size_t			num_dirs;
+	size_t			size_dirs;
+
+	lb_addr			ancestors[EXTRACT_MAX_DEPTH];
+
+	pthread_mutex_t		lock;
+	size_t			next;
+};
+
+static void *grow_array(void *array, size_t *size, size_t count, size_t item)
+{
+	size_t new_size;
+	void *ptr;
+
+	if (count < *size)
+		return array;
+
+	new_size = *size ? *size * 2 : 64;
+	ptr = realloc(array, new_size * item);
+	if (!ptr)
+	{
+		fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	*size = new_size;
+	return ptr;
+}
+
+static mode_t icb_mode(uint32_t permissions, uint16_t flags)
+{
+	mode_t mode = 0;
+
+	if (permissions & FE_PERM_U_READ)
+		mode |= S_IRUSR;
+	if (permissions & FE_PERM_U_WRITE)
+		mode |= S_IWUSR;
+	if (permissions & FE_PERM_U_EXEC)
+		mode |= S_IXUSR;
+	if (permissions & FE_PERM_G_READ)
+		mode |= S_IRGRP;
+	if (permissions & FE_PERM_G_WRITE)
+		mode |= S_IWGRP;
+	if (permissions & FE_PERM_G_EXEC)
+		mode |= S_IXGRP;
+	if (permissions & FE_PERM_O_READ)
+		mode |= S_IROTH;
+	if (permissions & FE_PERM_O_WRITE)
+		mode |= S_IWOTH;
+	if (permissions & FE_PERM_O_EXEC)
+		mode |= S_IXOTH;
+	if (flags & ICBTAG_FLAG_SETUID)
+		mode |= S_ISUID;
+	if (flags & ICBTAG_FLAG_SETGID)
+		mode |= S_ISGID;
+	if (flags & ICBTAG_FLAG_STICKY)
+		mode |= S_ISVTX;
+
+	return mode;
+}
+
+static void icb_time(const timestamp *ts, struct timespec *spec)
+{
+	uint16_t type_tz = le16_to_cpu(ts->typeAndTimezone);
+	int16_t tz;
+	struct tm tm;
+
+	if (le16_to_cpu(ts->year) == 0)
+	{
+		spec->tv_sec = 0;
+		spec->tv_nsec = UTIME_OMIT;
+		return;
+	}
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = le16_to_cpu(ts->year) - 1900;
+	tm.tm_mon = ts->month - 1;
+	tm.tm_mday = ts->day;
+	tm.tm_hour = ts->hour;
+	tm.tm_min = ts->minute;
+	tm.tm_sec = ts->second;
+	spec->tv_sec = timegm(&tm);
+	spec->tv_nsec = ((ts->centiseconds * 100 + ts->hundredsOfMicroseconds) * 100 + ts->microseconds) * 1000;
+
+	// Timezone is a signed 12 bit offset in minutes, -2047 when not specified
+	tz = type_tz & 0x0FFF;
+	if (tz & 0x0800)
+		tz |= 0xF000;
+	if ((type_tz >> 12) == 1 && tz != -2047)
+		spec->tv_sec -= tz * 60;
+}
+
+static int read_icb(struct extract *ex, const long_ad *ad, struct extract_icb *icb)
+{
+	struct udf_disc *disc = ex->disc;
+	struct fileEntry *fe;
+	struct extendedFileEntry *efe;
+	uint32_t header, ea_length;
+	uint8_t checksum;
+	int i;
+
+	memset(icb, 0, sizeof(*icb));
+	icb->partition = le16_to_cpu(ad->extLocation.partitionReferenceNum);
+	icb->block = le32_to_cpu(ad->extLocation.logicalBlockNum);
+
+	icb->buffer = malloc(disc->blocksize);
+	if (!icb->buffer)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	if (udf_read_blocks(ex->medium, disc, icb->partition, icb->block, 1, icb->buffer) < 0)
+		goto broken;
+
+	fe = (struct fileEntry *)icb->buffer;
+	efe = (struct extendedFileEntry *)icb->buffer;
+
+	checksum = 0;
+	for (i = 0; i < 16; ++i)
+		if (i != 4)
+			checksum += icb->buffer[i];
+	if (checksum != fe->descTag.tagChecksum || le32_to_cpu(fe->descTag.tagLocation) != icb->block)
+		goto broken;
+
+	if (le16_to_cpu(fe->descTag.tagIdent) == TAG_IDENT_FE)
+	{
+		header = sizeof(*fe);
+		ea_length = le32_to_cpu(fe->lengthExtendedAttr);
+		icb->ads_length = le32_to_cpu(fe->lengthAllocDescs);
+		icb->length = le64_to_cpu(fe->informationLength);
+		icb->atime = &fe->accessTime;
+		icb->mtime = &fe->modificationTime;
+	}
+	else if (le16_to_cpu(fe->descTag.tagIdent) == TAG_IDENT_EFE)
+	{
+		header = sizeof(*efe);
+		ea_length = le32_to_cpu(efe->lengthExtendedAttr);
+		icb->ads_length = le32_to_cpu(efe->lengthAllocDescs);
+		icb->length = le64_to_cpu(efe->informationLength);
+		icb->atime = &efe->accessTime;
+		icb->mtime = &efe->modificationTime;
+	}
+	else
+		goto broken;
+
+	if (ea_length > disc->blocksize - header || icb->ads_length > disc->blocksize - header - ea_length)
+		goto broken;
+
+	// File Entry and Extended File Entry share layout up to informationLength
+	icb->type = fe->icbTag.fileType;
+	icb->flags = le16_to_cpu(fe->icbTag.flags);
+	icb->permissions = le32_to_cpu(fe->permissions);
+	icb->ads = icb->buffer + header + ea_length;
+	return 0;
+
+broken:
+	free(icb->buffer);
+	icb->buffer = NULL;
+	return -1;
+}
+
+static int collect_extents(struct extract *ex, const struct extract_icb *icb, struct extract_extent **extents, size_t *count)
+{
+	struct udf_disc *disc = ex->disc;
+	struct allocExtDesc *aed;
+	uint8_t *aed_buffer = NULL;
+	const uint8_t *ads = icb->ads;
+	uint32_t ads_length = icb->ads_length;
+	uint32_t pos, ad_size, length, block;
+	uint16_t partition;
+	uint64_t offset = 0;
+	size_t size = 0;
+	unsigned int aeds = 0;
+	int ret = 0;
+
+	*extents = NULL;
+	*count = 0;
+
+	switch (icb->flags & ICBTAG_FLAG_AD_MASK)
+	{
+		case ICBTAG_FLAG_AD_SHORT:
+			ad_size = sizeof(short_ad);
+			break;
+		case ICBTAG_FLAG_AD_LONG:
+			ad_size = sizeof(long_ad);
+			break;
+		case ICBTAG_FLAG_AD_EXTENDED:
+			ad_size = sizeof(ext_ad);
+			break;
+		default:
+			return -1;
+	}
+
+	for (pos = 0; pos + ad_size <= ads_length; pos += ad_size)
+	{
+		if (ad_size == sizeof(short_ad))
+		{
+			const short_ad *sad = (const short_ad *)(ads + pos);
+			length = le32_to_cpu(sad->extLength);
+			block = le32_to_cpu(sad->extPosition);
+			partition = icb->partition;
+		}
+		else if (ad_size == sizeof(long_ad))
+		{
+			const long_ad *lad = (const long_ad *)(ads + pos);
+			length = le32_to_cpu(lad->extLength);
+			block = le32_to_cpu(lad->extLocation.logicalBlockNum);
+			partition = le16_to_cpu(lad->extLocation.partitionReferenceNum);
+		}
+		else
+		{
+			const ext_ad *ead = (const ext_ad *)(ads + pos);
+			length = le32_to_cpu(ead->extLength);
+			block = le32_to_cpu(ead->extLocation.logicalBlockNum);
+			partition = le16_to_cpu(ead->extLocation.partitionReferenceNum);
+		}
+
+		if ((length & EXT_LENGTH_MASK) == 0)
+			break;
+
+		if ((length & ~EXT_LENGTH_MASK) == EXT_NEXT_EXTENT_ALLOCDECS)
+		{
+			if (++aeds > EXTRACT_MAX_AEDS)
+			{
+				ret = -1;
+				break;
+			}
+			if (!aed_buffer)
+			{
+				aed_buffer = malloc(disc->blocksize);
+				if (!aed_buffer)
+				{
+					fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+					exit(1);
+				}
+			}
+			aed = (struct allocExtDesc *)aed_buffer;
+			if (udf_read_blocks(ex->medium, disc, partition, block, 1, aed_buffer) < 0
+			    || le16_to_cpu(aed->descTag.tagIdent) != TAG_IDENT_AED
+			    || le32_to_cpu(aed->descTag.tagLocation) != block
+			    || le32_to_cpu(aed->lengthAllocDescs) > disc->blocksize - sizeof(*aed))
+			{
+				ret = -1;
+				break;
+			}
+			ads = aed_buffer + sizeof(*aed);
+			ads_length = le32_to_cpu(aed->lengthAllocDescs);
+			pos = -ad_size;
+			continue;
+		}
+
+		*extents = grow_array(*extents, &size, *count, sizeof(**extents));
+		(*extents)[*count].offset = offset;
+		(*extents)[*count].length = length & EXT_LENGTH_MASK;
+		(*extents)[*count].type = length & ~EXT_LENGTH_MASK;
+		(*extents)[*count].partition = partition;
+		(*extents)[*count].block = block;
+		(*count)++;
+		offset += length & EXT_LENGTH_MASK;
+	}
+
+	free(aed_buffer);
+	return ret;
+}
+
+/* Read whole data of a directory or symbolic link into memory */
+static uint8_t *read_data(struct extract *ex, const struct extract_icb *icb)
+{
+	struct udf_disc *disc = ex->disc;
+	struct extract_extent *extents;
+	size_t count, i;
+	uint32_t blocks, bytes;
+	uint8_t *data, *buffer;
+
+	if (icb->length > EXTRACT_MAX_DATA)
+		return NULL;
+
+	data = calloc(1, icb->length + 1);
+	if (!data)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	if ((icb->flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB)
+	{
+		if (icb->ads_length < icb->length)
+		{
+			free(data);
+			return NULL;
+		}
+		memcpy(data, icb->ads, icb->length);
+		return data;
+	}
+
+	if (collect_extents(ex, icb, &extents, &count) < 0)
+	{
+		free(extents);
+		free(data);
+		return NULL;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		if (extents[i].offset >= icb->length)
+			break;
+		if (extents[i].type != EXT_RECORDED_ALLOCATED)
+			continue;
+
+		bytes = extents[i].length;
+		if (bytes > icb->length - extents[i].offset)
+			bytes = icb->length - extents[i].offset;
+		blocks = (bytes + disc->blocksize - 1) / disc->blocksize;
+
+		buffer = malloc((size_t)blocks * disc->blocksize);
+		if (!buffer)
+		{
+			fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+		if (udf_read_blocks(ex->medium, disc, extents[i].partition, extents[i].block, blocks, buffer) < 0)
+		{
+			free(buffer);
+			free(extents);
+			free(data);
+			return NULL;
+		}
+		memcpy(data + extents[i].offset, buffer, bytes);
+		free(buffer);
+	}
+
+	free(extents);
+	return data;
+}
+
+static int decode_name(struct extract *ex, const struct fileIdentDesc *fid, char *name, size_t size)
+{
+	const dchars *ident = fid->impUseAndFileIdent + le16_to_cpu(fid->lengthOfImpUse);
+	size_t len;
+
+	if (fid->lengthFileIdent == 0)
+		return -1;
+
+	if (ex->disc->flags & FLAG_UTF8)
+		len = decode_utf8(ident, name, fid->lengthFileIdent, size - 1);
+	else
+		len = decode_locale(ident, name, fid->lengthFileIdent, size - 1);
+	if (len == (size_t)-1 || len == 0)
+		return -1;
+	name[len] = 0;
+
+	// Only names which stay inside of the directory
+	if (strlen(name) != len || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return -1;
+
+	return 0;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+
+	if (!path)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	memcpy(path, dir, dir_len);
+	path[dir_len] = '/';
+	memcpy(path + dir_len + 1, name, name_len + 1);
+	return path;
+}
+
+static void finish_file(struct extract *ex, struct extract_file *file, int fd)
+{
+	if (fchmod(fd, file->mode) != 0 || futimens(fd, file->times) != 0)
+		fprintf(stderr, "%s: Warning: Cannot set attributes of '%s': %s\n", appname, file->path, strerror(errno));
+	if (close(fd) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot write '%s': %s\n", appname, file->path, strerror(errno));
+		ex->errors++;
+	}
+}
+
+static void extract_regular(struct extract *ex, const struct extract_icb *icb, char *path)
+{
+	struct udf_disc *disc = ex->disc;
+	struct extract_extent *extents;
+	struct extract_file *file;
+	struct extract_piece *last;
+	size_t count, index, i;
+	uint64_t bytes, done, source;
+	uint32_t position, block, length;
+	ssize_t ret;
+	int fd;
+
+	ex->files = grow_array(ex->files, &ex->size_files, ex->num_files, sizeof(*ex->files));
+	index = ex->num_files;
+	file = &ex->files[index];
+	memset(file, 0, sizeof(*file));
+	file->path = path;
+	file->mode = icb_mode(icb->permissions, icb->flags);
+	file->fd = -1;
+	icb_time(icb->atime, &file->times[0]);
+	icb_time(icb->mtime, &file->times[1]);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot create '%s': %s\n", appname, path, strerror(errno));
+		ex->errors++;
+		return;
+	}
+	ex->num_files++;
+
+	if ((icb->flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB)
+	{
+		// Small file, data are stored directly in its ICB
+		length = icb->ads_length < icb->length ? icb->ads_length : icb->length;
+		for (done = 0; done < length; done += ret)
+		{
+			ret = write(fd, icb->ads + done, length - done);
+			if (ret < 0 && errno == EINTR)
+				ret = 0;
+			else if (ret <= 0)
+				break;
+		}
+		if (done != length || length != icb->length)
+		{
+			fprintf(stderr, "%s: Error: Cannot write '%s' completely\n", appname, path);
+			ex->errors++;
+		}
+		finish_file(ex, file, fd);
+		return;
+	}
+
+	if (ftruncate(fd, icb->length) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot extend '%s': %s\n", appname, path, strerror(errno));
+		ex->errors++;
+		close(fd);
+		return;
+	}
+
+	if (collect_extents(ex, icb, &extents, &count) < 0)
+	{
+		fprintf(stderr, "%s: Error: Allocation descriptors of '%s' are damaged\n", appname, path);
+		ex->errors++;
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		if (extents[i].offset >= icb->length)
+			break;
+		if (extents[i].type != EXT_RECORDED_ALLOCATED)
+			continue;
+
+		bytes = extents[i].length;
+		if (bytes > icb->length - extents[i].offset)
+			bytes = icb->length - extents[i].offset;
+
+		// Virtual and Sparable partitions need not be contiguous on medium
+		for (done = 0, block = extents[i].block; done < bytes; done += length, ++block)
+		{
+			length = bytes - done < disc->blocksize ? bytes - done : disc->blocksize;
+			position = udf_block_position(disc, extents[i].partition, block);
+			if (position == UINT32_MAX)
+			{
+				fprintf(stderr, "%s: Error: Block %"PRIu32" of '%s' cannot be mapped\n", appname, block, path);
+				ex->errors++;
+				break;
+			}
+			source = (uint64_t)position * disc->blocksize;
+
+			last = file->pieces ? &ex->pieces[ex->num_pieces - 1] : NULL;
+			if (last && last->source + last->length == source && last->offset + last->length == extents[i].offset + done)
+			{
+				last->length += length;
+				continue;
+			}
+
+			ex->pieces = grow_array(ex->pieces, &ex->size_pieces, ex->num_pieces, sizeof(*ex->pieces));
+			ex->pieces[ex->num_pieces].source = source;
+			ex->pieces[ex->num_pieces].offset = extents[i].offset + done;
+			ex->pieces[ex->num_pieces].length = length;
+			ex->pieces[ex->num_pieces].file = index;
+			ex->num_pieces++;
+			file->pieces++;
+		}
+	}
+	free(extents);
+
+	// Attributes are set when the last piece is written
+	if (file->pieces == 0)
+		finish_file(ex, file, fd);
+	else if (close(fd) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot write '%s': %s\n", appname, path, strerror(errno));
+		ex->errors++;
+	}
+}
+
+static void extract_symlink(struct extract *ex, const struct extract_icb *icb, const char *path)
+{
+	uint8_t *data = read_data(ex, icb);
+	char *target;
+	size_t len = 0, pos;
+	uint8_t type, length;
+
+	if (!data)
+	{
+		fprintf(stderr, "%s: Error: Symbolic link '%s' cannot be read\n", appname, path);
+		ex->errors++;
+		return;
+	}
+
+	// Path Components (ECMA 167r3 4/14.16), each name is at most 255 bytes
+	target = malloc(icb->length * 4 + 2);
+	if (!target)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	for (pos = 0; pos + 4 <= icb->length; pos += 4 + length)
+	{
+		type = data[pos];
+		length = data[pos+1];
+		if (pos + 4 + length > icb->length)
+			break;
+
+		if (type == 1 || type == 2)
+		{
+			len = 0;
+			target[len++] = '/';
+			continue;
+		}
+
+		if (len && target[len-1] != '/')
+			target[len++] = '/';
+
+		if (type == 3)
+		{
+			memcpy(target + len, "..", 2);
+			len += 2;
+		}
+		else if (type == 4)
+			target[len++] = '.';
+		else if (type == 5 && length > 0)
+		{
+			size_t ret;
+
+			if (ex->disc->flags & FLAG_UTF8)
+				ret = decode_utf8(data + pos + 4, target + len, length, icb->length * 4 + 1 - len);
+			else
+				ret = decode_locale(data + pos + 4, target + len, length, icb->length * 4 + 1 - len);
+			if (ret == (size_t)-1)
+				break;
+			len += ret;
+		}
+	}
+	target[len] = 0;
+
+	if (pos != icb->length || len == 0)
+	{
+		fprintf(stderr, "%s: Error: Symbolic link '%s' is damaged\n", appname, path);
+		ex->errors++;
+	}
+	else if (symlink(target, path) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot create symbolic link '%s': %s\n", appname, path, strerror(errno));
+		ex->errors++;
+	}
+
+	free(target);
+	free(data);
+}
+
+static void extract_directory(struct extract *ex, struct extract_icb *icb, const char *path, unsigned int depth)
+{
+	struct extract_icb child;
+	struct fileIdentDesc *fid;
+	struct extract_file *dir;
+	uint8_t *data;
+	uint32_t pos, size, i;
+	char name[1024];
+	char *child_path;
+
+	ex->dirs = grow_array(ex->dirs, &ex->size_dirs, ex->num_dirs, sizeof(*ex->dirs));
+	dir = &ex->dirs[ex->num_dirs++];
+	memset(dir, 0, sizeof(*dir));
+	dir->path = strdup(path);
+	dir->mode = icb_mode(icb->permissions, icb->flags);
+	icb_time(icb->atime, &dir->times[0]);
+	icb_time(icb->mtime, &dir->times[1]);
+	if (!dir->path)
+	{
+		fprintf(stderr, "%s: Error: strdup failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	ex->ancestors[depth].partitionReferenceNum = icb->partition;
+	ex->ancestors[depth].logicalBlockNum = icb->block;
+
+	data = read_data(ex, icb);
+	if (!data)
+	{
+		fprintf(stderr, "%s: Error: Directory '%s' cannot be read\n", appname, path);
+		ex->errors++;
+		return;
+	}
+
+	for (pos = 0; pos + sizeof(*fid) <= icb->length; pos += size)
+	{
+		fid = (struct fileIdentDesc *)(data + pos);
+		size = (sizeof(*fid) + le16_to_cpu(fid->lengthOfImpUse) + fid->lengthFileIdent + 3) & ~3U;
+		if (le16_to_cpu(fid->descTag.tagIdent) != TAG_IDENT_FID || pos + size > icb->length)
+		{
+			fprintf(stderr, "%s: Error: Directory '%s' is damaged\n", appname, path);
+			ex->errors++;
+			break;
+		}
+
+		if (fid->fileCharacteristics & (FID_FILE_CHAR_DELETED | FID_FILE_CHAR_PARENT))
+			continue;
+
+		if (decode_name(ex, fid, name, sizeof(name)) < 0)
+		{
+			fprintf(stderr, "%s: Warning: Skipping file with unusable name in '%s'\n", appname, path);
+			ex->errors++;
+			continue;
+		}
+
+		child_path = join_path(path, name);
+		if (read_icb(ex, &fid->icb, &child) < 0)
+		{
+			fprintf(stderr, "%s: Error: File Entry of '%s' cannot be read\n", appname, child_path);
+			ex->errors++;
+			free(child_path);
+			continue;
+		}
+
+		switch (child.type)
+		{
+			case ICBTAG_FILE_TYPE_DIRECTORY:
+				for (i = 0; i <= depth; ++i)
+					if (ex->ancestors[i].partitionReferenceNum == child.partition && ex->ancestors[i].logicalBlockNum == child.block)
+						break;
+				if (i <= depth || depth + 1 >= EXTRACT_MAX_DEPTH)
+				{
+					fprintf(stderr, "%s: Error: Directory '%s' loops or is nested too deep\n", appname, child_path);
+					ex->errors++;
+				}
+				else if (mkdir(child_path, 0700) != 0 && errno != EEXIST)
+				{
+					fprintf(stderr, "%s: Error: Cannot create directory '%s': %s\n", appname, child_path, strerror(errno));
+					ex->errors++;
+				}
+				else
+					extract_directory(ex, &child, child_path, depth + 1);
+				free(child_path);
+				break;
+			case ICBTAG_FILE_TYPE_REGULAR:
+				extract_regular(ex, &child, child_path);
+				break;
+			case ICBTAG_FILE_TYPE_SYMLINK:
+				extract_symlink(ex, &child, child_path);
+				free(child_path);
+				break;
+			default:
+				fprintf(stderr, "%s: Warning: Skipping special file '%s'\n", appname, child_path);
+				free(child_path);
+				break;
+		}
+
+		free(child.buffer);
+	}
+
+	free(data);
+}
+
+static int copy_piece(struct extract *ex, const struct extract_piece *piece, int fd, int *copy_range, uint8_t **buffer)
+{
+	uint64_t done = 0;
+	size_t count;
+	ssize_t ret, written;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (*copy_range && done < piece->length)
+	{
+		loff_t in = piece->source + done;
+		loff_t out = piece->offset + done;
+
+		ret = copy_file_range(ex->medium->fd, &in, fd, &out, piece->length - done, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && done == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+		{
+			*copy_range = 0;
+			break;
+		}
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+#else
+	(void)copy_range;
+#endif
+
+	if (done < piece->length && !*buffer)
+	{
+		*buffer = malloc(EXTRACT_BUFFER_SIZE);
+		if (!*buffer)
+			return -1;
+	}
+
+	while (done < piece->length)
+	{
+		count = piece->length - done < EXTRACT_BUFFER_SIZE ? piece->length - done : EXTRACT_BUFFER_SIZE;
+		ret = pread(ex->medium->fd, *buffer, count, piece->source + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		for (count = 0; count < (size_t)ret; count += written)
+		{
+			written = pwrite(fd, *buffer + count, ret - count, piece->offset + done + count);
+			if (written < 0 && errno == EINTR)
+				written = 0;
+			else if (written <= 0)
+				return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static void *copy_thread(void *arg)
+{
+	struct extract *ex = arg;
+	struct extract_piece *piece;
+	struct extract_file *file;
+	uint8_t *buffer = NULL;
+	int copy_range = ex->copy_range;
+	int fd;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&ex->lock);
+		if (ex->next >= ex->num_pieces)
+		{
+			pthread_mutex_unlock(&ex->lock);
+			break;
+		}
+		piece = &ex->pieces[ex->next++];
+		file = &ex->files[piece->file];
+		if (file->fd == -1)
+		{
+			file->fd = open(file->path, O_WRONLY);
+			if (file->fd < 0)
+			{
+				fprintf(stderr, "%s: Error: Cannot open '%s': %s\n", appname, file->path, strerror(errno));
+				ex->errors++;
+				file->fd = -2;
+			}
+		}
+		fd = file->fd;
+		pthread_mutex_unlock(&ex->lock);
+
+		if (fd >= 0 && copy_piece(ex, piece, fd, &copy_range, &buffer) < 0)
+		{
+			pthread_mutex_lock(&ex->lock);
+			fprintf(stderr, "%s: Error: Cannot copy data of '%s': %s\n", appname, file->path, strerror(errno));
+			ex->errors++;
+			pthread_mutex_unlock(&ex->lock);
+		}
+
+		pthread_mutex_lock(&ex->lock);
+		if (--file->pieces == 0 && file->fd >= 0)
+		{
+			finish_file(ex, file, file->fd);
+			file->fd = -1;
+		}
+		pthread_mutex_unlock(&ex->lock);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static int cmp_piece(const void *a, const void *b)
+{
+	const struct extract_piece *pa = a;
+	const struct extract_piece *pb = b;
+
+	if (pa->source != pb->source)
+		return pa->source < pb->source ? -1 : 1;
+	return 0;
+}
+
+/**
+ * @brief Copy whole file tree of UDF disc into directory
+ * @param medium medium access
+ * @param disc disc read by udf_read_disc()
+ * @param directory destination directory, created when it does not exist
+ * @param jobs number of threads copying file data
+ * @return 0 when everything was copied, 1 otherwise
+ */
+int extract_tree(struct udf_medium *medium, struct udf_disc *disc, const char *directory, unsigned int jobs)
+{
+	struct extract ex;
+	struct extract_icb root;
+	struct stat st;
+	pthread_t *threads;
+	unsigned int started, i;
+	size_t j;
+
+	memset(&ex, 0, sizeof(ex));
+	ex.medium = medium;
+	ex.disc = disc;
+	ex.copy_range = fstat(medium->fd, &st) == 0 && S_ISREG(st.st_mode);
+	pthread_mutex_init(&ex.lock, NULL);
+
+	if (mkdir(directory, 0700) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "%s: Error: Cannot create directory '%s': %s\n", appname, directory, strerror(errno));
+		return 1;
+	}
+
+	if (read_icb(&ex, &disc->udf_fsd->rootDirectoryICB, &root) < 0 || root.type != ICBTAG_FILE_TYPE_DIRECTORY)
+	{
+		fprintf(stderr, "%s: Error: Root directory cannot be read\n", appname);
+		free(root.buffer);
+		return 1;
+	}
+
+	extract_directory(&ex, &root, directory, 0);
+	free(root.buffer);
+
+	qsort(ex.pieces, ex.num_pieces, sizeof(*ex.pieces), cmp_piece);
+
+	if (jobs > ex.num_pieces)
+		jobs = ex.num_pieces;
+
+	threads = calloc(jobs ? jobs : 1, sizeof(*threads));
+	if (!threads)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	for (started = 0; started < jobs; ++started)
+		if (pthread_create(&threads[started], NULL, copy_thread, &ex) != 0)
+			break;
+	if (started == 0)
+		copy_thread(&ex);
+	for (i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	// Directories get their attributes last, creating their entries changed them
+	for (j = ex.num_dirs; j > 0; --j)
+	{
+		if (chmod(ex.dirs[j-1].path, ex.dirs[j-1].mode) != 0 || utimensat(AT_FDCWD, ex.dirs[j-1].path, ex.dirs[j-1].times, 0) != 0)
+			fprintf(stderr, "%s: Warning: Cannot set attributes of '%s': %s\n", appname, ex.dirs[j-1].path, strerror(errno));
+		free(ex.dirs[j-1].path);
+	}
+
+	for (j = 0; j < ex.num_files; ++j)
+		free(ex.files[j].path);
+	free(ex.files);
+	free(ex.pieces);
+	free(ex.dirs);
+	pthread_mutex_destroy(&ex.lock);
+
+	return ex.errors ? 1 : 0;
+}
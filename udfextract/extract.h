@@ -1,6 +1,4 @@
 /*
- * Copyright (C) 2017  Pali Rohár <pali.rohar@gmail.com>
- *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
@@ -16,11 +14,15 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-#ifndef READDISC_H
-#define READDISC_H
+
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#define EXTRACT_JOBS		4
 
 struct udf_disc;
+struct udf_medium;
 
-int read_disc(int, struct udf_disc *);
+int extract_tree(struct udf_medium *, struct udf_disc *, const char *, unsigned int);
 
-#endif /* READDISC_H */
+#endif /* EXTRACT_H */
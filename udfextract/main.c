@@ -0,0 +1,148 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "libudffs.h"
+#include "options.h"
+#include "extract.h"
+
+static uint64_t get_size(int fd)
+{
+	struct stat st;
+	uint64_t size;
+	off_t offset;
+
+	if (fstat(fd, &st) == 0)
+	{
+		if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == 0)
+			return size;
+		else if (S_ISREG(st.st_mode))
+			return st.st_size;
+	}
+
+	offset = lseek(fd, 0, SEEK_END);
+	if (offset == (off_t)-1)
+	{
+		fprintf(stderr, "%s: Error: Cannot detect size of disk: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	if (lseek(fd, 0, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot seek to start of disk: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	return offset;
+}
+
+static int get_sector_size(int fd)
+{
+	int size;
+
+	if (ioctl(fd, BLKSSZGET, &size) != 0)
+		return 0;
+
+	if (size < 512 || size > 32768 || (size & (size - 1)))
+	{
+		fprintf(stderr, "%s: Warning: Disk logical sector size (%d) is not suitable for UDF\n", appname, size);
+		return 0;
+	}
+
+	return size;
+}
+
+int main(int argc, char *argv[])
+{
+	struct udf_disc disc;
+	struct udf_medium medium;
+	char *filename;
+	char *directory;
+	unsigned int jobs = EXTRACT_JOBS;
+	int ret;
+	int fd;
+
+	setlocale(LC_CTYPE, "");
+	appname = "udfextract";
+
+	if (udf_trace_start(appname) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot enable trace: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	memset(&disc, 0, sizeof(disc));
+
+	disc.head = calloc(1, sizeof(struct udf_extent));
+	if (!disc.head)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	disc.flags = FLAG_LOCALE;
+	disc.tail = disc.head;
+	disc.head->space_type = USPACE;
+
+	parse_args(argc, argv, &disc, &filename, &directory, &jobs);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot open device '%s': %s\n", appname, filename, strerror(errno));
+		exit(1);
+	}
+
+	disc.blksize = get_size(fd);
+	disc.blkssz = get_sector_size(fd);
+
+	udf_medium_init(&medium, fd, UDF_MEDIUM_IO_PREAD, 0);
+	if (udf_read_disc(&medium, &disc) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot process device '%s' as UDF disk\n", appname, filename);
+		exit(1);
+	}
+
+	if (!disc.udf_fsd)
+	{
+		fprintf(stderr, "%s: Error: File Set Descriptor of device '%s' cannot be read\n", appname, filename);
+		exit(1);
+	}
+
+	ret = extract_tree(&medium, &disc, directory, jobs);
+
+	udf_medium_free(&medium);
+	close(fd);
+
+	return ret;
+}
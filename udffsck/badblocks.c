@@ -0,0 +1,547 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Error tolerant reading of degraded media
+ *
+ * Unreadable sector in mmap()ed window raises SIGBUS on first access. The
+ * handler replaces the faulting page by anonymous page, fills it by pread()
+ * and returns, so the access is repeated on the new page. Windows read by
+ * pread or io_uring backend are refilled by the same way when the read fails.
+ *
+ * Range which cannot be read is split in halves down to sectors. Sector is
+ * read again BADBLOCKS_RETRIES times, with O_DIRECT when the medium allows it
+ * so neighbouring sectors of one page are not lost together. Sector which
+ * stays unreadable is zeroed and recorded in the map, descriptors there fail
+ * their tag checks and are reported as unreadable.
+ *
+ * In fix modes recovered pages are private to the process, so msync() does
+ * not write in-place fixes made there. Such pages are tracked with hash of
+ * their content and badblocks_sync() writes changed ones by pwrite(), except
+ * unreadable sectors. Descriptors written by repair transaction are copied
+ * into tracked pages by badblocks_refresh() so they are not read stale.
+ *
+ * Recovery runs in signal handler, so it only uses system calls and memory
+ * prepared by badblocks_init(). One recovery runs at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "badblocks.h"
+#include "log.h"
+#include "options.h"
+
+#define BADBLOCKS_DIRECT_SIZE 4096 ///< Largest sector read with O_DIRECT
+
+struct badblock_range {
+    uint64_t start;     ///< position on medium in bytes
+    uint64_t length;    ///< length in bytes
+};
+
+struct badblock_page {
+    uint8_t *addr;      ///< page in medium window
+    uint64_t position;  ///< position on medium in bytes
+    uint32_t length;    ///< bytes of page on medium, shorter at end of medium
+    uint64_t hash;      ///< content as recovered or last written
+};
+
+static struct {
+    udf_media_t *media;
+    int directfd;           ///< medium opened with O_DIRECT, -1 when not supported
+    uint8_t *direct;        ///< aligned buffer for O_DIRECT reads
+    long pagesize;
+    char lock;
+    uint32_t count;
+    uint32_t dropped;       ///< ranges which did not fit into map
+    uint64_t bytes;
+    struct badblock_range ranges[BADBLOCKS_MAX];
+    uint32_t numPages;
+    struct badblock_page pages[BADBLOCKS_PAGES]; ///< recovered pages of writable windows
+    struct sigaction fallback; ///< handler of SIGBUS outside of medium windows
+} bad = { .directfd = -1 };
+
+static void bad_lock(void) {
+    struct timespec pause = { 0, 100000 };
+
+    while(__atomic_test_and_set(&bad.lock, __ATOMIC_ACQUIRE))
+        nanosleep(&pause, NULL);
+}
+
+static void bad_unlock(void) {
+    __atomic_clear(&bad.lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Index of the first range which ends after position, called with lock held
+ */
+static uint32_t find(uint64_t position) {
+    uint32_t lo = 0, hi = bad.count;
+
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(bad.ranges[mid].start + bad.ranges[mid].length <= position)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * \brief Test whether sector is already in map, called with lock held
+ */
+static int recorded(uint64_t start, uint64_t length) {
+    uint32_t i = find(start);
+
+    return i < bad.count && bad.ranges[i].start <= start
+           && bad.ranges[i].start + bad.ranges[i].length >= start + length;
+}
+
+/**
+ * \brief Add sector to map, called with lock held
+ *
+ * Ranges are kept sorted and adjacent ones are merged. Sectors of windows
+ * read again are found in map already and not counted twice.
+ */
+static void record(uint64_t start, uint64_t length) {
+    uint32_t i = bad.count;
+
+    if(i > 0 && bad.ranges[i - 1].start + bad.ranges[i - 1].length == start) {
+        bad.ranges[i - 1].length += length;
+        bad.bytes += length;
+        return;
+    }
+    if(recorded(start, length))
+        return;
+    bad.bytes += length;
+    while(i > 0 && bad.ranges[i - 1].start > start)
+        i--;
+    if(i > 0 && bad.ranges[i - 1].start + bad.ranges[i - 1].length == start) {
+        bad.ranges[i - 1].length += length;
+        return;
+    }
+    if(i < bad.count && start + length == bad.ranges[i].start) {
+        bad.ranges[i].start = start;
+        bad.ranges[i].length += length;
+        return;
+    }
+    if(bad.count == BADBLOCKS_MAX) {
+        bad.dropped++;
+        return;
+    }
+    memmove(&bad.ranges[i + 1], &bad.ranges[i], (bad.count - i) * sizeof(bad.ranges[0]));
+    bad.ranges[i].start = start;
+    bad.ranges[i].length = length;
+    bad.count++;
+}
+
+/**
+ * \return 0 whole range read
+ * \return 1 read error
+ * \return -1 medium ends before end of range
+ */
+static int read_full(int fd, uint8_t *buf, size_t length, uint64_t position) {
+    while(length > 0) {
+        ssize_t ret = pread(fd, buf, length, (off_t)position);
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            return 1;
+        }
+        if(ret == 0)
+            return -1;
+        buf += ret;
+        length -= (size_t)ret;
+        position += (uint64_t)ret;
+    }
+    return 0;
+}
+
+static int read_sector(uint8_t *buf, size_t length, uint64_t position) {
+    int ret;
+
+    if(bad.directfd >= 0 && length <= BADBLOCKS_DIRECT_SIZE && length % 512 == 0 && position % 512 == 0) {
+        ret = read_full(bad.directfd, bad.direct, length, position);
+        if(ret == 0)
+            memcpy(buf, bad.direct, length);
+        return ret;
+    }
+    return read_full(bad.media->fd, buf, length, position);
+}
+
+/**
+ * \brief Read range, bisecting failed parts down to sectors, called with lock held
+ */
+static int recover(uint8_t *buf, size_t length, uint64_t position, uint32_t sectorsize) {
+    size_t half;
+    int ret;
+
+    ret = read_full(bad.media->fd, buf, length, position);
+    if(ret <= 0)
+        return ret;
+
+    if(length <= sectorsize) {
+        // Sector given up before is not retried when its window is read again
+        for(int retry = 0; retry < BADBLOCKS_RETRIES && !recorded(position, length); retry++) {
+            ret = read_sector(buf, length, position);
+            if(ret <= 0)
+                return ret;
+        }
+        memset(buf, 0, length);
+        record(position, length);
+        return 0;
+    }
+
+    half = MAX(sectorsize, length / 2 / sectorsize * sectorsize);
+    ret = recover(buf, half, position, sectorsize);
+    if(ret < 0)
+        return ret;
+    return recover(buf + half, length - half, position + half, sectorsize);
+}
+
+/**
+ * \brief FNV-1a hash of page content, tells whether page was modified
+ */
+static uint64_t page_hash(const uint8_t *buf, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for(size_t i = 0; i < length; i++)
+        hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+static int write_full(int fd, const uint8_t *buf, size_t length, uint64_t position) {
+    while(length > 0) {
+        ssize_t ret = pwrite(fd, buf, length, (off_t)position);
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        buf += ret;
+        length -= (size_t)ret;
+        position += (uint64_t)ret;
+    }
+    return 0;
+}
+
+static uint32_t sector_size(udf_media_t *media) {
+    return media->sectorsize > 0 ? (uint32_t)media->sectorsize : 512;
+}
+
+/**
+ * \brief Read range of medium, unreadable sectors are zeroed and recorded
+ *
+ * \param[in]  media    medium
+ * \param[out] buf      destination
+ * \param[in]  length   number of bytes, range must lie within medium
+ * \param[in]  position position on medium in bytes
+ *
+ * \return 0 range is read, possibly with zeroed sectors
+ * \return -1 medium is shorter than expected
+ */
+int badblocks_read(udf_media_t *media, uint8_t *buf, size_t length, uint64_t position) {
+    int ret;
+
+    bad_lock();
+    ret = recover(buf, length, position, sector_size(media));
+    bad_unlock();
+    return ret;
+}
+
+/**
+ * \brief Bus error handler of degraded medium
+ *
+ * Faulting page of medium window is replaced by anonymous page with content
+ * read by pread(). Other bus errors go to handler installed before.
+ */
+static void sigbus_handler(int sig, siginfo_t *info, void *context) {
+    udf_media_t *media = bad.media;
+    uint8_t *addr = (uint8_t *)info->si_addr;
+    uint8_t *page, *window = NULL;
+    uint32_t count = (uint32_t)((media->devsize + media->chunksize - 1) / media->chunksize);
+    uint64_t position = 0;
+    size_t length;
+    int ret;
+
+    for(uint32_t i = 0; i < count; i++) {
+        window = __atomic_load_n(&media->mapping[i], __ATOMIC_RELAXED);
+        if(window != NULL && addr >= window && addr < window + media->chunksize) {
+            position = (uint64_t)(i) * media->chunksize;
+            break;
+        }
+        window = NULL;
+    }
+
+    page = (uint8_t *)((uintptr_t)addr & ~(uintptr_t)(bad.pagesize - 1));
+    position += (uint64_t)(page - window);
+    if(window == NULL || position >= media->devsize)
+        goto fallback;
+
+    if(mmap(page, bad.pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+        goto fallback;
+
+    length = MIN((uint64_t)bad.pagesize, media->devsize - position);
+    bad_lock();
+    ret = recover(page, length, position, sector_size(media));
+    // Fixes in untracked page would be lost, it is handled as before
+    if(ret == 0 && (interactive || autofix)) {
+        if(bad.numPages < BADBLOCKS_PAGES) {
+            bad.pages[bad.numPages].addr = page;
+            bad.pages[bad.numPages].position = position;
+            bad.pages[bad.numPages].length = (uint32_t)length;
+            bad.pages[bad.numPages].hash = page_hash(page, length);
+            bad.numPages++;
+        } else {
+            ret = -1;
+        }
+    }
+    bad_unlock();
+    if(ret < 0)
+        goto fallback;
+
+    if(!interactive && !autofix)
+        mprotect(page, bad.pagesize, PROT_READ);
+    return;
+
+fallback:
+    if(bad.fallback.sa_flags & SA_SIGINFO)
+        bad.fallback.sa_sigaction(sig, info, context);
+    else if(bad.fallback.sa_handler != SIG_IGN && bad.fallback.sa_handler != SIG_DFL)
+        bad.fallback.sa_handler(sig);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/**
+ * \brief Prepare error tolerant reading and take over SIGBUS
+ *
+ * Requires media->fd, media->devsize and block cache to be set up. Handler
+ * of SIGBUS installed before is kept for bus errors outside of medium.
+ *
+ * \return 0 on success, -1 when handler cannot be installed
+ */
+int badblocks_init(udf_media_t *media) {
+    struct sigaction action;
+    char path[64];
+
+    bad.media = media;
+    bad.pagesize = sysconf(_SC_PAGESIZE);
+    bad.count = 0;
+    bad.dropped = 0;
+    bad.bytes = 0;
+    bad.numPages = 0;
+
+    // Sector granular retries need O_DIRECT, page cache reads whole pages
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", media->fd);
+    bad.directfd = open(path, O_RDONLY | O_DIRECT);
+    if(bad.directfd >= 0 && posix_memalign((void **)&bad.direct, BADBLOCKS_DIRECT_SIZE, BADBLOCKS_DIRECT_SIZE) != 0) {
+        close(bad.directfd);
+        bad.directfd = -1;
+    }
+    dbg("O_DIRECT retries: %s\n", bad.directfd >= 0 ? "yes" : "no");
+
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO;
+    action.sa_sigaction = sigbus_handler;
+    return sigaction(SIGBUS, &action, &bad.fallback);
+}
+
+/**
+ * \brief Restore SIGBUS handler and close O_DIRECT descriptor
+ */
+void badblocks_free(void) {
+    if(bad.media == NULL)
+        return;
+    sigaction(SIGBUS, &bad.fallback, NULL);
+    if(bad.directfd >= 0)
+        close(bad.directfd);
+    bad.directfd = -1;
+    free(bad.direct);
+    bad.direct = NULL;
+    bad.media = NULL;
+}
+
+/**
+ * \brief Write bytes \p start to \p end of recovered page, called with lock held
+ */
+static int write_run(udf_media_t *media, struct badblock_page *p, uint32_t start, uint32_t end) {
+    if(start >= end || write_full(media->fd, p->addr + start, end - start, p->position + start) == 0)
+        return 0;
+    err("Error writing fix of sector %" PRIu64 ": %s.\n", (p->position + start) / sector_size(media), strerror(errno));
+    return -1;
+}
+
+/**
+ * \brief Write in-place fixes of recovered pages in window
+ *
+ * msync() skips recovered pages, changed ones are written here. Unreadable
+ * sectors are not written, fix made there is reported and left undone.
+ *
+ * \param[in] media  medium
+ * \param[in] window mapped window
+ * \param[in] size   length of window
+ *
+ * \return 0 all fixes written
+ * \return -1 write failed or fix lies in unreadable sector
+ */
+int badblocks_sync(udf_media_t *media, uint8_t *window, uint32_t size) {
+    uint32_t sectorsize = sector_size(media);
+    int ret = 0;
+
+    if(__atomic_load_n(&bad.numPages, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    bad_lock();
+    for(uint32_t i = 0; i < bad.numPages; i++) {
+        struct badblock_page *p = &bad.pages[i];
+        uint64_t hash;
+        uint32_t run = 0;
+
+        if(p->addr < window || p->addr >= window + size)
+            continue;
+        hash = page_hash(p->addr, p->length);
+        if(hash == p->hash)
+            continue;
+
+        // Readable sectors are written in runs, unreadable ones stay as they are
+        for(uint32_t offset = 0, len; offset < p->length; offset += len) {
+            len = MIN(sectorsize, p->length - offset);
+            if(!recorded(p->position + offset, len))
+                continue;
+            if(write_run(media, p, run, offset) != 0)
+                ret = -1;
+            run = offset + len;
+            for(uint32_t j = 0; j < len; j++) {
+                if(p->addr[offset + j] != 0) {
+                    err("Fix of unreadable sector %" PRIu64 " is not written.\n", (p->position + offset) / sectorsize);
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+        if(write_run(media, p, run, p->length) != 0)
+            ret = -1;
+        p->hash = hash;
+    }
+    bad_unlock();
+    return ret;
+}
+
+/**
+ * \brief Forget recovered pages of window which is going to be unmapped
+ */
+void badblocks_unmap(uint8_t *window, uint32_t size) {
+    if(__atomic_load_n(&bad.numPages, __ATOMIC_RELAXED) == 0)
+        return;
+
+    bad_lock();
+    for(uint32_t i = 0; i < bad.numPages; ) {
+        if(bad.pages[i].addr >= window && bad.pages[i].addr < window + size)
+            bad.pages[i] = bad.pages[--bad.numPages];
+        else
+            i++;
+    }
+    bad_unlock();
+}
+
+/**
+ * \brief Copy data written to medium by pwrite() into recovered pages
+ *
+ * Shared mappings see such writes, recovered pages would keep old content.
+ */
+void badblocks_refresh(const uint8_t *buf, size_t length, uint64_t position) {
+    if(__atomic_load_n(&bad.numPages, __ATOMIC_RELAXED) == 0)
+        return;
+
+    bad_lock();
+    for(uint32_t i = 0; i < bad.numPages; i++) {
+        struct badblock_page *p = &bad.pages[i];
+        uint64_t start = MAX(position, p->position);
+        uint64_t end = MIN(position + length, p->position + p->length);
+
+        if(start >= end)
+            continue;
+        memcpy(p->addr + (start - p->position), buf + (start - position), end - start);
+        p->hash = page_hash(p->addr, p->length);
+    }
+    bad_unlock();
+}
+
+/**
+ * \brief Test whether range of medium overlaps unreadable range
+ *
+ * Range must be accessed before, unreadable sectors are found on access.
+ */
+int badblocks_contains(uint64_t position, uint64_t length) {
+    uint32_t i;
+    int found;
+
+    // Sector found by this thread is already counted, others do not matter yet
+    if(__atomic_load_n(&bad.count, __ATOMIC_RELAXED) == 0 && __atomic_load_n(&bad.dropped, __ATOMIC_RELAXED) == 0)
+        return 0;
+
+    bad_lock();
+    i = find(position);
+    found = i < bad.count && bad.ranges[i].start < position + length;
+    bad_unlock();
+    return found;
+}
+
+uint32_t badblocks_ranges(void) {
+    return bad.count + bad.dropped;
+}
+
+uint64_t badblocks_bytes(void) {
+    return bad.bytes;
+}
+
+/**
+ * \brief Print unreadable ranges in sectors of medium
+ */
+void badblocks_print(udf_media_t *media) {
+    uint32_t sectorsize = sector_size(media);
+
+    if(bad.bytes == 0)
+        return;
+    err("Unreadable medium: %" PRIu64 " bytes in %u ranges were read as zeros.\n", bad.bytes, badblocks_ranges());
+    for(uint32_t i = 0; i < bad.count && i < BADBLOCKS_PRINT; i++) {
+        err("  sectors %" PRIu64 " - %" PRIu64 "\n", bad.ranges[i].start / sectorsize,
+            (bad.ranges[i].start + bad.ranges[i].length - 1) / sectorsize);
+    }
+    if(badblocks_ranges() > BADBLOCKS_PRINT)
+        err("  ... %u more ranges\n", badblocks_ranges() - BADBLOCKS_PRINT);
+}
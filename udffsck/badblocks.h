@@ -0,0 +1,43 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __BADBLOCKS_H__
+#define __BADBLOCKS_H__
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "udffsck.h"
+
+#define BADBLOCKS_MAX       4096 ///< Unreadable ranges kept in map, further ones are only counted
+#define BADBLOCKS_RETRIES   2    ///< Repeated reads of sector which failed, before it is given up
+#define BADBLOCKS_PRINT     64   ///< Ranges listed in summary
+#define BADBLOCKS_PAGES     4096 ///< Recovered pages of writable windows kept mapped at once
+
+// Map of unreadable ranges of medium, read as zeros
+int badblocks_init(udf_media_t *media);
+void badblocks_free(void);
+int badblocks_read(udf_media_t *media, uint8_t *buf, size_t length, uint64_t position);
+int badblocks_sync(udf_media_t *media, uint8_t *window, uint32_t size);
+void badblocks_unmap(uint8_t *window, uint32_t size);
+void badblocks_refresh(const uint8_t *buf, size_t length, uint64_t position);
+int badblocks_contains(uint64_t position, uint64_t length);
+uint32_t badblocks_ranges(void);
+uint64_t badblocks_bytes(void);
+void badblocks_print(udf_media_t *media);
+
+#endif //__BADBLOCKS_H__
@@ -0,0 +1,519 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Word-wide range operations on space bitmaps
+ *
+ * Ranges are split into a partial head byte, whole bytes processed 64 bits
+ * at a time and a partial tail byte. Whole bytes are counted by the shared
+ * udf_popcount() kernels of libudffs. Words are loaded as little endian, so
+ * bit n of a loaded 64-bit word is bit n%8 of its byte n/8, as in the UDF
+ * space bitmap.
+ *
+ * struct page_bitmap keeps the same bitmap in pages of BITMAP_PAGE_BYTES.
+ * Pages whose bits are all set or all cleared are not allocated, so actual
+ * bitmap of a mostly contiguous partition takes a fraction of its size.
+ * Under memory limit only one window of pages is kept at a time; changes
+ * are appended to a temporary spill file and replayed for each window.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include "libudffs.h"
+#include "bitmap.h"
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64_to_cpu(v);
+}
+
+/**
+ * \brief Mask of bits [from, to) within one byte
+ */
+static inline uint8_t byte_mask(uint32_t from, uint32_t to) {
+    return (uint8_t)(((1U << to) - 1) & ~((1U << from) - 1));
+}
+
+/**
+ * \brief Count set bits in range
+ *
+ * \param[in] bitmap bitmap
+ * \param[in] start  first bit of range
+ * \param[in] length amount of bits in range
+ *
+ * \return amount of set bits
+ */
+uint32_t bitmap_count(const uint8_t *bitmap, uint32_t start, uint32_t length) {
+    uint64_t end = (uint64_t)start + length;
+    uint32_t count = 0;
+
+    if(length == 0)
+        return 0;
+
+    if(start % 8) {
+        uint32_t to = (end - (start & ~7U) < 8) ? (uint32_t)(end - (start & ~7U)) : 8;
+        count += __builtin_popcount(bitmap[start / 8] & byte_mask(start % 8, to));
+        start = (start & ~7U) + to;
+        if(start >= end)
+            return count;
+    }
+
+    const uint8_t *p = bitmap + start / 8;
+    uint32_t bytes = (uint32_t)((end - start) / 8);
+    count += (uint32_t)udf_popcount(p, bytes);
+
+    if((end - start) % 8)
+        count += __builtin_popcount(p[bytes] & byte_mask(0, (uint32_t)((end - start) % 8)));
+
+    return count;
+}
+
+/**
+ * \brief Count bits which differ between two bitmaps
+ *
+ * \param[in] a      first bitmap
+ * \param[in] b      second bitmap
+ * \param[in] length amount of bits to compare, starting from bit 0
+ *
+ * \return amount of differing bits
+ */
+uint32_t bitmap_count_diff(const uint8_t *a, const uint8_t *b, uint32_t length) {
+    uint32_t bytes = length / 8;
+    uint32_t count = (uint32_t)udf_popcount_xor(a, b, bytes);
+
+    if(length % 8)
+        count += __builtin_popcount((a[bytes] ^ b[bytes]) & byte_mask(0, length % 8));
+
+    return count;
+}
+
+/**
+ * \brief Find first bit of given value in range
+ *
+ * \param[in] bitmap bitmap
+ * \param[in] start  first bit of range
+ * \param[in] end    bit after range
+ * \param[in] value  0 to search for cleared bit, otherwise for set bit
+ *
+ * \return position of found bit, \p end if there is none
+ */
+uint32_t bitmap_find(const uint8_t *bitmap, uint32_t start, uint32_t end, int value) {
+    uint8_t inv8 = value ? 0 : 0xFF;
+    uint64_t inv64 = value ? 0 : UINT64_MAX;
+
+    while(start < end && start % 8) {
+        if(((bitmap[start / 8] ^ inv8) >> (start % 8)) & 1)
+            return start;
+        start++;
+    }
+
+    while(start + 64 <= end) {
+        uint64_t w = load64(bitmap + start / 8) ^ inv64;
+        if(w)
+            return start + __builtin_ctzll(w);
+        start += 64;
+    }
+
+    while(start < end) {
+        uint8_t b = bitmap[start / 8] ^ inv8;
+        if(b) {
+            uint32_t pos = start + __builtin_ctz(b);
+            return pos < end ? pos : end;
+        }
+        start += 8;
+    }
+
+    return end;
+}
+
+static void bitmap_fill(uint8_t *bitmap, uint32_t start, uint32_t length, int value) {
+    uint64_t end = (uint64_t)start + length;
+
+    if(length == 0)
+        return;
+
+    if(start % 8) {
+        uint32_t to = (end - (start & ~7U) < 8) ? (uint32_t)(end - (start & ~7U)) : 8;
+        uint8_t mask = byte_mask(start % 8, to);
+        if(value)
+            bitmap[start / 8] |= mask;
+        else
+            bitmap[start / 8] &= ~mask;
+        start = (start & ~7U) + to;
+        if(start >= end)
+            return;
+    }
+
+    uint32_t bytes = (uint32_t)((end - start) / 8);
+    memset(bitmap + start / 8, value ? 0xFF : 0x00, bytes);
+
+    if((end - start) % 8) {
+        uint8_t mask = byte_mask(0, (uint32_t)((end - start) % 8));
+        if(value)
+            bitmap[start / 8 + bytes] |= mask;
+        else
+            bitmap[start / 8 + bytes] &= ~mask;
+    }
+}
+
+/**
+ * \brief Set all bits in range
+ */
+void bitmap_set(uint8_t *bitmap, uint32_t start, uint32_t length) {
+    bitmap_fill(bitmap, start, length, 1);
+}
+
+/**
+ * \brief Clear all bits in range
+ */
+void bitmap_clear(uint8_t *bitmap, uint32_t start, uint32_t length) {
+    bitmap_fill(bitmap, start, length, 0);
+}
+
+/**
+ * \brief Change of paged bitmap recorded in spill file
+ */
+struct page_bitmap_change {
+    uint32_t start;
+    uint32_t length;
+    uint8_t value;
+};
+
+static inline uint32_t page_bits(const struct page_bitmap *pb, uint32_t page) {
+    uint32_t first = page * BITMAP_PAGE_BITS;
+
+    return (pb->numBits - first < BITMAP_PAGE_BITS) ? pb->numBits - first : BITMAP_PAGE_BITS;
+}
+
+static void page_drop(struct page_bitmap *pb, uint32_t page, uint8_t fill) {
+    if(pb->pages[page] != NULL) {
+        free(pb->pages[page]);
+        pb->pages[page] = NULL;
+        pb->memory -= BITMAP_PAGE_BYTES;
+    }
+    pb->fill[page] = fill;
+}
+
+static int page_alloc(struct page_bitmap *pb, uint32_t page) {
+    uint8_t *bits = malloc(BITMAP_PAGE_BYTES);
+
+    if(bits == NULL)
+        return -1;
+    memset(bits, pb->fill[page], BITMAP_PAGE_BYTES);
+    pb->pages[page] = bits;
+    pb->ones[page] = pb->fill[page] ? page_bits(pb, page) : 0;
+    pb->memory += BITMAP_PAGE_BYTES;
+    return 0;
+}
+
+/**
+ * \brief Create paged bitmap with all bits set
+ *
+ * \return 0 on success, -1 when heap allocation failed
+ */
+int page_bitmap_init(struct page_bitmap *pb, uint32_t numBits) {
+    memset(pb, 0, sizeof(*pb));
+    pb->numBits = numBits;
+    pb->numPages = (uint32_t)(((uint64_t)numBits + BITMAP_PAGE_BITS - 1) / BITMAP_PAGE_BITS);
+    pb->windowEnd = numBits;
+    pb->pages = calloc(pb->numPages + 1, sizeof(*pb->pages));
+    pb->ones = calloc(pb->numPages + 1, sizeof(*pb->ones));
+    pb->fill = malloc(pb->numPages + 1);
+    if(pb->pages == NULL || pb->ones == NULL || pb->fill == NULL) {
+        page_bitmap_free(pb);
+        return -1;
+    }
+    memset(pb->fill, 0xFF, pb->numPages + 1);
+    return 0;
+}
+
+/**
+ * \brief Free pages and spill file of paged bitmap
+ */
+void page_bitmap_free(struct page_bitmap *pb) {
+    if(pb->pages != NULL) {
+        for(uint32_t i = 0; i < pb->numPages; i++)
+            free(pb->pages[i]);
+    }
+    free(pb->pages);
+    free(pb->ones);
+    free(pb->fill);
+    if(pb->spill != NULL)
+        fclose(pb->spill);
+    memset(pb, 0, sizeof(*pb));
+}
+
+/**
+ * \brief Count set bits in range of paged bitmap
+ */
+uint32_t page_bitmap_count(const struct page_bitmap *pb, uint32_t start, uint32_t length) {
+    uint32_t count = 0;
+
+    while(length > 0) {
+        uint32_t page = start / BITMAP_PAGE_BITS;
+        uint32_t off = start % BITMAP_PAGE_BITS;
+        uint32_t n = MIN(length, page_bits(pb, page) - off);
+
+        if(pb->pages[page] == NULL)
+            count += pb->fill[page] ? n : 0;
+        else
+            count += bitmap_count(pb->pages[page], off, n);
+        start += n;
+        length -= n;
+    }
+    return count;
+}
+
+/**
+ * \brief Count bits which differ between range of paged bitmap and same range of bitmap \p b
+ */
+uint32_t page_bitmap_count_diff(const struct page_bitmap *pb, const uint8_t *b, uint32_t start, uint32_t length) {
+    uint32_t count = 0;
+
+    while(length > 0) {
+        uint32_t page = start / BITMAP_PAGE_BITS;
+        uint32_t off = start % BITMAP_PAGE_BITS;
+        uint32_t n = MIN(length, page_bits(pb, page) - off);
+
+        if(pb->pages[page] == NULL) {
+            uint32_t ones = bitmap_count(b, start, n);
+            count += pb->fill[page] ? n - ones : ones;
+        } else {
+            count += bitmap_count_diff(pb->pages[page] + off / 8, b + start / 8, n);
+        }
+        start += n;
+        length -= n;
+    }
+    return count;
+}
+
+/**
+ * \brief Find first bit of given value in range of paged bitmap
+ *
+ * \return position of found bit, \p end if there is none
+ */
+uint32_t page_bitmap_find(const struct page_bitmap *pb, uint32_t start, uint32_t end, int value) {
+    while(start < end) {
+        uint32_t page = start / BITMAP_PAGE_BITS;
+        uint32_t first = page * BITMAP_PAGE_BITS;
+        uint32_t last = MIN(end, first + page_bits(pb, page));
+
+        if(pb->pages[page] == NULL) {
+            if((pb->fill[page] != 0) == (value != 0))
+                return start;
+        } else {
+            uint32_t pos = bitmap_find(pb->pages[page], start - first, last - first, value);
+            if(pos < last - first)
+                return first + pos;
+        }
+        start = last;
+    }
+    return end;
+}
+
+static int page_bitmap_fill(struct page_bitmap *pb, uint32_t start, uint32_t length, int value) {
+    uint8_t fill = value ? 0xFF : 0x00;
+
+    while(length > 0) {
+        uint32_t page = start / BITMAP_PAGE_BITS;
+        uint32_t off = start % BITMAP_PAGE_BITS;
+        uint32_t bits = page_bits(pb, page);
+        uint32_t n = MIN(length, bits - off);
+
+        if(n == bits) {
+            page_drop(pb, page, fill);
+        } else if(pb->pages[page] != NULL || pb->fill[page] != fill) {
+            if(pb->pages[page] == NULL && page_alloc(pb, page) != 0)
+                return -1;
+            uint32_t ones = bitmap_count(pb->pages[page], off, n);
+            if(value) {
+                bitmap_set(pb->pages[page], off, n);
+                pb->ones[page] += n - ones;
+            } else {
+                bitmap_clear(pb->pages[page], off, n);
+                pb->ones[page] -= ones;
+            }
+            if(pb->ones[page] == 0)
+                page_drop(pb, page, 0x00);
+            else if(pb->ones[page] == bits)
+                page_drop(pb, page, 0xFF);
+        }
+        start += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * \brief Set all bits in range of paged bitmap
+ *
+ * \return 0 on success, -1 when heap allocation failed
+ */
+int page_bitmap_set(struct page_bitmap *pb, uint32_t start, uint32_t length) {
+    return page_bitmap_fill(pb, start, length, 1);
+}
+
+/**
+ * \brief Clear all bits in range of paged bitmap
+ *
+ * \return 0 on success, -1 when heap allocation failed
+ */
+int page_bitmap_clear(struct page_bitmap *pb, uint32_t start, uint32_t length) {
+    return page_bitmap_fill(pb, start, length, 0);
+}
+
+/**
+ * \brief Copy range of paged bitmap to plain bitmap \p dst, starting at its byte 0
+ *
+ * Bits after the end of paged bitmap are copied as set.
+ */
+void page_bitmap_read(const struct page_bitmap *pb, uint8_t *dst, uint32_t start, uint32_t length) {
+    uint64_t end = (uint64_t)start + length;
+    uint8_t *p = dst;
+
+    while(start < end) {
+        uint32_t page = start / BITMAP_PAGE_BITS;
+        uint32_t off = start % BITMAP_PAGE_BITS;
+        uint32_t n = (uint32_t)MIN(end - start, (uint64_t)page_bits(pb, page) - off);
+        uint32_t bytes = (n + 7) / 8;
+
+        if(pb->pages[page] == NULL)
+            memset(p, pb->fill[page], bytes);
+        else
+            memcpy(p, pb->pages[page] + off / 8, bytes);
+        p += bytes;
+        start += n;
+    }
+    if(end == pb->numBits && end % 8)
+        dst[(length - 1) / 8] |= (uint8_t)~byte_mask(0, end % 8);
+}
+
+/**
+ * \brief Replace content of paged bitmap with plain bitmap \p src of \p length bits
+ *
+ * \return 0 on success, -1 when heap allocation failed
+ */
+int page_bitmap_write(struct page_bitmap *pb, const uint8_t *src, uint32_t length) {
+    for(uint32_t page = 0; page < pb->numPages && (uint64_t)page * BITMAP_PAGE_BITS < length; page++) {
+        uint32_t first = page * BITMAP_PAGE_BITS;
+        uint32_t bits = MIN(page_bits(pb, page), length - first);
+        uint32_t ones = bitmap_count(src, first, bits);
+
+        if(bits == page_bits(pb, page) && (ones == 0 || ones == bits)) {
+            page_drop(pb, page, ones ? 0xFF : 0x00);
+            continue;
+        }
+        if(pb->pages[page] == NULL && page_alloc(pb, page) != 0)
+            return -1;
+        memcpy(pb->pages[page], src + first / 8, (bits + 7) / 8);
+        pb->ones[page] = bitmap_count(pb->pages[page], 0, page_bits(pb, page));
+    }
+    return 0;
+}
+
+/**
+ * \brief Keep at most \p bytes of paged bitmap in memory
+ *
+ * When the whole bitmap does not fit, it is split into windows of whole
+ * pages and changes are recorded to temporary file. Current window is the
+ * first one.
+ *
+ * \return 0 on success, -1 when spill file cannot be created
+ */
+int page_bitmap_limit(struct page_bitmap *pb, uint64_t bytes) {
+    uint64_t pages = MAX(bytes / BITMAP_PAGE_BYTES, 1);
+
+    if(pages >= pb->numPages)
+        return 0;
+    pb->spill = tmpfile();
+    if(pb->spill == NULL)
+        return -1;
+    pb->windowBits = (uint32_t)pages * BITMAP_PAGE_BITS;
+    page_bitmap_window(pb, 0);
+    return 0;
+}
+
+/**
+ * \brief Record change of range to spill file, nothing is done without memory limit
+ *
+ * \return 0 on success, -1 on write error
+ */
+int page_bitmap_record(struct page_bitmap *pb, uint32_t start, uint32_t length, uint8_t value) {
+    struct page_bitmap_change change = { .start = start, .length = length, .value = value };
+
+    if(pb->spill == NULL)
+        return 0;
+    return fwrite(&change, sizeof(change), 1, pb->spill) == 1 ? 0 : -1;
+}
+
+/**
+ * \brief Clip range to current window
+ *
+ * \return length of clipped range, 0 when range is outside of window
+ */
+uint32_t page_bitmap_clip(const struct page_bitmap *pb, uint32_t *start, uint32_t length) {
+    uint64_t first = MAX(*start, pb->windowStart);
+    uint64_t end = MIN((uint64_t)*start + length, pb->windowEnd);
+
+    if(pb->windowBits == 0)
+        return length;
+    if(first >= end)
+        return 0;
+    *start = (uint32_t)first;
+    return (uint32_t)(end - first);
+}
+
+/**
+ * \brief Make window starting at bit \p start current, all its bits are set
+ */
+void page_bitmap_window(struct page_bitmap *pb, uint32_t start) {
+    for(uint32_t i = 0; i < pb->numPages; i++)
+        page_drop(pb, i, 0xFF);
+    pb->windowStart = start;
+    pb->windowEnd = (uint32_t)MIN((uint64_t)start + pb->windowBits, pb->numBits);
+}
+
+/**
+ * \brief Pass all recorded changes clipped to current window to \p apply, in order of recording
+ *
+ * \return 0 on success, -1 on read error, otherwise first nonzero value returned by \p apply
+ */
+int page_bitmap_replay(struct page_bitmap *pb,
+                       int (*apply)(void *arg, uint32_t start, uint32_t length, uint8_t value), void *arg) {
+    struct page_bitmap_change change;
+    int ret = 0;
+
+    if(pb->spill == NULL)
+        return 0;
+    if(fflush(pb->spill) != 0 || fseeko(pb->spill, 0, SEEK_SET) != 0)
+        return -1;
+    while(ret == 0 && fread(&change, sizeof(change), 1, pb->spill) == 1) {
+        uint32_t length = page_bitmap_clip(pb, &change.start, change.length);
+        if(length > 0)
+            ret = apply(arg, change.start, length, change.value);
+    }
+    if(ret == 0 && ferror(pb->spill))
+        ret = -1;
+    fseeko(pb->spill, 0, SEEK_END);
+    return ret;
+}
@@ -0,0 +1,75 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __BITMAP_H__
+#define __BITMAP_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define BITMAP_PAGE_BYTES 4096 ///< Bytes of space bitmap kept by one page of struct page_bitmap
+#define BITMAP_PAGE_BITS (8 * BITMAP_PAGE_BYTES)
+
+/**
+ * \brief Space bitmap stored by pages, pages with all bits equal are not allocated
+ *
+ * With memory limit only bits of the current window are kept. All changes
+ * are recorded to spill file, so any window can be rebuilt by
+ * page_bitmap_replay().
+ */
+struct page_bitmap {
+    uint32_t numBits;
+    uint32_t numPages;
+    uint8_t **pages;        ///< bits of page, NULL for page with all bits equal
+    uint32_t *ones;         ///< set bits of allocated page
+    uint8_t *fill;          ///< 0x00 or 0xFF, value of page which is not allocated
+    uint64_t memory;        ///< bytes of allocated pages
+    uint32_t windowBits;    ///< bits of one window, 0 when whole bitmap is kept
+    uint32_t windowStart;   ///< first bit of current window
+    uint32_t windowEnd;     ///< bit after current window
+    FILE *spill;            ///< changes recorded by page_bitmap_record()
+};
+
+// Range operations on space bitmaps, bit n is bit n%8 of byte n/8
+uint32_t bitmap_count(const uint8_t *bitmap, uint32_t start, uint32_t length);
+uint32_t bitmap_count_diff(const uint8_t *a, const uint8_t *b, uint32_t length);
+uint32_t bitmap_find(const uint8_t *bitmap, uint32_t start, uint32_t end, int value);
+void bitmap_set(uint8_t *bitmap, uint32_t start, uint32_t length);
+void bitmap_clear(uint8_t *bitmap, uint32_t start, uint32_t length);
+
+// The same operations on paged bitmap, start of ranges passed to
+// page_bitmap_count_diff(), page_bitmap_read() is multiple of 8
+int page_bitmap_init(struct page_bitmap *pb, uint32_t numBits);
+void page_bitmap_free(struct page_bitmap *pb);
+uint32_t page_bitmap_count(const struct page_bitmap *pb, uint32_t start, uint32_t length);
+uint32_t page_bitmap_count_diff(const struct page_bitmap *pb, const uint8_t *b, uint32_t start, uint32_t length);
+uint32_t page_bitmap_find(const struct page_bitmap *pb, uint32_t start, uint32_t end, int value);
+int page_bitmap_set(struct page_bitmap *pb, uint32_t start, uint32_t length);
+int page_bitmap_clear(struct page_bitmap *pb, uint32_t start, uint32_t length);
+void page_bitmap_read(const struct page_bitmap *pb, uint8_t *dst, uint32_t start, uint32_t length);
+int page_bitmap_write(struct page_bitmap *pb, const uint8_t *src, uint32_t length);
+
+// Windows of paged bitmap under memory limit
+int page_bitmap_limit(struct page_bitmap *pb, uint64_t bytes);
+int page_bitmap_record(struct page_bitmap *pb, uint32_t start, uint32_t length, uint8_t value);
+uint32_t page_bitmap_clip(const struct page_bitmap *pb, uint32_t *start, uint32_t length);
+void page_bitmap_window(struct page_bitmap *pb, uint32_t start);
+int page_bitmap_replay(struct page_bitmap *pb,
+                       int (*apply)(void *arg, uint32_t start, uint32_t length, uint8_t value), void *arg);
+
+#endif //__BITMAP_H__
@@ -0,0 +1,475 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Block cache of mmap()ed windows of the medium
+ *
+ * The medium is split into windows of media->chunksize bytes. A window is
+ * mapped on first cache_get() and stays pinned while it has references.
+ * After the last cache_put() it is kept mapped on LRU list and it is unmapped
+ * only when mapping of another window would exceed the memory budget. Pinned
+ * windows are never evicted, so the budget can be exceeded temporarily when
+ * all mapped windows are in use.
+ *
+ * Window pointers are published in media->mapping[], callers access them
+ * directly between cache_get() and cache_put().
+ *
+ * In check mode windows can be read into buffers by pread or io_uring
+ * backend of libudffs instead (--io). With io_uring, buffers for budget/window
+ * windows are allocated and registered at start and windows are read into
+ * them with fixed buffer requests, up to queue depth requests at once.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+
+#include "cache.h"
+#include "badblocks.h"
+#include "log.h"
+#include "options.h"
+
+#define CACHE_NONE UINT32_MAX ///< Empty LRU link
+
+struct cache_entry {
+    uint32_t refs;  ///< pins held by callers
+    uint32_t size;  ///< mapped length, shorter for last window of medium
+    int32_t slot;   ///< registered buffer holding window, -1 for heap buffer
+    uint32_t prev;  ///< LRU neighbour, towards most recently used
+    uint32_t next;  ///< LRU neighbour, towards least recently used
+};
+
+struct block_cache {
+    pthread_mutex_t lock;
+    uint32_t count;             ///< windows on medium
+    uint64_t budget;            ///< bytes allowed to stay mapped
+    uint64_t mapped;            ///< bytes currently mapped
+    int prot;                   ///< mmap() protection
+    uint32_t head;              ///< most recently released window
+    uint32_t tail;              ///< least recently released window
+    struct cache_entry *entry;
+    int io;                     ///< CACHE_IO_MMAP or UDF_MEDIUM_IO_* backend reading windows into buffers
+    struct udf_medium medium;
+    uint8_t **slots;            ///< registered buffers
+    uint32_t numSlots;
+    uint32_t *freeSlots;        ///< stack of unused registered buffers
+    uint32_t numFreeSlots;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t puts;
+    uint64_t unmaps;
+    uint64_t bytes;             ///< bytes mapped or read into windows
+};
+
+static void lru_remove(struct block_cache *cache, uint32_t chunk) {
+    struct cache_entry *e = &cache->entry[chunk];
+
+    if(e->prev != CACHE_NONE)
+        cache->entry[e->prev].next = e->next;
+    else
+        cache->head = e->next;
+    if(e->next != CACHE_NONE)
+        cache->entry[e->next].prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = CACHE_NONE;
+}
+
+static void lru_push(struct block_cache *cache, uint32_t chunk) {
+    struct cache_entry *e = &cache->entry[chunk];
+
+    e->prev = CACHE_NONE;
+    e->next = cache->head;
+    if(cache->head != CACHE_NONE)
+        cache->entry[cache->head].prev = chunk;
+    else
+        cache->tail = chunk;
+    cache->head = chunk;
+}
+
+static void sync_window(udf_media_t *media, uint32_t chunk, uint32_t size) {
+    uint64_t position = (uint64_t)(chunk) * media->chunksize;
+    uint64_t start;
+    int ret;
+
+    UDF_TRACE_START(cache_sync, position, size, start);
+    ret = msync(media->mapping[chunk], size, MS_SYNC);
+    // Recovered pages of degraded medium are not backed by it
+    if(badblocks_sync(media, media->mapping[chunk], size) != 0)
+        ret = -1;
+    UDF_TRACE_DONE(UDF_TRACE_CACHE_SYNC, cache_sync, position, ret < 0 ? -1 : (int64_t)size, start);
+}
+
+static void release_window(udf_media_t *media, uint32_t chunk) {
+    struct block_cache *cache = media->cache;
+    struct cache_entry *e = &cache->entry[chunk];
+
+    if(cache->io != CACHE_IO_MMAP) {
+        if(e->slot >= 0)
+            cache->freeSlots[cache->numFreeSlots++] = (uint32_t)e->slot;
+        else
+            free(media->mapping[chunk]);
+        e->slot = -1;
+    } else {
+        if(cache->prot & PROT_WRITE)
+            sync_window(media, chunk, e->size);
+        badblocks_unmap(media->mapping[chunk], e->size);
+        munmap(media->mapping[chunk], e->size);
+    }
+    media->mapping[chunk] = NULL;
+    cache->mapped -= e->size;
+    cache->unmaps++;
+    dbg("\tChunk #%u unmapped\n", chunk);
+}
+
+/**
+ * \brief Unmap least recently used windows until \p need more bytes fit into budget
+ */
+static void evict(udf_media_t *media, uint64_t need) {
+    struct block_cache *cache = media->cache;
+
+    while(cache->mapped + need > cache->budget && cache->tail != CACHE_NONE) {
+        uint32_t victim = cache->tail;
+        lru_remove(cache, victim);
+        release_window(media, victim);
+        cache->evictions++;
+    }
+}
+
+/**
+ * \brief Allocate and register buffers for windows read by io_uring
+ *
+ * Without registered buffers (e.g. when locked memory limit is too low)
+ * windows are read into heap buffers.
+ */
+static void register_slots(struct block_cache *cache, uint32_t window) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    uint32_t count = (uint32_t)MIN(cache->budget / window, (uint64_t)cache->count);
+    struct iovec *iov;
+    uint32_t i;
+
+    if(count == 0)
+        count = 1;
+    cache->slots = calloc(count, sizeof(uint8_t *));
+    cache->freeSlots = calloc(count, sizeof(uint32_t));
+    iov = calloc(count, sizeof(struct iovec));
+    if(cache->slots == NULL || cache->freeSlots == NULL || iov == NULL)
+        goto failed;
+
+    for(i = 0; i < count; i++) {
+        void *buf;
+        if(posix_memalign(&buf, pagesize > 0 ? (size_t)pagesize : 4096, window) != 0)
+            goto failed;
+        cache->slots[i] = buf;
+        iov[i].iov_base = buf;
+        iov[i].iov_len = window;
+    }
+    if(udf_medium_register(&cache->medium, iov, count) != 0) {
+        dbg("Window buffers were not registered: %s\n", strerror(errno));
+        goto failed;
+    }
+
+    cache->numSlots = count;
+    for(i = 0; i < count; i++)
+        cache->freeSlots[i] = count - 1 - i;
+    cache->numFreeSlots = count;
+    free(iov);
+    dbg("Registered %u window buffers\n", count);
+    return;
+
+failed:
+    if(cache->slots != NULL) {
+        for(i = 0; i < count; i++)
+            free(cache->slots[i]);
+    }
+    free(cache->slots);
+    free(cache->freeSlots);
+    free(iov);
+    cache->slots = NULL;
+    cache->freeSlots = NULL;
+}
+
+/**
+ * \brief Read window into registered or heap buffer
+ */
+static uint8_t *read_window(udf_media_t *media, uint32_t chunk) {
+    struct block_cache *cache = media->cache;
+    struct cache_entry *e = &cache->entry[chunk];
+    uint8_t *ptr;
+    ssize_t ret;
+
+    if(cache->numFreeSlots > 0) {
+        e->slot = (int32_t)cache->freeSlots[--cache->numFreeSlots];
+        ptr = cache->slots[e->slot];
+    } else {
+        e->slot = -1;
+        ptr = malloc(e->size);
+        if(ptr == NULL) {
+            fatal("\tWindow allocation failed.\n");
+            exit(ESTATUS_OPERATIONAL_ERROR);
+        }
+    }
+
+    ret = udf_medium_read(&cache->medium, ptr, e->size, (uint64_t)(chunk) * media->chunksize, e->slot);
+    // Failed window is read again by sectors, unreadable ones are zeroed
+    if(ret != (ssize_t)e->size && badblocks_read(media, ptr, e->size, (uint64_t)(chunk) * media->chunksize) != 0) {
+        fatal("\tError reading: %s.\n", "Unexpected end of medium");
+        exit(ESTATUS_OPERATIONAL_ERROR);
+    }
+    return ptr;
+}
+
+/**
+ * \brief Set up block cache for medium
+ *
+ * Requires media->fd and media->devsize to be set.
+ *
+ * \param[in,out] media  medium to cache
+ * \param[in]     window window size in bytes, multiple of page size
+ * \param[in]     budget maximum amount of bytes kept mapped when not in use
+ *
+ * \return 0 everything ok
+ * \return -1 invalid window size
+ * \return -2 allocation failed
+ */
+int cache_init(udf_media_t *media, uint32_t window, uint64_t budget) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+    struct block_cache *cache;
+
+    if(window == 0 || (pagesize > 0 && window % pagesize != 0))
+        return -1;
+
+    media->chunksize = window;
+    uint32_t rest = (uint32_t)(media->devsize % window);
+    uint32_t count = (uint32_t)(media->devsize / window + (rest > 0 ? 1 : 0));
+    dbg("Chunk size %u, rest: %u\n", window, rest);
+    dbg("Amount of chunks: %u\n", count);
+
+    cache = calloc(1, sizeof(struct block_cache));
+    if(cache == NULL)
+        return -2;
+    cache->entry = calloc(count > 0 ? count : 1, sizeof(struct cache_entry));
+    media->mapping = calloc(count > 0 ? count : 1, sizeof(uint8_t *));
+    if(cache->entry == NULL || media->mapping == NULL) {
+        free(cache->entry);
+        free(media->mapping);
+        free(cache);
+        media->mapping = NULL;
+        return -2;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->count = count;
+    cache->budget = budget < window ? window : budget;
+    cache->head = cache->tail = CACHE_NONE;
+    for(uint32_t i = 0; i < count; i++) {
+        cache->entry[i].prev = cache->entry[i].next = CACHE_NONE;
+        cache->entry[i].size = (i == count - 1 && rest > 0) ? rest : window;
+        cache->entry[i].slot = -1;
+    }
+
+    cache->prot = PROT_READ;
+    // If is there some request for corrections, we need read/write access to the medium
+    if(interactive || autofix) {
+        cache->prot |= PROT_WRITE;
+        dbg("\tRW\n");
+    }
+
+    // Windows read into buffers are never written back
+    cache->io = medium_io;
+    if(cache->io != CACHE_IO_MMAP && (cache->prot & PROT_WRITE)) {
+        warn("Reading medium into buffers is available only in check mode. Mapping medium.\n");
+        cache->io = CACHE_IO_MMAP;
+    }
+    if(cache->io != CACHE_IO_MMAP) {
+        if(udf_medium_init(&cache->medium, media->fd, cache->io, queue_depth) != 0)
+            warn("io_uring is not available. Reading medium by pread.\n");
+        cache->io = cache->medium.io;
+        if(cache->io == UDF_MEDIUM_IO_URING)
+            register_slots(cache, window);
+        dbg("Medium is read by %s\n", udf_medium_io_name(cache->io));
+    }
+
+    media->cache = cache;
+    dbg("Cache budget: %" PRIu64 " bytes\n", cache->budget);
+    return 0;
+}
+
+/**
+ * \brief Sync and unmap all windows and free the block cache
+ */
+void cache_free(udf_media_t *media) {
+    struct block_cache *cache = media->cache;
+
+    if(cache == NULL)
+        return;
+
+    for(uint32_t i = 0; i < cache->count; i++) {
+        if(media->mapping[i] != NULL)
+            release_window(media, i);
+    }
+    if(cache->io != CACHE_IO_MMAP) {
+        udf_medium_free(&cache->medium);
+        for(uint32_t i = 0; i < cache->numSlots; i++)
+            free(cache->slots[i]);
+        free(cache->slots);
+        free(cache->freeSlots);
+    }
+    dbg("Cache hits: %" PRIu64 ", misses: %" PRIu64 ", evictions: %" PRIu64 "\n",
+        cache->hits, cache->misses, cache->evictions);
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entry);
+    free(cache);
+    free(media->mapping);
+    media->cache = NULL;
+    media->mapping = NULL;
+}
+
+/**
+ * \brief Fill \p stats with counters of block cache
+ *
+ * Counters are zero when block cache was not initialized.
+ */
+void cache_get_stats(udf_media_t *media, struct cache_stats *stats) {
+    struct block_cache *cache = media->cache;
+
+    memset(stats, 0, sizeof(*stats));
+    if(cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->puts = cache->puts;
+    stats->unmaps = cache->unmaps;
+    stats->bytes = cache->bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * \brief Pin window of medium, mapping it if needed
+ *
+ * Every call must be paired with cache_put() once the caller no longer
+ * touches the window.
+ *
+ * \param[in] media medium
+ * \param[in] chunk window number
+ *
+ * \return pointer to start of window, the same as media->mapping[chunk]
+ */
+uint8_t *cache_get(udf_media_t *media, uint32_t chunk) {
+    struct block_cache *cache = media->cache;
+    struct cache_entry *e = &cache->entry[chunk];
+    uint64_t position = (uint64_t)(chunk) * media->chunksize;
+    uint64_t start;
+    uint8_t *ptr;
+
+    pthread_mutex_lock(&cache->lock);
+    if(media->mapping[chunk] != NULL) {
+        if(e->refs++ == 0)
+            lru_remove(cache, chunk);
+        cache->hits++;
+        UDF_PROBE(cache_get__hit, position, e->size);
+        if(udf_trace_enabled)
+            udf_trace_hit(UDF_TRACE_CACHE_GET);
+        ptr = media->mapping[chunk];
+        pthread_mutex_unlock(&cache->lock);
+        dbg("\tChunk #%u is already mapped.\n", chunk);
+        return ptr;
+    }
+
+    evict(media, e->size);
+    dbg("\tSize: 0x%" PRIx64 ", chunk size 0x%x, mapped: 0x%x\n", media->devsize, media->chunksize, e->size);
+    // With mmap only setting up the mapping is timed, pages are read later on fault
+    UDF_TRACE_START(cache_get, position, e->size, start);
+    if(cache->io != CACHE_IO_MMAP) {
+        ptr = read_window(media, chunk);
+    } else {
+        ptr = (uint8_t *)mmap(NULL, e->size, cache->prot, MAP_SHARED, media->fd, position);
+        if(ptr == MAP_FAILED) {
+            fatal("\tError mapping: %s.\n", strerror(errno));
+            exit(ESTATUS_OPERATIONAL_ERROR);
+        }
+    }
+    UDF_TRACE_DONE(UDF_TRACE_CACHE_GET, cache_get, position, e->size, start);
+    media->mapping[chunk] = ptr;
+    cache->mapped += e->size;
+    cache->misses++;
+    cache->bytes += e->size;
+    udf_progress_add(UDF_PROGRESS_READ, e->size);
+    e->refs = 1;
+    pthread_mutex_unlock(&cache->lock);
+#ifdef MEMTRACE
+    dbg("\tChunk #%u allocated, pointer: %p, offset 0x%" PRIx64 "\n", chunk,
+        ptr, (uint64_t)(chunk) * media->chunksize);
+#else
+    dbg("\tChunk #%u allocated\n", chunk);
+#endif
+    return ptr;
+}
+
+/**
+ * \brief Drop pin of window
+ *
+ * Window stays mapped until it is evicted to make room for another one.
+ */
+void cache_put(udf_media_t *media, uint32_t chunk) {
+    struct block_cache *cache = media->cache;
+    struct cache_entry *e = &cache->entry[chunk];
+
+    pthread_mutex_lock(&cache->lock);
+    if(media->mapping[chunk] == NULL || e->refs == 0) {
+        pthread_mutex_unlock(&cache->lock);
+        dbg("\tChunk #%u is not in use\n", chunk);
+        return;
+    }
+    cache->puts++;
+    if(--e->refs == 0) {
+        lru_push(cache, chunk);
+        // Windows pinned while budget was exhausted are trimmed here
+        evict(media, 0);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * \brief Write modified window back to medium
+ */
+void cache_sync(udf_media_t *media, uint32_t chunk) {
+    struct block_cache *cache = media->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    if(media->mapping[chunk] != NULL && cache->io == CACHE_IO_MMAP) {
+        dbg("Going to sync chunk #%u\n", chunk);
+        sync_window(media, chunk, cache->entry[chunk].size);
+        dbg("\tChunk #%u synced\n", chunk);
+    } else {
+        dbg("\tChunk #%u is unmapped\n", chunk);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,49 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "udffsck.h"
+
+#define CACHE_SIZE ((uint64_t)32 * CHUNK_SIZE) ///< Default amount of bytes kept mapped by block cache
+#define CACHE_IO_MMAP (-1) ///< Windows are mmap()ed, otherwise they are read by UDF_MEDIUM_IO_* backend
+
+/**
+ * \brief Counters of block cache
+ */
+struct cache_stats {
+    uint64_t hits;      ///< cache_get() of already mapped window
+    uint64_t misses;    ///< cache_get() which mapped or read window
+    uint64_t evictions; ///< windows unmapped to fit into budget
+    uint64_t puts;      ///< cache_put() calls
+    uint64_t unmaps;    ///< all unmapped windows
+    uint64_t bytes;     ///< bytes mapped or read into windows
+};
+
+// Block cache over mmap()ed windows of the medium
+int cache_init(udf_media_t *media, uint32_t window, uint64_t budget);
+void cache_free(udf_media_t *media);
+uint8_t *cache_get(udf_media_t *media, uint32_t chunk);
+void cache_put(udf_media_t *media, uint32_t chunk);
+void cache_sync(udf_media_t *media, uint32_t chunk);
+void cache_get_stats(udf_media_t *media, struct cache_stats *stats);
+
+#endif //__CACHE_H__
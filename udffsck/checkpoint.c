@@ -0,0 +1,353 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Checkpoints of long file tree checks
+ *
+ * While file tree is walked in check mode, state of the walk is saved
+ * periodically: directories waiting on the replay stack with their events
+ * not replayed yet (see walk.c), counters calculated so far, and partition
+ * bitmap marked so far. Interrupted check started again with --resume
+ * continues from the last checkpoint instead of walking the whole tree again.
+ *
+ * Checkpoint is used only when LVD, LVID, PD, FSD and recorded space bitmap
+ * are the same as when it was saved, so nothing was written to the volume
+ * in the meantime. Messages of events are saved as formatted text, so the
+ * checkpoint is used also only with the same verbosity and colors.
+ *
+ * Checkpoint is saved in host byte order, it is not portable between little
+ * and big endian hosts.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "bitmap.h"
+#include "log.h"
+#include "options.h"
+
+volatile sig_atomic_t checkpoint_armed = 0;
+volatile sig_atomic_t checkpoint_interrupted = 0;
+
+/**
+ * \brief Continue 64 bit FNV-1a digest over \p length bytes
+ */
+static uint64_t digest(uint64_t hash, const void *buf, size_t length) {
+    const uint8_t *p = buf;
+
+    if (buf == NULL)
+        return hash;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * \brief Prepare checkpoints of file tree walk
+ *
+ * Digest of volume descriptors is calculated now, before the walk, and
+ * compared with the one of loaded checkpoint.
+ *
+ * \param[out] *cp       checkpoints
+ * \param[in]  *path     path to checkpoint file
+ * \param[in]  interval  seconds between checkpoints
+ * \param[in]  media     Information regarding medium & access to it
+ * \param[in]  *stats    file system status with loaded LVID, PD and FSD
+ */
+void checkpoint_init(struct checkpoint *cp, const char *path, unsigned int interval,
+                     udf_media_t *media, struct filesystemStats *stats) {
+    struct udf_disc *disc = &media->disc;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    memset(cp, 0, sizeof(struct checkpoint));
+    cp->path = strdup(path);
+    cp->interval = interval;
+    cp->last = time(NULL);
+
+    for (int i = 0; i < 2; ++i)
+        hash = digest(hash, disc->udf_lvd[i], sizeof(struct logicalVolDesc));
+    hash = digest(hash, disc->udf_lvid, sizeof(struct logicalVolIntegrityDesc));
+    hash = digest(hash, disc->udf_pd[0], sizeof(struct partitionDesc));
+    hash = digest(hash, disc->udf_fsd, sizeof(struct fileSetDesc));
+    if (stats->expPartitionBitmap)
+        hash = digest(hash, stats->expPartitionBitmap, stats->spacedesc.partitionNumBlocks / 8);
+    cp->volumeDigest = hash;
+}
+
+/**
+ * \brief Read exactly length bytes from checkpoint file
+ *
+ * \return 0 on success, -1 on error or end of file
+ */
+int checkpoint_read(FILE *fp, void *buf, size_t length) {
+    if (length == 0)
+        return 0;
+    return fread(buf, length, 1, fp) == 1 ? 0 : -1;
+}
+
+/**
+ * \brief Write length bytes to checkpoint file
+ *
+ * \return 0 on success, -1 on error
+ */
+int checkpoint_write(FILE *fp, const void *buf, size_t length) {
+    if (length == 0)
+        return 0;
+    return fwrite(buf, length, 1, fp) == 1 ? 0 : -1;
+}
+
+/**
+ * \brief Load checkpoint saved by interrupted check of the same volume
+ *
+ * Missing or not matching checkpoint is not an error, file tree is walked
+ * from the beginning.
+ *
+ * \param[in,out] *cp     checkpoints
+ * \param[in]     *stats  file system status
+ *
+ * \return 0 checkpoint loaded, frames are read by the walk
+ * \return -1 no usable checkpoint
+ */
+int checkpoint_load(struct checkpoint *cp, struct filesystemStats *stats) {
+    struct checkpoint_header *hdr = &cp->hdr;
+
+    cp->fp = fopen(cp->path, "rb");
+    if (cp->fp == NULL) {
+        if (errno == ENOENT)
+            msg("Checkpoint %s does not exist, file tree will be checked from the beginning.\n", cp->path);
+        else
+            warn("Cannot open checkpoint %s: %s. File tree will be checked from the beginning.\n", cp->path, strerror(errno));
+        return -1;
+    }
+
+    if (checkpoint_read(cp->fp, hdr, sizeof(struct checkpoint_header))
+        || memcmp(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != CHECKPOINT_VERSION
+        || hdr->numFrames == 0) {
+        warn("Checkpoint %s is not valid. File tree will be checked from the beginning.\n", cp->path);
+        fclose(cp->fp);
+        cp->fp = NULL;
+        return -1;
+    }
+
+    if (hdr->blocksize != stats->blocksize
+        || hdr->lbnlsn != stats->lbnlsn
+        || hdr->partitionNumBlocks != stats->found.partitionNumBlocks
+        || hdr->volumeDigest != cp->volumeDigest) {
+        warn("Checkpoint %s was saved for different volume or volume changed since. "
+             "File tree will be checked from the beginning.\n", cp->path);
+        fclose(cp->fp);
+        cp->fp = NULL;
+        return -1;
+    }
+
+    if (hdr->verbosity != (uint8_t)verbosity || hdr->colored != (uint8_t)colored) {
+        warn("Checkpoint %s was saved with different verbosity or colors. "
+             "File tree will be checked from the beginning.\n", cp->path);
+        fclose(cp->fp);
+        cp->fp = NULL;
+        return -1;
+    }
+
+    cp->loaded = 1;
+    note("Checkpoint: file tree at LSN %u, %u directories on stack\n", hdr->rootLsn, hdr->numFrames);
+    return 0;
+}
+
+/**
+ * \brief Release checkpoints, checkpoint file is kept
+ */
+void checkpoint_free(struct checkpoint *cp) {
+    if (cp->fp)
+        fclose(cp->fp);
+    free(cp->path);
+    memset(cp, 0, sizeof(struct checkpoint));
+}
+
+/**
+ * \brief Remove checkpoint file after completed walk, if it was saved or used
+ */
+void checkpoint_remove(struct checkpoint *cp) {
+    if (cp->path == NULL || (cp->saved == 0 && !cp->resumed))
+        return;
+    if (unlink(cp->path) != 0 && errno != ENOENT)
+        warn("Cannot remove checkpoint %s: %s\n", cp->path, strerror(errno));
+}
+
+/**
+ * \brief Check whether walk should save checkpoint now
+ */
+int checkpoint_due(const struct checkpoint *cp) {
+    return checkpoint_interrupted || time(NULL) - cp->last >= (time_t)cp->interval;
+}
+
+/**
+ * \brief Start saving checkpoint, header is written to temporary file
+ *
+ * Caller writes frames and finishes checkpoint by checkpoint_commit().
+ *
+ * \param[in,out] *cp          checkpoints
+ * \param[in]     *stats       file system status
+ * \param[in]     *found       counters of the walk
+ * \param[in]     *seq         VDS sequence
+ * \param[in]     walkStatus   status of directories already replayed
+ * \param[in]     numFrames    directories on replay stack
+ *
+ * \return temporary checkpoint file, NULL on error
+ */
+FILE *checkpoint_create(struct checkpoint *cp, const struct filesystemStats *stats,
+                        const integrity_info_t *found, const vds_sequence_t *seq,
+                        uint8_t walkStatus, uint32_t numFrames) {
+    struct checkpoint_header hdr;
+    char tmp[strlen(cp->path) + 5];
+    FILE *fp;
+
+    sprintf(tmp, "%s.new", cp->path);
+    cp->last = time(NULL);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        warn("Cannot create checkpoint %s: %s\n", tmp, strerror(errno));
+        return NULL;
+    }
+
+    memset(&hdr, 0, sizeof(struct checkpoint_header));
+    memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+    hdr.version = CHECKPOINT_VERSION;
+    hdr.blocksize = stats->blocksize;
+    hdr.lbnlsn = stats->lbnlsn;
+    hdr.partitionNumBlocks = stats->found.partitionNumBlocks;
+    hdr.volumeDigest = cp->volumeDigest;
+    hdr.rootLsn = cp->rootLsn;
+    hdr.treeStatus = cp->treeStatus;
+    hdr.walkStatus = walkStatus;
+    hdr.lvidError = seq->lvid.error;
+    hdr.verbosity = (uint8_t)verbosity;
+    hdr.colored = (uint8_t)colored;
+    hdr.foundNumFiles = found->numFiles;
+    hdr.foundNumDirs = found->numDirs;
+    hdr.foundFreeSpaceBlocks = found->freeSpaceBlocks;
+    hdr.foundNextUID = found->nextUID;
+    hdr.foundMinUDFReadRev = found->minUDFReadRev;
+    hdr.foundMinUDFWriteRev = found->minUDFWriteRev;
+    hdr.foundMaxUDFWriteRev = found->maxUDFWriteRev;
+    hdr.numFrames = numFrames;
+
+    if (checkpoint_write(fp, &hdr, sizeof(struct checkpoint_header)) != 0) {
+        warn("Cannot write checkpoint %s: %s\n", tmp, strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        return NULL;
+    }
+    return fp;
+}
+
+/**
+ * \brief Finish checkpoint, partition bitmap is appended and file replaces previous checkpoint
+ *
+ * \param[in,out] *cp     checkpoints
+ * \param[in]     *fp     file returned by checkpoint_create()
+ * \param[in]     *stats  file system status
+ * \param[in]     error   writing of frames failed, checkpoint is dropped
+ *
+ * \return 0 checkpoint saved
+ * \return -1 checkpoint was not saved, previous one is kept
+ */
+int checkpoint_commit(struct checkpoint *cp, FILE *fp, const struct filesystemStats *stats, int error) {
+    uint32_t numBlocks = stats->found.partitionNumBlocks;
+    char tmp[strlen(cp->path) + 5];
+    uint8_t *bitmap = malloc((numBlocks + 7) / 8 + 1);
+
+    sprintf(tmp, "%s.new", cp->path);
+    if (bitmap) {
+        page_bitmap_read(stats->actPartitionBitmap, bitmap, 0, numBlocks);
+        error |= checkpoint_write(fp, bitmap, (numBlocks + 7) / 8);
+        free(bitmap);
+    } else {
+        error = -1;
+    }
+
+    if (error || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        warn("Cannot write checkpoint %s: %s\n", tmp, strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        return -1;
+    }
+    if (fclose(fp) != 0 || rename(tmp, cp->path) != 0) {
+        warn("Cannot save checkpoint %s: %s\n", cp->path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    cp->saved++;
+    dbg("Checkpoint saved to %s\n", cp->path);
+    return 0;
+}
+
+/**
+ * \brief Restore counters and partition bitmap of loaded checkpoint
+ *
+ * Called by the walk after all frames were read. Nothing is changed when
+ * the bitmap cannot be read, failed allocation of partition bitmap is fatal.
+ *
+ * \param[in,out] *cp     checkpoints, loaded checkpoint is closed
+ * \param[in,out] *stats  file system status
+ * \param[out]    *found  counters of the walk
+ * \param[in,out] *seq    VDS sequence
+ *
+ * \return 0 walk can be resumed
+ * \return -1 checkpoint is truncated or allocation failed
+ */
+int checkpoint_restore(struct checkpoint *cp, struct filesystemStats *stats,
+                       integrity_info_t *found, vds_sequence_t *seq) {
+    const struct checkpoint_header *hdr = &cp->hdr;
+    uint32_t numBlocks = stats->found.partitionNumBlocks;
+    uint8_t *bitmap = malloc((numBlocks + 7) / 8 + 1);
+    uint8_t extra;
+    int ret = -1;
+
+    if (bitmap != NULL
+        && checkpoint_read(cp->fp, bitmap, (numBlocks + 7) / 8) == 0
+        && checkpoint_read(cp->fp, &extra, 1) != 0) {
+        if (page_bitmap_write(stats->actPartitionBitmap, bitmap, numBlocks) != 0) {
+            fatal("Cannot allocate partition bitmap.\n");
+            exit(ESTATUS_OPERATIONAL_ERROR);
+        }
+        found->numFiles = hdr->foundNumFiles;
+        found->numDirs = hdr->foundNumDirs;
+        found->freeSpaceBlocks = hdr->foundFreeSpaceBlocks;
+        found->nextUID = hdr->foundNextUID;
+        found->minUDFReadRev = hdr->foundMinUDFReadRev;
+        found->minUDFWriteRev = hdr->foundMinUDFWriteRev;
+        found->maxUDFWriteRev = hdr->foundMaxUDFWriteRev;
+        seq->lvid.error |= hdr->lvidError;
+        cp->resumed = 1;
+        ret = 0;
+    }
+
+    free(bitmap);
+    fclose(cp->fp);
+    cp->fp = NULL;
+    cp->loaded = 0;
+    return ret;
+}
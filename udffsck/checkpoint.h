@@ -0,0 +1,127 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+
+#include "udffsck.h"
+
+#define CHECKPOINT_MAGIC    "UDFFSCKK"  ///< First bytes of checkpoint file
+#define CHECKPOINT_VERSION  2           ///< Version of checkpoint file layout
+#define CHECKPOINT_INTERVAL 60          ///< Default seconds between checkpoints
+
+/**
+ * \brief State of file tree walk when checkpoint was saved
+ *
+ * Header is followed by numFrames frames of replay stack (from the root),
+ * each of them followed by its events, and by partition bitmap.
+ */
+struct checkpoint_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    blocksize;
+    uint32_t    lbnlsn;
+    uint32_t    partitionNumBlocks;
+    uint64_t    volumeDigest;           ///< digest of LVD, LVID, PD, FSD and recorded space bitmap
+    uint32_t    rootLsn;                ///< LSN of root FE of walked file tree
+    uint8_t     treeStatus;             ///< status of file trees walked before
+    uint8_t     walkStatus;             ///< status of directories already replayed
+    uint8_t     lvidError;              ///< LVID errors found by walk
+    uint8_t     verbosity;              ///< verbosity at which text of events was formatted
+    uint32_t    foundNumFiles;
+    uint32_t    foundNumDirs;
+    uint32_t    foundFreeSpaceBlocks;
+    uint64_t    foundNextUID;
+    uint16_t    foundMinUDFReadRev;
+    uint16_t    foundMinUDFWriteRev;
+    uint16_t    foundMaxUDFWriteRev;
+    uint8_t     colored;                ///< text of events has ANSI colors
+    uint8_t     reserved;
+    uint32_t    numFrames;              ///< number of checkpoint_frame records
+} __attribute__ ((packed));
+
+/**
+ * \brief Directory being replayed, its remaining events follow
+ */
+struct checkpoint_frame {
+    uint8_t  status;        ///< status of directory inspection
+    uint8_t  reserved[3];
+    uint32_t numEvents;     ///< number of checkpoint_event records
+} __attribute__ ((packed));
+
+/**
+ * \brief Walk event not replayed yet, followed by length bytes of its data
+ */
+struct checkpoint_event {
+    uint8_t  type;          ///< walk event type
+    uint8_t  arg;           ///< mark, stream of text (1 for stderr) or 1 for timestamp with filename
+    uint16_t icb_ad;        ///< AD type of directory
+    uint32_t lbn;           ///< LBN of mark or LSN of directory
+    uint32_t size;          ///< size of mark or depth of directory
+    uint32_t length;        ///< bytes of text, ADs of directory or filename
+    double   cts;           ///< file timestamp
+} __attribute__ ((packed));
+
+/**
+ * \brief Checkpoints of file tree walk
+ *
+ * Checkpoint is saved to a temporary file renamed over the previous one,
+ * so a complete checkpoint is always there when the check dies.
+ */
+struct checkpoint {
+    char                    *path;
+    unsigned int             interval;      ///< seconds between checkpoints
+    time_t                   last;          ///< time of last checkpoint or start of walk
+    uint64_t                 volumeDigest;
+    FILE                    *fp;            ///< loaded checkpoint, positioned at its frames
+    int                      loaded;        ///< hdr holds valid checkpoint of this volume
+    struct checkpoint_header hdr;
+    uint32_t                 rootLsn;       ///< root of file tree being walked
+    uint8_t                  treeStatus;    ///< status of file trees walked before
+    uint32_t                 saved;         ///< checkpoints saved by this run
+    int                      resumed;       ///< walk was resumed from loaded checkpoint
+};
+
+// SIGINT during checkpointed walk only requests checkpoint, walk exits after saving it
+extern volatile sig_atomic_t checkpoint_armed;
+extern volatile sig_atomic_t checkpoint_interrupted;
+
+void checkpoint_init(struct checkpoint *cp, const char *path, unsigned int interval,
+                     udf_media_t *media, struct filesystemStats *stats);
+int checkpoint_load(struct checkpoint *cp, struct filesystemStats *stats);
+void checkpoint_free(struct checkpoint *cp);
+void checkpoint_remove(struct checkpoint *cp);
+int checkpoint_due(const struct checkpoint *cp);
+
+FILE *checkpoint_create(struct checkpoint *cp, const struct filesystemStats *stats,
+                        const integrity_info_t *found, const vds_sequence_t *seq,
+                        uint8_t walkStatus, uint32_t numFrames);
+int checkpoint_commit(struct checkpoint *cp, FILE *fp, const struct filesystemStats *stats, int error);
+int checkpoint_restore(struct checkpoint *cp, struct filesystemStats *stats,
+                       integrity_info_t *found, vds_sequence_t *seq);
+
+int checkpoint_write(FILE *fp, const void *buf, size_t length);
+int checkpoint_read(FILE *fp, void *buf, size_t length);
+
+#endif //__CHECKPOINT_H__
@@ -0,0 +1,550 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Check journal for incremental file tree checks
+ *
+ * After a clean check, the journal file records the LVID state, the
+ * calculated statistics and, for every non-directory file, its Unique ID,
+ * (E)FE position and blocks accounted to it. The next check of the same
+ * volume walks directories as usual, but files found in the journal under
+ * the same Unique ID and position are accounted from their records instead
+ * of reading and verifying their (E)FE and allocation descriptors again.
+ * Only files created after the last check are verified.
+ *
+ * When neither the LVID nor the recorded space bitmap changed since the last
+ * check, the file tree walk is skipped completely.
+ *
+ * Journal is saved in host byte order, it is not portable between little
+ * and big endian hosts.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <sys/param.h>
+
+#include "journal.h"
+#include "bitmap.h"
+#include "log.h"
+
+/**
+ * \brief Number of blocks covered by both recorded and calculated space bitmap
+ */
+static uint32_t bitmap_blocks(const struct filesystemStats *stats) {
+    if (stats->expPartitionBitmap == NULL)
+        return 0;
+    return MIN(stats->found.partitionNumBlocks, stats->spacedesc.partitionNumBlocks);
+}
+
+/**
+ * \brief Read exactly size bytes from journal file
+ *
+ * \return 0 on success, -1 on error or end of file
+ */
+static int read_all(FILE *fp, void *buffer, size_t size) {
+    if (size == 0)
+        return 0;
+    return fread(buffer, size, 1, fp) == 1 ? 0 : -1;
+}
+
+/**
+ * \brief Load check journal recorded by previous clean check
+ *
+ * Missing or damaged journal is not an error, full check is done instead
+ * and new journal is saved at its end.
+ *
+ * \param[out] *journal  check journal
+ * \param[in]  *path     path to journal file
+ *
+ * \return 0 journal loaded
+ * \return -1 no usable journal, full check is needed
+ */
+int journal_load(struct check_journal *journal, const char *path) {
+    FILE *fp;
+    struct journal_header *hdr = &journal->hdr;
+
+    memset(journal, 0, sizeof(struct check_journal));
+    journal->path = strdup(path);
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        if (errno == ENOENT)
+            msg("Check journal %s does not exist yet, full check will be done.\n", path);
+        else
+            warn("Cannot open check journal %s: %s. Full check will be done.\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (read_all(fp, hdr, sizeof(struct journal_header))
+        || memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != JOURNAL_VERSION) {
+        warn("Check journal %s is not valid. Full check will be done.\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    journal->files = malloc((size_t)hdr->numFiles * sizeof(struct journal_file) + 1);
+    journal->extents = malloc((size_t)hdr->numExtents * sizeof(struct journal_extent) + 1);
+    if (journal->files == NULL || journal->extents == NULL
+        || read_all(fp, journal->files, (size_t)hdr->numFiles * sizeof(struct journal_file))
+        || read_all(fp, journal->extents, (size_t)hdr->numExtents * sizeof(struct journal_extent))) {
+        warn("Check journal %s is truncated. Full check will be done.\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    for (uint32_t i = 0; i < hdr->numFiles; ++i) {
+        const struct journal_file *file = &journal->files[i];
+        if ((uint64_t)file->firstExtent + file->numExtents > hdr->numExtents
+            || (i > 0 && (file->uniqueID < file[-1].uniqueID
+                          || (file->uniqueID == file[-1].uniqueID && file->lsn <= file[-1].lsn)))) {
+            warn("Check journal %s is not valid. Full check will be done.\n", path);
+            return -1;
+        }
+    }
+
+    journal->loaded = 1;
+    note("Check journal: %u files, %u extents\n", hdr->numFiles, hdr->numExtents);
+    return 0;
+}
+
+/**
+ * \brief Release memory of check journal
+ */
+void journal_free(struct check_journal *journal) {
+    free(journal->path);
+    free(journal->files);
+    free(journal->extents);
+    free(journal->newFiles);
+    free(journal->newExtents);
+    memset(journal, 0, sizeof(struct check_journal));
+}
+
+/**
+ * \brief 64 bit FNV-1a digest of space bitmap
+ *
+ * \param[in] *bitmap     space bitmap, may be NULL
+ * \param[in] numBlocks   number of bits in bitmap
+ *
+ * \return digest, 0 when there is no bitmap
+ */
+uint64_t journal_bitmap_digest(const uint8_t *bitmap, uint32_t numBlocks) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t bytes = numBlocks / 8;
+
+    if (bitmap == NULL)
+        return 0;
+
+    for (uint32_t i = 0; i < bytes; ++i) {
+        hash ^= bitmap[i];
+        hash *= 0x100000001b3ULL;
+    }
+    if (numBlocks % 8) {
+        hash ^= bitmap[bytes] & ((1U << (numBlocks % 8)) - 1);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * \brief Check that journal was recorded on the same volume and LVID only moved forward
+ *
+ * \param[in] *journal  check journal
+ * \param[in] media     Information regarding medium & access to it
+ * \param[in] *stats    file system status with loaded LVID and partition
+ *
+ * \return 1 journal can be used for incremental check
+ * \return 0 journal belongs to different or reformatted volume
+ */
+int journal_matches(const struct check_journal *journal, udf_media_t *media, struct filesystemStats *stats) {
+    const struct journal_header *hdr = &journal->hdr;
+    const struct fileSetDesc *fsd = media->disc.udf_fsd;
+
+    if (!journal->loaded || fsd == NULL)
+        return 0;
+
+    if (hdr->blocksize != stats->blocksize
+        || hdr->lbnlsn != stats->lbnlsn
+        || hdr->partitionNumBlocks != stats->found.partitionNumBlocks
+        || memcmp(hdr->logicalVolIdent, fsd->logicalVolIdent, sizeof(hdr->logicalVolIdent)) != 0
+        || memcmp(&hdr->fsdRecordingTime, &fsd->recordingDateAndTime, sizeof(timestamp)) != 0) {
+        warn("Check journal was recorded for different volume. Full check will be done.\n");
+        return 0;
+    }
+
+    if (stats->lvid.nextUID < hdr->lvidNextUID
+        || compare_timestamps(stats->lvid.recordedTime, hdr->lvidRecordedTime) < 0) {
+        warn("LVID is older than check journal. Full check will be done.\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * \brief Discard records collected by interrupted walk, e.g. before falling back to full check
+ */
+void journal_reset_walk(struct check_journal *journal) {
+    journal->numNewFiles = 0;
+    journal->numNewExtents = 0;
+    journal->recording = 0;
+    journal->overflow = 0;
+    journal->replayed = 0;
+}
+
+/**
+ * \brief Find file verified by previous check
+ *
+ * \param[in] *journal  check journal
+ * \param[in] uniqueID  Unique ID from FID
+ * \param[in] lsn       LSN of (E)FE from FID
+ *
+ * \return journal record or NULL when file was not verified yet
+ */
+const struct journal_file *journal_find_file(const struct check_journal *journal, uint32_t uniqueID, uint32_t lsn) {
+    uint32_t lo = 0, hi;
+
+    if (!journal->loaded || uniqueID == 0)
+        return NULL;
+
+    hi = journal->hdr.numFiles;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct journal_file *file = &journal->files[mid];
+        if (file->uniqueID < uniqueID || (file->uniqueID == uniqueID && file->lsn < lsn))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < journal->hdr.numFiles && journal->files[lo].uniqueID == uniqueID && journal->files[lo].lsn == lsn)
+        return &journal->files[lo];
+    return NULL;
+}
+
+/**
+ * \brief Incremental file tree check
+ *
+ * When LVID and recorded space bitmap are the same as after the last check,
+ * statistics calculated by the last check are used and file tree is not
+ * walked at all. Otherwise file tree is walked and only files not found in
+ * journal are verified. If the result does not match LVID and recorded space
+ * bitmap, something else than addition of files happened and full check is
+ * done instead.
+ *
+ * \param[in]      media     Information regarding medium & access to it
+ * \param[in,out]  *stats    file system status
+ * \param[in]      *seq      VDS sequence
+ * \param[in,out]  *journal  check journal matching the volume
+ *
+ * \return run status of file tree check
+ */
+uint8_t journal_check_file_structure(udf_media_t *media, struct filesystemStats *stats,
+                                     vds_sequence_t *seq, struct check_journal *journal) {
+    const struct journal_header *hdr = &journal->hdr;
+    uint32_t numBlocks = bitmap_blocks(stats);
+    uint32_t bitmapNumBytes = (stats->found.partitionNumBlocks + 7) / 8;
+    integrity_info_t found;
+    uint8_t *bitmap;
+    uint8_t status;
+
+    if (numBlocks > 0
+        && stats->lvid.nextUID == hdr->lvidNextUID
+        && memcmp(&stats->lvid.recordedTime, &hdr->lvidRecordedTime, sizeof(timestamp)) == 0
+        && stats->lvid.numFiles == hdr->lvidNumFiles
+        && stats->lvid.numDirs == hdr->lvidNumDirs
+        && stats->lvid.freeSpaceBlocks == hdr->lvidFreeSpaceBlocks
+        && journal_bitmap_digest(stats->expPartitionBitmap, numBlocks) == hdr->bitmapDigest) {
+        msg("\nVolume did not change since last check, file tree check skipped.\n");
+        stats->found.numFiles = hdr->foundNumFiles;
+        stats->found.numDirs = hdr->foundNumDirs;
+        stats->found.freeSpaceBlocks = hdr->foundFreeSpaceBlocks;
+        stats->found.nextUID = hdr->foundNextUID;
+        stats->found.minUDFReadRev = hdr->foundMinUDFReadRev;
+        stats->found.minUDFWriteRev = hdr->foundMinUDFWriteRev;
+        stats->found.maxUDFWriteRev = hdr->foundMaxUDFWriteRev;
+        if (page_bitmap_write(stats->actPartitionBitmap, stats->expPartitionBitmap, numBlocks) != 0) {
+            err("Cannot allocate partition bitmap.\n");
+            return ESTATUS_OPERATIONAL_ERROR;
+        }
+        journal->unchanged = 1;
+        return ESTATUS_OK;
+    }
+
+    // Keep state before file tree walk for fallback to full check
+    found = stats->found;
+    bitmap = malloc(bitmapNumBytes);
+    if (bitmap == NULL) {
+        journal->loaded = 0;
+        stats->journal = journal;
+        return get_file_structure(media, stats, seq);
+    }
+    page_bitmap_read(stats->actPartitionBitmap, bitmap, 0, stats->found.partitionNumBlocks);
+
+    stats->journal = journal;
+    status = get_file_structure(media, stats, seq);
+
+    if (status == ESTATUS_OK
+        && (stats->found.numFiles != stats->lvid.numFiles
+            || stats->found.numDirs != stats->lvid.numDirs
+            || stats->found.freeSpaceBlocks != stats->lvid.freeSpaceBlocks
+            || (numBlocks > 0 && page_bitmap_count_diff(stats->actPartitionBitmap, stats->expPartitionBitmap, 0, numBlocks) != 0))) {
+        warn("\nIncremental check does not match LVID or space bitmap, doing full check.\n");
+        stats->found = found;
+        if (page_bitmap_write(stats->actPartitionBitmap, bitmap, stats->found.partitionNumBlocks) != 0) {
+            err("Cannot allocate partition bitmap.\n");
+            free(bitmap);
+            return ESTATUS_OPERATIONAL_ERROR;
+        }
+        journal->loaded = 0;
+        journal_reset_walk(journal);
+        status = get_file_structure(media, stats, seq);
+    } else {
+        msg("\nIncremental check: %" PRIu64 " files accounted from journal, %" PRIu64 " verified.\n",
+            journal->replayed, (uint64_t)journal->numNewFiles - journal->replayed);
+    }
+
+    free(bitmap);
+    return status;
+}
+
+static struct journal_file *new_file(struct check_journal *journal) {
+    if (journal->numNewFiles == journal->sizeNewFiles) {
+        uint32_t size = journal->sizeNewFiles ? 2 * journal->sizeNewFiles : 1024;
+        struct journal_file *files = realloc(journal->newFiles, size * sizeof(struct journal_file));
+        if (files == NULL) {
+            journal->overflow = 1;
+            return NULL;
+        }
+        journal->newFiles = files;
+        journal->sizeNewFiles = size;
+    }
+    return &journal->newFiles[journal->numNewFiles++];
+}
+
+static int new_extent(struct check_journal *journal, uint32_t lbn, uint32_t blocks) {
+    if (journal->numNewExtents == journal->sizeNewExtents) {
+        uint32_t size = journal->sizeNewExtents ? 2 * journal->sizeNewExtents : 4096;
+        struct journal_extent *extents = realloc(journal->newExtents, size * sizeof(struct journal_extent));
+        if (extents == NULL) {
+            journal->overflow = 1;
+            return -1;
+        }
+        journal->newExtents = extents;
+        journal->sizeNewExtents = size;
+    }
+    journal->newExtents[journal->numNewExtents].lbn = lbn;
+    journal->newExtents[journal->numNewExtents].blocks = blocks;
+    journal->numNewExtents++;
+    return 0;
+}
+
+/**
+ * \brief Carry record of file accounted from journal over to the new journal
+ */
+void journal_keep_file(struct check_journal *journal, const struct journal_file *file) {
+    struct journal_file *copy = new_file(journal);
+
+    if (copy == NULL)
+        return;
+    *copy = *file;
+    copy->firstExtent = journal->numNewExtents;
+    for (uint16_t i = 0; i < file->numExtents; ++i) {
+        const struct journal_extent *ext = &journal->extents[file->firstExtent + i];
+        if (new_extent(journal, ext->lbn, ext->blocks))
+            return;
+    }
+    journal->replayed++;
+}
+
+/**
+ * \brief Start recording blocks of file which is going to be verified
+ *
+ * Blocks are recorded by journal_add_extent() until journal_end_file().
+ */
+void journal_begin_file(struct check_journal *journal, uint32_t uniqueID, uint32_t lsn) {
+    struct journal_file *file;
+
+    if (uniqueID == 0)
+        return;
+
+    file = new_file(journal);
+    if (file == NULL)
+        return;
+    memset(file, 0, sizeof(struct journal_file));
+    file->uniqueID = uniqueID;
+    file->lsn = lsn;
+    file->firstExtent = journal->numNewExtents;
+    journal->recording = 1;
+}
+
+/**
+ * \brief Record blocks accounted to file being verified
+ */
+void journal_add_extent(struct check_journal *journal, uint32_t lbn, uint32_t blocks) {
+    struct journal_file *file;
+
+    if (!journal->recording || blocks == 0)
+        return;
+
+    file = &journal->newFiles[journal->numNewFiles - 1];
+    if (file->numExtents == UINT16_MAX) {
+        // Not worth recording, file will be verified again next time
+        journal->numNewExtents = file->firstExtent;
+        journal->numNewFiles--;
+        journal->recording = 0;
+        return;
+    }
+    if (new_extent(journal, lbn, blocks) == 0)
+        file->numExtents++;
+}
+
+/**
+ * \brief Set JOURNAL_FILE_* flags of file being verified
+ */
+void journal_set_flags(struct check_journal *journal, uint8_t flags) {
+    if (journal->recording)
+        journal->newFiles[journal->numNewFiles - 1].flags |= flags;
+}
+
+/**
+ * \brief Finish recording of file being verified
+ *
+ * \param[in,out] *journal  check journal
+ * \param[in]     keep      file was verified without errors and can be trusted by next check
+ */
+void journal_end_file(struct check_journal *journal, int keep) {
+    if (!journal->recording)
+        return;
+
+    journal->recording = 0;
+    if (!keep) {
+        journal->numNewExtents = journal->newFiles[journal->numNewFiles - 1].firstExtent;
+        journal->numNewFiles--;
+    }
+}
+
+static int cmp_file(const void *a, const void *b) {
+    const struct journal_file *fa = a, *fb = b;
+
+    if (fa->uniqueID != fb->uniqueID)
+        return fa->uniqueID < fb->uniqueID ? -1 : 1;
+    if (fa->lsn != fb->lsn)
+        return fa->lsn < fb->lsn ? -1 : 1;
+    return 0;
+}
+
+/**
+ * \brief Save state of cleanly checked volume
+ *
+ * Journal is written to temporary file first and then renamed, so the
+ * previous journal stays valid when saving fails.
+ *
+ * \param[in,out] *journal  check journal with records collected by file tree walk
+ * \param[in]     media     Information regarding medium & access to it
+ * \param[in]     *stats    file system status of finished check
+ *
+ * \return 0 journal saved
+ * \return -1 journal could not be saved
+ */
+int journal_save(struct check_journal *journal, udf_media_t *media, struct filesystemStats *stats) {
+    struct journal_header hdr;
+    const struct fileSetDesc *fsd = media->disc.udf_fsd;
+    char *tmppath;
+    FILE *fp;
+    int ret = -1;
+
+    if (journal->overflow || fsd == NULL) {
+        warn("Check journal was not saved, not enough memory.\n");
+        return -1;
+    }
+
+    // Files with the same Unique ID (hard links) are kept only once
+    qsort(journal->newFiles, journal->numNewFiles, sizeof(struct journal_file), cmp_file);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < journal->numNewFiles; ++i) {
+        if (n > 0 && cmp_file(&journal->newFiles[n-1], &journal->newFiles[i]) == 0)
+            continue;
+        journal->newFiles[n++] = journal->newFiles[i];
+    }
+    journal->numNewFiles = n;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    hdr.blocksize = stats->blocksize;
+    hdr.lbnlsn = stats->lbnlsn;
+    hdr.partitionNumBlocks = stats->found.partitionNumBlocks;
+    memcpy(hdr.logicalVolIdent, fsd->logicalVolIdent, sizeof(hdr.logicalVolIdent));
+    hdr.fsdRecordingTime = fsd->recordingDateAndTime;
+    hdr.lvidRecordedTime = stats->lvid.recordedTime;
+    hdr.lvidNextUID = stats->lvid.nextUID;
+    hdr.lvidNumFiles = stats->lvid.numFiles;
+    hdr.lvidNumDirs = stats->lvid.numDirs;
+    hdr.lvidFreeSpaceBlocks = stats->lvid.freeSpaceBlocks;
+    hdr.foundNumFiles = stats->found.numFiles;
+    hdr.foundNumDirs = stats->found.numDirs;
+    hdr.foundFreeSpaceBlocks = stats->found.freeSpaceBlocks;
+    hdr.foundNextUID = stats->found.nextUID;
+    hdr.foundMinUDFReadRev = stats->found.minUDFReadRev;
+    hdr.foundMinUDFWriteRev = stats->found.minUDFWriteRev;
+    hdr.foundMaxUDFWriteRev = stats->found.maxUDFWriteRev;
+    hdr.bitmapDigest = journal_bitmap_digest(stats->expPartitionBitmap, bitmap_blocks(stats));
+    hdr.numFiles = journal->numNewFiles;
+    hdr.numExtents = journal->numNewExtents;
+
+    tmppath = malloc(strlen(journal->path) + 5);
+    if (tmppath == NULL)
+        return -1;
+    sprintf(tmppath, "%s.tmp", journal->path);
+
+    fp = fopen(tmppath, "wb");
+    if (fp == NULL) {
+        warn("Cannot create check journal %s: %s\n", tmppath, strerror(errno));
+        free(tmppath);
+        return -1;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+        && (hdr.numFiles == 0 || fwrite(journal->newFiles, sizeof(struct journal_file), hdr.numFiles, fp) == hdr.numFiles)
+        && (hdr.numExtents == 0 || fwrite(journal->newExtents, sizeof(struct journal_extent), hdr.numExtents, fp) == hdr.numExtents)
+        && fflush(fp) == 0) {
+        ret = 0;
+    }
+    if (fclose(fp) != 0)
+        ret = -1;
+
+    if (ret == 0 && rename(tmppath, journal->path) != 0)
+        ret = -1;
+
+    if (ret != 0) {
+        warn("Cannot save check journal %s: %s\n", journal->path, strerror(errno));
+        remove(tmppath);
+    } else {
+        msg("Check journal saved: %u files.\n", hdr.numFiles);
+    }
+
+    free(tmppath);
+    return ret;
+}
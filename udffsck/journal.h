@@ -0,0 +1,126 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "udffsck.h"
+
+#define JOURNAL_MAGIC   "UDFFSCKJ"  ///< First bytes of check journal file
+#define JOURNAL_VERSION 1           ///< Version of check journal file layout
+
+#define JOURNAL_FILE_COUNTED 0x01   ///< File is counted in LVID number of files
+#define JOURNAL_FILE_EFE     0x02   ///< File is recorded in EFE (UDF 2.00+)
+
+/**
+ * \brief Volume state recorded by the last clean check
+ */
+struct journal_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    blocksize;
+    uint32_t    lbnlsn;
+    uint32_t    partitionNumBlocks;
+    dstring     logicalVolIdent[128];   ///< FSD Logical Volume Identifier
+    timestamp   fsdRecordingTime;       ///< FSD Recording Date and Time
+    timestamp   lvidRecordedTime;       ///< LVID Recording Date and Time
+    uint64_t    lvidNextUID;
+    uint32_t    lvidNumFiles;
+    uint32_t    lvidNumDirs;
+    uint32_t    lvidFreeSpaceBlocks;
+    uint32_t    foundNumFiles;
+    uint32_t    foundNumDirs;
+    uint32_t    foundFreeSpaceBlocks;
+    uint64_t    foundNextUID;
+    uint16_t    foundMinUDFReadRev;
+    uint16_t    foundMinUDFWriteRev;
+    uint16_t    foundMaxUDFWriteRev;
+    uint16_t    reserved;
+    uint64_t    bitmapDigest;           ///< digest of recorded space bitmap, 0 without bitmap
+    uint32_t    numFiles;               ///< number of journal_file records
+    uint32_t    numExtents;             ///< number of journal_extent records
+} __attribute__ ((packed));
+
+/**
+ * \brief Verified non-directory file, keyed by FID Unique ID and ICB position
+ */
+struct journal_file {
+    uint32_t uniqueID;      ///< lower 32 bits of Unique ID recorded in FID
+    uint32_t lsn;           ///< LSN of (E)FE
+    uint32_t firstExtent;   ///< index of first extent
+    uint16_t numExtents;    ///< number of extents, including (E)FE and AEDs
+    uint8_t  flags;         ///< JOURNAL_FILE_* flags
+    uint8_t  reserved;
+} __attribute__ ((packed));
+
+/**
+ * \brief Blocks accounted to verified file
+ */
+struct journal_extent {
+    uint32_t lbn;
+    uint32_t blocks;
+} __attribute__ ((packed));
+
+/**
+ * \brief Check journal used for incremental checks
+ *
+ * Records of the last clean check are loaded into files and extents. While
+ * file tree is walked, records of all files found on medium (both replayed
+ * and newly verified) are collected into newFiles and newExtents, which are
+ * saved when the check ends clean.
+ */
+struct check_journal {
+    char                   *path;
+    int                     loaded;         ///< records of previous check are valid
+    int                     unchanged;      ///< volume did not change, file tree was not walked
+    struct journal_header   hdr;
+    struct journal_file    *files;
+    struct journal_extent  *extents;
+
+    struct journal_file    *newFiles;
+    uint32_t                numNewFiles;
+    uint32_t                sizeNewFiles;
+    struct journal_extent  *newExtents;
+    uint32_t                numNewExtents;
+    uint32_t                sizeNewExtents;
+    int                     recording;      ///< file recorded in newFiles[numNewFiles-1] is open
+    int                     overflow;       ///< allocation failed, journal is not saved
+
+    uint64_t                replayed;       ///< files accounted from journal during walk
+};
+
+int journal_load(struct check_journal *journal, const char *path);
+void journal_free(struct check_journal *journal);
+int journal_save(struct check_journal *journal, udf_media_t *media, struct filesystemStats *stats);
+int journal_matches(const struct check_journal *journal, udf_media_t *media, struct filesystemStats *stats);
+uint64_t journal_bitmap_digest(const uint8_t *bitmap, uint32_t numBlocks);
+void journal_reset_walk(struct check_journal *journal);
+uint8_t journal_check_file_structure(udf_media_t *media, struct filesystemStats *stats,
+                                     vds_sequence_t *seq, struct check_journal *journal);
+
+const struct journal_file *journal_find_file(const struct check_journal *journal, uint32_t uniqueID, uint32_t lsn);
+void journal_keep_file(struct check_journal *journal, const struct journal_file *file);
+void journal_begin_file(struct check_journal *journal, uint32_t uniqueID, uint32_t lsn);
+void journal_add_extent(struct check_journal *journal, uint32_t lbn, uint32_t blocks);
+void journal_set_flags(struct check_journal *journal, uint8_t flags);
+void journal_end_file(struct check_journal *journal, int keep);
+
+#endif //__JOURNAL_H__
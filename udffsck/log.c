@@ -20,7 +20,11 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <inttypes.h>
+#include <sys/param.h>
 
 #include "log.h"
 #include "options.h"
@@ -47,6 +51,159 @@ typedef enum {
 
 verbosity_e verbosity;
 
+static __thread log_sink_fn sink;  ///< Per-thread output redirection, see log_sink()
+static __thread void *sink_arg;
+static __thread char *log_buf;     ///< Per-thread formatting buffer, grown on demand
+static __thread size_t log_buf_size;
+
+static FILE *error_stream;         ///< JSON lines record of warnings and errors, see log_error_stream()
+
+/**
+ * \brief Redirect log output of calling thread
+ *
+ * Formatted messages (including prefix and colors) are passed to \p fn instead
+ * of being printed, together with the stream they would be printed to.
+ *
+ * \param[in] fn   output callback, NULL restores printing
+ * \param[in] arg  first argument of \p fn
+ */
+void log_sink(log_sink_fn fn, void *arg) {
+    sink = fn;
+    sink_arg = arg;
+    if (fn == NULL) {
+        // Worker threads reset their sink before they exit
+        free(log_buf);
+        log_buf = NULL;
+        log_buf_size = 0;
+    }
+}
+
+/**
+ * \brief Open record of warnings and errors
+ *
+ * Every warning, error and fatal error is written to \p path as one JSON object per line with
+ * time, level and message, independently of verbosity.
+ *
+ * \param[in] path  file to create, "-" for stderr
+ *
+ * \return 0 on success, -1 if file cannot be created
+ */
+int log_error_stream(const char *path) {
+    if(strcmp(path, "-") == 0) {
+        error_stream = stderr;
+        return 0;
+    }
+    error_stream = fopen(path, "w");
+    if(error_stream == NULL)
+        return -1;
+    setvbuf(error_stream, NULL, _IOLBF, 0);
+    return 0;
+}
+
+/**
+ * \brief Close record opened by log_error_stream() and release buffer of calling thread
+ */
+void log_close(void) {
+    if(error_stream != NULL && error_stream != stderr)
+        fclose(error_stream);
+    error_stream = NULL;
+    free(log_buf);
+    log_buf = NULL;
+    log_buf_size = 0;
+}
+
+/**
+ * \brief Make sure per-thread buffer can hold \p size bytes
+ */
+static int reserve_buf(size_t size) {
+    char *buf;
+
+    if(size <= log_buf_size)
+        return 0;
+    if(size < 1024)
+        size = 1024;
+    buf = realloc(log_buf, size);
+    if(buf == NULL)
+        return -1;
+    log_buf = buf;
+    log_buf_size = size;
+    return 0;
+}
+
+static void log_to_sink(FILE *stream, char *color, char *prefix, const char *format, va_list arg) {
+    size_t len;
+    va_list copy;
+
+    if (reserve_buf(1024) != 0)
+        return;
+    for(;;) {
+        size_t size = log_buf_size;
+        int n;
+        if(prefix != NULL)
+            n = snprintf(log_buf, size, "%s[%s] ", color, prefix);
+        else
+            n = snprintf(log_buf, size, "%s", color);
+        len = n;
+        va_copy(copy, arg);
+        n = vsnprintf(log_buf + MIN(len, size), size - MIN(len, size), format, copy);
+        va_end(copy);
+        if (n < 0)
+            return;
+        len += n;
+        if(colored == 1) {
+            n = snprintf(log_buf + MIN(len, size), size - MIN(len, size), ANSI_COLOR_RESET EOL);
+            len += n;
+        }
+        if (len < size)
+            break;
+        if (reserve_buf(len + 1) != 0)
+            return;
+    }
+
+    sink(sink_arg, stream, log_buf, len);
+}
+
+static void log_record(const char *level, const char *format, va_list arg) {
+    struct timespec ts;
+    va_list copy;
+    int n;
+
+    if (reserve_buf(1024) != 0)
+        return;
+    va_copy(copy, arg);
+    n = vsnprintf(log_buf, log_buf_size, format, copy);
+    va_end(copy);
+    if (n < 0)
+        return;
+    if ((size_t)n >= log_buf_size) {
+        if (reserve_buf(n + 1) != 0)
+            return;
+        va_copy(copy, arg);
+        vsnprintf(log_buf, log_buf_size, format, copy);
+        va_end(copy);
+    }
+    while (n > 0 && log_buf[n-1] == '\n')
+        n--;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    flockfile(error_stream);
+    fprintf(error_stream, "{\"time\":%lld.%03ld,\"level\":\"%s\",\"message\":\"",
+            (long long)ts.tv_sec, ts.tv_nsec / 1000000, level);
+    for (int i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)log_buf[i];
+        if (c == '"' || c == '\\')
+            fprintf(error_stream, "\\%c", c);
+        else if (c == '\n')
+            fputs("\\n", error_stream);
+        else if (c < 0x20)
+            fprintf(error_stream, "\\u%04x", c);
+        else
+            putc_unlocked(c, error_stream);
+    }
+    fputs("\"}\n", error_stream);
+    funlockfile(error_stream);
+}
+
 /**
  * \brief Simple prompt printing out message and accepting y/Y/n/N. Anything else restarts prompt.
  *
@@ -138,11 +295,18 @@ void logger(message_type type, char *color, const char *format, va_list arg) {
 			break;
 	}
 
+    if (error_stream != NULL && (type == warning || type == error || type == faterr))
+        log_record(prefix, format, arg);
+
     if(verbosity >= verblvl) {
-        if (stream == stderr)
-            fflush(stdout);
         if(color == NULL || colored == 0)
             color = "";
+        if (sink) {
+            log_to_sink(stream, color, prefix, format, arg);
+            return;
+        }
+        if (stream == stderr)
+            fflush(stdout);
         if(prefix != NULL)
             fprintf(stream, "%s[%s] ", color, prefix);
         else
@@ -164,7 +328,7 @@ void logger(message_type type, char *color, const char *format, va_list arg) {
  *
  * \param[in] *format string to print
  */
-void dbg(const char *format, ...) {
+void log_dbg(const char *format, ...) {
 	va_list arg;
 	va_start (arg, format);
 	logger(debug, "", format, arg);
@@ -180,7 +344,7 @@ void dbg(const char *format, ...) {
  *
  * \param[in] *format string to print
  */
-void dwarn(const char *format, ...) {
+void log_dwarn(const char *format, ...) {
 	va_list arg;
 	va_start (arg, format);
 	logger(debug, ANSI_COLOR_YELLOW, format, arg);
@@ -196,7 +360,7 @@ void dwarn(const char *format, ...) {
  *
  * \param[in] *format string to print
  */
-void note(const char *format, ...) {
+void log_note(const char *format, ...) {
 	va_list arg;
 	va_start (arg, format);
 	logger(show, "", format, arg);
@@ -212,7 +376,7 @@ void note(const char *format, ...) {
  *
  * \param[in] *format string to print
  */
-void msg(const char *format, ...) {
+void log_msg(const char *format, ...) {
 	va_list arg;
 	va_start (arg, format);
 	logger(message, "", format, arg);
@@ -228,7 +392,7 @@ void msg(const char *format, ...) {
  *
  * \param[in] *format string to print
  */
-void imp(const char *format, ...) {
+void log_imp(const char *format, ...) {
 	va_list arg;
 	va_start (arg, format);
 	logger(important, ANSI_COLOR_GREEN, format, arg);
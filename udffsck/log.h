@@ -41,15 +41,37 @@ typedef enum {
 
 extern verbosity_e verbosity;
 
-void dbg(const char *format, ...);
-void dwarn(const char *format, ...);
-void note(const char *format, ...);
-void msg(const char *format, ...);
-void imp(const char *format, ...);
+/**
+ * Highest verbosity level compiled in. Messages above it are removed by compiler, e.g. build with
+ * CPPFLAGS=-DLOG_LEVEL_MAX=1 keeps only warnings and errors.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX DBG
+#endif
+
+#define log_enabled(lvl) ((lvl) <= LOG_LEVEL_MAX && verbosity >= (lvl))
+
+typedef void (*log_sink_fn)(void *arg, FILE *stream, const char *text, size_t length);
+void log_sink(log_sink_fn fn, void *arg);
+int log_error_stream(const char *path);
+void log_close(void);
+
+void log_dbg(const char *format, ...);
+void log_dwarn(const char *format, ...);
+void log_note(const char *format, ...);
+void log_msg(const char *format, ...);
+void log_imp(const char *format, ...);
 void warn(const char *format, ...);
 void err(const char *format, ...);
 void fatal(const char *format, ...);
 
+// Level is tested before arguments are evaluated, so disabled messages cost one comparison
+#define dbg(...)    do { if (log_enabled(DBG)) log_dbg(__VA_ARGS__); } while (0)
+#define dwarn(...)  do { if (log_enabled(DBG)) log_dwarn(__VA_ARGS__); } while (0)
+#define note(...)   do { if (log_enabled(DBG)) log_note(__VA_ARGS__); } while (0)
+#define msg(...)    do { if (log_enabled(MSG)) log_msg(__VA_ARGS__); } while (0)
+#define imp(...)    do { if (log_enabled(WARN)) log_imp(__VA_ARGS__); } while (0)
+
 char * verbosity_level_str(verbosity_e lvl);
 
 
@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <sys/param.h>
 #include <signal.h>
 #include <mntent.h>
 #include <sys/vfs.h>
@@ -46,6 +47,13 @@
 #include "utils.h"
 #include "options.h"
 #include "udffsck.h"
+#include "cache.h"
+#include "badblocks.h"
+#include "report.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "repair.h"
+#include "checkpoint.h"
 
 
 #define PRINT_DISC 
@@ -56,9 +64,15 @@
  * \brief User interrupt hander (Ctrl + C or SIGINT)
  *
  * After calling this, program exits with code 32 (User interrupt).
+ * During checkpointed file tree walk the first interrupt only requests
+ * checkpoint, the walk exits after saving it.
  */
 void user_interrupt(int dummy) {
     (void)dummy;
+    if (checkpoint_armed && !checkpoint_interrupted) {
+        checkpoint_interrupted = 1;
+        return;
+    }
     warn("\nUser interrupted operation. Exiting.\n");
     exit(ESTATUS_USER_CANCEL);
 }
@@ -84,6 +98,8 @@ void segv_interrupt(int dummy) {
 void sigbus_interrupt(int dummy) {
     (void)dummy;
     fatal("Medium changed size during fsck run. Is somebody manipulating it? Exiting.\n");
+    if (checkpoint_armed)
+        fatal("File tree check can be continued from the last checkpoint with --resume.\n");
     exit(ESTATUS_OPERATIONAL_ERROR);
 }
 
@@ -117,6 +133,26 @@ int any_error(vds_sequence_t *seq) {
 #define ES_PD    0x0004
 #define ES_LVID  0x0008
 
+/**
+ * \brief Result of count_bitmap_diff()
+ */
+struct bitmap_diff {
+    uint32_t numBits;       ///< blocks covered by both bitmaps
+    uint32_t diffBlocks;    ///< blocks differing so far
+};
+
+/**
+ * \brief Count blocks of window of actual bitmap differing from recorded bitmap, for for_each_bitmap_window()
+ */
+static int count_bitmap_diff(struct filesystemStats *stats, uint32_t start, uint32_t length, void *arg) {
+    struct bitmap_diff *diff = arg;
+
+    if (start < diff->numBits)
+        diff->diffBlocks += page_bitmap_count_diff(stats->actPartitionBitmap, stats->expPartitionBitmap,
+                                                   start, MIN(length, diff->numBits - start));
+    return 0;
+}
+
 static void integrity_msg(const char* label, const char* valueFormat,
                           uint64_t lvidValue, uint64_t calcValue,
                           int bPrintLVID)
@@ -186,12 +222,16 @@ int main(int argc, char *argv[]) {
     int force_sectorsize = 0;
     int third_avdp_missing = 0;
     struct sigaction new_action;
+    struct check_journal journal;
+    struct repair_txn repair;
+    struct checkpoint checkpoint;
     int source = -1;
 
     memset(&media, 0, sizeof(media));
     media.sectorsize = -1;
 
     memset(&stats, 0, sizeof(struct filesystemStats));
+    memset(&journal, 0, sizeof(struct check_journal));
     stats.found.nextUID = 0x10;     // Min valid unique ID
     stats.found.maxUDFWriteRev = MAX_VERSION;
 
@@ -210,6 +250,32 @@ int main(int argc, char *argv[]) {
 #endif
 
     parse_args(argc, argv, &path, &media.sectorsize);
+    if(batch_jobs > 0) {
+        // Children share stdin and output files, so nothing can be asked or written by them
+        if(interactive || journal_path != NULL || checkpoint_path != NULL || progress_target != NULL
+           || (error_log_path != NULL && strcmp(error_log_path, "-") != 0)
+           || (report_path != NULL && strcmp(report_path, "-") != 0)) {
+            err("Batch mode cannot be combined with -i, -J, -K, -G, -E FILE or -R json:FILE.\n");
+            exit(ESTATUS_USAGE);
+        }
+        int index = udf_batch(batch_devices, batch_count, batch_jobs, &status);
+        if(index < 0)
+            exit(status);
+        path = batch_devices[index];
+    }
+    if(error_log_path != NULL && log_error_stream(error_log_path) != 0) {
+        err("Cannot create error log %s: %s\n", error_log_path, strerror(errno));
+        exit(ESTATUS_USAGE);
+    }
+    if(udf_trace_start("udffsck") != 0) {
+        err("Cannot enable trace: %s\n", strerror(errno));
+        exit(ESTATUS_OPERATIONAL_ERROR);
+    }
+    // Started before any other thread, they inherit blocked SIGUSR1
+    if(progress_target != NULL && udf_progress_start("udffsck", progress_target) != 0) {
+        err("Cannot report progress to %s: %s\n", progress_target, strerror(errno));
+        exit(ESTATUS_USAGE);
+    }
 #ifdef MEMTRACE
     dbg("Path: %p\n", path);    
 #endif
@@ -255,7 +321,7 @@ int main(int argc, char *argv[]) {
 
     media.fd = open(path, flags, 0660);
     if (media.fd == -1) {
-        fatal("Error opening %s: %s.", path, strerror(errno));
+        fatal("Error opening %s: %s.\n", path, strerror(errno));
         exit(ESTATUS_USAGE);
     } else {
         int fd2;
@@ -306,7 +372,7 @@ int main(int argc, char *argv[]) {
     }
 
     if((fp = fopen(path, "r")) == NULL) {
-        fatal("Error opening %s: %s.", path, strerror(errno));
+        fatal("Error opening %s: %s.\n", path, strerror(errno));
         exit(ESTATUS_USAGE);
     }
 
@@ -331,22 +397,30 @@ int main(int argc, char *argv[]) {
     media.devsize = ftello(fp);
     dbg("Size: 0x%" PRIx64 "\n", media.devsize);
 
-    uint32_t chunksize = CHUNK_SIZE;
-    uint32_t rest       = (uint32_t) media.devsize % chunksize;
-    uint32_t num_chunks = (uint32_t) ((media.devsize / chunksize) + (rest > 0 ? 1 : 0));
-    dbg("Chunk size %u, rest: %u\n", chunksize, rest);
-    media.mapping = calloc(sizeof(uint8_t *), num_chunks);
-    dbg("Amount of chunks: %u\n", num_chunks);
-    for(uint32_t i=0; i<num_chunks; i++) {
-        media.mapping[i] = NULL;
+    // Half of memory limit is given to block cache, a quarter to partition bitmap
+    if(memory_limit > 0)
+        cache_size = MIN(cache_size, MAX(memory_limit / 2, cache_window));
+    if(cache_init(&media, cache_window, cache_size) != 0) {
+        fatal("Cannot set up block cache.\n");
+        exit(ESTATUS_OPERATIONAL_ERROR);
+    }
+    // Unreadable sectors are read as zeros instead of killing the check by SIGBUS
+    if(badblocks_init(&media) != 0) {
+        fatal("Cannot set up reading of unreadable sectors: %s\n", strerror(errno));
+        exit(ESTATUS_OPERATIONAL_ERROR);
     }
+    // Repairs of volume structures are written together at the end of fix phases
+    if(interactive || autofix)
+        repair_begin(&media, &repair);
 
     //------------- Detections -----------------------
 
     seq = calloc(1, sizeof(vds_sequence_t));
 
     stats.AVDPSerialNum = 0xFFFF;
+    report_phase(PHASE_VRS);
     status = is_udf(&media, force_sectorsize, &stats); // Check for UDF recognition sequence. Also tries to detect blocksize.
+    report_phase(PHASE_AVDP);
     if(status < 0) {
         exit(status);
     } else if(status == 1) { //Unclosed or bridged medium 
@@ -419,6 +493,7 @@ int main(int argc, char *argv[]) {
             exit(ESTATUS_USAGE);
     }
 
+    report_phase(PHASE_VDS);
     note("\nTrying to load first VDS\n");
     status |= get_vds(&media, source, MAIN_VDS, seq); //load main VDS
     note("\nTrying to load second VDS\n");
@@ -435,6 +510,7 @@ int main(int argc, char *argv[]) {
         exit(status | blocksize_status);
 
 
+    report_phase(PHASE_LVID);
     integrity_info_t *lvid = &stats.lvid;
     status |= get_lvid(&media, lvid, seq);
     if(lvid->minUDFReadRev > MAX_VERSION){
@@ -449,11 +525,13 @@ int main(int argc, char *argv[]) {
 
     stats.blocksize = media.sectorsize;
 
+    report_phase(PHASE_PD);
     if (get_pd(&media, &stats, seq)) {
         err("PD error\n");
         exit(ESTATUS_OPERATIONAL_ERROR);
     }
 
+    report_phase(PHASE_FSD);
     dbg("STATUS: 0x%02x\n", status);
     status |= get_fsd(&media, &stats, seq);
     dbg("STATUS: 0x%02x\n", status);
@@ -466,10 +544,54 @@ int main(int argc, char *argv[]) {
     }
 
     note("LBN 0: LSN %u\n", stats.lbnlsn);
-    if (any_error(seq) || (media.disc.udf_lvid->integrityType != LVID_INTEGRITY_TYPE_CLOSE) || !fast_mode) {
-        status |= get_file_structure(&media, &stats, seq);
+    report_phase(PHASE_FILE_TREE);
+    if (!(seq->lvid.error & (E_CRC | E_CHECKSUM | E_WRONGDESC)))
+        udf_progress_total(UDF_PROGRESS_FILES, (uint64_t)lvid->numFiles + lvid->numDirs);
+    if (journal_path && stats.actPartitionBitmap->windowBits > 0) {
+        warn("Check journal is not used when partition bitmap does not fit into memory limit.\n");
+        journal_path = NULL;
+    }
+    if (journal_path)
+        journal_load(&journal, journal_path);
+    if (checkpoint_path) {
+        if (interactive || autofix || journal_path || scan_mode || stats.actPartitionBitmap->windowBits > 0) {
+            warn("Checkpoints are used only in check mode without check journal, two pass check "
+                 "and partition bitmap limited by memory.\n");
+        } else {
+            checkpoint_init(&checkpoint, checkpoint_path, checkpoint_interval, &media, &stats);
+            if (resume)
+                checkpoint_load(&checkpoint, &stats);
+            stats.checkpoint = &checkpoint;
+        }
+    }
+    if (any_error(seq) || (le32_to_cpu(media.disc.udf_lvid->integrityType) != LVID_INTEGRITY_TYPE_CLOSE) || !fast_mode) {
+        if (journal_path && !any_error(seq) && (le32_to_cpu(media.disc.udf_lvid->integrityType) == LVID_INTEGRITY_TYPE_CLOSE)
+            && journal_matches(&journal, &media, &stats)) {
+            status |= journal_check_file_structure(&media, &stats, seq, &journal);
+        } else {
+            // Full check, verified files are recorded for the next run
+            if (journal_path) {
+                journal.loaded = 0;
+                stats.journal = &journal;
+            }
+            status |= get_file_structure(&media, &stats, seq);
+            // Walk finished, its checkpoint is not needed anymore
+            if (stats.checkpoint)
+                checkpoint_remove(stats.checkpoint);
+        }
+    }
+    if (stats.checkpoint) {
+        checkpoint_free(stats.checkpoint);
+        stats.checkpoint = NULL;
+    }
+    // Marks outside of the window kept during the walk are checked now
+    if (stats.actPartitionBitmap->windowBits > 0
+        && for_each_bitmap_window(&stats, 1, NULL, NULL) != 0) {
+        err("Cannot read back marks of partition bitmap.\n");
+        status |= ESTATUS_OPERATIONAL_ERROR;
     }
 
+    report_phase(PHASE_VERIFY);
     dbg("PD PartitionsContentsUse\n");
     for(int i=0; i<128; ) {
         for(int j=0; j<8; j++, i++) {
@@ -533,6 +655,22 @@ int main(int argc, char *argv[]) {
         } else if (spaceDescDiffBlocks < 0) {
             err("%" PRId64 " blocks are used but marked as unallocated in SBD.\n", -spaceDescDiffBlocks);
             seq->pd.error |= E_FREESPACE;
+        } else if (stats.expPartitionBitmap != NULL) {
+            // Counts match, but allocated blocks can still be elsewhere
+            struct bitmap_diff diff = {
+                .numBits = MIN(stats.found.partitionNumBlocks, stats.spacedesc.partitionNumBlocks),
+            };
+            uint32_t diffBlocks = 0;
+            if (for_each_bitmap_window(&stats, 0, count_bitmap_diff, &diff) != 0) {
+                err("Cannot read back marks of partition bitmap.\n");
+                status |= ESTATUS_OPERATIONAL_ERROR;
+            } else {
+                diffBlocks = diff.diffBlocks;
+            }
+            if (diffBlocks > 0) {
+                err("%u blocks have wrong allocation state in SBD.\n", diffBlocks);
+                seq->pd.error |= E_FREESPACE;
+            }
         }
     }
 
@@ -557,6 +695,7 @@ int main(int argc, char *argv[]) {
     status |= dstring_error("IUVD, Reserve VDS, Logical Volume Info 3", stats.dstringIUVDLVInfo3Err[RESERVE_VDS]);
     status |= dstring_error("IUVD, Reserve VDS, Logical Volume Identifier", stats.dstringIUVDLogicalVolIdentErr[RESERVE_VDS]);
 
+    report_phase(PHASE_FIX_AVDP);
     if(seq->anchor[0].error + seq->anchor[1].error + seq->anchor[2].error != 0) { //Something went wrong with AVDPs
         int target1 = -1;
         int target2 = -1;
@@ -635,8 +774,10 @@ int main(int argc, char *argv[]) {
 
     print_metadata_sequence(seq);
 
+    report_phase(PHASE_FIX_VDS);
     status |= fix_vds(&media, source, seq);
 
+    report_phase(PHASE_FIX_LVID);
     int fixlvid = 0;
     int fixpd = 0;
     int lviderr = lvid_invalid;
@@ -644,7 +785,7 @@ int main(int argc, char *argv[]) {
         err("Max found Unique ID is same or bigger that Unique ID found at LVID.\n");
         lviderr = 1;
     }
-    if (media.disc.udf_lvid->integrityType != LVID_INTEGRITY_TYPE_CLOSE) {
+    if (le32_to_cpu(media.disc.udf_lvid->integrityType) != LVID_INTEGRITY_TYPE_CLOSE) {
         //There are some unfinished writes
         err("Opened integrity type. Some writes may be unfinished.\n");
         lviderr = 1;
@@ -696,13 +837,21 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if(repair_commit(&media) != 0) {
+        fatal("Writing repairs failed: %s\n", strerror(errno));
+        status |= ESTATUS_OPERATIONAL_ERROR;
+    } else if(media.repair != NULL && repair.runs > 0) {
+        note("Repairs written: %" PRIu64 " bytes in %u writes\n", repair.bytes, repair.runs);
+    }
+
 #if DEBUG && 0
     note("\n ACT \t EXP\n");
     uint32_t shift = 0;
     uint32_t line = 0;
     uint32_t amount = 50000;
     for(int i=0+shift, k=0+shift; i<stats.partitionNumBlocks/8 && i < amount+shift; ) {
-        note("[%04u] ",line++);
+        note("[%04u] ", line);
+        line++;
         for(int j=0; j<16; j++, i++) {
             note("%02x ", stats.actPartitionBitmap[i]);
         }
@@ -715,6 +864,11 @@ int main(int argc, char *argv[]) {
 #endif
 
     //---------------- Error & Fix Status -------------
+    if(badblocks_bytes() > 0) {
+        badblocks_print(&media);
+        status |= ESTATUS_UNCORRECTED_ERRORS;
+    }
+
     if(error_status != 0) {
         status |= ESTATUS_UNCORRECTED_ERRORS; //Errors remained unfixed
     }
@@ -729,33 +883,48 @@ int main(int argc, char *argv[]) {
     else if(status == ESTATUS_CORRECTED_ERRORS) {
         msg("Filesystem errors were fixed.\n");
     }
+    // Only clean result can be trusted by next check
+    if (stats.journal && !journal.unchanged && status == ESTATUS_OK
+        && le32_to_cpu(media.disc.udf_lvid->integrityType) == LVID_INTEGRITY_TYPE_CLOSE) {
+        journal_save(&journal, &media, &stats);
+    }
+
+    udf_progress_stop();
+
+    // Block cache counters are still needed
+    if (report_path && report_write(report_path, &media, path, &stats, status) != 0)
+        err("Cannot write report to %s: %s\n", report_path, strerror(errno));
+
     //---------------- Clean up -----------------
 
     note("Clean allocations\n");
-    free(media.mapping);
+    journal_free(&journal);
 
-    free(media.disc.udf_anchor[0]);
-    free(media.disc.udf_anchor[1]);
-    free(media.disc.udf_anchor[2]);
+    // Descriptors are referenced in block cache, release them first
+    for(int i = 0; i < 2; i++) {
+        release_descriptor(&media, media.disc.udf_pvd[i]);
+        release_descriptor(&media, media.disc.udf_lvd[i]);
+        release_descriptor(&media, media.disc.udf_usd[i]);
+        release_descriptor(&media, media.disc.udf_iuvd[i]);
+        release_descriptor(&media, media.disc.udf_pd[i]);
+        release_descriptor(&media, media.disc.udf_td[i]);
+    }
 
-    free(media.disc.udf_pvd[0]);
-    free(media.disc.udf_lvd[0]);
-    free(media.disc.udf_usd[0]);
-    free(media.disc.udf_iuvd[0]);
-    free(media.disc.udf_pd[0]);
-    free(media.disc.udf_td[0]);
+    release_descriptor(&media, media.disc.udf_lvid);
+    release_descriptor(&media, media.disc.udf_fsd);
+    release_descriptor(&media, stats.expPartitionBitmap);
 
-    free(media.disc.udf_pvd[1]);
-    free(media.disc.udf_lvd[1]);
-    free(media.disc.udf_usd[1]);
-    free(media.disc.udf_iuvd[1]);
-    free(media.disc.udf_pd[1]);
-    free(media.disc.udf_td[1]);
+    repair_free(&media);
+    cache_free(&media);
+    badblocks_free();
 
-    free(media.disc.udf_lvid);
-    free(media.disc.udf_fsd);
+    free(media.disc.udf_anchor[0]);
+    free(media.disc.udf_anchor[1]);
+    free(media.disc.udf_anchor[2]);
 
     free(seq);
+    if (stats.actPartitionBitmap)
+        page_bitmap_free(stats.actPartitionBitmap);
     free(stats.actPartitionBitmap);
     free(stats.volumeSetIdent);
     free(stats.partitionIdent);
@@ -765,5 +934,6 @@ int main(int argc, char *argv[]) {
     fclose(fp);
 
     msg("All done\n");
+    log_close();
     return status;
 }
@@ -21,16 +21,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <malloc.h>
+#include <string.h>
 
 #include "libudffs.h"
 #include "options.h"
 #include "utils.h"
+#include "cache.h"
+#include "prefetch.h"
+#include "checkpoint.h"
 
 verbosity_e verbose = NONE;
 int interactive = 0;
 int autofix = 0;
 int colored = 0;
 int fast_mode = 0;
+int jobs = 1;
+uint32_t cache_window = CHUNK_SIZE;
+uint64_t cache_size = CACHE_SIZE;
+char *journal_path = NULL;
+uint32_t prefetch_window = PREFETCH_WINDOW;
+int scan_mode = 0;
+int medium_io = CACHE_IO_MMAP;
+unsigned int queue_depth = UDF_MEDIUM_QUEUE_DEPTH;
+char *error_log_path = NULL;
+char *report_path = NULL;
+uint64_t memory_limit = 0;
+unsigned int batch_jobs = 0;
+char **batch_devices = NULL;
+unsigned int batch_count = 0;
+char *checkpoint_path = NULL;
+unsigned int checkpoint_interval = CHECKPOINT_INTERVAL;
+int resume = 0;
+char *progress_target = NULL;
+
+/**
+ * Short options for getopt_long() parser function.
+ */
+static const char short_options[] = "vb:ipcCfj:w:m:J:P:SI:Q:E:R:M:B::K:T:rG::h";
 
 /**
  * Options for getopt_long() parser function.
@@ -45,6 +72,22 @@ static struct option long_options[] =
     {"check", no_argument, 0, 'c'},
     {"colors",    no_argument,       0, 'C'},
     {"fast",    no_argument,       0, 'f'},
+    {"jobs",    required_argument, 0, 'j'},
+    {"cache-window", required_argument, 0, 'w'},
+    {"cache-size", required_argument, 0, 'm'},
+    {"journal", required_argument, 0, 'J'},
+    {"prefetch", required_argument, 0, 'P'},
+    {"scan",    no_argument,       0, 'S'},
+    {"io",      required_argument, 0, 'I'},
+    {"queue-depth", required_argument, 0, 'Q'},
+    {"error-log", required_argument, 0, 'E'},
+    {"report",  required_argument, 0, 'R'},
+    {"memory-limit", required_argument, 0, 'M'},
+    {"batch",   optional_argument, 0, 'B'},
+    {"checkpoint", required_argument, 0, 'K'},
+    {"checkpoint-interval", required_argument, 0, 'T'},
+    {"resume",  no_argument,       0, 'r'},
+    {"progress", optional_argument, 0, 'G'},
     {"help",    no_argument,       0, 'h'},
     {0, 0, 0, 0}
 };
@@ -60,6 +103,22 @@ static char * help[] = {
     "Medium will only be checked. This is default behavior, but this flag overrides -p.",
     "Tool output will be colored with ASCII color codes.",
     "Fast mode: File tree check will be skipped.",
+    "Number of threads checking file tree. Used only in check mode, default is 1.",
+    "Size of medium window mapped at once in MiB. Must be power of 2, default is 8.",
+    "Amount of medium in MiB kept mapped for reuse, default is 256.",
+    "Check journal file. Only files added since last clean check are verified on cleanly closed medium.",
+    "Number of file entries read ahead while directory is checked, 0 disables read ahead, default is 64.",
+    "Two pass file tree check: medium is read sequentially and file tree is resolved from found file entries. Used only in check mode.",
+    "Medium access method: mmap (default), pread or uring. Windows are read into buffers only in check mode.",
+    "Number of reads kept in flight by uring access method, default is 32.",
+    "Record warnings and errors to file as JSON lines, - for stderr.",
+    "Write report with phase timings and counters: json for stdout or json:FILE.",
+    "Memory limit in MiB for block cache and partition bitmap. Bitmap which does not fit is checked in more passes.",
+    "Check all given media, at most jobs (default 4) at once. One record with output and return code per medium is printed.",
+    "Save state of file tree check to file periodically and on interrupt. Used only in check mode.",
+    "Seconds between checkpoints, default is 60.",
+    "Continue interrupted file tree check from checkpoint when volume did not change.",
+    "Report progress with rate and ETA every second: to stderr (default), fd:N or status FILE. SIGUSR1 reports at once.",
     "This help message.",
     ""
 }; 
@@ -72,7 +131,7 @@ void usage(void)
     int i;
 
     printf("udffsck " UDFFSCK_VERSION  " from " PACKAGE_NAME " " PACKAGE_VERSION ".");
-    printf("\nUsage:\n\tudffsck [-icpvvvCh] [-b blocksize] medium\n");
+    printf("\nUsage:\n\tudffsck [-icpvvvCfSh] [-b blocksize] [-j jobs] [-w window] [-m cachesize] [-J journal] [-P prefetch] [-I io] [-Q depth] [-E errorlog] [-R json[:file]] [-M limit] [-B[jobs]] [-K checkpoint [-T seconds] [-r]] [-G[target]] medium...\n");
     printf("Options:\n");
     for (i = 0; long_options[i].name != NULL; i++) {
         if (long_options[i].flag != 0)
@@ -103,13 +162,23 @@ void usage(void)
 void parse_args(int argc, char *argv[], char **path, int *blocksize) 
 {
     int c;
+    long n;
+
+    // Batch mode is found first, standard output holds only its records then
+    opterr = 0;
+    while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        if (c == 'B')
+            batch_jobs = BATCH_JOBS;
+    }
+    opterr = 1;
+    optind = 0;
 
     while (1)
     {
         /* getopt_long stores the option index here. */
         int option_index = 0;
 
-        c = getopt_long (argc, argv, "vb:ipcCfh", long_options, &option_index);
+        c = getopt_long (argc, argv, short_options, long_options, &option_index);
 
         /* Detect the end of the options. */
         if (c == -1)
@@ -129,21 +198,25 @@ void parse_args(int argc, char *argv[], char **path, int *blocksize)
 
             case 'b':
                 *blocksize = strtol(optarg, NULL, 10);
-                printf("Device block size: %d\n", *blocksize);
+                if (batch_jobs == 0)
+                    printf("Device block size: %d\n", *blocksize);
                 break;
 
             case 'i':
-                printf ("Medium will be fixed interactively. Expect questions.\n");
+                if (batch_jobs == 0)
+                    printf ("Medium will be fixed interactively. Expect questions.\n");
                 interactive = 1;
                 break;
 
             case 'p':
-                printf ("Medium will be fixed automatically without questions.\n");
+                if (batch_jobs == 0)
+                    printf ("Medium will be fixed automatically without questions.\n");
                 autofix = 1;
                 break;
 
             case 'c':
-                printf ("Medium will be checked (only). No corrections.\n");
+                if (batch_jobs == 0)
+                    printf ("Medium will be checked (only). No corrections.\n");
                 autofix = 0;
                 break;
 
@@ -151,7 +224,8 @@ void parse_args(int argc, char *argv[], char **path, int *blocksize)
                 verbosity ++;
                 if(verbosity > DBG)
                     verbosity = DBG;
-                printf("Verbosity increased to %s.\n", verbosity_level_str(verbosity));
+                if (batch_jobs == 0)
+                    printf("Verbosity increased to %s.\n", verbosity_level_str(verbosity));
                 break;
 
             case 'C':
@@ -162,6 +236,127 @@ void parse_args(int argc, char *argv[], char **path, int *blocksize)
                 fast_mode = 1;
                 break;
 
+            case 'j':
+                jobs = strtol(optarg, NULL, 10);
+                if(jobs < 1) {
+                    printf("Invalid number of jobs: %s.\n", optarg);
+                    usage();
+                }
+                break;
+
+            case 'w':
+                n = strtol(optarg, NULL, 10);
+                if(n < 1 || n > 1024 || (n & (n - 1)) != 0) {
+                    printf("Invalid cache window size: %s.\n", optarg);
+                    usage();
+                }
+                cache_window = (uint32_t)n << 20;
+                break;
+
+            case 'm':
+                n = strtol(optarg, NULL, 10);
+                if(n < 1) {
+                    printf("Invalid cache size: %s.\n", optarg);
+                    usage();
+                }
+                cache_size = (uint64_t)n << 20;
+                break;
+
+            case 'J':
+                journal_path = optarg;
+                break;
+
+            case 'P':
+                n = strtol(optarg, NULL, 10);
+                if(n < 0 || n > 65536) {
+                    printf("Invalid prefetch window: %s.\n", optarg);
+                    usage();
+                }
+                prefetch_window = (uint32_t)n;
+                break;
+
+            case 'S':
+                scan_mode = 1;
+                break;
+
+            case 'I':
+                if(strcmp(optarg, "mmap") == 0) {
+                    medium_io = CACHE_IO_MMAP;
+                } else {
+                    medium_io = udf_medium_parse_io(optarg);
+                    if(medium_io < 0) {
+                        printf("Invalid medium access method: %s.\n", optarg);
+                        usage();
+                    }
+                }
+                break;
+
+            case 'Q':
+                n = strtol(optarg, NULL, 10);
+                if(n < 1 || n > 4096) {
+                    printf("Invalid queue depth: %s.\n", optarg);
+                    usage();
+                }
+                queue_depth = (unsigned int)n;
+                break;
+
+            case 'E':
+                error_log_path = optarg;
+                break;
+
+            case 'R':
+                if(strcmp(optarg, "json") == 0) {
+                    report_path = "-";
+                } else if(strncmp(optarg, "json:", 5) == 0 && optarg[5] != '\0') {
+                    report_path = optarg + 5;
+                } else {
+                    printf("Invalid report format: %s.\n", optarg);
+                    usage();
+                }
+                break;
+
+            case 'M':
+                n = strtol(optarg, NULL, 10);
+                if(n < 1) {
+                    printf("Invalid memory limit: %s.\n", optarg);
+                    usage();
+                }
+                memory_limit = (uint64_t)n << 20;
+                break;
+
+            case 'B':
+                batch_jobs = BATCH_JOBS;
+                if(optarg) {
+                    n = strtol(optarg, NULL, 10);
+                    if(n < 1 || n > 256) {
+                        printf("Invalid number of batch jobs: %s.\n", optarg);
+                        usage();
+                    }
+                    batch_jobs = (unsigned int)n;
+                }
+                break;
+
+            case 'K':
+                checkpoint_path = optarg;
+                break;
+
+            case 'T':
+                n = strtol(optarg, NULL, 10);
+                if(n < 1 || n > 86400) {
+                    printf("Invalid checkpoint interval: %s.\n", optarg);
+                    usage();
+                }
+                checkpoint_interval = (unsigned int)n;
+                break;
+
+            case 'r':
+                resume = 1;
+                break;
+
+            case 'G':
+                progress_target = optarg ? optarg : "-";
+                break;
+
             case 'h':
                 usage();
                 break;
@@ -173,8 +368,18 @@ void parse_args(int argc, char *argv[], char **path, int *blocksize)
         }
     }
 
+    if (resume && checkpoint_path == NULL) {
+        printf("Resume needs checkpoint file given by -K.\n");
+        usage();
+    }
+
+    if (batch_jobs > 0 && optind < argc) {
+        batch_devices = &argv[optind];
+        batch_count = argc - optind;
+        *path = argv[optind];
+    }
     /* Print any remaining command line arguments (not options). */
-    if (optind < argc)
+    else if (optind < argc)
     {
         dbg("Optind: %d\n", optind);
         dbg("non-option ARGV-elements: ");
@@ -33,6 +33,24 @@ extern int autofix;
 extern verbosity_e verbosity;
 extern int colored;
 extern int fast_mode;
+extern int jobs;
+extern uint32_t cache_window;
+extern uint64_t cache_size;
+extern char *journal_path;
+extern uint32_t prefetch_window;
+extern int scan_mode;
+extern int medium_io;
+extern unsigned int queue_depth;
+extern char *error_log_path;
+extern char *report_path;
+extern uint64_t memory_limit;
+extern unsigned int batch_jobs;
+extern char **batch_devices;
+extern unsigned int batch_count;
+extern char *checkpoint_path;
+extern unsigned int checkpoint_interval;
+extern int resume;
+extern char *progress_target;
 
 /*
  * Command line option token values.
@@ -43,4 +61,6 @@ extern int fast_mode;
 
 #define OPT_HELP        0x1000
 
+#define BATCH_JOBS      4   ///< Media checked at once by --batch without value
+
 #endif /* _OPTIONS_H */
@@ -0,0 +1,167 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Read ahead of ICBs during directory walk
+ *
+ * Before FIDs of a directory are inspected, ICB positions of all its entries
+ * are collected. While the walk proceeds, ICBs of the next prefetch_window
+ * entries are requested from the kernel with posix_fadvise(POSIX_FADV_WILLNEED),
+ * sorted by position and merged into contiguous ranges, so that the medium is
+ * read in one sweep instead of seeking for every (E)FE when get_file() maps
+ * it. Requests are issued when the walk reaches the middle of the previous
+ * window, so reads stay ahead of the walk.
+ *
+ * Requests are only hints, the walk reads the medium through the block cache
+ * as before.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prefetch.h"
+#include "journal.h"
+#include "options.h"
+#include "log.h"
+
+/**
+ * \brief Ask the kernel to read range of blocks in background
+ *
+ * \param[in] media   Information regarding medium & access to it
+ * \param[in] *stats  file system status
+ * \param[in] lsn     first block
+ * \param[in] blocks  number of blocks
+ */
+void prefetch_blocks(udf_media_t *media, struct filesystemStats *stats, uint32_t lsn, uint32_t blocks) {
+    uint64_t position = (uint64_t)lsn * stats->blocksize;
+    uint64_t length = (uint64_t)blocks * stats->blocksize;
+
+    if (prefetch_window == 0 || blocks == 0 || position >= media->devsize)
+        return;
+    if (length > media->devsize - position)
+        length = media->devsize - position;
+    posix_fadvise(media->fd, position, length, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * \brief Collect ICB positions of all FIDs in directory
+ *
+ * Only structure of FIDs is followed here, they are verified by inspect_fid().
+ * Collection stops on the first FID which does not look valid.
+ *
+ * \param[out] *pf      read ahead state
+ * \param[in]  media    Information regarding medium & access to it
+ * \param[in]  *stats   file system status
+ * \param[in]  *fids    directory contents
+ * \param[in]  length   length of directory contents in bytes
+ */
+void prefetch_init(struct prefetch *pf, udf_media_t *media, struct filesystemStats *stats,
+                   const uint8_t *fids, uint32_t length) {
+    uint32_t size = 0;
+
+    memset(pf, 0, sizeof(struct prefetch));
+    // Two pass check has all ICBs in memory already
+    if (prefetch_window == 0 || stats->scan)
+        return;
+
+    for (uint32_t pos = 0; pos + sizeof(struct fileIdentDesc) <= length; ) {
+        const struct fileIdentDesc *fid = (const struct fileIdentDesc *)(fids + pos);
+        uint32_t flen = sizeof(struct fileIdentDesc) + le16_to_cpu(fid->lengthOfImpUse) + fid->lengthFileIdent;
+        uint32_t lsn = 0;
+
+        if (le16_to_cpu(fid->descTag.tagIdent) != TAG_IDENT_FID || pos + flen > length)
+            break;
+
+        if ((fid->fileCharacteristics & (FID_FILE_CHAR_DELETED | FID_FILE_CHAR_PARENT)) == 0) {
+            uint32_t uuid;
+            memcpy(&uuid, fid->icb.impUse + 2, sizeof(uint32_t));
+            uuid = le32_to_cpu(uuid);
+            lsn = le32_to_cpu(fid->icb.extLocation.logicalBlockNum) + stats->lbnlsn;
+            // Files accounted from check journal are not read at all
+            if (stats->journal && (fid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY) == 0
+                && journal_find_file(stats->journal, uuid, lsn))
+                lsn = 0;
+        }
+
+        if (pf->count == size) {
+            uint32_t *lsns;
+            size = size ? 2 * size : 64;
+            lsns = realloc(pf->lsns, size * sizeof(uint32_t));
+            if (lsns == NULL)
+                break;
+            pf->lsns = lsns;
+        }
+        pf->lsns[pf->count++] = lsn;
+        pos += 4 * ((flen + 3) / 4);
+    }
+
+    prefetch_advance(pf, media, stats, 0);
+}
+
+static int cmp_lsn(const void *a, const void *b) {
+    uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+    return la < lb ? -1 : la > lb;
+}
+
+/**
+ * \brief Keep read ahead window in front of directory walk
+ *
+ * \param[in,out] *pf     read ahead state
+ * \param[in]     media   Information regarding medium & access to it
+ * \param[in]     *stats  file system status
+ * \param[in]     index   FID which is going to be inspected
+ */
+void prefetch_advance(struct prefetch *pf, udf_media_t *media, struct filesystemStats *stats, uint32_t index) {
+    uint32_t batch[256];
+    uint32_t n = 0, end;
+
+    if (pf->next >= pf->count || index + prefetch_window / 2 < pf->next)
+        return;
+
+    end = pf->next + prefetch_window;
+    if (end > pf->count || end < pf->next)
+        end = pf->count;
+
+    while (pf->next < end) {
+        uint32_t lsn = pf->lsns[pf->next++];
+        if (lsn != 0)
+            batch[n++] = lsn;
+        if (n < sizeof(batch) / sizeof(batch[0]) && pf->next < end)
+            continue;
+
+        qsort(batch, n, sizeof(uint32_t), cmp_lsn);
+        for (uint32_t i = 0; i < n; ) {
+            uint32_t j = i + 1;
+            while (j < n && batch[j] <= batch[j-1] + 1)
+                j++;
+            prefetch_blocks(media, stats, batch[i], batch[j-1] - batch[i] + 1);
+            i = j;
+        }
+        n = 0;
+    }
+}
+
+/**
+ * \brief Release read ahead state
+ */
+void prefetch_free(struct prefetch *pf) {
+    free(pf->lsns);
+    memset(pf, 0, sizeof(struct prefetch));
+}
@@ -0,0 +1,43 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "udffsck.h"
+
+#define PREFETCH_WINDOW 64 ///< Default number of ICBs requested ahead of directory walk
+
+/**
+ * \brief Read ahead state of one directory
+ */
+struct prefetch {
+    uint32_t *lsns;     ///< ICB LSN of every FID in directory order, 0 when not worth reading
+    uint32_t count;     ///< number of FIDs
+    uint32_t next;      ///< first FID not requested yet
+};
+
+void prefetch_init(struct prefetch *pf, udf_media_t *media, struct filesystemStats *stats,
+                   const uint8_t *fids, uint32_t length);
+void prefetch_advance(struct prefetch *pf, udf_media_t *media, struct filesystemStats *stats, uint32_t index);
+void prefetch_free(struct prefetch *pf);
+void prefetch_blocks(udf_media_t *media, struct filesystemStats *stats, uint32_t lsn, uint32_t blocks);
+
+#endif //__PREFETCH_H__
@@ -0,0 +1,269 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Write coalescing transaction of volume structure repairs
+ *
+ * AVDP, VDS, LVID and SBD repairs used to modify cache windows in place,
+ * each of them flushed with its window. Now every repaired descriptor is
+ * staged as a copy keyed by its position. Repairs of the same descriptor
+ * (e.g. AVDP copied and then its extent lengths fixed) modify the same copy
+ * and a repair reading a descriptor staged before sees the staged contents.
+ *
+ * On commit CRC and checksum of every staged descriptor are calculated once,
+ * descriptors are written in order of their positions, adjacent ones (e.g.
+ * copied VDS) by one write, and medium is flushed by a single fdatasync().
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include <sys/param.h>
+
+#include "repair.h"
+#include "badblocks.h"
+#include "scan.h"
+#include "log.h"
+
+/**
+ * \brief Start transaction, following fix phases stage descriptors into \p txn
+ */
+void repair_begin(udf_media_t *media, struct repair_txn *txn) {
+    memset(txn, 0, sizeof(*txn));
+    media->repair = txn;
+}
+
+/**
+ * \brief Copy \p length bytes at \p position of medium through cache windows
+ */
+static void read_medium(udf_media_t *media, uint64_t position, uint8_t *buf, size_t length) {
+    uint32_t chunksize = media->chunksize;
+
+    for(size_t done = 0; done < length; ) {
+        uint32_t chunk  = (uint32_t)((position + done) / chunksize);
+        uint32_t offset = (uint32_t)((position + done) % chunksize);
+        size_t n = MIN(length - done, (size_t)(chunksize - offset));
+
+        map_chunk(media, chunk, __FILE__, __LINE__);
+        memcpy(buf + done, media->mapping[chunk] + offset, n);
+        unmap_chunk(media, chunk);
+        done += n;
+    }
+}
+
+/**
+ * \brief Stage descriptor for writing
+ *
+ * Returned copy holds descriptor as staged by previous repairs, or as
+ * recorded on medium when it was not staged yet. Caller modifies it in
+ * place, it stays valid until repair_commit() or repair_free(). CRC and
+ * checksum are recalculated on commit.
+ *
+ * \param[in] media     Information regarding medium & access to it
+ * \param[in] position  position of descriptor on medium in bytes
+ * \param[in] length    length of descriptor in bytes
+ *
+ * \return staged copy, NULL if there is no transaction, descriptor is out of
+ *         medium or allocation failed
+ */
+void *repair_stage(udf_media_t *media, uint64_t position, size_t length) {
+    struct repair_txn *txn = media->repair;
+    struct repair_write *w;
+
+    if(txn == NULL || length < sizeof(tag) || position + length > media->devsize)
+        return NULL;
+
+    for(uint32_t i = 0; i < txn->count; i++) {
+        w = &txn->writes[i];
+        if(w->position != position)
+            continue;
+        if(w->length < length) {
+            uint8_t *data = realloc(w->data, length);
+            if(data == NULL)
+                return NULL;
+            read_medium(media, position + w->length, data + w->length, length - w->length);
+            w->data = data;
+            w->length = (uint32_t)length;
+        }
+        dbg("[REPAIR] Descriptor at 0x%" PRIx64 " is already staged\n", position);
+        return w->data;
+    }
+
+    if(txn->count == txn->size) {
+        uint32_t size = txn->size ? 2 * txn->size : 8;
+        struct repair_write *writes = realloc(txn->writes, size * sizeof(struct repair_write));
+        if(writes == NULL)
+            return NULL;
+        txn->writes = writes;
+        txn->size = size;
+    }
+
+    w = &txn->writes[txn->count];
+    w->data = malloc(length);
+    if(w->data == NULL)
+        return NULL;
+    w->position = position;
+    w->length = (uint32_t)length;
+    read_medium(media, position, w->data, length);
+    txn->count++;
+    dbg("[REPAIR] Staged %zu bytes at 0x%" PRIx64 "\n", length, position);
+    return w->data;
+}
+
+/**
+ * \brief Read descriptor as it is going to be recorded after commit
+ *
+ * Descriptor staged at the same position is read from its staged copy,
+ * otherwise (or beyond staged length) from medium.
+ *
+ * \return 0 descriptor was read
+ * \return -1 descriptor is out of medium
+ */
+int repair_read(udf_media_t *media, uint64_t position, void *buf, size_t length) {
+    struct repair_txn *txn = media->repair;
+    size_t staged = 0;
+
+    if(position + length > media->devsize)
+        return -1;
+
+    for(uint32_t i = 0; txn != NULL && i < txn->count; i++) {
+        if(txn->writes[i].position == position) {
+            staged = MIN(length, (size_t)txn->writes[i].length);
+            memcpy(buf, txn->writes[i].data, staged);
+            break;
+        }
+    }
+    read_medium(media, position + staged, (uint8_t *)buf + staged, length - staged);
+    return 0;
+}
+
+static int compare_writes(const void *a, const void *b) {
+    const struct repair_write *wa = a;
+    const struct repair_write *wb = b;
+
+    if(wa->position != wb->position)
+        return wa->position < wb->position ? -1 : 1;
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t length, uint64_t position) {
+    for(size_t done = 0; done < length; ) {
+        ssize_t ret = pwrite(fd, buf + done, length - done, (off_t)(position + done));
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(ret == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += (size_t)ret;
+    }
+    return 0;
+}
+
+/**
+ * \brief Write all staged descriptors and flush medium
+ *
+ * Staged copies are released, transaction stays open for further repairs.
+ *
+ * \return 0 everything written
+ * \return -1 write, flush or allocation failed, errno is set
+ */
+int repair_commit(udf_media_t *media) {
+    struct repair_txn *txn = media->repair;
+    int ret = 0;
+
+    if(txn == NULL)
+        return 0;
+    txn->bytes = 0;
+    txn->runs = 0;
+    if(txn->count == 0)
+        return 0;
+
+    for(uint32_t i = 0; i < txn->count; i++) {
+        struct repair_write *w = &txn->writes[i];
+        tag *descTag = (tag *)w->data;
+        uint32_t crcLength = MIN((uint32_t)udf_tag_crc_length(descTag), w->length - (uint32_t)sizeof(tag));
+
+        udf_tag_set_crc(descTag, calculate_crc(w->data, crcLength + sizeof(tag)));
+        descTag->tagChecksum = calculate_checksum(*descTag);
+    }
+
+    qsort(txn->writes, txn->count, sizeof(struct repair_write), compare_writes);
+
+    for(uint32_t i = 0; i < txn->count && ret == 0; ) {
+        uint64_t start = txn->writes[i].position;
+        uint64_t end = start + txn->writes[i].length;
+        uint32_t j = i + 1;
+
+        while(j < txn->count && txn->writes[j].position == end)
+            end += txn->writes[j++].length;
+
+        if(j == i + 1) {
+            ret = write_all(media->fd, txn->writes[i].data, txn->writes[i].length, start);
+            if(ret == 0)
+                badblocks_refresh(txn->writes[i].data, txn->writes[i].length, start);
+        } else {
+            uint8_t *run = malloc(end - start);
+            if(run == NULL) {
+                errno = ENOMEM;
+                ret = -1;
+                break;
+            }
+            for(uint32_t k = i; k < j; k++)
+                memcpy(run + (txn->writes[k].position - start), txn->writes[k].data, txn->writes[k].length);
+            ret = write_all(media->fd, run, end - start, start);
+            if(ret == 0)
+                badblocks_refresh(run, end - start, start);
+            free(run);
+        }
+        dbg("[REPAIR] Wrote %u descriptor(s), 0x%" PRIx64 " - 0x%" PRIx64 "\n", j - i, start, end);
+        txn->bytes += end - start;
+        txn->runs++;
+        i = j;
+    }
+
+    if(ret == 0 && fdatasync(media->fd) != 0)
+        ret = -1;
+
+    for(uint32_t i = 0; i < txn->count; i++)
+        free(txn->writes[i].data);
+    txn->count = 0;
+    return ret;
+}
+
+/**
+ * \brief Drop staged descriptors and end transaction
+ */
+void repair_free(udf_media_t *media) {
+    struct repair_txn *txn = media->repair;
+
+    if(txn == NULL)
+        return;
+    for(uint32_t i = 0; i < txn->count; i++)
+        free(txn->writes[i].data);
+    free(txn->writes);
+    memset(txn, 0, sizeof(*txn));
+    media->repair = NULL;
+}
@@ -0,0 +1,57 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __REPAIR_H__
+#define __REPAIR_H__
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "udffsck.h"
+
+/**
+ * \brief Descriptor staged by repair transaction
+ */
+struct repair_write {
+    uint64_t  position;     ///< position on medium in bytes
+    uint32_t  length;       ///< length of descriptor in bytes
+    uint8_t  *data;         ///< modified copy of descriptor
+};
+
+/**
+ * \brief Repair transaction of volume structure fix phases
+ *
+ * Fix phases modify staged copies of descriptors instead of cache windows.
+ * repair_commit() recalculates CRC and checksum of every staged descriptor,
+ * writes them in order of their positions and flushes the medium once.
+ */
+struct repair_txn {
+    struct repair_write *writes;
+    uint32_t             count;
+    uint32_t             size;
+    uint64_t             bytes;     ///< bytes written by last commit
+    uint32_t             runs;      ///< writes issued by last commit
+};
+
+void repair_begin(udf_media_t *media, struct repair_txn *txn);
+void *repair_stage(udf_media_t *media, uint64_t position, size_t length);
+int repair_read(udf_media_t *media, uint64_t position, void *buf, size_t length);
+int repair_commit(udf_media_t *media);
+void repair_free(udf_media_t *media);
+
+#endif //__REPAIR_H__
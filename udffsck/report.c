@@ -0,0 +1,234 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Machine readable report of a check (--report=json)
+ *
+ * Wall and CPU time is accumulated for every phase of the check, CPU time
+ * covers all threads of the process. Descriptors are counted by tag
+ * identifier from all threads. At the end the report is written as one JSON
+ * object together with block cache counters and the final filesystemStats.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "report.h"
+#include "cache.h"
+#include "badblocks.h"
+#include "options.h"
+
+#define DESC_TYPES 32 ///< Slots for tag identifiers 0-15 and 256-271
+
+struct phase_time {
+    double wall;
+    double cpu;
+    uint32_t runs;
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    "vrs", "avdp", "vds", "lvid", "pd", "fsd", "file_tree", "verify", "fix_avdp", "fix_vds", "fix_lvid"
+};
+
+static struct phase_time phases[PHASE_COUNT];
+static enum report_phase current = PHASE_NONE;
+static double phase_wall, phase_cpu, start_wall, start_cpu;
+static uint64_t descriptors[DESC_TYPES];
+
+static double clock_seconds(clockid_t id) {
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int desc_slot(uint16_t tagIdent) {
+    if (tagIdent < 16)
+        return tagIdent;
+    if (tagIdent >= TAG_IDENT_FSD && tagIdent < TAG_IDENT_FSD + 16)
+        return 16 + tagIdent - TAG_IDENT_FSD;
+    return -1;
+}
+
+static const char *desc_name(int slot) {
+    static const char *names[DESC_TYPES] = {
+        [TAG_IDENT_PVD] = "PVD", [TAG_IDENT_AVDP] = "AVDP", [TAG_IDENT_VDP] = "VDP",
+        [TAG_IDENT_IUVD] = "IUVD", [TAG_IDENT_PD] = "PD", [TAG_IDENT_LVD] = "LVD",
+        [TAG_IDENT_USD] = "USD", [TAG_IDENT_TD] = "TD", [TAG_IDENT_LVID] = "LVID",
+        [16 + TAG_IDENT_FSD - TAG_IDENT_FSD] = "FSD", [16 + TAG_IDENT_FID - TAG_IDENT_FSD] = "FID",
+        [16 + TAG_IDENT_AED - TAG_IDENT_FSD] = "AED", [16 + TAG_IDENT_IE - TAG_IDENT_FSD] = "IE",
+        [16 + TAG_IDENT_TE - TAG_IDENT_FSD] = "TE", [16 + TAG_IDENT_FE - TAG_IDENT_FSD] = "FE",
+        [16 + TAG_IDENT_EAHD - TAG_IDENT_FSD] = "EAHD", [16 + TAG_IDENT_USE - TAG_IDENT_FSD] = "USE",
+        [16 + TAG_IDENT_SBD - TAG_IDENT_FSD] = "SBD", [16 + TAG_IDENT_PIE - TAG_IDENT_FSD] = "PIE",
+        [16 + TAG_IDENT_EFE - TAG_IDENT_FSD] = "EFE",
+    };
+    return names[slot];
+}
+
+/**
+ * \brief Finish current phase and start timing of another one
+ *
+ * Time of phase entered more than once is accumulated.
+ *
+ * \param[in] phase  next phase, PHASE_NONE only finishes current one
+ */
+void report_phase(enum report_phase phase) {
+    double wall, cpu;
+
+    if (report_path == NULL)
+        return;
+    wall = clock_seconds(CLOCK_MONOTONIC);
+    cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    if (start_wall == 0) {
+        start_wall = wall;
+        start_cpu = cpu;
+    }
+    if (current != PHASE_NONE) {
+        phases[current].wall += wall - phase_wall;
+        phases[current].cpu += cpu - phase_cpu;
+        phases[current].runs++;
+    }
+    current = phase;
+    phase_wall = wall;
+    phase_cpu = cpu;
+}
+
+/**
+ * \brief Count descriptor which was read and checked
+ *
+ * \param[in] tagIdent  tag identifier of descriptor, in CPU byte order
+ */
+void report_desc(uint16_t tagIdent) {
+    int slot = desc_slot(tagIdent);
+
+    udf_progress_add(UDF_PROGRESS_DESCS, 1);
+    if (report_path == NULL || slot < 0)
+        return;
+    __atomic_fetch_add(&descriptors[slot], 1, __ATOMIC_RELAXED);
+}
+
+static void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; s != NULL && *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void json_integrity(FILE *f, const char *name, const integrity_info_t *info) {
+    fprintf(f, "    \"%s\": {\"nextUID\": %" PRIu64 ", \"numFiles\": %" PRIu32 ", \"numDirs\": %" PRIu32
+            ", \"minUDFReadRev\": %" PRIu16 ", \"minUDFWriteRev\": %" PRIu16 ", \"maxUDFWriteRev\": %" PRIu16
+            ", \"freeSpaceBlocks\": %" PRIu32 ", \"partitionNumBlocks\": %" PRIu32 "}",
+            name, info->nextUID, info->numFiles, info->numDirs, info->minUDFReadRev, info->minUDFWriteRev,
+            info->maxUDFWriteRev, info->freeSpaceBlocks, info->partitionNumBlocks);
+}
+
+/**
+ * \brief Write report of finished check
+ *
+ * \param[in] path    output file, "-" for stdout
+ * \param[in] media   Information regarding medium & access to it
+ * \param[in] medium  checked medium path
+ * \param[in] *stats  final file system status
+ * \param[in] status  exit status of check
+ *
+ * \return 0 on success, -1 on output error
+ */
+int report_write(const char *path, udf_media_t *media, const char *medium,
+                 const struct filesystemStats *stats, int status) {
+    struct cache_stats cs;
+    double treeWall;
+    FILE *f;
+    int first = 1;
+
+    report_phase(PHASE_NONE);
+    cache_get_stats(media, &cs);
+
+    if (strcmp(path, "-") == 0) {
+        fflush(stdout);
+        f = stdout;
+    } else if ((f = fopen(path, "w")) == NULL) {
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"medium\": ");
+    json_string(f, medium);
+    fprintf(f, ",\n  \"status\": %d,\n  \"blocksize\": %d,\n", status, media->sectorsize);
+    fprintf(f, "  \"wall\": %.6f,\n  \"cpu\": %.6f,\n", phase_wall - start_wall, phase_cpu - start_cpu);
+
+    fprintf(f, "  \"phases\": {");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        if (phases[i].runs == 0)
+            continue;
+        fprintf(f, "%s\n    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", first ? "" : ",",
+                phase_names[i], phases[i].wall, phases[i].cpu);
+        first = 0;
+    }
+    fprintf(f, "\n  },\n");
+
+    fprintf(f, "  \"io\": {\"bytesRead\": %" PRIu64 ", \"blocksRead\": %" PRIu64 ", \"windowGets\": %" PRIu64
+            ", \"windowPuts\": %" PRIu64 ", \"windowMaps\": %" PRIu64 ", \"windowUnmaps\": %" PRIu64
+            ", \"cacheHits\": %" PRIu64 "},\n",
+            cs.bytes, media->sectorsize > 0 ? cs.bytes / media->sectorsize : 0, cs.hits + cs.misses,
+            cs.puts, cs.misses, cs.unmaps, cs.hits);
+    fprintf(f, "  \"unreadable\": {\"ranges\": %" PRIu32 ", \"bytes\": %" PRIu64 "},\n",
+            badblocks_ranges(), badblocks_bytes());
+
+    fprintf(f, "  \"descriptors\": {");
+    first = 1;
+    for (int i = 0; i < DESC_TYPES; i++) {
+        if (descriptors[i] == 0 || desc_name(i) == NULL)
+            continue;
+        fprintf(f, "%s\"%s\": %" PRIu64, first ? "" : ", ", desc_name(i), descriptors[i]);
+        first = 0;
+    }
+    fprintf(f, "},\n");
+
+    treeWall = phases[PHASE_FILE_TREE].wall;
+    fprintf(f, "  \"filesPerSecond\": %.1f,\n  \"dirsPerSecond\": %.1f,\n",
+            treeWall > 0 ? stats->found.numFiles / treeWall : 0.0,
+            treeWall > 0 ? stats->found.numDirs / treeWall : 0.0);
+
+    fprintf(f, "  \"stats\": {\n    \"blocksize\": %" PRIu64 ",\n    \"lbnlsn\": %" PRIu32
+            ",\n    \"AVDPSerialNum\": %" PRIu16 ",\n    \"partitionAccessType\": %" PRIu32 ",\n",
+            stats->blocksize, stats->lbnlsn, stats->AVDPSerialNum, stats->partitionAccessType);
+    fprintf(f, "    \"volumeSetIdent\": ");
+    json_string(f, stats->volumeSetIdent);
+    fprintf(f, ",\n    \"partitionIdent\": ");
+    json_string(f, stats->partitionIdent);
+    fprintf(f, ",\n");
+    json_integrity(f, "lvid", &stats->lvid);
+    fprintf(f, ",\n");
+    json_integrity(f, "spacedesc", &stats->spacedesc);
+    fprintf(f, ",\n");
+    json_integrity(f, "found", &stats->found);
+    fprintf(f, "\n  }\n}\n");
+
+    if (f != stdout)
+        return fclose(f) == 0 ? 0 : -1;
+    return fflush(f) == 0 ? 0 : -1;
+}
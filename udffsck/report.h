@@ -0,0 +1,50 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "udffsck.h"
+
+/**
+ * \brief Check phases timed by report
+ */
+enum report_phase {
+    PHASE_VRS = 0,      ///< is_udf()
+    PHASE_AVDP,         ///< get_avdp()
+    PHASE_VDS,          ///< get_vds(), verify_vds()
+    PHASE_LVID,         ///< get_lvid()
+    PHASE_PD,           ///< get_pd()
+    PHASE_FSD,          ///< get_fsd()
+    PHASE_FILE_TREE,    ///< get_file_structure() or journal check
+    PHASE_VERIFY,       ///< comparison of recorded and found state
+    PHASE_FIX_AVDP,     ///< write_avdp(), fix_avdp()
+    PHASE_FIX_VDS,      ///< fix_vds()
+    PHASE_FIX_LVID,     ///< fix_lvid(), fix_pd()
+    PHASE_COUNT,
+    PHASE_NONE = PHASE_COUNT
+};
+
+void report_phase(enum report_phase phase);
+void report_desc(uint16_t tagIdent);
+int report_write(const char *path, udf_media_t *media, const char *medium,
+                 const struct filesystemStats *stats, int status);
+
+#endif //__REPORT_H__
@@ -0,0 +1,538 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Two pass, stream ordered file tree check
+ *
+ * First pass reads the whole partition sequentially and records every FE, EFE
+ * and AED with valid tag checksum, CRC and position into ICB graph sorted by
+ * LBN. Holes of sparse image are skipped, they read as zeros. AED chains of
+ * all ICBs are then collapsed from the graph and contents of all directories
+ * are read in one more sweep ordered by LBN.
+ *
+ * Second pass resolves file tree from the graph in the same order as
+ * get_file() does, so output and struct filesystemStats are the same as
+ * after the tree walk. FIDs are inspected by inspect_fid() from directory
+ * contents in memory. ICBs which are not in the graph or which need any
+ * diagnostics (damaged descriptors, Tag Serial Number or Unique ID
+ * mismatch, unsupported ADs, ...) are handed over to get_file(), which reads
+ * them from medium and reports their errors.
+ *
+ * Used in check mode only, nothing is written to medium.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <sys/param.h>
+
+#include "scan.h"
+#include "walk.h"
+#include "log.h"
+#include "report.h"
+
+/**
+ * \brief Extent of directory contents waiting for read
+ */
+struct scan_read {
+    uint32_t lbn;
+    uint32_t length;
+    uint32_t icb;       ///< index of directory in graph
+    uint64_t offset;    ///< offset in directory contents
+};
+
+static struct scan_icb *scan_add(struct scan_graph *graph, uint32_t lbn, uint16_t tagIdent) {
+    struct scan_icb *icb;
+
+    if (graph->count == graph->size) {
+        uint32_t size = graph->size ? 2 * graph->size : 1024;
+        struct scan_icb *icbs = realloc(graph->icbs, size * sizeof(struct scan_icb));
+        if (icbs == NULL)
+            return NULL;
+        graph->icbs = icbs;
+        graph->size = size;
+    }
+
+    icb = &graph->icbs[graph->count++];
+    memset(icb, 0, sizeof(struct scan_icb));
+    icb->lbn = lbn;
+    icb->tagIdent = tagIdent;
+    return icb;
+}
+
+static int scan_copy_ads(struct scan_icb *icb, const uint8_t *allocDescs, uint32_t length) {
+    icb->allocDescs = malloc(length ? length : 1);
+    if (icb->allocDescs == NULL)
+        return -1;
+    memcpy(icb->allocDescs, allocDescs, length);
+    icb->lengthAllocDescs = length;
+    return 0;
+}
+
+/**
+ * \brief Record block into ICB graph if it holds valid (E)FE or AED
+ *
+ * \return 0 -- block recorded or skipped
+ * \return -1 -- heap allocation failed
+ */
+static int scan_block(struct scan_graph *graph, const uint8_t *block, uint32_t lbn,
+                      struct filesystemStats *stats) {
+    const tag *descTag = (const tag *)block;
+    uint16_t tagIdent = le16_to_cpu(descTag->tagIdent);
+    struct scan_icb *icb;
+
+    if (tagIdent != TAG_IDENT_FE && tagIdent != TAG_IDENT_EFE && tagIdent != TAG_IDENT_AED)
+        return 0;
+    if (calculate_checksum(*descTag) != descTag->tagChecksum || le32_to_cpu(descTag->tagLocation) != lbn)
+        return 0;
+
+    if (tagIdent == TAG_IDENT_AED) {
+        const struct allocExtDesc *aed = (const struct allocExtDesc *)block;
+        uint32_t L_AD = le32_to_cpu(aed->lengthAllocDescs);
+        uint32_t crcLength = le16_to_cpu(descTag->descCRCLength) + sizeof(tag);
+
+        if (sizeof(struct allocExtDesc) + (uint64_t)L_AD > stats->blocksize || crcLength > stats->blocksize)
+            return 0;
+        if (calculate_crc((void *)block, crcLength) != le16_to_cpu(descTag->descCRC))
+            return 0;
+
+        icb = scan_add(graph, lbn, tagIdent);
+        if (icb == NULL || scan_copy_ads(icb, block + sizeof(struct allocExtDesc), L_AD))
+            return -1;
+        graph->numAeds++;
+        return 0;
+    }
+
+    const struct fileEntry *fe = (const struct fileEntry *)block;
+    const struct extendedFileEntry *efe = (const struct extendedFileEntry *)block;
+    int ext = tagIdent == TAG_IDENT_EFE;
+    uint32_t L_EA = le32_to_cpu(ext ? efe->lengthExtendedAttr : fe->lengthExtendedAttr);
+    uint32_t L_AD = le32_to_cpu(ext ? efe->lengthAllocDescs : fe->lengthAllocDescs);
+    uint64_t length = (ext ? sizeof(struct extendedFileEntry) : sizeof(struct fileEntry)) + (uint64_t)L_EA + L_AD;
+
+    if (length > stats->blocksize)
+        return 0;
+    if (calculate_crc((void *)block, (uint16_t)length) != le16_to_cpu(descTag->descCRC))
+        return 0;
+
+    icb = scan_add(graph, lbn, tagIdent);
+    if (icb == NULL)
+        return -1;
+    icb->tagSerialNum = le16_to_cpu(descTag->tagSerialNum);
+    icb->icb_ad = le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK;
+    icb->fileType = fe->icbTag.fileType;
+    icb->permissions = le32_to_cpu(fe->permissions);
+    icb->informationLength = le64_to_cpu(fe->informationLength);
+    icb->uniqueID = le64_to_cpu(ext ? efe->uniqueID : fe->uniqueID);
+    icb->modificationTime = ext ? efe->modificationTime : fe->modificationTime;
+
+    // File data recorded in ICB is not needed, FIDs of in-ICB directory are
+    if (icb->icb_ad != ICBTAG_FLAG_AD_IN_ICB || icb->fileType == ICBTAG_FILE_TYPE_DIRECTORY) {
+        const uint8_t *allocDescs = (ext ? efe->extendedAttrAndAllocDescs : fe->extendedAttrAndAllocDescs) + L_EA;
+        if (scan_copy_ads(icb, allocDescs, L_AD))
+            return -1;
+    }
+    graph->numFileEntries++;
+    return 0;
+}
+
+/**
+ * \brief First pass, read partition sequentially and record its descriptors
+ *
+ * \return 0 -- everything OK
+ * \return -1 -- heap allocation failed
+ */
+static int scan_blocks(udf_media_t *media, struct filesystemStats *stats, struct scan_graph *graph) {
+    uint32_t chunksize = media->chunksize;
+    uint64_t start = (uint64_t)stats->lbnlsn * stats->blocksize;
+    uint64_t end = start + (uint64_t)stats->found.partitionNumBlocks * stats->blocksize;
+    struct udf_medium medium;
+    int ret = 0;
+
+    if (end > media->devsize)
+        end = media->devsize;
+    if (start >= end)
+        return 0;
+
+    // Used only to find holes of sparse image, partition is read by mapped windows
+    udf_medium_init(&medium, media->fd, UDF_MEDIUM_IO_PREAD, 0);
+
+    posix_fadvise(media->fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+    for (uint64_t position = start; position + stats->blocksize <= end; ) {
+        uint64_t data = udf_medium_next_data(&medium, position, end);
+
+        // Hole reads as zeros, there is no descriptor in it
+        if (data - position >= stats->blocksize) {
+            position += (data - position) / stats->blocksize * stats->blocksize;
+            continue;
+        }
+
+        uint32_t chunk = (uint32_t)(position / chunksize);
+        uint64_t chunkEnd = MIN((uint64_t)(chunk + 1) * chunksize, end);
+
+        // Keep the next window on its way while this one is parsed
+        if (chunkEnd < end)
+            posix_fadvise(media->fd, chunkEnd, MIN(chunksize, end - chunkEnd), POSIX_FADV_WILLNEED);
+
+        map_chunk(media, chunk, __FILE__, __LINE__);
+        for (; position + stats->blocksize <= chunkEnd; position += stats->blocksize) {
+            uint32_t lbn = (uint32_t)((position - start) / stats->blocksize);
+            if (scan_block(graph, media->mapping[chunk] + position % chunksize, lbn, stats)) {
+                ret = -1;
+                break;
+            }
+        }
+        unmap_chunk(media, chunk);
+        if (ret)
+            break;
+    }
+    udf_medium_free(&medium);
+    return ret;
+}
+
+/**
+ * \brief Find descriptor recorded by partition scan
+ *
+ * \param[in] *graph  ICB graph
+ * \param[in] lbn     position in partition
+ *
+ * \return descriptor, NULL when there is no valid descriptor in lbn
+ */
+const struct scan_icb *scan_find(const struct scan_graph *graph, uint32_t lbn) {
+    uint32_t lo = 0, hi = graph->count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (graph->icbs[mid].lbn < lbn)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < graph->count && graph->icbs[lo].lbn == lbn)
+        return &graph->icbs[lo];
+    return NULL;
+}
+
+/**
+ * \brief Collapse AED chains of ICB, the same way collect_extents() does it
+ *
+ * \return 0 -- everything OK
+ * \return 1 -- AED is not in graph, ICB is left for get_file()
+ * \return -1 -- heap allocation failed
+ */
+static int scan_collect_extents(struct scan_graph *graph, struct scan_icb *icb) {
+    uint32_t descSize = icb->icb_ad == ICBTAG_FLAG_AD_SHORT ? sizeof(short_ad) : sizeof(long_ad);
+    uint32_t lengthADArray = icb->lengthAllocDescs;
+    uint8_t *ADArray = icb->allocDescs;
+    uint32_t sizeAeds = 0;
+    int nAD = lengthADArray / descSize;
+
+    for (int i = 0; i < nAD; i++) {
+        short_ad *sad = (short_ad *)(ADArray + i*descSize);
+        uint32_t aedlbn;
+        const struct scan_icb *aed;
+
+        if (!udf_sad_length(sad))
+            break;
+        if (udf_sad_type(sad) != 3)
+            continue;
+
+        if (icb->icb_ad == ICBTAG_FLAG_AD_SHORT)
+            aedlbn = udf_sad_position(sad);
+        else
+            aedlbn = udf_lad_block((long_ad *)sad);
+
+        // Chain longer than number of AEDs on partition has a loop
+        aed = scan_find(graph, aedlbn);
+        if (aed == NULL || aed->tagIdent != TAG_IDENT_AED || icb->numAeds >= graph->numAeds)
+            return 1;
+
+        if (icb->numAeds == sizeAeds) {
+            uint32_t *aeds;
+            sizeAeds = sizeAeds ? 2 * sizeAeds : 4;
+            aeds = realloc(icb->aeds, sizeAeds * sizeof(uint32_t));
+            if (aeds == NULL)
+                return -1;
+            icb->aeds = aeds;
+        }
+        icb->aeds[icb->numAeds++] = aedlbn;
+
+        // Chain entry is overwritten by the first AD of the next AED
+        memset(ADArray + i*descSize, 0, descSize);
+        lengthADArray -= descSize;
+        ADArray = realloc(ADArray, (lengthADArray + aed->lengthAllocDescs) ? lengthADArray + aed->lengthAllocDescs : 1);
+        if (ADArray == NULL)
+            return -1;
+        icb->allocDescs = ADArray;
+        memcpy(ADArray + lengthADArray, aed->allocDescs, aed->lengthAllocDescs);
+        lengthADArray += aed->lengthAllocDescs;
+        icb->lengthAllocDescs = lengthADArray;
+        nAD = lengthADArray / descSize;
+        --i;
+    }
+    return 0;
+}
+
+static void scan_get_ad(const struct scan_icb *icb, int i, uint32_t *extType, uint32_t *extLength, uint32_t *extPosition) {
+    if (icb->icb_ad == ICBTAG_FLAG_AD_SHORT) {
+        short_ad *sad = (short_ad *)(icb->allocDescs + i*sizeof(short_ad));
+        *extType     = udf_sad_type(sad);
+        *extLength   = udf_sad_length(sad);
+        *extPosition = udf_sad_position(sad);
+    } else {
+        long_ad *lad = (long_ad *)(icb->allocDescs + i*sizeof(long_ad));
+        *extType     = udf_lad_type(lad);
+        *extLength   = udf_lad_length(lad);
+        *extPosition = udf_lad_block(lad);
+    }
+}
+
+static int scan_num_ads(const struct scan_icb *icb) {
+    return icb->lengthAllocDescs / (icb->icb_ad == ICBTAG_FLAG_AD_SHORT ? sizeof(short_ad) : sizeof(long_ad));
+}
+
+static int cmp_read(const void *a, const void *b) {
+    const struct scan_read *ra = a, *rb = b;
+    return ra->lbn < rb->lbn ? -1 : ra->lbn > rb->lbn;
+}
+
+/**
+ * \brief Resolve AED chains and read contents of all directories in LBN order
+ *
+ * \return 0 -- everything OK
+ * \return -1 -- heap allocation failed
+ */
+static int scan_resolve(udf_media_t *media, struct filesystemStats *stats, struct scan_graph *graph) {
+    struct scan_read *reads = NULL;
+    uint32_t numReads = 0, sizeReads = 0;
+    uint32_t chunksize = media->chunksize;
+
+    for (uint32_t n = 0; n < graph->count; n++) {
+        struct scan_icb *icb = &graph->icbs[n];
+        int ret;
+
+        if (icb->tagIdent == TAG_IDENT_AED || icb->icb_ad == ICBTAG_FLAG_AD_IN_ICB)
+            continue;
+        if (icb->icb_ad != ICBTAG_FLAG_AD_SHORT && icb->icb_ad != ICBTAG_FLAG_AD_LONG) {
+            icb->unresolved = 1;
+            continue;
+        }
+        ret = scan_collect_extents(graph, icb);
+        if (ret < 0)
+            goto failed;
+        if (ret > 0 || icb->fileType != ICBTAG_FILE_TYPE_DIRECTORY) {
+            icb->unresolved = ret > 0;
+            continue;
+        }
+
+        int nAD = scan_num_ads(icb);
+        for (int i = 0; i < nAD; i++) {
+            uint32_t extType, extLength, extPosition;
+            scan_get_ad(icb, i, &extType, &extLength, &extPosition);
+            icb->dirContentLen += extLength;
+        }
+        icb->dirContent = calloc(1, icb->dirContentLen ? icb->dirContentLen : 1);
+        if (icb->dirContent == NULL)
+            goto failed;
+
+        uint64_t offset = 0;
+        for (int i = 0; i < nAD; i++) {
+            uint32_t extType, extLength, extPosition;
+            scan_get_ad(icb, i, &extType, &extLength, &extPosition);
+            if (extType == 0 && extLength > 0) {
+                if (numReads == sizeReads) {
+                    struct scan_read *r;
+                    sizeReads = sizeReads ? 2 * sizeReads : 256;
+                    r = realloc(reads, sizeReads * sizeof(struct scan_read));
+                    if (r == NULL)
+                        goto failed;
+                    reads = r;
+                }
+                reads[numReads].lbn = extPosition;
+                reads[numReads].length = extLength;
+                reads[numReads].icb = n;
+                reads[numReads].offset = offset;
+                numReads++;
+            }
+            offset += extLength;
+        }
+    }
+
+    qsort(reads, numReads, sizeof(struct scan_read), cmp_read);
+    for (uint32_t r = 0; r < numReads; r++) {
+        struct scan_icb *icb = &graph->icbs[reads[r].icb];
+        uint64_t position = (stats->lbnlsn + (uint64_t)reads[r].lbn) * stats->blocksize;
+        uint32_t done = 0;
+
+        if (icb->unresolved)
+            continue;
+        if (position + reads[r].length > media->devsize) {
+            icb->unresolved = 1;
+            continue;
+        }
+        while (done < reads[r].length) {
+            uint32_t chunk = (uint32_t)((position + done) / chunksize);
+            uint32_t offset = (uint32_t)((position + done) % chunksize);
+            uint32_t length = MIN(reads[r].length - done, chunksize - offset);
+
+            map_chunk(media, chunk, __FILE__, __LINE__);
+            memcpy(icb->dirContent + reads[r].offset + done, media->mapping[chunk] + offset, length);
+            unmap_chunk(media, chunk);
+            done += length;
+        }
+    }
+    free(reads);
+    return 0;
+
+failed:
+    free(reads);
+    return -1;
+}
+
+/**
+ * \brief Build ICB graph of partition
+ *
+ * Reads whole partition sequentially, then contents of all directories in LBN order.
+ *
+ * \param[in]   media    Information regarding medium & access to it
+ * \param[in]   *stats   file system status
+ * \param[out]  *graph   ICB graph, must be released by scan_free()
+ *
+ * \return 0 -- everything OK
+ * \return -1 -- heap allocation failed, graph is released
+ */
+int scan_partition(udf_media_t *media, struct filesystemStats *stats, struct scan_graph *graph) {
+    memset(graph, 0, sizeof(struct scan_graph));
+
+    if (scan_blocks(media, stats, graph) || scan_resolve(media, stats, graph)) {
+        err("Partition scan allocation failed.\n");
+        scan_free(graph);
+        return -1;
+    }
+    msg("Partition scanned, %" PRIu32 " file entries and %" PRIu32 " AEDs found.\n",
+        graph->numFileEntries, graph->numAeds);
+    return 0;
+}
+
+/**
+ * \brief Release ICB graph
+ */
+void scan_free(struct scan_graph *graph) {
+    for (uint32_t n = 0; n < graph->count; n++) {
+        free(graph->icbs[n].allocDescs);
+        free(graph->icbs[n].aeds);
+        free(graph->icbs[n].dirContent);
+    }
+    free(graph->icbs);
+    memset(graph, 0, sizeof(struct scan_graph));
+}
+
+/**
+ * \brief (E)FE parsing function of two pass check
+ *
+ * Counterpart of get_file() working on ICB graph. Any ICB which cannot be
+ * accounted from the graph without diagnostics is passed to get_file().
+ *
+ * \param[in]      media     Information regarding medium & access to it
+ * \param[in]      lsn       actual LSN
+ * \param[in,out]  *stats    file system status, stats->scan holds ICB graph
+ * \param[in]      depth     depth of FE for printing
+ * \param[in]      uuid      Unique ID from parent FID
+ * \param[in]      info      file information structure for easier handling for print
+ * \param[in]      *seq      VDS sequence
+ *
+ * \return the same as get_file()
+ */
+uint8_t scan_get_file(udf_media_t *media, uint32_t lsn, struct filesystemStats *stats, uint32_t depth,
+                      uint32_t uuid, struct fileInfo info, vds_sequence_t *seq) {
+    const struct scan_icb *icb = scan_find(stats->scan, lsn - stats->lbnlsn);
+    uint8_t status = 0;
+    double cts;
+
+    if (icb == NULL || icb->tagIdent == TAG_IDENT_AED || icb->unresolved
+        || icb->tagSerialNum != stats->AVDPSerialNum
+        || (uuid != 0 && uuid != icb->uniqueID)) {
+        dbg("(%u) ICB is not resolved from partition scan.\n", lsn);
+        return get_file(media, lsn, stats, depth, uuid, info, seq);
+    }
+
+    report_desc(icb->tagIdent);
+    udf_progress_add(UDF_PROGRESS_FILES, 1);
+    increment_used_space(stats, stats->blocksize, icb->lbn);
+    if (icb->tagIdent == TAG_IDENT_EFE)
+        update_min_udf_revision(stats, 0x0200);
+
+    info.size = icb->informationLength;
+    info.fileType = icb->fileType;
+    info.permissions = icb->permissions;
+
+    switch (icb->fileType) {
+        case ICBTAG_FILE_TYPE_DIRECTORY:
+            stats->found.numDirs++;
+            break;
+        case ICBTAG_FILE_TYPE_REGULAR:
+        case ICBTAG_FILE_TYPE_BLOCK:
+        case ICBTAG_FILE_TYPE_CHAR:
+        case ICBTAG_FILE_TYPE_FIFO:
+        case ICBTAG_FILE_TYPE_SYMLINK:
+            stats->found.numFiles++;
+            break;
+    }
+
+    if ((cts = compare_timestamps(stats->lvid.recordedTime, icb->modificationTime)) < 0)
+        report_lvid_timestamp(stats, seq, info.filename, cts);
+    info.modTime = icb->modificationTime;
+
+    if (uuid == 0 && stats->found.nextUID <= icb->uniqueID)
+        stats->found.nextUID = icb->uniqueID + 1;
+
+    print_file_info(info, depth);
+
+    if (icb->icb_ad == ICBTAG_FLAG_AD_IN_ICB) {
+        if (icb->fileType == ICBTAG_FILE_TYPE_DIRECTORY) {
+            struct walk_dir dir = { lsn, (uint8_t *)icb->allocDescs, icb->lengthAllocDescs, ICBTAG_FLAG_AD_IN_ICB, depth };
+            status |= inspect_directory(media, &dir, stats, seq);
+        }
+        return status;
+    }
+
+    for (uint32_t i = 0; i < icb->numAeds; i++)
+        increment_used_space(stats, stats->blocksize, icb->aeds[i]);
+
+    int nAD = scan_num_ads(icb);
+    for (int i = 0; i < nAD; i++) {
+        uint32_t extType, extLength, extPosition;
+        scan_get_ad(icb, i, &extType, &extLength, &extPosition);
+        if (icb->fileType == ICBTAG_FILE_TYPE_DIRECTORY) {
+            // Directory extents are accounted the same way as walk_directory() does it
+            if (extType != 2)
+                increment_used_space(stats, extLength ? extLength : 1, extPosition);
+        } else if (extType < 2) {
+            increment_used_space(stats, extLength, extPosition);
+        }
+    }
+
+    if (icb->fileType == ICBTAG_FILE_TYPE_DIRECTORY) {
+        struct walk_dir dir = { lsn, (uint8_t *)icb->dirContent, (uint32_t)icb->dirContentLen, ICBTAG_FLAG_AD_IN_ICB, depth };
+        status |= inspect_directory(media, &dir, stats, seq);
+    }
+    return status;
+}
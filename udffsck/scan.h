@@ -0,0 +1,75 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "udffsck.h"
+
+/**
+ * \brief (E)FE or AED found by sequential partition scan
+ *
+ * Only descriptors with valid tag checksum, CRC and position are recorded.
+ */
+struct scan_icb {
+    uint32_t  lbn;                  ///< position in partition, from tag
+    uint16_t  tagIdent;             ///< TAG_IDENT_FE, TAG_IDENT_EFE or TAG_IDENT_AED
+    uint16_t  tagSerialNum;
+    uint16_t  icb_ad;               ///< AD type from ICB tag
+    uint8_t   fileType;
+    uint8_t   unresolved;           ///< ICB needs get_file(), it was not resolved from graph
+    uint32_t  permissions;
+    uint64_t  informationLength;
+    uint64_t  uniqueID;
+    timestamp modificationTime;
+    uint8_t  *allocDescs;           ///< ADs (with AED chains collapsed) or FIDs of in-ICB directory
+    uint32_t  lengthAllocDescs;     ///< length of allocDescs in bytes
+    uint32_t *aeds;                 ///< LBNs of chained AEDs in chain order
+    uint32_t  numAeds;
+    uint8_t  *dirContent;           ///< directory contents, read after scan
+    uint64_t  dirContentLen;
+};
+
+/**
+ * \brief ICB graph of partition, sorted by LBN
+ */
+struct scan_graph {
+    struct scan_icb *icbs;
+    uint32_t         count;
+    uint32_t         size;
+    uint32_t         numFileEntries;    ///< number of indexed FEs and EFEs
+    uint32_t         numAeds;           ///< number of indexed AEDs
+};
+
+// Two pass file tree check
+int scan_partition(udf_media_t *media, struct filesystemStats *stats, struct scan_graph *graph);
+void scan_free(struct scan_graph *graph);
+const struct scan_icb *scan_find(const struct scan_graph *graph, uint32_t lbn);
+uint8_t scan_get_file(udf_media_t *media, uint32_t lsn, struct filesystemStats *stats, uint32_t depth,
+                      uint32_t uuid, struct fileInfo info, vds_sequence_t *seq);
+
+// Implemented in udffsck.c
+void print_file_info(struct fileInfo info, uint32_t depth);
+void increment_used_space(struct filesystemStats *stats, uint64_t increment, uint32_t position);
+void update_min_udf_revision(struct filesystemStats *stats, uint16_t new_revision);
+uint16_t calculate_crc(void * restrict desc, uint16_t size);
+uint8_t calculate_checksum(tag descTag);
+
+#endif //__SCAN_H__
@@ -26,6 +26,7 @@
 #include <sys/mman.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <sys/param.h>
 
@@ -33,6 +34,16 @@
 #include "utils.h"
 #include "libudffs.h"
 #include "options.h"
+#include "walk.h"
+#include "checkpoint.h"
+#include "cache.h"
+#include "badblocks.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "prefetch.h"
+#include "scan.h"
+#include "report.h"
+#include "repair.h"
 
 // Local function prototypes
 uint8_t get_file(udf_media_t *media,
@@ -40,20 +51,42 @@ uint8_t get_file(udf_media_t *media,
                  uint32_t uuid, struct fileInfo info, vds_sequence_t *seq );
 void increment_used_space(struct filesystemStats *stats, uint64_t increment, uint32_t position);
 uint8_t inspect_fid(udf_media_t *media,
-                    uint32_t lsn, uint8_t *base, uint32_t *pos,
+                    uint32_t lsn, uint8_t *base, uint32_t start, uint32_t *pos, int valid,
                     struct filesystemStats *stats, uint32_t depth, vds_sequence_t *seq, uint8_t *status);
 void print_file_chunks(struct filesystemStats *stats);
 int copy_descriptor(udf_media_t *media,
                     uint32_t sourcePosition, uint32_t destinationPosition, size_t size);
 int append_error(vds_sequence_t *seq, uint16_t tagIdent, vds_type_e vds, uint8_t error);
 uint8_t get_error(vds_sequence_t *seq, uint16_t tagIdent, vds_type_e vds);
-static void update_min_udf_revision(struct filesystemStats *stats, uint16_t new_revision);
+void update_min_udf_revision(struct filesystemStats *stats, uint16_t new_revision);
 
 // Local defines
 #define MARK_BLOCK 1    ///< Mark switch for markUsedBlock() function
 #define UNMARK_BLOCK 0  ///< Unmark switch for markUsedBlock() function
+#define DIR_WINDOW (1024 * 1024) ///< Bytes of directory contents inspected from one read of walk_directory()
+#define FID_MAX_LENGTH (38 + 65535 + 255) ///< Longest FID, ECMA 167r3 4/14.4
 
 #define MAX_DEPTH 100 ///< Maximal printed filetree depth is MAX_DEPTH/4. Required by function depth2str().
+#define EXTENT_LIST_INLINE 8 ///< Extents of ICB kept without heap allocation by collect_extents()
+
+/**
+ * Extent of short_ad, long_ad or ext_ad decoded by collect_extents()
+ */
+struct ad_extent {
+    uint32_t lbn;       ///< first block of extent
+    uint32_t length;    ///< extent length in bytes
+    uint32_t type;      ///< extent type, ECMA 167r3 4/14.14.1.1
+};
+
+/**
+ * Extents of ICB with AED chains collapsed
+ */
+struct extent_list {
+    struct ad_extent *ext;      ///< inlineExt or heap array
+    uint32_t count;
+    uint32_t capacity;
+    struct ad_extent inlineExt[EXTENT_LIST_INLINE];
+};
 
 /**
  * \brief File tree prefix creator
@@ -64,13 +97,17 @@ static void update_min_udf_revision(struct filesystemStats *stats, uint16_t new_
  * \return NULL terminated static char array with printed depth
  */
 char * depth2str(int32_t depth) {
-    static char prefix[MAX_DEPTH] = {0};
+    static __thread char prefix[MAX_DEPTH] = {0};
 
     if(depth == 0) {
         return prefix;
     }
 
-    if(depth < MAX_DEPTH) {
+    if(depth > MAX_DEPTH/4 - 1) {
+        depth = MAX_DEPTH/4 - 1; // deeper levels share the deepest prefix
+    }
+
+    {
         int i=0, c=0;
         int width = 4;
         for(i=0, c=0; c<depth-1; c++, i+=width) {
@@ -144,8 +181,61 @@ uint16_t calculate_crc(void * restrict desc, uint16_t size) {
 int crc(void * restrict desc, uint16_t size) {
     uint16_t calcCrc = calculate_crc(desc, size);
     tag *descTag = desc;
-    dbg("Calc CRC: 0x%04x, TagCRC: 0x%04x\n", calcCrc, descTag->descCRC);
-    return le16_to_cpu(descTag->descCRC) != calcCrc;
+    dbg("Calc CRC: 0x%04x, TagCRC: 0x%04x\n", calcCrc, udf_tag_crc(descTag));
+    return udf_tag_crc(descTag) != calcCrc;
+}
+
+/**
+ * \brief Tag checksum of FID computed on 64 bit words
+ *
+ * Same result as calculate_checksum(). Bytes of both halves of the tag are
+ * summed in 16 bit lanes, byte 4 (the checksum itself) is masked out.
+ *
+ * \param[in] *desc tag to check
+ * \return checksum result
+ */
+static inline uint8_t fid_tag_checksum(const uint8_t *desc) {
+    const uint64_t lanes = 0x00FF00FF00FF00FFULL;
+    uint64_t lo, hi;
+
+    memcpy(&lo, desc, sizeof(uint64_t));
+    memcpy(&hi, desc + sizeof(uint64_t), sizeof(uint64_t));
+    lo = le64_to_cpu(lo) & ~((uint64_t)0xFF << 32);
+    hi = le64_to_cpu(hi);
+
+    uint64_t sum = (lo & lanes) + ((lo >> 8) & lanes) + (hi & lanes) + ((hi >> 8) & lanes);
+    return (uint8_t)((sum * 0x0001000100010001ULL) >> 48);
+}
+
+/**
+ * \brief Validate run of FIDs in directory contents
+ *
+ * Tag identifier, tag checksum and CRC of consecutive FIDs are checked in one
+ * tight loop before the FIDs are inspected one by one. inspect_fid() does not
+ * repeat these checks for FIDs found valid here, the first FID which fails them
+ * goes down its diagnostic path.
+ *
+ * \param[in] *fids    directory contents
+ * \param[in] length   FIDs starting in first \p length bytes are validated
+ * \param[in] size     bytes available in \p fids
+ *
+ * \return number of leading valid FIDs
+ */
+uint32_t validate_fids(const uint8_t *fids, uint32_t length, uint32_t size) {
+    uint32_t count = 0;
+
+    for(uint32_t pos = 0; pos < length && pos + sizeof(struct fileIdentDesc) <= size; count++) {
+        const struct fileIdentDesc *fid = (const struct fileIdentDesc *)(fids + pos);
+        uint32_t flen = udf_fid_length(fid);
+
+        if(udf_tag_ident(&fid->descTag) != TAG_IDENT_FID
+           || fid_tag_checksum(fids + pos) != fid->descTag.tagChecksum
+           || pos + flen > size
+           || calculate_crc((void *)fid, (uint16_t)flen) != udf_tag_crc(&fid->descTag))
+            break;
+        pos += flen;
+    }
+    return count;
 }
 
 /**
@@ -158,8 +248,8 @@ int crc(void * restrict desc, uint16_t size) {
  * \return result of position comparison, 0 if match, 1 if differs
  */
 int check_position(tag descTag, uint32_t position) {
-    dbg("tag pos: 0x%x, pos: 0x%x\n", descTag.tagLocation, position);
-    return (descTag.tagLocation != position);
+    dbg("tag pos: 0x%x, pos: 0x%x\n", udf_tag_location(&descTag), position);
+    return (udf_tag_location(&descTag) != position);
 }
 
 /**
@@ -178,9 +268,10 @@ int check_position(tag descTag, uint32_t position) {
  * \warning char array is NOT NULL terminated
  */
 char * print_timestamp(timestamp ts) {
-    static char str[34+11] = {0}; //Total length is 34 characters. We add some reserve (11 bytes -> 1 for each parameter) to suppress GCC7 warnings.
-    uint8_t type = ts.typeAndTimezone >> 12;
-    int16_t offset = (ts.typeAndTimezone & 0x0800) > 0 ? (ts.typeAndTimezone & 0x0FFF) - (0x1000) : (ts.typeAndTimezone & 0x0FFF);
+    static __thread char str[34+11] = {0}; //Total length is 34 characters. We add some reserve (11 bytes -> 1 for each parameter) to suppress GCC7 warnings.
+    uint16_t typeAndTimezone = udf_timestamp_type_tz(&ts);
+    uint8_t type = typeAndTimezone >> 12;
+    int16_t offset = (typeAndTimezone & 0x0800) > 0 ? (typeAndTimezone & 0x0FFF) - (0x1000) : (typeAndTimezone & 0x0FFF);
     int8_t hrso = 0;
     int8_t mino = 0;
     dbg("offset: %d\n", offset);
@@ -188,8 +279,8 @@ char * print_timestamp(timestamp ts) {
         hrso = offset/60; // offset in hours
         mino = offset%60; // offset in minutes
     }
-    dbg("TypeAndTimezone: 0x%04x\n", ts.typeAndTimezone);
-    sprintf(str, "%04d-%02u-%02u %02u:%02u:%02u.%02u%02u%02u+%02d:%02d", ts.year, ts.month, ts.day, ts.hour, ts.minute, ts.second, ts.centiseconds, ts.hundredsOfMicroseconds ,ts.microseconds, hrso, mino);
+    dbg("TypeAndTimezone: 0x%04x\n", typeAndTimezone);
+    sprintf(str, "%04d-%02u-%02u %02u:%02u:%02u.%02u%02u%02u+%02d:%02d", udf_timestamp_year(&ts), ts.month, ts.day, ts.hour, ts.minute, ts.second, ts.centiseconds, ts.hundredsOfMicroseconds ,ts.microseconds, hrso, mino);
     return str; 
 }
 
@@ -210,7 +301,7 @@ time_t timestamp2epoch(timestamp t) {
     tm.tm_wday = 0;   
     tm.tm_yday = 0;   
     tm.tm_isdst = 0;  
-    tm.tm_year = t.year - 1900;
+    tm.tm_year = udf_timestamp_year(&t) - 1900;
     tm.tm_mon = t.month - 1; 
     tm.tm_mday = t.day;
     tm.tm_hour = t.hour;
@@ -219,8 +310,9 @@ time_t timestamp2epoch(timestamp t) {
     float rest = (t.centiseconds * 10000 + t.hundredsOfMicroseconds * 100 + t.microseconds)/1000000.0;
     if(rest > 0.5)
         tm.tm_sec++;
-    uint8_t type = t.typeAndTimezone >> 12;
-    int16_t offset = (t.typeAndTimezone & 0x0800) > 0 ? (t.typeAndTimezone & 0x0FFF) - (0x1000) : (t.typeAndTimezone & 0x0FFF);
+    uint16_t typeAndTimezone = udf_timestamp_type_tz(&t);
+    uint8_t type = typeAndTimezone >> 12;
+    int16_t offset = (typeAndTimezone & 0x0800) > 0 ? (typeAndTimezone & 0x0FFF) - (0x1000) : (typeAndTimezone & 0x0FFF);
     if(type == 1 && offset > -2047) { // timestamp is in local time. Convert to UTC.
         int8_t hrso = offset/60; // offset in hours
         int8_t mino = offset%60; // offset in minutes
@@ -345,106 +437,15 @@ void print_file_info(struct fileInfo info, uint32_t depth) {
     msg("\n");
 }
 
-static void sync_chunk(uint8_t **dev, uint32_t chunk, uint64_t devsize) {
-    uint32_t chunksize = CHUNK_SIZE;
-    uint64_t rest = devsize % chunksize;
-    if(dev[chunk] != NULL) {
-#ifndef MEMTRACE
-        dbg("Going to sync chunk #%u\n", chunk);
-#else
-        dbg("Going to sync chunk #%u, ptr: %p\n", chunk, dev[chunk]);
-#endif
-        if((rest > 0) && (chunk == (devsize / chunksize))) {
-            dbg("\tRest used\n");
-            msync(dev[chunk], chunksize, MS_SYNC);
-        } else {
-            dbg("\tChunk size used\n");
-            msync(dev[chunk], chunksize, MS_SYNC);
-        }
-        dbg("\tChunk #%u synced\n", chunk);
-    } else {
-        dbg("\tChunk #%u is unmapped\n", chunk);
-    }
-}
-
 void unmap_chunk(udf_media_t *media, uint32_t chunk) {
-    uint32_t chunksize = CHUNK_SIZE;
-    uint64_t rest = media->devsize % chunksize;
-    if (media->mapping[chunk] != NULL) {
-        sync_chunk(media->mapping, chunk, media->devsize);
-#ifndef MEMTRACE
-        dbg("Going to unmap chunk #%u\n", chunk);
-#else
-        dbg("Going to unmap chunk #%u, ptr: %p\n", chunk, media->mapping[chunk]);
-#endif
-        if ((rest > 0) && (chunk == (media->devsize / chunksize))) {
-            dbg("\tRest used\n");
-            munmap(media->mapping[chunk], rest);
-        } else {
-            dbg("\tChunk size used\n");
-            munmap(media->mapping[chunk], chunksize);
-        }
-        media->mapping[chunk] = NULL;
-        dbg("\tChunk #%u unmapped\n", chunk);
-    } else {
-        dbg("\tChunk #%u is already unmapped\n", chunk);
-#ifdef MEMTRACE
-        dbg("[MEMTRACE] Chunk #%u is already unmapped\n", chunk);
-#endif
-    }
+    cache_put(media, chunk);
 }
 
 void map_chunk(udf_media_t* media, uint32_t chunk, char * file, int line) {
-    uint32_t chunksize = CHUNK_SIZE;
-    uint32_t rest = (uint32_t) (media->devsize % chunksize);
-    if (media->mapping[chunk] != NULL) {
-        dbg("\tChunk #%u is already mapped.\n", chunk);
-        return;
-    }
 #ifdef MEMTRACE
     dbg("[MEMTRACE] map_chunk source call: %s:%d\n", file, line);
 #endif
-    dbg("\tSize: 0x%" PRIx64 ", chunk size 0x%x, rest: 0x%x\n", media->devsize, chunksize, rest);
-
-    int prot = PROT_READ;
-    // If is there some request for corrections, we need read/write access to the medium
-    if(interactive || autofix) {
-        prot |= PROT_WRITE;
-        dbg("\tRW\n");
-    }
-
-    dbg("\tdevsize/chunksize = %" PRIu64 "\n", media->devsize / chunksize);
-    if ((rest > 0) && (chunk == (media->devsize / chunksize))) {
-        dbg("\tRest used\n");
-        media->mapping[chunk] = (uint8_t *)mmap(NULL, rest, prot, MAP_SHARED, media->fd, (uint64_t)(chunk)*chunksize);
-    } else {
-        dbg("\tChunk size used\n");
-        media->mapping[chunk] = (uint8_t *)mmap(NULL, chunksize, prot, MAP_SHARED, media->fd, (uint64_t)(chunk)*chunksize);
-    }
-    if (media->mapping[chunk] == MAP_FAILED) {
-        switch(errno) {
-            case EACCES: dbg("EACCES\n"); break;
-            case EAGAIN: dbg("EAGAIN\n"); break;
-            case EBADF: dbg("EBADF\n"); break;
-            case EINVAL: dbg("EINVAL\n"); break;
-            case ENFILE: dbg("ENFILE\n"); break;
-            case ENODEV: dbg("ENODEV\n"); break;
-            case ENOMEM: dbg("ENOMEM\n"); break;
-            case EPERM: dbg("EPERM\n"); break;
-            case ETXTBSY: dbg("ETXTBSY\n"); break;
-            case EOVERFLOW: dbg("EOVERFLOW\n"); break;
-            default: dbg("EUnknown\n"); break;
-        }
-
-        fatal("\tError mapping: %s.\n", strerror(errno));
-        exit(ESTATUS_OPERATIONAL_ERROR);
-    }
-#ifdef MEMTRACE
-    dbg("\tChunk #%u allocated, pointer: %p, offset 0x%" PRIx64 "\n", chunk,
-        media->mapping[chunk], (uint64_t)(chunk)*chunksize);
-#else
-    dbg("\tChunk #%u allocated\n", chunk);
-#endif
+    cache_get(media, chunk);
 
     // Suppressing unused variables
     (void)file;
@@ -507,6 +508,100 @@ static void map_raw(int fd, uint8_t **ptr, uint64_t offset, size_t size, uint64_
 #endif
 }
 
+/**
+ * \brief Reference descriptor in place in block cache
+ *
+ * Descriptor is not copied, returned pointer points into cache window which stays pinned until
+ * own_descriptor() or release_descriptor() is called. View must be treated as read only, function
+ * which modifies the descriptor has to call own_descriptor() first. Only descriptors crossing cache
+ * windows (or exceeding amount of views) are copied to allocated memory.
+ *
+ * \param[in] media     Information regarding medium & access to it
+ * \param[in] position  position of descriptor on medium in bytes
+ * \param[in] length    length of descriptor in bytes
+ *
+ * \return pointer to descriptor, NULL if copy cannot be allocated
+ */
+void *view_descriptor(udf_media_t *media, uint64_t position, size_t length) {
+    uint32_t chunksize = media->chunksize;
+    uint32_t chunk  = (uint32_t)(position / chunksize);
+    uint32_t offset = (uint32_t)(position % chunksize);
+    uint8_t *raw = NULL;
+    void *desc;
+
+    if(offset + length <= chunksize && position + length <= media->devsize && media->numViews < DESC_VIEWS) {
+        map_chunk(media, chunk, __FILE__, __LINE__);
+        desc = media->mapping[chunk] + offset;
+        media->views[media->numViews].desc = desc;
+        media->views[media->numViews].chunk = chunk;
+        media->views[media->numViews].length = (uint32_t)length;
+        media->numViews++;
+        return desc;
+    }
+
+    dbg("Descriptor at 0x%" PRIx64 " crosses cache window, copy it\n", position);
+    desc = malloc(length);
+    if(desc == NULL)
+        return NULL;
+    map_raw(media->fd, &raw, (uint64_t)(chunk)*chunksize, length + offset, media->devsize);
+    memcpy(desc, raw+offset, length);
+    unmap_raw(&raw, (uint64_t)(chunk)*chunksize, length + offset);
+    return desc;
+}
+
+static int find_view(udf_media_t *media, const void *desc) {
+    for(uint32_t i = 0; i < media->numViews; i++) {
+        if(media->views[i].desc == desc)
+            return (int)i;
+    }
+    return -1;
+}
+
+static void drop_view(udf_media_t *media, int i) {
+    unmap_chunk(media, media->views[i].chunk);
+    media->views[i] = media->views[--media->numViews];
+}
+
+/**
+ * \brief Make private copy of descriptor returned by view_descriptor() before it is modified
+ *
+ * \param[in] media  Information regarding medium & access to it
+ * \param[in] desc   descriptor returned by view_descriptor()
+ *
+ * \return pointer to modifiable descriptor, which replaces desc
+ */
+void *own_descriptor(udf_media_t *media, void *desc) {
+    int i = find_view(media, desc);
+    void *copy;
+
+    if(i < 0)
+        return desc;
+
+    copy = malloc(media->views[i].length);
+    if(copy == NULL) {
+        fatal("Cannot allocate descriptor copy.\n");
+        exit(ESTATUS_OPERATIONAL_ERROR);
+    }
+    memcpy(copy, desc, media->views[i].length);
+    drop_view(media, i);
+    return copy;
+}
+
+/**
+ * \brief Release descriptor returned by view_descriptor() or own_descriptor()
+ *
+ * \param[in] media  Information regarding medium & access to it
+ * \param[in] desc   descriptor, may be NULL
+ */
+void release_descriptor(udf_media_t *media, void *desc) {
+    int i = find_view(media, desc);
+
+    if(i >= 0)
+        drop_view(media, i);
+    else
+        free(desc);
+}
+
 char * dstring_suberror(uint8_t e_code) {
    switch(e_code) {
         case 0:
@@ -675,7 +770,7 @@ int is_udf(udf_media_t* media, int force_sectorsize, struct filesystemStats *sta
     int notFound = 0;
     int foundBEA = 0;
     uint32_t chunk = 0;
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
 
     for(int it=0; it<2; it++, ssize *= 2) {
         if(force_sectorsize) {
@@ -796,7 +891,7 @@ int get_avdp(udf_media_t *media, avdp_type_e type, int force_sectorsize,
     tag desc_tag;
     int ssize = 512;
     int status = 0;
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
     uint32_t chunk = 0;
     uint32_t offset = 0;
 
@@ -848,7 +943,7 @@ int get_avdp(udf_media_t *media, avdp_type_e type, int force_sectorsize,
             } 
             continue;
         }
-        if(le16_to_cpu(desc_tag.tagIdent) != TAG_IDENT_AVDP) {
+        if(udf_tag_ident(&desc_tag) != TAG_IDENT_AVDP) {
             status |= E_WRONGDESC;
             unmap_chunk(media, chunk);
             if(type == THIRD_AVDP) {
@@ -856,10 +951,10 @@ int get_avdp(udf_media_t *media, avdp_type_e type, int force_sectorsize,
             } 
             continue;
         }
-        dbg("Tag Serial Num: %u\n", desc_tag.tagSerialNum);
+        dbg("Tag Serial Num: %u\n", udf_tag_serial(&desc_tag));
         if(stats->AVDPSerialNum == 0xFFFF) { // Default state -> save first found 
-            stats->AVDPSerialNum = desc_tag.tagSerialNum;
-        } else if(stats->AVDPSerialNum != desc_tag.tagSerialNum) { //AVDP serial number differs, no recovery support. UDF 2.1.6
+            stats->AVDPSerialNum = udf_tag_serial(&desc_tag);
+        } else if(stats->AVDPSerialNum != udf_tag_serial(&desc_tag)) { //AVDP serial number differs, no recovery support. UDF 2.1.6
             stats->AVDPSerialNum = 0; //No recovery support
         }
 
@@ -870,7 +965,7 @@ int get_avdp(udf_media_t *media, avdp_type_e type, int force_sectorsize,
             // that doesn't cover the large 'reserved' region of the AVDP.
             // This does not bother Windows or Linux, don't let it bother us.
             uint16_t shortenedDescSize = offsetof(struct anchorVolDescPtr, reserved);
-            if (   (desc_tag.descCRCLength == (shortenedDescSize - sizeof(tag)))
+            if (   (udf_tag_crc_length(&desc_tag) == (shortenedDescSize - sizeof(tag)))
                 && (crc(media->disc.udf_anchor[type], shortenedDescSize) == 0)) {
                 warn("AVDP descCRCLength is non-compliant\n");
             }
@@ -888,17 +983,18 @@ int get_avdp(udf_media_t *media, avdp_type_e type, int force_sectorsize,
         }
 
         dbg("AVDP[%d]: Main Ext Len: %u, Reserve Ext Len: %u\n", type,
-            media->disc.udf_anchor[type]->mainVolDescSeqExt.extLength,
-            media->disc.udf_anchor[type]->reserveVolDescSeqExt.extLength);
+            udf_extad_length(&media->disc.udf_anchor[type]->mainVolDescSeqExt),
+            udf_extad_length(&media->disc.udf_anchor[type]->reserveVolDescSeqExt));
         dbg("AVDP[%d]: Main Ext Pos: 0x%08x, Reserve Ext Pos: 0x%08x\n", type,
-            media->disc.udf_anchor[type]->mainVolDescSeqExt.extLocation,
-            media->disc.udf_anchor[type]->reserveVolDescSeqExt.extLocation);
-        if (   (media->disc.udf_anchor[type]->mainVolDescSeqExt.extLength < (uint32_t)(16*ssize))
-            || (media->disc.udf_anchor[type]->reserveVolDescSeqExt.extLength < (uint32_t)(16*ssize))) {
+            udf_extad_location(&media->disc.udf_anchor[type]->mainVolDescSeqExt),
+            udf_extad_location(&media->disc.udf_anchor[type]->reserveVolDescSeqExt));
+        if (   (udf_extad_length(&media->disc.udf_anchor[type]->mainVolDescSeqExt) < (uint32_t)(16*ssize))
+            || (udf_extad_length(&media->disc.udf_anchor[type]->reserveVolDescSeqExt) < (uint32_t)(16*ssize))) {
             status |= E_EXTLEN;
         }
 
         msg("AVDP[%d] successfully loaded.\n", type);
+        report_desc(TAG_IDENT_AVDP);
         media->sectorsize = ssize;
 
         if(status & E_CHECKSUM) {
@@ -927,6 +1023,8 @@ int get_avdp(udf_media_t *media, avdp_type_e type, int force_sectorsize,
 /**
  * \brief Loads Volume Descriptor Sequence (VDS) and stores it at struct udf_disc
  *
+ * Descriptors are referenced in place in block cache, see view_descriptor().
+ *
  * \param[in] media   Information regarding medium & access to it
  * \param[in] vds     MAIN_VDS or RESERVE_VDS selector
  * \param[out] *seq   structure capturing actual order of descriptors in VDS for recovery
@@ -937,11 +1035,10 @@ int get_avdp(udf_media_t *media, avdp_type_e type, int force_sectorsize,
  */
 int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t *seq) {
     uint8_t *position;
-    uint8_t *raw = NULL;
     int8_t counter = 0;
     tag descTag;
     uint64_t location = 0;
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
     uint32_t chunk = 0;
     uint32_t offset = 0;
     uint32_t descLen;
@@ -950,14 +1047,14 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
     switch(vds) {
         case MAIN_VDS:
             location =   media->sectorsize
-                       * ((uint64_t)(media->disc.udf_anchor[avdp]->mainVolDescSeqExt.extLocation));
-            dbg("VDS location: 0x%x\n", media->disc.udf_anchor[avdp]->mainVolDescSeqExt.extLocation);
+                       * ((uint64_t)udf_extad_location(&media->disc.udf_anchor[avdp]->mainVolDescSeqExt));
+            dbg("VDS location: 0x%x\n", udf_extad_location(&media->disc.udf_anchor[avdp]->mainVolDescSeqExt));
             break;
 
         case RESERVE_VDS:
             location =   media->sectorsize
-                       * ((uint64_t)(media->disc.udf_anchor[avdp]->reserveVolDescSeqExt.extLocation));
-            dbg("VDS location: 0x%x\n", media->disc.udf_anchor[avdp]->reserveVolDescSeqExt.extLocation);
+                       * ((uint64_t)udf_extad_location(&media->disc.udf_anchor[avdp]->reserveVolDescSeqExt));
+            dbg("VDS location: 0x%x\n", udf_extad_location(&media->disc.udf_anchor[avdp]->reserveVolDescSeqExt));
             break;
     }
     chunk = location/chunksize;
@@ -972,21 +1069,22 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
         // Read tag
         memcpy(&descTag, position, sizeof(descTag));
 
-        dbg("Tag ID: %u\n", descTag.tagIdent);
+        dbg("Tag ID: %u\n", udf_tag_ident(&descTag));
 
         if(vds == MAIN_VDS) {
-            seq->main[counter].tagIdent = descTag.tagIdent;
+            seq->main[counter].tagIdent = udf_tag_ident(&descTag);
             seq->main[counter].tagLocation = (location) / media->sectorsize;
         } else {
-            seq->reserve[counter].tagIdent = descTag.tagIdent;
+            seq->reserve[counter].tagIdent = udf_tag_ident(&descTag);
             seq->reserve[counter].tagLocation = (location) / media->sectorsize;
         }
 
         counter++;
         dbg("Tag stored\n");
+        report_desc(udf_tag_ident(&descTag));
 
         // What kind of descriptor is that?
-        switch(le16_to_cpu(descTag.tagIdent)) {
+        switch(udf_tag_ident(&descTag)) {
             case TAG_IDENT_PVD:
                 descLen = sizeof(struct primaryVolDesc);
                 if (media->disc.udf_pvd[vds] != 0) {
@@ -994,12 +1092,11 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
                     unmap_chunk(media, chunk);
                     return -4;
                 }
-                media->disc.udf_pvd[vds] = malloc(descLen); // Prepare memory
-                memcpy(media->disc.udf_pvd[vds], position, descLen);
-                dbg("VolNum: %u\n",  media->disc.udf_pvd[vds]->volDescSeqNum);
-                dbg("pVolNum: %u\n", media->disc.udf_pvd[vds]->primaryVolDescNum);
-                dbg("seqNum: %u\n",  media->disc.udf_pvd[vds]->volSeqNum);
-                dbg("predLoc: %u\n", media->disc.udf_pvd[vds]->predecessorVolDescSeqLocation);
+                media->disc.udf_pvd[vds] = view_descriptor(media, location, descLen);
+                dbg("VolNum: %u\n",  le32_to_cpu(media->disc.udf_pvd[vds]->volDescSeqNum));
+                dbg("pVolNum: %u\n", le32_to_cpu(media->disc.udf_pvd[vds]->primaryVolDescNum));
+                dbg("seqNum: %u\n",  le16_to_cpu(media->disc.udf_pvd[vds]->volSeqNum));
+                dbg("predLoc: %u\n", le32_to_cpu(media->disc.udf_pvd[vds]->predecessorVolDescSeqLocation));
                 break;
 
             case TAG_IDENT_IUVD:
@@ -1010,11 +1107,10 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
                     return -4;
                 }
                 dbg("Store IUVD\n");
-                media->disc.udf_iuvd[vds] = malloc(descLen); // Prepare memory
+                media->disc.udf_iuvd[vds] = view_descriptor(media, location, descLen);
 #ifdef MEMTRACE
-                dbg("Malloc ptr: %p\n", media->disc.udf_iuvd[vds]);
+                dbg("View ptr: %p\n", media->disc.udf_iuvd[vds]);
 #endif
-                memcpy(media->disc.udf_iuvd[vds], position, descLen);
                 dbg("Stored\n"); 
                 break;
 
@@ -1025,8 +1121,7 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
                     unmap_chunk(media, chunk);
                     return -4;
                 }
-                media->disc.udf_pd[vds] = malloc(descLen); // Prepare memory
-                memcpy(media->disc.udf_pd[vds], position, descLen);
+                media->disc.udf_pd[vds] = view_descriptor(media, location, descLen);
                 break;
 
             case TAG_IDENT_LVD:
@@ -1041,14 +1136,10 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
                 lvd = (struct logicalVolDesc *)(position);
 
                 descLen = sizeof(struct logicalVolDesc) + le32_to_cpu(lvd->mapTableLength);
-                media->disc.udf_lvd[vds] = malloc(descLen); // Prepare memory
-
-                map_raw(media->fd, &raw, (uint64_t)(chunk)*CHUNK_SIZE, descLen + offset, media->devsize);
-                memcpy(media->disc.udf_lvd[vds], raw+offset, descLen);
-                unmap_raw(&raw, (uint64_t)(chunk)*CHUNK_SIZE, descLen + offset);
+                media->disc.udf_lvd[vds] = view_descriptor(media, location, descLen);
 
-                dbg("NumOfPartitionMaps: %u\n", media->disc.udf_lvd[vds]->numPartitionMaps);
-                dbg("MapTableLength: %u\n",     media->disc.udf_lvd[vds]->mapTableLength);
+                dbg("NumOfPartitionMaps: %u\n", le32_to_cpu(media->disc.udf_lvd[vds]->numPartitionMaps));
+                dbg("MapTableLength: %u\n",     le32_to_cpu(media->disc.udf_lvd[vds]->mapTableLength));
                 for(int i=0; i<(int)(le32_to_cpu(lvd->mapTableLength)); i++) {
                     note("[0x%02x] ", media->disc.udf_lvd[vds]->partitionMaps[i]);
                 }
@@ -1064,16 +1155,12 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
 
                 struct unallocSpaceDesc *usd;
                 usd = (struct unallocSpaceDesc *)(position);
-                dbg("VolDescNum: %u\n", usd->volDescSeqNum);
-                dbg("NumAllocDesc: %u\n", usd->numAllocDescs);
+                dbg("VolDescNum: %u\n", le32_to_cpu(usd->volDescSeqNum));
+                dbg("NumAllocDesc: %u\n", le32_to_cpu(usd->numAllocDescs));
 
                 descLen =   sizeof(struct unallocSpaceDesc)
                           + le32_to_cpu(usd->numAllocDescs) * sizeof(extent_ad);
-                media->disc.udf_usd[vds] = malloc(descLen); // Prepare memory
-
-                map_raw(media->fd, &raw, (uint64_t)(chunk)*CHUNK_SIZE, descLen + offset, media->devsize);
-                memcpy(media->disc.udf_usd[vds], raw+offset, descLen);
-                unmap_raw(&raw, (uint64_t)(chunk)*CHUNK_SIZE, descLen + offset);
+                media->disc.udf_usd[vds] = view_descriptor(media, location, descLen);
                 break;
 
             case TAG_IDENT_TD:
@@ -1083,8 +1170,7 @@ int get_vds(udf_media_t *media, avdp_type_e avdp, vds_type_e vds, vds_sequence_t
                     return -4;
                 }
                 descLen = sizeof(struct terminatingDesc);
-                media->disc.udf_td[vds] = malloc(descLen); // Prepare memory
-                memcpy(media->disc.udf_td[vds], position, descLen);
+                media->disc.udf_td[vds] = view_descriptor(media, location, descLen);
                 // Found terminator, ending.
                 unmap_chunk(media, chunk);
                 return 0;
@@ -1152,7 +1238,7 @@ int get_correct(vds_sequence_t *seq, uint16_t tagIdent) {
  * \return ESTATUS_UNCORRECTED_ERRORS structure is already set or no correct LVID found
  */
 int get_lvid(udf_media_t *media, integrity_info_t *info, vds_sequence_t *seq ) {
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
     uint32_t chunk = 0;
     uint32_t offset = 0;
     uint64_t position = 0;
@@ -1167,8 +1253,8 @@ int get_lvid(udf_media_t *media, integrity_info_t *info, vds_sequence_t *seq ) {
         return ESTATUS_UNCORRECTED_ERRORS;
     }
 
-    uint32_t loc = media->disc.udf_lvd[vds]->integritySeqExt.extLocation;
-    uint32_t len = media->disc.udf_lvd[vds]->integritySeqExt.extLength;
+    uint32_t loc = udf_extad_location(&media->disc.udf_lvd[vds]->integritySeqExt);
+    uint32_t len = udf_extad_length(&media->disc.udf_lvd[vds]->integritySeqExt);
     dbg("LVID: loc: %u, len: %u\n", loc, len);
 
     position = loc * (uint64_t)media->sectorsize;
@@ -1179,10 +1265,9 @@ int get_lvid(udf_media_t *media, integrity_info_t *info, vds_sequence_t *seq ) {
     struct logicalVolIntegrityDesc *lvid;
     lvid = (struct logicalVolIntegrityDesc *)(media->mapping[chunk] + offset);
 
-    media->disc.udf_lvid = malloc(len);
-    memcpy(media->disc.udf_lvid, media->mapping[chunk]+offset, len);
+    media->disc.udf_lvid = view_descriptor(media, position, len);
 
-    if (lvid->descTag.tagIdent != TAG_IDENT_LVID) {
+    if (udf_tag_ident(&lvid->descTag) != TAG_IDENT_LVID) {
         err("LVID not found\n");
         seq->lvid.error |= E_WRONGDESC;
         unmap_chunk(media, chunk);
@@ -1190,43 +1275,45 @@ int get_lvid(udf_media_t *media, integrity_info_t *info, vds_sequence_t *seq ) {
         return ESTATUS_OK;
     }
     else {
+        report_desc(TAG_IDENT_LVID);
         if (!checksum(lvid->descTag)) {
             err("LVID checksum error. Continue with caution.\n");
             seq->lvid.error |= E_CHECKSUM;
         }
-        if (crc(lvid, lvid->descTag.descCRCLength + sizeof(tag))) {
+        if (crc(lvid, udf_tag_crc_length(&lvid->descTag) + sizeof(tag))) {
             err("LVID CRC error. Continue with caution.\n");
             seq->lvid.error |= E_CRC;
         }
     }
 
-    dbg("LVID: lenOfImpUse: %u\n",     media->disc.udf_lvid->lengthOfImpUse);
-    dbg("LVID: numOfPartitions: %u\n", media->disc.udf_lvid->numOfPartitions);
+    dbg("LVID: lenOfImpUse: %u\n",     le32_to_cpu(media->disc.udf_lvid->lengthOfImpUse));
+    dbg("LVID: numOfPartitions: %u\n", le32_to_cpu(media->disc.udf_lvid->numOfPartitions));
 
     struct impUseLVID *impUse =
         (struct impUseLVID *)(  (uint8_t *)(media->disc.udf_lvid)
                               + sizeof(struct logicalVolIntegrityDesc)
-                              + 8 * media->disc.udf_lvid->numOfPartitions); // Because of ECMA 167r3, 3/24, fig 22
+                              + 8 * le32_to_cpu(media->disc.udf_lvid->numOfPartitions)); // Because of ECMA 167r3, 3/24, fig 22
     struct logicalVolHeaderDesc *lvhd =
         (struct logicalVolHeaderDesc *)(media->disc.udf_lvid->logicalVolContentsUse);
-    info->nextUID = lvhd->uniqueID;
+    info->nextUID = le64_to_cpu(lvhd->uniqueID);
 
     info->recordedTime = lvid->recordingDateAndTime;
 
-    dbg("LVID: number of files: %u\n", impUse->numOfFiles);
-    dbg("LVID: number of dirs:  %u\n", impUse->numOfDirs);
-    dbg("LVID: UDF rev: min read:  %04x\n", impUse->minUDFReadRev);
-    dbg("               min write: %04x\n", impUse->minUDFWriteRev);
-    dbg("               max write: %04x\n", impUse->maxUDFWriteRev);
-    dbg("Next Unique ID: %" PRIu64 "\n", info->nextUID);
+        dbg("Next Unique ID: %" PRIu64 "\n", info->nextUID);
     dbg("LVID recording timestamp: %s\n", print_timestamp(info->recordedTime));
 
-    info->numFiles = impUse->numOfFiles;
-    info->numDirs = impUse->numOfDirs;
+    info->numFiles = le32_to_cpu(impUse->numOfFiles);
+    info->numDirs = le32_to_cpu(impUse->numOfDirs);
+
+    info->minUDFReadRev = le16_to_cpu(impUse->minUDFReadRev);
+    info->minUDFWriteRev = le16_to_cpu(impUse->minUDFWriteRev);
+    info->maxUDFWriteRev = le16_to_cpu(impUse->maxUDFWriteRev);
 
-    info->minUDFReadRev = impUse->minUDFReadRev;
-    info->minUDFWriteRev = impUse->minUDFWriteRev;
-    info->maxUDFWriteRev = impUse->maxUDFWriteRev;
+    dbg("LVID: number of files: %u\n", info->numFiles);
+    dbg("LVID: number of dirs:  %u\n", info->numDirs);
+    dbg("LVID: UDF rev: min read:  %04x\n", info->minUDFReadRev);
+    dbg("               min write: %04x\n", info->minUDFWriteRev);
+    dbg("               max write: %04x\n", info->maxUDFWriteRev);
 
     dbg("Logical Volume Contents Use\n");
     for(int i=0; i<32; ) {
@@ -1237,20 +1324,21 @@ int get_lvid(udf_media_t *media, integrity_info_t *info, vds_sequence_t *seq ) {
     }
     dbg("Free Space Table\n");
     const uint32_t *freeSpaceTable = (const uint32_t *) media->disc.udf_lvid->data;
-    const uint32_t *sizeTable      = freeSpaceTable + media->disc.udf_lvid->numOfPartitions;
-    for(uint32_t i=0; i < media->disc.udf_lvid->numOfPartitions; i++) {
-        note("0x%08x, %u\n", freeSpaceTable[i], freeSpaceTable[i]);
+    const uint32_t numOfPartitions = le32_to_cpu(media->disc.udf_lvid->numOfPartitions);
+    const uint32_t *sizeTable      = freeSpaceTable + numOfPartitions;
+    for(uint32_t i=0; i < numOfPartitions; i++) {
+        note("0x%08x, %u\n", le32_to_cpu(freeSpaceTable[i]), le32_to_cpu(freeSpaceTable[i]));
     }
 
-    info->freeSpaceBlocks    = freeSpaceTable[0];
-    info->partitionNumBlocks = sizeTable[0];
+    info->freeSpaceBlocks    = le32_to_cpu(freeSpaceTable[0]);
+    info->partitionNumBlocks = le32_to_cpu(sizeTable[0]);
 
     dbg("Size Table\n");
-    for(uint32_t i=0; i < media->disc.udf_lvid->numOfPartitions; i++) {
-        note("0x%08x, %u\n", sizeTable[i], sizeTable[i]);
+    for(uint32_t i=0; i < numOfPartitions; i++) {
+        note("0x%08x, %u\n", le32_to_cpu(sizeTable[i]), le32_to_cpu(sizeTable[i]));
     }
 
-    if (media->disc.udf_lvid->nextIntegrityExt.extLength > 0) {
+    if (udf_extad_length(&media->disc.udf_lvid->nextIntegrityExt) > 0) {
         dbg("Next integrity extent found.\n");
     } else {
         dbg("No other integrity extents are here.\n");
@@ -1284,7 +1372,7 @@ int check_blocksize(udf_media_t *media, int force_sectorsize, vds_sequence_t *se
         return ESTATUS_UNCORRECTED_ERRORS;
     }
 
-    int lvd_blocksize = media->disc.udf_lvd[vds]->logicalBlockSize;
+    int lvd_blocksize = le32_to_cpu(media->disc.udf_lvd[vds]->logicalBlockSize);
     
     if (lvd_blocksize != media->sectorsize) {
         if(force_sectorsize) {
@@ -1339,6 +1427,136 @@ int get_volume_identifier(struct udf_disc *disc, struct filesystemStats *stats,
     return 0;
 }
 
+/**
+ * \brief Warn about blocks of area which already are in requested state
+ *
+ * Conflicting blocks are reported as runs, one line per run.
+ *
+ * \param[in] bitmap actual partition bitmap
+ * \param[in] lbn    first block of area
+ * \param[in] end    block after area
+ * \param[in] mark   MARK_BLOCK or UNMARK_BLOCK switch
+ */
+static void report_mark_conflicts(const struct page_bitmap *bitmap, uint32_t lbn, uint32_t end, uint8_t mark) {
+    // Marking conflicts on cleared (used) bits, unmarking on set (unused) ones
+    int conflict = mark ? 0 : 1;
+
+    while((lbn = page_bitmap_find(bitmap, lbn, end, conflict)) < end) {
+        uint32_t last = page_bitmap_find(bitmap, lbn, end, !conflict) - 1;
+        if(last == lbn) {
+            if(mark)
+                warn("[%u:%u]Error marking block as used. It is already marked.\n", lbn / 8, lbn % 8);
+            else
+                warn("[%u:%u]Error marking block as unused. It is already unmarked.\n", lbn / 8, lbn % 8);
+        } else {
+            if(mark)
+                warn("[%u:%u]-[%u:%u]Error marking %u blocks as used. They are already marked.\n",
+                     lbn / 8, lbn % 8, last / 8, last % 8, last - lbn + 1);
+            else
+                warn("[%u:%u]-[%u:%u]Error marking %u blocks as unused. They are already unmarked.\n",
+                     lbn / 8, lbn % 8, last / 8, last % 8, last - lbn + 1);
+        }
+        lbn = last + 1;
+    }
+}
+
+/**
+ * \brief Apply mark to area of actual bitmap
+ *
+ * \param[in,out] *bitmap actual partition bitmap
+ * \param[in] lbn    first block of area
+ * \param[in] size   length of area, within current window of \p bitmap
+ * \param[in] mark   MARK_BLOCK or UNMARK_BLOCK switch
+ * \param[in] report warn about blocks already in requested state
+ *
+ * \return 0 on success, -1 when heap allocation failed
+ */
+static int apply_mark(struct page_bitmap *bitmap, uint32_t lbn, uint32_t size, uint8_t mark, int report) {
+    uint32_t end = lbn + size;
+    // Free blocks have their bit set
+    uint32_t unused = page_bitmap_count(bitmap, lbn, size);
+
+    if(mark) { // write 0
+        if(report && unused != size)
+            report_mark_conflicts(bitmap, lbn, end, mark);
+        return page_bitmap_clear(bitmap, lbn, size);
+    } else { // write 1
+        if(report && unused != 0)
+            report_mark_conflicts(bitmap, lbn, end, mark);
+        return page_bitmap_set(bitmap, lbn, size);
+    }
+}
+
+static int replay_mark(void *arg, uint32_t lbn, uint32_t size, uint8_t value) {
+    return apply_mark(arg, lbn, size, value ? UNMARK_BLOCK : MARK_BLOCK, 1);
+}
+
+static int rebuild_mark(void *arg, uint32_t lbn, uint32_t size, uint8_t value) {
+    return apply_mark(arg, lbn, size, value ? UNMARK_BLOCK : MARK_BLOCK, 0);
+}
+
+/**
+ * \brief Call \p fn for every window of actual bitmap
+ *
+ * Without memory limit actual bitmap is kept whole and \p fn is called once.
+ * Otherwise current window is used as it is and the other ones are rebuilt
+ * from recorded marks. The first pass after file tree check is done with
+ * \p report set, so marking conflicts outside of the window marked during
+ * the walk are reported; later passes rebuild windows quietly.
+ *
+ * \param[in,out] *stats  file system status
+ * \param[in]     report  warn about marking conflicts of rebuilt windows
+ * \param[in]     fn      called with range of current window, may be NULL
+ * \param[in]     arg     passed to \p fn
+ *
+ * \return 0 on success, -1 when window cannot be rebuilt, otherwise nonzero value returned by \p fn
+ */
+int for_each_bitmap_window(struct filesystemStats *stats, int report,
+                           int (*fn)(struct filesystemStats *stats, uint32_t start, uint32_t length, void *arg),
+                           void *arg) {
+    struct page_bitmap *bitmap = stats->actPartitionBitmap;
+    uint32_t step = bitmap->windowBits ? bitmap->windowBits : bitmap->numBits;
+    uint64_t start = 0;
+    int ret;
+
+    do {
+        if(start != bitmap->windowStart) {
+            page_bitmap_window(bitmap, (uint32_t)start);
+            ret = page_bitmap_replay(bitmap, report ? replay_mark : rebuild_mark, bitmap);
+            if(ret != 0)
+                return -1;
+        }
+        if(fn != NULL) {
+            ret = fn(stats, bitmap->windowStart, bitmap->windowEnd - bitmap->windowStart, arg);
+            if(ret != 0)
+                return ret;
+        }
+        start += step;
+    } while(step > 0 && start < bitmap->numBits);
+    return 0;
+}
+
+/**
+ * \brief Destination of copy_bitmap_window()
+ */
+struct bitmap_copy {
+    uint8_t *dst;       ///< plain bitmap starting at bit 0
+    uint64_t numBits;   ///< bits available in dst
+};
+
+/**
+ * \brief Copy window of actual bitmap to plain bitmap, for for_each_bitmap_window()
+ */
+static int copy_bitmap_window(struct filesystemStats *stats, uint32_t start, uint32_t length, void *arg) {
+    struct bitmap_copy *copy = arg;
+
+    if(start >= copy->numBits)
+        return 0;
+    length = (uint32_t)MIN(length, copy->numBits - start);
+    page_bitmap_read(stats->actPartitionBitmap, copy->dst + start / 8, start, length);
+    return 0;
+}
+
 /**
  * \brief Marks used blocks in actual bitmap
  *
@@ -1354,37 +1572,28 @@ int get_volume_identifier(struct udf_disc *disc, struct filesystemStats *stats,
  * \return -1 marking failed (actParititonBitmap is uninitialized)
  */ 
 uint8_t markUsedBlock(struct filesystemStats *stats, uint32_t lbn, uint32_t size, uint8_t mark) {
+    if (stats->walk) {
+        // Conflicts depend on walk order, mark is applied when the walk is replayed
+        return walk_defer_mark(stats->walk, lbn, size, mark);
+    }
     if ((lbn + size) <= stats->found.partitionNumBlocks) {
-        uint32_t byte = 0;
-        uint8_t bit = 0;
+        uint32_t end = lbn + size;
 
         dbg("Marked LBN %u with size %u\n", lbn, size);
         if(size == 0) {
             dbg("Size is 0, return.\n");
             return 0;
         }
-        int i = 0;
-        do {
-            byte = lbn/8;
-            bit = lbn%8;
-            if(mark) { // write 0
-                if(stats->actPartitionBitmap[byte] & (1<<bit)) {
-                    stats->actPartitionBitmap[byte] &= ~(1<<bit);
-                } else {
-                    warn("[%u:%u]Error marking block as used. It is already marked.\n", byte, bit);
-                }
-            } else { // write 1
-                if(stats->actPartitionBitmap[byte] & (1<<bit)) {
-                    warn("[%u:%u]Error marking block as unused. It is already unmarked.\n", byte, bit);
-                } else {
-                    stats->actPartitionBitmap[byte] |= 1<<bit;
-                }
-            }
-            lbn++;
-            i++;
-        } while(i < (int)size);
-        dbg("Last LBN: %u, Byte: %u, Bit: %u\n", lbn, byte, bit);
-        dbg("Real size: %d\n", i);
+        // Under memory limit marks outside of current window are applied when it is rebuilt
+        uint32_t windowLbn = lbn;
+        uint32_t windowSize = page_bitmap_clip(stats->actPartitionBitmap, &windowLbn, size);
+        if(page_bitmap_record(stats->actPartitionBitmap, lbn, size, mark ? 0 : 1) != 0
+           || (windowSize > 0 && apply_mark(stats->actPartitionBitmap, windowLbn, windowSize, mark, 1) != 0)) {
+            err("MARKING USED BLOCK TO BITMAP FAILED\n");
+            return -1;
+        }
+        dbg("Last LBN: %u, Byte: %u, Bit: %u\n", end, (end - 1) / 8, (end - 1) % 8);
+        dbg("Real size: %u\n", size);
 
 #if 0   // For debug purposes only
         note("\n ACT \t EXP\n");
@@ -1437,18 +1646,16 @@ uint8_t get_fsd(udf_media_t *media,
                 struct filesystemStats * stats, vds_sequence_t *seq) {
     long_ad *lap;
     int vds = -1;
-    uint32_t offset = 0, chunk = 0;
-    uint32_t chunksize = CHUNK_SIZE;
     uint64_t position = 0;
 
     if((vds=get_correct(seq, TAG_IDENT_PD)) < 0) {
         err("No correct PD found. Aborting.\n");
         return ESTATUS_UNCORRECTED_ERRORS;
     }
-    dbg("PD partNum: %u\n", media->disc.udf_pd[vds]->partitionNumber);
+    dbg("PD partNum: %u\n", le16_to_cpu(media->disc.udf_pd[vds]->partitionNumber));
     uint32_t lbnlsn = 0;
-    lbnlsn = media->disc.udf_pd[vds]->partitionStartingLocation;
-    dbg("Partition Length: %u\n", media->disc.udf_pd[vds]->partitionLength);
+    lbnlsn = le32_to_cpu(media->disc.udf_pd[vds]->partitionStartingLocation);
+    dbg("Partition Length: %u\n", le32_to_cpu(media->disc.udf_pd[vds]->partitionLength));
 
     dbg("LBN 0: LSN %u\n", lbnlsn);
 
@@ -1466,32 +1673,27 @@ uint8_t get_fsd(udf_media_t *media,
     leRecordedUDFRevision = *(const uint16_t*) media->disc.udf_iuvd[vds]->impIdent.identSuffix;
     update_min_udf_revision(stats, le16_to_cpu(leRecordedUDFRevision));
 
-    lap = (long_ad *)media->disc.udf_lvd[vds]->logicalVolContentsUse; //FIXME BIG_ENDIAN use lela_to_cpu, but not on ptr to disc. Must store it on different place.
-    lb_addr filesetblock = lap->extLocation;
+    lap = (long_ad *)media->disc.udf_lvd[vds]->logicalVolContentsUse;
+    uint32_t filesetlbn = udf_lad_block(lap);
 
-    uint32_t filesetlen = lap->extLength & 0x3FFFFFFF;
+    uint32_t filesetlen = udf_lad_length(lap);
 
-    dbg("FSD at (%u, p%u)\n",
-            lap->extLocation.logicalBlockNum,
-            lap->extLocation.partitionReferenceNum);
+    dbg("FSD at (%u, p%u)\n", filesetlbn, udf_lad_partition(lap));
 
-    dbg("LAP: length: %x, LBN: %x, PRN: %x\n", filesetlen, filesetblock.logicalBlockNum, filesetblock.partitionReferenceNum);
-    dbg("LAP: LSN: %u\n", lbnlsn/*+filesetblock.logicalBlockNum*/);
+    dbg("LAP: length: %x, LBN: %x, PRN: %x\n", filesetlen, filesetlbn, udf_lad_partition(lap));
+    dbg("LAP: LSN: %u\n", lbnlsn/*+filesetlbn*/);
 
-    position = (lbnlsn + filesetblock.logicalBlockNum) * stats->blocksize;
-    chunk  = (uint32_t)(position / chunksize);
-    offset = (uint32_t)(position % chunksize);
-    map_chunk(media, chunk, __FILE__, __LINE__);
+    position = (lbnlsn + filesetlbn) * stats->blocksize;
 
-    media->disc.udf_fsd = malloc(sizeof(struct fileSetDesc));
-    memcpy(media->disc.udf_fsd, media->mapping[chunk]+offset, sizeof(struct fileSetDesc));
+    media->disc.udf_fsd = view_descriptor(media, position, sizeof(struct fileSetDesc));
 
-    if (le16_to_cpu(media->disc.udf_fsd->descTag.tagIdent) != TAG_IDENT_FSD) {
-        err("Error identifying FSD. Tag ID: 0x%x\n", media->disc.udf_fsd->descTag.tagIdent);
-        free(media->disc.udf_fsd);
-        unmap_chunk(media, chunk);
+    if (udf_tag_ident(&media->disc.udf_fsd->descTag) != TAG_IDENT_FSD) {
+        err("Error identifying FSD. Tag ID: 0x%x\n", udf_tag_ident(&media->disc.udf_fsd->descTag));
+        release_descriptor(media, media->disc.udf_fsd);
+        media->disc.udf_fsd = NULL;
         return ESTATUS_OPERATIONAL_ERROR;
     }
+    report_desc(TAG_IDENT_FSD);
 
     leRecordedUDFRevision = *(const uint16_t*) media->disc.udf_fsd->domainIdent.identSuffix;
     update_min_udf_revision(stats, le16_to_cpu(leRecordedUDFRevision));
@@ -1516,18 +1718,16 @@ uint8_t get_fsd(udf_media_t *media,
         }
     }
 
-    increment_used_space(stats, filesetlen, lap->extLocation.logicalBlockNum);
+    increment_used_space(stats, filesetlen, filesetlbn);
 
     stats->lbnlsn = lbnlsn;
 
-    unmap_chunk(media, chunk);
-
     stats->dstringFSDLogVolIdentErr        = check_dstring(media->disc.udf_fsd->logicalVolIdent,   128);
     stats->dstringFSDFileSetIdentErr       = check_dstring(media->disc.udf_fsd->fileSetIdent,       32);
     stats->dstringFSDCopyrightFileIdentErr = check_dstring(media->disc.udf_fsd->copyrightFileIdent, 32);
     stats->dstringFSDAbstractFileIdentErr  = check_dstring(media->disc.udf_fsd->abstractFileIdent,  32);
 
-    dbg("Stream Length: %u\n", media->disc.udf_fsd->streamDirectoryICB.extLength & 0x3FFFFFFF);
+    dbg("Stream Length: %u\n", udf_lad_length(&media->disc.udf_fsd->streamDirectoryICB));
 
 #if HEXPRINT
     print_hex_array(media->disc.udf_fsd, sizeof(struct fileSetDesc));
@@ -1537,48 +1737,130 @@ uint8_t get_fsd(udf_media_t *media,
 }
 
 /**
- * \brief Inspect AED and append its allocation descriptors to an expanded version
- * of the specified array.
+ * \brief Decode allocation descriptor of any type into extent
+ *
+ * \param[in]  *ad      allocation descriptor
+ * \param[in]  icb_ad   type of AD
+ * \param[out] *ext     decoded extent
+ */
+static void decode_ad(const uint8_t *ad, uint16_t icb_ad, struct ad_extent *ext) {
+    const short_ad *sad;
+    const long_ad *lad;
+    const ext_ad *ead;
+
+    switch(icb_ad) {
+        case ICBTAG_FLAG_AD_SHORT:
+            sad = (const short_ad *)ad;
+            ext->type   = udf_sad_type(sad);
+            ext->length = udf_sad_length(sad);
+            ext->lbn    = udf_sad_position(sad);
+            break;
+
+        case ICBTAG_FLAG_AD_LONG:
+            lad = (const long_ad *)ad;
+            ext->type   = udf_lad_type(lad);
+            ext->length = udf_lad_length(lad);
+            ext->lbn    = udf_lad_block(lad);
+            break;
+
+        default:
+            ead = (const ext_ad *)ad;
+            ext->type   = udf_ead_type(ead);
+            ext->length = udf_ead_length(ead);
+            ext->lbn    = udf_ead_block(ead);
+            break;
+    }
+}
+
+/**
+ * \brief Make room for \p n more extents in list
+ *
+ * Capacity at least doubles, so collecting long AED chains copies every extent
+ * only a constant number of times.
+ *
+ * \return 0 on success, -1 if allocation failed
+ */
+static int reserve_extents(struct extent_list *list, uint32_t n) {
+    struct ad_extent *ext;
+    uint32_t capacity = list->capacity;
+
+    if (list->count + n <= capacity)
+        return 0;
+    while (capacity < list->count + n)
+        capacity *= 2;
+
+    if (list->ext == list->inlineExt) {
+        ext = malloc(capacity * sizeof(struct ad_extent));
+        if (ext)
+            memcpy(ext, list->ext, list->count * sizeof(struct ad_extent));
+    } else {
+        ext = realloc(list->ext, capacity * sizeof(struct ad_extent));
+    }
+    if (!ext)
+        return -1;
+    list->ext = ext;
+    list->capacity = capacity;
+    return 0;
+}
+
+/**
+ * \brief Release extents collected by collect_extents()
+ */
+static void free_extents(struct extent_list *list) {
+    if (list->ext != list->inlineExt)
+        free(list->ext);
+    list->ext = list->inlineExt;
+    list->count = 0;
+    list->capacity = EXTENT_LIST_INLINE;
+}
+
+/**
+ * \brief Inspect AED and return its allocation descriptors
+ *
+ * Chunk with the AED stays mapped on success, so descriptors are decoded in place.
  *
  * \param[in]      media            Information regarding medium & access to it
  * \param[in]      aedlbn           LBN of AED
- * \param[in,out]  *lengthADArray   size of allocation descriptor array ADArray
- * \param[in,out]  **ADAarray       allocation descriptors array itself (heap memory)
+ * \param[out]     **ads            allocation descriptors of AED in mapped chunk
+ * \param[out]     *length          length of \p ads in bytes
+ * \param[out]     *chunk           mapped chunk, to be unmapped by caller
  * \param[in]      *stats           file system status
  * \param[out]     status           error status
  *
- * \return 0 -- AED found and ADArray is set
- * \return 2 -- Heap allocation failed
+ * \return 0 -- AED found and ads are set
  * \return 4 -- AED not found
  * \return 4 -- checksum failed
  * \return 4 -- CRC failed
+ * \return 4 -- allocation descriptors do not fit into block
  */
-static uint8_t inspect_aed(udf_media_t *media,
-                           uint32_t aedlbn, uint32_t *lengthADArray, uint8_t **ADArray,
+static uint8_t inspect_aed(udf_media_t *media, uint32_t aedlbn,
+                           const uint8_t **ads, uint32_t *length, uint32_t *chunk,
                            struct filesystemStats *stats, uint8_t *status) {
-    uint32_t lad = 0;
-    uint32_t offset = 0, chunk = 0, chunksize = CHUNK_SIZE;
+    uint32_t offset = 0, chunksize = media->chunksize;
     uint64_t position;
 
     position = (stats->lbnlsn + aedlbn) * stats->blocksize;
-    chunk  = (uint32_t) (position / chunksize);
+    *chunk = (uint32_t) (position / chunksize);
     offset = (uint32_t) (position % chunksize);
-    dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
-    map_chunk(media, chunk, __FILE__, __LINE__);
+    dbg("Chunk: %u, offset: 0x%x\n", *chunk, offset);
+    map_chunk(media, *chunk, __FILE__, __LINE__);
 
-    struct allocExtDesc *aed = (struct allocExtDesc *)(media->mapping[chunk]+offset);
-    if(aed->descTag.tagIdent == TAG_IDENT_AED) {
+    struct allocExtDesc *aed = (struct allocExtDesc *)(media->mapping[*chunk]+offset);
+    if(udf_tag_ident(&aed->descTag) == TAG_IDENT_AED) {
+        report_desc(TAG_IDENT_AED);
         //checksum
         if(!checksum(aed->descTag)) {
             err("AED checksum failed\n");
             *status |= ESTATUS_UNCORRECTED_ERRORS;
+            unmap_chunk(media, *chunk);
             return 4;
         }
 
         //CRC
-        if(crc(aed, aed->descTag.descCRCLength + sizeof(tag))) {
+        if(crc(aed, udf_tag_crc_length(&aed->descTag) + sizeof(tag))) {
             err("AED CRC failed\n");
             *status |= ESTATUS_UNCORRECTED_ERRORS;
+            unmap_chunk(media, *chunk);
             return 4;
         }
 
@@ -1588,52 +1870,43 @@ static uint8_t inspect_aed(udf_media_t *media,
             *status |= ESTATUS_UNCORRECTED_ERRORS;
         }
 
-        uint32_t L_AD = aed->lengthAllocDescs;
-        uint8_t *newADArray = realloc(*ADArray, *lengthADArray + L_AD);
-        if (!newADArray) {
-            err("AED realloc failed\n");
-            return 2;
-        }
-        memcpy(newADArray + *lengthADArray, (uint8_t *)(aed)+sizeof(struct allocExtDesc), L_AD);
-        *ADArray = newADArray;
-        *lengthADArray += L_AD;
-#if 0  //For debug purposes only
-        uint32_t line = 0;
-        dbg("AED Array\n");
-        for(int i=0; i<*lengthADArray; ) {
-            note("[%04u] ",line++);
-            for(int j=0; j<8; j++, i++) {
-                note("%02x ", (*ADArray)[i]);
-            }
-            note("\n");
+        uint32_t L_AD = le32_to_cpu(aed->lengthAllocDescs);
+        if(L_AD > stats->blocksize - sizeof(struct allocExtDesc)) {
+            err("AED allocation descriptors do not fit into block\n");
+            *status |= ESTATUS_UNCORRECTED_ERRORS;
+            unmap_chunk(media, *chunk);
+            return 4;
         }
-#endif
-#ifdef MEMTRACE
-        dbg("ADArray ptr: %p\n", *ADArray);
-#endif
-        dbg("lengthADArray: %u\n", *lengthADArray);
+        *ads = (const uint8_t *)aed + sizeof(struct allocExtDesc);
+        *length = L_AD;
+        dbg("AED lengthAllocDescs: %u\n", L_AD);
         increment_used_space(stats, stats->blocksize, aedlbn);
         return 0;
     } else {
         err("Expected AED in LSN %u, but did not find one.\n", stats->lbnlsn + aedlbn);
     }
+    unmap_chunk(media, *chunk);
     return 4;
 }
 
 /**
- * \brief Collect all extents for an ICB into a contiguous heap-allocated array.
+ * \brief Collect all extents for an ICB into a list of decoded extents.
  *
  * Note, as part of the collection process, any "chain" extents marked
- * EXT_NEXT_EXTENT_ALLOCDECS are followed but are collapsed out of the array
- * returned to the caller.
+ * EXT_NEXT_EXTENT_ALLOCDECS are followed but are collapsed out of the list
+ * returned to the caller. Descriptors after zero length terminator are kept,
+ * but chains are not followed past it.
+ *
+ * Chained AED is a linked list, so the next AED is known only after the
+ * current one is read. It is requested ahead while the current AED is decoded.
  *
  * \param[in]   media              Information regarding medium & access to it
  * \param[in]   *feAllocDescs      allocation descriptors for the directory contents, in FE/EFE
  *                                 This is a pointer to memory mapped directly from the device
  * \param[in]   lengthAllocDescs   length of feAllocDescs area in bytes
  * \param[in]   icb_ad             type of AD
- * \param[out]  *ADArray           heap-allocated memory containing all ADs for the ICB (including those in chained AEDs)
- * \param[out]  *nAD               number of ADs stored at *ADArray
+ * \param[out]  *list              extents of the ICB (including those in chained AEDs),
+ *                                 must be released by free_extents() also on error
  * \param[in]   *stats             file system status
  * \param[out]   *status           run status
  *
@@ -1644,11 +1917,15 @@ static uint8_t inspect_aed(udf_media_t *media,
  */
 static uint8_t collect_extents(udf_media_t *media,
                                const uint8_t *feAllocDescs, uint32_t lengthAllocDescs,
-                               uint16_t icb_ad, uint8_t **ADArray, int *nAD,
+                               uint16_t icb_ad, struct extent_list *list,
                                struct filesystemStats *stats, uint8_t *status)
 {
     uint32_t descSize = 0;
 
+    list->ext = list->inlineExt;
+    list->count = 0;
+    list->capacity = EXTENT_LIST_INLINE;
+
     switch(icb_ad) {
         case ICBTAG_FLAG_AD_SHORT:
             dbg("Short AD\n");
@@ -1668,76 +1945,168 @@ static uint8_t collect_extents(udf_media_t *media,
     }
     dbg("LengthOfAllocDescs: %u\n", lengthAllocDescs);
 
+    const uint8_t *ads = feAllocDescs;
+    uint32_t length = lengthAllocDescs;
+    uint32_t chunk = 0;
+    int terminated = 0;
 
-    // Collect all of the ICB's allocation descriptors into a single array
-    uint32_t lengthADArray = lengthAllocDescs;
-    *ADArray = malloc(lengthAllocDescs);
+    for (;;) {
+        uint32_t nAD = length / descSize;
+        struct ad_extent chain = {0};
 
-    if (!*ADArray) {
-        err("AD allocation failed.\n");
-        *nAD = 0;
-        return 2;
-    }
+        if (reserve_extents(list, nAD)) {
+            err("AD allocation failed.\n");
+            if (ads != feAllocDescs)
+                unmap_chunk(media, chunk);
+            return 2;
+        }
 
-    memcpy(*ADArray, feAllocDescs, lengthAllocDescs);
-    *nAD = lengthAllocDescs / descSize;
+        for (uint32_t i = 0; i < nAD; i++) {
+            struct ad_extent *ext = &list->ext[list->count];
 
-    for(int i = 0; i < *nAD; i++) {
-        uint32_t aedlbn = 0;
-        short_ad *sad = (short_ad *)(*ADArray + i*descSize); //we can do that, because all ADs have size as first.
+            decode_ad(ads + i*descSize, icb_ad, ext);
+            dbg("ExtLength: %u, type: %u\n", ext->length, ext->type);
+            // ECMA 167r3 sec. 12: AD with zero extent length terminates the sequence
+            if (!ext->length)
+                terminated = 1;
+            if (!terminated && ext->type == 3) {
+                // Extent is AED, request it before the rest is decoded
+                chain = *ext;
+                prefetch_blocks(media, stats, stats->lbnlsn + chain.lbn, 1);
+                continue;
+            }
+            list->count++;
+        }
+        if (ads != feAllocDescs)
+            unmap_chunk(media, chunk);
 
-        // ECMA 167r3 sec. 12: AD with zero extent length terminates the sequence
-        if (!(sad->extLength & 0x3FFFFFFF)) {
-            // @todo Something if i != (nAD - 1).
-            // Not so easy with current implementation because we've tossed the lbn (AED or FE or EFE)
-            // (easy enough to fix) and don't have the nAD from that block
+        if (!chain.length || terminated)
             break;
+        if (inspect_aed(media, chain.lbn, &ads, &length, &chunk, stats, status)) {
+            err("AED inspection failed.\n");
+            return 255;
         }
-        uint32_t extType = sad->extLength >> 30;
-        dbg("ExtLength: %u, type: %u\n", sad->extLength & 0x3FFFFFFF, extType);
-        if(extType == 3) { //Extent is AED
-            long_ad *lad;
-            ext_ad *ead;
-            switch(icb_ad) {
-                case ICBTAG_FLAG_AD_SHORT:
-                    //we already have sad
-                    aedlbn = sad->extPosition;
-                    break;
-                case ICBTAG_FLAG_AD_LONG:
-                    lad = (long_ad *)(*ADArray + i*descSize);
-                    aedlbn = lad->extLocation.logicalBlockNum;
-                    break;
-                case ICBTAG_FLAG_AD_EXTENDED:
-                    ead = (ext_ad *)(*ADArray + i*descSize);
-                    aedlbn = ead->extLocation.logicalBlockNum;
-                    break;
-            }
-            // Erase the chain entry just in case the chained AED has zero entries
-            memset(*ADArray + i*descSize, 0, descSize);
+    }
+    dbg("Collected extents: %u\n", list->count);
+
+    return 0;
+}
 
-            lengthADArray -= descSize;  // Force this (chain) entry to be overwritten
-            if (inspect_aed(media, aedlbn, &lengthADArray, ADArray, stats, status)) {
-                err("AED inspection failed.\n");
-                return 255;
+/**
+ * \brief Copy part of directory contents between buffer and medium
+ *
+ * Not recorded extents are read as zeros and skipped when writing.
+ *
+ * \param[in]     media    Information regarding medium & access to it
+ * \param[in]     *stats   file system status
+ * \param[in]     *list    extents of directory
+ * \param[in]     start    position in directory contents
+ * \param[in,out] *buf     buffer of \p length bytes
+ * \param[in]     length   bytes to copy
+ * \param[in]     write    0 to read contents into \p buf, otherwise write \p buf to medium
+ */
+static void copy_dir_contents(udf_media_t *media, struct filesystemStats *stats,
+                              const struct extent_list *list,
+                              uint64_t start, uint8_t *buf, uint32_t length, int write) {
+    uint64_t extStart = 0;
+    uint64_t end = start + length;
+    uint32_t chunksize = media->chunksize;
+
+    for(uint32_t i = 0; i < list->count && extStart < end; i++) {
+        const struct ad_extent *ext = &list->ext[i];
+        uint64_t first = MAX(start, extStart);
+        uint64_t last = MIN(end, extStart + ext->length);
+        if(first < last) {
+            uint8_t *p = buf + (first - start);
+
+            if(ext->type == 0) {
+                // Allocated and Recorded
+                // Directory can span more blocks, so it can cross chunk boundary
+                uint64_t position = (stats->lbnlsn + ext->lbn) * stats->blocksize + (first - extStart);
+                for(uint64_t done = 0; done < last - first; ) {
+                    uint32_t chunk  = (uint32_t)((position + done) / chunksize);
+                    uint32_t offset = (uint32_t)((position + done) % chunksize);
+                    uint32_t n = (uint32_t)MIN(last - first - done, chunksize - offset);
+                    dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
+                    map_chunk(media, chunk, __FILE__, __LINE__);
+                    if(write)
+                        memcpy(media->mapping[chunk] + offset, p + done, n);
+                    else
+                        memcpy(p + done, media->mapping[chunk] + offset, n);
+                    unmap_chunk(media, chunk);
+                    done += n;
+                }
+            } else if(!write) {
+                // Not recorded
+                memset(p, 0, last - first);
             }
+        }
+        extStart += ext->length;
+    }
+}
+
+static int cmp_range(const void *a, const void *b) {
+    uint32_t la = ((const uint32_t *)a)[0], lb = ((const uint32_t *)b)[0];
+    return la < lb ? -1 : la > lb;
+}
+
+/**
+ * \brief Request recorded blocks of part of directory contents in block order
+ *
+ * Fragmented directory is read extent by extent in logical order, requests
+ * sorted by position let the kernel read them in one sweep while previous
+ * window is inspected.
+ *
+ * \param[in]     media    Information regarding medium & access to it
+ * \param[in]     *stats   file system status
+ * \param[in]     *list    extents of directory
+ * \param[in]     start    position in directory contents
+ * \param[in]     length   bytes to be read
+ */
+static void prefetch_dir_contents(udf_media_t *media, struct filesystemStats *stats,
+                                  const struct extent_list *list, uint64_t start, uint64_t length) {
+    uint32_t (*ranges)[2];
+    uint32_t n = 0;
+    uint64_t extStart = 0;
+    uint64_t end = start + length;
+
+    // Contiguous directory is read ahead by the kernel anyway
+    if (list->count < 2 || length == 0)
+        return;
+    ranges = malloc(list->count * sizeof(*ranges));
+    if (ranges == NULL)
+        return;
 
-            *nAD = (lengthADArray / descSize);
+    for (uint32_t i = 0; i < list->count && extStart < end; i++) {
+        const struct ad_extent *ext = &list->ext[i];
+        uint64_t first = MAX(start, extStart);
+        uint64_t last = MIN(end, extStart + ext->length);
 
-            // Force rescan of the current ADArray entry.
-            // It has changed from a chain to the next AED
-            // to the first AD in that next AED.
-            --i;
-        }  // AED extent
+        if (first < last && ext->type == 0) {
+            ranges[n][0] = ext->lbn + (uint32_t)((first - extStart) / stats->blocksize);
+            ranges[n][1] = ext->lbn + (uint32_t)((last - extStart + stats->blocksize - 1) / stats->blocksize);
+            n++;
+        }
+        extStart += ext->length;
     }
 
-    return 0;
+    qsort(ranges, n, sizeof(*ranges), cmp_range);
+    for (uint32_t i = 0; i < n; ) {
+        uint32_t from = ranges[i][0], to = ranges[i][1];
+        for (i++; i < n && ranges[i][0] <= to; i++)
+            to = MAX(to, ranges[i][1]);
+        prefetch_blocks(media, stats, stats->lbnlsn + from, to - from);
+    }
+    free(ranges);
 }
 
 /**
  * \brief Parse the contents of a directory given the allocation descriptors within its FE/EFE.
  *
  * Note, the contents can be split across extents, even in the middle of a file information descriptor.
- * This function creates a virtual linear area for further processing.
+ * Contents are read into a linear buffer of at most DIR_WINDOW bytes plus one FID at once. FIDs which
+ * start in the first DIR_WINDOW bytes of buffer are inspected, the rest of buffer is kept for the next read.
+ * Buffer is written back when FIDs were fixed.
  *
  * This function internally calls inspect_fid().
  *
@@ -1762,183 +2131,141 @@ static uint8_t walk_directory(udf_media_t *media,
                               struct filesystemStats *stats, uint32_t depth, vds_sequence_t *seq,
                               uint8_t *status) {
 
-    uint32_t descSize = 0;
     uint8_t *dirContent = NULL;
-    int nAD = 0;
     uint64_t dirContentLen = 0;
-    short_ad *sad = NULL;
-    long_ad *lad = NULL;
-    ext_ad *ead = NULL;
-    uint32_t offset = 0, chunk = 0, chunksize = CHUNK_SIZE;
-    uint64_t position = 0;
+    struct extent_list list;
 
-    uint32_t lengthADArray = 0;
-    uint8_t *ADArray = NULL;
-
-    // Collect all of the ICB's allocation descriptors into a single array
+    // Collect all of the ICB's allocation descriptors into a single list
     int extentErr = collect_extents(media, allocDescs, lengthAllocDescs, icb_ad,
-                                    &ADArray, &nAD, stats, status);
+                                    &list, stats, status);
     if (extentErr) {
-        free(ADArray);
+        free_extents(&list);
         return extentErr;
     }
 
     switch(icb_ad) {
         case ICBTAG_FLAG_AD_SHORT:
             dbg("Short AD\n");
-            descSize = sizeof(short_ad);
             break;
         case ICBTAG_FLAG_AD_LONG:
             dbg("Long AD\n");
-            descSize = sizeof(long_ad);
             break;
         case ICBTAG_FLAG_AD_EXTENDED:
             dbg("Extended AD\n");
-            descSize = sizeof(ext_ad);
             break;
         default:
             err("[walk_directory] Unsupported icb_ad: 0x%04x\n", icb_ad);
-            free(ADArray);
+            free_extents(&list);
             return 1;
     }
 
-    for(int i = 0; i < nAD; i++) {
-        sad = (short_ad *)(ADArray + i*descSize); //we can do that, because all ADs have size as first.
-
-        dirContentLen += sad->extLength & 0x3FFFFFFF;
-    }
+    for(uint32_t i = 0; i < list.count; i++)
+        dirContentLen += list.ext[i].length;
 
     dbg("Dir content length: %u\n", dirContentLen);
-    dbg("nAD: %u\n", nAD);
-
-    // Now read the entire directory contents into a contiguous array
+    dbg("nAD: %u\n", list.count);
 
-    dirContent = calloc(1, dirContentLen);
+    uint32_t bufSize = (uint32_t)MIN(dirContentLen, DIR_WINDOW + FID_MAX_LENGTH);
+    dirContent = calloc(1, bufSize);
     if(dirContent == NULL) {
         err("Dir content allocation failed.\n");
-        free(ADArray);
+        free_extents(&list);
         return 2;
     }
 
-    uint32_t prevExtLength = 0;
-    for(int i = 0; i < nAD; i++) {
-        uint32_t extStartLBN;
-        uint32_t extType;
-        uint32_t extLength;
-        switch(icb_ad) {
-            case ICBTAG_FLAG_AD_SHORT:
-                sad = (short_ad *)(ADArray + i*descSize);
-                extType     = sad->extLength >> 30;
-                extLength   = sad->extLength & 0x3FFFFFFF;
-                extStartLBN = sad->extPosition;
-                break;
-
-            case ICBTAG_FLAG_AD_LONG:
-                lad = (long_ad *)(ADArray + i*descSize);
-                extType     = lad->extLength >> 30;
-                extLength   = lad->extLength & 0x3FFFFFFF;
-                extStartLBN = lad->extLocation.logicalBlockNum;
-                break;
+    for(uint32_t i = 0; i < list.count; i++) {
+        if (list.ext[i].type != 2) {
+            // Allocated, whole extent and at least one block
+            increment_used_space(stats, list.ext[i].length ? list.ext[i].length : 1, list.ext[i].lbn);
+        }
+    }
 
-            case ICBTAG_FLAG_AD_EXTENDED:
-                ead = (ext_ad *)(ADArray + i*descSize);
-                extType     = ead->extLength >> 30;
-                extLength   = ead->extLength & 0x3FFFFFFF;
-                extStartLBN = ead->extLocation.logicalBlockNum;
-                break;
+    // Window of directory contents in dirContent
+    uint64_t bufStart = 0;
+    uint32_t bufLen = bufSize;
+    prefetch_dir_contents(media, stats, &list, 0, bufLen);
+    copy_dir_contents(media, stats, &list, 0, dirContent, bufLen, 0);
+    // Next window is read while this one is inspected
+    prefetch_dir_contents(media, stats, &list, bufLen, MIN(DIR_WINDOW, dirContentLen - bufLen));
 
-            default:
-                // @todo something
-                continue;
+    uint8_t tempStatus = 0;
+    uint8_t windowStatus = 0;
+    uint32_t counter = 0;
+    for(uint32_t pos = 0; pos < dirContentLen; ) {
+        uint64_t bufEnd = bufStart + bufLen;
+        // FID starting before limit is whole in the buffer
+        uint64_t limit = bufEnd == dirContentLen ? bufEnd : bufEnd - FID_MAX_LENGTH;
+        int over = 0;
+        struct prefetch pf;
+        uint32_t valid = validate_fids(dirContent + (pos - bufStart), (uint32_t)(limit - pos),
+                                       (uint32_t)(bufEnd - pos));
+
+        prefetch_init(&pf, media, stats, dirContent + (pos - bufStart), (uint32_t)(bufEnd - pos));
+        for(uint32_t index = 0; pos < limit; index++) {
+            dbg("FID #%u\n", counter++);
+            prefetch_advance(&pf, media, stats, index);
+            if (inspect_fid(media, lsn, dirContent, (uint32_t)bufStart, &pos, index < valid,
+                            stats, depth+1, seq, &windowStatus) != 0) {
+                dbg("1 FID inspection over.\n");
+                over = 1;
                 break;
+            }
         }
+        prefetch_free(&pf);
+        if(over || bufEnd == dirContentLen)
+            break;
 
-        if (extType == 0) {
-            // Allocated and Recorded
-            position = (stats->lbnlsn + extStartLBN) * stats->blocksize;
-            chunk  = (uint32_t)(position / chunksize);
-            offset = (uint32_t)(position % chunksize);
-            dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
-            map_chunk(media, chunk, __FILE__, __LINE__);
+        if(windowStatus & ESTATUS_CORRECTED_ERRORS) // FID(s) were fixed - write window back out
+            copy_dir_contents(media, stats, &list, bufStart, dirContent, bufLen, 1);
+        tempStatus |= windowStatus;
+        windowStatus = 0;
 
-            memcpy(dirContent+prevExtLength, (uint8_t *)(media->mapping[chunk] + offset), extLength);
-        } else {
-            // Not recorded
-            memset(dirContent+prevExtLength, 0, extLength);
-        }
-        if (extType != 2) {
-            // Allocated
-            increment_used_space(stats, 1, extStartLBN);
-        }
-        prevExtLength += extLength;
+        // Keep beginning of the next FID, read rest of the window
+        uint32_t keep = (uint32_t)(bufEnd - pos);
+        memmove(dirContent, dirContent + (pos - bufStart), keep);
+        bufStart = pos;
+        bufLen = (uint32_t)MIN(bufSize, dirContentLen - bufStart);
+        copy_dir_contents(media, stats, &list, bufEnd, dirContent + keep, bufLen - keep, 0);
+        prefetch_dir_contents(media, stats, &list, bufStart + bufLen,
+                              MIN(DIR_WINDOW, dirContentLen - (bufStart + bufLen)));
     }
-
-    uint8_t tempStatus = 0;
-    int counter = 0;
-    for(uint32_t pos=0; pos < dirContentLen; ) {
-        dbg("FID #%d\n", counter++);
-        if (inspect_fid(media, lsn, dirContent, &pos, stats, depth+1, seq, &tempStatus) != 0) {
-            dbg("1 FID inspection over.\n");
-            break;
-        }
-    } 
     dbg("2 FID inspection over.\n");
 
-    if(tempStatus & ESTATUS_CORRECTED_ERRORS) { // FID(s) were fixed - write dirContent back out
-        prevExtLength = 0;
-        for(int i = 0; i < nAD; i++) {
-            uint32_t extStartLBN;
-            uint32_t extType;
-            uint32_t extLength;
-            switch(icb_ad) {
-                case ICBTAG_FLAG_AD_SHORT:
-                    sad = (short_ad *)(ADArray + i*descSize);
-                    extType     = sad->extLength >> 30;
-                    extLength   = sad->extLength & 0x3FFFFFFF;
-                    extStartLBN = sad->extPosition;
-                    break;
-
-                case ICBTAG_FLAG_AD_LONG:
-                    lad = (long_ad *)(ADArray + i*descSize);
-                    extType     = lad->extLength >> 30;
-                    extLength   = lad->extLength & 0x3FFFFFFF;
-                    extStartLBN = lad->extLocation.logicalBlockNum;
-                    break;
-
-                case ICBTAG_FLAG_AD_EXTENDED:
-                    ead = (ext_ad *)(ADArray + i*descSize);
-                    extType     = ead->extLength >> 30;
-                    extLength   = ead->extLength & 0x3FFFFFFF;
-                    extStartLBN = ead->extLocation.logicalBlockNum;
-                    break;
-            }
-
-            if (extType == 0) {
-                // Allocated and Recorded
-                position = (stats->lbnlsn + extStartLBN) * stats->blocksize;
-                chunk  = (uint32_t)(position / chunksize);
-                offset = (uint32_t)(position % chunksize);
-                dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
-                map_chunk(media, chunk, __FILE__, __LINE__);
-
-                memcpy(media->mapping[chunk] + offset, dirContent + prevExtLength, extLength);
-            }
-            // else @todo, depends how unrecorded extents were handled earlier
-
-            prevExtLength += extLength;
-        }   // for each extent of directory contents
-
+    if(windowStatus & ESTATUS_CORRECTED_ERRORS) { // FID(s) were fixed - write dirContent back out
+        copy_dir_contents(media, stats, &list, bufStart, dirContent, bufLen, 1);
         dbg("3 directory copyback done.\n");
-    }  // if directory contents need writeback
-
+    }
+    tempStatus |= windowStatus;
 
     //free arrays
     free(dirContent);
-    free(ADArray);
+    free_extents(&list);
     (*status) |= tempStatus;
     return 0;
 }
 
+/**
+ * \brief Account file verified by previous check from its check journal record
+ *
+ * Blocks of the file are marked and counted the same way get_file() would do it.
+ *
+ * \param[in,out]  *stats    file system status
+ * \param[in]      *file     journal record of the file
+ */
+static void replay_journal_file(struct filesystemStats *stats, const struct journal_file *file) {
+    struct check_journal *journal = stats->journal;
+
+    for (uint16_t i = 0; i < file->numExtents; ++i) {
+        const struct journal_extent *ext = &journal->extents[file->firstExtent + i];
+        increment_used_space(stats, (uint64_t)ext->blocks * stats->blocksize, ext->lbn);
+    }
+    if (file->flags & JOURNAL_FILE_COUNTED)
+        stats->found.numFiles++;
+    if (file->flags & JOURNAL_FILE_EFE)
+        update_min_udf_revision(stats, 0x0200);
+    journal_keep_file(journal, file);
+}
+
 /**
  * \brief FID parsing function
  *
@@ -1950,7 +2277,9 @@ static uint8_t walk_directory(udf_media_t *media,
  * \param[in]     media     Information regarding medium & access to it
  * \param[in]     lsn       actual LSN
  * \param[in]     *base     base pointer for for FID area
+ * \param[in]     start     position of \p base in FID area
  * \param[in,out] *pos      actual position in FID area
+ * \param[in]     valid     FID tag and CRC were verified by validate_fids()
  * \param[in]     *stats    file system status
  * \param[in]     depth     depth of FE for printing
  * \param[in]     *seq      VDS sequence
@@ -1962,43 +2291,44 @@ static uint8_t walk_directory(udf_media_t *media,
  * \return 251 -- FID CRC failed
  */
 uint8_t inspect_fid(udf_media_t *media,
-                    uint32_t lsn, uint8_t *base, uint32_t *pos,
+                    uint32_t lsn, uint8_t *base, uint32_t start, uint32_t *pos, int valid,
                     struct filesystemStats *stats, uint32_t depth, vds_sequence_t *seq,
                     uint8_t *status) {
     uint32_t flen, padding;
-    struct fileIdentDesc *fid = (struct fileIdentDesc *)(base + *pos);
+    struct fileIdentDesc *fid = (struct fileIdentDesc *)(base + (*pos - start));
     struct fileInfo info;
     memset(&info, 0, sizeof(struct fileInfo));
     uint32_t offset = 0, chunk = 0;
     uint64_t position = 0;
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
 
     dbg("FID pos: 0x%x\n", *pos);
-    if (!checksum(fid->descTag)) {
+    if (!valid && !checksum(fid->descTag)) {
         err("[inspect fid] FID checksum failed.\n");
         return -4;
         warn("DISABLED ERROR RETURN\n");
     }
-    if (le16_to_cpu(fid->descTag.tagIdent) == TAG_IDENT_FID) {
+    if (udf_tag_ident(&fid->descTag) == TAG_IDENT_FID) {
+        report_desc(TAG_IDENT_FID);
         dwarn("FID found (%u)\n",*pos);
-        flen = 38 + le16_to_cpu(fid->lengthOfImpUse) + fid->lengthFileIdent;
-        padding = 4 * ((le16_to_cpu(fid->lengthOfImpUse) + fid->lengthFileIdent + 38 + 3)/4) - (le16_to_cpu(fid->lengthOfImpUse) + fid->lengthFileIdent + 38);
+        flen = 38 + udf_fid_imp_use_length(fid) + fid->lengthFileIdent;
+        padding = udf_fid_length(fid) - flen;
 
-        dbg("lengthOfImpUse: %u\n", fid->lengthOfImpUse);
+        dbg("lengthOfImpUse: %u\n", udf_fid_imp_use_length(fid));
         dbg("flen+padding: %u\n", flen+padding);
-        if(crc(fid, flen + padding)) {
+        if(!valid && crc(fid, flen + padding)) {
             err("FID CRC failed.\n");
             return -5;
             warn("DISABLED ERROR RETURN\n");
         }
-        dbg("FID: ImpUseLen: %u\n", fid->lengthOfImpUse);
+        dbg("FID: ImpUseLen: %u\n", udf_fid_imp_use_length(fid));
         dbg("FID: FilenameLen: %u\n", fid->lengthFileIdent);
         if(fid->lengthFileIdent == 0) {
             dbg("ROOT directory\n");
         } else {
             char *namebuf = calloc(1,256*2);
             memset(namebuf, 0, 256*2);
-            uint8_t *fileIdent = fid->impUseAndFileIdent + fid->lengthOfImpUse;
+            const uint8_t *fileIdent = udf_fid_ident(fid);
             size_t size = decode_utf8(fileIdent, namebuf, fid->lengthFileIdent, 256*2);
             if(size == (size_t) - 1) { //Decoding failed
                 warn("Filename decoding failed."); //TODO add tests
@@ -2009,8 +2339,8 @@ uint8_t inspect_fid(udf_media_t *media,
             }
         }
 
-        dbg("Tag Serial Num: %u\n", fid->descTag.tagSerialNum);
-        if(stats->AVDPSerialNum != fid->descTag.tagSerialNum) {
+        dbg("Tag Serial Num: %u\n", udf_tag_serial(&fid->descTag));
+        if(stats->AVDPSerialNum != udf_tag_serial(&fid->descTag)) {
             err("(%s) Tag Serial Number differs.\n", info.filename);
             uint8_t fixsernum = autofix;
             if(interactive) {
@@ -2019,8 +2349,8 @@ uint8_t inspect_fid(udf_media_t *media,
                 }
             }
             if(fixsernum) {
-                fid->descTag.tagSerialNum = stats->AVDPSerialNum;
-                fid->descTag.descCRC = calculate_crc(fid, flen+padding);             
+                udf_tag_set_serial(&fid->descTag, stats->AVDPSerialNum);
+                udf_tag_set_crc(&fid->descTag, calculate_crc(fid, flen+padding));
                 fid->descTag.tagChecksum = calculate_checksum(fid->descTag);
 
                 position = lsn * stats->blocksize;
@@ -2031,44 +2361,46 @@ uint8_t inspect_fid(udf_media_t *media,
 
                 struct fileEntry *fe = (struct fileEntry *)(media->mapping[chunk] + offset);
                 struct extendedFileEntry *efe = (struct extendedFileEntry *)fe;
-                if(efe->descTag.tagIdent == TAG_IDENT_EFE) {
-                    efe->descTag.descCRC = calculate_crc(efe, sizeof(struct extendedFileEntry) + le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs));
+                if(udf_tag_ident(&efe->descTag) == TAG_IDENT_EFE) {
+                    udf_tag_set_crc(&efe->descTag, calculate_crc(efe, udf_efe_length(efe)));
                     efe->descTag.tagChecksum = calculate_checksum(efe->descTag);
                     dbg("[CHECKSUM] %"PRIx16"\n", efe->descTag.tagChecksum);
-                } else if(efe->descTag.tagIdent == TAG_IDENT_FE) {
-                    fe->descTag.descCRC = calculate_crc(fe, sizeof(struct fileEntry) + le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs));
+                } else if(udf_tag_ident(&efe->descTag) == TAG_IDENT_FE) {
+                    udf_tag_set_crc(&fe->descTag, calculate_crc(fe, udf_fe_length(fe)));
                     fe->descTag.tagChecksum = calculate_checksum(fe->descTag);
                     dbg("[CHECKSUM] %"PRIx16"\n", fe->descTag.tagChecksum);
                 } else {
                     err("(%s) FID parent FE not found.\n", info.filename);
                 }
                 imp("(%s) Tag Serial Number was fixed.\n", info.filename);
-                sync_chunk(media->mapping, chunk, media->devsize);
+                cache_sync(media, chunk);
+                unmap_chunk(media, chunk);
                 *status |= ESTATUS_CORRECTED_ERRORS;
             } else {
                 *status |= ESTATUS_UNCORRECTED_ERRORS;
             }
         }
 
-        dbg("FileVersionNum: %u\n", fid->fileVersionNum);
+        dbg("FileVersionNum: %u\n", udf_fid_version(fid));
 
         info.fileCharacteristics = fid->fileCharacteristics;
         if((fid->fileCharacteristics & FID_FILE_CHAR_DELETED) == 0) { //NOT deleted, continue
-            dbg("ICB: LSN: %u, length: %u\n", fid->icb.extLocation.logicalBlockNum + stats->lbnlsn,
-                fid->icb.extLength);
+            dbg("ICB: LSN: %u, length: %u\n", udf_lad_block(&fid->icb) + stats->lbnlsn,
+                le32_to_cpu(fid->icb.extLength));
             dbg("ROOT ICB: LSN: %u\n",
-                media->disc.udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum + stats->lbnlsn);
+                udf_lad_block(&media->disc.udf_fsd->rootDirectoryICB) + stats->lbnlsn);
 
             if(*pos == 0) {
                 dbg("Parent. Not Following this one\n");
-            } else if ((fid->icb.extLocation.logicalBlockNum + stats->lbnlsn) == lsn) {
+            } else if ((udf_lad_block(&fid->icb) + stats->lbnlsn) == lsn) {
                 dbg("Self. Not following this one\n");
-            } else if (   (fid->icb.extLocation.logicalBlockNum + stats->lbnlsn)
-                       == (media->disc.udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum + stats->lbnlsn)) {
+            } else if (   (udf_lad_block(&fid->icb) + stats->lbnlsn)
+                       == (udf_lad_block(&media->disc.udf_fsd->rootDirectoryICB) + stats->lbnlsn)) {
                 dbg("ROOT. Not following this one.\n");
             } else {
                 uint32_t uuid = 0;
                 memcpy(&uuid, (fid->icb).impUse+2, sizeof(uint32_t));
+                uuid = le32_to_cpu(uuid);
                 dbg("UUID: %u\n", uuid);
                 if(stats->found.nextUID <= uuid) {
                     stats->found.nextUID = uuid + 1;
@@ -2098,10 +2430,11 @@ uint8_t inspect_fid(udf_media_t *media,
                         stats->found.nextUID = uuid;
                         stats->lvid.nextUID++;
                         seq->lvid.error |= E_UUID;
-                        fid->icb.impUse[2] = uuid;
-                        fid->descTag.descCRC = calculate_crc(fid, flen+padding);             
+                        uint32_t leUuid = cpu_to_le32(uuid);
+                        memcpy((fid->icb).impUse+2, &leUuid, sizeof(uint32_t));
+                        udf_tag_set_crc(&fid->descTag, calculate_crc(fid, flen+padding));
                         fid->descTag.tagChecksum = calculate_checksum(fid->descTag);
-                        dbg("Location: %u\n", fid->descTag.tagLocation);
+                        dbg("Location: %u\n", udf_tag_location(&fid->descTag));
 
                         position = lsn * stats->blocksize;
                         chunk  = (uint32_t)(position / chunksize);
@@ -2111,31 +2444,50 @@ uint8_t inspect_fid(udf_media_t *media,
 
                         struct fileEntry *fe = (struct fileEntry *)(media->mapping[chunk] + offset);
                         struct extendedFileEntry *efe = (struct extendedFileEntry *)fe;
-                        if(efe->descTag.tagIdent == TAG_IDENT_EFE) {
-                            efe->descTag.descCRC = calculate_crc(efe, sizeof(struct extendedFileEntry) + le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs));
+                        if(udf_tag_ident(&efe->descTag) == TAG_IDENT_EFE) {
+                            udf_tag_set_crc(&efe->descTag, calculate_crc(efe, udf_efe_length(efe)));
                             efe->descTag.tagChecksum = calculate_checksum(efe->descTag);
-                        } else if(efe->descTag.tagIdent == TAG_IDENT_FE) {
-                            fe->descTag.descCRC = calculate_crc(fe, sizeof(struct fileEntry) + le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs));
+                        } else if(udf_tag_ident(&efe->descTag) == TAG_IDENT_FE) {
+                            udf_tag_set_crc(&fe->descTag, calculate_crc(fe, udf_fe_length(fe)));
                             fe->descTag.tagChecksum = calculate_checksum(fe->descTag);
                         } else {
 
                         }
                         imp("(%s) UUID was fixed.\n", info.filename);
+                        unmap_chunk(media, chunk);
                         *status |= ESTATUS_CORRECTED_ERRORS;
                     }
                 }
                 dbg("ICB to follow.\n");
-                int tmp_status = get_file(media,
-                                          fid->icb.extLocation.logicalBlockNum + stats->lbnlsn, stats,
-                                          depth, uuid, info, seq);
+                uint32_t icblsn = udf_lad_block(&fid->icb) + stats->lbnlsn;
+                const struct journal_file *verified = NULL;
+                int tmp_status;
+                if (stats->journal && (fid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY) == 0)
+                    verified = journal_find_file(stats->journal, uuid, icblsn);
+                if (verified) {
+                    dbg("(%s) Verified by previous check.\n", info.filename);
+                    replay_journal_file(stats, verified);
+                    tmp_status = 0;
+                } else if (stats->journal && (fid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY) == 0) {
+                    uint32_t numFiles = stats->found.numFiles;
+                    journal_begin_file(stats->journal, uuid, icblsn);
+                    tmp_status = get_file(media, icblsn, stats, depth, uuid, info, seq);
+                    if (stats->found.numFiles != numFiles)
+                        journal_set_flags(stats->journal, JOURNAL_FILE_COUNTED);
+                    journal_end_file(stats->journal, tmp_status == 0);
+                } else if (stats->scan) {
+                    tmp_status = scan_get_file(media, icblsn, stats, depth, uuid, info, seq);
+                } else {
+                    tmp_status = get_file(media, icblsn, stats, depth, uuid, info, seq);
+                }
                 if(tmp_status == 32) { //32 means delete this FID
                     fid->fileCharacteristics |= FID_FILE_CHAR_DELETED; //Set deleted flag
                     memset(&(fid->icb), 0, sizeof(long_ad)); //clear ICB according to ECMA-167r3, 4/14.4.5
-                    fid->descTag.descCRC = calculate_crc(fid, flen+padding);             
+                    udf_tag_set_crc(&fid->descTag, calculate_crc(fid, flen+padding));
                     fid->descTag.tagChecksum = calculate_checksum(fid->descTag);
-                    dbg("Location: %u\n", fid->descTag.tagLocation);
+                    dbg("Location: %u\n", udf_tag_location(&fid->descTag));
 
-                    position = (fid->descTag.tagLocation + stats->lbnlsn) * stats->blocksize;
+                    position = (udf_tag_location(&fid->descTag) + stats->lbnlsn) * stats->blocksize;
                     chunk  = (uint32_t)(position / chunksize);
                     offset = (uint32_t)(position % chunksize);
                     dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
@@ -2143,16 +2495,17 @@ uint8_t inspect_fid(udf_media_t *media,
 
                     struct fileEntry *fe = (struct fileEntry *)(media->mapping[chunk] + offset);
                     struct extendedFileEntry *efe = (struct extendedFileEntry *)fe;
-                    if(efe->descTag.tagIdent == TAG_IDENT_EFE) {
-                        efe->descTag.descCRC = calculate_crc(efe, sizeof(struct extendedFileEntry) + le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs));
+                    if(udf_tag_ident(&efe->descTag) == TAG_IDENT_EFE) {
+                        udf_tag_set_crc(&efe->descTag, calculate_crc(efe, udf_efe_length(efe)));
                         efe->descTag.tagChecksum = calculate_checksum(efe->descTag);
-                    } else if(efe->descTag.tagIdent == TAG_IDENT_EFE) {
-                        fe->descTag.descCRC = calculate_crc(fe, sizeof(struct fileEntry) + le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs));
+                    } else if(udf_tag_ident(&efe->descTag) == TAG_IDENT_FE) {
+                        udf_tag_set_crc(&fe->descTag, calculate_crc(fe, udf_fe_length(fe)));
                         fe->descTag.tagChecksum = calculate_checksum(fe->descTag);
                     } else {
                         err("(%s) FID parent FE not found.\n", info.filename);
                     }
                     imp("(%s) Unfinished file was removed.\n", info.filename);
+                    unmap_chunk(media, chunk);
 
                     tmp_status = ESTATUS_CORRECTED_ERRORS;
                 }
@@ -2161,7 +2514,7 @@ uint8_t inspect_fid(udf_media_t *media,
             }
         } else {
             dbg("DELETED FID\n");
-            uint8_t *fileIdent = fid->impUseAndFileIdent + fid->lengthOfImpUse;
+            uint8_t *fileIdent = fid->impUseAndFileIdent + udf_fid_imp_use_length(fid);
             *status |= check_dstring(fileIdent, fid->lengthFileIdent) ? ESTATUS_UNCORRECTED_ERRORS
                                                                       : ESTATUS_OK; //FIXME expand for fixing later.
             print_file_info(info, depth);
@@ -2170,7 +2523,7 @@ uint8_t inspect_fid(udf_media_t *media,
         *pos = *pos + flen + padding;
         note("\n");
     } else {
-        msg("Ident: %x\n", le16_to_cpu(fid->descTag.tagIdent));
+        msg("Ident: %x\n", udf_tag_ident(&fid->descTag));
         uint8_t *fidarray = (uint8_t *)fid;
         for(int i=0; i<80;) {
             for(int j=0; j<8; j++, i++) {
@@ -2190,7 +2543,7 @@ uint32_t get_used_blocks(const integrity_info_t *info)
     return (info->partitionNumBlocks - info->freeSpaceBlocks);
 }
 
-static void update_min_udf_revision(struct filesystemStats *stats, uint16_t new_revision)
+void update_min_udf_revision(struct filesystemStats *stats, uint16_t new_revision)
 {
     if (new_revision > stats->found.minUDFReadRev)
         stats->found.minUDFReadRev = new_revision;
@@ -2214,6 +2567,8 @@ void increment_used_space(struct filesystemStats *stats, uint64_t increment, uin
     uint32_t increment_blocks = (increment + stats->blocksize - 1) / stats->blocksize;
     stats->found.freeSpaceBlocks -= increment_blocks;
     markUsedBlock(stats, position, increment_blocks, MARK_BLOCK);
+    if (stats->journal)
+        journal_add_extent(stats->journal, position, increment_blocks);
 #if DEBUG
     dwarn("INCREMENT to %u\n", get_used_blocks(&stats->found));
 #endif
@@ -2239,6 +2594,94 @@ void decrement_used_space(struct filesystemStats *stats, uint64_t decrement, uin
 #endif
 }
 
+/**
+ * \brief Inspect FIDs recorded directly in directory (E)FE
+ *
+ * \param[in]      media              Information regarding medium & access to it
+ * \param[in]      lsn                LSN of the directory (E)FE
+ * \param[in]      *dirContent        FIDs area in (E)FE
+ * \param[in]      lengthAllocDescs   length of FIDs area in bytes
+ * \param[in,out]  *stats             file system status
+ * \param[in]      depth              depth of FE for printing
+ * \param[in]      *seq               VDS sequence
+ *
+ * \return run status of FIDs inspection
+ */
+static uint8_t walk_icb_directory(udf_media_t *media, uint32_t lsn,
+                                  uint8_t *dirContent, uint32_t lengthAllocDescs,
+                                  struct filesystemStats *stats, uint32_t depth, vds_sequence_t *seq) {
+    uint8_t tempStatus = 0;
+    uint32_t counter = 0;
+    struct prefetch pf;
+    uint32_t valid = validate_fids(dirContent, lengthAllocDescs, lengthAllocDescs);
+
+    prefetch_init(&pf, media, stats, dirContent, lengthAllocDescs);
+    for(uint32_t pos=0; pos < lengthAllocDescs; ) {
+        prefetch_advance(&pf, media, stats, counter);
+        uint8_t failureCode = inspect_fid(media, lsn,
+                                          dirContent, 0, &pos, counter++ < valid, stats, depth+1, seq,
+                                          &tempStatus);
+        if(failureCode) {
+            dbg("1 FID inspection over.\n");
+            break;
+        }
+    }
+    prefetch_free(&pf);
+    dbg("2 FID inspection over.\n");
+    return tempStatus;
+}
+
+/**
+ * \brief Inspect contents of directory queued by parallel file tree walk
+ *
+ * Corrections of FIDs are not written back, parallel walk is used only in check mode.
+ *
+ * \param[in]      media     Information regarding medium & access to it
+ * \param[in]      *dir      queued directory
+ * \param[in,out]  *stats    file system status of calling thread
+ * \param[in]      *seq      VDS sequence
+ *
+ * \return run status of directory inspection
+ */
+uint8_t inspect_directory(udf_media_t *media, const struct walk_dir *dir,
+                          struct filesystemStats *stats, vds_sequence_t *seq) {
+    uint8_t status = 0;
+
+    if (dir->icb_ad == ICBTAG_FLAG_AD_IN_ICB) {
+        status = walk_icb_directory(media, dir->lsn, dir->allocDescs, dir->lengthAllocDescs,
+                                    stats, dir->depth, seq);
+    } else {
+        walk_directory(media, dir->lsn, dir->allocDescs, dir->lengthAllocDescs, dir->icb_ad,
+                       stats, dir->depth, seq, &status);
+    }
+    return status;
+}
+
+/**
+ * \brief Report file modified after LVID was recorded
+ *
+ * Error message is printed only for the first LVID error found.
+ *
+ * \param[in]      *stats     file system status
+ * \param[in,out]  *seq       VDS sequence
+ * \param[in]      *filename  file name for message
+ * \param[in]      cts        result of compare_timestamps()
+ */
+void report_lvid_timestamp(struct filesystemStats *stats, vds_sequence_t *seq,
+                           const char *filename, double cts) {
+    if (stats->walk) {
+        walk_defer_timestamp(stats->walk, filename, cts);
+        return;
+    }
+    if (!seq->lvid.error) {
+        err("(%s) File timestamp is later than LVID timestamp. LVID needs to be fixed.\n", filename);
+#ifdef DEBUG
+        err("CTS: %f\n", cts);
+#endif
+    }
+    seq->lvid.error |= E_TIMESTAMP;
+}
+
 /**
  * \brief (E)FE parsing function
  *
@@ -2277,7 +2720,7 @@ uint8_t get_file(udf_media_t *media,
 
     uint8_t dir = 0;
     uint8_t status = 0;
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
     uint32_t chunk = 0;
     uint32_t offset = 0;
     uint64_t position = 0;
@@ -2290,16 +2733,26 @@ uint8_t get_file(udf_media_t *media,
     map_chunk(media, chunk, __FILE__, __LINE__);
 
     descTag = (tag *)(media->mapping[chunk] + offset);
-    if(!checksum(*descTag)) {
+    int tagValid = checksum(*descTag);
+    // Sectors are found unreadable on access, so the map is complete after checksum()
+    if(badblocks_contains(position, stats->blocksize)) {
+        err("(%u) File entry is in unreadable sector, skipped.\n", lsn);
+        unmap_chunk(media, chunk);
+        return ESTATUS_UNCORRECTED_ERRORS;
+    }
+    if(!tagValid) {
         err("Tag checksum failed. Unable to continue.\n");
+        unmap_chunk(media, chunk);
         return ESTATUS_UNCORRECTED_ERRORS;
     }
+    report_desc(udf_tag_ident(descTag));
+    udf_progress_add(UDF_PROGRESS_FILES, 1);
 
     dbg("global FE increment.\n");
     dbg("usedSpace: %u\n", get_used_blocks(&stats->found));
     increment_used_space(stats, stats->blocksize, lsn - stats->lbnlsn);
     dbg("usedSpace: %u\n", get_used_blocks(&stats->found));
-    switch(le16_to_cpu(descTag->tagIdent)) {
+    switch(udf_tag_ident(descTag)) {
         case TAG_IDENT_FE:
         case TAG_IDENT_EFE:
             dir = 0;
@@ -2307,9 +2760,9 @@ uint8_t get_file(udf_media_t *media,
             efe = (struct extendedFileEntry *)fe;
             uint8_t ext = 0;
 
-            if(le16_to_cpu(descTag->tagIdent) == TAG_IDENT_EFE) {
+            if(udf_tag_ident(descTag) == TAG_IDENT_EFE) {
                 dwarn("[EFE]\n");
-                if(crc(efe, sizeof(struct extendedFileEntry) + le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs))) {
+                if(crc(efe, udf_efe_length(efe))) {
                     err("EFE CRC failed.\n");
                     int cont = 0;
                     if(interactive) {
@@ -2323,9 +2776,11 @@ uint8_t get_file(udf_media_t *media,
                     }
                 }
                 update_min_udf_revision(stats, 0x0200);
+                if (stats->journal)
+                    journal_set_flags(stats->journal, JOURNAL_FILE_EFE);
                 ext = 1;
             } else {
-                if(crc(fe, sizeof(struct fileEntry) + le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs))) {
+                if(crc(fe, udf_fe_length(fe))) {
                     err("FE CRC failed.\n");
                     int cont = 0;
                     if(interactive) {
@@ -2339,8 +2794,8 @@ uint8_t get_file(udf_media_t *media,
                     }
                 }
             }
-            dbg("Tag Serial Num: %u\n", descTag->tagSerialNum);
-            if(stats->AVDPSerialNum != descTag->tagSerialNum) {
+            dbg("Tag Serial Num: %u\n", udf_tag_serial(descTag));
+            if(stats->AVDPSerialNum != udf_tag_serial(descTag)) {
                 err("(%s) Tag Serial Number differs.\n", info.filename);
                 uint8_t fixsernum = autofix;
                 if(interactive) {
@@ -2349,11 +2804,11 @@ uint8_t get_file(udf_media_t *media,
                     }
                 }
                 if(fixsernum) {
-                    descTag->tagSerialNum = stats->AVDPSerialNum;
+                    udf_tag_set_serial(descTag, stats->AVDPSerialNum);
                     if(ext) {
-                        descTag->descCRC = calculate_crc(efe, sizeof(struct extendedFileEntry) + le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs));
+                        udf_tag_set_crc(descTag, calculate_crc(efe, udf_efe_length(efe)));
                     } else {
-                        descTag->descCRC = calculate_crc(fe, sizeof(struct fileEntry) + le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs));
+                        udf_tag_set_crc(descTag, calculate_crc(fe, udf_fe_length(fe)));
                     }
                     descTag->tagChecksum = calculate_checksum(*descTag);
                     status |= ESTATUS_CORRECTED_ERRORS;
@@ -2362,22 +2817,22 @@ uint8_t get_file(udf_media_t *media,
                 }
             }
             dbg("\nFE, LSN: %u, EntityID: %s ", lsn, fe->impIdent.ident);
-            dbg("fileLinkCount: %u, LB recorded: %" PRIu64 "\n", fe->fileLinkCount,
-                ext ? efe->logicalBlocksRecorded: fe->logicalBlocksRecorded);
-            uint32_t L_EA = ext ? efe->lengthExtendedAttr : fe->lengthExtendedAttr;
-            uint32_t L_AD = ext ? efe->lengthAllocDescs   : fe->lengthAllocDescs;
+            dbg("fileLinkCount: %u, LB recorded: %" PRIu64 "\n", udf_fe_link_count(fe),
+                ext ? udf_efe_blocks_recorded(efe) : udf_fe_blocks_recorded(fe));
+            uint32_t L_EA = ext ? udf_efe_ea_length(efe) : udf_fe_ea_length(fe);
+            uint32_t L_AD = ext ? udf_efe_ad_length(efe) : udf_fe_ad_length(fe);
             dbg("L_EA %u, L_AD %u\n", L_EA, L_AD);
-            dbg("Information Length: %" PRIu64 "\n", fe->informationLength);
-            uint32_t info_len_blocks = (uint32_t) (fe->informationLength / stats->blocksize);
-            if ((fe->informationLength % stats->blocksize) != 0)
+            dbg("Information Length: %" PRIu64 "\n", udf_fe_info_length(fe));
+            uint32_t info_len_blocks = (uint32_t) (udf_fe_info_length(fe) / stats->blocksize);
+            if ((udf_fe_info_length(fe) % stats->blocksize) != 0)
                 info_len_blocks++;
             dbg("InfLenBlocks: %u\n", info_len_blocks);
-            dbg("BlocksRecord: %" PRIu64 "\n", ext ? efe->logicalBlocksRecorded : fe->logicalBlocksRecorded);
+            dbg("BlocksRecord: %" PRIu64 "\n", ext ? udf_efe_blocks_recorded(efe) : udf_fe_blocks_recorded(fe));
 
-            info.size = fe->informationLength;
+            info.size = udf_fe_info_length(fe);
             info.fileType = fe->icbTag.fileType;
-            info.permissions = fe->permissions;
-            dbg("Permissions: 0x%04x : 0x%04x\n", info.permissions, fe->permissions);
+            info.permissions = udf_fe_permissions(fe);
+            dbg("Permissions: 0x%04x : 0x%04x\n", info.permissions, udf_fe_permissions(fe));
 
             switch(fe->icbTag.fileType) {
                 case ICBTAG_FILE_TYPE_UNDEF:
@@ -2438,23 +2893,17 @@ uint8_t get_file(udf_media_t *media,
                     break; 
             }
 
-            dbg("numEntries: %u\n", fe->icbTag.numEntries);
-            dbg("Parent ICB loc: %u\n", fe->icbTag.parentICBLocation.logicalBlockNum);
+            dbg("numEntries: %u\n", le16_to_cpu(fe->icbTag.numEntries));
+            dbg("Parent ICB loc: %u\n", udf_lb_block(&fe->icbTag.parentICBLocation));
 
             double cts = 0;
             if((cts = compare_timestamps(stats->lvid.recordedTime, ext ? efe->modificationTime : fe->modificationTime)) < 0) {
-                if (!seq->lvid.error) {
-                    err("(%s) File timestamp is later than LVID timestamp. LVID needs to be fixed.\n", info.filename);
-#ifdef DEBUG
-                    err("CTS: %f\n", cts);
-#endif
-                }
-                seq->lvid.error |= E_TIMESTAMP; 
+                report_lvid_timestamp(stats, seq, info.filename, cts);
             }
             info.modTime = ext ? efe->modificationTime : fe->modificationTime;
 
 
-            uint64_t feUUID = (ext ? efe->uniqueID : fe->uniqueID);
+            uint64_t feUUID = (ext ? udf_efe_unique_id(efe) : udf_fe_unique_id(fe));
             dbg("Unique ID: FE: %"PRIu64" FID: %"PRIu32"\n", (feUUID), uuid); //PRIu32 is fixing uint32_t printing
             if (uuid == 0) {
                 // Account UIDs that can't be handled during FID processing
@@ -2481,12 +2930,12 @@ uint8_t get_file(udf_media_t *media,
                     if(lsn==1704005)
                         dbg("[1704005] fixuuid");
                 if(ext) {
-                    efe->uniqueID = uuid;
-                    efe->descTag.descCRC = calculate_crc(efe, sizeof(struct extendedFileEntry) + le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs));
+                    udf_efe_set_unique_id(efe, uuid);
+                    udf_tag_set_crc(&efe->descTag, calculate_crc(efe, udf_efe_length(efe)));
                     efe->descTag.tagChecksum = calculate_checksum(efe->descTag);
                 } else {
-                    fe->uniqueID = uuid;
-                    fe->descTag.descCRC = calculate_crc(fe, sizeof(struct fileEntry) + le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs));
+                    udf_fe_set_unique_id(fe, uuid);
+                    udf_tag_set_crc(&fe->descTag, calculate_crc(fe, udf_fe_length(fe)));
                     fe->descTag.tagChecksum = calculate_checksum(fe->descTag);
                 }
                 status |= ESTATUS_CORRECTED_ERRORS;
@@ -2497,82 +2946,60 @@ uint8_t get_file(udf_media_t *media,
 
             uint8_t fid_inspected = 0;
             uint8_t *allocDescs = (ext ? efe->extendedAttrAndAllocDescs : fe->extendedAttrAndAllocDescs) + L_EA; 
-            uint16_t icbTagADFlags = le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK;
+            uint16_t icbTagADFlags = udf_icbtag_flags(&fe->icbTag) & ICBTAG_FLAG_AD_MASK;
             if (   (icbTagADFlags == ICBTAG_FLAG_AD_SHORT)
                 || (icbTagADFlags == ICBTAG_FLAG_AD_LONG)) {
 
                 if(dir) {
                     fid_inspected = 1;
-                    walk_directory(media, lsn, allocDescs, L_AD,
-                                   icbTagADFlags, stats, depth, seq, &status);
+                    if(stats->walk == NULL
+                       || walk_defer_directory(stats->walk, lsn, allocDescs, L_AD, icbTagADFlags, depth))
+                        walk_directory(media, lsn, allocDescs, L_AD,
+                                       icbTagADFlags, stats, depth, seq, &status);
                 } else {
-                    uint32_t lengthADArray = 0;
-                    uint8_t *ADArray = NULL;  // Heap-allocated memory we must free
-                    int nAD = 0;
+                    struct extent_list list;
 
                     int extentErr = collect_extents(media, allocDescs, L_AD,
-                                                    icbTagADFlags, &ADArray, &nAD, stats, &status);
+                                                    icbTagADFlags, &list, stats, &status);
                     if (extentErr) {
-                        nAD = 0;
+                        list.count = 0;
                     }
 
-                    size_t descLen;
-                    if (icbTagADFlags == ICBTAG_FLAG_AD_SHORT) {
-                        descLen = sizeof(short_ad);
-                        dbg("SHORT\n");
-                    } else {
-                        descLen = sizeof(long_ad);
-                        dbg("LONG\n");
-                    }
-                    dbg("LAD: %u, N: %u, rest: %u\n", L_AD, L_AD / descLen, L_AD % descLen);
-                    for(int si = 0; si < nAD; si++) {
-                        uint32_t extLength;
-                        uint32_t extType;
-                        uint32_t extPosition;
-
-                        if (icbTagADFlags == ICBTAG_FLAG_AD_SHORT) {
-                            dwarn("SHORT #%d\n", si);
-                            short_ad *sad = (short_ad *)(ADArray + si*descLen);
-                            extLength   = sad->extLength & 0x3FFFFFFF;
-                            extType     = sad->extLength >> 30;
-                            extPosition = sad->extPosition;
+                    dbg("%s LAD: %u, N: %u\n", icbTagADFlags == ICBTAG_FLAG_AD_SHORT ? "SHORT" : "LONG",
+                        L_AD, list.count);
+                    for(uint32_t si = 0; si < list.count; si++) {
+                        const struct ad_extent *extent = &list.ext[si];
 
-                        } else {
-                            dwarn("LONG #%d\n", si);
-                            long_ad *lad = (long_ad *)(ADArray + si*descLen);
-                            extLength   = lad->extLength & 0x3FFFFFFF;
-                            extType     = lad->extLength >> 30;
-                            extPosition = lad->extLocation.logicalBlockNum;
-                        }
-
-                        dbg("ExtLen: %u, type: %u, ExtLoc: %u\n", extLength, extType, extPosition);
+                        dbg("ExtLen: %u, type: %u, ExtLoc: %u\n", extent->length, extent->type, extent->lbn);
                         dbg("usedSpace: %u\n", get_used_blocks(&stats->found));
 
-                        if (extType < 2) {
+                        if (extent->type < 2) {
                             // Allocated
-                            increment_used_space(stats, extLength, extPosition);
+                            increment_used_space(stats, extent->length, extent->lbn);
                         }
                         uint32_t lbSize = (uint32_t) stats->blocksize;
-                        lsn = lsn + (extLength / lbSize);
-                        dbg("LSN: %u, ExtLocOrig: %u\n", lsn, extPosition);
+                        lsn = lsn + (extent->length / lbSize);
+                        dbg("LSN: %u, ExtLocOrig: %u\n", lsn, extent->lbn);
                         dbg("usedSpace: %u\n", get_used_blocks(&stats->found));
-                        dwarn("Size: %u, Blocks: %u\n", extLength, extLength / lbSize);
+                        dwarn("Size: %u, Blocks: %u\n", extent->length, extent->length / lbSize);
                     }
 
-                    free(ADArray);
+                    free_extents(&list);
                 }
             } else if(icbTagADFlags == ICBTAG_FLAG_AD_EXTENDED) {
                 if(dir) {
                     fid_inspected = 1;
-                    walk_directory(media, lsn, allocDescs, L_AD,
-                                   ICBTAG_FLAG_AD_EXTENDED, stats, depth, seq, &status);
+                    if(stats->walk == NULL
+                       || walk_defer_directory(stats->walk, lsn, allocDescs, L_AD, ICBTAG_FLAG_AD_EXTENDED, depth))
+                        walk_directory(media, lsn, allocDescs, L_AD,
+                                       ICBTAG_FLAG_AD_EXTENDED, stats, depth, seq, &status);
                 } else {
                     err("EAD found. Please report.\n");
                 }
             } else if(icbTagADFlags == ICBTAG_FLAG_AD_IN_ICB) {
                 dbg("AD in ICB\n");
             } else {
-                dbg("ICB TAG->flags: 0x%02x\n", fe->icbTag.flags);
+                dbg("ICB TAG->flags: 0x%02x\n", udf_icbtag_flags(&fe->icbTag));
             }
 
             // We can assume that directory have one or more FID inside.
@@ -2581,42 +3008,36 @@ uint8_t get_file(udf_media_t *media,
                 uint8_t *dirContent;
                 uint32_t lengthAllocDescs;
                 if(ext) {
-                    dbg("[EFE DIR] lengthExtendedAttr: %u\n", efe->lengthExtendedAttr);
-                    dbg("[EFE DIR] lengthAllocDescs: %u\n", efe->lengthAllocDescs);
-                    dirContent = efe->extendedAttrAndAllocDescs + efe->lengthExtendedAttr;
-                    lengthAllocDescs = efe->lengthAllocDescs;
+                    dbg("[EFE DIR] lengthExtendedAttr: %u\n", udf_efe_ea_length(efe));
+                    dbg("[EFE DIR] lengthAllocDescs: %u\n", udf_efe_ad_length(efe));
+                    dirContent = udf_efe_ads(efe);
+                    lengthAllocDescs = udf_efe_ad_length(efe);
                 } else {
-                    dbg("[FE DIR] lengthExtendedAttr: %u\n", fe->lengthExtendedAttr);
-                    dbg("[FE DIR] lengthAllocDescs: %u\n", fe->lengthAllocDescs);
-                    dirContent = fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr;
-                    lengthAllocDescs = fe->lengthAllocDescs;
+                    dbg("[FE DIR] lengthExtendedAttr: %u\n", udf_fe_ea_length(fe));
+                    dbg("[FE DIR] lengthAllocDescs: %u\n", udf_fe_ad_length(fe));
+                    dirContent = udf_fe_ads(fe);
+                    lengthAllocDescs = udf_fe_ad_length(fe);
                 }
 
-                uint8_t tempStatus = 0;
-                for(uint32_t pos=0; pos < lengthAllocDescs; ) {
-                    uint8_t failureCode = inspect_fid(media, lsn,
-                                                      dirContent, &pos, stats, depth+1, seq,
-                                                      &tempStatus);
-                    if(failureCode) {
-                        dbg("1 FID inspection over.\n");
-                        break;
+                if(stats->walk == NULL
+                   || walk_defer_directory(stats->walk, lsn, dirContent, lengthAllocDescs, ICBTAG_FLAG_AD_IN_ICB, depth)) {
+                    uint8_t tempStatus = walk_icb_directory(media, lsn, dirContent, lengthAllocDescs,
+                                                            stats, depth, seq);
+                    if (tempStatus & ESTATUS_CORRECTED_ERRORS) {
+                        // FID(s) were fixed - update FE/EFE CRC
+                        descTag = &efe->descTag;  // same as &fe->descTag
+                        udf_tag_set_crc(descTag, udf_crc((uint8_t *)(descTag + 1), udf_tag_crc_length(descTag), 0));
+                        descTag->tagChecksum = calculate_checksum(*descTag);
                     }
+                    status |= tempStatus;
                 }
-                dbg("2 FID inspection over.\n");
-                if (tempStatus & ESTATUS_CORRECTED_ERRORS) {
-                    // FID(s) were fixed - update FE/EFE CRC
-                    descTag = &efe->descTag;  // same as &fe->descTag
-                    descTag->descCRC = udf_crc((uint8_t *)(descTag + 1),  descTag->descCRCLength, 0);
-                    descTag->tagChecksum = calculate_checksum(*descTag);
-                }
-                status |= tempStatus;
             }
             break;  
         default:
-            err("IDENT: %x, LSN: %u, addr: 0x%" PRIx64 "\n", descTag->tagIdent, lsn,
+            err("IDENT: %x, LSN: %u, addr: 0x%" PRIx64 "\n", udf_tag_ident(descTag), lsn,
                 lsn * stats->blocksize);
     }            
-    // unmap_chunk(dev, chunk, devsize); 
+    unmap_chunk(media, chunk);
     return status;
 }
 
@@ -2653,27 +3074,91 @@ uint8_t get_file_structure(udf_media_t *media,
     lb_addr icbloc = media->disc.udf_fsd->rootDirectoryICB.extLocation;
     // Get Stream Dir ICB
     lb_addr sicbloc = media->disc.udf_fsd->streamDirectoryICB.extLocation;
-    dbg("icbloc: %u\n", icbloc.logicalBlockNum);
-    dbg("sicbloc: %u\n", sicbloc.logicalBlockNum);
+    dbg("icbloc: %u\n", udf_lb_block(&icbloc));
+    dbg("sicbloc: %u\n", udf_lb_block(&sicbloc));
 
-    lsn   = icbloc.logicalBlockNum  + stats->lbnlsn;
-    slsn  = sicbloc.logicalBlockNum + stats->lbnlsn;
-    elen  = media->disc.udf_fsd->rootDirectoryICB.extLength;
-    selen = media->disc.udf_fsd->streamDirectoryICB.extLength;
-    dbg("ROOT LSN: %u, len: %u, partition: %u\n", lsn, elen, icbloc.partitionReferenceNum);
-    dbg("STREAM LSN: %u len: %u, partition: %u\n", slsn, selen, sicbloc.partitionReferenceNum);
+    lsn   = udf_lb_block(&icbloc)  + stats->lbnlsn;
+    slsn  = udf_lb_block(&sicbloc) + stats->lbnlsn;
+    elen  = le32_to_cpu(media->disc.udf_fsd->rootDirectoryICB.extLength);
+    selen = le32_to_cpu(media->disc.udf_fsd->streamDirectoryICB.extLength);
+    dbg("ROOT LSN: %u, len: %u, partition: %u\n", lsn, elen, udf_lb_partition(&icbloc));
+    dbg("STREAM LSN: %u len: %u, partition: %u\n", slsn, selen, udf_lb_partition(&sicbloc));
 
     dbg("Used space offset: %u\n", get_used_blocks(&stats->found));
     struct fileInfo info;
     memset(&info, 0, sizeof(struct fileInfo));
 
+    // Worker threads never write, corrections need the single threaded walk
+    int threads = (interactive || autofix) ? 1 : jobs;
+    if(threads < jobs) {
+        warn("Parallel file tree check is available only in check mode. Using single thread.\n");
+    } else if(stats->journal && threads > 1) {
+        warn("Parallel file tree check is not available with check journal. Using single thread.\n");
+        threads = 1;
+    }
+
+    // Two pass check resolves file tree from ICB graph, it has nothing to fix or record
+    struct scan_graph graph;
+    if(scan_mode) {
+        if(interactive || autofix || stats->journal) {
+            warn("Two pass file tree check is available only in check mode without check journal. Walking file tree.\n");
+        } else if(scan_partition(media, stats, &graph) == 0) {
+            stats->scan = &graph;
+            if(threads > 1) {
+                warn("Parallel file tree check is not available with two pass check. Using single thread.\n");
+                threads = 1;
+            }
+        }
+    }
+
+    // Check mode walks iteratively, corrections depend on the recursion of get_file()
+    int walk = !(interactive || autofix) && stats->journal == NULL;
+
+    // Replay stack is saved only by serial walk
+    struct checkpoint *cp = (walk && stats->scan == NULL) ? stats->checkpoint : NULL;
+    if(cp && threads > 1) {
+        warn("Parallel file tree check is not available with checkpoints. Using single thread.\n");
+        threads = 1;
+    }
+    // Stream file tree was finished by interrupted run when it saved checkpoint of medium file tree
+    int resumed = cp && cp->loaded && elen > 0 && cp->hdr.rootLsn == lsn;
+    if(resumed)
+        status |= cp->hdr.treeStatus;
+
     if(selen > 0) {
         msg("\nStream file tree\n----------------\n");
-        status |= get_file(media, slsn, stats, 0, 0, info, seq);
+        if(stats->scan) {
+            status |= scan_get_file(media, slsn, stats, 0, 0, info, seq);
+        } else if(resumed) {
+            msg("Checked before checkpoint.\n");
+        } else if(walk) {
+            if(cp) {
+                cp->rootLsn = slsn;
+                cp->treeStatus = status;
+            }
+            status |= walk_file_tree(media, slsn, stats, seq, threads);
+        } else {
+            status |= get_file(media, slsn, stats, 0, 0, info, seq);
+        }
     }
     if(elen > 0) {
         msg("\nMedium file tree\n----------------\n");
-        status |= get_file(media, lsn, stats, 0, 0, info, seq);
+        if(stats->scan) {
+            status |= scan_get_file(media, lsn, stats, 0, 0, info, seq);
+        } else if(walk) {
+            if(cp) {
+                cp->rootLsn = lsn;
+                cp->treeStatus = status;
+            }
+            status |= walk_file_tree(media, lsn, stats, seq, threads);
+        } else {
+            status |= get_file(media, lsn, stats, 0, 0, info, seq);
+        }
+    }
+
+    if(stats->scan) {
+        scan_free(&graph);
+        stats->scan = NULL;
     }
     return status;
 }
@@ -2822,7 +3307,7 @@ int verify_vds(struct udf_disc *disc, vds_type_e vds, vds_sequence_t *seq, struc
         err("CRC error at PVD[%d]\n", vds);
         append_error(seq, TAG_IDENT_PVD, vds, E_CRC);
     }
-    if(crc(disc->udf_lvd[vds], sizeof(struct logicalVolDesc)+disc->udf_lvd[vds]->mapTableLength)) {
+    if(crc(disc->udf_lvd[vds], sizeof(struct logicalVolDesc)+le32_to_cpu(disc->udf_lvd[vds]->mapTableLength))) {
         err("CRC error at LVD[%d]\n", vds);
         append_error(seq, TAG_IDENT_LVD, vds, E_CRC);
     }
@@ -2830,7 +3315,7 @@ int verify_vds(struct udf_disc *disc, vds_type_e vds, vds_sequence_t *seq, struc
         err("CRC error at PD[%d]\n", vds);
         append_error(seq, TAG_IDENT_PD, vds, E_CRC);
     }
-    if(crc(disc->udf_usd[vds], sizeof(struct unallocSpaceDesc)+(disc->udf_usd[vds]->numAllocDescs)*sizeof(extent_ad))) {
+    if(crc(disc->udf_usd[vds], sizeof(struct unallocSpaceDesc)+le32_to_cpu(disc->udf_usd[vds]->numAllocDescs)*sizeof(extent_ad))) {
         err("CRC error at USD[%d]\n", vds);
         append_error(seq, TAG_IDENT_USD, vds, E_CRC);
     }
@@ -2869,54 +3354,36 @@ int verify_vds(struct udf_disc *disc, vds_type_e vds, vds_sequence_t *seq, struc
 /**
  * \brief Copy descriptor from one position to another on medium
  *
- * Also fixes declared position, CRC and checksum of the new copy.
+ * Copy is staged in repair transaction, see repair_stage(). Declared position and checksum of
+ * the new copy are fixed here, its CRC is recalculated on commit.
  *
  * \param[in]  media                Information regarding medium & access to it
  * \param[in]  sourcePosition       in blocks
  * \param[in]  destinationPosition  in blocks
  * \param[in]  size                 size of descriptor to copy
  *
- * return 0
+ * return 0 copy is staged
+ * return -1 copy cannot be staged
  */
 int copy_descriptor(udf_media_t *media, uint32_t sourcePosition, uint32_t destinationPosition,
                     size_t size) {
-    tag sourceDescTag, destinationDescTag;
+    tag *destinationDescTag;
     uint8_t *destArray;
-    uint32_t offset = 0, chunk = 0;
-    uint32_t chunksize = CHUNK_SIZE;
-    uint64_t byte_position;
 
     dbg("source: 0x%x, destination: 0x%x\n", sourcePosition, destinationPosition);
 
-    byte_position = sourcePosition * (uint64_t)media->sectorsize;
-    chunk  = (uint32_t)(byte_position / chunksize);
-    offset = (uint32_t)(byte_position % chunksize);
-    dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
-    map_chunk(media, chunk, __FILE__, __LINE__);
-
-    sourceDescTag = *(tag *)(media->mapping[chunk] + offset);
-    memcpy(&destinationDescTag, &sourceDescTag, sizeof(tag));
-    destinationDescTag.tagLocation = destinationPosition;
-    destinationDescTag.tagChecksum = calculate_checksum(destinationDescTag);
-
-    dbg("srcChecksum: 0x%x, destChecksum: 0x%x\n", sourceDescTag.tagChecksum, destinationDescTag.tagChecksum);
-
-    destArray = calloc(1, size);
-    memcpy(destArray, &destinationDescTag, sizeof(tag));
-    memcpy(destArray+sizeof(tag), media->mapping[chunk] + offset + sizeof(tag), size - sizeof(tag));
-
-    unmap_chunk(media, chunk);
-    byte_position = destinationPosition * (uint64_t)media->sectorsize;
-    chunk  = (uint32_t)(byte_position / chunksize);
-    offset = (uint32_t)(byte_position % chunksize);
-    dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
-    map_chunk(media, chunk, __FILE__, __LINE__);
-
-    memcpy(media->mapping[chunk] + offset, destArray, size);
-
-    free(destArray);
+    destArray = repair_stage(media, destinationPosition * (uint64_t)media->sectorsize, size);
+    if(destArray == NULL)
+        return -1;
+    // Source can be staged by previous repair too
+    if(repair_read(media, sourcePosition * (uint64_t)media->sectorsize, destArray, size) != 0)
+        return -1;
 
-    unmap_chunk(media, chunk);
+    destinationDescTag = (tag *)destArray;
+    dbg("srcChecksum: 0x%x\n", destinationDescTag->tagChecksum);
+    udf_tag_set_location(destinationDescTag, destinationPosition);
+    destinationDescTag->tagChecksum = calculate_checksum(*destinationDescTag);
+    dbg("destChecksum: 0x%x\n", destinationDescTag->tagChecksum);
 
     return 0;
 }
@@ -2924,21 +3391,23 @@ int copy_descriptor(udf_media_t *media, uint32_t sourcePosition, uint32_t destin
 /**
  * \brief Writes back specified AVDP from udf_disc structure to device
  *
+ * AVDP is staged in repair transaction and written by repair_commit().
+ *
  * \param[in] media    Information regarding medium & access to it
  * \param[in] source   source AVDP
  * \param[in] target   target AVDP
  *
  * \return 0 everything OK
- * \return -2 after write checksum failed 
- * \return -4 after write CRC failed
+ * \return -1 AVDP cannot be staged
+ * \return -2 after copy checksum failed
+ * \return -3 after copy CRC failed
+ * \return -4 AVDP not found after copy
  */
 int write_avdp(udf_media_t *media, avdp_type_e source, avdp_type_e target) {
     uint64_t sourcePosition = 0;
     uint64_t targetPosition = 0;
-    tag desc_tag;
+    struct anchorVolDescPtr *avdp;
     avdp_type_e type = target;
-    uint32_t offset = 0, chunk = 0;
-    uint32_t chunksize = CHUNK_SIZE;
 
     // Source type determines position on media
     if(source == 0) {
@@ -2968,60 +3437,54 @@ int write_avdp(udf_media_t *media, avdp_type_e source, avdp_type_e target) {
     dbg("DevSize: %" PRIu64 "\n", media->devsize);
     dbg("Current position: %" PRIx64 "\n", targetPosition);
 
-    copy_descriptor(media,
-                    sourcePosition / media->sectorsize,
-                    targetPosition / media->sectorsize,
-                    sizeof(struct anchorVolDescPtr));
+    if(copy_descriptor(media,
+                       sourcePosition / media->sectorsize,
+                       targetPosition / media->sectorsize,
+                       sizeof(struct anchorVolDescPtr)) != 0) {
+        err("AVDP[%d] cannot be staged\n", type);
+        return -1;
+    }
+    avdp = repair_stage(media, targetPosition, sizeof(struct anchorVolDescPtr));
 
     free(media->disc.udf_anchor[type]);
     media->disc.udf_anchor[type] = malloc(sizeof(struct anchorVolDescPtr)); // Prepare memory for AVDP
 
-    chunk = targetPosition/chunksize;
-    offset = targetPosition%chunksize;
-    dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
-    map_chunk(media, chunk, __FILE__, __LINE__);
-
-    desc_tag = *(tag *)(media->mapping[chunk] + offset);
-
-    if(!checksum(desc_tag)) {
+    if(!checksum(avdp->descTag)) {
         err("Checksum failure at AVDP[%d]\n", type);
-        map_chunk(media, chunk, __FILE__, __LINE__);
         return -2;
-    } else if(le16_to_cpu(desc_tag.tagIdent) != TAG_IDENT_AVDP) {
+    } else if(udf_tag_ident(&avdp->descTag) != TAG_IDENT_AVDP) {
         err("AVDP not found at 0x%" PRIx64 "\n", targetPosition);
-        map_chunk(media, chunk, __FILE__, __LINE__);
         return -4;
     }
 
-    memcpy(media->disc.udf_anchor[type], media->mapping[chunk] + offset, sizeof(struct anchorVolDescPtr));
+    memcpy(media->disc.udf_anchor[type], avdp, sizeof(struct anchorVolDescPtr));
 
     if (crc(media->disc.udf_anchor[type], sizeof(struct anchorVolDescPtr))) {
         err("CRC error at AVDP[%d]\n", type);
-        map_chunk(media, chunk, __FILE__, __LINE__);
         return -3;
     }
 
-    imp("AVDP[%d] successfully written.\n", type);
-    map_chunk(media, chunk, __FILE__, __LINE__);
+    imp("AVDP[%d] successfully copied.\n", type);
     return 0;
 }
 
 /**
  * \brief Fix target AVDP's extent length
  *
+ * Fixed AVDP is staged in repair transaction, it can be the copy staged by write_avdp().
+ *
  * \param[in] media    Information regarding medium & access to it
  * \param[in] target   target AVDP
  *
  * \return 0 everything OK
- * \return -2 checksum failed 
- * \return -4 CRC failed
+ * \return -1 AVDP cannot be staged
+ * \return -2 checksum failed
+ * \return -4 AVDP not found
  */
 int fix_avdp(udf_media_t *media, avdp_type_e target) {
     uint64_t targetPosition = 0;
-    tag desc_tag;
+    struct anchorVolDescPtr *avdp;
     avdp_type_e type = target;
-    uint32_t offset = 0, chunk = 0;
-    uint32_t chunksize = CHUNK_SIZE;
 
     // Target type determines position on media
     if(target == 0) {
@@ -3039,37 +3502,35 @@ int fix_avdp(udf_media_t *media, avdp_type_e target) {
     dbg("DevSize: %" PRIu64 "\n", media->devsize);
     dbg("Current position: %" PRIx64 "\n", targetPosition);
 
-    chunk = targetPosition/chunksize;
-    offset = targetPosition%chunksize;
-    dbg("Chunk: %u, offset: 0x%x\n", chunk, offset);
-    map_chunk(media, chunk, __FILE__, __LINE__);
-
-    desc_tag = *(tag *)(media->mapping[chunk] + offset);
+    avdp = repair_stage(media, targetPosition, sizeof(struct anchorVolDescPtr));
+    if(avdp == NULL) {
+        err("AVDP[%d] cannot be staged\n", type);
+        return -1;
+    }
 
-    if(!checksum(desc_tag)) {
+    if(!checksum(avdp->descTag)) {
         err("Checksum failure at AVDP[%d]\n", type);
         return -2;
-    } else if(le16_to_cpu(desc_tag.tagIdent) != TAG_IDENT_AVDP) {
+    } else if(udf_tag_ident(&avdp->descTag) != TAG_IDENT_AVDP) {
         err("AVDP not found at 0x%" PRIx64 "\n", targetPosition);
         return -4;
     }
 
-    if(  media->disc.udf_anchor[type]->mainVolDescSeqExt.extLength
-       > media->disc.udf_anchor[type]->reserveVolDescSeqExt.extLength) { //main is bigger
-        if (   media->disc.udf_anchor[type]->mainVolDescSeqExt.extLength
-            >= 16 * media->sectorsize) { //and is big enough
+    if(  udf_extad_length(&media->disc.udf_anchor[type]->mainVolDescSeqExt)
+       > udf_extad_length(&media->disc.udf_anchor[type]->reserveVolDescSeqExt)) { //main is bigger
+        if (   udf_extad_length(&media->disc.udf_anchor[type]->mainVolDescSeqExt)
+            >= 16U * media->sectorsize) { //and is big enough
             media->disc.udf_anchor[type]->reserveVolDescSeqExt.extLength = media->disc.udf_anchor[type]->mainVolDescSeqExt.extLength;
         } 
     } else { //reserve is bigger
-        if (   media->disc.udf_anchor[type]->reserveVolDescSeqExt.extLength
-            >= 16 * media->sectorsize) { //and is big enough
+        if (   udf_extad_length(&media->disc.udf_anchor[type]->reserveVolDescSeqExt)
+            >= 16U * media->sectorsize) { //and is big enough
             media->disc.udf_anchor[type]->mainVolDescSeqExt.extLength = media->disc.udf_anchor[type]->reserveVolDescSeqExt.extLength;
         } 
     }
-    media->disc.udf_anchor[type]->descTag.descCRC = calculate_crc(media->disc.udf_anchor[type], sizeof(struct anchorVolDescPtr));
-    media->disc.udf_anchor[type]->descTag.tagChecksum = calculate_checksum(media->disc.udf_anchor[type]->descTag);
 
-    memcpy(media->mapping[chunk] + offset, media->disc.udf_anchor[type], sizeof(struct anchorVolDescPtr));
+    // CRC and checksum are recalculated on commit
+    memcpy(avdp, media->disc.udf_anchor[type], sizeof(struct anchorVolDescPtr));
 
     imp("AVDP[%d] Extent Length successfully fixed.\n", type);
     return 0;
@@ -3123,8 +3584,8 @@ int fix_vds(udf_media_t *media, avdp_type_e source, vds_sequence_t *seq) {
     uint8_t status = 0;
 
     // Go to first address of VDS
-    position_main    = media->disc.udf_anchor[source]->mainVolDescSeqExt.extLocation;
-    position_reserve = media->disc.udf_anchor[source]->reserveVolDescSeqExt.extLocation;
+    position_main    = udf_extad_location(&media->disc.udf_anchor[source]->mainVolDescSeqExt);
+    position_reserve = udf_extad_location(&media->disc.udf_anchor[source]->reserveVolDescSeqExt);
 
 
     msg("\nVDS verification status\n-----------------------\n");
@@ -3149,8 +3610,12 @@ int fix_vds(udf_media_t *media, avdp_type_e source, vds_sequence_t *seq) {
                 warn("src pos: 0x%x\n", position_reserve + i);
                 warn("dest pos: 0x%x\n", position_main + i);
                 //                memcpy(position_main + i*sectorsize, position_reserve + i*sectorsize, sectorsize);
-                copy_descriptor(media, position_reserve + i, position_main + i, media->sectorsize);
-                status |= ESTATUS_CORRECTED_ERRORS;
+                if(copy_descriptor(media, position_reserve + i, position_main + i, media->sectorsize) == 0) {
+                    status |= ESTATUS_CORRECTED_ERRORS;
+                } else {
+                    err("[%i] %s cannot be staged.\n", i, descriptor_name(seq->reserve[i].tagIdent));
+                    status |= ESTATUS_UNCORRECTED_ERRORS;
+                }
             } else {
                 err("[%i] %s is broken.\n", i,descriptor_name(seq->reserve[i].tagIdent));
                 status |= ESTATUS_UNCORRECTED_ERRORS;
@@ -3166,8 +3631,12 @@ int fix_vds(udf_media_t *media, avdp_type_e source, vds_sequence_t *seq) {
 
             if(fix) {
                 warn("[%i] Fixing Reserve %s\n", i,descriptor_name(seq->main[i].tagIdent));
-                copy_descriptor(media, position_reserve + i, position_main + i, media->sectorsize);
-                status |= ESTATUS_CORRECTED_ERRORS;
+                if(copy_descriptor(media, position_main + i, position_reserve + i, media->sectorsize) == 0) {
+                    status |= ESTATUS_CORRECTED_ERRORS;
+                } else {
+                    err("[%i] %s cannot be staged.\n", i, descriptor_name(seq->main[i].tagIdent));
+                    status |= ESTATUS_UNCORRECTED_ERRORS;
+                }
             } else {
                 err("[%i] %s is broken.\n", i,descriptor_name(seq->main[i].tagIdent));
                 status |= ESTATUS_UNCORRECTED_ERRORS;
@@ -3184,14 +3653,6 @@ int fix_vds(udf_media_t *media, avdp_type_e source, vds_sequence_t *seq) {
     return status;
 }
 
-static const unsigned char BitsSetTable256[256] = 
-{
-#define B2(n) n,     n+1,     n+1,     n+2
-#define B4(n) B2(n), B2(n+1), B2(n+1), B2(n+2)
-#define B6(n) B4(n), B4(n+1), B4(n+1), B4(n+2)
-    B6(0), B6(1), B6(1), B6(2)
-}; ///< Support array for bit counting
-
 /**
  * \brief Fix PD Partition Header contents
  *
@@ -3208,62 +3669,76 @@ static const unsigned char BitsSetTable256[256] =
  */
 int fix_pd(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *seq) {
     int vds = -1;
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
     uint32_t chunk = 0;
     uint32_t offset = 0;
+    uint32_t numOfBytes;
 
     if((vds=get_correct(seq, TAG_IDENT_PD)) < 0) {
         err("No correct PD found. Aborting.\n");
         return 4;
     }
     struct partitionHeaderDesc *phd = (struct partitionHeaderDesc *)(media->disc.udf_pd[vds]->partitionContentsUse);
-    dbg("[USD] UST pos: %u, len: %u\n", phd->unallocSpaceTable.extPosition, phd->unallocSpaceTable.extLength);
-    dbg("[USD] USB pos: %u, len: %u\n", phd->unallocSpaceBitmap.extPosition, phd->unallocSpaceBitmap.extLength);
-    dbg("[USD] FST pos: %u, len: %u\n", phd->freedSpaceTable.extPosition, phd->freedSpaceTable.extLength);
-    dbg("[USD] FSB pos: %u, len: %u\n", phd->freedSpaceBitmap.extPosition, phd->freedSpaceBitmap.extLength);
+    dbg("[USD] UST pos: %u, len: %u\n", udf_sad_position(&phd->unallocSpaceTable), le32_to_cpu(phd->unallocSpaceTable.extLength));
+    dbg("[USD] USB pos: %u, len: %u\n", udf_sad_position(&phd->unallocSpaceBitmap), le32_to_cpu(phd->unallocSpaceBitmap.extLength));
+    dbg("[USD] FST pos: %u, len: %u\n", udf_sad_position(&phd->freedSpaceTable), le32_to_cpu(phd->freedSpaceTable.extLength));
+    dbg("[USD] FSB pos: %u, len: %u\n", udf_sad_position(&phd->freedSpaceBitmap), le32_to_cpu(phd->freedSpaceBitmap.extLength));
 
-    if(phd->unallocSpaceTable.extLength > 0) {
+    if(le32_to_cpu(phd->unallocSpaceTable.extLength) > 0) {
         //Unhandled. Not found on any medium.
         err("[USD] Unallocated Space Table is unhandled. Skipping.\n");
     }
-    if(phd->freedSpaceTable.extLength > 0) {
+    if(le32_to_cpu(phd->freedSpaceTable.extLength) > 0) {
         //Unhandled. Not found on any medium.
         err("[USD] Free Space Table is unhandled. Skipping.\n");
     }
-    if(phd->freedSpaceBitmap.extLength > 0) {
+    if(le32_to_cpu(phd->freedSpaceBitmap.extLength) > 0) {
         //Unhandled. Not found on any medium.
         err("[USD] Unallocated Space Table is unhandled. Skipping.\n");
     }
 
-    if(phd->unallocSpaceBitmap.extLength > 3) { //0,1,2,3 are special values ECMA 167r3 4/14.14.1.1
-        uint32_t lbnlsn   = media->disc.udf_pd[vds]->partitionStartingLocation;
-        uint64_t position = (lbnlsn + phd->unallocSpaceBitmap.extPosition) * stats->blocksize;
+    if(le32_to_cpu(phd->unallocSpaceBitmap.extLength) > 3) { //0,1,2,3 are special values ECMA 167r3 4/14.14.1.1
+        uint32_t lbnlsn   = le32_to_cpu(media->disc.udf_pd[vds]->partitionStartingLocation);
+        uint64_t position = (lbnlsn + udf_sad_position(&phd->unallocSpaceBitmap)) * stats->blocksize;
 
         chunk  = (uint32_t) (position / chunksize);
         offset = (uint32_t) (position % chunksize);
         map_chunk(media, chunk, __FILE__, __LINE__);
 
         struct spaceBitmapDesc *sbd = (struct spaceBitmapDesc *)(media->mapping[chunk] + offset);
-        if(sbd->descTag.tagIdent != TAG_IDENT_SBD) {
+        if(udf_tag_ident(&sbd->descTag) != TAG_IDENT_SBD) {
             err("SBD not found\n");
+            unmap_chunk(media, chunk);
             return -1;
         }
-        dbg("[SBD] NumOfBits: %u\n", sbd->numOfBits);
-        dbg("[SBD] NumOfBytes: %u\n", sbd->numOfBytes);
+        numOfBytes = le32_to_cpu(sbd->numOfBytes);
+        dbg("[SBD] NumOfBits: %u\n", le32_to_cpu(sbd->numOfBits));
+        dbg("[SBD] NumOfBytes: %u\n", numOfBytes);
         dbg("[SBD] Chunk: %u, Offset: %u\n", chunk, offset);
+        unmap_chunk(media, chunk);
+
+        // Whole SBD is staged, its bitmap can cross cache windows
+        sbd = repair_stage(media, position, sizeof(struct spaceBitmapDesc) + numOfBytes);
+        if(sbd == NULL) {
+            err("PD SBD recovery failed, SBD cannot be staged.\n");
+            return 1;
+        }
 
 #ifdef MEMTRACE    
-        dbg("Bitmap: %u, %p\n", lbnlsn + phd->unallocSpaceBitmap.extPosition, sbd->bitmap);
+        dbg("Bitmap: %u, %p\n", lbnlsn + udf_sad_position(&phd->unallocSpaceBitmap), sbd->bitmap);
 #else
-        dbg("Bitmap: %u\n", lbnlsn + phd->unallocSpaceBitmap.extPosition);
+        dbg("Bitmap: %u\n", lbnlsn + udf_sad_position(&phd->unallocSpaceBitmap));
 #endif
-        memcpy(sbd->bitmap, stats->actPartitionBitmap, sbd->numOfBytes);
+        // Recorded bitmap is referenced in place, keep it as it was found
+        stats->expPartitionBitmap = own_descriptor(media, stats->expPartitionBitmap);
+        struct bitmap_copy copy = { .dst = sbd->bitmap, .numBits = (uint64_t)numOfBytes * 8 };
+        if(for_each_bitmap_window(stats, 0, copy_bitmap_window, &copy) != 0) {
+            err("PD SBD recovery failed, actual bitmap cannot be rebuilt.\n");
+            return 1;
+        }
         dbg("MEMCPY DONE\n");
 
-        //Recalculate CRC and checksum
-        sbd->descTag.descCRC = calculate_crc(sbd, sbd->descTag.descCRCLength + sizeof(tag));
-        sbd->descTag.tagChecksum = calculate_checksum(sbd->descTag);
-        
+        // CRC and checksum are recalculated on commit
         imp("PD SBD recovery was successful.\n");
         return 0;
     }
@@ -3288,7 +3763,7 @@ int fix_pd(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *se
 int get_pd(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *seq) {
     int vds = -1;
     uint32_t offset = 0, chunk = 0;
-    uint32_t chunksize = CHUNK_SIZE;
+    uint32_t chunksize = media->chunksize;
     uint64_t position = 0;
 
     if((vds=get_correct(seq, TAG_IDENT_PD)) < 0) {
@@ -3296,119 +3771,109 @@ int get_pd(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *se
         return 4;
     }
 
-    stats->partitionAccessType      = media->disc.udf_pd[vds]->accessType;
-    stats->found.partitionNumBlocks = media->disc.udf_pd[vds]->partitionLength;
-    stats->found.freeSpaceBlocks    = media->disc.udf_pd[vds]->partitionLength;
+    stats->partitionAccessType      = le32_to_cpu(media->disc.udf_pd[vds]->accessType);
+    stats->found.partitionNumBlocks = le32_to_cpu(media->disc.udf_pd[vds]->partitionLength);
+    stats->found.freeSpaceBlocks    = le32_to_cpu(media->disc.udf_pd[vds]->partitionLength);
 
     // Create array for used/unused blocks counting
-    uint32_t bitmapNumBytes = (stats->found.partitionNumBlocks + 7) / 8;
-    stats->actPartitionBitmap  = malloc(bitmapNumBytes);
-    memset(stats->actPartitionBitmap, 0xff, bitmapNumBytes);
+    stats->actPartitionBitmap = malloc(sizeof(struct page_bitmap));
+    if(stats->actPartitionBitmap == NULL || page_bitmap_init(stats->actPartitionBitmap, stats->found.partitionNumBlocks) != 0) {
+        free(stats->actPartitionBitmap);
+        stats->actPartitionBitmap = NULL;
+        err("Cannot allocate partition bitmap.\n");
+        return 4;
+    }
+    // A quarter of memory limit is left for actual bitmap, see main()
+    if(memory_limit > 0 && page_bitmap_limit(stats->actPartitionBitmap, memory_limit / 4) != 0)
+        warn("Cannot create temporary file, whole partition bitmap is kept in memory: %s\n", strerror(errno));
+    if(stats->actPartitionBitmap->windowBits > 0)
+        msg("Partition bitmap is checked in %u passes.\n",
+            (stats->found.partitionNumBlocks + stats->actPartitionBitmap->windowBits - 1) / stats->actPartitionBitmap->windowBits);
     dbg("Create array done\n");
 
     struct partitionHeaderDesc *phd = (struct partitionHeaderDesc *)(media->disc.udf_pd[vds]->partitionContentsUse);
-    dbg("[USD] UST pos: %u, len: %u\n", phd->unallocSpaceTable.extPosition, phd->unallocSpaceTable.extLength);
-    dbg("[USD] USB pos: %u, len: %u\n", phd->unallocSpaceBitmap.extPosition, phd->unallocSpaceBitmap.extLength);
-    dbg("[USD] FST pos: %u, len: %u\n", phd->freedSpaceTable.extPosition, phd->freedSpaceTable.extLength);
-    dbg("[USD] FSB pos: %u, len: %u\n", phd->freedSpaceBitmap.extPosition, phd->freedSpaceBitmap.extLength);
+    dbg("[USD] UST pos: %u, len: %u\n", udf_sad_position(&phd->unallocSpaceTable), le32_to_cpu(phd->unallocSpaceTable.extLength));
+    dbg("[USD] USB pos: %u, len: %u\n", udf_sad_position(&phd->unallocSpaceBitmap), le32_to_cpu(phd->unallocSpaceBitmap.extLength));
+    dbg("[USD] FST pos: %u, len: %u\n", udf_sad_position(&phd->freedSpaceTable), le32_to_cpu(phd->freedSpaceTable.extLength));
+    dbg("[USD] FSB pos: %u, len: %u\n", udf_sad_position(&phd->freedSpaceBitmap), le32_to_cpu(phd->freedSpaceBitmap.extLength));
 
-    if(phd->unallocSpaceTable.extLength > 0) {
+    if(le32_to_cpu(phd->unallocSpaceTable.extLength) > 0) {
         //Unhandled. Not found on any medium.
         err("[USD] Unallocated Space Table is unhandled. Skipping.\n");
         return -128;
     }
-    if(phd->freedSpaceTable.extLength > 0) {
+    if(le32_to_cpu(phd->freedSpaceTable.extLength) > 0) {
         //Unhandled. Not found on any medium.
         err("[USD] Free Space Table is unhandled. Skipping.\n");
         return -128;
     }
-    if(phd->freedSpaceBitmap.extLength > 0) {
+    if(le32_to_cpu(phd->freedSpaceBitmap.extLength) > 0) {
         //Unhandled. Not found on any medium.
         err("[USD] Freed Space Bitmap is unhandled. Skipping.\n");
         return -128;
     }
-    if(phd->unallocSpaceBitmap.extLength > 3) { //0,1,2,3 are special values ECMA 167r3 4/14.14.1.1
-        uint32_t lbnlsn = media->disc.udf_pd[vds]->partitionStartingLocation;
+    if(le32_to_cpu(phd->unallocSpaceBitmap.extLength) > 3) { //0,1,2,3 are special values ECMA 167r3 4/14.14.1.1
+        uint32_t lbnlsn = le32_to_cpu(media->disc.udf_pd[vds]->partitionStartingLocation);
         dbg("LBN 0: LSN %u\n", lbnlsn);
-        position = (lbnlsn + phd->unallocSpaceBitmap.extPosition) * stats->blocksize;
+        position = (lbnlsn + udf_sad_position(&phd->unallocSpaceBitmap)) * stats->blocksize;
         chunk  = (uint32_t)(position / chunksize);
         offset = (uint32_t)(position % chunksize);
         map_chunk(media, chunk, __FILE__, __LINE__);
 
         struct spaceBitmapDesc *sbd = (struct spaceBitmapDesc *)(media->mapping[chunk] + offset);
-        if(sbd->descTag.tagIdent != TAG_IDENT_SBD) {
+        if(udf_tag_ident(&sbd->descTag) != TAG_IDENT_SBD) {
             err("SBD not found\n");
             return -1;
         }
+        report_desc(TAG_IDENT_SBD);
         if(!checksum(sbd->descTag)) {
             err("SBD checksum error. Continue with caution.\n");
             seq->pd.error |= E_CHECKSUM;
         }
-        if(crc(sbd, sbd->descTag.descCRCLength + sizeof(tag))) {
+        if(crc(sbd, udf_tag_crc_length(&sbd->descTag) + sizeof(tag))) {
             err("SBD CRC error. Continue with caution.\n");
             seq->pd.error |= E_CRC; 
         }
-        if (sbd->numOfBits != stats->found.partitionNumBlocks) {
+        if (le32_to_cpu(sbd->numOfBits) != stats->found.partitionNumBlocks) {
             err("SBD size error. Continue with caution.\n");
             seq->pd.error |= E_FREESPACE;
         }
         dbg("SBD is ok\n");
-        dbg("[SBD] NumOfBits: %u\n", sbd->numOfBits);
-        dbg("[SBD] NumOfBytes: %u\n", sbd->numOfBytes);
+        dbg("[SBD] NumOfBits: %u\n", le32_to_cpu(sbd->numOfBits));
+        dbg("[SBD] NumOfBytes: %u\n", le32_to_cpu(sbd->numOfBytes));
 #ifdef MEMTRACE
-        dbg("Bitmap: %u, %p\n", lbnlsn + phd->unallocSpaceBitmap.extPosition, sbd->bitmap);
+        dbg("Bitmap: %u, %p\n", lbnlsn + udf_sad_position(&phd->unallocSpaceBitmap), sbd->bitmap);
 #else
-        dbg("Bitmap: %u\n", lbnlsn + phd->unallocSpaceBitmap.extPosition);
+        dbg("Bitmap: %u\n", lbnlsn + udf_sad_position(&phd->unallocSpaceBitmap));
 #endif
 
-        stats->spacedesc.partitionNumBlocks = sbd->numOfBits;
+        stats->spacedesc.partitionNumBlocks = le32_to_cpu(sbd->numOfBits);
 
-        uint8_t *ptr = NULL;
-        dbg("Chunk: %u\n", chunk);
-        map_raw(media->fd, &ptr, (uint64_t)(chunk) * CHUNK_SIZE, (sbd->numOfBytes + offset), media->devsize);
-#ifdef MEMTRACE
-        dbg("Ptr: %p\n", ptr); 
-#endif
-        sbd = (struct spaceBitmapDesc *)(ptr+offset);
-       
-        dbg("Get bitmap statistics\n"); 
-        //Get actual bitmap statistics
-        uint32_t unusedBlocks = 0;
-        uint8_t count = 0;
-        uint8_t v = 0;
-        for(int i=0; i<(int)(sbd->numOfBytes-1); i++) {
-            v = sbd->bitmap[i];
-            //if(i%1000 == 0) dbg("0x%02x %d\n",v, i);
-            count = BitsSetTable256[v & 0xff] + BitsSetTable256[(v >> 8) & 0xff] + BitsSetTable256[(v >> 16) & 0xff] + BitsSetTable256[v >> 24];     
-            unusedBlocks += count;
+        // Keep recorded bitmap for comparison
+        release_descriptor(media, stats->expPartitionBitmap);
+        stats->expPartitionBitmap = view_descriptor(media, position + sizeof(struct spaceBitmapDesc), le32_to_cpu(sbd->numOfBytes));
+        if(stats->expPartitionBitmap == NULL) {
+            err("Cannot load SBD bitmap\n");
+            unmap_chunk(media, chunk);
+            return -1;
         }
-        dbg("Unused blocks: %u\n", unusedBlocks);
 
-        uint8_t bitCorrection = sbd->numOfBytes*8-sbd->numOfBits;
-        dbg("BitCorrection: %u\n", bitCorrection);
-        v = sbd->bitmap[sbd->numOfBytes-1];
-        dbg("Bitmap last: 0x%02x\n", v);
-        for(int i=0; i<8 - bitCorrection; i++) {
-            dbg("Mask: 0x%02x, Result: 0x%02x\n", (1 << i), v & (1 << i));
-            if(v & (1 << i))
-                unusedBlocks++;
-        }
+        dbg("Get bitmap statistics\n"); 
+        //Get actual bitmap statistics
+        uint32_t unusedBlocks = bitmap_count(stats->expPartitionBitmap, 0, MIN(le32_to_cpu(sbd->numOfBits), le32_to_cpu(sbd->numOfBytes) * 8));
 
         stats->spacedesc.freeSpaceBlocks = unusedBlocks;
-        stats->expPartitionBitmap = sbd->bitmap;
         dbg("Unused blocks: %u\n", unusedBlocks);
         dbg("Used Blocks: %u\n", get_used_blocks(&stats->spacedesc));
 
-        sbd = (struct spaceBitmapDesc *)(media->mapping[chunk] + offset);
-        unmap_raw(&ptr, (uint64_t)(chunk)*CHUNK_SIZE, sbd->numOfBytes);
         unmap_chunk(media, chunk);
     }
 
     //Mark used space
-    increment_used_space(stats, phd->unallocSpaceTable.extLength, phd->unallocSpaceTable.extPosition);
-    increment_used_space(stats, phd->unallocSpaceBitmap.extLength, phd->unallocSpaceBitmap.extPosition);
-    increment_used_space(stats, phd->freedSpaceTable.extLength, phd->freedSpaceTable.extPosition);
-    increment_used_space(stats, phd->freedSpaceBitmap.extLength, phd->freedSpaceBitmap.extPosition);
+    increment_used_space(stats, le32_to_cpu(phd->unallocSpaceTable.extLength), udf_sad_position(&phd->unallocSpaceTable));
+    increment_used_space(stats, le32_to_cpu(phd->unallocSpaceBitmap.extLength), udf_sad_position(&phd->unallocSpaceBitmap));
+    increment_used_space(stats, le32_to_cpu(phd->freedSpaceTable.extLength), udf_sad_position(&phd->freedSpaceTable));
+    increment_used_space(stats, le32_to_cpu(phd->freedSpaceBitmap.extLength), udf_sad_position(&phd->freedSpaceBitmap));
 
     return 0; 
 }
@@ -3423,13 +3888,11 @@ int get_pd(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *se
  * \param[in] *seq     VDS sequence
  *
  * \return 0 -- All Ok
+ * \return 1 -- LVID cannot be staged
  * \return 4 -- No correct LVD found
  */
 int fix_lvid(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *seq) {
     int vds = -1;
-    uint32_t chunksize = CHUNK_SIZE;
-    uint32_t chunk = 0;
-    uint32_t offset = 0;
     uint64_t position;
 
     if((vds=get_correct(seq, TAG_IDENT_LVD)) < 0) {
@@ -3437,26 +3900,23 @@ int fix_lvid(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *
         return 4;
     }
 
-    uint32_t loc = media->disc.udf_lvd[vds]->integritySeqExt.extLocation;
-    uint32_t len = media->disc.udf_lvd[vds]->integritySeqExt.extLength;
+    uint32_t loc = udf_extad_location(&media->disc.udf_lvd[vds]->integritySeqExt);
+    uint32_t len = udf_extad_length(&media->disc.udf_lvd[vds]->integritySeqExt);
 
     position = loc * stats->blocksize;
-    chunk  = (uint32_t)(position / chunksize);
-    offset = (uint32_t)(position % chunksize);
-    map_chunk(media, chunk, __FILE__, __LINE__);
-
-    struct logicalVolIntegrityDesc *lvid = (struct logicalVolIntegrityDesc *)(media->mapping[chunk] + offset);
 
     // Fix PD too
     fix_pd(media, stats, seq);
 
+    media->disc.udf_lvid = own_descriptor(media, media->disc.udf_lvid);
+
     // These two may not be correct if LVID is damaged
     uint16_t size =   sizeof(struct logicalVolIntegrityDesc)
-                    + media->disc.udf_lvid->numOfPartitions * sizeof(uint32_t) * 2
-                    + media->disc.udf_lvid->lengthOfImpUse;
+                    + le32_to_cpu(media->disc.udf_lvid->numOfPartitions) * sizeof(uint32_t) * 2
+                    + le32_to_cpu(media->disc.udf_lvid->lengthOfImpUse);
     struct impUseLVID *impUse = (struct impUseLVID *)(  (uint8_t *)(media->disc.udf_lvid)
                                                       + size
-                                                      - media->disc.udf_lvid->lengthOfImpUse);
+                                                      - le32_to_cpu(media->disc.udf_lvid->lengthOfImpUse));
 
     if (seq->lvid.error & (E_CRC | E_CHECKSUM | E_WRONGDESC))
     {
@@ -3530,7 +3990,7 @@ int fix_lvid(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *
     dbg("Type and Timezone: 0x%04x\n", le16_to_cpu(ts->typeAndTimezone));
 
     uint32_t *freeSpaceTable = (uint32_t *) media->disc.udf_lvid->data;
-    uint32_t *sizeTable      = freeSpaceTable + media->disc.udf_lvid->numOfPartitions;
+    uint32_t *sizeTable      = freeSpaceTable + le32_to_cpu(media->disc.udf_lvid->numOfPartitions);
 
     sizeTable[0]      = cpu_to_le32(stats->found.partitionNumBlocks);
     freeSpaceTable[0] = cpu_to_le32(stats->found.freeSpaceBlocks);
@@ -3539,13 +3999,14 @@ int fix_lvid(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *
     // Close integrity (last thing before write)
     media->disc.udf_lvid->integrityType = constant_cpu_to_le32(LVID_INTEGRITY_TYPE_CLOSE);
 
-    // Recalculate CRC and checksum
-    media->disc.udf_lvid->descTag.descCRC = calculate_crc(media->disc.udf_lvid, size);
-    media->disc.udf_lvid->descTag.tagChecksum = calculate_checksum(media->disc.udf_lvid->descTag);
-    //Write changes back to medium
+    // Stage changes for writing back to medium, CRC and checksum are recalculated on commit
+    struct logicalVolIntegrityDesc *lvid = repair_stage(media, position, size);
+    if(lvid == NULL) {
+        err("LVID recovery failed, LVID cannot be staged.\n");
+        return 1;
+    }
     memcpy(lvid, media->disc.udf_lvid, size);
 
-    unmap_chunk(media, chunk);
     imp("LVID recovery was successful.\n");
     return 0;
 }
@@ -23,6 +23,7 @@
 
 #include <ecma_167.h>
 #include <libudffs.h>
+#include <udf_access.h>
 
 #include <stdio.h>
 #include <errno.h>
@@ -87,20 +88,42 @@ typedef struct {
 
 } integrity_info_t;
 
+struct block_cache;
+struct repair_txn;
+
+#define DESC_VIEWS 16 ///< Maximum amount of descriptors referenced in place in block cache
+
+typedef struct {
+    void     *desc;         ///< descriptor inside of pinned cache window
+    uint32_t  chunk;        ///< pinned window
+    uint32_t  length;       ///< length of descriptor in bytes
+} desc_view_t;
+
 typedef struct {
     int             fd;          // File descriptor for mmapped access to media
-    uint8_t       **mapping;     // mmapped chunks of the media
+    uint8_t       **mapping;     // mmapped chunks of the media, managed by block cache
+    uint32_t        chunksize;   // Size of one chunk (cache window) in bytes
+    struct block_cache *cache;   // Block cache state
     struct udf_disc disc;
     uint64_t        devsize;     // Size of the whole device in bytes
     int             sectorsize;
+    desc_view_t     views[DESC_VIEWS]; // Descriptors of udf_disc read in place, see view_descriptor()
+    uint32_t        numViews;
+    struct repair_txn *repair;   // Staged repairs of fix phases, see repair.h
 } udf_media_t;
 
+struct walk_ctx;
+struct check_journal;
+struct scan_graph;
+struct page_bitmap;
+struct checkpoint;
+
 struct filesystemStats {
     uint64_t blocksize;  // This is 64 bits to simplify block->byte conversions
     uint32_t lbnlsn;     // Offset in blocks of partition block 0 from volume sector 0
     uint16_t AVDPSerialNum;
     uint32_t partitionAccessType;
-    uint8_t * actPartitionBitmap;
+    struct page_bitmap * actPartitionBitmap; // Calculated, see bitmap.h
     uint8_t * expPartitionBitmap;
     char * partitionIdent;
     char * volumeSetIdent;
@@ -119,6 +142,11 @@ struct filesystemStats {
     integrity_info_t lvid;      // Information from recorded LVID
     integrity_info_t spacedesc; // Information from recorded space descriptor (if any)
     integrity_info_t found;     // Calculated
+
+    struct walk_ctx *walk;      // Parallel file tree walk of this thread, NULL if single threaded
+    struct check_journal *journal; // Check journal recording verified files, NULL without --journal
+    struct scan_graph *scan;    // ICB graph of two pass check, NULL when file tree is walked
+    struct checkpoint *checkpoint; // Checkpoints of file tree walk, NULL without --checkpoint
 };
 
 struct fileInfo {
@@ -160,10 +188,14 @@ struct impUseLVID {
 
 // Support functions
 char * print_timestamp(timestamp ts);
+double compare_timestamps(timestamp a, timestamp b);
 uint32_t get_used_blocks(const integrity_info_t *info);
 int get_volume_identifier(struct udf_disc *disc, struct filesystemStats *stats, vds_sequence_t *seq );
 void unmap_chunk(udf_media_t *media, uint32_t chunk);
 void map_chunk(udf_media_t *media, uint32_t chunk, char * file, int line);
+void *view_descriptor(udf_media_t *media, uint64_t position, size_t length);
+void *own_descriptor(udf_media_t *media, void *desc);
+void release_descriptor(udf_media_t *media, void *desc);
 
 // UDF detection
 int is_udf(udf_media_t* media, int force_sectorsize, struct filesystemStats *stats);
@@ -188,6 +220,13 @@ int fix_pd(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *se
 // Filetree functions
 uint8_t get_fsd(udf_media_t *media, struct filesystemStats * stats, vds_sequence_t *seq);
 uint8_t get_file_structure(udf_media_t *media, struct filesystemStats *stats, vds_sequence_t *seq );
+uint8_t get_file(udf_media_t *media, uint32_t lsn, struct filesystemStats *stats, uint32_t depth,
+                 uint32_t uuid, struct fileInfo info, vds_sequence_t *seq );
+uint8_t markUsedBlock(struct filesystemStats *stats, uint32_t lbn, uint32_t size, uint8_t mark);
+uint32_t validate_fids(const uint8_t *fids, uint32_t length, uint32_t size);
+int for_each_bitmap_window(struct filesystemStats *stats, int report,
+                           int (*fn)(struct filesystemStats *stats, uint32_t start, uint32_t length, void *arg),
+                           void *arg);
 
 // Check for match on blocksize
 int check_blocksize(udf_media_t *media, int force_sectorsize, vds_sequence_t *seq);
@@ -34,6 +34,11 @@
 #include <time.h>
 
 #include "udffsck.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "scan.h"
+#include "cache.h"
+#include "repair.h"
 #include "log.h"
 
     
@@ -535,6 +540,371 @@ void print_dstring(dstring *string, size_t field_length) {
     assert_int_equal(check_dstring(array, 32), DSTRING_E_INVALID_CHARACTERS); //Check it 
 }
 
+// Bit by bit reference for bitmap tests
+static int ref_bit(const uint8_t *bitmap, uint32_t n) {
+    return (bitmap[n / 8] >> (n % 8)) & 1;
+}
+
+static void fill_pattern(uint8_t *bitmap, size_t size, uint32_t seed) {
+    for(size_t i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        bitmap[i] = seed >> 16;
+    }
+}
+
+ void bitmap_count_ranges(void **state) {
+    (void) state;
+    uint8_t bitmap[64];
+    fill_pattern(bitmap, sizeof(bitmap), 1);
+    for(uint32_t start = 0; start < 200; ++start) {
+        for(uint32_t length = 0; start + length <= 8 * sizeof(bitmap); length += 7) {
+            uint32_t expected = 0;
+            for(uint32_t n = start; n < start + length; ++n)
+                expected += ref_bit(bitmap, n);
+            assert_int_equal(bitmap_count(bitmap, start, length), expected);
+        }
+    }
+}
+
+ void bitmap_set_clear_ranges(void **state) {
+    (void) state;
+    uint8_t bitmap[64], orig[64];
+    fill_pattern(orig, sizeof(orig), 2);
+    for(uint32_t start = 0; start < 100; start += 3) {
+        for(uint32_t length = 0; start + length <= 8 * sizeof(bitmap); length += 11) {
+            for(int value = 0; value < 2; ++value) {
+                memcpy(bitmap, orig, sizeof(bitmap));
+                if(value)
+                    bitmap_set(bitmap, start, length);
+                else
+                    bitmap_clear(bitmap, start, length);
+                for(uint32_t n = 0; n < 8 * sizeof(bitmap); ++n) {
+                    if(n >= start && n < start + length)
+                        assert_int_equal(ref_bit(bitmap, n), value);
+                    else
+                        assert_int_equal(ref_bit(bitmap, n), ref_bit(orig, n));
+                }
+            }
+        }
+    }
+}
+
+ void bitmap_find_ranges(void **state) {
+    (void) state;
+    uint8_t bitmap[64];
+    memset(bitmap, 0xFF, sizeof(bitmap));
+    bitmap[40] = 0xEF; // bit 324 cleared
+    for(uint32_t start = 0; start < 400; ++start) {
+        uint32_t expected = start <= 324 ? 324 : 400;
+        assert_int_equal(bitmap_find(bitmap, start, 400, 0), expected);
+        assert_int_equal(bitmap_find(bitmap, start, 324, 0), 324);
+    }
+    assert_int_equal(bitmap_find(bitmap, 324, 512, 1), 325);
+    memset(bitmap, 0, sizeof(bitmap));
+    assert_int_equal(bitmap_find(bitmap, 3, 509, 1), 509);
+}
+
+ void bitmap_count_diff_1(void **state) {
+    (void) state;
+    uint8_t a[64], b[64];
+    fill_pattern(a, sizeof(a), 3);
+    memcpy(b, a, sizeof(b));
+    assert_int_equal(bitmap_count_diff(a, b, 8 * sizeof(a)), 0);
+    b[0] ^= 0x01;
+    b[17] ^= 0x81;
+    b[63] ^= 0x80;
+    assert_int_equal(bitmap_count_diff(a, b, 8 * sizeof(a)), 4);
+    assert_int_equal(bitmap_count_diff(a, b, 8 * sizeof(a) - 1), 3);
+    assert_int_equal(bitmap_count_diff(a, b, 137), 2);
+}
+
+#define PAGE_TEST_BITS (3 * BITMAP_PAGE_BITS + 1000)
+
+// Same operations on paged and plain bitmap give the same bits
+ void page_bitmap_ranges(void **state) {
+    (void) state;
+    static uint8_t plain[(PAGE_TEST_BITS + 7) / 8], out[(PAGE_TEST_BITS + 7) / 8];
+    struct page_bitmap pb;
+    uint32_t seed = 4;
+
+    assert_int_equal(page_bitmap_init(&pb, PAGE_TEST_BITS), 0);
+    memset(plain, 0xFF, sizeof(plain));
+    for(int i = 0; i < 2000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t start = (seed >> 8) % PAGE_TEST_BITS;
+        seed = seed * 1103515245 + 12345;
+        uint32_t length = (seed >> 8) % (i % 10 ? 500 : 2 * BITMAP_PAGE_BITS);
+        if(length > PAGE_TEST_BITS - start)
+            length = PAGE_TEST_BITS - start;
+        if(i % 3) {
+            bitmap_clear(plain, start, length);
+            assert_int_equal(page_bitmap_clear(&pb, start, length), 0);
+        } else {
+            bitmap_set(plain, start, length);
+            assert_int_equal(page_bitmap_set(&pb, start, length), 0);
+        }
+        assert_int_equal(page_bitmap_count(&pb, start / 2, PAGE_TEST_BITS - start / 2),
+                         bitmap_count(plain, start / 2, PAGE_TEST_BITS - start / 2));
+        assert_int_equal(page_bitmap_find(&pb, start / 2, PAGE_TEST_BITS, i % 2),
+                         bitmap_find(plain, start / 2, PAGE_TEST_BITS, i % 2));
+    }
+    page_bitmap_read(&pb, out, 0, PAGE_TEST_BITS);
+    assert_memory_equal(out, plain, sizeof(plain));
+    assert_int_equal(page_bitmap_count_diff(&pb, plain, 0, PAGE_TEST_BITS), 0);
+
+    // Pages with all bits equal are released
+    assert_int_equal(page_bitmap_clear(&pb, 0, PAGE_TEST_BITS), 0);
+    assert_int_equal(pb.memory, 0);
+    assert_int_equal(page_bitmap_write(&pb, plain, PAGE_TEST_BITS), 0);
+    assert_int_equal(page_bitmap_count_diff(&pb, plain, 0, PAGE_TEST_BITS), 0);
+    page_bitmap_free(&pb);
+}
+
+static int page_test_apply(void *arg, uint32_t start, uint32_t length, uint8_t value) {
+    return value ? page_bitmap_set(arg, start, length) : page_bitmap_clear(arg, start, length);
+}
+
+// Window of paged bitmap under memory limit is rebuilt from recorded changes
+ void page_bitmap_windows(void **state) {
+    (void) state;
+    static uint8_t plain[(PAGE_TEST_BITS + 7) / 8], out[(PAGE_TEST_BITS + 7) / 8];
+    struct page_bitmap pb;
+
+    assert_int_equal(page_bitmap_init(&pb, PAGE_TEST_BITS), 0);
+    assert_int_equal(page_bitmap_limit(&pb, BITMAP_PAGE_BYTES), 0);
+    assert_int_equal(pb.windowBits, BITMAP_PAGE_BITS);
+    memset(plain, 0xFF, sizeof(plain));
+    for(uint32_t start = 100; start + 3000 < PAGE_TEST_BITS; start += 7919) {
+        uint32_t lbn = start, length;
+        bitmap_clear(plain, start, 3000);
+        assert_int_equal(page_bitmap_record(&pb, start, 3000, 0), 0);
+        length = page_bitmap_clip(&pb, &lbn, 3000);
+        if(length > 0)
+            assert_int_equal(page_bitmap_clear(&pb, lbn, length), 0);
+    }
+    for(uint32_t start = 0; start < PAGE_TEST_BITS; start += pb.windowBits) {
+        if(start != pb.windowStart) {
+            page_bitmap_window(&pb, start);
+            assert_int_equal(page_bitmap_replay(&pb, page_test_apply, &pb), 0);
+        }
+        page_bitmap_read(&pb, out + start / 8, start, pb.windowEnd - start);
+    }
+    assert_memory_equal(out, plain, sizeof(plain));
+    page_bitmap_free(&pb);
+}
+
+ void journal_find_file_1(void **state) {
+    (void) state;
+    struct journal_file files[] = {
+        { 16, 300, 0, 1, JOURNAL_FILE_COUNTED, 0 },
+        { 17, 301, 1, 2, JOURNAL_FILE_COUNTED, 0 },
+        { 17, 400, 3, 1, JOURNAL_FILE_COUNTED, 0 },
+        { 40, 290, 4, 1, 0, 0 },
+    };
+    struct check_journal journal;
+    memset(&journal, 0, sizeof(journal));
+    journal.files = files;
+    journal.hdr.numFiles = 4;
+
+    assert_null(journal_find_file(&journal, 17, 301));  // not loaded
+    journal.loaded = 1;
+    assert_ptr_equal(journal_find_file(&journal, 16, 300), &files[0]);
+    assert_ptr_equal(journal_find_file(&journal, 17, 301), &files[1]);
+    assert_ptr_equal(journal_find_file(&journal, 17, 400), &files[2]);
+    assert_ptr_equal(journal_find_file(&journal, 40, 290), &files[3]);
+    assert_null(journal_find_file(&journal, 17, 302));  // moved ICB
+    assert_null(journal_find_file(&journal, 18, 301));
+    assert_null(journal_find_file(&journal, 41, 290));
+    assert_null(journal_find_file(&journal, 0, 300));   // no Unique ID in FID
+}
+
+ void journal_record_file_1(void **state) {
+    (void) state;
+    struct check_journal journal;
+    memset(&journal, 0, sizeof(journal));
+
+    journal_begin_file(&journal, 20, 500);
+    journal_add_extent(&journal, 480, 1);
+    journal_add_extent(&journal, 600, 0);
+    journal_add_extent(&journal, 600, 10);
+    journal_set_flags(&journal, JOURNAL_FILE_COUNTED);
+    journal_end_file(&journal, 1);
+    journal_add_extent(&journal, 700, 5);   // not recording, e.g. directory
+
+    journal_begin_file(&journal, 21, 501);
+    journal_add_extent(&journal, 481, 1);
+    journal_end_file(&journal, 0);          // failed verification is dropped
+
+    assert_int_equal(journal.numNewFiles, 1);
+    assert_int_equal(journal.numNewExtents, 2);
+    assert_int_equal(journal.newFiles[0].uniqueID, 20);
+    assert_int_equal(journal.newFiles[0].numExtents, 2);
+    assert_int_equal(journal.newFiles[0].flags, JOURNAL_FILE_COUNTED);
+    assert_int_equal(journal.newExtents[1].lbn, 600);
+    assert_int_equal(journal.newExtents[1].blocks, 10);
+    journal_free(&journal);
+}
+
+ void scan_find_1(void **state) {
+    (void) state;
+    struct scan_icb icbs[] = {
+        { .lbn = 2,   .tagIdent = TAG_IDENT_FE },
+        { .lbn = 3,   .tagIdent = TAG_IDENT_AED },
+        { .lbn = 90,  .tagIdent = TAG_IDENT_EFE },
+        { .lbn = 511, .tagIdent = TAG_IDENT_FE },
+    };
+    struct scan_graph graph;
+    memset(&graph, 0, sizeof(graph));
+
+    assert_null(scan_find(&graph, 2));     // empty graph
+    graph.icbs = icbs;
+    graph.count = 4;
+    assert_ptr_equal(scan_find(&graph, 2), &icbs[0]);
+    assert_ptr_equal(scan_find(&graph, 3), &icbs[1]);
+    assert_ptr_equal(scan_find(&graph, 90), &icbs[2]);
+    assert_ptr_equal(scan_find(&graph, 511), &icbs[3]);
+    assert_null(scan_find(&graph, 0));
+    assert_null(scan_find(&graph, 4));
+    assert_null(scan_find(&graph, 512));
+}
+
+ static uint32_t put_fid(uint8_t *buf, uint8_t lengthFileIdent, uint32_t location) {
+    struct fileIdentDesc *fid = (struct fileIdentDesc *)buf;
+    uint32_t flen = 4 * ((sizeof(struct fileIdentDesc) + lengthFileIdent + 3) / 4);
+
+    memset(buf, 0, flen);
+    fid->descTag.tagIdent = cpu_to_le16(TAG_IDENT_FID);
+    fid->descTag.descVersion = cpu_to_le16(3);
+    fid->descTag.tagSerialNum = cpu_to_le16(0xFEFE);   // high bytes exercise the checksum lanes
+    fid->descTag.tagLocation = cpu_to_le32(location);
+    fid->descTag.descCRCLength = cpu_to_le16(flen - sizeof(tag));
+    fid->lengthFileIdent = lengthFileIdent;
+    for(uint8_t i = 0; i < lengthFileIdent; i++)
+        fid->impUseAndFileIdent[i] = (uint8_t)(0xF0 + i);
+    fid->descTag.descCRC = cpu_to_le16(calculate_crc(fid, flen));
+    fid->descTag.tagChecksum = calculate_checksum(fid->descTag);
+    return flen;
+}
+
+ void fid_validate_1(void **state) {
+    (void) state;
+    uint8_t buf[512];
+    uint32_t first = put_fid(buf, 0, 0xFFFFFFF0);
+    uint32_t second = put_fid(buf + first, 13, 0xFFFFFFF1);
+    uint32_t total = first + second + put_fid(buf + first + second, 55, 0x80808080);
+
+    assert_int_equal(validate_fids(buf, total, total), 3);
+    assert_int_equal(validate_fids(buf, first, total), 1);      // only FIDs starting in length
+    assert_int_equal(validate_fids(buf, total, total - 1), 2);  // last FID does not fit
+    buf[first + sizeof(struct fileIdentDesc) + 3] ^= 0x10;      // CRC of second FID
+    assert_int_equal(validate_fids(buf, total, total), 1);
+    buf[first + sizeof(struct fileIdentDesc) + 3] ^= 0x10;
+    buf[first + 4]++;                                           // tag checksum of second FID
+    assert_int_equal(validate_fids(buf, total, total), 1);
+    buf[first + 4]--;
+    buf[first + second] ^= 0x01;                                // third is not a FID
+    assert_int_equal(validate_fids(buf, total, total), 2);
+    assert_int_equal(validate_fids(buf, 0, total), 0);
+}
+
+ void medium_read_1(void **state) {
+    (void) state;
+    char path[] = "/tmp/udffsck-medium-XXXXXX";
+    size_t size = 3 * UDF_MEDIUM_SEGMENT + 1000;
+    uint8_t *data = malloc(size), *buf = malloc(size);
+    struct udf_medium medium;
+    int fd = mkstemp(path);
+
+    assert_true(fd >= 0);
+    unlink(path);
+    for(size_t i = 0; i < size; i++)
+        data[i] = (uint8_t)(i * 7 + i / 251);
+    assert_int_equal(write(fd, data, size), size);
+
+    for(int io = UDF_MEDIUM_IO_PREAD; io <= UDF_MEDIUM_IO_URING; io++) {
+        udf_medium_init(&medium, fd, io, 2);
+        memset(buf, 0, size);
+        assert_int_equal(udf_medium_read(&medium, buf, size - 10, 10, -1), size - 10);
+        assert_memory_equal(buf, data + 10, size - 10);
+        // Read is cut at end of medium
+        assert_int_equal(udf_medium_read(&medium, buf, 4096, size - 100, -1), 100);
+        assert_memory_equal(buf, data + size - 100, 100);
+        udf_medium_free(&medium);
+    }
+
+    close(fd);
+    free(data);
+    free(buf);
+}
+
+ void repair_commit_1(void **state) {
+    (void) state;
+    char path[] = "/tmp/udffsck-repair-XXXXXX";
+    const uint32_t bs = 2048;
+    uint8_t *data = calloc(8, bs);
+    udf_media_t media;
+    struct repair_txn txn;
+    int fd = mkstemp(path);
+
+    assert_true(fd >= 0);
+    unlink(path);
+    for(uint32_t i = 0; i < 8; i++) {
+        tag *t = (tag *)(data + i * bs);
+        t->tagIdent = cpu_to_le16(TAG_IDENT_PVD);
+        t->descCRCLength = cpu_to_le16(512 - sizeof(tag));
+        memset(data + i * bs + sizeof(tag), (int)i, 512 - sizeof(tag));
+    }
+    assert_int_equal(write(fd, data, 8 * bs), 8 * bs);
+
+    memset(&media, 0, sizeof(media));
+    media.fd = fd;
+    media.devsize = 8 * bs;
+    media.sectorsize = bs;
+    assert_int_equal(cache_init(&media, 65536, 65536), 0);
+    assert_null(repair_stage(&media, 0, bs));   // no transaction
+    repair_begin(&media, &txn);
+    assert_null(repair_stage(&media, 7 * bs, bs + 1));  // out of medium
+
+    uint8_t *d3 = repair_stage(&media, 3 * bs, 512);
+    uint8_t *d2 = repair_stage(&media, 2 * bs, bs);
+    uint8_t *d6 = repair_stage(&media, 6 * bs, 512);
+    assert_non_null(d3);
+    assert_non_null(d2);
+    assert_non_null(d6);
+    assert_ptr_equal(repair_stage(&media, 2 * bs, bs), d2);   // the same copy
+    d2[100] = 0xA2;
+    d3[100] = 0xA3;
+
+    uint8_t buf[512];
+    assert_int_equal(repair_read(&media, 3 * bs, buf, sizeof(buf)), 0);
+    assert_int_equal(buf[100], 0xA3);
+    memcpy(repair_stage(&media, 5 * bs, 512), buf, sizeof(buf));
+
+    assert_int_equal(repair_commit(&media), 0);
+    assert_int_equal(txn.runs, 3);                              // blocks 2-3, 5 and 6
+    assert_int_equal(txn.bytes, bs + 3 * 512);
+    assert_int_equal(txn.count, 0);
+
+    assert_int_equal(pread(fd, data, 8 * bs, 0), 8 * bs);
+    for(uint32_t i = 2; i < 7; i++) {
+        tag *t = (tag *)(data + i * bs);
+        if(i == 4)
+            continue;
+        assert_int_equal(t->tagChecksum, calculate_checksum(*t));
+        assert_int_equal(le16_to_cpu(t->descCRC), calculate_crc(t, 512));
+    }
+    assert_int_equal(data[2 * bs + 100], 0xA2);
+    assert_int_equal(data[3 * bs + 100], 0xA3);
+    assert_int_equal(data[5 * bs + 100], 0xA3);
+    assert_int_equal(data[4 * bs + 100], 4);                    // not staged
+
+    repair_free(&media);
+    assert_null(media.repair);
+    cache_free(&media);
+    close(fd);
+    free(data);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(dstring_check_u8_ok_1),
@@ -587,6 +957,18 @@ int main(void) {
         cmocka_unit_test(dstring_check_u16_dchars_3),
         cmocka_unit_test(dstring_check_u16_dchars_4),
         cmocka_unit_test(dstring_check_u16_dchars_5),
+        cmocka_unit_test(bitmap_count_ranges),
+        cmocka_unit_test(bitmap_set_clear_ranges),
+        cmocka_unit_test(bitmap_find_ranges),
+        cmocka_unit_test(bitmap_count_diff_1),
+        cmocka_unit_test(page_bitmap_ranges),
+        cmocka_unit_test(page_bitmap_windows),
+        cmocka_unit_test(journal_find_file_1),
+        cmocka_unit_test(journal_record_file_1),
+        cmocka_unit_test(scan_find_1),
+        cmocka_unit_test(fid_validate_1),
+        cmocka_unit_test(medium_read_1),
+        cmocka_unit_test(repair_commit_1),
     };
 
 
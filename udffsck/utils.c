@@ -35,8 +35,8 @@
 void read_tag(tag id) {
     note("\tIdentification Tag\n"
            "\t==================\n");
-    note("\tID: %u (", id.tagIdent);
-    switch(id.tagIdent) {
+    note("\tID: %u (", udf_tag_ident(&id));
+    switch(udf_tag_ident(&id)) {
         case TAG_IDENT_PVD:
             note("PVD");
             break;
@@ -66,11 +66,11 @@ void read_tag(tag id) {
             break;
     }
     note(")\n");
-    note("\tVersion: %u\n", id.descVersion);
+    note("\tVersion: %u\n", udf_tag_version(&id));
     note("\tChecksum: 0x%x\n", id.tagChecksum);
-    note("\tSerial Number: 0x%x\n", id.tagSerialNum);
-    note("\tDescriptor CRC: 0x%x, Length: %u\n", id.descCRC, id.descCRCLength);
-    note("\tTag Location: 0x%x\n", id.tagLocation);
+    note("\tSerial Number: 0x%x\n", udf_tag_serial(&id));
+    note("\tDescriptor CRC: 0x%x, Length: %u\n", udf_tag_crc(&id), udf_tag_crc_length(&id));
+    note("\tTag Location: 0x%x\n", udf_tag_location(&id));
 }
 
 /**
@@ -125,7 +125,7 @@ int print_disc(struct udf_disc *disc) {
         note("[%d]\n", i);
         if(disc->udf_usd[i] != 0) {
             read_tag(disc->udf_usd[i]->descTag);
-            note("\tNumOfAllocDescs: %u\n", disc->udf_usd[i]->numAllocDescs);
+            note("\tNumOfAllocDescs: %u\n", le32_to_cpu(disc->udf_usd[i]->numAllocDescs));
         }
     }
 
@@ -206,7 +206,8 @@ void print_hex_array(void *ptr, size_t size) {
     uint32_t amount = 50000;
      
     for(int i=0+shift, k=0+shift; i<size && i < amount+shift; ) {
-        note("[%04u] ",line++);
+        note("[%04u] ", line);
+        line++;
         for(int j=0; j<16; j++, i++) {
             note("%02x ", ((unsigned char *)(ptr))[i]);
         }
@@ -0,0 +1,787 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * \file
+ * Parallel file tree walk
+ *
+ * Every directory found by get_file() becomes a task holding a copy of its
+ * allocation descriptors. Tasks are pushed to the deque of the thread which
+ * found them; the owner pops from the bottom (depth first), idle threads steal
+ * from the top.
+ *
+ * Whatever depends on the order of the traversal is not applied by workers
+ * directly. Log output, bitmap marking (and its conflict warnings) and LVID
+ * timestamp errors are recorded as events of the running task, and a "child"
+ * event is recorded where a subdirectory would have been walked. The main
+ * thread replays the events depth first as tasks complete, so the output is
+ * the same as in a single threaded run. Counters which do not depend on the
+ * order are kept in a per-thread copy of struct filesystemStats and reduced
+ * at the end.
+ *
+ * Without worker threads the same engine is used as an iterative walk: tasks
+ * are not queued, the replay runs each child task when it reaches its child
+ * event. The call stack depth does not depend on the depth of the tree then;
+ * the directories being walked are frames of the replay stack.
+ *
+ * Serial walk saves the replay stack to checkpoint from time to time (see
+ * checkpoint.c). Every frame is saved with the events not replayed yet, a
+ * child event with the directory of its task, which was not inspected yet.
+ * Resumed walk rebuilds the stack and continues the replay.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "walk.h"
+#include "log.h"
+#include "options.h"
+#include "checkpoint.h"
+
+typedef enum {
+    WALK_EV_TEXT = 0,
+    WALK_EV_CHILD,
+    WALK_EV_MARK,
+    WALK_EV_TIMESTAMP,
+} walk_event_e;
+
+struct walk_task;
+
+struct walk_event {
+    walk_event_e type;
+    union {
+        struct {
+            FILE *stream;
+            char *buf;
+            size_t length;
+            size_t size;
+        } text;
+        struct walk_task *child;
+        struct {
+            uint32_t lbn;
+            uint32_t size;
+            uint8_t mark;
+        } mark;
+        struct {
+            char *filename;
+            double cts;
+        } timestamp;
+    } u;
+};
+
+struct walk_task {
+    struct walk_dir dir;
+    struct walk_event *events;
+    size_t nevents;
+    size_t maxevents;
+    uint8_t status;
+    int done;
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_task **tasks;
+    size_t head;    ///< oldest task, stolen by other threads
+    size_t tail;    ///< one past the newest task, popped by the owner
+    size_t size;
+};
+
+struct walk;
+
+struct walk_ctx {
+    struct walk *walk;
+    int id;
+    pthread_t thread;
+    struct walk_deque deque;
+    struct walk_task *task;         ///< task currently executed by this thread
+    struct filesystemStats stats;   ///< per-thread accumulators
+};
+
+struct walk {
+    udf_media_t *media;
+    struct filesystemStats *stats;
+    vds_sequence_t *seq;
+    int nctx;                       ///< main thread context + workers
+    struct walk_ctx *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t work;            ///< new task queued or walk finished
+    pthread_cond_t done;            ///< some task finished
+    size_t pending;                 ///< tasks queued or running
+    int idle;
+    int serial;                     ///< no workers, tasks are run by walk_replay()
+    struct checkpoint *cp;          ///< checkpoints of serial walk, NULL without them
+    uint8_t status;
+};
+
+/**
+ * \brief Task being replayed and its next event
+ */
+struct walk_frame {
+    struct walk_task *task;
+    size_t next;
+};
+
+static struct walk_event *walk_new_event(struct walk_task *task, walk_event_e type) {
+    if (task->nevents == task->maxevents) {
+        size_t maxevents = task->maxevents ? 2 * task->maxevents : 16;
+        struct walk_event *events = realloc(task->events, maxevents * sizeof(struct walk_event));
+        if (!events) {
+            fatal("Walk event allocation failed.\n");
+            exit(ESTATUS_OPERATIONAL_ERROR);
+        }
+        task->events = events;
+        task->maxevents = maxevents;
+    }
+    struct walk_event *ev = &task->events[task->nevents++];
+    memset(ev, 0, sizeof(struct walk_event));
+    ev->type = type;
+    return ev;
+}
+
+/**
+ * \brief Log sink of worker threads, appends text to the running task
+ */
+static void walk_log(void *arg, FILE *stream, const char *text, size_t length) {
+    struct walk_ctx *ctx = arg;
+    struct walk_task *task = ctx->task;
+    struct walk_event *ev = NULL;
+
+    if (task->nevents > 0) {
+        ev = &task->events[task->nevents - 1];
+        if (ev->type != WALK_EV_TEXT || ev->u.text.stream != stream)
+            ev = NULL;
+    }
+    if (ev == NULL) {
+        ev = walk_new_event(task, WALK_EV_TEXT);
+        ev->u.text.stream = stream;
+    }
+
+    if (ev->u.text.length + length > ev->u.text.size) {
+        size_t size = ev->u.text.size ? ev->u.text.size : 256;
+        while (size < ev->u.text.length + length)
+            size *= 2;
+        char *buf = realloc(ev->u.text.buf, size);
+        if (!buf) {
+            log_sink(NULL, NULL);
+            fatal("Walk log allocation failed.\n");
+            exit(ESTATUS_OPERATIONAL_ERROR);
+        }
+        ev->u.text.buf = buf;
+        ev->u.text.size = size;
+    }
+    memcpy(ev->u.text.buf + ev->u.text.length, text, length);
+    ev->u.text.length += length;
+}
+
+static void walk_push(struct walk_deque *dq, struct walk_task *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->size) {
+        if (dq->head > 0) {
+            memmove(dq->tasks, dq->tasks + dq->head, (dq->tail - dq->head) * sizeof(struct walk_task *));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            size_t size = dq->size ? 2 * dq->size : 64;
+            struct walk_task **tasks = realloc(dq->tasks, size * sizeof(struct walk_task *));
+            if (!tasks) {
+                pthread_mutex_unlock(&dq->lock);
+                fatal("Walk queue allocation failed.\n");
+                exit(ESTATUS_OPERATIONAL_ERROR);
+            }
+            dq->tasks = tasks;
+            dq->size = size;
+        }
+    }
+    dq->tasks[dq->tail++] = task;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static struct walk_task *walk_pop(struct walk_deque *dq, int steal) {
+    struct walk_task *task = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        if (steal)
+            task = dq->tasks[dq->head++];
+        else
+            task = dq->tasks[--dq->tail];
+        if (dq->head == dq->tail)
+            dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+static int walk_queued(struct walk *walk) {
+    int queued = 0;
+
+    for (int i = 0; i < walk->nctx && !queued; i++) {
+        struct walk_deque *dq = &walk->ctx[i].deque;
+        pthread_mutex_lock(&dq->lock);
+        queued = dq->head < dq->tail;
+        pthread_mutex_unlock(&dq->lock);
+    }
+    return queued;
+}
+
+/**
+ * \brief Get next task for a worker, own deque first, then steal
+ *
+ * \return NULL when no task is queued or running anymore
+ */
+static struct walk_task *walk_take(struct walk_ctx *ctx) {
+    struct walk *walk = ctx->walk;
+    struct walk_task *task;
+
+    for (;;) {
+        task = walk_pop(&ctx->deque, 0);
+        for (int i = 1; task == NULL && i < walk->nctx; i++)
+            task = walk_pop(&walk->ctx[(ctx->id + i) % walk->nctx].deque, 1);
+        if (task)
+            return task;
+
+        pthread_mutex_lock(&walk->lock);
+        if (walk->pending == 0) {
+            pthread_mutex_unlock(&walk->lock);
+            return NULL;
+        }
+        if (!walk_queued(walk)) {
+            walk->idle++;
+            pthread_cond_wait(&walk->work, &walk->lock);
+            walk->idle--;
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+static void walk_finish(struct walk *walk, struct walk_task *task, uint8_t status) {
+    pthread_mutex_lock(&walk->lock);
+    task->status = status;
+    task->done = 1;
+    if (--walk->pending == 0)
+        pthread_cond_broadcast(&walk->work);
+    pthread_cond_signal(&walk->done);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static uint8_t walk_inspect(struct walk_ctx *ctx, struct walk_task *task) {
+    struct walk *walk = ctx->walk;
+    uint8_t status;
+
+    ctx->task = task;
+    status = inspect_directory(walk->media, &task->dir, &ctx->stats, walk->seq);
+    ctx->task = NULL;
+    return status;
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_ctx *ctx = arg;
+    struct walk *walk = ctx->walk;
+    struct walk_task *task;
+
+    log_sink(walk_log, ctx);
+    while ((task = walk_take(ctx)) != NULL)
+        walk_finish(walk, task, walk_inspect(ctx, task));
+    log_sink(NULL, NULL);
+    return NULL;
+}
+
+static void walk_free_task(struct walk_task *task) {
+    for (size_t i = 0; i < task->nevents; i++) {
+        if (task->events[i].type == WALK_EV_TEXT)
+            free(task->events[i].u.text.buf);
+        else if (task->events[i].type == WALK_EV_TIMESTAMP)
+            free(task->events[i].u.timestamp.filename);
+    }
+    free(task->events);
+    free(task->dir.allocDescs);
+    free(task);
+}
+
+/**
+ * \brief Write event not replayed yet to checkpoint
+ *
+ * \return 0 on success, -1 on error
+ */
+static int walk_save_event(FILE *fp, const struct walk_event *ev) {
+    struct checkpoint_event ce;
+    const void *data = NULL;
+
+    memset(&ce, 0, sizeof(struct checkpoint_event));
+    ce.type = ev->type;
+    switch (ev->type) {
+        case WALK_EV_TEXT:
+            ce.arg = ev->u.text.stream == stderr;
+            ce.length = ev->u.text.length;
+            data = ev->u.text.buf;
+            break;
+        case WALK_EV_CHILD:
+            ce.lbn = ev->u.child->dir.lsn;
+            ce.size = ev->u.child->dir.depth;
+            ce.icb_ad = ev->u.child->dir.icb_ad;
+            ce.length = ev->u.child->dir.lengthAllocDescs;
+            data = ev->u.child->dir.allocDescs;
+            break;
+        case WALK_EV_MARK:
+            ce.lbn = ev->u.mark.lbn;
+            ce.size = ev->u.mark.size;
+            ce.arg = ev->u.mark.mark;
+            break;
+        case WALK_EV_TIMESTAMP:
+            if (ev->u.timestamp.filename) {
+                ce.arg = 1;
+                ce.length = strlen(ev->u.timestamp.filename);
+                data = ev->u.timestamp.filename;
+            }
+            ce.cts = ev->u.timestamp.cts;
+            break;
+    }
+    if (checkpoint_write(fp, &ce, sizeof(struct checkpoint_event)) != 0)
+        return -1;
+    return checkpoint_write(fp, data, ce.length);
+}
+
+/**
+ * \brief Append event read from checkpoint to task, child event gets a task not inspected yet
+ *
+ * \return 0 on success, -1 on error or allocation failure
+ */
+static int walk_load_event(FILE *fp, struct walk_task *task) {
+    struct checkpoint_event ce;
+    struct walk_task *child = NULL;
+    struct walk_event *ev;
+    uint8_t *data;
+
+    if (checkpoint_read(fp, &ce, sizeof(struct checkpoint_event)) != 0 || ce.type > WALK_EV_TIMESTAMP)
+        return -1;
+    data = malloc(ce.length + 1);
+    if (data == NULL)
+        return -1;
+    if (checkpoint_read(fp, data, ce.length) != 0) {
+        free(data);
+        return -1;
+    }
+    data[ce.length] = 0;
+    if (ce.type == WALK_EV_CHILD && (child = calloc(1, sizeof(struct walk_task))) == NULL) {
+        free(data);
+        return -1;
+    }
+
+    ev = walk_new_event(task, ce.type);
+    switch (ev->type) {
+        case WALK_EV_TEXT:
+            ev->u.text.stream = ce.arg ? stderr : stdout;
+            ev->u.text.buf = (char *)data;
+            ev->u.text.length = ce.length;
+            ev->u.text.size = ce.length + 1;
+            break;
+        case WALK_EV_CHILD:
+            child->dir.lsn = ce.lbn;
+            child->dir.depth = ce.size;
+            child->dir.icb_ad = ce.icb_ad;
+            child->dir.allocDescs = data;
+            child->dir.lengthAllocDescs = ce.length;
+            ev->u.child = child;
+            break;
+        case WALK_EV_MARK:
+            ev->u.mark.lbn = ce.lbn;
+            ev->u.mark.size = ce.size;
+            ev->u.mark.mark = ce.arg;
+            free(data);
+            break;
+        case WALK_EV_TIMESTAMP:
+            if (ce.arg) {
+                ev->u.timestamp.filename = (char *)data;
+            } else {
+                free(data);
+            }
+            ev->u.timestamp.cts = ce.cts;
+            break;
+    }
+    return 0;
+}
+
+/**
+ * \brief Save replay stack of serial walk to checkpoint
+ *
+ * Walk is ended when the check was interrupted, the saved checkpoint is
+ * continued by the next run with --resume.
+ */
+static void walk_checkpoint(struct walk *walk, const struct walk_frame *frames, size_t nframes) {
+    FILE *fp = checkpoint_create(walk->cp, walk->stats, &walk->ctx[0].stats.found,
+                                 walk->seq, walk->status, nframes);
+    int saved = 0;
+
+    if (fp != NULL) {
+        int error = 0;
+        for (size_t i = 0; i < nframes && !error; i++) {
+            const struct walk_task *task = frames[i].task;
+            struct checkpoint_frame cf;
+
+            memset(&cf, 0, sizeof(struct checkpoint_frame));
+            cf.status = task->status;
+            cf.numEvents = task->nevents - frames[i].next;
+            error |= checkpoint_write(fp, &cf, sizeof(struct checkpoint_frame));
+            for (size_t j = frames[i].next; j < task->nevents && !error; j++)
+                error |= walk_save_event(fp, &task->events[j]);
+        }
+        saved = checkpoint_commit(walk->cp, fp, walk->stats, error) == 0;
+    }
+
+    if (checkpoint_interrupted) {
+        if (saved)
+            warn("Checkpoint saved to %s, run check again with --resume to continue.\n", walk->cp->path);
+        warn("User interrupted operation. Exiting.\n");
+        exit(ESTATUS_USER_CANCEL);
+    }
+}
+
+/**
+ * \brief Rebuild replay stack saved to loaded checkpoint
+ *
+ * Tasks of frames are already inspected, their child events get tasks
+ * which are inspected when replay reaches them. Counters and partition
+ * bitmap are restored at the end.
+ *
+ * \param[in,out] *walk     serial walk with loaded checkpoint
+ * \param[out]    **frames  replay stack, root task at the bottom
+ * \param[out]    *nframes  frames on the stack
+ *
+ * \return 0 on success, -1 when checkpoint is damaged or allocation failed
+ */
+static int walk_resume(struct walk *walk, struct walk_frame **frames, size_t *nframes) {
+    struct checkpoint *cp = walk->cp;
+    uint32_t numFrames = cp->hdr.numFrames;
+
+    *nframes = 0;
+    *frames = calloc(numFrames, sizeof(struct walk_frame));
+    if (*frames == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < numFrames; i++) {
+        struct checkpoint_frame cf;
+        struct walk_task *task;
+
+        if (checkpoint_read(cp->fp, &cf, sizeof(struct checkpoint_frame)) != 0
+            || (task = calloc(1, sizeof(struct walk_task))) == NULL)
+            return -1;
+        task->status = cf.status;
+        task->done = 1;
+        (*frames)[i].task = task;
+        (*nframes)++;
+        for (uint32_t j = 0; j < cf.numEvents; j++) {
+            if (walk_load_event(cp->fp, task) != 0)
+                return -1;
+        }
+    }
+
+    if (checkpoint_restore(cp, walk->stats, &walk->ctx[0].stats.found, walk->seq) != 0)
+        return -1;
+    walk->status = cp->hdr.walkStatus;
+    return 0;
+}
+
+/**
+ * \brief Replay events of finished task and its children in walk order
+ *
+ * Children are replayed from an explicit stack, replayed tasks except
+ * \p root are freed. In serial walk a child task is run when it is reached.
+ * Stack rebuilt from checkpoint is passed in \p frames with \p root at its
+ * bottom, the stack is freed.
+ */
+static void walk_replay(struct walk *walk, struct walk_task *root,
+                        struct walk_frame *frames, size_t nframes) {
+    size_t maxframes = nframes;
+    struct walk_task *task = nframes ? NULL : root;
+
+    for (;;) {
+        if (task != NULL) {
+            if (nframes == maxframes) {
+                size_t size = maxframes ? 2 * maxframes : 64;
+                struct walk_frame *tmp = realloc(frames, size * sizeof(struct walk_frame));
+                if (!tmp) {
+                    fatal("Walk stack allocation failed.\n");
+                    exit(ESTATUS_OPERATIONAL_ERROR);
+                }
+                frames = tmp;
+                maxframes = size;
+            }
+            frames[nframes].task = task;
+            frames[nframes].next = 0;
+            nframes++;
+        }
+
+        task = NULL;
+        while (task == NULL && nframes > 0) {
+            if (walk->cp && checkpoint_due(walk->cp))
+                walk_checkpoint(walk, frames, nframes);
+
+            struct walk_frame *frame = &frames[nframes - 1];
+            if (frame->next == frame->task->nevents) {
+                walk->status |= frame->task->status;
+                if (frame->task != root)
+                    walk_free_task(frame->task);
+                nframes--;
+                continue;
+            }
+
+            struct walk_event *ev = &frame->task->events[frame->next++];
+            switch (ev->type) {
+                case WALK_EV_TEXT:
+                    if (ev->u.text.stream == stderr)
+                        fflush(stdout);
+                    fwrite(ev->u.text.buf, 1, ev->u.text.length, ev->u.text.stream);
+                    if (ev->u.text.stream == stderr)
+                        fflush(stderr);
+                    free(ev->u.text.buf);
+                    ev->u.text.buf = NULL;
+                    break;
+                case WALK_EV_MARK:
+                    markUsedBlock(walk->stats, ev->u.mark.lbn, ev->u.mark.size, ev->u.mark.mark);
+                    break;
+                case WALK_EV_TIMESTAMP:
+                    report_lvid_timestamp(walk->stats, walk->seq, ev->u.timestamp.filename, ev->u.timestamp.cts);
+                    break;
+                case WALK_EV_CHILD:
+                    task = ev->u.child;
+                    if (walk->serial) {
+                        if (!task->done) {
+                            log_sink(walk_log, &walk->ctx[0]);
+                            task->status = walk_inspect(&walk->ctx[0], task);
+                            log_sink(NULL, NULL);
+                            task->done = 1;
+                        }
+                        break;
+                    }
+                    pthread_mutex_lock(&walk->lock);
+                    while (!task->done)
+                        pthread_cond_wait(&walk->done, &walk->lock);
+                    pthread_mutex_unlock(&walk->lock);
+                    break;
+            }
+        }
+        if (task == NULL)
+            break;
+    }
+    free(frames);
+}
+
+/**
+ * \brief Queue directory contents for inspection by any worker
+ *
+ * \param[in] *ctx              walk context of calling thread
+ * \param[in] lsn               LSN of the directory FE/EFE
+ * \param[in] *allocDescs       ADs of the directory (or FIDs for in-ICB directory), copied
+ * \param[in] lengthAllocDescs  length of allocDescs in bytes
+ * \param[in] icb_ad            AD type
+ * \param[in] depth             depth of the directory FE
+ *
+ * \return 0 -- directory was queued
+ * \return -1 -- allocation failed, caller has to inspect directory itself
+ */
+int walk_defer_directory(struct walk_ctx *ctx, uint32_t lsn, const uint8_t *allocDescs,
+                         uint32_t lengthAllocDescs, uint16_t icb_ad, uint32_t depth) {
+    struct walk *walk = ctx->walk;
+    struct walk_task *task = calloc(1, sizeof(struct walk_task));
+
+    if (task == NULL)
+        return -1;
+    task->dir.allocDescs = malloc(lengthAllocDescs ? lengthAllocDescs : 1);
+    if (task->dir.allocDescs == NULL) {
+        free(task);
+        return -1;
+    }
+    memcpy(task->dir.allocDescs, allocDescs, lengthAllocDescs);
+    task->dir.lsn = lsn;
+    task->dir.lengthAllocDescs = lengthAllocDescs;
+    task->dir.icb_ad = icb_ad;
+    task->dir.depth = depth;
+
+    walk_new_event(ctx->task, WALK_EV_CHILD)->u.child = task;
+    if (walk->serial)
+        return 0;
+
+    pthread_mutex_lock(&walk->lock);
+    walk->pending++;
+    walk_push(&ctx->deque, task);
+    if (walk->idle)
+        pthread_cond_signal(&walk->work);
+    pthread_mutex_unlock(&walk->lock);
+    return 0;
+}
+
+/**
+ * \brief Record bitmap marking, applied by markUsedBlock() during replay
+ *
+ * \return 0 always, conflicts are reported on replay
+ */
+int walk_defer_mark(struct walk_ctx *ctx, uint32_t lbn, uint32_t size, uint8_t mark) {
+    struct walk_event *ev = walk_new_event(ctx->task, WALK_EV_MARK);
+
+    ev->u.mark.lbn = lbn;
+    ev->u.mark.size = size;
+    ev->u.mark.mark = mark;
+    return 0;
+}
+
+/**
+ * \brief Record LVID timestamp error, reported by report_lvid_timestamp() during replay
+ */
+void walk_defer_timestamp(struct walk_ctx *ctx, const char *filename, double cts) {
+    struct walk_event *ev = walk_new_event(ctx->task, WALK_EV_TIMESTAMP);
+
+    ev->u.timestamp.filename = filename ? strdup(filename) : NULL;
+    ev->u.timestamp.cts = cts;
+}
+
+/**
+ * \brief Parallel variant of get_file() for file tree root
+ *
+ * Root FE is inspected by calling thread, its subdirectories by \p jobs worker threads.
+ * With a single job the subdirectories are walked iteratively by calling thread.
+ * Only usable in check mode; no fixes are written from the workers.
+ * Serial walk with checkpoints continues loaded checkpoint of this file tree.
+ *
+ * \param[in]      media     Information regarding medium & access to it
+ * \param[in]      lsn       LSN of root FE/EFE
+ * \param[in,out]  *stats    file system status
+ * \param[in]      *seq      VDS sequence
+ * \param[in]      jobs      number of worker threads, 1 for serial walk
+ *
+ * \return the same status as get_file() would
+ */
+uint8_t walk_file_tree(udf_media_t *media, uint32_t lsn, struct filesystemStats *stats,
+                       vds_sequence_t *seq, int jobs) {
+    struct walk walk;
+    struct walk_task *root;
+    struct walk_frame *frames = NULL;
+    size_t nframes = 0;
+    struct fileInfo info;
+    int started = 0;
+
+    memset(&walk, 0, sizeof(struct walk));
+    walk.media = media;
+    walk.stats = stats;
+    walk.seq = seq;
+    walk.serial = jobs <= 1;
+    walk.cp = walk.serial ? stats->checkpoint : NULL;
+    walk.nctx = walk.serial ? 1 : jobs + 1;
+    walk.ctx = calloc(walk.nctx, sizeof(struct walk_ctx));
+    root = calloc(1, sizeof(struct walk_task));
+    if (walk.ctx == NULL || root == NULL) {
+        free(walk.ctx);
+        free(root);
+        warn("Parallel walk allocation failed, using single thread.\n");
+        memset(&info, 0, sizeof(struct fileInfo));
+        return get_file(media, lsn, stats, 0, 0, info, seq);
+    }
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.work, NULL);
+    pthread_cond_init(&walk.done, NULL);
+    // SIGINT only requests checkpoint, replay saves it and exits
+    checkpoint_armed = walk.cp != NULL;
+
+    for (int i = 0; i < walk.nctx; i++) {
+        struct walk_ctx *ctx = &walk.ctx[i];
+        ctx->walk = &walk;
+        ctx->id = i;
+        pthread_mutex_init(&ctx->deque.lock, NULL);
+        ctx->stats = *stats;
+        ctx->stats.walk = ctx;
+        // Order independent counters are summed up at the end. freeSpaceBlocks
+        // only decrements, unsigned wrap around makes the sum right. Serial walk
+        // keeps them running in its only context, as get_file() would.
+        if (!walk.serial) {
+            ctx->stats.found.numFiles = 0;
+            ctx->stats.found.numDirs = 0;
+            ctx->stats.found.freeSpaceBlocks = 0;
+        }
+    }
+    int reduce = !walk.serial;
+
+    if (walk.cp && walk.cp->loaded && walk.cp->hdr.rootLsn == lsn) {
+        // Root FE and replayed part of the tree were checked by interrupted run
+        free(root);
+        if (walk_resume(&walk, &frames, &nframes) != 0) {
+            fatal("Cannot resume file tree check from checkpoint %s. Run check without --resume.\n", walk.cp->path);
+            exit(ESTATUS_OPERATIONAL_ERROR);
+        }
+        root = frames[0].task;
+        msg("File tree check resumed from checkpoint.\n");
+    } else {
+        // Root FE; its contents end up in the main thread deque, or wait for replay in serial walk
+        memset(&info, 0, sizeof(struct fileInfo));
+        walk.ctx[0].task = root;
+        log_sink(walk_log, &walk.ctx[0]);
+        root->status = get_file(media, lsn, &walk.ctx[0].stats, 0, 0, info, seq);
+        log_sink(NULL, NULL);
+        walk.ctx[0].task = NULL;
+        root->done = 1;
+    }
+
+    for (int i = 1; i < walk.nctx; i++) {
+        if (pthread_create(&walk.ctx[i].thread, NULL, walk_worker, &walk.ctx[i]) != 0) {
+            warn("Unable to start walk thread #%d.\n", i);
+            break;
+        }
+        started++;
+    }
+    // Queued tasks are run by replay when no worker is there to take them
+    if (started == 0)
+        walk.serial = 1;
+
+    walk_replay(&walk, root, frames, nframes);
+    walk_free_task(root);
+    checkpoint_armed = 0;
+    if (checkpoint_interrupted) {
+        warn("\nUser interrupted operation. Exiting.\n");
+        exit(ESTATUS_USER_CANCEL);
+    }
+
+    for (int i = 1; i <= started; i++)
+        pthread_join(walk.ctx[i].thread, NULL);
+
+    for (int i = 0; i < walk.nctx; i++) {
+        integrity_info_t *found = &walk.ctx[i].stats.found;
+        if (reduce) {
+            stats->found.numFiles += found->numFiles;
+            stats->found.numDirs += found->numDirs;
+            stats->found.freeSpaceBlocks += found->freeSpaceBlocks;
+        } else {
+            stats->found.numFiles = found->numFiles;
+            stats->found.numDirs = found->numDirs;
+            stats->found.freeSpaceBlocks = found->freeSpaceBlocks;
+        }
+        if (found->nextUID > stats->found.nextUID)
+            stats->found.nextUID = found->nextUID;
+        if (found->minUDFReadRev > stats->found.minUDFReadRev)
+            stats->found.minUDFReadRev = found->minUDFReadRev;
+        if (found->minUDFWriteRev > stats->found.minUDFWriteRev)
+            stats->found.minUDFWriteRev = found->minUDFWriteRev;
+        pthread_mutex_destroy(&walk.ctx[i].deque.lock);
+        free(walk.ctx[i].deque.tasks);
+    }
+
+    pthread_cond_destroy(&walk.done);
+    pthread_cond_destroy(&walk.work);
+    pthread_mutex_destroy(&walk.lock);
+    free(walk.ctx);
+    return walk.status;
+}
@@ -0,0 +1,56 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __WALK_H__
+#define __WALK_H__
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "udffsck.h"
+
+/**
+ * \brief Directory whose FIDs are waiting for inspection
+ *
+ * Captures everything walk_directory() (or the in-ICB FID loop of get_file())
+ * needs, so the directory contents can be inspected later by another thread.
+ */
+struct walk_dir {
+    uint32_t lsn;               ///< LSN of the directory FE/EFE
+    uint8_t *allocDescs;        ///< private copy of ADs (or FIDs for in-ICB directories)
+    uint32_t lengthAllocDescs;  ///< length of allocDescs in bytes
+    uint16_t icb_ad;            ///< AD type, ICBTAG_FLAG_AD_IN_ICB for embedded FIDs
+    uint32_t depth;             ///< depth of the directory FE for printing
+};
+
+// Parallel file tree walk
+uint8_t walk_file_tree(udf_media_t *media, uint32_t lsn, struct filesystemStats *stats,
+                       vds_sequence_t *seq, int jobs);
+
+// Hooks used by udffsck.c while a walk context is attached to stats
+int walk_defer_directory(struct walk_ctx *ctx, uint32_t lsn, const uint8_t *allocDescs,
+                         uint32_t lengthAllocDescs, uint16_t icb_ad, uint32_t depth);
+int walk_defer_mark(struct walk_ctx *ctx, uint32_t lbn, uint32_t size, uint8_t mark);
+void walk_defer_timestamp(struct walk_ctx *ctx, const char *filename, double cts);
+
+// Implemented in udffsck.c
+uint8_t inspect_directory(udf_media_t *media, const struct walk_dir *dir,
+                          struct filesystemStats *stats, vds_sequence_t *seq);
+void report_lvid_timestamp(struct filesystemStats *stats, vds_sequence_t *seq,
+                           const char *filename, double cts);
+
+#endif //__WALK_H__
@@ -36,7 +36,6 @@
 
 #include "libudffs.h"
 #include "options.h"
-#include "readdisc.h"
 
 static uint64_t get_size(int fd)
 {
@@ -141,6 +140,78 @@ static void print_dstring(struct udf_disc *disc, const char *name, const dstring
 	putchar('\n');
 }
 
+static void print_integrity(struct udf_disc *disc)
+{
+	if (disc->udf_lvid)
+	{
+		switch (le32_to_cpu(disc->udf_lvid->integrityType))
+		{
+			case LVID_INTEGRITY_TYPE_OPEN:
+				printf("integrity=opened\n");
+				break;
+			case LVID_INTEGRITY_TYPE_CLOSE:
+				printf("integrity=closed\n");
+				break;
+			default:
+				printf("integrity=unknown\n");
+				break;
+		}
+	}
+	else
+		printf("integrity=unknown\n");
+}
+
+static void print_accesstype(struct partitionDesc *pd)
+{
+	if (pd)
+	{
+		switch (le32_to_cpu(pd->accessType))
+		{
+			case PD_ACCESS_TYPE_OVERWRITABLE:
+				printf("accesstype=overwritable\n");
+				break;
+			case PD_ACCESS_TYPE_REWRITABLE:
+				printf("accesstype=rewritable\n");
+				break;
+			case PD_ACCESS_TYPE_WRITE_ONCE:
+				printf("accesstype=writeonce\n");
+				break;
+			case PD_ACCESS_TYPE_READ_ONLY:
+				printf("accesstype=readonly\n");
+				break;
+			case PD_ACCESS_TYPE_NONE:
+				printf("accesstype=pseudo-overwritable\n");
+				break;
+			default:
+				printf("accesstype=unknown\n");
+				break;
+		}
+	}
+	else
+		printf("accesstype=unknown\n");
+}
+
+/* Stages of udf_read_disc_stages() which fields depend on, VAT overrides label and LVID information */
+static unsigned int fields_stages(uint32_t fields)
+{
+	unsigned int stages = 0;
+
+	if (fields & (FIELD_UUID | FIELD_VID | FIELD_VSID | FIELD_FULLVSID | FIELD_ACCESSTYPE))
+		stages |= UDF_READ_VDS;
+	if (fields & (FIELD_LABEL | FIELD_LVID | FIELD_VATBLOCK))
+		stages |= UDF_READ_PARTITIONS;
+	if (fields & (FIELD_NUMFILES | FIELD_NUMDIRS | FIELD_UDFREV | FIELD_UDFWRITEREV | FIELD_INTEGRITY))
+		stages |= UDF_READ_LVIS | UDF_READ_PARTITIONS;
+	if (fields & (FIELD_FSID | FIELD_WINSERIALNUM))
+		stages |= UDF_READ_FSD;
+	if (fields & (FIELD_USEDBLOCKS | FIELD_FREEBLOCKS))
+		stages |= UDF_READ_SPACE;
+	if (fields & (FIELD_BEHINDBLOCKS | FIELD_SPACE))
+		stages |= UDF_READ_ALL;
+
+	return stages;
+}
+
 static const char *udf_space_type_str[UDF_SPACE_TYPE_SIZE] = { "RESERVED", "VRS", "ANCHOR", "MVDS", "RVDS", "LVID", "STABLE", "SSPACE", "PSPACE", "USPACE", "BAD", "MBR" };
 
 static void dump_space(struct udf_disc *disc)
@@ -167,6 +238,10 @@ int main(int argc, char *argv[])
 	dstring vsid[128];
 	char uuid[17];
 	char *filename;
+	char **devices;
+	unsigned int count;
+	unsigned int batch = 0;
+	int index, status;
 	struct logicalVolDesc *lvd;
 	struct primaryVolDesc *pvd;
 	struct partitionDesc *pd;
@@ -174,11 +249,22 @@ int main(int argc, char *argv[])
 	uint32_t used_blocks;
 	uint32_t behind_blocks;
 	size_t ret;
+	struct udf_medium medium;
+	int io = UDF_MEDIUM_IO_PREAD;
+	unsigned int depth = UDF_MEDIUM_QUEUE_DEPTH;
+	uint32_t fields = FIELD_ALL;
+	unsigned int stages;
 	int fd;
 
 	setlocale(LC_CTYPE, "");
 	appname = "udfinfo";
 
+	if (udf_trace_start(appname) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot enable trace: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
 	memset(&disc, 0, sizeof(disc));
 
 	disc.head = calloc(1, sizeof(struct udf_extent));
@@ -192,7 +278,18 @@ int main(int argc, char *argv[])
 	disc.tail = disc.head;
 	disc.head->space_type = USPACE;
 
-	parse_args(argc, argv, &disc, &filename);
+	parse_args(argc, argv, &disc, &devices, &count, &io, &depth, &fields, &batch);
+	stages = fields_stages(fields);
+
+	if (batch)
+	{
+		index = udf_batch(devices, count, batch, &status);
+		if (index < 0)
+			return status;
+		filename = devices[index];
+	}
+	else
+		filename = devices[0];
 
 	fd = open(filename, O_RDONLY);
 	if (fd < 0)
@@ -204,12 +301,16 @@ int main(int argc, char *argv[])
 	disc.blksize = get_size(fd);
 	disc.blkssz = get_sector_size(fd);
 
-	if (read_disc(fd, &disc) < 0)
+	if (udf_medium_init(&medium, fd, io, depth) != 0)
+		fprintf(stderr, "%s: Warning: io_uring is not available, using pread\n", appname);
+
+	if (udf_read_disc_stages(&medium, &disc, stages) < 0)
 	{
 		fprintf(stderr, "%s: Error: Cannot process device '%s' as UDF disk\n", appname, filename);
 		exit(1);
 	}
 
+	udf_medium_free(&medium);
 	close(fd);
 
 	if (disc.udf_lvd[0])
@@ -271,77 +372,56 @@ int main(int argc, char *argv[])
 		vsid[127] = 0;
 	}
 
-	if (!disc.udf_lvid || le32_to_cpu(disc.udf_lvid->integrityType) != LVID_INTEGRITY_TYPE_CLOSE)
+	if ((stages & UDF_READ_LVIS) && (!disc.udf_lvid || le32_to_cpu(disc.udf_lvid->integrityType) != LVID_INTEGRITY_TYPE_CLOSE))
 		fprintf(stderr, "%s: Warning: Logical Volume is in inconsistent state\n", appname);
 
-	printf("filename=%s\n", filename);
-	print_dstring(&disc, "label", lvd ? lvd->logicalVolIdent : NULL, sizeof(lvd->logicalVolIdent));
-	printf("uuid=%s\n", uuid);
-	print_dstring(&disc, "lvid", lvd ? lvd->logicalVolIdent : NULL, sizeof(lvd->logicalVolIdent));
-	print_dstring(&disc, "vid", pvd ? pvd->volIdent : NULL, sizeof(pvd->volIdent));
-	print_dstring(&disc, "vsid", vsid, sizeof(vsid));
-	print_dstring(&disc, "fsid", disc.udf_fsd ? disc.udf_fsd->fileSetIdent : NULL, sizeof(disc.udf_fsd->fileSetIdent));
-	print_dstring(&disc, "fullvsid", pvd ? pvd->volSetIdent : NULL, sizeof(pvd->volSetIdent));
-	printf("winserialnum=0x%08"PRIx32"\n", serial_num);
-	printf("blocksize=%"PRIu32"\n", disc.blocksize);
-	printf("blocks=%"PRIu32"\n", disc.blocks);
-	printf("usedblocks=%"PRIu32"\n", used_blocks);
-	printf("freeblocks=%"PRIu32"\n", disc.free_space_blocks);
-	printf("behindblocks=%"PRIu32"\n", behind_blocks);
-	printf("numfiles=%"PRIu32"\n", disc.num_files);
-	printf("numdirs=%"PRIu32"\n", disc.num_dirs);
-	printf("udfrev=%"PRIx16".%02"PRIx16"\n", disc.udf_rev >> 8, disc.udf_rev & 0xFF);
-	printf("udfwriterev=%"PRIx16".%02"PRIx16"\n", disc.udf_write_rev >> 8, disc.udf_write_rev & 0xFF);
-
-	if (disc.vat_block)
+	if (fields & FIELD_FILENAME)
+		printf("filename=%s\n", filename);
+	if (fields & FIELD_LABEL)
+		print_dstring(&disc, "label", lvd ? lvd->logicalVolIdent : NULL, sizeof(lvd->logicalVolIdent));
+	if (fields & FIELD_UUID)
+		printf("uuid=%s\n", uuid);
+	if (fields & FIELD_LVID)
+		print_dstring(&disc, "lvid", lvd ? lvd->logicalVolIdent : NULL, sizeof(lvd->logicalVolIdent));
+	if (fields & FIELD_VID)
+		print_dstring(&disc, "vid", pvd ? pvd->volIdent : NULL, sizeof(pvd->volIdent));
+	if (fields & FIELD_VSID)
+		print_dstring(&disc, "vsid", vsid, sizeof(vsid));
+	if (fields & FIELD_FSID)
+		print_dstring(&disc, "fsid", disc.udf_fsd ? disc.udf_fsd->fileSetIdent : NULL, sizeof(disc.udf_fsd->fileSetIdent));
+	if (fields & FIELD_FULLVSID)
+		print_dstring(&disc, "fullvsid", pvd ? pvd->volSetIdent : NULL, sizeof(pvd->volSetIdent));
+	if (fields & FIELD_WINSERIALNUM)
+		printf("winserialnum=0x%08"PRIx32"\n", serial_num);
+	if (fields & FIELD_BLOCKSIZE)
+		printf("blocksize=%"PRIu32"\n", disc.blocksize);
+	if (fields & FIELD_BLOCKS)
+		printf("blocks=%"PRIu32"\n", disc.blocks);
+	if (fields & FIELD_USEDBLOCKS)
+		printf("usedblocks=%"PRIu32"\n", used_blocks);
+	if (fields & FIELD_FREEBLOCKS)
+		printf("freeblocks=%"PRIu32"\n", disc.free_space_blocks);
+	if (fields & FIELD_BEHINDBLOCKS)
+		printf("behindblocks=%"PRIu32"\n", behind_blocks);
+	if (fields & FIELD_NUMFILES)
+		printf("numfiles=%"PRIu32"\n", disc.num_files);
+	if (fields & FIELD_NUMDIRS)
+		printf("numdirs=%"PRIu32"\n", disc.num_dirs);
+	if (fields & FIELD_UDFREV)
+		printf("udfrev=%"PRIx16".%02"PRIx16"\n", disc.udf_rev >> 8, disc.udf_rev & 0xFF);
+	if (fields & FIELD_UDFWRITEREV)
+		printf("udfwriterev=%"PRIx16".%02"PRIx16"\n", disc.udf_write_rev >> 8, disc.udf_write_rev & 0xFF);
+
+	if ((fields & FIELD_VATBLOCK) && disc.vat_block)
 		printf("vatblock=%"PRIu32"\n", disc.vat_block);
 
-	if (disc.udf_lvid)
-	{
-		switch (le32_to_cpu(disc.udf_lvid->integrityType))
-		{
-			case LVID_INTEGRITY_TYPE_OPEN:
-				printf("integrity=opened\n");
-				break;
-			case LVID_INTEGRITY_TYPE_CLOSE:
-				printf("integrity=closed\n");
-				break;
-			default:
-				printf("integrity=unknown\n");
-				break;
-		}
-	}
-	else
-		printf("integrity=unknown\n");
-
-	if (pd)
-	{
-		switch (le32_to_cpu(pd->accessType))
-		{
-			case PD_ACCESS_TYPE_OVERWRITABLE:
-				printf("accesstype=overwritable\n");
-				break;
-			case PD_ACCESS_TYPE_REWRITABLE:
-				printf("accesstype=rewritable\n");
-				break;
-			case PD_ACCESS_TYPE_WRITE_ONCE:
-				printf("accesstype=writeonce\n");
-				break;
-			case PD_ACCESS_TYPE_READ_ONLY:
-				printf("accesstype=readonly\n");
-				break;
-			case PD_ACCESS_TYPE_NONE:
-				printf("accesstype=pseudo-overwritable\n");
-				break;
-			default:
-				printf("accesstype=unknown\n");
-				break;
-		}
-	}
-	else
-		printf("accesstype=unknown\n");
+	if (fields & FIELD_INTEGRITY)
+		print_integrity(&disc);
+	if (fields & FIELD_ACCESSTYPE)
+		print_accesstype(pd);
 
-	dump_space(&disc);
+	if (fields & FIELD_SPACE)
+		dump_space(&disc);
 
 	return 0;
 }
@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <getopt.h>
 
@@ -36,19 +37,77 @@ static struct option long_options[] = {
 	{ "u8", no_argument, NULL, OPT_UNICODE8 },
 	{ "u16", no_argument, NULL, OPT_UNICODE16 },
 	{ "utf8", no_argument, NULL, OPT_UTF8 },
+	{ "io", required_argument, NULL, OPT_IO },
+	{ "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+	{ "fields", required_argument, NULL, OPT_FIELDS },
+	{ "batch", optional_argument, NULL, OPT_BATCH },
 	{ 0, 0, NULL, 0 },
 };
 
+static const struct
+{
+	const char *name;
+	uint32_t field;
+} field_names[] = {
+	{ "filename", FIELD_FILENAME },
+	{ "label", FIELD_LABEL },
+	{ "uuid", FIELD_UUID },
+	{ "lvid", FIELD_LVID },
+	{ "vid", FIELD_VID },
+	{ "vsid", FIELD_VSID },
+	{ "fsid", FIELD_FSID },
+	{ "fullvsid", FIELD_FULLVSID },
+	{ "winserialnum", FIELD_WINSERIALNUM },
+	{ "blocksize", FIELD_BLOCKSIZE },
+	{ "blocks", FIELD_BLOCKS },
+	{ "usedblocks", FIELD_USEDBLOCKS },
+	{ "freeblocks", FIELD_FREEBLOCKS },
+	{ "behindblocks", FIELD_BEHINDBLOCKS },
+	{ "numfiles", FIELD_NUMFILES },
+	{ "numdirs", FIELD_NUMDIRS },
+	{ "udfrev", FIELD_UDFREV },
+	{ "udfwriterev", FIELD_UDFWRITEREV },
+	{ "vatblock", FIELD_VATBLOCK },
+	{ "integrity", FIELD_INTEGRITY },
+	{ "accesstype", FIELD_ACCESSTYPE },
+	{ "space", FIELD_SPACE },
+};
+
+static uint32_t parse_fields(const char *list)
+{
+	uint32_t fields = 0;
+	size_t len, i;
+
+	while (*list)
+	{
+		len = strcspn(list, ",");
+		for (i = 0; i < sizeof(field_names)/sizeof(field_names[0]); ++i)
+		{
+			if (strlen(field_names[i].name) == len && strncmp(field_names[i].name, list, len) == 0)
+				break;
+		}
+		if (i == sizeof(field_names)/sizeof(field_names[0]))
+			return 0;
+		fields |= field_names[i].field;
+		list += len;
+		if (*list == ',')
+			++list;
+	}
+
+	return fields;
+}
+
 static void usage(void)
 {
 	fprintf(stderr, "udfinfo from " PACKAGE_NAME " " PACKAGE_VERSION "\n"
 		"Usage:\n"
-		"\tudfinfo [--locale|--u8|--u16|--utf8] [-b|--blocksize=block-size] [--vatblock=block] device\n"
+		"\tudfinfo [--locale|--u8|--u16|--utf8] [-b|--blocksize=block-size] [--vatblock=block] [--io=pread|uring] [--queue-depth=depth] [--fields=field,...] device\n"
+		"\tudfinfo --batch[=jobs] [options] device...\n"
 	);
 	exit(1);
 }
 
-void parse_args(int argc, char *argv[], struct udf_disc *disc, char **filename)
+void parse_args(int argc, char *argv[], struct udf_disc *disc, char ***devices, unsigned int *count, int *io, unsigned int *depth, uint32_t *fields, unsigned int *batch)
 {
 	int failed;
 	int ret;
@@ -78,6 +137,42 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **filename)
 					exit(1);
 				}
 				break;
+			case OPT_IO:
+				*io = udf_medium_parse_io(optarg);
+				if (*io < 0)
+				{
+					fprintf(stderr, "%s: Error: Invalid value for option --io\n", appname);
+					exit(1);
+				}
+				break;
+			case OPT_QUEUE_DEPTH:
+				*depth = strtou32(optarg, 0, &failed);
+				if (failed || *depth < 1 || *depth > 4096)
+				{
+					fprintf(stderr, "%s: Error: Invalid value for option --queue-depth\n", appname);
+					exit(1);
+				}
+				break;
+			case OPT_FIELDS:
+				*fields = parse_fields(optarg);
+				if (!*fields)
+				{
+					fprintf(stderr, "%s: Error: Invalid value for option --fields\n", appname);
+					exit(1);
+				}
+				break;
+			case OPT_BATCH:
+				*batch = BATCH_JOBS;
+				if (optarg)
+				{
+					*batch = strtou32(optarg, 0, &failed);
+					if (failed || *batch < 1 || *batch > 256)
+					{
+						fprintf(stderr, "%s: Error: Invalid value for option --batch\n", appname);
+						exit(1);
+					}
+				}
+				break;
 			case OPT_UNICODE8:
 				disc->flags &= ~FLAG_CHARSET;
 				disc->flags |= FLAG_UNICODE8;
@@ -100,8 +195,9 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **filename)
 		}
 	}
 
-	if (optind+1 != argc)
+	if (optind >= argc || (!*batch && optind+1 != argc))
 		usage();
 
-	*filename = argv[optind];
+	*devices = &argv[optind];
+	*count = argc - optind;
 }
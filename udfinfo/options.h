@@ -21,7 +21,7 @@
 
 struct udf_disc;
 
-void parse_args(int, char *[], struct udf_disc *, char **);
+void parse_args(int, char *[], struct udf_disc *, char ***, unsigned int *, int *, unsigned int *, uint32_t *, unsigned int *);
 
 /*
  * Command line option token values.
@@ -38,5 +38,39 @@ void parse_args(int, char *[], struct udf_disc *, char **);
 
 #define OPT_BLK_SIZE	0x2000
 #define OPT_VAT_BLOCK	0x2001
+#define OPT_IO		0x2002
+#define OPT_QUEUE_DEPTH	0x2003
+#define OPT_FIELDS	0x2004
+#define OPT_BATCH	0x2005
+
+/*
+ * Output fields selectable by --fields
+ */
+
+#define FIELD_FILENAME		0x00000001
+#define FIELD_LABEL		0x00000002
+#define FIELD_UUID		0x00000004
+#define FIELD_LVID		0x00000008
+#define FIELD_VID		0x00000010
+#define FIELD_VSID		0x00000020
+#define FIELD_FSID		0x00000040
+#define FIELD_FULLVSID		0x00000080
+#define FIELD_WINSERIALNUM	0x00000100
+#define FIELD_BLOCKSIZE		0x00000200
+#define FIELD_BLOCKS		0x00000400
+#define FIELD_USEDBLOCKS	0x00000800
+#define FIELD_FREEBLOCKS	0x00001000
+#define FIELD_BEHINDBLOCKS	0x00002000
+#define FIELD_NUMFILES		0x00004000
+#define FIELD_NUMDIRS		0x00008000
+#define FIELD_UDFREV		0x00010000
+#define FIELD_UDFWRITEREV	0x00020000
+#define FIELD_VATBLOCK		0x00040000
+#define FIELD_INTEGRITY		0x00080000
+#define FIELD_ACCESSTYPE	0x00100000
+#define FIELD_SPACE		0x00200000
+#define FIELD_ALL		0x003FFFFF
+
+#define BATCH_JOBS		4
 
 #endif /* OPTIONS_H */
@@ -36,7 +36,6 @@
 
 #include "libudffs.h"
 #include "options.h"
-#include "../udfinfo/readdisc.h"
 
 static uint64_t get_size(int fd)
 {
@@ -123,13 +122,36 @@ static void update_desc(void *desc, size_t length)
 	tag->tagChecksum = compute_checksum(tag);
 }
 
-static void write_desc(int fd, struct udf_disc *disc, enum udf_space_type type, uint16_t ident, void *buffer)
+/* Descriptors written by one phase, main VDS or FSD (and its mirror) with reserve VDS */
+#define PLAN_MAX	5
+
+struct plan_write
+{
+	uint32_t	block;
+	void		*buffer;
+	size_t		length;
+};
+
+struct plan
+{
+	struct plan_write	writes[PLAN_MAX];
+	int			count;
+};
+
+static void plan_block(struct plan *plan, uint32_t block, void *buffer, size_t length)
+{
+	printf("  ... at block %"PRIu32"\n", block);
+
+	plan->writes[plan->count].block = block;
+	plan->writes[plan->count].buffer = buffer;
+	plan->writes[plan->count].length = length;
+	plan->count++;
+}
+
+static void plan_desc(struct plan *plan, struct udf_disc *disc, enum udf_space_type type, uint16_t ident, void *buffer)
 {
 	struct udf_extent *ext;
 	struct udf_desc *desc;
-	off_t off;
-	off_t offset;
-	ssize_t ret;
 
 	ext = disc->head;
 	while ((ext = next_extent(ext, type)))
@@ -140,36 +162,7 @@ static void write_desc(int fd, struct udf_disc *disc, enum udf_space_type type,
 			if (!desc->data || desc->data->buffer != buffer)
 				continue;
 
-			printf("  ... at block %"PRIu32"\n", ext->start + desc->offset);
-
-			offset = (off_t)disc->blocksize * (ext->start + desc->offset);
-			off = lseek(fd, offset, SEEK_SET);
-			if (off != (off_t)-1 && off != offset)
-			{
-				errno = EIO;
-				off = (off_t)-1;
-			}
-			if (off == (off_t)-1)
-			{
-				fprintf(stderr, "%s: Error: lseek failed: %s\n", appname, strerror(errno));
-				return;
-			}
-
-			if (!(disc->flags & FLAG_NO_WRITE))
-			{
-				ret = write(fd, desc->data->buffer, desc->data->length);
-				if (ret >= 0 && (size_t)ret != desc->data->length)
-				{
-					errno = EIO;
-					ret = -1;
-				}
-				if (ret < 0)
-				{
-					fprintf(stderr, "%s: Error: write failed: %s\n", appname, strerror(errno));
-					return;
-				}
-			}
-
+			plan_block(plan, ext->start + desc->offset, desc->data->buffer, desc->data->length);
 			return;
 		}
 	}
@@ -178,6 +171,94 @@ static void write_desc(int fd, struct udf_disc *disc, enum udf_space_type type,
 	return;
 }
 
+static int cmp_plan_write(const void *a, const void *b)
+{
+	const struct plan_write *wa = a;
+	const struct plan_write *wb = b;
+
+	if (wa->block != wb->block)
+		return wa->block < wb->block ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Write planned descriptors in block order. Descriptors in adjacent blocks
+ * are merged into one write of whole blocks, the rest of their blocks is read
+ * from the device first so it is written back unchanged. Then wait until all
+ * of it is on the device, so the next phase starts only after this one is
+ * durable.
+ */
+static void plan_write(struct plan *plan, int fd, struct udf_disc *disc)
+{
+	uint32_t blocks, run_blocks, last;
+	uint8_t *buffer;
+	size_t total;
+	ssize_t ret;
+	off_t offset;
+	int first, i;
+
+	printf("Synchronizing...\n");
+
+	if (disc->flags & FLAG_NO_WRITE)
+	{
+		plan->count = 0;
+		return;
+	}
+
+	qsort(plan->writes, plan->count, sizeof(plan->writes[0]), cmp_plan_write);
+
+	for (first = 0; first < plan->count; first = i)
+	{
+		last = plan->writes[first].block + (plan->writes[first].length + disc->blocksize - 1) / disc->blocksize;
+		for (i = first + 1; i < plan->count && plan->writes[i].block == last; ++i)
+			last += (plan->writes[i].length + disc->blocksize - 1) / disc->blocksize;
+
+		run_blocks = last - plan->writes[first].block;
+		total = (size_t)run_blocks * disc->blocksize;
+		offset = (off_t)plan->writes[first].block * disc->blocksize;
+
+		buffer = calloc(1, total);
+		if (!buffer)
+		{
+			fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+
+		if (pread(fd, buffer, total, offset) < 0)
+		{
+			fprintf(stderr, "%s: Error: read failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+
+		for (blocks = 0; first < i; ++first)
+		{
+			memcpy(buffer + (size_t)blocks * disc->blocksize, plan->writes[first].buffer, plan->writes[first].length);
+			blocks += (plan->writes[first].length + disc->blocksize - 1) / disc->blocksize;
+		}
+
+		ret = pwrite(fd, buffer, total, offset);
+		if (ret >= 0 && (size_t)ret != total)
+		{
+			errno = EIO;
+			ret = -1;
+		}
+		free(buffer);
+		if (ret < 0)
+		{
+			fprintf(stderr, "%s: Error: write failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+	}
+
+	plan->count = 0;
+
+	if (fdatasync(fd) != 0)
+	{
+		fprintf(stderr, "%s: Synchronization failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	struct udf_disc disc;
@@ -187,6 +268,8 @@ int main(int argc, char *argv[])
 	struct logicalVolDesc *lvd;
 	struct impUseVolDescImpUse *iuvdiu;
 	size_t len;
+	struct udf_medium medium;
+	struct plan plan;
 	int fd;
 	int i;
 	char buf[256];
@@ -202,6 +285,9 @@ int main(int argc, char *argv[])
 	int update_lvd = 0;
 	int update_iuvd = 0;
 	int update_fsd = 0;
+	uint32_t fsd_mirror = UINT32_MAX;
+	uint16_t fsd_partition;
+	long_ad *fsd_ad;
 
 	if (fcntl(0, F_GETFL) < 0 && open("/dev/null", O_RDONLY) < 0)
 		_exit(1);
@@ -213,6 +299,12 @@ int main(int argc, char *argv[])
 	setlocale(LC_CTYPE, "");
 	appname = "udflabel";
 
+	if (udf_trace_start(appname) < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot enable trace: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
 	memset(&disc, 0, sizeof(disc));
 
 	disc.head = calloc(1, sizeof(struct udf_extent));
@@ -325,11 +417,13 @@ int main(int argc, char *argv[])
 	disc.blksize = get_size(fd);
 	disc.blkssz = get_sector_size(fd);
 
-	if (read_disc(fd, &disc) < 0)
+	udf_medium_init(&medium, fd, UDF_MEDIUM_IO_PREAD, 0);
+	if (udf_read_disc(&medium, &disc) < 0)
 	{
 		fprintf(stderr, "%s: Error: Cannot process device '%s' as UDF disk\n", appname, filename);
 		exit(1);
 	}
+	udf_medium_free(&medium);
 
 	if (!update)
 	{
@@ -541,6 +635,21 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "%s: Error: File Set Descriptor is damaged\n", appname);
 			exit(1);
 		}
+
+		// File Set Descriptor in Metadata Partition has its copy in Metadata Mirror File
+		fsd_ad = (long_ad *)(disc.udf_lvd[0] ? disc.udf_lvd[0] : disc.udf_lvd[1])->logicalVolContentsUse;
+		fsd_partition = le16_to_cpu(fsd_ad->extLocation.partitionReferenceNum);
+		if (fsd_partition < disc.num_partitions && disc.partitions[fsd_partition].type == UDF_PARTITION_METADATA)
+		{
+			fsd_mirror = udf_mirror_block_position(&disc, fsd_partition, le32_to_cpu(fsd_ad->extLocation.logicalBlockNum));
+			if (fsd_mirror == UINT32_MAX)
+			{
+				fprintf(stderr, "%s: Error: Metadata File or Metadata Mirror File cannot be read, File Set Descriptor cannot be updated\n", appname);
+				exit(1);
+			}
+			if (fsd_mirror == udf_block_position(&disc, fsd_partition, le32_to_cpu(fsd_ad->extLocation.logicalBlockNum)))
+				fsd_mirror = UINT32_MAX;
+		}
 	}
 
 	if (new_lvid[0] != 0xFF)
@@ -609,77 +718,67 @@ int main(int argc, char *argv[])
 		memcpy(disc.udf_pvd[1]->volSetIdent, new_fullvsid, sizeof(new_fullvsid));
 	}
 
+	memset(&plan, 0, sizeof(plan));
+
 	if (update_pvd)
 	{
 		printf("Updating Main Primary Volume Descriptor...\n");
 		update_desc(disc.udf_pvd[0], sizeof(*disc.udf_pvd[0]));
-		write_desc(fd, &disc, MVDS, TAG_IDENT_PVD, disc.udf_pvd[0]);
+		plan_desc(&plan, &disc, MVDS, TAG_IDENT_PVD, disc.udf_pvd[0]);
 	}
 
 	if (update_lvd)
 	{
 		printf("Updating Main Logical Volume Descriptor...\n");
 		update_desc(disc.udf_lvd[0], sizeof(*disc.udf_lvd[0]) + le32_to_cpu(disc.udf_lvd[0]->mapTableLength));
-		write_desc(fd, &disc, MVDS, TAG_IDENT_LVD, disc.udf_lvd[0]);
+		plan_desc(&plan, &disc, MVDS, TAG_IDENT_LVD, disc.udf_lvd[0]);
 	}
 
 	if (update_iuvd)
 	{
 		printf("Updating Main Implementation Use Volume Descriptor...\n");
 		update_desc(disc.udf_iuvd[0], sizeof(*disc.udf_iuvd[0]));
-		write_desc(fd, &disc, MVDS, TAG_IDENT_IUVD, disc.udf_iuvd[0]);
+		plan_desc(&plan, &disc, MVDS, TAG_IDENT_IUVD, disc.udf_iuvd[0]);
 	}
 
+	// Main VDS must be durable before Reserve VDS is touched, one of them is always valid
 	if (update_pvd || update_lvd || update_iuvd)
-	{
-		printf("Synchronizing...\n");
-		if (!(disc.flags & FLAG_NO_WRITE))
-		{
-			if (fdatasync(fd) != 0)
-			{
-				fprintf(stderr, "%s: Synchronization failed: %s\n", appname, strerror(errno));
-				exit(1);
-			}
-		}
-	}
+		plan_write(&plan, fd, &disc);
 
 	if (update_fsd)
 	{
 		printf("Updating File Set Descriptor...\n");
 		update_desc(disc.udf_fsd, sizeof(*disc.udf_fsd));
-		write_desc(fd, &disc, PSPACE, TAG_IDENT_FSD, disc.udf_fsd);
+		plan_desc(&plan, &disc, PSPACE, TAG_IDENT_FSD, disc.udf_fsd);
+		if (fsd_mirror != UINT32_MAX && plan.count > 0)
+		{
+			printf("Updating File Set Descriptor in Metadata Mirror File...\n");
+			plan_block(&plan, fsd_mirror, plan.writes[plan.count-1].buffer, plan.writes[plan.count-1].length);
+		}
 	}
 
 	if (update_pvd && disc.udf_pvd[1] != disc.udf_pvd[0])
 	{
 		printf("Updating Reserve Primary Volume Descriptor...\n");
 		update_desc(disc.udf_pvd[1], sizeof(*disc.udf_pvd[1]));
-		write_desc(fd, &disc, RVDS, TAG_IDENT_PVD, disc.udf_pvd[1]);
+		plan_desc(&plan, &disc, RVDS, TAG_IDENT_PVD, disc.udf_pvd[1]);
 	}
 
 	if (update_lvd && disc.udf_lvd[1] != disc.udf_lvd[0])
 	{
 		printf("Updating Reserve Logical Volume Descriptor...\n");
 		update_desc(disc.udf_lvd[1], sizeof(*disc.udf_lvd[1]) + le32_to_cpu(disc.udf_lvd[1]->mapTableLength));
-		write_desc(fd, &disc, RVDS, TAG_IDENT_LVD, disc.udf_lvd[1]);
+		plan_desc(&plan, &disc, RVDS, TAG_IDENT_LVD, disc.udf_lvd[1]);
 	}
 
 	if (update_iuvd && disc.udf_iuvd[1] != disc.udf_iuvd[0])
 	{
 		printf("Updating Reserve Implementation Use Volume Descriptor...\n");
 		update_desc(disc.udf_iuvd[1], sizeof(*disc.udf_iuvd[1]));
-		write_desc(fd, &disc, RVDS, TAG_IDENT_IUVD, disc.udf_iuvd[1]);
+		plan_desc(&plan, &disc, RVDS, TAG_IDENT_IUVD, disc.udf_iuvd[1]);
 	}
 
-	printf("Synchronizing...\n");
-	if (!(disc.flags & FLAG_NO_WRITE))
-	{
-		if (fdatasync(fd) != 0)
-		{
-			fprintf(stderr, "%s: Synchronization failed: %s\n", appname, strerror(errno));
-			exit(1);
-		}
-	}
+	plan_write(&plan, fd, &disc);
 
 	printf("Done\n");
 	return 0;
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 
 #include "bswap.h"
+#include "libudffs.h"
 #include "ide-pc.h"
 
 typedef struct cdrom_generic_command CGC;
@@ -343,6 +344,7 @@ readCD(int fd, int sectortype, int lba, int n, unsigned char* buf)
 {
     CGC pc;
     uint32_t lba_be32 = cpu_to_be32(lba);
+    uint64_t start;
 
     initpc(&pc);
     pc.data_direction = CGC_DATA_READ;
@@ -353,7 +355,10 @@ readCD(int fd, int sectortype, int lba, int n, unsigned char* buf)
     pc.cmd[9]=0x10;				/* user data only */
     pc.buffer=buf;
     pc.buflen=n * 2048;
-    return rv = ioctl(fd, CDROM_SEND_PACKET, &pc);
+    UDF_TRACE_START(cd_read, lba, n, start);
+    rv = ioctl(fd, CDROM_SEND_PACKET, &pc);
+    UDF_TRACE_DONE(UDF_TRACE_CD_READ, cd_read, lba, rv ? -1 : n * 2048, start);
+    return rv;
 }
 
 int
@@ -362,6 +367,7 @@ writeCD(int fd, int lba, int nblks, unsigned char* buf)
     CGC pc;
     uint32_t lba_be32 = cpu_to_be32(lba);
     uint16_t nblks_be16 = cpu_to_be16(nblks);
+    uint64_t start;
 
     initpc(&pc);
     pc.data_direction = CGC_DATA_WRITE;
@@ -371,7 +377,10 @@ writeCD(int fd, int lba, int nblks, unsigned char* buf)
     memcpy(&pc.cmd[7], &nblks_be16, sizeof(nblks_be16));
     pc.buffer = buf;
     pc.buflen = nblks * 2048;
-    return rv = ioctl(fd, CDROM_SEND_PACKET, &pc);
+    UDF_TRACE_START(cd_write, lba, nblks, start);
+    rv = ioctl(fd, CDROM_SEND_PACKET, &pc);
+    UDF_TRACE_DONE(UDF_TRACE_CD_WRITE, cd_write, lba, rv ? -1 : nblks * 2048, start);
+    return rv;
 }
 
 
@@ -389,6 +398,24 @@ verify(int fd, int lba, int nblocks)
     pc.cmd[8] = (u_char) nblocks;
     return rv = ioctl(fd, CDROM_SEND_PACKET, &pc);
 }
+
+int
+writeVerifyCD(int fd, int lba, int nblks, unsigned char* buf)
+{
+    CGC pc;
+    uint32_t lba_be32 = cpu_to_be32(lba);
+    uint16_t nblks_be16 = cpu_to_be16(nblks);
+
+    initpc(&pc);
+    pc.data_direction = CGC_DATA_WRITE;
+    pc.cmd[0] = GPCMD_WRITE_AND_VERIFY_10;
+    pc.cmd[1] = 0;				/* BYTCHK 0: medium verification only */
+    memcpy(&pc.cmd[2], &lba_be32, sizeof(lba_be32));
+    memcpy(&pc.cmd[7], &nblks_be16, sizeof(nblks_be16));
+    pc.buffer = buf;
+    pc.buflen = nblks * 2048;
+    return rv = ioctl(fd, CDROM_SEND_PACKET, &pc);
+}
 #endif
 
 /*
@@ -357,6 +357,7 @@ int	mode_select(int fd, u_char *buffer);
 
 #ifdef MMC2
 int	verify(int fd, int lba, int nblocks); 
+int	writeVerifyCD(int fd, int lba, int nblocks, unsigned char* buf);
 #else
 int	verify(int fd, int sectortype, int lba, int nblocks, char* buf);
 #endif
@@ -13,14 +13,40 @@
 #include "ide-pc.h"
 #include "bswap.h"
 
-static unsigned char *blockBuffer;
+static unsigned char blockBuffer[2048];
 static uint32_t newVATindex;
 static uint32_t sizeVAT;
 static uint32_t prevVATlbn;
 uint64_t  CDRuniqueID;			// from VAT FE
 
+/* The VAT as read at startup or written at the last batch checkpoint.
+ * writeVATtable() compares against it page by page, 2048 byte pages not changed
+ * since are referenced at their old location by the new VAT FileEntry instead
+ * of being written again. Nothing is written at all when no entry changed and
+ * no block was written.
+ */
+static uint32_t *readVAT;		// copy of VAT file as read, including its trailer
+static uint32_t readVATsize;		// its informationLength
+static uint32_t *readVATblocks;		// partition block of each page, 0xFFFFFFFF when embedded
+static uint32_t readVATnwa;		// NWA when VAT was read
+static uint32_t freeVATscan;		// entries below are known to be in use
+
+/* short_ad's fitting into the VAT FileEntry */
+#define FE_SHORT_ADS	((2048 - sizeof(struct fileEntry)) / sizeof(short_ad))
+
 
 uint32_t newVATentry() {
+    uint32_t	i;
+
+    /* reuse an entry of a deleted file, entries are scanned only once */
+    for( i = freeVATscan; i < newVATindex; i++ ) {
+	if( vat[i] == 0xFFFFFFFF ) {
+	    freeVATscan = i + 1;
+	    vat[i] = getNWA() - pd->partitionStartingLocation;
+	    return i;
+	}
+    }
+    freeVATscan = newVATindex;
 
     if( newVATindex + 10 > (sizeVAT >> 2) ) {		// ensure enough spave for regid and prevVATlbn
 	sizeVAT += 2048;
@@ -28,7 +54,6 @@ uint32_t newVATentry() {
 	if( vat == NULL )
 	    printf("VAT reallocation failed\n");
     }
-    /* could go through VAT and try to find unused 0xFFFFFFFF entry rather than alloc new one at the end */
     vat[newVATindex] = getNWA() - pd->partitionStartingLocation;
     return newVATindex++;
 }
@@ -134,6 +159,149 @@ writeCDR(void* src) {
 }
 
 
+/*	writeCDRBlocks()
+ *	Writes 'n' consecutive 2048 byte blocks at NWA.
+ *	Drive gets at most 32 blocks per command.
+ */
+uint32_t
+writeCDRBlocks(void* src, uint32_t n) {
+    uint32_t	physical, i, count;
+    ssize_t	len;
+
+    physical = getNWA();
+
+    if( devicetype == DISK_IMAGE ) {
+	lseek(device, 2048 * (off_t)physical, SEEK_SET);
+	len = write(device, src, 2048 * (size_t)n);
+	if( len != 2048 * (ssize_t)n )
+	    printf("writeHD failed %s\n", strerror(errno));
+    } else {
+	for( i = 0; i < n; i += count ) {
+	    count = n - i < 32 ? n - i : 32;
+	    writeCD(device, physical + i, count, (unsigned char*)src + 2048 * i);
+	}
+    }
+    return physical;
+}
+
+
+/*	writeHDpad()
+ *	The drive adds link blocks after every packet, do the same on disk image
+ *	up to block 'pbn' where the next extent was allocated
+ */
+void writeHDpad(uint32_t pbn) {
+    static unsigned char zeroBlock[2048];
+    uint32_t blk = getNWA();
+
+    for( ; blk < pbn; blk++ )
+	writeHD(blk, zeroBlock);
+}
+
+
+/*	countLongExtents()
+ *	Number of long_ad's up to the zero length one ending the list
+ */
+uint32_t countLongExtents(long_ad *extents) {
+    uint32_t n;
+
+    for( n = 0; extents[n].extLength != 0; n++ )
+	;
+    return n;
+}
+
+/* long_ad's fitting after Allocation Extent Descriptor header */
+#define AED_LONG_ADS	((2048 - sizeof(struct allocExtDesc)) / sizeof(long_ad))
+
+/* long_ad's fitting into FileEntry after its extended attributes */
+static uint32_t feLongExtents(struct fileEntry *fe) {
+    return (2048 - sizeof(struct fileEntry) - fe->lengthExtendedAttr) / sizeof(long_ad);
+}
+
+/*	Number of long_ad's to record for 'extents', including the zero length
+ *	one after a final extent which is a multiple of the block size
+ */
+static uint32_t recordedLongExtents(long_ad *extents) {
+    uint32_t n = countLongExtents(extents);
+
+    if( n > 0 && (extents[n-1].extLength & 2047) == 0 )
+	n++;
+    return n;
+}
+
+/*	countAllocExtDescs()
+ *	Number of Allocation Extent Descriptor blocks needed to record 'extents'
+ *	when they do not fit into the FileEntry 'fe'
+ */
+uint32_t countAllocExtDescs(struct fileEntry *fe, long_ad *extents) {
+    uint32_t n = recordedLongExtents(extents);
+    uint32_t room = feLongExtents(fe);
+    uint32_t blocks = 0;
+
+    if( n <= room )
+	return 0;
+
+    n -= room - 1;				/* last one in FE points to first AED */
+    for( blocks = 1; n > AED_LONG_ADS; blocks++ )
+	n -= AED_LONG_ADS - 1;
+    return blocks;
+}
+
+/*	setLongExtents()
+ *	Record 'extents' in the FileEntry, spilling into Allocation Extent Descriptors
+ *	in 'aeds' (countAllocExtDescs() blocks) located at 'aedLbn' and following
+ *	blocks of the physical partition when they do not fit
+ */
+void setLongExtents(struct fileEntry *fe, long_ad *extents, uint8_t *aeds, uint32_t aedLbn) {
+    long_ad	*dest;
+    struct allocExtDesc	*aed;
+    uint32_t	n, count, room;
+
+    n = recordedLongExtents(extents);
+    dest = (long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
+    room = feLongExtents(fe);
+    aed = NULL;
+
+    for(;;) {
+	count = n <= room ? n : room - 1;
+	memmove(dest, extents, count * sizeof(long_ad));
+	extents += count;
+	n -= count;
+
+	if( n > 0 ) {					/* continue in next AED */
+	    memset(&dest[count], 0, sizeof(long_ad));
+	    dest[count].extLength = EXT_NEXT_EXTENT_ALLOCDECS | 2048;
+	    dest[count].extLocation.logicalBlockNum = aedLbn;
+	    dest[count].extLocation.partitionReferenceNum = pd->partitionNumber;
+	    count++;
+	}
+
+	if( aed ) {
+	    aed->lengthAllocDescs = count * sizeof(long_ad);
+	    aed->descTag.descCRCLength = sizeof(struct allocExtDesc) - sizeof(tag) + aed->lengthAllocDescs;
+	    setChecksum(aed);
+	} else {
+	    fe->lengthAllocDescs = count * sizeof(long_ad);
+	    fe->descTag.descCRCLength = sizeof(struct fileEntry) + 
+		fe->lengthExtendedAttr + fe->lengthAllocDescs - sizeof(tag);
+	}
+
+	if( n == 0 )
+	    break;
+
+	aed = (struct allocExtDesc*)aeds;
+	memset(aed, 0, 2048);
+	aed->descTag.tagIdent = TAG_IDENT_AED;
+	aed->descTag.descVersion = 2;
+	aed->descTag.tagSerialNum = lvd->descTag.tagSerialNum;
+	aed->descTag.tagLocation = aedLbn;
+	dest = (long_ad*)(aed + 1);
+	room = AED_LONG_ADS;
+	aeds += 2048;
+	aedLbn++;
+    }
+}
+
+
 /*	flagError
  *	split up extent in (1) good, (2) bad and (3) good subextents.
  *	In bad extent (2) set logicalBlockNum to zero
@@ -170,7 +338,7 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
 
     /* 1st block of extent is bad */
     if( posInExtent == 1 ) {
-	memmove(ext+1, ext, extents - ext + 62);
+	memmove(ext+1, ext, (countLongExtents(ext) + 1) * sizeof(long_ad));
 	ext[0].extLength = 2048;
 	ext[0].extLocation.logicalBlockNum = 0;
 	ext[1].extLength -= 2048;
@@ -180,7 +348,7 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
 
     /* last block of extent is bad - watch partial block */
     if( posInExtent == blksInExtent ) {
-	memmove(ext+1, ext, extents - ext + 62);
+	memmove(ext+1, ext, (countLongExtents(ext) + 1) * sizeof(long_ad));
 	ext[1].extLength = ext->extLength - 2048;
 	ext[1].extLocation.logicalBlockNum = 0;
 	ext[0].extLength -= ext[1].extLength;
@@ -188,7 +356,7 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
     }
 
     /* middle block in extent is bad */
-    memmove(ext+2, ext, extents - ext + 61);
+    memmove(ext+2, ext, (countLongExtents(ext) + 1) * sizeof(long_ad));
     memcpy(ext+1, ext, sizeof(long_ad));
     ext[0].extLength = 2048 * posInExtent;
     ext[1].extLength = 2048;
@@ -198,14 +366,22 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
     return ext+1;
 }
 
-int verifyCDR(struct fileEntry *fe) {
-    long_ad	*ext, *extents;
-    uint32_t	processed;
+/*	verifyCDR()
+ *	Verify file data in 'extents', the Allocation Extent Descriptors
+ *	following the FileEntry and the FileEntry itself.
+ *	Bad blocks are split off into extents with location 0 by flagError(),
+ *	'capacity' is the number of long_ad's 'extents' can hold.
+ *	Returns number of bad blocks, after assigning new locations to them,
+ *	or -1 if there are more than 'extents' can record
+ */
+int verifyCDR(struct fileEntry *fe, long_ad *extents, uint32_t capacity, uint32_t aedBlocks) {
+    long_ad	*ext;
+    uint32_t	processed, i;
     int		stat, rv = 0;
     uint32_t	pbn, pbnFE, rewriteBlkno;
 
     setStrictRead(1);
-    extents = ext = (long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
+    ext = extents;
     processed = 0;
     pbnFE = vat[fe->descTag.tagLocation] + pd->partitionStartingLocation;
     pbn = ext->extLocation.logicalBlockNum + pd->partitionStartingLocation;
@@ -224,6 +400,11 @@ int verifyCDR(struct fileEntry *fe) {
 
 	    if( stat ) {
 		printf("readError %d : %s\n", pbn, get_sense_string());
+		if( countLongExtents(extents) + 3 > capacity ) {
+		    printf("verifyCDR: too many bad blocks\n");
+		    setStrictRead(0);
+		    return -1;
+		}
 		rv++;
 		ext = flagError(extents, ext, pbn);
 		processed = ext->extLength - 2048;
@@ -239,6 +420,20 @@ int verifyCDR(struct fileEntry *fe) {
 	}
     } while (processed < ext->extLength);
 
+    /* AEDs were written right after the FileEntry, rewritten with it on error */
+    for( i = 0; i < aedBlocks && rv == 0; i++ ) {
+	if( devicetype == DISK_IMAGE ) {
+	    printf("Verify %d\n", pbnFE + 1 + i);
+	    stat = 0;
+	} else
+	    stat = readCD(device, sectortype, pbnFE + 1 + i, 1, blockBuffer);
+
+	if( stat ) {
+	    printf("readError %d : %s\n", pbnFE + 1 + i, get_sense_string());
+	    rv++;
+	}
+    }
+
   FileEntryOnly:
     if( rv == 0 ) {				/* no errors in data, now verify FileEntry */
 	int retries;
@@ -265,11 +460,10 @@ int verifyCDR(struct fileEntry *fe) {
 
     setStrictRead(0);
 
-    rewriteBlkno = getNWA() + 1 - pd->partitionStartingLocation;		// NWA itself for revised FileEntry
+    /* NWA itself for revised FileEntry, followed by its AEDs */
+    rewriteBlkno = getNWA() + 1 + countAllocExtDescs(fe, extents) - pd->partitionStartingLocation;
 
-    fe->lengthAllocDescs = 0;
     for( ext = extents; ext->extLength; ext++ ) {
-	fe->lengthAllocDescs += sizeof(long_ad);
 	if( ext->extLocation.logicalBlockNum != 0 )
 	    continue;
 	ext->extLocation.logicalBlockNum = rewriteBlkno;
@@ -277,17 +471,18 @@ int verifyCDR(struct fileEntry *fe) {
 	if( ext->extLength & 2047 )
 	    break;
     }
-    fe->descTag.descCRCLength = sizeof(struct fileEntry) + fe->lengthExtendedAttr + fe->lengthAllocDescs - 16;
     return rv;
 }
 
 void readVATtable() {
     uint32_t 	blkno;
     struct fileEntry *fe;
+    static uint8_t feBuffer[2048];
 
     blkno = getNWA() - (devicetype == DISK_IMAGE ? 1 : 8);
     prevVATlbn = blkno;
-    fe = (struct fileEntry*)readTaggedBlock(blkno, ABSOLUTE);
+    /* copied, reading the VAT data reuses the block buffer holding its ICB */
+    fe = memcpy(feBuffer, readTaggedBlock(blkno, ABSOLUTE), 2048);
 
     if( fe->descTag.tagIdent != TAG_IDENT_FE ||  fe->icbTag.fileType != 0 )
 	fail("VAT ICB not found\n");
@@ -298,11 +493,82 @@ void readVATtable() {
     memset(vat, 0xFF, sizeVAT);				// later or not at all
     newVATindex = (fe->informationLength - 36) >> 2;
 
-    if( sizeof(*fe) + fe->lengthExtendedAttr + fe->informationLength <= 2048 ) {
-	memcpy(vat, fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr, fe->informationLength - 36);
+    readVATsize = fe->informationLength;
+    readVATnwa = blkno + (devicetype == DISK_IMAGE ? 1 : 8);
+    readVATblocks = malloc(((readVATsize + 2047) >> 11) * sizeof(uint32_t));
+    readVAT = malloc(sizeVAT);
+    if( readVATblocks == NULL || readVAT == NULL )
+	fail("malloc VAT copy failed\n");
+    memset(readVATblocks, 0xFF, ((readVATsize + 2047) >> 11) * sizeof(uint32_t));
+
+    if( (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB ) {
+	memcpy(vat, fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr, fe->informationLength);
     } else {
-	readExtents((char*)vat, 1, fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
+	int usesShort = (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT;
+
+	if( usesShort ) {
+	    short_ad	*ext = (short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
+	    uint32_t	page, i;
+
+	    for( page = 0; ext->extLength && page < (readVATsize + 2047) >> 11; ext++ )
+		for( i = 0; i < ext->extLength && page < (readVATsize + 2047) >> 11; i += 2048 )
+		    readVATblocks[page++] = ext->extPosition + (i >> 11);
+	}
+	readExtents((char*)vat, usesShort, fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
     }
+    memcpy(readVAT, vat, sizeVAT);
+    memset((uint8_t*)vat + newVATindex * 4, 0xFF, sizeVAT - newVATindex * 4);
+}
+
+/*	keptVATpage()
+ *	Whether 2048 byte page 'page' of a VAT of 'size' bytes is recorded unchanged
+ *	in the VAT read at startup, at block readVATblocks[page]
+ */
+static int keptVATpage(uint32_t page, uint32_t size) {
+    uint32_t	offset = page << 11;
+    uint32_t	len = size - offset < 2048 ? size - offset : 2048;
+
+    if( !readVAT || offset + len > readVATsize || readVATblocks[page] == 0xFFFFFFFF )
+	return 0;
+    return memcmp((uint8_t*)vat + offset, (uint8_t*)readVAT + offset, len) == 0;
+}
+
+
+/*	rememberVAT()
+ *	VAT just written at 'pbn' becomes the last VAT, a later writeVATtable()
+ *	of the same session (after a batch checkpoint) keeps its unchanged pages
+ *	and writes nothing when there was no change since
+ */
+static void rememberVAT(struct fileEntry *fe, uint32_t size, uint32_t pbn) {
+    uint32_t	pages = (size + 2047) >> 11;
+    uint32_t	*blocks, page, i;
+    uint32_t	*copy;
+    short_ad	*ext;
+
+    prevVATlbn = pbn;
+
+    blocks = realloc(readVATblocks, pages * sizeof(uint32_t));
+    copy = realloc(readVAT, sizeVAT);
+    if( blocks )
+	readVATblocks = blocks;
+    if( copy )
+	readVAT = copy;
+    if( !blocks || !copy ) {
+	free(readVAT);
+	readVAT = NULL;
+	return;
+    }
+
+    memset(readVATblocks, 0xFF, pages * sizeof(uint32_t));
+    if( (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT ) {
+	ext = (short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
+	for( page = 0; ext->extLength && page < pages; ext++ )
+	    for( i = 0; i < ext->extLength && page < pages; i += 2048 )
+		readVATblocks[page++] = ext->extPosition + (i >> 11);
+    }
+    memcpy(readVAT, vat, sizeVAT);
+    readVATsize = size;
+    readVATnwa = getNWA();
 }
 
 
@@ -313,12 +579,18 @@ writeVATtable()
     struct fileEntry *fe;
     uint64_t	i;
     int		stat, retries, size;
-    uint32_t	startBlk;
+    uint32_t	startBlk, pages, page, written, nExts, blk;
+    uint32_t	*kept;
     short_ad	*ext;
     uint16_t	udf_rev_le16;
 
     retries = 0;
 
+    /* nothing changed since the last VAT was read or written, it is still the last block */
+    if( readVAT && newVATindex == (readVATsize - 36) >> 2 && getNWA() == readVATnwa
+	&& memcmp(vat, readVAT, newVATindex * 4) == 0 )
+	return;
+
     id = (regid*)(&vat[newVATindex]);
     memset(id, 0, sizeof(regid));
     strcpy((char *)id->ident, UDF_ID_ALLOC);
@@ -335,34 +607,63 @@ writeVATtable()
     fe->icbTag.fileType = ICBTAG_FILE_TYPE_UNDEF;
     fe->fileLinkCount = 0;
 
+    /* pages of the VAT read which can be referenced again */
+    pages = (size + 2047) >> 11;
+    kept = calloc(pages, sizeof(uint32_t));
+    if( kept && sizeof(*fe) + size >= 2048 ) {
+	for( page = 0, nExts = 0; page < pages; page++ ) {
+	    kept[page] = keptVATpage(page, size);
+	    if( page == 0 || kept[page] != kept[page-1]
+		|| (kept[page] && readVATblocks[page] != readVATblocks[page-1] + 1) )
+		nExts++;
+	}
+	if( nExts > FE_SHORT_ADS )
+	    memset(kept, 0, pages * sizeof(uint32_t));
+    }
+
     for( retries = 0; retries < 8; retries++ ) {
 	startBlk = getNWA();
+	written = 0;
 
 	if( sizeof(*fe) + size < 2048 ) {
 	    fe->icbTag.flags = ICBTAG_FLAG_AD_IN_ICB;
 	    memcpy(fe->extendedAttrAndAllocDescs, vat, size);
 	    fe->lengthAllocDescs = cpu_to_le32(size);
 	} else {
-	    fe->logicalBlocksRecorded = (size + 2047) >> 11;
+	    fe->logicalBlocksRecorded = pages;
 	    fe->icbTag.flags = ICBTAG_FLAG_AD_SHORT;
 	    ext = (short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-	    ext->extLength = size;
-	    ext->extPosition = startBlk  - pd->partitionStartingLocation;
-	    fe->lengthAllocDescs = cpu_to_le32(16);
+
+	    /* changed pages are written in order from NWA, unchanged ones stay where they are */
+	    for( page = 0, nExts = 0; page < pages; page++ ) {
+		if( kept && kept[page] )
+		    blk = readVATblocks[page];
+		else
+		    blk = startBlk - pd->partitionStartingLocation + written++;
+
+		if( nExts == 0 || ext[nExts-1].extPosition + (ext[nExts-1].extLength >> 11) != blk ) {
+		    ext[nExts].extLength = 0;
+		    ext[nExts].extPosition = blk;
+		    nExts++;
+		}
+		ext[nExts-1].extLength += page + 1 < pages ? 2048 : size - (page << 11);
+	    }
+	    fe->lengthAllocDescs = cpu_to_le32(nExts * sizeof(short_ad));
 	}
 
-	fe->descTag.tagLocation = startBlk  - pd->partitionStartingLocation + fe->logicalBlocksRecorded;
+	fe->descTag.tagLocation = startBlk  - pd->partitionStartingLocation + written;
 	fe->descTag.descCRCLength = sizeof(*fe) + fe->lengthExtendedAttr + fe->lengthAllocDescs - sizeof(tag);
 	setChecksum(&fe->descTag);
 
 	for( i = 0; i < fe->logicalBlocksRecorded; i++ )
-	    writeCDR(vat + (i<<9));
+	    if( !kept || !kept[i] )
+		writeCDR(vat + (i<<9));
 
 	writeCDR(fe);
 
 	setStrictRead(1);
 
-	for( i = 0; i <= fe->logicalBlocksRecorded; i++ ) {	// "<=" so including FileEntry 
+	for( i = 0; i <= written; i++ ) {			// "<=" so including FileEntry 
 	    if( devicetype == DISK_IMAGE ) {
 		printf("Verify %llu\n", (unsigned long long int)(startBlk+i));
 		stat = 0;
@@ -380,8 +681,11 @@ writeVATtable()
 
     if( retries == 8 )
 	printf("*** writeVATtable rewrite FAILED\nLast VAT was at LBN %d\n", prevVATlbn); 
+    else
+	rememberVAT(fe, size, startBlk + written);
 
     setStrictRead(0);
+    free(kept);
 }
 
 
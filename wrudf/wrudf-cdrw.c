@@ -2,13 +2,29 @@
  *
  * PURPOSE
  *	Lowlevel IO routines.
- *	To minimise reading and writing packets wrudf uses a few 64kb packetbuffers.
+ *	To minimise reading and writing packets wrudf uses a cache of 64kb packetbuffers
+ *	(packetCacheSize, set by --cache) looked up by a hash on the packet start.
  *	Blocks to be read are preferentially taken from those buffers and updates written
  *	to the buffers. Buffers that are in-use will not be discarded.
- *	When a new buffer is required preferentially an unused not-dirty buffer gets overwritten.
- *	If not available, then a unused dirty buffer gets written and is then reused.
+ *	When a new buffer is required the least recently used not-dirty buffer gets overwritten.
+ *	If not available, then the least recently used dirty buffer is queued for writing
+ *	and is then reused.
  *	If no such buffer can be found the system panics.
  *
+ *	Dirty packets are written by a background flush thread. The foreground copies a
+ *	packet into a flush slot and continues; the flush thread writes queued slots in
+ *	ascending physical order (wrapping around like an elevator). Packets are also
+ *	queued ahead of time when more than half of the cache is dirty, so that clean
+ *	buffers are available for eviction. Reads of a packet still in a flush slot are
+ *	served from that slot. closeIO() queues all remaining dirty packets and waits for
+ *	the flush thread to finish.
+ *
+ *	Written packets are not verified one by one. Their slots are kept until the flush
+ *	thread verifies a whole batch of them with strict read error recovery, reading
+ *	physically consecutive packets together. Only packets failing verification get a
+ *	Sparing Table entry and are rewritten. With MMC2 drives WRITE AND VERIFY is used
+ *	instead.
+ *
  * COPYRIGHT
  *	This file is distributed under the terms of the GNU General Public
  *	License (GPL). Copies of the GPL can be obtained from:
@@ -28,6 +44,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/cdrom.h>		/* for CDROM_DRIVE_STATUS  */
@@ -37,13 +54,30 @@
 #include "bswap.h"
 
 
-#define MAXPKTBUFS	4
 struct packetbuf {
     uint32_t		inuse;
     uint32_t		dirty;
     uint32_t		bufNum;
     uint32_t		start;
     unsigned char	*pkt;
+    struct packetbuf	*hashNext;			/* chain of packets with same hash */
+    struct packetbuf	*lruPrev, *lruNext;		/* lruHead is most recently used */
+};
+
+#ifdef MMC2
+#define DEFERRED_VERIFY		0			/* WRITE AND VERIFY checks every packet */
+#else
+#define DEFERRED_VERIFY		1
+#endif
+#define VERIFY_MAX_PACKETS	4			/* READ CD transfers at most 255 blocks */
+
+enum flushState { SLOT_FREE, SLOT_QUEUED, SLOT_WRITING, SLOT_WRITTEN };
+struct flushslot {
+    enum flushState	state;
+    uint32_t		start;
+    uint32_t		physical;			/* where written, for verify */
+    uint32_t		seq;				/* newer copies have higher seq */
+    unsigned char	*pkt;				/* copy of packet to be written */
 };
 
 int			lastTrack;
@@ -53,7 +87,25 @@ u_char *rerp_buffer;
 struct cdrom_cacheparams		*cp;
 u_char *cp_buffer;
 
-struct packetbuf pktbuf[MAXPKTBUFS+1];			/* last one special use */
+uint32_t	packetCacheSize = DEFAULT_PACKET_CACHE;
+struct udf_sparing_map	sparingMap;
+
+static struct packetbuf	*pktbuf;
+static struct packetbuf	**pktHash;
+static uint32_t		pktHashMask;
+static struct packetbuf	*lruHead, *lruTail;
+static uint32_t		dirtyPackets;
+
+static struct flushslot	*flushSlots;
+static uint32_t		numFlushSlots;
+static uint32_t		lastFlushed;			/* elevator position of flush thread */
+static uint32_t		flushSeq;
+static int		flushStop;
+static pthread_t	flushThread;
+static pthread_mutex_t	cacheLock = PTHREAD_MUTEX_INITIALIZER;	/* flush slots */
+static pthread_cond_t	flushWork = PTHREAD_COND_INITIALIZER;	/* slot queued or stop requested */
+static pthread_cond_t	flushDone = PTHREAD_COND_INITIALIZER;	/* slot written */
+static pthread_mutex_t	ioLock = PTHREAD_MUTEX_INITIALIZER;	/* device and sparing table */
 
 static unsigned char *verifyBuffer;					/* for verify only */
 static unsigned char *blockBuffer;
@@ -65,44 +117,338 @@ int	sectortype;					/* from track info for readCD() */
 /* declarations */
 struct packetbuf* findBuf(uint32_t blkno);
 int	readPacket(struct packetbuf* pb);
-int	writePacket(struct packetbuf* pb);
+int	writePacket(uint32_t start, unsigned char *pkt, uint32_t *written);
+static void queuePacket(struct packetbuf *pb);
+static void drainFlushQueue(void);
 
 
-/*	markBlock()
- *	FREE or ALLOC block in spacemap
+/*	Free space of the rewritable partition is kept in a pair of treaps of
+ *	extents built from the space bitmap, one ordered by address to merge
+ *	freed blocks with their neighbours, one by size for best fit allocation.
+ *	The bitmap is updated along with them and written back by finalise(),
+ *	the LVID free space count is set from freeBlocks at the same time.
  */
-void markBlock(enum markAction action, uint32_t blkno) {
+struct freeExtent {
+    uint32_t		start;				/* lbn */
+    uint32_t		length;				/* in blocks */
+    uint32_t		prio;
+    struct freeExtent	*link[2][2];			/* [tree][left, right] */
+};
+
+enum { BY_ADDR, BY_SIZE };
+
+static struct freeExtent	*freeRoot[2];
+uint32_t			freeBlocks;
+
+static int
+cmpExtent(int tree, struct freeExtent *a, struct freeExtent *b)
+{
+    if( tree == BY_SIZE && a->length != b->length )
+	return a->length < b->length ? -1 : 1;
+    if( a->start != b->start )
+	return a->start < b->start ? -1 : 1;
+    return 0;
+}
+
+static struct freeExtent*
+treapInsert(int tree, struct freeExtent *root, struct freeExtent *node)
+{
+    struct freeExtent	*child;
+    int			dir;
+
+    if( !root )
+	return node;
+
+    dir = cmpExtent(tree, node, root) > 0;
+    root->link[tree][dir] = treapInsert(tree, root->link[tree][dir], node);
+
+    child = root->link[tree][dir];
+    if( child->prio > root->prio ) {
+	root->link[tree][dir] = child->link[tree][!dir];
+	child->link[tree][!dir] = root;
+	return child;
+    }
+    return root;
+}
+
+static struct freeExtent*
+treapMerge(int tree, struct freeExtent *a, struct freeExtent *b)
+{
+    if( !a )
+	return b;
+    if( !b )
+	return a;
+
+    if( a->prio > b->prio ) {
+	a->link[tree][1] = treapMerge(tree, a->link[tree][1], b);
+	return a;
+    }
+    b->link[tree][0] = treapMerge(tree, a, b->link[tree][0]);
+    return b;
+}
+
+static struct freeExtent*
+treapRemove(int tree, struct freeExtent *root, struct freeExtent *node)
+{
+    int		dir;
+
+    if( root == node )
+	return treapMerge(tree, node->link[tree][0], node->link[tree][1]);
+
+    dir = cmpExtent(tree, node, root) > 0;
+    root->link[tree][dir] = treapRemove(tree, root->link[tree][dir], node);
+    return root;
+}
+
+/*	treapFind()
+ *	dir 1: smallest extent >= key, dir 0: largest extent <= key
+ */
+static struct freeExtent*
+treapFind(int tree, struct freeExtent *key, int dir)
+{
+    struct freeExtent	*node, *found = NULL;
+    int			cmp;
+
+    for( node = freeRoot[tree]; node; ) {
+	cmp = cmpExtent(tree, node, key);
+	if( cmp == 0 )
+	    return node;
+	if( (cmp > 0) == dir ) {
+	    found = node;
+	    node = node->link[tree][!dir];
+	} else
+	    node = node->link[tree][dir];
+    }
+    return found;
+}
+
+/*	treapNext()
+ *	Neighbour of 'node' in 'tree', dir 1: next, dir 0: previous
+ */
+static struct freeExtent*
+treapNext(int tree, struct freeExtent *node, int dir)
+{
+    struct freeExtent	*n, *found = NULL;
+    int			cmp;
+
+    for( n = freeRoot[tree]; n; ) {
+	cmp = cmpExtent(tree, n, node);
+	if( cmp != 0 && (cmp > 0) == dir ) {
+	    found = n;
+	    n = n->link[tree][!dir];
+	} else
+	    n = n->link[tree][dir];
+    }
+    return found;
+}
+
+static void
+addFreeExtent(uint32_t start, uint32_t length)
+{
+    static uint32_t	seed = 2463534242U;
+    struct freeExtent	*node;
+
+    node = calloc(1, sizeof(struct freeExtent));
+    if( !node )
+	fail("addFreeExtent: out of memory\n");
+
+    seed ^= seed << 13;					/* xorshift priorities */
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    node->start = start;
+    node->length = length;
+    node->prio = seed;
+    freeRoot[BY_ADDR] = treapInsert(BY_ADDR, freeRoot[BY_ADDR], node);
+    freeRoot[BY_SIZE] = treapInsert(BY_SIZE, freeRoot[BY_SIZE], node);
+}
+
+static void
+removeFreeExtent(struct freeExtent *node)
+{
+    freeRoot[BY_ADDR] = treapRemove(BY_ADDR, freeRoot[BY_ADDR], node);
+    freeRoot[BY_SIZE] = treapRemove(BY_SIZE, freeRoot[BY_SIZE], node);
+    free(node);
+}
+
+static void
+resizeFreeExtent(struct freeExtent *node, uint32_t start, uint32_t length)
+{
+    freeRoot[BY_ADDR] = treapRemove(BY_ADDR, freeRoot[BY_ADDR], node);
+    freeRoot[BY_SIZE] = treapRemove(BY_SIZE, freeRoot[BY_SIZE], node);
+    node->start = start;
+    node->length = length;
+    node->link[BY_ADDR][0] = node->link[BY_ADDR][1] = NULL;
+    node->link[BY_SIZE][0] = node->link[BY_SIZE][1] = NULL;
+    freeRoot[BY_ADDR] = treapInsert(BY_ADDR, freeRoot[BY_ADDR], node);
+    freeRoot[BY_SIZE] = treapInsert(BY_SIZE, freeRoot[BY_SIZE], node);
+}
+
+/*	Blocks start .. start+length-1 were allocated, are free now */
+static void
+treeFree(uint32_t start, uint32_t length)
+{
+    struct freeExtent	key, *prev, *next;
+
+    freeBlocks += length;
+    key.start = start;
+    prev = treapFind(BY_ADDR, &key, 0);
+    next = treapFind(BY_ADDR, &key, 1);
+
+    if( prev && prev->start + prev->length == start ) {
+	if( next && start + length == next->start ) {
+	    length += next->length;
+	    removeFreeExtent(next);
+	}
+	resizeFreeExtent(prev, prev->start, prev->length + length);
+    } else if( next && start + length == next->start )
+	resizeFreeExtent(next, start, next->length + length);
+    else
+	addFreeExtent(start, length);
+}
+
+/*	Blocks start .. start+length-1 were free, are allocated now */
+static void
+treeAlloc(uint32_t start, uint32_t length)
+{
+    struct freeExtent	key, *node;
+    uint32_t		before, after;
+
+    key.start = start;
+    node = treapFind(BY_ADDR, &key, 0);
+    if( !node || node->start + node->length < start + length )
+	fail("treeAlloc: blocks %u-%u not free\n", start, start + length - 1);
+
+    before = start - node->start;
+    after = node->start + node->length - (start + length);
+
+    if( before == 0 && after == 0 )
+	removeFreeExtent(node);
+    else if( before == 0 )
+	resizeFreeExtent(node, start + length, after);
+    else {
+	resizeFreeExtent(node, node->start, before);
+	if( after )
+	    addFreeExtent(start + length, after);
+    }
+    freeBlocks -= length;
+}
+
+
+/*	initFreeExtents()
+ *	Build the free extent trees from the space bitmap
+ */
+void
+initFreeExtents(void)
+{
+    uint32_t	blkno, start, bits;
+
+    if( !spaceMap )
+	return;
+
+    bits = spaceMap->numOfBits;
+    for( blkno = 0; blkno < bits; ) {
+	if( !(spaceMap->bitmap[blkno >> 3] & (1 << (blkno & 7))) ) {
+	    /* skip allocated blocks a byte at a time where possible */
+	    if( (blkno & 7) == 0 && spaceMap->bitmap[blkno >> 3] == 0 )
+		blkno += 8;
+	    else
+		blkno++;
+	    continue;
+	}
+	for( start = blkno; blkno < bits && (spaceMap->bitmap[blkno >> 3] & (1 << (blkno & 7))); ) {
+	    if( (blkno & 7) == 0 && blkno + 8 <= bits && spaceMap->bitmap[blkno >> 3] == 0xFF )
+		blkno += 8;
+	    else
+		blkno++;
+	}
+	addFreeExtent(start, blkno - start);
+	freeBlocks += blkno - start;
+    }
+}
+
+/*	freeFreeExtents()
+ *	Release the free extent trees
+ */
+void
+freeFreeExtents(void)
+{
+    while( freeRoot[BY_ADDR] )
+	removeFreeExtent(freeRoot[BY_ADDR]);
+    freeBlocks = 0;
+}
+
+
+/*	markBlocks()
+ *	FREE or ALLOC 'count' blocks from 'blkno' in spacemap and free extent trees.
+ *	Blocks already in the requested state are left alone.
+ */
+void markBlocks(enum markAction action, uint32_t blkno, uint32_t count) {
     uint8_t	*bm;
     uint8_t	mask;
-    uint32_t	value;
+    uint32_t	end, run;
 
     spaceMapDirty = 1;
-    bm = spaceMap->bitmap + (blkno >> 3);
-    mask = 1 << (blkno & 7);
-    memcpy(&value, &lvid->data[sizeof(uint32_t)*pd->partitionNumber], sizeof(value));
 
-    if( action == FREE ) {
-	*bm |= mask;
-	value++;
-    } else {
-	*bm &= ~mask;
-	value--;
+    for( end = blkno + count, run = 0; blkno < end; blkno++ ) {
+	bm = spaceMap->bitmap + (blkno >> 3);
+	mask = 1 << (blkno & 7);
+
+	if( ((*bm & mask) != 0) == (action == ALLOC) ) {	/* changes state */
+	    if( action == FREE )
+		*bm |= mask;
+	    else
+		*bm &= ~mask;
+	    run++;
+	} else if( run ) {
+	    if( action == FREE )
+		treeFree(blkno - run, run);
+	    else
+		treeAlloc(blkno - run, run);
+	    run = 0;
+	}
     }
+    if( run ) {
+	if( action == FREE )
+	    treeFree(blkno - run, run);
+	else
+	    treeAlloc(blkno - run, run);
+    }
+}
 
-    memcpy(&lvid->data[sizeof(uint32_t)*pd->partitionNumber], &value, sizeof(value));
+/*	markBlock()
+ *	FREE or ALLOC block in spacemap
+ */
+void markBlock(enum markAction action, uint32_t blkno) {
+    markBlocks(action, blkno, 1);
 }
 
+/*	setFreeSpaceCount()
+ *	Put the number of free blocks into the LVID
+ */
+void setFreeSpaceCount(void) {
+    if( spaceMap )
+	memcpy(&lvid->data[sizeof(uint32_t)*pd->partitionNumber], &freeBlocks, sizeof(freeBlocks));
+}
+
+#define MAX_EXTENTS	32
+
 /*	GetExtents()
  *	Try to find unallocated blocks for 'requestedLength' bytes in the rewritable partition
  *	Return short_ad's of lbns in the physical partition together satisfying that request
  *	Last extent has length < n * 2048; if exact multiple of 2048 the a final length 0 short_ad
+ *	The blocks are not allocated, markBlock() does that when they are written.
+ *
+ *	A single extent is preferred: the smallest free extent that holds the request,
+ *	starting at a packet boundary if the request is a packet or more. Otherwise the
+ *	largest free extents are combined.
  *
  *	Return value: lenAllocDescs if extents found, 0 if not.
  */
 int getExtents(uint32_t requestedLength, short_ad *extents) {
-    uint32_t	blkno, lengthFound = 0;
-    short_ad	*ext;
-    uint32_t	mask, *bm;
+    uint32_t	blocks, pad, n, i, j, found;
+    struct freeExtent	key, *node, *fit;
+    short_ad	*ext, tmp;
 
     if( medium == CDR ) {
 	/* check space availability */
@@ -116,61 +462,79 @@ int getExtents(uint32_t requestedLength, short_ad *extents) {
 	    return 8;
     }
 
-    // clear extents
+    blocks = (requestedLength + 2047) >> 11;
     ext = extents;
-    ext->extLength = 0;
-    bm = ((uint32_t*)spaceMap->bitmap) - 1;
-    mask = 0;
-    blkno = 0xFFFFFFFF;
 
-    while( lengthFound < requestedLength ) {
-	blkno++;
-	mask <<= 1;
-	if( mask == 0 ) {
-	    bm++;
-	    mask = 1;
-	    // check bm within limits
+    if( blocks > 0 ) {
+	key.length = blocks;
+	key.start = 0;
+	fit = NULL;
+	pad = 0;
+
+	for( node = treapFind(BY_SIZE, &key, 1); node; node = treapNext(BY_SIZE, node, 1) ) {
+	    if( !fit )
+		fit = node;				/* best fit, if not aligned */
+	    if( blocks < 32 )
+		break;
+	    n = (32 - (node->start & 31)) & 31;
+	    if( node->length >= blocks + n ) {
+		fit = node;
+		pad = n;
+		break;
+	    }
 	}
-	if( (*bm & mask) == 0 ) {			// if allocated
-	    if( ext->extLength != 0 ) {
-		ext++;
-		if( ext - extents > 31 ) {
+
+	if( fit ) {
+	    ext->extPosition = fit->start + pad;
+	    ext->extLength = blocks << 11;
+	    ext++;
+	} else {
+	    /* combine largest extents, not using the last one more than needed */
+	    key.length = 0xFFFFFFFF;
+	    for( found = 0, node = treapFind(BY_SIZE, &key, 0); found < blocks; node = treapNext(BY_SIZE, node, 0) ) {
+		if( !node || ext - extents >= MAX_EXTENTS ) {
 		    printf("GetExtents: Too many extents\n");
 		    return 0;
 		}
-		ext->extLength = 0;
+		n = node->length < blocks - found ? node->length : blocks - found;
+		ext->extPosition = node->start;
+		ext->extLength = n << 11;
+		found += n;
+		ext++;
+	    }
+
+	    /* write all but the partial last extent in ascending order */
+	    for( i = 1; i + 1 < (uint32_t)(ext - extents); i++ ) {
+		tmp = extents[i];
+		for( j = i; j > 0 && extents[j-1].extPosition > tmp.extPosition; j-- )
+		    extents[j] = extents[j-1];
+		extents[j] = tmp;
 	    }
-	    continue;
 	}
-	if( ext->extLength == 0 )
-	    ext->extPosition = blkno;
-	lengthFound += 2048;
-	ext->extLength += 2048;
+    } else {
+	ext->extLength = 0;
+	ext->extPosition = 0;
+	ext++;
     }
 
-    if( requestedLength != lengthFound  ) {
-	ext->extLength = ((ext->extLength & ~2047) | (requestedLength & 2047)) - 2048;
+    if( requestedLength & 2047 ) {
+	(ext-1)->extLength -= 2048 - (requestedLength & 2047);
     } else {
-	ext++;
 	ext->extLength = 0;
 	ext->extPosition = 0;
+	ext++;
     }
-    return (uint8_t*)ext - (uint8_t*)extents + sizeof(short_ad);
+    return (uint8_t*)ext - (uint8_t*)extents;
 }
 
 
 int
 freeShortExtents(short_ad* extents) 
 {
-    uint32_t blkno, lengthFreed;
     short_ad*	ext;
     
     for( ext = extents; extents->extLength != 0; ext++ ) {
-	blkno = ext->extPosition;
-	for( lengthFreed = 0 ; lengthFreed < ext->extLength; lengthFreed += 2048 ) {
-	    markBlock(FREE, blkno);
-	    blkno++;
-	}
+	markBlocks(FREE, ext->extPosition, (ext->extLength + 2047) >> 11);
 	if( ext->extLength & 2047 || (ext+1)->extLength == 0 )
 	    break;
     }
@@ -299,36 +663,44 @@ uint32_t	getPhysical(uint32_t lbn, uint16_t part) {
     return lbn + pd->partitionStartingLocation;
 }
 
-int cmpBlk(const void* a, const void* b) {		/* compare routine for sparing table lookup */
-    if( *(uint32_t*)a < ((struct sparingEntry*)b)->origLocation )
+/* compare routine for sorting the sparing table before it is written */
+static int cmpSparingEntry(const void* a, const void* b) {
+    if( ((struct sparingEntry*)a)->origLocation < ((struct sparingEntry*)b)->origLocation )
 	return -1;
-    if( *(uint32_t*)a > ((struct sparingEntry*)b)->origLocation )
+    if( ((struct sparingEntry*)a)->origLocation > ((struct sparingEntry*)b)->origLocation )
 	return 1;
     return 0;
 }
 
+/*	initSparingMap()
+ *	Load the remapped packets of the Sparing Table into sparingMap
+ */
+void initSparingMap(uint32_t packetLength) {
+    unsigned int	i;
+
+    udf_sparing_map_init(&sparingMap, packetLength);
+    for( i = 0; i < st->reallocationTableLen; i++ ) {
+	if( udf_sparing_map_add(&sparingMap, st->mapEntry[i].origLocation, st->mapEntry[i].mappedLocation) < 0 )
+	    fail("initSparingMap: out of memory\n");
+    }
+}
+
 /* 	If the original packet occurs in the Sparing Table return the mappedLocation
  *	else return the original packet address unchanged.
  */
 uint32_t lookupSparingTable(uint32_t original) {
-    struct sparingEntry* se;
-
     if( !st )					// no sparing table found
 	return original;
 
-    se = bsearch(&original, st->mapEntry, usedSparingEntries, sizeof(struct sparingEntry), cmpBlk);
-    
-    if( se )
-	return se->mappedLocation;
-    else
-	return original;
+    return udf_sparing_map_lookup(&sparingMap, original);
 }
 
 /*	Make an entry in the Sparing Table for packet 'original' and
  *	return the mappedLocation
+ *	The table is not kept sorted, updateSparingTable() sorts it.
  */
 uint32_t newSparingTableEntry(uint32_t original) {
-    struct sparingEntry *se, newEntry, swapEntry;
+    struct sparingEntry *se, *spare;
     uint32_t	mapped;
     unsigned int	i;
 
@@ -340,24 +712,23 @@ uint32_t newSparingTableEntry(uint32_t original) {
     if( usedSparingEntries == st->reallocationTableLen ) {
 	fail("SparingTable full\n");
     }
-	
-    se = bsearch(&original, &st->mapEntry[0], usedSparingEntries, sizeof(struct sparingEntry), cmpBlk);
 
-    if( se ) {					/* sparing a sparing packet */
-	se->origLocation = 0xFFFFFFF0;
+    spare = NULL;
+    for( i = 0; i < st->reallocationTableLen; i++ ) {
+	se = &st->mapEntry[i];
+	if( se->origLocation == original )	/* sparing a sparing packet */
+	    se->origLocation = 0xFFFFFFF0;
+	else if( se->origLocation == 0xFFFFFFFF && !spare )
+	    spare = se;
     }
-    newEntry.origLocation = original;
-    newEntry.mappedLocation = mapped = st->mapEntry[usedSparingEntries].mappedLocation;
+    if( !spare )
+	fail("SparingTable full\n");
+
+    spare->origLocation = original;
+    mapped = spare->mappedLocation;
+    if( udf_sparing_map_add(&sparingMap, original, mapped) < 0 )
+	fail("newSparingTableEntry: out of memory\n");
 
-    for( i = 0; i < usedSparingEntries; i++ ) {
-	if( st->mapEntry[i].origLocation < original )
-	    continue;
-    }
-    for(   ; i <= usedSparingEntries; i++ ) {
-	swapEntry = st->mapEntry[i];
-	st->mapEntry[i] = newEntry;
-	newEntry = swapEntry;
-    }
     usedSparingEntries++;
     st->sequenceNum++;
     sparingTableDirty = 1;
@@ -369,11 +740,12 @@ uint32_t newSparingTableEntry(uint32_t original) {
 }
 
 /*	updateSparingTable()
- *	Only done when quitting.
+ *	Only done when quitting or at a batch checkpoint, all copies are written
+ *	with the entries sorted.
  *	Do not verify writing as that would change the table again.
  */
 void updateSparingTable() {
-    size_t		i;
+    size_t		i, size;
     int			pbn, ret;
     off_t		off;
     ssize_t		len;
@@ -381,6 +753,11 @@ void updateSparingTable() {
     struct packetbuf	*pb;
     struct sparablePartitionMap *spm = (struct sparablePartitionMap*)lvd->partitionMaps;
 
+    /* packets already queued may still add sparing entries */
+    drainFlushQueue();
+
+    qsort(st->mapEntry, st->reallocationTableLen, sizeof(struct sparingEntry), cmpSparingEntry);
+
     for( i = 0; i < sizeof(spm->locSparingTable)/sizeof(spm->locSparingTable[0]); i++ ) {
 	pbn = spm->locSparingTable[i];
 	if( pbn == 0 )
@@ -388,6 +765,7 @@ void updateSparingTable() {
 
 	p = readBlock(pbn, ABSOLUTE);
 	pb = findBuf(pbn);
+	pthread_mutex_lock(&ioLock);
 	memcpy(p, st, sizeof(struct sparingTable) + st->reallocationTableLen * sizeof(struct sparingEntry));
 	p->descTag.tagLocation = pbn;
 	p->descTag.descCRCLength = 
@@ -401,12 +779,15 @@ void updateSparingTable() {
 	    off = lseek(device, 2048 * pbn, SEEK_SET);
 	    if( off == (off_t)-1 )
 		fail("writeSparingTable at %d: %s\n", pbn, strerror(errno));
-	    len = write(device, pb->pkt, 32 * 2048);
+	    /* only the table blocks, so that the image does not grow */
+	    size = (p->descTag.descCRCLength + sizeof(tag) + 2047) & ~2047;
+	    len = write(device, p, size);
 	    if( len < 0 )
 		fail("writeSparingTable at %d: %s\n", pbn, strerror(errno));
-	    if( len != 32 * 2048 )
+	    if( (size_t)len != size )
 		fail("writeSparingTable at %d: %s\n", pbn, strerror(EIO));
 	}
+	pthread_mutex_unlock(&ioLock);
     }
 }
 
@@ -418,8 +799,29 @@ readPacket(struct packetbuf* pb)
     off_t	off;
     ssize_t	len;
     uint32_t	physical;
+    uint64_t	start;
+    struct flushslot *fs, *found;
+
+    /* packet not yet written or verified by flush thread, take the newest copy */
+    pthread_mutex_lock(&cacheLock);
+    found = NULL;
+    for( fs = flushSlots; fs < flushSlots + numFlushSlots; fs++ ) {
+	if( fs->state != SLOT_FREE && fs->start == pb->start && (!found || fs->seq > found->seq) )
+	    found = fs;
+    }
+    if( found ) {
+	memcpy(pb->pkt, found->pkt, 32 * 2048);
+	pthread_mutex_unlock(&cacheLock);
+	UDF_PROBE(packet_read__hit, pb->start, 32);
+	if( udf_trace_enabled )
+	    udf_trace_hit(UDF_TRACE_PACKET_READ);
+	return 0;
+    }
+    pthread_mutex_unlock(&cacheLock);
 
+    pthread_mutex_lock(&ioLock);
     physical = lookupSparingTable(pb->start);
+    UDF_TRACE_START(packet_read, physical, 32, start);
 
     if( devicetype != DISK_IMAGE ) {
 	ret = readCD(device, sectortype, physical, 32, pb->pkt);
@@ -432,76 +834,319 @@ readPacket(struct packetbuf* pb)
 	len = read(device, pb->pkt, 32 * 2048);
 	if( len < 0 )
 	    fail("readPacket: read failed %s\n", strerror(errno));
-	if( len != 32 * 2048 )
+	if( len % 2048 )
 	    fail("readPacket: read failed %s\n", strerror(EIO));
+	/* last packet, e.g. the second sparing table, may extend beyond end of image */
+	if( len != 32 * 2048 )
+	    memset(pb->pkt + len, 0, 32 * 2048 - len);
 	ret = 0;
     }
+    UDF_TRACE_DONE(UDF_TRACE_PACKET_READ, packet_read, physical, ret ? -1 : 32 * 2048, start);
+    pthread_mutex_unlock(&ioLock);
     return ret;
 }
    
 
+/*	writePacket()
+ *	Only called by the flush thread, with ioLock held.
+ *	Physical location of the packet is returned in 'written',
+ *	without MMC2 it still has to be verified by verifyPackets().
+ */
 int 
-writePacket(struct packetbuf* pb) 
+writePacket(uint32_t start, unsigned char *pkt, uint32_t *written) 
 {
-    int		ret, retry;
+    int		ret;
     off_t	off;
     ssize_t	len;
     uint32_t	physical;
+    uint64_t	begin;
+#ifdef MMC2
+    int		retry;
+#endif
 
-    pb->dirty = 0;
-    physical = lookupSparingTable(pb->start);
+    physical = lookupSparingTable(start);
+    UDF_TRACE_START(packet_write, physical, 32, begin);
 
     if( devicetype != DISK_IMAGE ) {
+#ifdef MMC2
 	for(retry = 0; retry < 2; retry++ ) {
 	    if( retry != 0 )
-		physical = newSparingTableEntry(pb->start);
+		physical = newSparingTableEntry(start);
 
-	    ret = writeCD(device, physical, 32, pb->pkt);
+	    ret = writeVerifyCD(device, physical, 32, pkt);
 
-	    if( ret )
-		fail("writePacket: writeCD %s\n", get_sense_string());
-
-	    // must now verify write operation and spare if necessary
-	    // My HP8100 does not support Verify or WriteAndVerify
-	    // Use ReadCD with strict Read Error Recovery Parameters
-	    setStrictRead(1);
-	    ret = readCD(device, sectortype, physical, 32, verifyBuffer);
-
-	    if( ret == 0 ) {
-		setStrictRead(0);
-		return 0;
-	    }
-	    printf("writePacket: verify %s\n", get_sense_string());
+	    if( ret == 0 )
+		break;
+	    printf("writePacket: write and verify %s\n", get_sense_string());
 	}
-	setStrictRead(0);
+#else
+	ret = writeCD(device, physical, 32, pkt);
+
+	if( ret )
+	    fail("writePacket: writeCD %s\n", get_sense_string());
+#endif
     } else { // DISK_IMAGE
 #ifdef DEBUG_SPARING						// force sparing on packets of disk image 
 	if( st ) {
 	    if( physical == 0x820 || physical == 0x880 ) 	// arbitrary 'bad' blocks
-		physical = newSparingTableEntry(pb->start);
+		physical = newSparingTableEntry(start);
 	}
 #endif
 	off = lseek(device, 2048 * physical, SEEK_SET);
 	if( off == (off_t)-1 )
 	    fail("writePacket: writeHD failed %s\n", strerror(errno));
-	len = write(device, pb->pkt, 32 * 2048);
+	len = write(device, pkt, 32 * 2048);
 	if( len < 0 )
 	    fail("writePacket: writeHD failed %s\n", strerror(errno));
 	if( len != 32 * 2048 )
 	    fail("writePacket: writeHD failed %s\n", strerror(EIO));
 	ret = 0;
     }
+    UDF_TRACE_DONE(UDF_TRACE_PACKET_WRITE, packet_write, physical, ret ? -1 : 32 * 2048, begin);
+    *written = physical;
     return ret;
 }
 
 
+/*	verifyPackets()
+ *	Verify written packets with strict Read Error Recovery Parameters,
+ *	my HP8100 does not support Verify or WriteAndVerify.
+ *	'batch' is sorted by physical location, consecutive packets are read
+ *	together and read again one by one only if that fails. Failed packets
+ *	are spared and rewritten once. Called with ioLock held.
+ */
+static void
+verifyPackets(struct flushslot **batch, int n)
+{
+    int		i, j, k, ret;
+    uint32_t	physical;
+
+    setStrictRead(1);
+
+    for( i = 0; i < n; i = j ) {
+	for( j = i + 1; j < n && j - i < VERIFY_MAX_PACKETS; j++ ) {
+	    if( batch[j]->physical != batch[j-1]->physical + 32 )
+		break;
+	}
+
+	ret = readCD(device, sectortype, batch[i]->physical, 32 * (j - i), verifyBuffer);
+	if( ret == 0 )
+	    continue;
+
+	for( k = i; k < j; k++ ) {
+	    if( j - i > 1 && readCD(device, sectortype, batch[k]->physical, 32, verifyBuffer) == 0 )
+		continue;
+	    printf("writePacket: verify %s\n", get_sense_string());
+
+	    physical = newSparingTableEntry(batch[k]->start);
+	    if( writeCD(device, physical, 32, batch[k]->pkt) )
+		fail("writePacket: writeCD %s\n", get_sense_string());
+	    if( readCD(device, sectortype, physical, 32, verifyBuffer) )
+		printf("writePacket: verify %s\n", get_sense_string());
+	}
+    }
+
+    setStrictRead(0);
+}
+
+
+/*	flushThreadMain()
+ *	Write queued flush slots in ascending physical order, starting
+ *	from the last written packet and wrapping around
+ */
+static void*
+flushThreadMain(void *arg)
+{
+    struct flushslot	*fs, *next, *lowest, **batch;
+    uint32_t		written;
+    int			i, n;
+
+    (void)arg;
+    if( (batch = malloc(numFlushSlots * sizeof(*batch))) == NULL )
+	fail("malloc flushSlot failed\n");
+
+    pthread_mutex_lock(&cacheLock);
+    for(;;) {
+	next = lowest = NULL;
+	n = 0;
+	for( fs = flushSlots; fs < flushSlots + numFlushSlots; fs++ ) {
+	    if( fs->state == SLOT_WRITTEN ) {
+		/* insertion sort by physical location */
+		for( i = n++; i > 0 && batch[i-1]->physical > fs->physical; i-- )
+		    batch[i] = batch[i-1];
+		batch[i] = fs;
+	    }
+	    if( fs->state != SLOT_QUEUED )
+		continue;
+	    if( !lowest || fs->start < lowest->start )
+		lowest = fs;
+	    if( fs->start >= lastFlushed && (!next || fs->start < next->start) )
+		next = fs;
+	}
+	if( !next )
+	    next = lowest;
+
+	/* verify when nothing else is queued or half of slots waits for verify */
+	if( n > 0 && (!next || (uint32_t)n >= numFlushSlots / 2) ) {
+	    pthread_mutex_unlock(&cacheLock);
+
+	    pthread_mutex_lock(&ioLock);
+	    verifyPackets(batch, n);
+	    pthread_mutex_unlock(&ioLock);
+
+	    pthread_mutex_lock(&cacheLock);
+	    for( i = 0; i < n; i++ )
+		batch[i]->state = SLOT_FREE;
+	    pthread_cond_broadcast(&flushDone);
+	    continue;
+	}
+
+	if( !next ) {
+	    if( flushStop )
+		break;
+	    pthread_cond_wait(&flushWork, &cacheLock);
+	    continue;
+	}
+
+	next->state = SLOT_WRITING;
+	pthread_mutex_unlock(&cacheLock);
+
+	pthread_mutex_lock(&ioLock);
+	writePacket(next->start, next->pkt, &written);
+	pthread_mutex_unlock(&ioLock);
+
+	pthread_mutex_lock(&cacheLock);
+	lastFlushed = next->start;
+	next->physical = written;
+	if( DEFERRED_VERIFY && devicetype != DISK_IMAGE ) {
+	    /* older copies of the same packet do not need verify anymore */
+	    for( fs = flushSlots; fs < flushSlots + numFlushSlots; fs++ ) {
+		if( fs->state == SLOT_WRITTEN && fs->start == next->start )
+		    fs->state = SLOT_FREE;
+	    }
+	    next->state = SLOT_WRITTEN;
+	} else
+	    next->state = SLOT_FREE;
+	pthread_cond_broadcast(&flushDone);
+    }
+    pthread_mutex_unlock(&cacheLock);
+    free(batch);
+    return NULL;
+}
+
+/*	queuePacket()
+ *	Copy dirty packet to a flush slot for the flush thread, the packet buffer
+ *	is clean afterwards. A copy still waiting in the queue is just replaced.
+ */
+static void
+queuePacket(struct packetbuf *pb)
+{
+    struct flushslot	*fs, *slot;
+
+    pthread_mutex_lock(&cacheLock);
+    for(;;) {
+	slot = NULL;
+	for( fs = flushSlots; fs < flushSlots + numFlushSlots; fs++ ) {
+	    if( fs->state == SLOT_QUEUED && fs->start == pb->start ) {
+		slot = fs;
+		break;
+	    }
+	    if( fs->state == SLOT_FREE && !slot )
+		slot = fs;
+	}
+	if( slot )
+	    break;
+	pthread_cond_wait(&flushDone, &cacheLock);
+    }
+
+    memcpy(slot->pkt, pb->pkt, 32 * 2048);
+    slot->start = pb->start;
+    slot->seq = ++flushSeq;
+    slot->state = SLOT_QUEUED;
+    pthread_cond_signal(&flushWork);
+    pthread_mutex_unlock(&cacheLock);
+
+    pb->dirty = 0;
+    dirtyPackets--;
+}
+
+/*	drainFlushQueue()
+ *	Wait until the flush thread wrote and verified all queued packets
+ */
+static void
+drainFlushQueue(void)
+{
+    struct flushslot	*fs;
+
+    pthread_mutex_lock(&cacheLock);
+    for( fs = flushSlots; fs < flushSlots + numFlushSlots; fs++ ) {
+	while( fs->state != SLOT_FREE )
+	    pthread_cond_wait(&flushDone, &cacheLock);
+    }
+    pthread_mutex_unlock(&cacheLock);
+}
+
+static void
+lruUnlink(struct packetbuf *pb)
+{
+    if( pb->lruPrev )
+	pb->lruPrev->lruNext = pb->lruNext;
+    else
+	lruHead = pb->lruNext;
+    if( pb->lruNext )
+	pb->lruNext->lruPrev = pb->lruPrev;
+    else
+	lruTail = pb->lruPrev;
+}
+
+static void
+lruTouch(struct packetbuf *pb)
+{
+    if( pb == lruHead )
+	return;
+    lruUnlink(pb);
+    pb->lruPrev = NULL;
+    pb->lruNext = lruHead;
+    if( lruHead )
+	lruHead->lruPrev = pb;
+    else
+	lruTail = pb;
+    lruHead = pb;
+}
+
+static struct packetbuf**
+hashBucket(uint32_t start)
+{
+    return &pktHash[(start >> 5) & pktHashMask];
+}
+
+/*	rehashBuf()
+ *	Move packet buffer to the hash chain of its new start
+ */
+static void
+rehashBuf(struct packetbuf *pb, uint32_t start)
+{
+    struct packetbuf	**pp;
+
+    if( pb->start != 0xFFFFFFFF ) {
+	for( pp = hashBucket(pb->start); *pp != pb; pp = &(*pp)->hashNext )
+	    ;
+	*pp = pb->hashNext;
+    }
+
+    pb->start = start;
+    pp = hashBucket(start);
+    pb->hashNext = *pp;
+    *pp = pb;
+}
+
 struct packetbuf* 
 findBuf(uint32_t blkno) 
 {
     struct packetbuf *b;
 
     blkno &= ~31;
-    for(b = &pktbuf[0]; b < &pktbuf[MAXPKTBUFS]; b++ ) {
+    for( b = *hashBucket(blkno); b; b = b->hashNext ) {
 	if( blkno == b->start )
 	    return b;
     }
@@ -518,12 +1163,12 @@ getFreePacketBuffer(uint32_t lbn, uint16_t part)
     blkno = lbn + ( part == 0xFFFF ? 0 : pd->partitionStartingLocation ); 
     bFree = bMustWrite = NULL;
 
-    for( b = &pktbuf[0]; b < &pktbuf[MAXPKTBUFS]; b++ ) {
+    for( b = lruTail; b; b = b->lruPrev ) {
 	if( (b->inuse | b->dirty) == 0 ) {
 	    bFree = b;
 	    break;
 	} else
-	    if( b->inuse == 0 )
+	    if( b->inuse == 0 && !bMustWrite )
 		bMustWrite = b;
     }
 
@@ -533,13 +1178,11 @@ getFreePacketBuffer(uint32_t lbn, uint16_t part)
     }
 
     if( !bFree ) {
-	writePacket(bMustWrite);
-	bMustWrite->inuse = 0;
-	bMustWrite->dirty = 0;
+	queuePacket(bMustWrite);
 	bFree = bMustWrite;
     }
 
-    bFree->start = blkno & ~31;
+    rehashBuf(bFree, blkno & ~31);
     return bFree;
 }
 
@@ -559,6 +1202,7 @@ readBlock(uint32_t lbn, uint16_t part)
 	readPacket(b);
     }
 
+    lruTouch(b);
     b->inuse |= 0x80000000 >> (lbn & 31);
     return b->pkt + ((lbn & 31) << 11);
 }
@@ -572,7 +1216,9 @@ readSingleBlock(uint32_t pbn)
     ssize_t len;
 
     if( devicetype != DISK_IMAGE ) {
+	pthread_mutex_lock(&ioLock);
 	ret = readCD(device, sectortype, pbn, 1, blockBuffer);
+	pthread_mutex_unlock(&ioLock);
 	if( ret ) {
 	    if( ! ignoreReadError )
 		printf("readSingleBlock: %s\n", get_sense_string());
@@ -580,10 +1226,14 @@ readSingleBlock(uint32_t pbn)
 	} else 
 	    return blockBuffer;
     } else {
-	off = lseek(device, 2048 * pbn, SEEK_SET);
-	if( off != (off_t)-1 )
+	pthread_mutex_lock(&ioLock);
+	off = lseek(device, 2048 * (off_t)pbn, SEEK_SET);
+	if( off == (off_t)-1 ) {
+	    pthread_mutex_unlock(&ioLock);
 	    return NULL;
+	}
 	len = read(device, blockBuffer, 2048);
+	pthread_mutex_unlock(&ioLock);
 	if( len != 2048 )
 	    return NULL;
 	else
@@ -610,6 +1260,23 @@ freeBlock(uint32_t lbn, uint16_t part)
 }
 
 
+/*	flushAhead()
+ *	Keep clean buffers available, write least recently used packets in background
+ */
+static void
+flushAhead(void)
+{
+    struct packetbuf	*pb;
+
+    if( dirtyPackets > packetCacheSize / 2 ) {
+	for( pb = lruTail; pb && dirtyPackets > packetCacheSize / 4; pb = pb->lruPrev ) {
+	    if( pb->dirty && !pb->inuse )
+		queuePacket(pb);
+	}
+    }
+}
+
+
 void 
 dirtyBlock(uint32_t lbn, uint16_t part) 
 {
@@ -622,7 +1289,11 @@ dirtyBlock(uint32_t lbn, uint16_t part)
     if( !pb )
 	fail("dirtyBlock failed on block %d\n", blkno);
 
+    if( !pb->dirty )
+	dirtyPackets++;
     pb->dirty |=  0x80000000 >> (blkno & 31);		/* turn on DIRTY bit */
+
+    flushAhead();
 }
 
 void
@@ -689,8 +1360,8 @@ readExtents(char* dest, int usesShort, void* extents)
 {
     uint	len, blkno, partitionNumber;
     char	*p;
-    long_ad	*lo;
-    short_ad	*sh;
+    long_ad	*lo = NULL;
+    short_ad	*sh = NULL;
 
     if( usesShort ) {
 	sh = (short_ad*) extents;
@@ -709,9 +1380,9 @@ readExtents(char* dest, int usesShort, void* extents)
 	memcpy(dest, p, 2048);
 	freeBlock(blkno, partitionNumber);
 	dest += 2048;
-	if( len < 2048 )
-	    break;
-	if( len == 0 ) {
+	if( len <= 2048 ) {
+	    if( len < 2048 )				/* partial block ends the data */
+		break;
 	    if( usesShort ) {
 		sh++;
 		len = sh->extLength;
@@ -733,6 +1404,75 @@ readExtents(char* dest, int usesShort, void* extents)
 }    
 
 
+/*	writeFileExtents()
+ *	Write 'length' bytes read from file 'fd' to the short_ad 'extents' in the
+ *	rewritable partition and mark the blocks allocated. Whole packets are read
+ *	from the file straight into a packet buffer, which is not read from the
+ *	medium first as it gets completely overwritten.
+ */
+int
+writeFileExtents(int fd, short_ad *extents, uint64_t length)
+{
+    short_ad	*ext;
+    struct packetbuf *pb;
+    uint32_t	blkno, blocks;
+    uint64_t	left;
+    ssize_t	len;
+    char	*p;
+
+    left = (length + 2047) >> 11;			/* blocks still to be written */
+
+    for( ext = extents; left > 0; ext++ ) {
+	blkno = ext->extPosition;
+	blocks = (ext->extLength + 2047) >> 11;
+	if( blocks == 0 )
+	    return CMND_FAILED;
+
+	while( blocks > 0 && left > 0 ) {
+	    if( (blkno & 31) == 0 && blocks >= 32 && left >= 32 ) {
+		pb = findBuf(getPhysical(blkno, pd->partitionNumber));
+		if( !pb )
+		    pb = getFreePacketBuffer(blkno, pd->partitionNumber);
+		if( !pb )
+		    return CMND_FAILED;
+		lruTouch(pb);
+
+		len = readFull(fd, pb->pkt, 32 * 2048);
+		if( len < 0 )
+		    return CMND_FAILED;
+		memset(pb->pkt + len, 0, 32 * 2048 - len);
+
+		markBlocks(ALLOC, blkno, 32);
+		if( !pb->dirty )
+		    dirtyPackets++;
+		pb->dirty = 0xFFFFFFFF;
+		flushAhead();
+
+		blkno += 32;
+		blocks -= 32;
+		left -= 32;
+	    } else {
+		p = readBlock(blkno, pd->partitionNumber);
+		len = readFull(fd, p, 2048);
+		if( len < 0 ) {
+		    freeBlock(blkno, pd->partitionNumber);
+		    return CMND_FAILED;
+		}
+		memset(p + len, 0, 2048 - len);
+		markBlock(ALLOC, blkno);
+		dirtyBlock(blkno, pd->partitionNumber);
+		freeBlock(blkno, pd->partitionNumber);
+
+		blkno++;
+		blocks--;
+		left--;
+	    }
+	}
+    }
+    return CMND_OK;
+}
+
+
 int
 writeExtents(char* src, int usesShort, void* extents) 
 {
@@ -779,10 +1519,57 @@ writeExtents(char* src, int usesShort, void* extents)
 }    
 
 
+/*	initPacketCache()
+ *	Allocate packetCacheSize packet buffers, half as many flush slots
+ *	and start the flush thread
+ */
+static void
+initPacketCache(void)
+{
+    struct packetbuf	*pb;
+    uint32_t		i;
+
+    if( (pktbuf = calloc(packetCacheSize, sizeof(struct packetbuf))) == NULL )
+	fail("malloc packetBuffer failed\n");
+
+    for( pktHashMask = 1; pktHashMask < 2 * packetCacheSize; pktHashMask <<= 1 )
+	;
+    if( (pktHash = calloc(pktHashMask, sizeof(struct packetbuf*))) == NULL )
+	fail("malloc packetBuffer failed\n");
+    pktHashMask--;
+
+    for( i = 0; i < packetCacheSize; i++ ) {
+	pb = &pktbuf[i];
+	pb->start = 0xFFFFFFFF;
+	pb->pkt = malloc(32*2048);
+	pb->bufNum = i + 1;
+	if( pb->pkt == NULL )
+	    fail("malloc packetBuffer failed\n");
+	pb->lruPrev = lruTail;
+	if( lruTail )
+	    lruTail->lruNext = pb;
+	else
+	    lruHead = pb;
+	lruTail = pb;
+    }
+
+    numFlushSlots = packetCacheSize / 2;
+    if( (flushSlots = calloc(numFlushSlots, sizeof(struct flushslot))) == NULL )
+	fail("malloc flushSlot failed\n");
+    for( i = 0; i < numFlushSlots; i++ ) {
+	flushSlots[i].state = SLOT_FREE;
+	if( (flushSlots[i].pkt = malloc(32*2048)) == NULL )
+	    fail("malloc flushSlot failed\n");
+    }
+
+    if( pthread_create(&flushThread, NULL, flushThreadMain, NULL) )
+	fail("Cannot create flush thread\n");
+}
+
+
 int
 initIO(char *filename) 
 {
-    struct packetbuf *pb;
     int		rv;
     off_t	off;
     ssize_t	len;
@@ -813,15 +1600,8 @@ initIO(char *filename)
 	    fail("initIO: read %s failed: %s\n", filename, strerror(EIO));
 	medium = ident == TAG_IDENT_VDP ? CDR : CDRW;
 
-	if( medium == CDRW ) {
-	    for( pb = pktbuf, rv = 1; pb <= pktbuf + MAXPKTBUFS; pb++ ) {
-		pb->start = 0xFFFFFFFF;
-		pb->pkt = malloc(32*2048);
-		pb->bufNum = rv++;
-		if( pb->pkt == NULL )
-		    fail("malloc packetBuffer failed\n");
-	    }
-	}
+	if( medium == CDRW )
+	    initPacketCache();
     }
 
     if( (blockBuffer = malloc(2048)) == NULL )
@@ -863,15 +1643,9 @@ initIO(char *filename)
     }
 
     if( medium == CDRW ) {
-	for( pb = pktbuf, rv = 1; pb <= pktbuf + MAXPKTBUFS; pb++ ) {
-	    pb->start = 0xFFFFFFFF;
-	    pb->pkt = malloc(32*2048);
-	    pb->bufNum = rv++;
-	    if( pb->pkt == NULL )
-		fail("malloc packetBuffer failed\n");
-	}
-	if( (verifyBuffer = malloc(32 * 2048)) == NULL )
+	if( (verifyBuffer = malloc(VERIFY_MAX_PACKETS * 32 * 2048)) == NULL )
 	    fail("malloc verifyBuffer failed\n");
+	initPacketCache();
     }
 
     if( medium == CDR ) {
@@ -927,20 +1701,55 @@ initIO(char *filename)
 }	
 
 
+/*	syncIO()
+ *	Queue all dirty packets and wait until the flush thread wrote and
+ *	verified them. Unlike closeIO() the packet cache stays in use.
+ */
+void
+syncIO(void)
+{
+    struct packetbuf *pb;
+
+    if( medium != CDRW || !pktbuf )
+	return;
+
+    for( pb = pktbuf; pb < pktbuf + packetCacheSize; pb++ ) {
+	if( pb->dirty && !pb->inuse )
+	    queuePacket(pb);
+    }
+    drainFlushQueue();
+}
+
+
 int 
 closeIO(void) 
 {
     struct packetbuf *pb;
+    uint32_t	i;
 
-    if( medium == CDRW ) {
-	for( pb = pktbuf; pb < pktbuf + MAXPKTBUFS; pb++ ) {
+    if( medium == CDRW && pktbuf ) {
+	for( pb = pktbuf; pb < pktbuf + packetCacheSize; pb++ ) {
 	    if( pb->dirty && !pb->inuse )
-		writePacket(pb);
+		queuePacket(pb);
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	flushStop = 1;
+	pthread_cond_signal(&flushWork);
+	pthread_mutex_unlock(&cacheLock);
+	pthread_join(flushThread, NULL);
+
+	for( pb = pktbuf; pb < pktbuf + packetCacheSize; pb++ ) {
 	    if( pb->inuse || pb->dirty)
 		printf("PacketBuffet[%d] at %d inuse %08X  dirty %08X\n", 
 		    pb->bufNum, pb->start, pb->inuse, pb->dirty);
 	    free(pb->pkt);
 	}
+	for( i = 0; i < numFlushSlots; i++ )
+	    free(flushSlots[i].pkt);
+	free(flushSlots);
+	free(pktHash);
+	free(pktbuf);
     }
 
     if( blockBuffer ) free(blockBuffer);
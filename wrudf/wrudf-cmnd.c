@@ -16,7 +16,6 @@
 
 #include "config.h"
 
-#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -33,9 +32,36 @@ int	deleteDirectory(Directory *dir, struct fileIdentDesc *fid);
 Directory *makeDir(Directory *dir, char* name);
 int	questionOverwrite(Directory *dir, struct fileIdentDesc *fid, char* name);
 int	directoryIsEmpty(Directory *dir);
+static int takeDeferred(Directory *dir, long_ad *icb);
 
 char	*hdWorkingDir;
 
+static Directory *deferredDirs;		/* parked by releaseDirectory() in batch mode */
+
+/*	readFull()
+ *	Like read() but retries until 'count' bytes or end of file
+ */
+ssize_t
+readFull(int fd, void *buf, size_t count)
+{
+    size_t	done = 0;
+    ssize_t	len;
+
+    while( done < count ) {
+	len = read(fd, (char*)buf + done, count - done);
+	if( len < 0 ) {
+	    if( errno == EINTR )
+		continue;
+	    return -1;
+	}
+	if( len == 0 )
+	    break;
+	done += len;
+    }
+    return done;
+}
+
+
 /*	copyFile()
  *	Write File Entry immediately followed by data
  *	A verify error on CDR causes a further packet with
@@ -52,14 +78,16 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
     struct fileEntry *fe;
     struct allocDescImpUse *adiu;
     struct logicalVolIntegrityDescImpUse *lvidiu;
-    uint8_t	p[2048];
 
     fd = open(inName, O_RDONLY);
-    if( fd == 0 ) {
+    if( fd < 0 ) {
 	printf("'%s' does not exist\n", inName);
 	return CMND_FAILED;
     }
 
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
     printf("Copy file %s\n", inName);
     fid = findFileIdentDesc(dir, newName);
 
@@ -102,27 +130,36 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
 	 *
 	 *	Variable packet length restricted by drive buffer size.
 	 *	Must break up long file over several var packets.
-	 *	Only 116 long_ad's fit in fileEntry without going to extended alloc descs
+	 *	The long_ad's which do not fit in fileEntry continue in
+	 *	Allocation Extent Descriptors written right after it
 	 */
-	long_ad	*ad;
-	uint32_t	loc;
+	long_ad		*extents, *ad;
+	uint8_t		*aeds, *buf;
+	uint32_t	loc, nExtents, capacity, nAEDs, count, retries;
+	uint64_t	offset;
+	int		rv;
 
 	maxVarPktSize = getMaxVarPktSize();
-	
-	if( fe->informationLength / maxVarPktSize > 116 ) {
-	    printf("Cannot handle files longer than %d\n", 116 * maxVarPktSize);
+	nExtents = (fe->informationLength + maxVarPktSize - 1) / maxVarPktSize;
+	capacity = nExtents + 2 + 2 * MAX_BAD_BLOCKS;
+	extents = calloc(capacity, sizeof(long_ad));
+	buf = malloc(maxVarPktSize);
+	aeds = NULL;
+
+	if( !extents || !buf ) {
+	    printf("Not enough memory for file data\n");
 	    close(fd);
+	    free(extents);
+	    free(buf);
 	    free(fe);
 	    free(fid);
 	    return CMND_FAILED;
 	}
 
 	fe->icbTag.flags |= ICBTAG_FLAG_AD_LONG;
-	/* +1 as the fileEntry itself occupies block NWA */
-	loc = getNWA() + 1 - pd->partitionStartingLocation;
 	nBytes = (uint32_t) fe->informationLength ;
 
-	for( ad = (long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr); nBytes > 0; ad++ ) {
+	for( ad = extents; nBytes > 0; ad++ ) {
 	    if( nBytes > maxVarPktSize ) {
 		ad->extLength = maxVarPktSize;
 		nBytes -= maxVarPktSize;
@@ -130,58 +167,70 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
 		ad->extLength = nBytes;
 		nBytes = 0;
 	    }
-	    ad->extLocation.logicalBlockNum = loc;
-	    ad->extLocation.partitionReferenceNum = pd->partitionNumber;
-	    adiu = (struct allocDescImpUse*)(ad->impUse);
-	    memcpy(&adiu->impUse, &fe->uniqueID, sizeof(uint32_t));
-	    loc += ((ad->extLength + 2047) >> 11) + 7;
 	}
 
-	if( ((ad-1)->extLength & 2047) == 0 ) {
-	    memset(ad, 0, sizeof(long_ad));
+	/* +1 as the fileEntry itself occupies block NWA, followed by its AEDs */
+	loc = getNWA() + 1 + countAllocExtDescs(fe, extents) - pd->partitionStartingLocation;
+
+	for( ad = extents; ; ad++ ) {
 	    adiu = (struct allocDescImpUse*)(ad->impUse);
 	    memcpy(&adiu->impUse, &fe->uniqueID, sizeof(uint32_t));
-	    ad++;
+	    if( ad->extLength == 0 )
+		break;
+	    ad->extLocation.logicalBlockNum = loc;
+	    ad->extLocation.partitionReferenceNum = pd->partitionNumber;
+	    loc += ((ad->extLength + 2047) >> 11) + 7;
 	}
 
-	fe->lengthAllocDescs = (uint8_t*)ad - (fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-	fe->descTag.descCRCLength = sizeof(struct fileEntry) + 
-	    fe->lengthExtendedAttr + fe->lengthAllocDescs - sizeof(tag);
 	fe->descTag.tagLocation = newVATentry();
 
-	for( ;; ) {	    					/* retry loop for verify failure */
-	    int		blknoFE, skipped, retries;
-	    long_ad	*extent;
+	for( retries = 0; ; ) {	    			/* retry loop for verify failure */
+	    int		blknoFE;
 
+	    nAEDs = countAllocExtDescs(fe, extents);
+	    aeds = realloc(aeds, (nAEDs + 1) * 2048);
+	    if( !aeds ) {
+		printf("Not enough memory for Allocation Extent Descriptors\n");
+		break;
+	    }
+	    setLongExtents(fe, extents, aeds, getNWA() + 1 - pd->partitionStartingLocation);
 	    setChecksum(fe);
-	    skipped = 0;
-	    retries = 0;
-	    lseek(fd, 0, SEEK_SET);
 
-	    /* write FE */
+	    /* write FE and AEDs */
 	    blknoFE = vat[fe->descTag.tagLocation] = writeCDR(fe) - pd->partitionStartingLocation;
+	    for( i = 0; i < nAEDs; i++ )
+		writeCDR(aeds + 2048 * i);
 	    fid->icb.extLocation.logicalBlockNum = fe->descTag.tagLocation; 
 	    fid->icb.extLocation.partitionReferenceNum = virtualPartitionNum;
 
-	    /* write file data */
-	    extent = (long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-
-	    for( blkInPkt = nBytes = 0; nBytes < fe->informationLength; extent++ ) {
-		blkno = extent->extLocation.logicalBlockNum;
-		if( blkno < blknoFE ) {
-		    nBytes += extent->extLength;
-		    skipped = 1;
+	    /* write file data, extents written before FE are already verified */
+	    for( blkInPkt = 0, offset = 0, ad = extents; ad->extLength; offset += ad->extLength, ad++ ) {
+		blkno = ad->extLocation.logicalBlockNum;
+		if( blkno < blknoFE )
 		    continue;
-		}
-		for( i = 0; i < extent->extLength; blkno++, i += 2048 ) {
-		    memset(p, 0, 2048);
-		    if( skipped ) {
-			lseek(fd, nBytes, SEEK_SET);
-			skipped = 0;
+
+		if( devicetype == DISK_IMAGE )
+		    writeHDpad(blkno + pd->partitionStartingLocation);
+		lseek(fd, offset, SEEK_SET);
+
+		for( i = 0; i < ad->extLength; i += count << 11 ) {
+		    count = ((ad->extLength - i + 2047) >> 11);
+		    if( count > (maxVarPktSize >> 11) - blkInPkt )
+			count = (maxVarPktSize >> 11) - blkInPkt;
+
+		    nBytes = count << 11;
+		    if( nBytes > ad->extLength - i )
+			nBytes = ad->extLength - i;
+		    rv = readFull(fd, buf, nBytes);
+		    if( rv < 0 ) {
+			printf("Read of '%s' failed: %s\n", inName, strerror(errno));
+			rv = 0;
 		    }
-		    nBytes += read(fd, p, 2048);
-		    writeCDR(p);
-		    if( ++blkInPkt == (maxVarPktSize >> 11) ) {
+		    memset(buf + rv, 0, (count << 11) - rv);
+		    writeCDRBlocks(buf, count);
+
+		    blkInPkt += count;
+		    if( blkInPkt == (maxVarPktSize >> 11) ) {
 			syncCDR();
 			blkInPkt = 0;
 		    }
@@ -189,7 +238,8 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
 	    }
 
 	    syncCDR();
-	    if( verifyCDR(fe) == 0 ) 			// verify the file data
+	    rv = verifyCDR(fe, extents, capacity, nAEDs);	// verify the file data
+	    if( rv <= 0 ) 
 		break;
 
 	    if( retries++ > 3 ) {
@@ -197,6 +247,9 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
 		break;
 	    }
 	}
+	free(extents);
+	free(aeds);
+	free(buf);
     } else {
 	short_ad	*extent, extentFE[2];
 
@@ -230,13 +283,14 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
 
 	/* write file data */
 	extent = (short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-	for( nBytes = 0; nBytes < fe->informationLength; extent++ ) {
-	    blkno = extent->extPosition;
-	    for( i = 0; i < extent->extLength; blkno++, i += 2048 ) {
-		memset(p, 0, 2048);
-		nBytes += read(fd, p, 2048);
-		writeBlock(blkno, pd->partitionNumber, p);
-	    }	
+	if( writeFileExtents(fd, extent, fe->informationLength) != CMND_OK ) {
+	    printf("Read of '%s' failed: %s\n", inName, strerror(errno));
+	    freeShortExtents(extent);
+	    markBlock(FREE, fe->descTag.tagLocation);
+	    close(fd);
+	    free(fe);
+	    free(fid);
+	    return CMND_FAILED;
 	}
     }
 
@@ -416,7 +470,12 @@ readDirectory(Directory *parentDir, long_ad* icb, char *name)
     }
 
     if( dir->dirDirty )
-	updateDirectory(dir);
+	releaseDirectory(dir);
+
+    if( takeDeferred(dir, icb) ) {
+	printf("Reuse dir %s\n", dir->name);
+	return dir;
+    }
 
     dir->icb = *icb;
     if( name[0] ) {
@@ -450,6 +509,7 @@ readDirectory(Directory *parentDir, long_ad* icb, char *name)
 		freeLongExtents((long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr));
 	}
     }
+    indexDirectory(dir);
     printf("Read dir %s\n", dir->name);
     return dir;
 }
@@ -585,9 +645,14 @@ updateDirectory(Directory* dir)
 		for( i = 0; i < fe->informationLength; i += 2048 )
 		    writeCDR(dir->data + i);
 
-	    if( verifyCDR((struct fileEntry *)dir->fe) == 0 )
+	    if( verifyCDR(fe, (long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr),
+			  (2048 - sizeof(struct fileEntry) - fe->lengthExtendedAttr) / sizeof(long_ad), 0) == 0 )
 		break;
 
+	    if( (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) != ICBTAG_FLAG_AD_IN_ICB )
+		setLongExtents(fe, (long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr), NULL, 0);
+	    setChecksum(fe);
+
 	    if( ++retries > 3 ) {
 		printf("updateDirectory: '%s' failed\n", dir->name);
 		return CMND_FAILED;
@@ -600,6 +665,115 @@ updateDirectory(Directory* dir)
 }
 
 
+/*	swapDirectory()
+ *	Exchange contents of two Directory structures, their place in the chain
+ *	of current directories (parent, child) stays
+ */
+static void
+swapDirectory(Directory *a, Directory *b)
+{
+    Directory	tmp;
+
+    tmp = *a;
+    *a = *b;
+    *b = tmp;
+
+    b->parent = a->parent;
+    b->child = a->child;
+    b->nextDeferred = a->nextDeferred;
+    a->parent = tmp.parent;
+    a->child = tmp.child;
+    a->nextDeferred = tmp.nextDeferred;
+}
+
+
+/*	releaseDirectory()
+ *	Directory in the chain of current directories is going to be reused for
+ *	another one. Interactively it is written now. In batch mode a dirty one is
+ *	parked in memory until syncDirectories(), so going back and forth between
+ *	directories does not rewrite them again and again.
+ */
+int
+releaseDirectory(Directory *dir)
+{
+    Directory	*parked;
+
+    if( !batchMode )
+	return updateDirectory(dir);
+
+    if( !dir->dirDirty )
+	return CMND_OK;
+
+    parked = (Directory*)malloc(sizeof(Directory));
+    if( !parked )
+	return updateDirectory(dir);
+    memset(parked, 0, sizeof(Directory));
+    parked->dataSize = 4096;
+    parked->data = malloc(4096);
+    if( !parked->data ) {
+	free(parked);
+	return updateDirectory(dir);
+    }
+
+    swapDirectory(parked, dir);
+    parked->nextDeferred = deferredDirs;
+    deferredDirs = parked;
+    return CMND_OK;
+}
+
+
+/*	takeDeferred()
+ *	Move parked directory with ICB 'icb' back into 'dir' of the chain.
+ *	Return 1 when found, 0 when the directory has to be read from medium
+ */
+static int
+takeDeferred(Directory *dir, long_ad *icb)
+{
+    Directory	**pp, *parked;
+
+    for( pp = &deferredDirs; (parked = *pp); pp = &parked->nextDeferred ) {
+	if( parked->icb.extLocation.logicalBlockNum == icb->extLocation.logicalBlockNum
+	    && parked->icb.extLocation.partitionReferenceNum == icb->extLocation.partitionReferenceNum )
+	    break;
+    }
+    if( !parked )
+	return 0;
+
+    *pp = parked->nextDeferred;
+    swapDirectory(parked, dir);
+    free(parked->data);
+    free(parked->name);
+    free(parked->fidIndex);
+    free(parked);
+    return 1;
+}
+
+
+/*	syncDirectories()
+ *	Write all parked directories and dirty directories in the chain
+ *	of current directories
+ */
+int
+syncDirectories(void)
+{
+    Directory	*parked;
+    int		rv = CMND_OK;
+
+    while( (parked = deferredDirs) ) {
+	deferredDirs = parked->nextDeferred;
+	if( updateDirectory(parked) != CMND_OK )
+	    rv = CMND_FAILED;
+	free(parked->data);
+	free(parked->name);
+	free(parked->fidIndex);
+	free(parked);
+    }
+    if( updateDirectory(rootDir) != CMND_OK )
+	rv = CMND_FAILED;
+    return rv;
+}
+
+
 /*	Create subdirectory called 'name' in 'dir' 
  */
 Directory * 
@@ -658,7 +832,7 @@ makeDir(Directory *dir, char* name )
     newDir = dir->child;
 
     if( newDir != NULL ) 
-	updateDirectory(newDir);
+	releaseDirectory(newDir);
     else {
 	newDir = (Directory*)malloc(sizeof(Directory));
 	memset(newDir, 0, sizeof(Directory));
@@ -675,6 +849,7 @@ makeDir(Directory *dir, char* name )
     memcpy(&newDir->fe, fe, 2048);
     memcpy(newDir->data, backFid, fe->informationLength);
     newDir->dirDirty = 1;
+    indexDirectory(newDir);
 
     lvidiu = (struct logicalVolIntegrityDescImpUse*)
 	(lvid->data + 2 * sizeof(uint32_t) * lvid->numOfPartitions);
@@ -1111,6 +1286,16 @@ directoryIsEmpty(Directory *dir)
 int
 questionOverwrite(Directory *dir, struct fileIdentDesc *fid, char* name)
 {
+    if( batchMode ) {
+	/* nobody to ask, -f of the command answers */
+	if( !(options & OPT_FORCE) ) {
+	    printf("File %s already exists, use cp -f to overwrite\n", name);
+	    return 1;
+	}
+	deleteFID(dir, fid);
+	return 0;
+    }
+
     printf("File %s already exists. Overwrite ? (y/N) : ", name);
 #ifdef USE_READLINE
     readLine(NULL);
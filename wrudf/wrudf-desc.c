@@ -37,8 +37,9 @@ removeFID(Directory *dir, struct fileIdentDesc *fid)
     fe = (struct fileEntry *)dir->fe;
     fe->informationLength -= lenFID;
     lenMove = fe->informationLength - ((char *)fid - dir->data);
-    memcpy(fid, (char *)fid + lenFID, lenMove);
+    memmove(fid, (char *)fid + lenFID, lenMove);
     dir->dirDirty = 1;
+    indexDirectory(dir);				/* offsets of following FIDs changed */
     return 0;
 }
 
@@ -117,30 +118,56 @@ deleteFID(Directory * dir, struct fileIdentDesc * fid)
     return rv;
 }
 
-struct fileIdentDesc* 
-findFileIdentDesc(Directory *dir, char* name) 
+/*	hashName()
+ *	Hash of compressed unicode name, ASCII letters are folded to upper case
+ *	so names differing only in case land in the same bucket
+ */
+static uint32_t
+hashName(const dchars *name, size_t len)
 {
-    uint64_t		i;
-    char		*data;
-    struct fileEntry	*fe;
-    struct fileIdentDesc *fid;
-    dchars              uName[256];
-    size_t              uLen;
+    uint32_t	h = 2166136261U;
+    size_t	i;
+    uint8_t	c;
+
+    for( i = 0; i < len; i++ ) {
+	c = name[i];
+	if( c >= 'a' && c <= 'z' )
+	    c -= 'a' - 'A';
+	h = (h ^ c) * 16777619U;
+    }
+    return h;
+}
 
-    uLen = encode_locale(uName, name, 256);
-    if (uLen == (size_t)-1)
-        return NULL;
+static void
+indexInsert(Directory *dir, uint32_t offset)
+{
+    struct fileIdentDesc *fid = (struct fileIdentDesc*)(dir->data + offset);
+    uint32_t	slot;
+
+    slot = hashName(fid->impUseAndFileIdent + fid->lengthOfImpUse, fid->lengthFileIdent);
+    for( slot &= dir->fidIndexSize - 1; dir->fidIndex[slot]; slot = (slot + 1) & (dir->fidIndexSize - 1) )
+	;
+    dir->fidIndex[slot] = offset + 1;
+    dir->fidIndexUsed++;
+}
 
-    data = dir->data;
-    fe = (struct fileEntry *)dir->fe;
+/*	nextFID()
+ *	Offset of the named FID at or after 'offset' in directory data,
+ *	informationLength when there is none
+ */
+static uint64_t
+nextFID(Directory *dir, uint64_t offset)
+{
+    struct fileEntry	*fe = (struct fileEntry *)dir->fe;
+    struct fileIdentDesc *fid;
 
-    for( i = 0; i < fe->informationLength; 
-	 i += (sizeof(struct fileIdentDesc) + fid->lengthOfImpUse + fid->lengthFileIdent + 3) & ~3 ) {
+    for( ; offset < fe->informationLength; 
+	 offset += (sizeof(struct fileIdentDesc) + fid->lengthOfImpUse + fid->lengthFileIdent + 3) & ~3 ) {
 
-	fid = (struct fileIdentDesc*)(data + i);
+	fid = (struct fileIdentDesc*)(dir->data + offset);
 
 	if( fid->descTag.tagIdent == TAG_IDENT_TE )
-	    return NULL;
+	    return fe->informationLength;
 
 	if( fid->descTag.tagIdent == TAG_IDENT_IE ) {
 	    printf("Indirect Entry not yet implemented\n");
@@ -151,11 +178,69 @@ findFileIdentDesc(Directory *dir, char* name)
 
 	// check CRC
 
-	if( fid->fileCharacteristics == FID_FILE_CHAR_PARENT)
-	    continue;
+	if( fid->fileCharacteristics != FID_FILE_CHAR_PARENT)
+	    return offset;
+    }
+    return fe->informationLength;
+}
+
+/*	indexDirectory()
+ *	(Re)build the hash index of FIDs in directory data.
+ *	Table is kept at most half full.
+ */
+void
+indexDirectory(Directory *dir)
+{
+    uint64_t		i, end;
+    uint32_t		n, size;
+    struct fileIdentDesc *fid;
+
+    end = ((struct fileEntry *)dir->fe)->informationLength;
+
+    for( n = 0, i = nextFID(dir, 0); i < end; n++ ) {
+	fid = (struct fileIdentDesc*)(dir->data + i);
+	i = nextFID(dir, i + ((sizeof(struct fileIdentDesc) + fid->lengthOfImpUse + fid->lengthFileIdent + 3) & ~3));
+    }
+
+    for( size = 64; size < 2 * (n + 1); size <<= 1 )
+	;
+    if( size != dir->fidIndexSize ) {
+	free(dir->fidIndex);
+	if( !(dir->fidIndex = malloc(size * sizeof(uint32_t))) )
+	    fail("Malloc directory index failed\n");
+	dir->fidIndexSize = size;
+    }
+    memset(dir->fidIndex, 0, size * sizeof(uint32_t));
+    dir->fidIndexUsed = 0;
+
+    for( i = nextFID(dir, 0); i < end; ) {
+	indexInsert(dir, i);
+	fid = (struct fileIdentDesc*)(dir->data + i);
+	i = nextFID(dir, i + ((sizeof(struct fileIdentDesc) + fid->lengthOfImpUse + fid->lengthFileIdent + 3) & ~3));
+    }
+}
+
+struct fileIdentDesc* 
+findFileIdentDesc(Directory *dir, char* name) 
+{
+    uint32_t		slot;
+    struct fileIdentDesc *fid;
+    dchars              uName[256];
+    size_t              uLen;
+
+    uLen = encode_locale(uName, name, 256);
+    if (uLen == (size_t)-1)
+        return NULL;
+
+    if( !dir->fidIndex )
+	indexDirectory(dir);
+
+    slot = hashName(uName, uLen);
+    for( slot &= dir->fidIndexSize - 1; dir->fidIndex[slot]; slot = (slot + 1) & (dir->fidIndexSize - 1) ) {
+	fid = (struct fileIdentDesc*)(dir->data + dir->fidIndex[slot] - 1);
 
 	if( fid->lengthFileIdent == uLen
-	    && memcmp( fid->impUseAndFileIdent, uName, fid->lengthFileIdent) == 0 )
+	    && memcmp( fid->impUseAndFileIdent + fid->lengthOfImpUse, uName, fid->lengthFileIdent) == 0 )
 	    return fid;
     }
     return NULL;
@@ -245,5 +330,10 @@ insertFileIdentDesc(Directory *dir, struct fileIdentDesc* fid)
     memcpy(dir->data + fe->informationLength, fid, lenFid);
     fe->informationLength += lenFid;
     dir->dirDirty = 1;
+
+    if( !dir->fidIndex || 2 * (dir->fidIndexUsed + 1) > dir->fidIndexSize )
+	indexDirectory(dir);
+    else if( fid->fileCharacteristics != FID_FILE_CHAR_PARENT )
+	indexInsert(dir, fe->informationLength - lenFid);
     return CMND_OK;
 }
@@ -39,6 +39,8 @@ int	cmndc;
 int	cmndvSize;
 char**	cmndv;
 
+int	batchMode;			/* commands are read from manifest */
+
 #define FOUND_BEA01	1
 #define FOUND_NSR02	1<<1
 #define FOUND_TEA01	1<<2
@@ -254,6 +256,7 @@ initialise(char *devicename)
 		     if( st->mapEntry[j].origLocation < 0xFFFFFFF0 )
 			 usedSparingEntries++;
 		}
+		initSparingMap(spm->packetLength);
 	    } else if( strncmp((char *)spm->partIdent.ident, UDF_ID_VIRTUAL, strlen(UDF_ID_VIRTUAL)) == 0 )
 		virtualPartitionNum = i;
 	}
@@ -311,21 +314,27 @@ initialise(char *devicename)
 
 	if( spaceMap->descTag.tagIdent != TAG_IDENT_SBD )
 	    fail("SpaceBitmap not found\n");
+	initFreeExtents();
     }
 
     if (decode_string(NULL, fsd->fileSetIdent, fsdOut, sizeof(fsd->fileSetIdent), sizeof(fsdOut)) == (size_t)-1)
         fsdOut[0] = 0;
 
-    printf("You are going to update fileset '%s'\nProceed (y/N) : ", fsdOut);
-    GETLINE("");
+    if( batchMode ) {
+	/* manifest given on command line is the confirmation */
+	printf("Updating fileset '%s'\n", fsdOut);
+    } else {
+	printf("You are going to update fileset '%s'\nProceed (y/N) : ", fsdOut);
+	GETLINE("");
 
 #ifdef USE_READLINE
-    if( !line )
-	fail("wrudf terminated\n");
+	if( !line )
+	    fail("wrudf terminated\n");
 #endif
 
-    if( line[0] != 'y' )
-	fail("wrudf terminated\n");
+	if( line[0] != 'y' )
+	    fail("wrudf terminated\n");
+    }
 
     /* Read Logical Volume Integrity sequence */
     blkno = lvd->integritySeqExt.extLocation;
@@ -386,6 +395,8 @@ initialise(char *devicename)
 	return;
 
     if( lvid->integrityType == LVID_INTEGRITY_TYPE_OPEN ) {
+	if( batchMode )
+	    fail("Volume was not closed, batch mode does not proceed\n");
 	GETLINE("** Volume was not closed; do you wish to proceed (y/N) : ");
 	if( (line[0] | 0x20) != 'y' )
 	    exit(0);
@@ -427,15 +438,45 @@ initialise(char *devicename)
 }
 
 
-int 
-finalise(void) 
+/*	writeIntegrity()
+ *	Rewrite current Logical Volume Integrity Descriptor with integrity 'type'
+ */
+static void
+writeIntegrity(uint32_t type)
 {
-    int		i, lbn, len, size, blkno ;
+    int		size;
+    struct generic_desc *p;
+
+    setFreeSpaceCount();
+    lvid->integrityType = type;
+    updateTimestamp(0,0);
+    lvid->recordingDateAndTime = timeStamp;
+    lvid->descTag.tagLocation = integrityDescBlocknumber;
+    size = sizeof(struct logicalVolIntegrityDesc) + sizeof(struct logicalVolIntegrityDescImpUse) 
+	+ 2 * sizeof(uint32_t) * lvid->numOfPartitions;
+    lvid->descTag.descCRCLength = size - sizeof(tag);
+    setChecksum(lvid);
+    p = readBlock(integrityDescBlocknumber, ABSOLUTE);
+    memcpy(p, lvid, size);
+    dirtyBlock(integrityDescBlocknumber, ABSOLUTE);
+    freeBlock(integrityDescBlocknumber, ABSOLUTE);
+}
+
+
+/*	syncMetadata()
+ *	Write directories and volume metadata changed since the last call:
+ *	VAT on CDR, otherwise Space Bitmap, Sparing Table, closed LVID and USD.
+ *	Done when quitting and at checkpoints of batch mode.
+ */
+static int
+syncMetadata(void)
+{
+    int		i, lbn, len, size, blkno, rv;
     struct generic_desc 	*p;
     short_ad	*adSpaceMap;
     struct partitionHeaderDesc *phd;
 
-    updateDirectory(rootDir);				/* and any dirty children */
+    rv = syncDirectories();				/* parked ones and the current chain */
 
     if( medium == CDR ) {
 	writeVATtable();
@@ -453,24 +494,16 @@ finalise(void)
 		dirtyBlock(lbn, 0);
 		freeBlock(lbn++, 0);
 	    }
+	    spaceMapDirty = 0;
 	}
 
-	if( sparingTableDirty )
+	if( sparingTableDirty ) {
 	    updateSparingTable();
+	    sparingTableDirty = 0;
+	}
 
 	/* write closed Logical Volume Integrity Descriptor */
-	lvid->integrityType = LVID_INTEGRITY_TYPE_CLOSE;
-	updateTimestamp(0,0);
-	lvid->recordingDateAndTime = timeStamp;
-	lvid->descTag.tagLocation = integrityDescBlocknumber;
-	size = sizeof(struct logicalVolIntegrityDesc) + sizeof(struct logicalVolIntegrityDescImpUse) 
-	    + 2 * sizeof(uint32_t) * lvid->numOfPartitions;
-	lvid->descTag.descCRCLength = size - sizeof(tag);
-	setChecksum(lvid);
-	p = readBlock(integrityDescBlocknumber, ABSOLUTE);
-	memcpy(p, lvid, size);
-	dirtyBlock(integrityDescBlocknumber, ABSOLUTE);
-	freeBlock(integrityDescBlocknumber, ABSOLUTE);
+	writeIntegrity(LVID_INTEGRITY_TYPE_CLOSE);
 
 	/* terminating descriptor */
 	blkno = lvid->nextIntegrityExt.extLocation;
@@ -504,8 +537,39 @@ finalise(void)
 	    memcpy(p, usd, size);
 	    dirtyBlock(usd->descTag.tagLocation, ABSOLUTE);
 	    freeBlock(usd->descTag.tagLocation, ABSOLUTE);
+	    usd->descTag.tagLocation -=
+		extentRsrvVolDescSeq.extLocation - extentMainVolDescSeq.extLocation;
+	    usdDirty = 0;
 	}
     } // end not CDR				
+    return rv;
+}
+
+
+/*	syncCommand()
+ *	Checkpoint of batch mode, everything written so far is put on medium
+ *	as a closed volume, then the volume is opened again for further commands
+ */
+int
+syncCommand(void)
+{
+    int		rv;
+
+    if( cmndc != 0 )
+	return WRONG_NO_ARGS;
+
+    rv = syncMetadata();
+    syncIO();
+    if( medium != CDR )
+	writeIntegrity(LVID_INTEGRITY_TYPE_OPEN);
+    return rv;
+}
+
+
+int 
+finalise(void) 
+{
+    syncMetadata();
 
     closeIO();						/* clears packet buffers; closes device */
 
@@ -515,8 +579,10 @@ finalise(void)
     if(fsd) free(fsd);
     if(usd) free (usd);
     if(spaceMap) free(spaceMap);
+    freeFreeExtents();
     if(lvid) free(lvid);
     if(st)  free(st);
+    udf_sparing_map_free(&sparingMap);
     if(vat) free(vat);
     return 0;
 }
@@ -555,6 +621,7 @@ parseCmnd(char* line)
     else if( !strcmp(p, "lsh") )   cmnd = CMND_LSH;
     else if( !strcmp(p, "cdc") )   cmnd = CMND_CDC;
     else if( !strcmp(p, "cdh") )   cmnd = CMND_CDH;
+    else if( !strcmp(p, "sync") )  cmnd = CMND_SYNC;
     else if( !strcmp(p, "quit") )  cmnd = CMND_QUIT;
     else if( !strcmp(p, "exit") )  cmnd = CMND_QUIT;
     else if( !strcmp(p, "help") ) {
@@ -569,6 +636,7 @@ parseCmnd(char* line)
 	"\tcdc\n"
 	"\tcdh\n"
 	"Specify cdh/lsh or cdc/lsc to do cd or ls for Harddisk or CompactDisc.\n"
+	"\tsync\n"
 	"\tquit\n"
 	"\texit\n"
 	);
@@ -646,7 +714,10 @@ int show_help()
 	char *msg =
 	"Interactive tool to maintain a UDF filesystem.\n"
 	"Usage:\n"
-	"\twrudf [device]\n"
+	"\twrudf [--cache=packets] [--batch=manifest] [device]\n"
+	"Options:\n"
+	"\t--cache=packets    Number of 64kB packets cached for CD-RW (default: 32)\n"
+	"\t--batch=manifest   Run commands from manifest file, - for stdin, without questions\n"
 	"Available commands:\n"
 	"\tcp\n"
 	"\trm\n"
@@ -657,6 +728,7 @@ int show_help()
 	"\tcdc\n"
 	"\tcdh\n"
 	"Specify cdh/lsh or cdc/lsc to do cd or ls for Harddisk or CompactDisc.\n"
+	"\tsync      Write all changes to medium (checkpoint)\n"
 	"\tquit\n"
 	"\texit\n";
 	printf("%s", msg);
@@ -672,12 +744,44 @@ main(int argc, char** argv)
     char	*ptr;
     size_t	len;
     Directory	*d;
+    char	*batchName = NULL;
+    FILE	*batchFile = NULL;
+    char	*batchLine = NULL;
+    size_t	batchSize = 0;
+    unsigned int batchLineNum = 0, batchFailures = 0;
 
     setlocale(LC_CTYPE, "");
 
+    if( udf_trace_start("wrudf") < 0 )
+	fail("Cannot enable trace: %s\n", strerror(errno));
+
     printf("wrudf from " PACKAGE_NAME " " PACKAGE_VERSION "\n");
     devicename= "/dev/cdrom";
 
+    while( argc > 1 ) {
+	if( !strncmp(argv[1], "--cache=", 8) ) {
+	    packetCacheSize = strtoul(argv[1] + 8, &ptr, 10);
+	    if( *ptr || packetCacheSize < MIN_PACKET_CACHE ) {
+		printf("Packet cache must have at least %d packets\n", MIN_PACKET_CACHE);
+		return show_help();
+	    }
+	} else if( !strncmp(argv[1], "--batch=", 8) && argv[1][8] ) {
+	    batchName = argv[1] + 8;
+	} else
+	    break;
+	argv++;
+	argc--;
+    }
+
+    if( batchName ) {
+	batchFile = strcmp(batchName, "-") ? fopen(batchName, "r") : stdin;
+	if( !batchFile ) {
+	    printf("Open manifest '%s': %s\n", batchName, strerror(errno));
+	    return 1;
+	}
+	batchMode = 1;
+    }
+
     if( argc > 2 || (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "-help") || !strcmp(argv[1], "--help"))) )
 	return show_help();
     else if( argc == 2 )
@@ -691,37 +795,54 @@ main(int argc, char** argv)
     initialise(devicename);
 
     for(;;) {
-	d = rootDir;
-	prompt[0] = 0;
-	ptr = prompt;
-	while( curDir != d ) { 
-	    len = strlen(d->name);
-	    if( ptr + len + 1 >= prompt + sizeof(prompt) - 7 )
-	        break;
-	    memcpy(ptr, d->name, len);
-	    ptr[len] = '/';
-	    ptr += len + 1;
-	    d = d->child;
-	}
-	len = strlen(d->name);
-	if( ptr + len + 1 >= prompt + sizeof(prompt) - 7 ) {
-	    memcpy(ptr, "...", 3);
-	    ptr += 3;
-	} else if( d->name[0] == 0 ) {
-	    *(ptr++) = '/';
+	if( batchMode ) {
+	    if( getline(&batchLine, &batchSize, batchFile) < 0 )
+		break;
+	    batchLineNum++;
+	    batchLine[strcspn(batchLine, "\r\n")] = 0;
+	    for( ptr = batchLine; *ptr == ' ' || *ptr == '\t'; ptr++ )   ;
+	    if( *ptr == 0 || *ptr == '#' )
+		continue;
+
+	    cmnd = parseCmnd(ptr);
+	    if( cmnd == CMND_FAILED ) {
+		printf("%s:%u: Command not run\n", batchName, batchLineNum);
+		batchFailures++;
+		continue;
+	    }
 	} else {
-	    memcpy(ptr, d->name, len);
-	    ptr += len;
-	}
+	    d = rootDir;
+	    prompt[0] = 0;
+	    ptr = prompt;
+	    while( curDir != d ) { 
+		len = strlen(d->name);
+		if( ptr + len + 1 >= prompt + sizeof(prompt) - 7 )
+		    break;
+		memcpy(ptr, d->name, len);
+		ptr[len] = '/';
+		ptr += len + 1;
+		d = d->child;
+	    }
+	    len = strlen(d->name);
+	    if( ptr + len + 1 >= prompt + sizeof(prompt) - 7 ) {
+		memcpy(ptr, "...", 3);
+		ptr += 3;
+	    } else if( d->name[0] == 0 ) {
+		*(ptr++) = '/';
+	    } else {
+		memcpy(ptr, d->name, len);
+		ptr += len;
+	    }
 
-	memcpy(ptr, " > ", 4);
-	
-	GETLINE(prompt);
+	    memcpy(ptr, " > ", 4);
 
-	cmnd = parseCmnd(line);
+	    GETLINE(prompt);
 
-	if( cmnd == CMND_FAILED )
-	    continue;
+	    cmnd = parseCmnd(line);
+
+	    if( cmnd == CMND_FAILED )
+		continue;
+	}
 
 	if( cmnd == CMND_QUIT )
 	    break;
@@ -751,6 +872,17 @@ main(int argc, char** argv)
 	case CMND_CDH:
 	    rv = cdhCommand();
 	    break;
+	case CMND_SYNC:
+	    rv = syncCommand();
+	    break;
+	default:
+	    rv = cmnd;				/* parseCmnd() error */
+	    break;
+	}
+
+	if( batchMode && rv != CMND_OK ) {
+	    printf("%s:%u: ", batchName, batchLineNum);
+	    batchFailures++;
 	}
 
 	switch( rv ) {
@@ -791,5 +923,16 @@ main(int argc, char** argv)
 	}
     }
     free(hdWorkingDir);
-    return finalise();
+    rv = finalise();
+
+    if( batchMode ) {
+	free(batchLine);
+	if( batchFile != stdin )
+	    fclose(batchFile);
+	if( batchFailures ) {
+	    printf("%u commands of '%s' failed\n", batchFailures, batchName);
+	    return 1;
+	}
+    }
+    return rv;
 }
@@ -17,6 +17,7 @@
 
 
 #include <sys/time.h>
+#include <sys/types.h>
 #include <time.h>
 #include <stdint.h>
 #include <string.h>
@@ -59,11 +60,13 @@ enum RV { CMND_OK, CMND_FAILED, WRONG_NO_ARGS, CMND_ARG_INVALID, NOT_IN_RW_PARTI
 	  DIR_INVALID, EXISTING_DIR, EXISTING_FILE, DELETED_DIR, DELETED_FILE, DOES_NOT_EXIST,
 	  DIR_NOT_EMPTY, PERMISSION_DENIED, IS_DIRECTORY };
 
-enum CMND { CMND_CP = 50, CMND_RM, CMND_MKDIR, CMND_RMDIR, CMND_LSC, CMND_LSH, CMND_CDC, CMND_CDH, CMND_QUIT };
+enum CMND { CMND_CP = 50, CMND_RM, CMND_MKDIR, CMND_RMDIR, CMND_LSC, CMND_LSH, CMND_CDC, CMND_CDH, CMND_SYNC, CMND_QUIT };
 
 extern	int	cmndc;
 extern	char**	cmndv;
 
+extern	int		batchMode;		/* commands read from manifest, nobody to ask */
+
 extern	uint32_t	options;
 #define OPT_DUMMY	0x01
 #define OPT_FORCE	0x02
@@ -89,7 +92,11 @@ typedef struct _dir_ {
     long_ad		icb;				/* icb of this directory itself */
     char		*name;
     uint32_t		dirDirty;
+    uint32_t		*fidIndex;			/* hashed offsets + 1 of FIDs in data, 0 unused */
+    uint32_t		fidIndexSize;			/* power of 2 */
+    uint32_t		fidIndexUsed;
     uint8_t		fe[2048];
+    struct _dir_	*nextDeferred;			/* directories parked in batch mode */
 }   Directory;
 
 extern Directory		*rootDir, *curDir;
@@ -99,10 +106,14 @@ extern Directory		*rootDir, *curDir;
 #ifdef USE_READLINE
 char* readLine(char *prompt);
 #endif
+int	syncCommand(void);
 
 /* wrudf-cmnd.c */
 int	updateDirectory(Directory* dir);
+int	releaseDirectory(Directory *dir);
+int	syncDirectories(void);
 Directory *readDirectory(Directory *parentDir, long_ad *icb, char* name);
+ssize_t	readFull(int fd, void *buf, size_t count);
 
 int	cpCommand(void);
 int	rmCommand(void);
@@ -116,6 +127,7 @@ int	lshCommand(void);
 /* wrudf-desc.c */
 struct fileIdentDesc*	makeFileIdentDesc(char* name);
 struct fileIdentDesc*	findFileIdentDesc(Directory *dir, char* name);
+void			indexDirectory(Directory *dir);
 int			deleteFID(Directory *dir, struct fileIdentDesc *fid);
 int			removeFID(Directory *dir, struct fileIdentDesc *fid);
 int			insertFileIdentDesc(Directory *dir, struct fileIdentDesc* fid);
@@ -123,8 +135,18 @@ struct fileEntry*	makeFileEntry();
 
 
 /* wrudf-cdrw.c */
+#define DEFAULT_PACKET_CACHE	32		/* packet buffers of 64kb */
+#define MIN_PACKET_CACHE	4
+
+extern	uint32_t	packetCacheSize;
+
 enum markAction { FREE, ALLOC };
 void markBlock(enum markAction action, uint32_t blkno);
+void markBlocks(enum markAction action, uint32_t blkno, uint32_t count);
+void initFreeExtents(void);
+void freeFreeExtents(void);
+void setFreeSpaceCount(void);
+extern	uint32_t	freeBlocks;
 
 extern	int		lastTrack;
 extern	int		sectortype;
@@ -141,6 +163,8 @@ void	updateTimestamp(time_t t, uint32_t  ut);		/* current time if t = 0 */
 void	setStrictRead(int yes);
 uint32_t	getPhysical(uint32_t lbn, uint16_t part);
 void	updateSparingTable();
+void	initSparingMap(uint32_t packetLength);
+extern	struct udf_sparing_map	sparingMap;
 
 #define ABSOLUTE	0xFFFF				/* ignore partition, process physical blocknumber */
 /*	actually 0xFFFF is a perfectly valid partition number
@@ -158,19 +182,28 @@ void* 	readSingleBlock(uint32_t pbn);
 void* 	readTaggedBlock(uint32_t lbn, uint16_t part);
 int	readExtents(char* dest, int usesShort, void* extents);
 int	writeExtents(char* src, int usesShort, void* extents);
+int	writeFileExtents(int fd, short_ad *extents, uint64_t length);
 
 int	initIO(char *filename);
+void	syncIO(void);
 int	closeIO();
 
 /* wrudf-cdr.c */
+#define MAX_BAD_BLOCKS	32			/* per file split off by verifyCDR() */
+
 uint32_t	newVATentry();
 uint32_t	getNWA();
 uint32_t	getMaxVarPktSize();
 uint32_t	writeCDR(void* src);
+uint32_t	writeCDRBlocks(void* src, uint32_t n);
 void	syncCDR();
 void	writeHDlink();
+void	writeHDpad(uint32_t pbn);
 unsigned char*	readCDR(uint32_t lbn, uint16_t partition);
-int	verifyCDR(struct fileEntry *fe);
+uint32_t	countLongExtents(long_ad *extents);
+uint32_t	countAllocExtDescs(struct fileEntry *fe, long_ad *extents);
+void	setLongExtents(struct fileEntry *fe, long_ad *extents, uint8_t *aeds, uint32_t aedLbn);
+int	verifyCDR(struct fileEntry *fe, long_ad *extents, uint32_t capacity, uint32_t aedBlocks);
 void	readVATtable();
 void	writeVATtable();
 